@@ -0,0 +1,60 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Defines the reference counts shared across threads by the public types of
+// the invalidation client library, with the atomic operations of the
+// compiler.
+
+#ifndef IPC_INVALIDATION_PUBLIC_INCLUDE_ATOMIC_REF_COUNT_H_
+#define IPC_INVALIDATION_PUBLIC_INCLUDE_ATOMIC_REF_COUNT_H_
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace invalidation {
+
+#if defined(_MSC_VER)
+
+typedef long AtomicRefCount;  // NOLINT
+
+/* Adds a reference to *ref_count. */
+inline void AtomicRefCountIncrement(volatile AtomicRefCount* ref_count) {
+  _InterlockedIncrement(ref_count);
+}
+
+/* Drops a reference from *ref_count. Returns whether any are left. */
+inline bool AtomicRefCountDecrement(volatile AtomicRefCount* ref_count) {
+  return _InterlockedDecrement(ref_count) != 0;
+}
+
+#else
+
+typedef int AtomicRefCount;
+
+/* Adds a reference to *ref_count. */
+inline void AtomicRefCountIncrement(volatile AtomicRefCount* ref_count) {
+  __sync_add_and_fetch(ref_count, 1);
+}
+
+/* Drops a reference from *ref_count. Returns whether any are left. */
+inline bool AtomicRefCountDecrement(volatile AtomicRefCount* ref_count) {
+  return __sync_sub_and_fetch(ref_count, 1) != 0;
+}
+
+#endif
+
+}  // namespace invalidation
+
+#endif  // IPC_INVALIDATION_PUBLIC_INCLUDE_ATOMIC_REF_COUNT_H_
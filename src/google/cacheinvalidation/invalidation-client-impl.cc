@@ -14,6 +14,7 @@
 
 #include "google/cacheinvalidation/invalidation-client-impl.h"
 
+#include <algorithm>
 #include <sstream>
 #include <string>
 
@@ -27,6 +28,8 @@ namespace invalidation {
 namespace {
 
 using INVALIDATION_STL_NAMESPACE::hex;
+using INVALIDATION_STL_NAMESPACE::max;
+using INVALIDATION_STL_NAMESPACE::min;
 using INVALIDATION_STL_NAMESPACE::ostringstream;
 
 // Used by HandleNewSession().
@@ -39,6 +42,16 @@ string EscapeChars(const string& str) {
   return oss.str();
 }
 
+// Used by GetNextCheckTime().  If deadline is after now and before any
+// deadline already in *earliest, stores it there.
+void UpdateEarliestDeadline(Time deadline, Time now, bool* has_earliest,
+                            Time* earliest) {
+  if ((deadline > now) && (!*has_earliest || (deadline < *earliest))) {
+    *has_earliest = true;
+    *earliest = deadline;
+  }
+}
+
 }  // namespace
 
 using INVALIDATION_STL_NAMESPACE::string;
@@ -77,14 +90,19 @@ InvalidationClientImpl::InvalidationClientImpl(
     config_(config),
     network_manager_(ALLOW_THIS_IN_INITIALIZER_LIST(this),
                      resources, client_info, config),
-    persistence_manager_(resources_),
+    persistence_manager_(resources_, config.coalesce_state_writes),
     awaiting_seqno_writeback_(false),
+    prefetch_seqno_limit_(0),
     is_started_(false),
+    has_scheduled_check_(false),
     random_(resources->current_time().ToInternalValue()) {
 }
 
 void InvalidationClientImpl::Start(const string& serialized_state) {
-  CHECK(!is_started_) << "client already started";
+  {
+    MutexLock m(&operations_lock_);
+    CHECK(!is_started_) << "client already started";
+  }
 
   // Initialize the registration and session managers from persisted state if
   // present.
@@ -142,8 +160,13 @@ void InvalidationClientImpl::Start(const string& serialized_state) {
     registration_manager_->UpdateMaximumSeqno(config_.seqno_block_size);
   }
 
-  resources_->ScheduleImmediately(
-      NewPermanentCallback(this, &InvalidationClientImpl::PeriodicTask));
+  if (config_.event_driven) {
+    ScheduleCheck();
+  } else {
+    resources_->ScheduleImmediately(
+        NewPermanentCallback(this, &InvalidationClientImpl::PeriodicTask));
+  }
+  MutexLock m(&operations_lock_);
   is_started_ = true;
 }
 
@@ -184,10 +207,80 @@ void InvalidationClientImpl::HandleSeqnoWritebackResult(
     // retrying the write.
     ForgetClientId();
   }
+  ScheduleCheck();
+}
+
+void InvalidationClientImpl::MaybePrefetchSequenceNumbers() {
+  const string& uniquifier = session_manager_->client_uniquifier();
+  if ((prefetch_seqno_limit_ != 0) || uniquifier.empty() ||
+      (config_.seqno_prefetch_threshold <= 0.0)) {
+    // Either a reservation is already in progress, or we have no client id
+    // under which to persist one (a fresh client id starts with a new block
+    // anyway), or prefetching is disabled.
+    return;
+  }
+  int64 maximum_op_seqno_inclusive =
+      registration_manager_->maximum_op_seqno_inclusive();
+  int64 num_unused_seqnos =
+      maximum_op_seqno_inclusive - registration_manager_->current_op_seqno() + 1;
+  if (num_unused_seqnos >
+      config_.seqno_prefetch_threshold * config_.seqno_block_size) {
+    return;
+  }
+  // Reserve the next block while the current one is still in use, so that
+  // registrations never wait for the write to complete.
+  prefetch_seqno_limit_ = maximum_op_seqno_inclusive + config_.seqno_block_size;
+  TLOG(INFO_LEVEL, "%d seqnos left; reserving up to %lld",
+       static_cast<int>(num_unused_seqnos), prefetch_seqno_limit_);
+  TiclState state;
+  state.set_uniquifier(uniquifier);
+  state.set_session_token(session_manager_->session_token());
+  state.set_sequence_number_limit(prefetch_seqno_limit_);
+  string serialized;
+  SerializeState(state, &serialized);
+  persistence_manager_.WriteState(
+      serialized,
+      NewPermanentCallback(
+          this,
+          &InvalidationClientImpl::HandleSeqnoPrefetchResult,
+          prefetch_seqno_limit_,
+          uniquifier));
+}
+
+void InvalidationClientImpl::HandleSeqnoPrefetchResult(
+    int64 maximum_op_seqno_inclusive, const string& uniquifier, bool success) {
+  MutexLock m(&lock_);
+
+  TLOG(INFO_LEVEL, "seqno prefetch returned %d", success);
+  if ((prefetch_seqno_limit_ != maximum_op_seqno_inclusive) ||
+      (session_manager_->client_uniquifier() != uniquifier)) {
+    // The client id was forgotten while the write was in progress, so the
+    // reserved block no longer applies.
+    ScheduleCheck();
+    return;
+  }
+  prefetch_seqno_limit_ = 0;
+  if (success && (maximum_op_seqno_inclusive >
+                  registration_manager_->maximum_op_seqno_inclusive())) {
+    registration_manager_->UpdateMaximumSeqno(maximum_op_seqno_inclusive);
+  }
+  // On failure, the next periodic check retries the reservation.  Until the
+  // current block runs out, nothing else needs to happen.  In event-driven
+  // mode, the retry waits for the periodic interval rather than running right
+  // away, so that a failing storage isn't written to in a loop.
+  if (success) {
+    ScheduleCheck();
+  } else if (config_.event_driven) {
+    ScheduleCheckAt(resources_->current_time() +
+                    config_.periodic_task_interval);
+  }
 }
 
 void InvalidationClientImpl::HandleBestEffortWrite(bool result) {
   TLOG(INFO_LEVEL, "Write completed with result: %d", result);
+  // Issue the next queued write, if any.
+  MutexLock m(&lock_);
+  ScheduleCheck();
 }
 
 void InvalidationClientImpl::PeriodicTask() {
@@ -206,6 +299,11 @@ void InvalidationClientImpl::PeriodicTask() {
           smeared_delay,
           NewPermanentCallback(this, &InvalidationClientImpl::PeriodicTask)));
 
+  CheckState();
+}
+
+void InvalidationClientImpl::CheckState() {
+  ApplyPendingOperations();
   persistence_manager_.DoPeriodicCheck();
   if (awaiting_seqno_writeback_) {
     TLOG(INFO_LEVEL, "Skipping periodic check while awaiting local write");
@@ -221,6 +319,10 @@ void InvalidationClientImpl::PeriodicTask() {
     ForgetClientId();
   }
 
+  // Reserve the next block of sequence numbers ahead of time if the current
+  // one is running low.
+  MaybePrefetchSequenceNumbers();
+
   // Check for session data to send.
   bool have_session_data = session_manager_->HasDataToSend();
 
@@ -242,26 +344,128 @@ void InvalidationClientImpl::PeriodicTask() {
   }
 }
 
+void InvalidationClientImpl::ScheduleCheck() {
+  if (config_.event_driven) {
+    ScheduleCheckAt(resources_->current_time());
+  }
+}
+
+void InvalidationClientImpl::ScheduleCheckAt(Time check_time) {
+  if (has_scheduled_check_ && (scheduled_check_time_ <= check_time)) {
+    // The scheduled check will run in time, and schedule the next one.
+    return;
+  }
+  // A check scheduled for later is superseded, and will do nothing when it
+  // runs, since the scheduler offers no way to cancel it.
+  has_scheduled_check_ = true;
+  scheduled_check_time_ = check_time;
+  Closure* task = NewPermanentCallback(
+      this, &InvalidationClientImpl::HandleScheduledCheck, check_time);
+  Time now = resources_->current_time();
+  if (check_time <= now) {
+    resources_->ScheduleImmediately(task);
+  } else {
+    resources_->ScheduleWithDelay(check_time - now, task);
+  }
+}
+
+void InvalidationClientImpl::HandleScheduledCheck(Time check_time) {
+  MutexLock m(&lock_);
+  if (!has_scheduled_check_ || (scheduled_check_time_ != check_time)) {
+    return;
+  }
+  has_scheduled_check_ = false;
+  CheckState();
+  Time next_check_time;
+  if (GetNextCheckTime(&next_check_time)) {
+    ScheduleCheckAt(next_check_time);
+  }
+}
+
+bool InvalidationClientImpl::GetNextCheckTime(Time* deadline) {
+  if (awaiting_seqno_writeback_) {
+    // Nothing happens until the write completes, which schedules a check.
+    return false;
+  }
+  // Deadlines that have passed were acted on by the check that just ran.  If
+  // what they allow is still blocked (e.g., a heartbeat by the throttle or by
+  // the application not pulling a message), whatever unblocks it schedules a
+  // check or signals the network listener itself.
+  Time now = resources_->current_time();
+  bool has_deadline = false;
+  if (!session_manager_->HasSession()) {
+    UpdateEarliestDeadline(session_manager_->GetNextSendTime(), now,
+                           &has_deadline, deadline);
+  } else {
+    UpdateEarliestDeadline(network_manager_.next_heartbeat_time(), now,
+                           &has_deadline, deadline);
+  }
+  Time registration_deadline;
+  if (registration_manager_->GetNextCheckTime(&registration_deadline)) {
+    UpdateEarliestDeadline(registration_deadline, now, &has_deadline,
+                           deadline);
+  }
+  return has_deadline;
+}
+
 void InvalidationClientImpl::Register(const ObjectId& oid) {
   CHECK(!resources_->IsRunningOnInternalThread());
-  MutexLock m(&lock_);
   EnsureStarted();
   TLOG(INFO_LEVEL, "Received register for %d/%s", oid.source(),
        oid.name().c_str());
-  ObjectIdP object_id;
-  ConvertToObjectIdProto(oid, &object_id);
-  registration_manager_->Register(object_id);
+  EnqueueOperation(oid, true);
 }
 
 void InvalidationClientImpl::Unregister(const ObjectId& oid) {
   CHECK(!resources_->IsRunningOnInternalThread());
-  MutexLock m(&lock_);
   EnsureStarted();
   TLOG(INFO_LEVEL, "Received unregister for %d/%s", oid.source(),
        oid.name().c_str());
-  ObjectIdP object_id;
-  ConvertToObjectIdProto(oid, &object_id);
-  registration_manager_->Unregister(object_id);
+  EnqueueOperation(oid, false);
+}
+
+void InvalidationClientImpl::EnqueueOperation(const ObjectId& oid,
+                                              bool is_register) {
+  PendingOperation operation;
+  ConvertToObjectIdProto(oid, &operation.object_id);
+  operation.is_register = is_register;
+  bool was_empty;
+  {
+    MutexLock m(&operations_lock_);
+    was_empty = pending_operations_.empty();
+    pending_operations_.push_back(operation);
+  }
+  // If operations were already queued, a task to apply them is scheduled, or
+  // they're being applied and this one will be too.
+  if (was_empty) {
+    resources_->ScheduleImmediately(
+        NewPermanentCallback(
+            this, &InvalidationClientImpl::HandlePendingOperations));
+  }
+}
+
+void InvalidationClientImpl::HandlePendingOperations() {
+  MutexLock m(&lock_);
+  ApplyPendingOperations();
+}
+
+void InvalidationClientImpl::ApplyPendingOperations() {
+  vector<PendingOperation> operations;
+  {
+    MutexLock m(&operations_lock_);
+    operations.swap(pending_operations_);
+  }
+  if (operations.empty()) {
+    return;
+  }
+  for (size_t i = 0; i < operations.size(); ++i) {
+    if (operations[i].is_register) {
+      registration_manager_->Register(operations[i].object_id);
+    } else {
+      registration_manager_->Unregister(operations[i].object_id);
+    }
+  }
+  ScheduleCheck();
 }
 
 void InvalidationClientImpl::PermanentShutdown() {
@@ -284,11 +488,48 @@ void InvalidationClientImpl::HandleNewSession() {
 
   registration_manager_->HandleNewSession();
   network_manager_.RecordImplicitHeartbeat();
+  WriteSessionState();
+
+  // Tell the listener we acquired a session and that its registrations were
+  // removed.
+  resources_->ScheduleOnListenerThread(
+      NewPermanentCallback(
+          listener_,
+          &InvalidationListener::SessionStatusChanged,
+          true));
+}
+
+void InvalidationClientImpl::HandleResumedSession() {
+  if (!registration_manager_->HandleResumedSession()) {
+    // We had nothing to resume (e.g., the application changed registrations
+    // while we had no session), so treat it as any new session.
+    TLOG(INFO_LEVEL, "No registrations to resume; handling as new session");
+    HandleNewSession();
+    return;
+  }
+  TLOG(INFO_LEVEL, "Resumed session with registrations intact");
+  network_manager_.RecordImplicitHeartbeat();
+  WriteSessionState();
+
+  // Tell the listener we acquired a session.  Its registrations were kept, so
+  // it doesn't need to reissue them.
+  resources_->ScheduleOnListenerThread(
+      NewPermanentCallback(
+          listener_,
+          &InvalidationListener::SessionStatusChanged,
+          true));
+}
+
+void InvalidationClientImpl::WriteSessionState() {
+  const string& uniquifier = session_manager_->client_uniquifier();
   TiclState state;
   state.set_uniquifier(uniquifier);
   state.set_session_token(session_manager_->session_token());
+  // If a reservation of the next block is in progress, persist its limit
+  // rather than the current one, so this write can't undo it.
   state.set_sequence_number_limit(
-      registration_manager_->maximum_op_seqno_inclusive());
+      max(registration_manager_->maximum_op_seqno_inclusive(),
+          prefetch_seqno_limit_));
 
   string serialized;
   SerializeState(state, &serialized);
@@ -297,14 +538,6 @@ void InvalidationClientImpl::HandleNewSession() {
       NewPermanentCallback(
           this,
           &InvalidationClientImpl::HandleBestEffortWrite));
-
-  // Tell the listener we acquired a session and that its registrations were
-  // removed.
-  resources_->ScheduleOnListenerThread(
-      NewPermanentCallback(
-          listener_,
-          &InvalidationListener::SessionStatusChanged,
-          true));
 }
 
 void InvalidationClientImpl::HandleLostSession() {
@@ -329,6 +562,8 @@ void InvalidationClientImpl::HandleInboundMessage(const string& message) {
   CHECK(!resources_->IsRunningOnInternalThread());
   MutexLock m(&lock_);
   EnsureStarted();
+  // Registrations requested before the message arrived precede its results.
+  ApplyPendingOperations();
 
   if (awaiting_seqno_writeback_) {
     // If the initial write back to allocate sequence numbers hasn't returned,
@@ -337,6 +572,9 @@ void InvalidationClientImpl::HandleInboundMessage(const string& message) {
     TLOG(INFO_LEVEL, "Dropping inbound message since seqno write in-progress");
     return;
   }
+  // Whatever the message changes is seen by the check, which runs after this
+  // method releases the lock.
+  ScheduleCheck();
 
   ServerToClientMessage bundle;
   bundle.ParseFromString(message);
@@ -351,6 +589,9 @@ void InvalidationClientImpl::HandleInboundMessage(const string& message) {
     case ACQUIRE_SESSION:
       HandleNewSession();
       break;
+    case RESUME_SESSION:
+      HandleResumedSession();
+      break;
     case LOSE_CLIENT_ID:
       ForgetClientId();
       break;
@@ -399,11 +640,27 @@ void InvalidationClientImpl::AcknowledgeInvalidation(
     const InvalidationP& invalidation) {
 
   MutexLock m(&lock_);
-  if (invalidation.version() !=
+  if (invalidation.version() ==
       static_cast<uint64>(InvalidationListener::UNKNOWN_OBJECT_VERSION)) {
+    return;
+  }
+  // Acking a version of an object tells the server that all its earlier
+  // versions were seen too, so only the newest ack per object is kept.
+  string object_key;
+  invalidation.object_id().SerializeToString(&object_key);
+  map<string, size_t>::iterator position =
+      pending_ack_positions_.find(object_key);
+  if (position == pending_ack_positions_.end()) {
+    pending_ack_positions_[object_key] = pending_invalidation_acks_.size();
     pending_invalidation_acks_.push_back(invalidation);
-    network_manager_.OutboundDataReady();
+  } else {
+    ++outbound_message_stats_.num_redundant_acks;
+    InvalidationP* pending_ack = &pending_invalidation_acks_[position->second];
+    if (pending_ack->version() < invalidation.version()) {
+      pending_ack->CopyFrom(invalidation);
+    }
   }
+  network_manager_.OutboundDataReady();
 }
 
 void InvalidationClientImpl::ScheduleAcknowledgeInvalidation(
@@ -424,46 +681,79 @@ void InvalidationClientImpl::RegisterOutboundListener(
 
 void InvalidationClientImpl::TakeOutboundMessage(string* serialized) {
   CHECK(!resources_->IsRunningOnInternalThread());
-  MutexLock m(&lock_);
-  EnsureStarted();
-
   ClientToServerMessage message;
+  {
+    MutexLock m(&lock_);
+    EnsureStarted();
+    ApplyPendingOperations();
+    BuildOutboundMessage(&message);
+  }
+  // The message is a copy of the state it was built from, so it's serialized
+  // without holding the lock.
+  message.SerializeToString(serialized);
+}
 
+void InvalidationClientImpl::BuildOutboundMessage(
+    ClientToServerMessage* message) {
   // If PermanentShutdown() has been called, the session manager will return a
   // message of TYPE_SHUTDOWN.
-  session_manager_->AddSessionAction(&message);
+  session_manager_->AddSessionAction(message);
+
+  // If the session manager offers to resume the lost session, provide the
+  // digest of the registrations to resume, or withdraw the offer if they can't
+  // be.
+  if (message->has_last_session_token()) {
+    string digest;
+    if (registration_manager_->GetResumableRegistrationDigest(&digest)) {
+      message->set_registration_digest(digest);
+    } else {
+      message->clear_last_session_token();
+    }
+  }
+
+  // Invalidation acks get the first claim on the max_ops_per_message
+  // operations of an OBJECT_CONTROL message, since the server holds the
+  // invalidations until they're acked.  Registrations get what's left, retries
+  // last (see RegistrationInfoStore::TakeData()).  A heartbeat takes no
+  // operation, so it's attached whenever it's due.
+  int num_acks = min(static_cast<int>(pending_invalidation_acks_.size()),
+                     config_.max_ops_per_message);
+  int max_registrations = min(config_.max_registrations_per_message,
+                              config_.max_ops_per_message - num_acks);
 
   // If the session manager didn't set a message type, then we can let the
   // registration manager add fields and set a message type.
-  if (!message.has_message_type()) {
-    registration_manager_->AddOutboundData(&message);
+  if (!message->has_message_type()) {
+    registration_manager_->AddOutboundData(message, max_registrations);
   } else {
     TLOG(INFO_LEVEL, "message had type %d, not giving to reg manager",
-         message.message_type());
+         message->message_type());
   }
   // At this point, the message must have a type set.
-  CHECK(message.has_message_type());
+  CHECK(message->has_message_type());
 
   // If the registration manager is sending an OBJECT_CONTROL message, we can
   // let the network manager try to attach a heartbeat to it if needed, and we
   // can send invalidation acks.
-  if (message.message_type() ==
+  if (message->message_type() ==
       ClientToServerMessage_MessageType_TYPE_OBJECT_CONTROL) {
-    network_manager_.AddHeartbeat(&message);
+    network_manager_.AddHeartbeat(message);
 
-    // Add up to maxRegistrationsPerMessage registrations.
-    int invalidation_acks_sent = 0;
-    int registration_count = message.register_operation_size();
+    int registration_count = message->register_operation_size();
+    ++outbound_message_stats_.num_messages;
+    if (registration_count + num_acks == config_.max_ops_per_message) {
+      ++outbound_message_stats_.num_messages_at_ops_cap;
+    }
+    if (registration_count == config_.max_registrations_per_message) {
+      ++outbound_message_stats_.num_messages_at_registrations_cap;
+    }
 
-    // Add any outbound invalidations, up to max_ops_per_message. We ack the
-    // newest invalidations first (since we pop from the array), which is good,
+    // Add the outbound invalidations counted above. We ack the newest
+    // invalidations first (since we pop from the array), which is good,
     // because an invalidation for a newer version of an object subsumes an
     // older invalidation.
-    while (!pending_invalidation_acks_.empty() &&
-           (registration_count + invalidation_acks_sent <
-            config_.max_ops_per_message)) {
-      ++invalidation_acks_sent;
-      InvalidationP* inv = message.add_acked_invalidation();
+    for (int i = 0; i < num_acks; ++i) {
+      InvalidationP* inv = message->add_acked_invalidation();
       inv->CopyFrom(pending_invalidation_acks_.back());
       // If the invalidation contains a component stamp log, add a client stamp.
       if (inv->has_component_stamp_log()) {
@@ -474,14 +764,18 @@ void InvalidationClientImpl::TakeOutboundMessage(string* serialized) {
         stamp->set_time(resources_->current_time().ToInternalValue() /
                         Time::kMicrosecondsPerMillisecond);
       }
+      string object_key;
+      inv->object_id().SerializeToString(&object_key);
+      pending_ack_positions_.erase(object_key);
       pending_invalidation_acks_.pop_back();
     }
   }
   // Regardless, we'll let the network manager add a message id and signal data
   // to send.
-  network_manager_.FinalizeOutboundMessage(&message);
-  CHECK(message.has_client_type());
-  message.SerializeToString(serialized);
+  network_manager_.FinalizeOutboundMessage(message);
+  CHECK(message->has_client_type());
+  // Sending the message starts timeouts and may leave more data to send.
+  ScheduleCheck();
 }
 
 TimeDelta InvalidationClientImpl::SmearDelay(
@@ -502,9 +796,12 @@ void InvalidationClientImpl::ForgetClientId() {
   // Inform the registration and session managers about the lost client id.
   registration_manager_->HandleLostClientId();
   session_manager_->DoLoseClientId();
+  // Any block of sequence numbers being reserved belongs to the old client id.
+  prefetch_seqno_limit_ = 0;
 }
 
 void InvalidationClientImpl::EnsureStarted() {
+  MutexLock m(&operations_lock_);
   CHECK(is_started_) << "client not started";
 }
 
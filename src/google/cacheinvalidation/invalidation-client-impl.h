@@ -37,6 +37,31 @@ namespace invalidation {
 using INVALIDATION_STL_NAMESPACE::map;
 using INVALIDATION_STL_NAMESPACE::vector;
 
+/* Counts of how full the OBJECT_CONTROL messages built by the Ticl were. */
+struct OutboundMessageStats {
+  OutboundMessageStats()
+      : num_messages(0),
+        num_messages_at_ops_cap(0),
+        num_messages_at_registrations_cap(0),
+        num_redundant_acks(0) {}
+
+  /* The number of OBJECT_CONTROL messages built. */
+  int64 num_messages;
+
+  /* The number of them whose invalidation acks and registrations filled
+   * max_ops_per_message.
+   */
+  int64 num_messages_at_ops_cap;
+
+  /* The number of them with max_registrations_per_message registrations. */
+  int64 num_messages_at_registrations_cap;
+
+  /* The number of invalidation acks dropped because an ack for the same or a
+   * newer version of the object was already waiting to be sent.
+   */
+  int64 num_redundant_acks;
+};
+
 /**
  * Implementation of the Invalidation Client Library (Ticl).
  */
@@ -77,6 +102,12 @@ class InvalidationClientImpl : public InvalidationClient, NetworkEndpoint {
     *uniquifier = session_manager_->client_uniquifier();
   }
 
+  /* Stores the counts of how full the outbound messages were in *stats. */
+  void GetOutboundMessageStats(OutboundMessageStats* stats) {
+    MutexLock m(&lock_);
+    *stats = outbound_message_stats_;
+  }
+
   // Inherited from NetworkEndpoint:
 
   virtual void TakeOutboundMessage(string* message);
@@ -124,17 +155,98 @@ class InvalidationClientImpl : public InvalidationClient, NetworkEndpoint {
    */
   void HandleSeqnoWritebackResult(int64 maximum_op_seqno, bool success);
 
+  /* If the unused sequence numbers have fallen to
+   * config_.seqno_prefetch_threshold of a block, persists a state blob that
+   * reserves the next block, without blocking any registrations.  Does nothing
+   * if such a write is already in progress.
+   */
+  void MaybePrefetchSequenceNumbers();
+
+  /* Handles the result of a write issued by MaybePrefetchSequenceNumbers() on
+   * behalf of the client with the given uniquifier.  If 'success' is true and
+   * the client still has that uniquifier, raises the registration manager's
+   * maximum sequence number to 'maximum_op_seqno'; otherwise, the write will be
+   * retried from the periodic task.
+   */
+  void HandleSeqnoPrefetchResult(int64 maximum_op_seqno,
+                                 const string& uniquifier, bool success);
+
+  /* Queues an (un)registration of oid for the internal thread to apply, and
+   * if none was queued, schedules a task to apply it.  Takes only
+   * operations_lock_, so the application never waits for lock_, which is held
+   * while messages are built and processed.
+   */
+  void EnqueueOperation(const ObjectId& oid, bool is_register);
+
+  /* Task that applies the queued (un)registrations. */
+  void HandlePendingOperations();
+
+  /* Applies the queued (un)registrations to the registration manager, in the
+   * order in which they were requested.  Called before anything that uses the
+   * registration manager, so that it sees the operations as if they had been
+   * applied when they were requested.
+   * REQUIRES: lock_ is held.
+   */
+  void ApplyPendingOperations();
+
   /* Handles the result of a write performed on receipt of a new session.  This
    * write is best-effort, so 'success' is only used for logging.
    */
   void HandleBestEffortWrite(bool success);
 
-  /* Checks for messages that need to be sent, operations to time out, etc. */
+  /* Checks for messages that need to be sent, operations to time out, etc.
+   * REQUIRES: lock_ is held.
+   */
+  void CheckState();
+
+  /* Runs CheckState() and reschedules itself to run again after a smeared
+   * config_.periodic_task_interval.  Used unless config_.event_driven is set.
+   */
   void PeriodicTask();
 
+  /* If config_.event_driven is set, arranges for CheckState() to run as soon
+   * as possible, after a change that may have given the client something to
+   * do or changed its deadlines.  Otherwise, does nothing, since the periodic
+   * task will run it.
+   */
+  void ScheduleCheck();
+
+  /* Arranges for CheckState() to run at the given time, unless a run is
+   * already scheduled no later than that.
+   */
+  void ScheduleCheckAt(Time check_time);
+
+  /* Runs the check scheduled for check_time, unless it was superseded by an
+   * earlier one, and schedules the next check at the earliest deadline of the
+   * client, if it has any.
+   */
+  void HandleScheduledCheck(Time check_time);
+
+  /* Returns whether the client has a deadline after the current time at which
+   * CheckState() may find something to do, and if so, stores the earliest one
+   * in *deadline.
+   */
+  bool GetNextCheckTime(Time* deadline);
+
+  /* Fills in the next message to send to the server.
+   * REQUIRES: lock_ is held.
+   */
+  void BuildOutboundMessage(ClientToServerMessage* message);
+
   /* Handles a response from the server that involves getting a new session. */
   void HandleNewSession();
 
+  /* Handles a new session in which the server resumed the lost one, keeping
+   * the registrations.  Falls back to HandleNewSession() if the client has no
+   * registrations to resume.
+   */
+  void HandleResumedSession();
+
+  /* Persists the client id and session token, along with the sequence number
+   * limit, on a best-effort basis.
+   */
+  void WriteSessionState();
+
   /* Handles a lost-session event. */
   void HandleLostSession();
 
@@ -159,7 +271,9 @@ class InvalidationClientImpl : public InvalidationClient, NetworkEndpoint {
   /* Forgets any client id and session the client may currently have. */
   void ForgetClientId();
 
-  /* Ensures that the client has been started. */
+  /* Ensures that the client has been started.  Takes operations_lock_, so it
+   * may be called with or without lock_.
+   */
   void EnsureStarted();
 
   /* Various system resources needed by the Ticl (storage, CPU, logging). */
@@ -189,9 +303,19 @@ class InvalidationClientImpl : public InvalidationClient, NetworkEndpoint {
   /* Wraps resources_->WriteState() to ensure sequential access. */
   PersistenceManager persistence_manager_;
 
-  /* Invalidation acknowledgments waiting to be delivered to the server. */
+  /* Invalidation acknowledgments waiting to be delivered to the server, at
+   * most one per object.  The newest are sent first, from the back.
+   */
   vector<InvalidationP> pending_invalidation_acks_;
 
+  /* Map from serialized object id to the position of its ack in
+   * pending_invalidation_acks_.
+   */
+  map<string, size_t> pending_ack_positions_;
+
+  /* Counts of how full the outbound messages were. */
+  OutboundMessageStats outbound_message_stats_;
+
   /* Whether we're waiting for the initial seqno write-back to complete.  While
    * this is true, the Ticl will not accept any messages from the server, and it
    * will not issue any registrations or inform the network listener that it has
@@ -199,12 +323,42 @@ class InvalidationClientImpl : public InvalidationClient, NetworkEndpoint {
    */
   bool awaiting_seqno_writeback_;
 
-  /* Whether the client has been started. */
+  /* The sequence number limit being persisted by a background reservation of
+   * the next block (see MaybePrefetchSequenceNumbers()), or 0 if there is none
+   * in progress.
+   */
+  int64 prefetch_seqno_limit_;
+
+  /* Whether the client has been started.  Protected by operations_lock_, since
+   * Register() and Unregister() check it without lock_.
+   */
   bool is_started_;
 
+  /* If config_.event_driven is set, whether a check is scheduled, and if so,
+   * the time at which it will run.
+   */
+  bool has_scheduled_check_;
+  Time scheduled_check_time_;
+
   /* Random number generator for smearing periodic intervals. */
   Random random_;
 
+  /* An (un)registration requested by the application and not yet applied. */
+  struct PendingOperation {
+    ObjectIdP object_id;
+    bool is_register;
+  };
+
+  /* Operations requested by the application and not yet applied, in the order
+   * in which they were requested.
+   */
+  vector<PendingOperation> pending_operations_;
+
+  /* Protects pending_operations_ and is_started_.  May be acquired while
+   * holding lock_, but not the other way around.
+   */
+  Mutex operations_lock_;
+
   /* A lock to protect this object's state. */
   Mutex lock_;
 };
@@ -276,6 +276,13 @@ class InvalidationClientImplTest : public testing::Test {
     EXPECT_CALL(*listener_, AllRegistrationsLost(_))
         .WillOnce(SaveArg<0>(&callback));
 
+    // The Ticl persists its new state by the next periodic check, or right
+    // away if it's event-driven.
+    StorageCallback* storage_callback = NULL;
+    EXPECT_CALL(*resources_, WriteState(_, _))
+        .WillOnce(DoAll(SaveArg<0>(&last_persisted_state_),
+                        SaveArg<1>(&storage_callback)));
+
     // Give the message to the Ticl, and let it handle it.
     ticl_->network_endpoint()->HandleInboundMessage(serialized);
     resources_->RunReadyTasks();
@@ -285,10 +292,6 @@ class InvalidationClientImplTest : public testing::Test {
     callback->Run();
     delete callback;
 
-    StorageCallback* storage_callback = NULL;
-    EXPECT_CALL(*resources_, WriteState(_, _))
-        .WillOnce(DoAll(SaveArg<0>(&last_persisted_state_),
-                        SaveArg<1>(&storage_callback)));
     resources_->ModifyTime(TimeDelta::FromSeconds(1));
     resources_->RunReadyTasks();
 
@@ -695,6 +698,46 @@ TEST_F(InvalidationClientImplTest, HeartbeatIntervalRespected) {
   ASSERT_TRUE(outbound_message_ready_);
 }
 
+TEST_F(InvalidationClientImplTest, EventDrivenIdleClientSleeps) {
+  /* Test plan: in event-driven mode, get a client id and session, and consume
+   * a message.  Let ten minutes pass in half-second steps, and check that the
+   * Ticl neither nudged the application to send nor ran more than a handful of
+   * tasks, where the periodic task would have run 1200 times.  Then advance
+   * past the default heartbeat interval, and check that the Ticl woke up to
+   * nudge the application.
+   */
+  ClientConfig ticl_config;
+  ticl_config.smear_factor = 0.0;  // Disable smearing for determinism.
+  ticl_config.event_driven = true;
+  ClientType client_type;
+  client_type.set_type(ClientType_Type_CHROME_SYNC);
+  ticl_.reset(new InvalidationClientImpl(
+      resources_.get(), client_type, APP_NAME, CLIENT_INFO, ticl_config,
+      listener_.get()));
+  TestInitialization();
+  string serialized;
+  ticl_->network_endpoint()->TakeOutboundMessage(&serialized);
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+  outbound_message_ready_ = false;
+
+  int64 num_tasks_run = resources_->num_tasks_run();
+  for (int i = 0; i < 1200; ++i) {
+    resources_->ModifyTime(TimeDelta::FromMilliseconds(500));
+    resources_->RunReadyTasks();
+  }
+  resources_->RunListenerTasks();
+  ASSERT_FALSE(outbound_message_ready_);
+  ASSERT_LT(resources_->num_tasks_run() - num_tasks_run, 5);
+
+  // The session was acquired a little over ten minutes ago, and the first
+  // heartbeat is due twenty minutes after that.
+  resources_->ModifyTime(TimeDelta::FromMinutes(10));
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+  ASSERT_TRUE(outbound_message_ready_);
+}
+
 TEST_F(InvalidationClientImplTest, Registration) {
   /* Test plan: get a client id and session.  Register for an object.  Check
    * that the Ticl sends an appropriate registration request.  Respond with a
@@ -857,6 +900,126 @@ TEST_F(InvalidationClientImplTest, InvalidationP) {
                       client_message.acked_invalidation(0).object_id()));
 }
 
+TEST_F(InvalidationClientImplTest, AcksPackedBeforeRegistrations) {
+  /* Test plan: with room for three operations per message, get a client id
+   * and session, deliver invalidations for two objects and ack them, and
+   * register for two other objects.  Check that the next message carries both
+   * acks and only one registration, and that it was counted as full.  Check
+   * that the message after it carries the other registration.
+   */
+  ClientConfig ticl_config;
+  ticl_config.smear_factor = 0.0;  // Disable smearing for determinism.
+  ticl_config.max_ops_per_message = 3;
+  ClientType client_type;
+  client_type.set_type(ClientType_Type_CHROME_SYNC);
+  ticl_.reset(new InvalidationClientImpl(
+      resources_.get(), client_type, APP_NAME, CLIENT_INFO, ticl_config,
+      listener_.get()));
+  TestInitialization();
+
+  // Deliver the invalidations, and ack them.
+  Closure* callback1 = NULL;
+  Closure* callback2 = NULL;
+  EXPECT_CALL(*listener_, Invalidate(_, _))
+      .WillOnce(SaveArg<1>(&callback1))
+      .WillOnce(SaveArg<1>(&callback2));
+  ServerToClientMessage message;
+  for (int i = 0; i < 2; ++i) {
+    InvalidationP* invalidation = message.add_invalidation();
+    invalidation->mutable_object_id()->set_source(ObjectIdP_Source_CHROME_SYNC);
+    invalidation->mutable_object_id()->mutable_name()->set_string_value(
+        i == 0 ? "acked-object-1" : "acked-object-2");
+    invalidation->set_version(InvalidationClientImplTest::VERSION);
+  }
+  message.set_session_token(session_token_);
+  message.mutable_status()->set_code(Status_Code_SUCCESS);
+  message.set_message_type(
+      ServerToClientMessage_MessageType_TYPE_OBJECT_CONTROL);
+  string serialized;
+  message.SerializeToString(&serialized);
+  ticl_->network_endpoint()->HandleInboundMessage(serialized);
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+  ASSERT_TRUE(callback2 != NULL);
+  callback1->Run();
+  delete callback1;
+  callback2->Run();
+  delete callback2;
+
+  // Register for the other objects.
+  ObjectId oid1;
+  ObjectId oid2;
+  ConvertFromObjectIdProto(object_id1_, &oid1);
+  ConvertFromObjectIdProto(object_id2_, &oid2);
+  ticl_->Register(oid1);
+  ticl_->Register(oid2);
+  resources_->ModifyTime(fine_throttle_interval_);
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+
+  ClientToServerMessage client_message;
+  ticl_->network_endpoint()->TakeOutboundMessage(&serialized);
+  client_message.ParseFromString(serialized);
+  ASSERT_EQ(2, client_message.acked_invalidation_size());
+  ASSERT_EQ(1, client_message.register_operation_size());
+  OutboundMessageStats stats;
+  ticl_->GetOutboundMessageStats(&stats);
+  ASSERT_EQ(1, stats.num_messages_at_ops_cap);
+
+  ticl_->network_endpoint()->TakeOutboundMessage(&serialized);
+  client_message.ParseFromString(serialized);
+  ASSERT_EQ(0, client_message.acked_invalidation_size());
+  ASSERT_EQ(1, client_message.register_operation_size());
+}
+
+TEST_F(InvalidationClientImplTest, RedundantAcksDropped) {
+  /* Test plan: get a client id and session, deliver invalidations of two
+   * versions of one object, and ack the newer one first.  Check that the Ticl
+   * sends a single ack, for the newer version, and counts the other as
+   * redundant.
+   */
+  TestInitialization();
+
+  Closure* callback1 = NULL;
+  Closure* callback2 = NULL;
+  EXPECT_CALL(*listener_, Invalidate(_, _))
+      .WillOnce(SaveArg<1>(&callback1))
+      .WillOnce(SaveArg<1>(&callback2));
+  ServerToClientMessage message;
+  for (int i = 0; i < 2; ++i) {
+    InvalidationP* invalidation = message.add_invalidation();
+    invalidation->mutable_object_id()->CopyFrom(object_id1_);
+    invalidation->set_version(InvalidationClientImplTest::VERSION + i);
+  }
+  message.set_session_token(session_token_);
+  message.mutable_status()->set_code(Status_Code_SUCCESS);
+  message.set_message_type(
+      ServerToClientMessage_MessageType_TYPE_OBJECT_CONTROL);
+  string serialized;
+  message.SerializeToString(&serialized);
+  ticl_->network_endpoint()->HandleInboundMessage(serialized);
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+  ASSERT_TRUE(callback2 != NULL);
+  callback2->Run();
+  delete callback2;
+  callback1->Run();
+  delete callback1;
+  resources_->ModifyTime(fine_throttle_interval_);
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+
+  ClientToServerMessage client_message;
+  ticl_->network_endpoint()->TakeOutboundMessage(&serialized);
+  client_message.ParseFromString(serialized);
+  ASSERT_EQ(1, client_message.acked_invalidation_size());
+  ASSERT_EQ(static_cast<uint64>(InvalidationClientImplTest::VERSION + 1),
+            client_message.acked_invalidation(0).version());
+  OutboundMessageStats stats;
+  ticl_->GetOutboundMessageStats(&stats);
+  ASSERT_EQ(1, stats.num_redundant_acks);
+}
+
 TEST_F(InvalidationClientImplTest, SessionSwitch) {
   /* Test plan: get client id and session.  Register for a couple of objects.
    * Send the Ticl an invalid-session message.  Check that the Ticl sends an
@@ -867,6 +1030,87 @@ TEST_F(InvalidationClientImplTest, SessionSwitch) {
   TestSessionSwitch();
 }
 
+TEST_F(InvalidationClientImplTest, SessionResumption) {
+  /* Test plan: with session resumption enabled, get client id and session and
+   * register for a couple of objects.  Send the Ticl an invalid-session
+   * message.  Check that its UpdateSession request offers to resume the old
+   * session, and respond with a new session token that resumes it.  Check
+   * that the registrations are kept, without AllRegistrationsLost (the
+   * listener is strict) or a registration sync.
+   */
+  ClientConfig ticl_config;
+  ticl_config.smear_factor = 0.0;  // Disable smearing for determinism.
+  ticl_config.resume_sessions = true;
+  ClientType client_type;
+  client_type.set_type(ClientType_Type_CHROME_SYNC);
+  ticl_.reset(new InvalidationClientImpl(
+      resources_.get(), client_type, APP_NAME, CLIENT_INFO, ticl_config,
+      listener_.get()));
+  TestRegistration(true);
+  string old_session_token = session_token_;
+
+  // Tell the Ticl its session is invalid.
+  EXPECT_CALL(*listener_, SessionStatusChanged(false));
+  outbound_message_ready_ = false;
+  ServerToClientMessage message;
+  message.set_session_token(session_token_);
+  message.mutable_status()->set_code(Status_Code_INVALID_SESSION);
+  message.set_message_type(
+      ServerToClientMessage_MessageType_TYPE_INVALIDATE_SESSION);
+  string serialized;
+  message.SerializeToString(&serialized);
+  ticl_->network_endpoint()->HandleInboundMessage(serialized);
+  resources_->ModifyTime(fine_throttle_interval_);
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+  ASSERT_TRUE(outbound_message_ready_);
+
+  // The session request should carry the old token and a registration digest.
+  ClientToServerMessage request;
+  ticl_->network_endpoint()->TakeOutboundMessage(&serialized);
+  request.ParseFromString(serialized);
+  ASSERT_EQ(ClientToServerMessage_Action_UPDATE_SESSION, request.action());
+  ASSERT_EQ(old_session_token, request.last_session_token());
+  ASSERT_TRUE(request.has_registration_digest());
+
+  // Resume the session.
+  EXPECT_CALL(*listener_, SessionStatusChanged(true));
+  session_token_ = "NEW_OPAQUE_DATA";
+  message.Clear();
+  message.set_client_uniquifier(client_uniquifier_);
+  message.set_session_token(session_token_);
+  message.set_session_resumed(true);
+  message.mutable_status()->set_code(Status_Code_SUCCESS);
+  message.set_message_type(
+      ServerToClientMessage_MessageType_TYPE_UPDATE_SESSION);
+  message.SerializeToString(&serialized);
+  ticl_->network_endpoint()->HandleInboundMessage(serialized);
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+
+  ASSERT_EQ(State_SYNCED, ticl_->GetRegistrationManagerStateForTest());
+  ASSERT_EQ(RegState_REGISTERED,
+            ticl_->GetRegistrationStateForTest(object_id1_));
+  ASSERT_EQ(RegState_REGISTERED,
+            ticl_->GetRegistrationStateForTest(object_id2_));
+
+  // The new session token is still persisted.
+  StorageCallback* storage_callback = NULL;
+  EXPECT_CALL(*resources_, WriteState(_, _))
+      .WillOnce(DoAll(SaveArg<0>(&last_persisted_state_),
+                      SaveArg<1>(&storage_callback)));
+  resources_->ModifyTime(TimeDelta::FromSeconds(1));
+  resources_->RunReadyTasks();
+  storage_callback->Run(true);
+  delete storage_callback;
+
+  // The next message is an object-control message, not a registration sync.
+  ticl_->network_endpoint()->TakeOutboundMessage(&serialized);
+  request.ParseFromString(serialized);
+  ASSERT_EQ(ClientToServerMessage_MessageType_TYPE_OBJECT_CONTROL,
+            request.message_type());
+}
+
 TEST_F(InvalidationClientImplTest, MismatchingInvalidSessionIgnored) {
   /* Test plan: get client id and session.  Register for a couple of objects.
    * Send the Ticl an invalid-session message with a mismatched session token.
@@ -1367,4 +1611,190 @@ TEST_F(InvalidationClientImplTest, Persistence) {
   resources_->RunListenerTasks();
 }
 
+TEST_F(InvalidationClientImplTest, SeqnoPrefetch) {
+  /* Test plan: restart a Ticl with a small block of sequence numbers and a
+   * prefetch threshold of a whole block.  Once the restart write-back
+   * completes, the Ticl should reserve the next block from the periodic task,
+   * while it keeps sending messages, and then stop reserving blocks.
+   */
+  const int64 kPersistedLimit = 100;
+  TiclState persisted_state;
+  persisted_state.set_uniquifier("uniquifier");
+  persisted_state.set_session_token(OPAQUE_DATA);
+  persisted_state.set_sequence_number_limit(kPersistedLimit);
+  string state;
+  SerializeState(persisted_state, &state);
+
+  ClientConfig ticl_config;
+  ticl_config.smear_factor = 0.0;  // Disable smearing for determinism.
+  ticl_config.seqno_block_size = 4;
+  ticl_config.seqno_prefetch_threshold = 1.0;
+  ClientType client_type;
+  client_type.set_type(ClientType_Type_CHROME_SYNC);
+
+  string new_state;
+  StorageCallback* storage_callback = NULL;
+  Closure* callback = NULL;
+
+  // On startup, the Ticl should write back the first block, as usual.
+  EXPECT_CALL(*listener_, AllRegistrationsLost(_))
+      .WillOnce(SaveArg<0>(&callback));
+  EXPECT_CALL(*listener_, SessionStatusChanged(true));
+  EXPECT_CALL(*resources_, WriteState(_, _))
+      .WillOnce(DoAll(SaveArg<0>(&new_state),
+                      SaveArg<1>(&storage_callback)));
+
+  ticl_.reset(new InvalidationClientImpl(
+      resources_.get(), client_type, APP_NAME, CLIENT_INFO, ticl_config,
+      listener_.get()));
+  ticl_->Start(state);
+  ticl_->network_endpoint()->RegisterOutboundListener(network_listener_.get());
+
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+
+  storage_callback->Run(true);
+  delete storage_callback;
+  callback->Run();
+  delete callback;
+
+  TiclState new_parsed_state;
+  DeserializeState(new_state, &new_parsed_state);
+  ASSERT_EQ(kPersistedLimit + ticl_config.seqno_block_size,
+            new_parsed_state.sequence_number_limit());
+
+  // All of the new block is unused, so the next periodic check should reserve
+  // the one after it (the persistence manager issues the write on the check
+  // after that), and still let the Ticl send its registration sync.
+  storage_callback = NULL;
+  EXPECT_CALL(*resources_, WriteState(_, _))
+      .WillOnce(DoAll(SaveArg<0>(&new_state),
+                      SaveArg<1>(&storage_callback)));
+  resources_->ModifyTime(TimeDelta::FromSeconds(1));
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+  ASSERT_TRUE(outbound_message_ready_);
+  resources_->ModifyTime(TimeDelta::FromSeconds(1));
+  resources_->RunReadyTasks();
+  ASSERT_TRUE(storage_callback != NULL);
+
+  DeserializeState(new_state, &new_parsed_state);
+  ASSERT_EQ(kPersistedLimit + 2 * ticl_config.seqno_block_size,
+            new_parsed_state.sequence_number_limit());
+  ASSERT_EQ("uniquifier", new_parsed_state.uniquifier());
+
+  // Once that write completes, more than a block is left, so the Ticl should
+  // not write again (the mock resources are strict).
+  storage_callback->Run(true);
+  delete storage_callback;
+  resources_->ModifyTime(TimeDelta::FromSeconds(1));
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+}
+
+TEST_F(InvalidationClientImplTest, RegistrationSyncRetriesIncompleteRanges) {
+  /* Test plan: restart a Ticl with two registration sync ranges.  Reply to its
+   * sync request with the totals of both ranges, but with the registrations
+   * of one range only.  When the request times out, the Ticl should ask
+   * again for the other range only.
+   */
+  TiclState persisted_state;
+  persisted_state.set_uniquifier("uniquifier");
+  persisted_state.set_session_token(OPAQUE_DATA);
+  persisted_state.set_sequence_number_limit(100);
+  string state;
+  SerializeState(persisted_state, &state);
+
+  ClientConfig ticl_config;
+  ticl_config.smear_factor = 0.0;  // Disable smearing for determinism.
+  ticl_config.num_registration_sync_ranges = 2;
+  ClientType client_type;
+  client_type.set_type(ClientType_Type_CHROME_SYNC);
+
+  StorageCallback* storage_callback = NULL;
+  Closure* callback = NULL;
+  EXPECT_CALL(*listener_, AllRegistrationsLost(_))
+      .WillOnce(SaveArg<0>(&callback));
+  EXPECT_CALL(*listener_, SessionStatusChanged(true));
+  EXPECT_CALL(*resources_, WriteState(_, _))
+      .WillOnce(SaveArg<1>(&storage_callback));
+
+  ticl_.reset(new InvalidationClientImpl(
+      resources_.get(), client_type, APP_NAME, CLIENT_INFO, ticl_config,
+      listener_.get()));
+  ticl_->Start(state);
+  ticl_->network_endpoint()->RegisterOutboundListener(network_listener_.get());
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+  storage_callback->Run(true);
+  delete storage_callback;
+  callback->Run();
+  delete callback;
+
+  // The Ticl should ask for the registrations of all the ranges.
+  outbound_message_ready_ = false;
+  resources_->ModifyTime(TimeDelta::FromSeconds(1));
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+  ASSERT_TRUE(outbound_message_ready_);
+  string serialized;
+  ticl_->network_endpoint()->TakeOutboundMessage(&serialized);
+  ClientToServerMessage message;
+  message.ParseFromString(serialized);
+  ASSERT_EQ(ClientToServerMessage_MessageType_TYPE_REGISTRATION_SYNC,
+            message.message_type());
+  ASSERT_EQ(2, static_cast<int>(message.num_sync_ranges()));
+  ASSERT_EQ(0, message.sync_range_size());
+
+  // Find the range of object_id1_: the hash of its source, in four big-endian
+  // bytes, and name, modulo the number of ranges.
+  string key;
+  uint32 source = static_cast<uint32>(object_id1_.source());
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    key.push_back(static_cast<char>((source >> shift) & 0xff));
+  }
+  key.append(object_id1_.name().string_value());
+  uint32 range1 = static_cast<uint32>(ObjectKeyHash::Fingerprint(key) % 2);
+  uint32 other_range = 1 - range1;
+
+  // Each range holds one registration, but only the one of object_id1_
+  // arrives.
+  ServerToClientMessage response;
+  response.set_session_token(OPAQUE_DATA);
+  response.set_message_type(
+      ServerToClientMessage_MessageType_TYPE_OBJECT_CONTROL);
+  response.set_num_total_registrations(2);
+  response.add_sync_range(range1);
+  response.add_sync_range_total(1);
+  response.add_sync_range(other_range);
+  response.add_sync_range_total(1);
+  RegistrationUpdateResult* result = response.add_registration_result();
+  result->mutable_operation()->mutable_object_id()->CopyFrom(object_id1_);
+  result->mutable_operation()->set_type(RegistrationUpdate_Type_REGISTER);
+  result->mutable_operation()->set_sequence_number(1);
+  result->mutable_status()->set_code(Status_Code_SUCCESS);
+  ObjectId oid1;
+  ConvertFromObjectIdProto(object_id1_, &oid1);
+  EXPECT_CALL(*listener_,
+              RegistrationStateChanged(
+                  ObjectIdEq(oid1), RegistrationState_REGISTERED, _));
+  response.SerializeToString(&serialized);
+  ticl_->network_endpoint()->HandleInboundMessage(serialized);
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+
+  // When the request times out, the Ticl should ask for the other range only.
+  outbound_message_ready_ = false;
+  resources_->ModifyTime(ticl_config.registration_sync_timeout);
+  resources_->RunReadyTasks();
+  resources_->RunListenerTasks();
+  ASSERT_TRUE(outbound_message_ready_);
+  ticl_->network_endpoint()->TakeOutboundMessage(&serialized);
+  message.ParseFromString(serialized);
+  ASSERT_EQ(ClientToServerMessage_MessageType_TYPE_REGISTRATION_SYNC,
+            message.message_type());
+  ASSERT_EQ(1, message.sync_range_size());
+  ASSERT_EQ(other_range, message.sync_range(0));
+}
+
 }  // namespace invalidation
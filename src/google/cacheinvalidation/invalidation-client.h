@@ -35,6 +35,7 @@ using INVALIDATION_STL_NAMESPACE::string;
 using INVALIDATION_STL_NAMESPACE::vector;
 
 class NetworkEndpoint;
+class RateBudget;
 
 typedef INVALIDATION_CALLBACK1_TYPE(NetworkEndpoint* const&) NetworkCallback;
 typedef INVALIDATION_CALLBACK1_TYPE(bool) StorageCallback;
@@ -287,8 +288,16 @@ static int kDefaultMaxRegistrationsPerMessage = 5;
 static int kDefaultMaxOpsPerMessage = 10;
 // Maximum number of attempts to perform a registration, by default.
 static int kDefaultMaxRegistrationAttempts = 3;
+// Number of ranges into which registrations are split for a registration sync,
+// by default.
+static int kDefaultNumRegistrationSyncRanges = 16;
+// Maximum number of requests to send for a registration sync, by default.
+static int kDefaultMaxRegistrationSyncAttempts = 5;
 // Number of sequence numbers to reserve when writing state, by default.
 static int kDefaultSeqnoBlockSize = 1024 * 1024;
+// Fraction of a block of sequence numbers that, when it is all that remains
+// unused, triggers the reservation of the next block, by default.
+static double kDefaultSeqnoPrefetchThreshold = 0.5;
 // Maximum factor by which to randomly increase or decrease an interval, by
 // default.
 static double kDefaultSmearFactor = 0.2;
@@ -303,8 +312,15 @@ struct ClientConfig {
         max_registration_attempts(kDefaultMaxRegistrationAttempts),
         periodic_task_interval(TimeDelta::FromMilliseconds(500)),
         registration_sync_timeout(TimeDelta::FromSeconds(60)),
+        num_registration_sync_ranges(kDefaultNumRegistrationSyncRanges),
+        max_registration_sync_attempts(kDefaultMaxRegistrationSyncAttempts),
         seqno_block_size(kDefaultSeqnoBlockSize),
-        smear_factor(kDefaultSmearFactor) {
+        seqno_prefetch_threshold(kDefaultSeqnoPrefetchThreshold),
+        smear_factor(kDefaultSmearFactor),
+        rate_budget(NULL),
+        coalesce_state_writes(false),
+        resume_sessions(false),
+        event_driven(false) {
     AddDefaultRateLimits();
   }
 
@@ -337,19 +353,58 @@ struct ClientConfig {
   // Maximum number of times to attempt a registration.
   int max_registration_attempts;
 
-  // The interval at which to execute the periodic task.
+  // The interval at which to execute the periodic task.  Unused if
+  // event_driven is set.
   TimeDelta periodic_task_interval;
 
-  // Timeout for registration sync operations.
+  // Timeout for registration sync operations.  With a server that reports
+  // per-range counts, this is the timeout of each request, after which the
+  // incomplete ranges are requested again.
   TimeDelta registration_sync_timeout;
 
+  // Number of ranges into which registrations are split for a registration
+  // sync (see ClientToServerMessage.num_sync_ranges).  Must be positive.
+  int num_registration_sync_ranges;
+
+  // Maximum number of requests to send for a registration sync before giving
+  // up on the incomplete ranges.
+  int max_registration_sync_attempts;
+
   // Number of sequence numbers to allocate per restart.
   int seqno_block_size;
 
+  // When no more than this fraction of seqno_block_size sequence numbers
+  // remains unused, the next block is reserved by a background write, so that
+  // registrations don't wait for storage when the current block runs out.  If
+  // 0, a new block is only reserved on restart.
+  double seqno_prefetch_threshold;
+
   // Smearing factor for scheduling. Delays will be smeared by +/- this
   // factor. E.g., if this value is 0.2 and a delay has base value 1, the
   // smeared value will be between 0.8 and 1.2.
   double smear_factor;
+
+  // If not NULL, a token-bucket budget (see RateBudget) to enforce instead of
+  // rate_limits. It may be shared by many clients, e.g., to keep all the
+  // clients in a process within one aggregate rate limit. Not owned.
+  RateBudget* rate_budget;
+
+  // Whether to collapse queued writes of the persistent state into one write
+  // of the latest state, issued as soon as the previous write completes (see
+  // PersistenceManager).
+  bool coalesce_state_writes;
+
+  // Whether, after losing its session, the client asks the server to resume it
+  // with the registrations it had, rather than resynchronizing them (see
+  // ClientToServerMessage.last_session_token).
+  bool resume_sessions;
+
+  // Whether the client checks for timeouts and data to send only when its
+  // state changes and when the earliest of its deadlines (registration, sync
+  // and session request timeouts, and heartbeats) passes, rather than every
+  // periodic_task_interval.  An idle client then wakes up only for its
+  // heartbeats.
+  bool event_driven;
 };
 
 // Allows an application to register and unregister for invalidations for
@@ -17,7 +17,6 @@
 #include <algorithm>
 
 #include "google/cacheinvalidation/callback.h"
-#include "google/cacheinvalidation/compiler-specific.h"
 #include "google/cacheinvalidation/invalidation-client-impl.h"
 #include "google/cacheinvalidation/log-macro.h"
 #include "google/cacheinvalidation/logging.h"
@@ -34,11 +33,6 @@ NetworkManager::NetworkManager(
     const string& client_info, const ClientConfig& config)
     : endpoint_(endpoint),
       resources_(resources),
-      // Set the throttler up with rate limits defined by the config.
-      throttle_(config.rate_limits, resources,
-                NewPermanentCallback(
-                    ALLOW_THIS_IN_INITIALIZER_LIST(this),
-                    &NetworkManager::DoInformOutboundListener)),
       has_outbound_data_(false),
       outbound_listener_(NULL),
       config_(config),
@@ -47,6 +41,16 @@ NetworkManager::NetworkManager(
       message_number_(0),
       random_(resources->current_time().ToInternalValue()),
       version_manager_(client_info) {
+  // Set the throttler up with rate limits defined by the config.
+  Closure* inform_outbound_listener = NewPermanentCallback(
+      this, &NetworkManager::DoInformOutboundListener);
+  if (config.rate_budget != NULL) {
+    throttle_.reset(new Throttle(config.rate_budget, resources,
+                                 inform_outbound_listener));
+  } else {
+    throttle_.reset(new Throttle(config.rate_limits, resources,
+                                 inform_outbound_listener));
+  }
 }
 
 void NetworkManager::OutboundDataReady() {
@@ -75,7 +79,7 @@ void NetworkManager::RegisterOutboundListener(
 }
 
 void NetworkManager::InformOutboundListener() {
-  throttle_.Fire();
+  throttle_->Fire();
 }
 
 void NetworkManager::DoInformOutboundListener() {
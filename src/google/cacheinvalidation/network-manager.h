@@ -20,6 +20,7 @@
 #include "google/cacheinvalidation/callback.h"
 #include "google/cacheinvalidation/invalidation-client.h"
 #include "google/cacheinvalidation/random.h"
+#include "google/cacheinvalidation/scoped_ptr.h"
 #include "google/cacheinvalidation/throttle.h"
 #include "google/cacheinvalidation/time.h"
 #include "google/cacheinvalidation/types.pb.h"
@@ -78,6 +79,11 @@ class NetworkManager {
     return NeedsHeartbeat();
   }
 
+  /* Returns the time at which the next heartbeat is due. */
+  Time next_heartbeat_time() const {
+    return next_heartbeat_;
+  }
+
   /* Indicates that the Ticl has data it's ready to send to the server.  If a
    * network listener has been registered and it hasn't been informed about
    * outbound data since it last pulled a message, let it know.
@@ -114,7 +120,7 @@ class NetworkManager {
   /* A rate-limiter for calls to inform the network listenr that we have data to
    * send.
    */
-  Throttle throttle_;
+  scoped_ptr<Throttle> throttle_;
 
   /* Whether or not we have useful data for the server. */
   bool has_outbound_data_;
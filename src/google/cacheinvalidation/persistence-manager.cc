@@ -25,25 +25,66 @@ PersistenceManager::~PersistenceManager() {
     pending_writes_.pop();
     delete pending_record.callback;
   }
+  for (size_t i = 0; i < in_progress_callbacks_.size(); ++i) {
+    delete in_progress_callbacks_[i];
+  }
 }
 
-void PersistenceManager::DoPeriodicCheck() {
-  // Check whether we have any pending writes to perform, and if we don't
-  // already have a write in progress, issue the first one.
-  if (!pending_writes_.empty() && !write_in_progress_) {
-    // Take the oldest pending record off the queue.
-    PendingRecord pending_record = pending_writes_.front();
-    TLOG(INFO_LEVEL, "Issuing write");
-    pending_writes_.pop();
+void PersistenceManager::WriteState(const string& state,
+                                    StorageCallback* callback) {
+  CHECK(IsCallbackRepeatable(callback));
+  {
+    MutexLock m(&lock_);
+    pending_writes_.push(PendingRecord(state, callback));
+  }
+  if (coalesce_writes_) {
+    MaybeIssueWrite();
+  }
+}
+
+void PersistenceManager::MaybeIssueWrite() {
+  string payload;
+  int num_states;
+  {
+    MutexLock m(&lock_);
+    // Check whether we have any pending writes to perform, and if we don't
+    // already have a write in progress, issue one.
+    if (pending_writes_.empty() || write_in_progress_) {
+      return;
+    }
+    // Take the oldest pending record off the queue or, when coalescing, all of
+    // them, keeping the payload of the newest.
+    do {
+      PendingRecord& pending_record = pending_writes_.front();
+      payload.swap(pending_record.payload);
+      in_progress_callbacks_.push_back(pending_record.callback);
+      pending_writes_.pop();
+    } while (coalesce_writes_ && !pending_writes_.empty());
     // Record that there's a write in progress.
     write_in_progress_ = true;
-    // Issue the write.
-    resources_->WriteState(
-        pending_record.payload,
-        NewPermanentCallback(
-            this,
-            &PersistenceManager::HandleWriteCompletion,
-            pending_record.callback));
+    num_states = static_cast<int>(in_progress_callbacks_.size());
+  }
+  TLOG(INFO_LEVEL, "Issuing write for %d queued states", num_states);
+  // Issue the write. This is done without holding the lock, in case the write
+  // completes right away.
+  resources_->WriteState(
+      payload,
+      NewPermanentCallback(this, &PersistenceManager::HandleWriteCompletion));
+}
+
+void PersistenceManager::HandleWriteCompletion(bool result) {
+  vector<StorageCallback*> callbacks;
+  {
+    MutexLock m(&lock_);
+    write_in_progress_ = false;
+    callbacks.swap(in_progress_callbacks_);
+  }
+  for (size_t i = 0; i < callbacks.size(); ++i) {
+    callbacks[i]->Run(result);
+    delete callbacks[i];
+  }
+  if (coalesce_writes_) {
+    MaybeIssueWrite();
   }
 }
 
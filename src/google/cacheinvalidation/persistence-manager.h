@@ -17,14 +17,17 @@
 
 #include <queue>
 #include <string>
+#include <vector>
 
 #include "google/cacheinvalidation/invalidation-client.h"
 #include "google/cacheinvalidation/logging.h"
+#include "google/cacheinvalidation/mutex.h"
 #include "google/cacheinvalidation/stl-namespace.h"
 
 namespace invalidation {
 
 using INVALIDATION_STL_NAMESPACE::queue;
+using INVALIDATION_STL_NAMESPACE::vector;
 
 // Contains the data and callback associated with a pending write.
 struct PendingRecord {
@@ -39,11 +42,26 @@ struct PendingRecord {
 };
 
 // Enforces sequential access to the persistent storage system.
+//
+// By default, queued writes are issued in order, one per call to
+// DoPeriodicCheck.  In coalescing mode, since each state blob supersedes the
+// ones before it, all the queued writes are instead collapsed into one write
+// of the latest blob, whose result is passed to all of their callbacks (in the
+// order in which they were queued), and the next write is issued as soon as
+// the previous one completes.
 class PersistenceManager {
  public:
   // Creates a persistence manager that wraps the given resources.
   explicit PersistenceManager(SystemResources* resources)
-      : write_in_progress_(false),
+      : coalesce_writes_(false),
+        write_in_progress_(false),
+        resources_(resources) {}
+
+  // Creates a persistence manager that wraps the given resources, coalescing
+  // the queued writes if coalesce_writes is true.
+  PersistenceManager(SystemResources* resources, bool coalesce_writes)
+      : coalesce_writes_(coalesce_writes),
+        write_in_progress_(false),
         resources_(resources) {}
 
   // Frees callbacks from queued writes.
@@ -52,28 +70,36 @@ class PersistenceManager {
   // Enqueues a write.  Takes ownership of callback.  callback is not
   // guaranteed to be called (e.g., if the PersistenceManager is
   // destroyed before the write completes).
-  void WriteState(const string& state, StorageCallback* callback) {
-    CHECK(IsCallbackRepeatable(callback));
-    pending_writes_.push(PendingRecord(state, callback));
-  }
+  // In coalescing mode, issues the write right away if there isn't one
+  // in progress.
+  void WriteState(const string& state, StorageCallback* callback);
 
   // Issues a write to the persistent store if there isn't already one in
   // progress.
-  void DoPeriodicCheck();
+  void DoPeriodicCheck() {
+    MaybeIssueWrite();
+  }
 
  private:
-  // Runs the callback with the given result, deletes it, and records that there
-  // is no longer a write in progress.
-  void HandleWriteCompletion(StorageCallback* callback, bool result) {
-    write_in_progress_ = false;
-    callback->Run(result);
-    delete callback;
-  }
+  // Issues the next write (or, in coalescing mode, the latest) if there isn't
+  // already one in progress.
+  void MaybeIssueWrite();
+
+  // Runs the callbacks of the completed write with the given result, deletes
+  // them, and records that there is no longer a write in progress.  In
+  // coalescing mode, then issues the next write.
+  void HandleWriteCompletion(bool result);
 
+  // Whether queued writes are collapsed into the latest one.
+  const bool coalesce_writes_;
+  // Protects the fields below, since writes complete on another thread.
+  Mutex lock_;
   // Writes that have been queued and not yet processed.
   queue<PendingRecord> pending_writes_;
   // Whether we have a write in progress or not.
   bool write_in_progress_;
+  // The callbacks of the write in progress.
+  vector<StorageCallback*> in_progress_callbacks_;
   // System resources that perform the actual writes.
   SystemResources* resources_;
 };
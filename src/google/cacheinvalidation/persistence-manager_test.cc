@@ -19,6 +19,7 @@
 #include "google/cacheinvalidation/googletest.h"
 #include "google/cacheinvalidation/scoped_ptr.h"
 #include "google/cacheinvalidation/persistence-manager.h"
+#include "google/cacheinvalidation/string_util.h"
 #include "google/cacheinvalidation/system-resources-for-test.h"
 
 namespace invalidation {
@@ -28,9 +29,21 @@ class MockStorageCallback {
   MOCK_METHOD1(StorageCallback, void(bool));
 };
 
+// System resources that record the states they are asked to write.
+class RecordingSystemResources : public SystemResourcesForTest {
+ public:
+  virtual void WriteState(const string& state, StorageCallback* callback) {
+    written_states_.push_back(state);
+    SystemResourcesForTest::WriteState(state, callback);
+  }
+
+  // The states that were written, in order.
+  vector<string> written_states_;
+};
+
 class PersistenceManagerTest : public testing::Test {
  protected:
-  SystemResourcesForTest resources_;
+  RecordingSystemResources resources_;
 
   MockStorageCallback mock_storage_callback_;
 
@@ -81,4 +94,28 @@ TEST_F(PersistenceManagerTest, WriteState) {
   }
 }
 
+TEST_F(PersistenceManagerTest, CoalesceWrites) {
+  /* Test plan: in coalescing mode, call WriteState() a few times.  The first
+   * call should be written right away, without waiting for
+   * DoPeriodicCheck(), and the others should be collapsed into one write of
+   * the latest state once it completes.  All the storage callbacks should be
+   * called.
+   */
+  persistence_manager_.reset(new PersistenceManager(&resources_, true));
+
+  const int kNumCalls = 4;
+  EXPECT_CALL(mock_storage_callback_, StorageCallback(true)).Times(kNumCalls);
+
+  for (int i = 0; i < kNumCalls; ++i) {
+    persistence_manager_->WriteState(StringPrintf("state-%d", i),
+                                     NewStorageCallback());
+  }
+  resources_.RunReadyTasks();
+
+  ASSERT_EQ(2U, resources_.written_states_.size());
+  EXPECT_EQ("state-0", resources_.written_states_[0]);
+  EXPECT_EQ(StringPrintf("state-%d", kNumCalls - 1),
+            resources_.written_states_[1]);
+}
+
 }  // namespace invalidation
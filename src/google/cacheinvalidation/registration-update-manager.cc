@@ -14,17 +14,37 @@
 
 #include "google/cacheinvalidation/registration-update-manager.h"
 
+#include <algorithm>
+
 #include "google/cacheinvalidation/callback.h"
 #include "google/cacheinvalidation/compiler-specific.h"
 #include "google/cacheinvalidation/invalidation-client.h"
 #include "google/cacheinvalidation/invalidation-client-impl.h"
 #include "google/cacheinvalidation/logging.h"
 #include "google/cacheinvalidation/log-macro.h"
+#include "google/cacheinvalidation/md5.h"
 #include "google/cacheinvalidation/proto-converter.h"
 #include "google/cacheinvalidation/scoped_ptr.h"
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::make_pair;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::sort;
+
+// Makes the given RegistrationStateChanged() calls on listener, in order, and
+// deletes them.
+static void DeliverStateChanges(InvalidationListener* listener,
+                                vector<StateChange>* state_changes) {
+  for (size_t i = 0; i < state_changes->size(); ++i) {
+    const StateChange& state_change = (*state_changes)[i];
+    listener->RegistrationStateChanged(state_change.object_id,
+                                       state_change.new_state,
+                                       state_change.unknown_hint);
+  }
+  delete state_changes;
+}
+
 // RegistrationInfo definitions.
 
 RegistrationInfo::RegistrationInfo(RegistrationUpdateManager* reg_manager,
@@ -32,7 +52,8 @@ RegistrationInfo::RegistrationInfo(RegistrationUpdateManager* reg_manager,
     : reg_manager_(reg_manager),
       resources_(reg_manager_->resources_),
       object_id_(object_id),
-      latest_known_server_state_(RegistrationUpdate_Type_UNREGISTER) {}
+      latest_known_server_state_(RegistrationUpdate_Type_UNREGISTER),
+      timed_out_(false) {}
 
 void RegistrationInfo::ProcessRegistrationUpdateResult(
     const RegistrationUpdateResult& result) {
@@ -51,6 +72,9 @@ void RegistrationInfo::ProcessRegistrationUpdateResult(
     return;
   }
 
+  // The server has answered for the object since any timeout.
+  timed_out_ = false;
+
   const Status& status = result.status();
   if (status.code() == Status_Code_SUCCESS) {
     bool matched_previous_state = (latest_known_server_state_ == op.type());
@@ -154,6 +178,7 @@ void RegistrationInfo::CheckTimeout(Time now, TimeDelta deadline) {
   InvokeStateChangedCallback(RegistrationState_UNKNOWN, unknown_hint);
   pending_state_.reset();
   send_time_.reset();
+  timed_out_ = true;
 }
 
 bool RegistrationInfo::HasDataToSend() {
@@ -180,15 +205,8 @@ void RegistrationInfo::TakeData(ClientToServerMessage* message, Time now) {
 
 void RegistrationInfo::InvokeStateChangedCallback(
     RegistrationState new_state, const UnknownHint& unknown_hint) {
-  ObjectId oid;
-  ConvertFromObjectIdProto(object_id_, &oid);
-  resources_->ScheduleOnListenerThread(
-      NewPermanentCallback(
-          reg_manager_->listener_,
-          &InvalidationListener::RegistrationStateChanged,
-          oid,
-          new_state,
-          unknown_hint));
+  reg_manager_->InvokeStateChangedCallback(object_id_, new_state,
+                                           unknown_hint);
 }
 
 bool RegistrationInfo::IsResultValid(const RegistrationUpdateResult& result) {
@@ -258,153 +276,318 @@ void RegistrationInfo::CheckSequenceNumber() {
 RegistrationInfoStore::RegistrationInfoStore(
     RegistrationUpdateManager* reg_manager)
     : reg_manager_(reg_manager),
-      resources_(reg_manager->resources_) {}
+      resources_(reg_manager->resources_),
+      num_records_with_server_state_(0),
+      num_confirmed_registrations_(0),
+      confirmed_registrations_by_range_(
+          reg_manager->config_.num_registration_sync_ranges, 0) {}
 
 
 void RegistrationInfoStore::ProcessRegistrationUpdateResult(
     const RegistrationUpdateResult& result) {
-  const ObjectIdP& object_id = result.operation().object_id();
-  EnsureRecordPresent(object_id);
-  string serialized;
-  object_id.SerializeToString(&serialized);
-  registration_state_[serialized].ProcessRegistrationUpdateResult(result);
+  RegistrationInfo* reg_info =
+      EnsureRecordPresent(result.operation().object_id());
+  RemoveFromIndex(reg_info);
+  reg_info->ProcessRegistrationUpdateResult(result);
+  AddToIndex(reg_info);
 }
 
 void RegistrationInfoStore::ProcessApplicationRequest(
     const ObjectIdP& object_id, RegistrationUpdate_Type op_type) {
-  EnsureRecordPresent(object_id);
-  string serialized;
-  object_id.SerializeToString(&serialized);
-  registration_state_[serialized].ProcessApplicationRequest(op_type);
+  RegistrationInfo* reg_info = EnsureRecordPresent(object_id);
+  RemoveFromIndex(reg_info);
+  reg_info->ProcessApplicationRequest(op_type);
+  AddToIndex(reg_info);
 }
 
 void RegistrationInfoStore::Reset() {
   TLOG(INFO_LEVEL, "Resetting all registration state");
   registration_state_.clear();
+  ClearIndex();
 }
 
-bool RegistrationInfoStore::HasServerStateForChecks() {
-  for (map<string, RegistrationInfo>::iterator iter =
-           registration_state_.begin();
-       iter != registration_state_.end();
-       ++iter) {
-    if (iter->second.latest_known_server_seqno_.get() != NULL) {
-      return true;
-    }
+void RegistrationInfoStore::SwapRecords(RecordMap* records) {
+  registration_state_.swap(*records);
+  ClearIndex();
+  for (RecordMap::iterator iter = registration_state_.begin();
+       iter != registration_state_.end(); ++iter) {
+    AddToIndex(&iter->second);
   }
-  return false;
 }
 
 bool RegistrationInfoStore::HasDataToSend() {
-  for (map<string, RegistrationInfo>::iterator iter =
-           registration_state_.begin();
-       iter != registration_state_.end();
-       ++iter) {
-    if (iter->second.HasDataToSend()) {
-      return true;
-    }
-  }
-  return false;
+  // In each index, the unsent operation with the lowest sequence number is the
+  // first to become sendable.
+  return HasSendableRecord(unsent_records_) ||
+      HasSendableRecord(unsent_retries_);
+}
+
+int RegistrationInfoStore::TakeData(ClientToServerMessage* message,
+                                    int max_registrations) {
+  CHECK(max_registrations <=
+        reg_manager_->config_.max_registrations_per_message);
+  Time now = resources_->current_time();
+  // Retries go last, so that operations the server may be slow to answer
+  // don't hold back the others.
+  int registrations_added =
+      TakeData(&unsent_records_, max_registrations, now, message);
+  registrations_added += TakeData(
+      &unsent_retries_, max_registrations - registrations_added, now, message);
+  return registrations_added;
 }
 
-int RegistrationInfoStore::TakeData(ClientToServerMessage* message) {
+int RegistrationInfoStore::TakeData(map<int64, RegistrationInfo*>* unsent,
+                                    int max_registrations, Time now,
+                                    ClientToServerMessage* message) {
   int registrations_added = 0;
-  for (map<string, RegistrationInfo>::iterator iter =
-           registration_state_.begin();
-       iter != registration_state_.end();
-       ++iter) {
-    RegistrationInfo& reg_info = iter->second;
-    if (reg_info.HasDataToSend()) {
-      reg_info.TakeData(message, resources_->current_time());
-      ++registrations_added;
-    }
-    if (registrations_added ==
-        reg_manager_->config_.max_registrations_per_message) {
-      break;
-    }
+  while ((registrations_added < max_registrations) &&
+         HasSendableRecord(*unsent)) {
+    RegistrationInfo* reg_info = unsent->begin()->second;
+    RemoveFromIndex(reg_info);
+    reg_info->TakeData(message, now);
+    AddToIndex(reg_info);
+    ++registrations_added;
   }
   return registrations_added;
 }
 
 void RegistrationInfoStore::CheckTimedOutRegistrations() {
-  for (map<string, RegistrationInfo>::iterator iter =
-           registration_state_.begin();
-       iter != registration_state_.end();
-       ++iter) {
-    RegistrationInfo& reg_info = iter->second;
-    reg_info.CheckTimeout(resources_->current_time(),
-                          reg_manager_->config_.registration_timeout);
+  Time now = resources_->current_time();
+  TimeDelta timeout = reg_manager_->config_.registration_timeout;
+  while (!sent_records_.empty() &&
+         !(now < sent_records_.begin()->first + timeout)) {
+    RegistrationInfo* reg_info = sent_records_.begin()->second;
+    RemoveFromIndex(reg_info);
+    reg_info->CheckTimeout(now, timeout);
+    CHECK(!reg_info->IsInProgress());
+    AddToIndex(reg_info);
   }
 }
 
+bool RegistrationInfoStore::GetNextTimeout(Time* deadline) {
+  if (sent_records_.empty()) {
+    return false;
+  }
+  *deadline =
+      sent_records_.begin()->first + reg_manager_->config_.registration_timeout;
+  return true;
+}
+
 void RegistrationInfoStore::CheckSequenceNumbers() {
-  for (map<string, RegistrationInfo>::iterator iter =
-           registration_state_.begin();
-       iter != registration_state_.end();
+  // The server's sequence numbers are validated as they are received, and
+  // stay valid since the current sequence number only grows (it is reset
+  // only along with the store), so only the pending operations are checked.
+  for (map<int64, RegistrationInfo*>::iterator iter = unsent_records_.begin();
+       iter != unsent_records_.end();
        ++iter) {
-    RegistrationInfo& reg_info = iter->second;
-    reg_info.CheckSequenceNumber();
-    if ((reg_info.pending_seqno_.get() != NULL) &&
-        (*reg_info.pending_seqno_ >
-         reg_manager_->maximum_op_seqno_inclusive_)) {
-      CHECK(reg_info.send_time_.get() == NULL);
-    }
+    iter->second->CheckSequenceNumber();
+  }
+  for (map<int64, RegistrationInfo*>::iterator iter = unsent_retries_.begin();
+       iter != unsent_retries_.end();
+       ++iter) {
+    iter->second->CheckSequenceNumber();
+  }
+  for (multimap<Time, RegistrationInfo*>::iterator iter =
+           sent_records_.begin();
+       iter != sent_records_.end();
+       ++iter) {
+    RegistrationInfo* reg_info = iter->second;
+    reg_info->CheckSequenceNumber();
+    CHECK(*reg_info->pending_seqno_ <=
+          reg_manager_->maximum_op_seqno_inclusive_);
   }
 }
 
 void RegistrationInfoStore::CheckNoPendingOpsSent() {
-  for (map<string, RegistrationInfo>::iterator iter =
-           registration_state_.begin();
-       iter != registration_state_.end();
-       ++iter) {
-    RegistrationInfo& reg_info = iter->second;
-    if (reg_info.IsInProgress() &&
-        (*reg_info.pending_seqno_ <=
-         reg_manager_->maximum_op_seqno_inclusive_)) {
-      CHECK(reg_info.HasDataToSend());
-    }
-  }
+  CHECK(sent_records_.empty());
 }
 
 RegState RegistrationInfoStore::GetRegistrationState(
     const ObjectIdP& object_id) {
-  string serialized;
-  object_id.SerializeToString(&serialized);
-  map<string, RegistrationInfo>::iterator iter =
-      registration_state_.find(serialized);
+  string key;
+  GetObjectKey(object_id, &key);
+  RecordMap::iterator iter = registration_state_.find(key);
   if (iter == registration_state_.end()) {
     return RegState_UNREGISTERED;
   }
   return iter->second.GetRegistrationState();
 }
 
-void RegistrationInfoStore::EnsureRecordPresent(const ObjectIdP& object_id) {
-  string serialized;
-  object_id.SerializeToString(&serialized);
-  map<string, RegistrationInfo>::iterator iter =
-      registration_state_.find(serialized);
+void RegistrationInfoStore::GetObjectKey(const ObjectIdP& object_id,
+                                         string* key) {
+  // The application identifies an object by its source and string name only
+  // (see ConvertFromObjectIdProto()).
+  const string& name = object_id.name().string_value();
+  uint32 source = static_cast<uint32>(object_id.source());
+  key->clear();
+  key->reserve(4 + name.size());
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    key->push_back(static_cast<char>((source >> shift) & 0xff));
+  }
+  key->append(name);
+}
+
+int RegistrationInfoStore::GetSyncRange(const string& key) {
+  return static_cast<int>(
+      ObjectKeyHash::Fingerprint(key) %
+      reg_manager_->config_.num_registration_sync_ranges);
+}
+
+RegistrationInfo* RegistrationInfoStore::EnsureRecordPresent(
+    const ObjectIdP& object_id) {
+  string key;
+  GetObjectKey(object_id, &key);
+  RecordMap::iterator iter = registration_state_.find(key);
   if (iter == registration_state_.end()) {
-    registration_state_[serialized] = RegistrationInfo(reg_manager_, object_id);
+    iter = registration_state_.insert(
+        make_pair(key, RegistrationInfo(reg_manager_, object_id))).first;
+    iter->second.sync_range_ = GetSyncRange(key);
+    AddToIndex(&iter->second);
+  }
+  return &iter->second;
+}
+
+void RegistrationInfoStore::AddToIndex(RegistrationInfo* reg_info) {
+  if (reg_info->IsInProgress()) {
+    if (reg_info->send_time_.get() == NULL) {
+      CHECK(GetUnsentIndex(*reg_info)->insert(
+          make_pair(*reg_info->pending_seqno_, reg_info)).second);
+    } else {
+      sent_records_.insert(make_pair(*reg_info->send_time_, reg_info));
+    }
+  }
+  if (reg_info->latest_known_server_seqno_.get() != NULL) {
+    ++num_records_with_server_state_;
+  }
+  if (reg_info->IsLatestKnownServerStateRegistration()) {
+    ++num_confirmed_registrations_;
+    ++confirmed_registrations_by_range_[reg_info->sync_range_];
+  }
+}
+
+void RegistrationInfoStore::RemoveFromIndex(RegistrationInfo* reg_info) {
+  if (reg_info->IsInProgress()) {
+    if (reg_info->send_time_.get() == NULL) {
+      map<int64, RegistrationInfo*>* unsent_index = GetUnsentIndex(*reg_info);
+      map<int64, RegistrationInfo*>::iterator unsent =
+          unsent_index->find(*reg_info->pending_seqno_);
+      CHECK((unsent != unsent_index->end()) && (unsent->second == reg_info));
+      unsent_index->erase(unsent);
+    } else {
+      typedef multimap<Time, RegistrationInfo*>::iterator SentIterator;
+      pair<SentIterator, SentIterator> range =
+          sent_records_.equal_range(*reg_info->send_time_);
+      SentIterator sent = range.first;
+      while ((sent != range.second) && (sent->second != reg_info)) {
+        ++sent;
+      }
+      CHECK(sent != range.second);
+      sent_records_.erase(sent);
+    }
+  }
+  if (reg_info->latest_known_server_seqno_.get() != NULL) {
+    --num_records_with_server_state_;
+  }
+  if (reg_info->IsLatestKnownServerStateRegistration()) {
+    --num_confirmed_registrations_;
+    --confirmed_registrations_by_range_[reg_info->sync_range_];
   }
 }
 
+void RegistrationInfoStore::ClearIndex() {
+  unsent_records_.clear();
+  unsent_retries_.clear();
+  sent_records_.clear();
+  num_records_with_server_state_ = 0;
+  num_confirmed_registrations_ = 0;
+  confirmed_registrations_by_range_.assign(
+      confirmed_registrations_by_range_.size(), 0);
+}
+
 // SyncState definitions.
 
 SyncState::SyncState(RegistrationUpdateManager* reg_manager)
     : reg_manager_(reg_manager),
       request_send_time_(reg_manager_->resources_->current_time()),
-      num_expected_registrations_(-1) {}
+      num_attempts_(0),
+      num_expected_registrations_(-1),
+      has_range_totals_(false),
+      range_totals_(reg_manager->config_.num_registration_sync_ranges, -1) {}
 
 bool SyncState::IsSyncComplete() {
+  if (has_range_totals_) {
+    int max_attempts = reg_manager_->config_.max_registration_sync_attempts;
+    return AreAllRangesConfirmed() ||
+        (IsTimedOut() && (num_attempts_ >= max_attempts));
+  }
   int num_registrations = reg_manager_->GetNumConfirmedRegistrations();
   bool have_enough_registrations = (num_expected_registrations_ != -1) &&
       (num_expected_registrations_ <= num_registrations);
   return have_enough_registrations || IsTimedOut();
 }
 
+bool SyncState::IsRetryDue() {
+  return has_range_totals_ && IsTimedOut() && !IsSyncComplete();
+}
+
+void SyncState::AddSyncRequest(ClientToServerMessage* message) {
+  message->set_message_type(
+      ClientToServerMessage_MessageType_TYPE_REGISTRATION_SYNC);
+  message->set_num_sync_ranges(range_totals_.size());
+  if (num_attempts_ > 0) {
+    for (size_t i = 0; i < range_totals_.size(); ++i) {
+      if (!IsRangeConfirmed(i)) {
+        message->add_sync_range(i);
+      }
+    }
+    reg_manager_->resources_->Log(
+        SystemResources::INFO_LEVEL, __FILE__, __LINE__,
+        "Retrying registration sync for %d of %d ranges",
+        message->sync_range_size(), static_cast<int>(range_totals_.size()));
+  }
+  ++num_attempts_;
+  request_send_time_ = reg_manager_->resources_->current_time();
+}
+
+void SyncState::ProcessRangeTotals(const ServerToClientMessage& message) {
+  if (message.sync_range_size() != message.sync_range_total_size()) {
+    reg_manager_->resources_->Log(
+        SystemResources::INFO_LEVEL, __FILE__, __LINE__,
+        "Ignoring mismatched sync range totals");
+    return;
+  }
+  for (int i = 0; i < message.sync_range_size(); ++i) {
+    uint32 sync_range = message.sync_range(i);
+    if (sync_range < range_totals_.size()) {
+      range_totals_[sync_range] = message.sync_range_total(i);
+      has_range_totals_ = true;
+    }
+  }
+}
+
 bool SyncState::IsTimedOut() {
-  return reg_manager_->resources_->current_time() >=
-      reg_manager_->config_.registration_sync_timeout + request_send_time_;
+  return (num_attempts_ > 0) &&
+      (reg_manager_->resources_->current_time() >= GetTimeoutTime());
+}
+
+bool SyncState::IsRangeConfirmed(int sync_range) {
+  return (range_totals_[sync_range] != -1) &&
+      (range_totals_[sync_range] <=
+       reg_manager_->registration_info_store_
+           .num_confirmed_registrations_in_range(sync_range));
+}
+
+bool SyncState::AreAllRangesConfirmed() {
+  for (size_t i = 0; i < range_totals_.size(); ++i) {
+    if (!IsRangeConfirmed(i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Time SyncState::GetTimeoutTime() {
+  return request_send_time_ + reg_manager_->config_.registration_sync_timeout;
 }
 
 // RegistrationUpdateManager definitions.
@@ -415,12 +598,16 @@ RegistrationUpdateManager::RegistrationUpdateManager(
     : state_(State_LIMBO),
       resources_(resources),
       listener_(listener),
+      batching_state_changes_(false),
+      pending_state_changes_(NULL),
       current_op_seqno_(current_op_seqno),
       maximum_op_seqno_inclusive_(current_op_seqno_ - 1),
       config_(config),
+      has_resumable_registrations_(false),
       registration_info_store_(ALLOW_THIS_IN_INITIALIZER_LIST(this)) {}
 
 RegistrationUpdateManager::~RegistrationUpdateManager() {
+  delete pending_state_changes_;
 }
 
 void RegistrationUpdateManager::EnterState(State new_state) {
@@ -450,7 +637,10 @@ void RegistrationUpdateManager::EnterState(State new_state) {
           (current_op_seqno_ == kFirstSequenceNumber);
       bool is_normal_sync_completion =
           (state_ == State_SYNC_STARTED) && sync_state_->IsSyncComplete();
-      CHECK(is_normal_sync_completion || is_short_circuit_sync_completion);
+      bool is_session_resumption =
+          (state_ == State_LIMBO) && has_resumable_registrations_;
+      CHECK(is_normal_sync_completion || is_short_circuit_sync_completion ||
+            is_session_resumption);
       sync_state_.reset();
       break;
     }
@@ -495,16 +685,7 @@ void RegistrationUpdateManager::CheckSequenceNumber(const ObjectIdP& object_id,
 }
 
 int RegistrationUpdateManager::GetNumConfirmedRegistrations() {
-  int count = 0;
-  for (map<string, RegistrationInfo>::iterator iter =
-           registration_info_store_.registration_state_.begin();
-       iter != registration_info_store_.registration_state_.end();
-       ++iter) {
-    if (iter->second.IsLatestKnownServerStateRegistration()) {
-      ++count;
-    }
-  }
-  return count;
+  return registration_info_store_.num_confirmed_registrations();
 }
 
 void RegistrationUpdateManager::HandleLostSession() {
@@ -513,12 +694,67 @@ void RegistrationUpdateManager::HandleLostSession() {
   // meaningfully issue registration requests to the server.  Abort all pending
   // requests, since we know we'll ignore the responses, as they'll have the old
   // session token.  Additionally, clear the confirmed-registrations list, since
-  // those registrations are no longer valid in the absence of a session.
+  // those registrations are no longer valid in the absence of a session,
+  // unless the session may be resumed.
   CheckRep();
+  SaveResumableRegistrations();
   EnterState(State_LIMBO);
   CheckRep();
 }
 
+void RegistrationUpdateManager::SaveResumableRegistrations() {
+  DiscardResumableRegistrations();
+  if (!config_.resume_sessions || (state_ != State_SYNCED)) {
+    return;
+  }
+  RegistrationInfoStore::RecordMap& records =
+      registration_info_store_.registration_state_;
+  vector<string> registered_objects;
+  for (RegistrationInfoStore::RecordMap::iterator iter = records.begin();
+       iter != records.end(); ++iter) {
+    if (iter->second.IsInProgress()) {
+      // The application awaits the result of this operation, which the lost
+      // session won't deliver.
+      TLOG(INFO_LEVEL, "Not resumable: operations in progress");
+      return;
+    }
+    if (iter->second.IsLatestKnownServerStateRegistration()) {
+      registered_objects.push_back(string());
+      iter->second.object_id_.SerializeToString(&registered_objects.back());
+    }
+  }
+  // The digest covers the serialized object ids in order.
+  sort(registered_objects.begin(), registered_objects.end());
+  string digest_input;
+  for (size_t i = 0; i < registered_objects.size(); ++i) {
+    digest_input.append(registered_objects[i]);
+  }
+  ComputeMd5Digest(digest_input, &resumable_registration_digest_);
+  registration_info_store_.SwapRecords(&resumable_registrations_);
+  has_resumable_registrations_ = true;
+}
+
+bool RegistrationUpdateManager::GetResumableRegistrationDigest(
+    string* digest) {
+  if (!has_resumable_registrations_) {
+    return false;
+  }
+  *digest = resumable_registration_digest_;
+  return true;
+}
+
+bool RegistrationUpdateManager::HandleResumedSession() {
+  CheckRep();
+  if ((state_ != State_LIMBO) || !has_resumable_registrations_) {
+    return false;
+  }
+  EnterState(State_SYNCED);
+  registration_info_store_.SwapRecords(&resumable_registrations_);
+  DiscardResumableRegistrations();
+  CheckRep();
+  return true;
+}
+
 void RegistrationUpdateManager::HandleLostClientId() {
   // Approach: we'll put the manager in a state appropriate to a newly-created
   // client.  I.e., we'll abort all of our pending registrations and discard all
@@ -530,6 +766,7 @@ void RegistrationUpdateManager::HandleLostClientId() {
   // Enter State_LIMBO, discard all registrations (pending or confirmed).
   CheckRep();
   EnterState(State_LIMBO);
+  DiscardResumableRegistrations();
 
   // Reset sequence numbers.
   current_op_seqno_ = kFirstSequenceNumber;
@@ -558,6 +795,8 @@ void RegistrationUpdateManager::HandleNewSession() {
   if (state_ != State_LIMBO) {
     HandleLostSession();
   }
+  // The server did not resume the lost session.
+  DiscardResumableRegistrations();
 
   // TODO(ghc): [misc] Consider moving this to SYNCED transition.
   resources_->ScheduleOnListenerThread(
@@ -571,7 +810,8 @@ void RegistrationUpdateManager::HandleNewSession() {
   CheckRep();
 }
 
-int RegistrationUpdateManager::AddOutboundData(ClientToServerMessage* message) {
+int RegistrationUpdateManager::AddOutboundData(ClientToServerMessage* message,
+                                               int max_registrations) {
   CheckRep();
   int num_registrations_added = 0;
 
@@ -581,23 +821,30 @@ int RegistrationUpdateManager::AddOutboundData(ClientToServerMessage* message) {
       break;
 
     case State_SYNC_NOT_STARTED:
-      message->set_message_type(
-          ClientToServerMessage_MessageType_TYPE_REGISTRATION_SYNC);
       EnterState(State_SYNC_STARTED);
+      sync_state_->AddSyncRequest(message);
       TLOG(INFO_LEVEL, "Setting message type to TYPE_REGISTRATION_SYNC");
       break;
 
-    case State_SYNCED:
-      num_registrations_added = registration_info_store_.TakeData(message);
-      TLOG(INFO_LEVEL, "Adding %d registrations in from State_SYNCED",
-           num_registrations_added);
-      // Fall through.
     case State_SYNC_STARTED:
+      if (sync_state_->IsRetryDue()) {
+        sync_state_->AddSyncRequest(message);
+        break;
+      }
       // We need to set the message type to OBJECT_CONTROL even if we're not
       // SYNCED, since the network manager might be trying to send a heartbeat.
       message->set_message_type(
           ClientToServerMessage_MessageType_TYPE_OBJECT_CONTROL);
       break;
+
+    case State_SYNCED:
+      num_registrations_added =
+          registration_info_store_.TakeData(message, max_registrations);
+      TLOG(INFO_LEVEL, "Adding %d registrations in from State_SYNCED",
+           num_registrations_added);
+      message->set_message_type(
+          ClientToServerMessage_MessageType_TYPE_OBJECT_CONTROL);
+      break;
   }
 
   CheckRep();
@@ -610,19 +857,55 @@ void RegistrationUpdateManager::ProcessInboundMessage(
   CHECK(message.message_type() ==
         ServerToClientMessage_MessageType_TYPE_OBJECT_CONTROL);
   CHECK(state_ != State_LIMBO);
+  batching_state_changes_ = true;
   for (int i = 0; i < message.registration_result_size(); ++i) {
     registration_info_store_.ProcessRegistrationUpdateResult(
         message.registration_result(i));
   }
-  if (message.has_num_total_registrations()) {
-    if (state_ == State_SYNC_STARTED) {
+  batching_state_changes_ = false;
+  FlushStateChanges();
+  if (state_ == State_SYNC_STARTED) {
+    if (message.has_num_total_registrations()) {
       sync_state_->set_num_expected_registrations(
           message.num_total_registrations());
     }
+    sync_state_->ProcessRangeTotals(message);
   }
   CheckRep();
 }
 
+void RegistrationUpdateManager::InvokeStateChangedCallback(
+    const ObjectIdP& object_id, RegistrationState new_state,
+    const UnknownHint& unknown_hint) {
+  ObjectId oid;
+  ConvertFromObjectIdProto(object_id, &oid);
+  if (!batching_state_changes_) {
+    resources_->ScheduleOnListenerThread(
+        NewPermanentCallback(
+            listener_,
+            &InvalidationListener::RegistrationStateChanged,
+            oid,
+            new_state,
+            unknown_hint));
+    return;
+  }
+  if (pending_state_changes_ == NULL) {
+    pending_state_changes_ = new vector<StateChange>();
+  }
+  pending_state_changes_->push_back(
+      StateChange(oid, new_state, unknown_hint));
+}
+
+void RegistrationUpdateManager::FlushStateChanges() {
+  if (pending_state_changes_ == NULL) {
+    return;
+  }
+  resources_->ScheduleOnListenerThread(
+      NewPermanentCallback(&DeliverStateChanges, listener_,
+                           pending_state_changes_));
+  pending_state_changes_ = NULL;
+}
+
 bool RegistrationUpdateManager::DoPeriodicRegistrationCheck() {
   // Approach: we know that we definitely do not have data to send in two cases:
   // 1) We are in state LIMBO. In this case, we can do nothing since we have no
@@ -647,8 +930,8 @@ bool RegistrationUpdateManager::DoPeriodicRegistrationCheck() {
       break;
 
     case State_SYNC_STARTED:
-      // Never have anything to send, but we need to check if the sync has timed
-      // out.
+      // Nothing to send unless the sync has timed out with sync ranges left to
+      // request again, but we need to check if the sync has completed.
       CHECK(sync_state_.get() != NULL);
       if (sync_state_->IsSyncComplete()) {
         EnterState(State_SYNCED);
@@ -657,8 +940,9 @@ bool RegistrationUpdateManager::DoPeriodicRegistrationCheck() {
         // condition.
         result = SyncedStateHasDataToSend();
       } else {
-        // We didn't enter the SYNCED state, so we have no data to send.
-        result = false;
+        // We didn't enter the SYNCED state, so we have data to send only if
+        // the incomplete sync ranges are to be requested again.
+        result = sync_state_->IsRetryDue();
       }
       break;
 
@@ -682,6 +966,24 @@ bool RegistrationUpdateManager::DoPeriodicRegistrationCheck() {
   return result;
 }
 
+bool RegistrationUpdateManager::GetNextCheckTime(Time* deadline) {
+  CheckRep();
+  switch (state_) {
+    case State_SYNC_STARTED:
+      CHECK(sync_state_.get() != NULL);
+      *deadline = sync_state_->GetTimeoutTime();
+      return true;
+
+    case State_SYNCED:
+      return registration_info_store_.GetNextTimeout(deadline);
+
+    default:
+      // Nothing times out in State_LIMBO, and in State_SYNC_NOT_STARTED the
+      // sync message is already waiting to be sent.
+      return false;
+  }
+}
+
 void RegistrationUpdateManager::BeginSync() {
   EnterState(State_SYNC_NOT_STARTED);
   if (current_op_seqno_ == kFirstSequenceNumber) {
@@ -16,6 +16,7 @@
 #define GOOGLE_CACHEINVALIDATION_REGISTRATION_UPDATE_MANAGER_H_
 
 #include <map>
+#include <vector>
 
 #include "google/cacheinvalidation/callback.h"
 #include "google/cacheinvalidation/hash_map.h"
@@ -28,6 +29,8 @@
 namespace invalidation {
 
 using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::multimap;
+using INVALIDATION_STL_NAMESPACE::vector;
 
 class SystemResources;
 
@@ -52,7 +55,7 @@ class RegistrationUpdateManager;
 // Record of the registration state of an object.
 class RegistrationInfo {
  public:
-  RegistrationInfo() {}
+  RegistrationInfo() : timed_out_(false), sync_range_(0) {}
 
   RegistrationInfo(RegistrationUpdateManager* reg_manager,
                    const ObjectIdP& object_id);
@@ -69,6 +72,8 @@ class RegistrationInfo {
     resources_ = reg_info.resources_;
     object_id_ = reg_info.object_id_;
     latest_known_server_state_ = reg_info.latest_known_server_state_;
+    timed_out_ = reg_info.timed_out_;
+    sync_range_ = reg_info.sync_range_;
 
     // We use scoped_ptr in several places to simulate optional / nullable
     // values.  These values cannot be copied implicitly.  We need to allocate
@@ -118,8 +123,8 @@ class RegistrationInfo {
         RegistrationState_UNREGISTERED;
   }
 
-  // Invokes the RegistrationStateChanged() callback on object_id_ and
-  // new_state_.
+  // Has the manager invoke the RegistrationStateChanged() callback on
+  // object_id_ and new_state_.
   void InvokeStateChangedCallback(RegistrationState new_state_,
                                   const UnknownHint& unknown_hint);
 
@@ -128,6 +133,13 @@ class RegistrationInfo {
     return pending_state_.get() != NULL;
   }
 
+  // Returns whether an operation for the object timed out with no later
+  // answer from the server, so that the operation in progress, if any,
+  // retries it.
+  bool IsRetry() {
+    return timed_out_;
+  }
+
   // Returns the type of operation in-progress.
   // REQUIRES: IsInProgress().
   RegistrationUpdate_Type GetInProgressType() {
@@ -176,17 +188,72 @@ class RegistrationInfo {
   // The time, if any, at which a message was sent requesting this operation.
   scoped_ptr<Time> send_time_;
 
+  // Whether the last operation sent for the object timed out, and the server
+  // has sent no result for the object since.
+  bool timed_out_;
+
   // The sequence number, if any, of the pending operation.
   scoped_ptr<int64> pending_seqno_;
 
+  // The registration sync range of the object (see
+  // RegistrationInfoStore::GetSyncRange()).
+  int sync_range_;
+
   friend class RegistrationInfoStore;
   friend class RegistrationUpdateManager;
 };
 
+// A RegistrationStateChanged() call to be made on the listener.
+struct StateChange {
+  StateChange(const ObjectId& object_id, RegistrationState new_state,
+              const UnknownHint& unknown_hint)
+      : object_id(object_id), new_state(new_state),
+        unknown_hint(unknown_hint) {}
+
+  ObjectId object_id;
+  RegistrationState new_state;
+  UnknownHint unknown_hint;
+};
+
+// Hashes the keys of the registration records (see
+// RegistrationInfoStore::GetObjectKey()), with FNV-1a.
+struct ObjectKeyHash {
+  // Returns the 64-bit FNV-1a hash of key, which the server also computes to
+  // split registrations into sync ranges.
+  static uint64 Fingerprint(const string& key) {
+    uint64 hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.size(); ++i) {
+      hash ^= static_cast<unsigned char>(key[i]);
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  size_t operator()(const string& key) const {
+    return static_cast<size_t>(Fingerprint(key));
+  }
+};
+
 // Class to manage RegistrationInfo records representing the total registration
 // state known to a manager.
+//
+// The records are hashed by a key built from the source and name of the
+// object, so that finding one costs neither a serialization of the object id
+// nor a walk down a tree.  The indexes hold pointers to the records, which,
+// unlike iterators into the hash map, stay valid as records are added.
+//
+// Besides the records, the store indexes the ones with an operation in
+// progress: those not yet sent by sequence number (the retries of timed-out
+// operations apart, so that they are sent after the others), and those sent
+// by send time. The periodic checks and the building of messages only visit
+// these, so that they cost nothing when no operation is in progress however
+// many registrations there are. Every change to a record goes through the
+// store, which takes the record out of the indexes before the change and puts
+// it back after.
 class RegistrationInfoStore {
  public:
+  typedef hash_map<string, RegistrationInfo, ObjectKeyHash> RecordMap;
+
   // Constructs a registration info store associated with the given reg_manager.
   // The reg manager will own this object.
   explicit RegistrationInfoStore(RegistrationUpdateManager* reg_manager);
@@ -202,20 +269,44 @@ class RegistrationInfoStore {
   // Clears the registration state map.
   void Reset();
 
+  // Exchanges the records of the store with records, and reindexes them.
+  void SwapRecords(RecordMap* records);
+
   // Returns whether the store has received any state from the server.
-  bool HasServerStateForChecks();
+  bool HasServerStateForChecks() {
+    return num_records_with_server_state_ > 0;
+  }
+
+  // Returns the number of objects whose latest known server state is
+  // registered.
+  int num_confirmed_registrations() {
+    return num_confirmed_registrations_;
+  }
+
+  // Returns the number of objects in the given sync range whose latest known
+  // server state is registered.
+  int num_confirmed_registrations_in_range(int sync_range) {
+    return confirmed_registrations_by_range_[sync_range];
+  }
 
   // Returns whether any (un)registrations are ready to be sent to the server.
   bool HasDataToSend();
 
-  // Adds outbound registration messages to the given message.  Returns the
-  // number of registrations added.
-  int32 TakeData(ClientToServerMessage* message);
+  // Adds up to max_registrations outbound registration messages to the given
+  // message: first the ones that aren't retries, then the retries, each in the
+  // order in which they were requested.  Returns the number of registrations
+  // added.
+  int32 TakeData(ClientToServerMessage* message, int max_registrations);
 
   // Checks for timed-out registrations, either invoking callbacks or
   // arranging for retries as needed.
   void CheckTimedOutRegistrations();
 
+  // Returns whether any (un)registrations have been sent and not yet answered
+  // or timed out, and if so, stores in *deadline the time at which the
+  // earliest of them times out.
+  bool GetNextTimeout(Time* deadline);
+
   // Validates sequence numbers in the store.
   void CheckSequenceNumbers();
 
@@ -226,9 +317,46 @@ class RegistrationInfoStore {
   RegState GetRegistrationState(const ObjectIdP& object_id);
 
  private:
-  // Ensures that a record for object_id is present in the registration_state_
-  // map.  If none was previously present, adds a default record.
-  void EnsureRecordPresent(const ObjectIdP& object_id);
+  // Stores in key the key of the record for object_id: its source, in four
+  // bytes, followed by its name as the application sees it.
+  static void GetObjectKey(const ObjectIdP& object_id, string* key);
+
+  // Returns the registration sync range of the object with the given key: its
+  // fingerprint modulo config.num_registration_sync_ranges.
+  int GetSyncRange(const string& key);
+
+  // Returns the record for object_id in the registration_state_ map.  If none
+  // was previously present, adds a default record.
+  RegistrationInfo* EnsureRecordPresent(const ObjectIdP& object_id);
+
+  // Adds reg_info to the indexes and counts, according to its current state.
+  void AddToIndex(RegistrationInfo* reg_info);
+
+  // Returns the index of unsent records in which reg_info belongs.
+  map<int64, RegistrationInfo*>* GetUnsentIndex(
+      const RegistrationInfo& reg_info) {
+    return reg_info.timed_out_ ? &unsent_retries_ : &unsent_records_;
+  }
+
+  // Returns whether the first record of the given index of unsent records is
+  // ready to be sent.
+  static bool HasSendableRecord(
+      const map<int64, RegistrationInfo*>& unsent) {
+    return !unsent.empty() && unsent.begin()->second->HasDataToSend();
+  }
+
+  // Adds up to max_registrations records from the given index of unsent
+  // records to message, marking them sent at now.  Returns the number added.
+  int32 TakeData(map<int64, RegistrationInfo*>* unsent,
+                 int max_registrations, Time now,
+                 ClientToServerMessage* message);
+
+  // Removes reg_info from the indexes and counts.
+  // REQUIRES: the record has not changed since it was added.
+  void RemoveFromIndex(RegistrationInfo* reg_info);
+
+  // Clears the indexes and counts.
+  void ClearIndex();
 
   // The registration update manager to which this store belongs.
   RegistrationUpdateManager* reg_manager_;
@@ -236,13 +364,40 @@ class RegistrationInfoStore {
   // System resources for logging, etc.
   SystemResources* resources_;
 
-  // Map from serialized object id to associated record.
-  map<string, RegistrationInfo> registration_state_;
+  // Map from object key to associated record.
+  RecordMap registration_state_;
+
+  // The records with an operation in progress that has not been sent and
+  // isn't a retry, by the sequence number of the operation.
+  map<int64, RegistrationInfo*> unsent_records_;
+
+  // The records with an operation in progress that has not been sent and is
+  // a retry, by the sequence number of the operation.
+  map<int64, RegistrationInfo*> unsent_retries_;
+
+  // The records with an operation in progress that has been sent, by the time
+  // at which it was sent.
+  multimap<Time, RegistrationInfo*> sent_records_;
+
+  // The number of records with a sequence number from the server.
+  int num_records_with_server_state_;
+
+  // The number of records whose latest known server state is registered.
+  int num_confirmed_registrations_;
+
+  // The same, for each sync range.
+  vector<int> confirmed_registrations_by_range_;
 
   friend class RegistrationUpdateManager;
 };
 
 // Represents the state of an on-going registration synchronization operation.
+//
+// The registrations are split into config.num_registration_sync_ranges sync
+// ranges, which the server counts separately, so that each range is confirmed
+// as soon as all its registrations have arrived.  If a request times out with
+// some ranges incomplete, another is sent for those only, up to
+// config.max_registration_sync_attempts requests in all.
 class SyncState {
  public:
   explicit SyncState(RegistrationUpdateManager* reg_manager);
@@ -251,23 +406,56 @@ class SyncState {
   // all messages or timeout.
   bool IsSyncComplete();
 
+  // Returns whether the request in flight timed out with some sync ranges
+  // still incomplete, and another request may be sent for them.
+  bool IsRetryDue();
+
+  // Makes message a request for the sync ranges not yet confirmed (all of
+  // them, on the first request), and restarts the timeout.
+  void AddSyncRequest(ClientToServerMessage* message);
+
+  // Records the per-range registration counts in a reply from the server.
+  void ProcessRangeTotals(const ServerToClientMessage& message);
+
+  // Returns the time at which the request in flight times out.
+  Time GetTimeoutTime();
+
   void set_num_expected_registrations(int num_expected_registrations) {
     num_expected_registrations_ = num_expected_registrations;
   }
 
  private:
-  // Returns whether the sync process has timed out -- i.e., it has started and
-  // too much time has passed.
+  // Returns whether the request in flight has timed out -- i.e., it has been
+  // sent and too much time has passed.
   bool IsTimedOut();
 
+  // Returns whether the server has sent all the registrations it holds in the
+  // given sync range.
+  bool IsRangeConfirmed(int sync_range);
+
+  // Returns whether every sync range is confirmed.
+  bool AreAllRangesConfirmed();
+
   // The registration manager to which this synchronization state pertains.
   RegistrationUpdateManager* reg_manager_;
 
-  // The time at which we sent the request to sync registrations.
+  // The time at which we sent the latest request to sync registrations.
   Time request_send_time_;
 
+  // The number of requests sent.
+  int num_attempts_;
+
   // The total number of registrations we expect from the server.
   int32 num_expected_registrations_;
+
+  // Whether the server has sent per-range counts, so that the sync can go
+  // on range by range.  Servers that don't only send
+  // num_expected_registrations_, and the sync then ends at the first timeout.
+  bool has_range_totals_;
+
+  // For each sync range, the number of registrations the server holds in it,
+  // or -1 if unknown.
+  vector<int> range_totals_;
 };
 
 /* Keeps track of pending and confirmed registration update operations for a
@@ -294,6 +482,17 @@ class RegistrationUpdateManager {
   // Handles a new session.
   void HandleNewSession();
 
+  // Handles a new session that the server resumed, i.e., to which it confirmed
+  // that the registrations of the lost session carry over.  Restores them and
+  // enters State_SYNCED without a registration sync.  Returns false, doing
+  // nothing, if there are no registrations to resume.
+  bool HandleResumedSession();
+
+  // If the registrations confirmed in the lost session can be resumed, stores
+  // their digest (see ClientToServerMessage.registration_digest) in digest and
+  // returns true.
+  bool GetResumableRegistrationDigest(string* digest);
+
   // Returns the registration state of the given object.
   RegState GetRegistrationState(const ObjectIdP& object_id) {
     CheckRep();
@@ -301,9 +500,9 @@ class RegistrationUpdateManager {
   }
 
   // For each pending registration update that was not aready sent out recently,
-  // adds a message to the given message (up to
-  // config.max_registrations_per_message).
-  int AddOutboundData(ClientToServerMessage* message);
+  // adds a message to the given message (up to max_registrations, which is at
+  // most config.max_registrations_per_message), retries last.
+  int AddOutboundData(ClientToServerMessage* message, int max_registrations);
 
   // Handles a message from the server.
   void ProcessInboundMessage(const ServerToClientMessage& message);
@@ -318,6 +517,9 @@ class RegistrationUpdateManager {
     // 2) We'll issue registrations-removed when we leave LIMBO, which will
     //    cause the application to re-register everything anyway.
     if (state_ == State_LIMBO) {
+      // The application won't be asked to re-register if the session is
+      // resumed, so it must not be.
+      DiscardResumableRegistrations();
       return;
     }
     registration_info_store_.ProcessApplicationRequest(object_id, op_type);
@@ -347,6 +549,13 @@ class RegistrationUpdateManager {
    */
   bool DoPeriodicRegistrationCheck();
 
+  /* Returns whether DoPeriodicRegistrationCheck() has a timeout to check in
+   * the current state, and if so, stores in *deadline the time at which it
+   * next needs to run: when the sync times out in State_SYNC_STARTED, or when
+   * the earliest sent (un)registration times out in State_SYNCED.
+   */
+  bool GetNextCheckTime(Time* deadline);
+
   // Updates the maximum sequence number.
   void UpdateMaximumSeqno(int64 new_maximum_seqno_inclusive) {
     CHECK(new_maximum_seqno_inclusive > maximum_op_seqno_inclusive_);
@@ -385,12 +594,35 @@ class RegistrationUpdateManager {
   // notification from the server about registration state.
   int GetNumConfirmedRegistrations();
 
+  // If config_.resume_sessions, the manager is in State_SYNCED and has no
+  // operations in progress, keeps the registration records so that the session
+  // about to be lost can be resumed.
+  void SaveResumableRegistrations();
+
+  // Discards the registrations kept for resuming the lost session, if any.
+  void DiscardResumableRegistrations() {
+    resumable_registrations_.clear();
+    resumable_registration_digest_.clear();
+    has_resumable_registrations_ = false;
+  }
+
   // Starts the registration sync process.  If our current sequence number is
   // kFirstSequenceNumber, then we know we can't have issued any registrations,
   // and we transition directly to State_SYNCED.  Otherwise, we transition to
   // State_SYNC_NOT_STARTED.
   void BeginSync();
 
+  // Invokes the RegistrationStateChanged() callback on object_id and
+  // new_state, or, while an inbound message is being processed, queues the
+  // call to be made along with the others the message causes.
+  void InvokeStateChangedCallback(const ObjectIdP& object_id,
+                                  RegistrationState new_state,
+                                  const UnknownHint& unknown_hint);
+
+  // Schedules the calls queued by InvokeStateChangedCallback(), if any, as a
+  // single task on the listener thread.
+  void FlushStateChanges();
+
   // Returns whether there is any data to send, given that the manager is in
   // State_SYNCED.
   bool SyncedStateHasDataToSend() {
@@ -408,6 +640,12 @@ class RegistrationUpdateManager {
   // state.
   InvalidationListener* listener_;
 
+  // Whether an inbound message is being processed, so that the
+  // RegistrationStateChanged() calls it causes are queued in
+  // pending_state_changes_ (owned, or NULL if none are queued).
+  bool batching_state_changes_;
+  vector<StateChange>* pending_state_changes_;
+
   // Sequence number to use for the next registration operation.
   int64 current_op_seqno_;
 
@@ -417,6 +655,13 @@ class RegistrationUpdateManager {
   // Ticl configuration parameters.
   ClientConfig config_;
 
+  // The registration records of the lost session and the digest of the
+  // registrations confirmed in it, if it can be resumed (see
+  // SaveResumableRegistrations()).
+  RegistrationInfoStore::RecordMap resumable_registrations_;
+  string resumable_registration_digest_;
+  bool has_resumable_registrations_;
+
   // State of the current registration synchronization operation.  Non-null iff
   // state_ == State_SYNC_STARTED.
   scoped_ptr<SyncState> sync_state_;
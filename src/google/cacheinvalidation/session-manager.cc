@@ -84,6 +84,11 @@ void SessionManager::AddSessionAction(ClientToServerMessage* message) {
       // We need a session, so make a request that will get a session token.
       // Set message type to TYPE_UPDATE_SESSION.
       message->set_client_uniquifier(uniquifier_);
+      if (!last_session_token_.empty()) {
+        // Offer to resume the lost session.  The Ticl adds the digest of the
+        // registrations to resume, or clears the token if it has none.
+        message->set_last_session_token(last_session_token_);
+      }
       message->set_action(ClientToServerMessage_Action_UPDATE_SESSION);
       message->set_message_type(
           ClientToServerMessage_MessageType_TYPE_UPDATE_SESSION);
@@ -257,7 +262,10 @@ MessageAction SessionManager::ProcessUpdateSession(
     UpdateState();
     // Reset the count of unsuccessful session acquisition attempts.
     session_attempt_count_ = 0;
-    return ACQUIRE_SESSION;
+    bool is_resumed =
+        message.session_resumed() && !last_session_token_.empty();
+    last_session_token_.clear();
+    return is_resumed ? RESUME_SESSION : ACQUIRE_SESSION;
   }
   return IGNORE_MESSAGE;
 }
@@ -291,6 +299,7 @@ void SessionManager::DoLoseClientId() {
   TLOG(INFO_LEVEL, "Client id invalidated");
   uniquifier_.clear();
   session_token_.clear();
+  last_session_token_.clear();
   // Set the "last send time" into the far past so we'll be allowed to send an
   // assign-client-id request at least once.
   last_send_time_ = Time() - TimeDelta::FromHours(1);
@@ -323,6 +332,9 @@ MessageAction SessionManager::ProcessInvalidateSession(
   // Invalidate our session token if it matches the one in the message.
   if (session_token_ == message.session_token()) {
     TLOG(INFO_LEVEL, "Invalidating session: %s", session_token_.c_str());
+    if (config_.resume_sessions) {
+      last_session_token_.swap(session_token_);
+    }
     session_token_.clear();
     // Set the "last send time" into the far past so we'll be allowed to send an
     // update-session request at least once.
@@ -386,6 +398,15 @@ bool SessionManager::HasDataToSend() {
       (session_attempt_count_ < kMaxSessionAttempts);
 }
 
+Time SessionManager::GetNextSendTime() {
+  // HasDataToSend() requires that the current time be strictly after these
+  // times, hence the extra microsecond.
+  TimeDelta delay = (session_attempt_count_ < kMaxSessionAttempts) ?
+      config_.registration_timeout :
+      TimeDelta::FromMinutes(kWakeUpAfterGiveUpIntervalMinutes);
+  return last_send_time_ + delay + TimeDelta::FromMicroseconds(1);
+}
+
 const int SessionManager::kMaxSessionAttempts = 5;
 const int SessionManager::kWakeUpAfterGiveUpIntervalMinutes = 3 * 60;
 
@@ -34,6 +34,11 @@ enum MessageAction {
   // any registration operations that may have been lost.
   ACQUIRE_SESSION,
 
+  // We acquired a new session token from this message, and the server
+  // confirmed that the registrations of our last session carry over to it.
+  // The Ticl need not repeat any registration operations.
+  RESUME_SESSION,
+
   // We lost our session.
   LOSE_SESSION,
 
@@ -146,6 +151,13 @@ class SessionManager {
   /* Returns whether the session manager has data to send. */
   bool HasDataToSend();
 
+  /* Returns the time after which HasDataToSend() may become true without a
+   * message being sent or received: when the request for a client id or
+   * session may be repeated, or, if the client has given up, when it may start
+   * trying again.  Only meaningful while there is no session.
+   */
+  Time GetNextSendTime();
+
   /* Informs the session manager that the client is shutting down.  Any
    * subsequent outbound messages will be of type SHUTDOWN.
    */
@@ -169,6 +181,13 @@ class SessionManager {
     return session_token_;
   }
 
+  /* Returns the token of the session the client lost and may ask to resume, or
+   * the empty string if there is none.
+   */
+  const string& last_session_token() const {
+    return last_session_token_;
+  }
+
   /* Configuration parameters. */
   ClientConfig config_;
 
@@ -202,6 +221,11 @@ class SessionManager {
   /* The client's session id, or {@code null} if unassigned. */
   string session_token_;
 
+  /* If config_.resume_sessions, the token of the session the client lost since
+   * it last had one, or empty.
+   */
+  string last_session_token_;
+
   /* Whether this client has been shut down. */
   bool shutdown_;
 
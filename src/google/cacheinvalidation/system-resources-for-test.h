@@ -59,7 +59,7 @@ struct TaskEntry {
 class SystemResourcesForTest : public SystemResources {
  public:
   SystemResourcesForTest()
-      : current_id_(0), started_(false), stopped_(false),
+      : current_id_(0), num_tasks_run_(0), started_(false), stopped_(false),
         running_internal_(false) {}
 
   ~SystemResourcesForTest() {
@@ -166,6 +166,11 @@ class SystemResourcesForTest : public SystemResources {
     running_internal_ = false;
   }
 
+  // Returns the number of internal tasks RunReadyTasks() has run.
+  int64 num_tasks_run() const {
+    return num_tasks_run_;
+  }
+
   // Runs all queued listener tasks.
   void RunListenerTasks() {
     while (!listener_work_queue_.empty()) {
@@ -189,6 +194,7 @@ class SystemResourcesForTest : public SystemResources {
         work_queue_.pop();
         top_elt.task->Run();
         delete top_elt.task;
+        ++num_tasks_run_;
         return true;
       }
     }
@@ -201,6 +207,9 @@ class SystemResourcesForTest : public SystemResources {
   // The id number of the next task.
   uint64 current_id_;
 
+  // The number of internal tasks run by RunReadyTasks().
+  int64 num_tasks_run_;
+
   // Whether or not the scheduler has been started.
   bool started_;
 
@@ -17,17 +17,56 @@
 #include <algorithm>
 
 #include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/logging.h"
 #include "google/cacheinvalidation/stl-namespace.h"
 
 namespace invalidation {
 
 using INVALIDATION_STL_NAMESPACE::max;
 
+RateBudget::RateBudget(const vector<RateLimit>& rate_limits,
+                       RateBudget* parent)
+    : buckets_(rate_limits.size()), parent_(parent) {
+  for (size_t i = 0; i < rate_limits.size(); ++i) {
+    CHECK(rate_limits[i].count > 0);
+    buckets_[i].emission_interval =
+        rate_limits[i].window_size / static_cast<int64>(rate_limits[i].count);
+    buckets_[i].tolerance = buckets_[i].emission_interval *
+        static_cast<int64>(rate_limits[i].count - 1);
+  }
+}
+
+bool RateBudget::TryAcquire(Time now, TimeDelta* delay) {
+  MutexLock m(&lock_);
+
+  // A bucket has a token iff it is full at most 'tolerance' from now.
+  TimeDelta max_wait = TimeDelta::FromMicroseconds(0);
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    const Bucket& bucket = buckets_[i];
+    max_wait = max(max_wait, (bucket.full_time - bucket.tolerance) - now);
+  }
+  if (max_wait > TimeDelta::FromMicroseconds(0)) {
+    *delay = max_wait;
+    return false;
+  }
+  if ((parent_ != NULL) && !parent_->TryAcquire(now, delay)) {
+    return false;
+  }
+
+  // Take a token from each bucket.
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    Bucket* bucket = &buckets_[i];
+    bucket->full_time = max(bucket->full_time, now) +
+        bucket->emission_interval;
+  }
+  return true;
+}
+
 Throttle::Throttle(
     const vector<RateLimit>& rate_limits, SystemResources* resources,
     Closure* listener)
-    : rate_limits_(rate_limits), resources_(resources), listener_(listener),
-      timer_scheduled_(false) {
+    : rate_limits_(rate_limits), budget_(NULL), resources_(resources),
+      listener_(listener), timer_scheduled_(false) {
 
   // Find the largest 'count' in all of the rate limits, as this is the size of
   // the buffer of recent messages we need to retain.
@@ -37,12 +76,30 @@ Throttle::Throttle(
   }
 }
 
+Throttle::Throttle(RateBudget* budget, SystemResources* resources,
+                   Closure* listener)
+    : budget_(budget), resources_(resources), listener_(listener),
+      timer_scheduled_(false), max_recent_events_(0) {
+}
+
 void Throttle::Fire() {
   if (timer_scheduled_) {
     // We're already rate-limited and have a deferred call scheduled.  Just
     // return.  The flag will be reset when the deferred task runs.
     return;
   }
+  if (budget_ != NULL) {
+    TimeDelta delay;
+    if (budget_->TryAcquire(resources_->current_time(), &delay)) {
+      listener_->Run();
+    } else {
+      timer_scheduled_ = true;
+      resources_->ScheduleWithDelay(
+          delay, NewPermanentCallback(this, &Throttle::RetryFire));
+    }
+    return;
+  }
+
   // Go through all of the limits to see if we've hit one.  If so, schedule a
   // task to try again once that limit won't be violated.  If no limits would be
   // violated, send.
@@ -20,6 +20,7 @@
 #include <vector>
 
 #include "google/cacheinvalidation/invalidation-client.h"
+#include "google/cacheinvalidation/mutex.h"
 #include "google/cacheinvalidation/scoped_ptr.h"
 #include "google/cacheinvalidation/stl-namespace.h"
 #include "google/cacheinvalidation/time.h"
@@ -29,6 +30,53 @@ namespace invalidation {
 using INVALIDATION_STL_NAMESPACE::deque;
 using INVALIDATION_STL_NAMESPACE::vector;
 
+// A budget of events under a set of rate limits, enforced with one token bucket
+// per limit: a limit of 'count' events per 'window_size' allows a burst of
+// 'count' events, refilled at 'count' per 'window_size'. Unlike the sliding
+// windows of Throttle, the budget uses constant space and time per event
+// whatever the counts, but it may allow up to twice 'count' events in some
+// window of 'window_size' (a full burst followed by a full refill).
+//
+// A budget may have a parent budget, from which every event must also be
+// allowed. This lets the throttles of many clients each have limits of their
+// own and share one aggregate limit. Budgets are thread-safe.
+class RateBudget {
+ public:
+  // Constructs a budget for the given rate limits, under parent if it is not
+  // NULL. Ownership of parent is retained by the caller.
+  RateBudget(const vector<RateLimit>& rate_limits, RateBudget* parent);
+
+  // If an event at now is within the budget (and its parent's), takes it from
+  // the budget and returns true. Otherwise, stores in *delay how long to wait
+  // before trying again and returns false.
+  bool TryAcquire(Time now, TimeDelta* delay);
+
+ private:
+  // The state of the token bucket for one rate limit, kept as the time at
+  // which the bucket will be full again (the "theoretical arrival time" of the
+  // generic cell rate algorithm).
+  struct Bucket {
+    // The time in which one token is refilled.
+    TimeDelta emission_interval;
+
+    // How far full_time may be in the future while tokens remain, i.e., the
+    // time to refill all but one token.
+    TimeDelta tolerance;
+
+    // The time at which the bucket is full.
+    Time full_time;
+  };
+
+  // The buckets, one per rate limit.
+  vector<Bucket> buckets_;
+
+  // Budget from which events must also be allowed, if not NULL.
+  RateBudget* parent_;
+
+  // Lock for the buckets.
+  Mutex lock_;
+};
+
 // Provides an abstraction for multi-level rate-limiting.  For example, the
 // default limits state that no more than one message should be sent per second,
 // or six per minute.  Rate-limiting is implemented by maintaining a buffer of
@@ -42,6 +90,11 @@ class Throttle {
   Throttle(const vector<RateLimit>& rate_limits, SystemResources* resources,
            Closure* listener);
 
+  // Constructs a throttler that enforces the limits of budget (which may be
+  // shared with other throttlers) instead of rate limits of its own. Ownership
+  // of budget and resources is retained by the caller.
+  Throttle(RateBudget* budget, SystemResources* resources, Closure* listener);
+
   // If calling the listener would not violate the rate limits, does so.
   // Otherwise, schedules a timer to do so as soon as doing so would not violate
   // the rate limits, unless such a timer is already set, in which case does
@@ -59,6 +112,9 @@ class Throttle {
   // Rate limits to be enforced by this object.
   vector<RateLimit> rate_limits_;
 
+  // Budget to take events from instead of enforcing rate_limits_, if not NULL.
+  RateBudget* budget_;
+
   // System resources for reading the current time and scheduling tasks that
   // need to be delayed.
   SystemResources* resources_;
@@ -0,0 +1,108 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Bounded cache of the highest version of each object that the application
+// has acknowledged.
+
+#include "google/cacheinvalidation/v2/acked-version-cache.h"
+
+#include "google/cacheinvalidation/v2/logging.h"
+#include "google/cacheinvalidation/v2/memory-usage.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+AckedVersionCache::AckedVersionCache(int capacity)
+    : capacity_(capacity), hand_(0) {
+  CHECK(capacity > 0) << "Capacity must be positive: " << capacity;
+}
+
+bool AckedVersionCache::RecordAck(const ObjectIdP& oid, int64 version) {
+  oid.SerializeToString(&key_buffer_);
+  map<string, int>::iterator iter = index_.find(key_buffer_);
+  if (iter != index_.end()) {
+    Slot& slot = slots_[iter->second];
+    if (version > slot.version) {
+      slot.version = version;
+    }
+    slot.is_referenced = true;
+    return false;
+  }
+  bool is_eviction = (size() == capacity_);
+  int slot_index;
+  if (is_eviction) {
+    slot_index = EvictSlot();
+  } else {
+    slot_index = size();
+    slots_.push_back(Slot());
+  }
+  Slot& slot = slots_[slot_index];
+  slot.key = key_buffer_;
+  slot.version = version;
+  // A new object has not been used again yet, so it is the first candidate
+  // for eviction until it is.
+  slot.is_referenced = false;
+  index_.insert(make_pair(slot.key, slot_index));
+  return is_eviction;
+}
+
+bool AckedVersionCache::IsAcknowledged(const ObjectIdP& oid, int64 version) {
+  if (slots_.empty()) {
+    return false;
+  }
+  oid.SerializeToString(&key_buffer_);
+  map<string, int>::iterator iter = index_.find(key_buffer_);
+  if (iter == index_.end()) {
+    return false;
+  }
+  Slot& slot = slots_[iter->second];
+  slot.is_referenced = true;
+  return version <= slot.version;
+}
+
+void AckedVersionCache::GetVersions(vector<InvalidationP>* versions) const {
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    versions->push_back(InvalidationP());
+    InvalidationP* invalidation = &versions->back();
+    invalidation->mutable_object_id()->ParseFromString(slots_[i].key);
+    invalidation->set_is_known_version(true);
+    invalidation->set_version(slots_[i].version);
+  }
+}
+
+size_t AckedVersionCache::GetAllocatedBytes() const {
+  size_t bytes = slots_.capacity() * sizeof(Slot) +
+      MemoryUsage::TreeNodeBytes(index_) +
+      MemoryUsage::StringBytes(key_buffer_);
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    // Each key is held by its slot and by the index.
+    bytes += 2 * MemoryUsage::StringBytes(slots_[i].key);
+  }
+  return bytes;
+}
+
+int AckedVersionCache::EvictSlot() {
+  // Every full sweep clears all the referenced bits, so this ends within two.
+  while (slots_[hand_].is_referenced) {
+    slots_[hand_].is_referenced = false;
+    hand_ = (hand_ + 1) % size();
+  }
+  int slot_index = hand_;
+  hand_ = (hand_ + 1) % size();
+  index_.erase(slots_[slot_index].key);
+  return slot_index;
+}
+
+}  // namespace invalidation
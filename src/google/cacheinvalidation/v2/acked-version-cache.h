@@ -0,0 +1,112 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Bounded cache of the highest version of each object that the application
+// has acknowledged, used to drop invalidations that it has already processed.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_ACKED_VERSION_CACHE_H_
+#define GOOGLE_CACHEINVALIDATION_V2_ACKED_VERSION_CACHE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* A map from object ids to the highest known version acknowledged for each,
+ * holding at most capacity objects. Once full, an object is evicted to make
+ * room for a new one with the CLOCK algorithm: the slots are swept in a
+ * circle, and a slot that was looked up or recorded since the hand last
+ * passed it gets a second chance. An evicted object is simply no longer
+ * known, so the cache can only miss stale invalidations, never drop fresh
+ * ones.
+ */
+class AckedVersionCache {
+ public:
+  /* Creates an empty cache for at most capacity objects.
+   *
+   * REQUIRES: capacity > 0.
+   */
+  explicit AckedVersionCache(int capacity);
+
+  /* Records that version of oid was acknowledged, unless a higher version
+   * already was. Returns whether another object was evicted to make room.
+   */
+  bool RecordAck(const ObjectIdP& oid, int64 version);
+
+  /* Returns whether a version of oid at or above version has been
+   * acknowledged, as far as the cache knows.
+   */
+  bool IsAcknowledged(const ObjectIdP& oid, int64 version);
+
+  /* Appends to versions the highest version acknowledged for each object in
+   * the cache, as known-version invalidations.
+   */
+  void GetVersions(vector<InvalidationP>* versions) const;
+
+  /* Returns the number of objects in the cache. */
+  int size() const {
+    return static_cast<int>(slots_.size());
+  }
+
+  int capacity() const {
+    return capacity_;
+  }
+
+  /* Returns the approximate number of heap bytes held by the cache. */
+  size_t GetAllocatedBytes() const;
+
+ private:
+  /* An object in the cache. */
+  struct Slot {
+    /* The serialized object id. */
+    string key;
+
+    /* The highest version acknowledged. */
+    int64 version;
+
+    /* Whether the slot was used since the hand last passed it. */
+    bool is_referenced;
+  };
+
+  /* Returns the index of a slot to reuse, after removing its object. */
+  int EvictSlot();
+
+  /* The maximum number of objects. */
+  int capacity_;
+
+  /* The objects, in no particular order. */
+  vector<Slot> slots_;
+
+  /* The index in slots_ of each object, by serialized object id. */
+  map<string, int> index_;
+
+  /* The next slot that the CLOCK hand considers for eviction. */
+  int hand_;
+
+  /* Reused buffer for serializing object ids. */
+  string key_buffer_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_ACKED_VERSION_CACHE_H_
@@ -0,0 +1,301 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Network channel shared by many clients in one process.
+
+#include "google/cacheinvalidation/v2/channel-multiplexer.h"
+
+#include <utility>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/v2/log-macro.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/wire_format_lite.h"
+#include "google/cacheinvalidation/v2/proto-helpers.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+using INVALIDATION_STL_NAMESPACE::pair;
+using ::google::protobuf::io::CodedInputStream;
+using ::google::protobuf::internal::WireFormatLite;
+
+/* Sets *key to the key with which the server addresses the sender of message,
+ * a serialized ClientToServerMessage: the token in its header, or the nonce
+ * in its initialize message if it has no token. Only the header and the
+ * initialize message are parsed; the other fields, which hold the bulk of the
+ * message, are skipped. Returns false if message is malformed.
+ */
+static bool GetRoutingKey(const string& message, string* key) {
+  CodedInputStream input(reinterpret_cast<const uint8*>(message.data()),
+                         message.size());
+  string field_bytes;
+  string nonce;
+  uint32 tag;
+  while ((tag = input.ReadTag()) != 0) {
+    int field_number = WireFormatLite::GetTagFieldNumber(tag);
+    bool is_routing_field =
+        (field_number == ClientToServerMessage::kHeaderFieldNumber) ||
+        (field_number == ClientToServerMessage::kInitializeMessageFieldNumber);
+    if (!is_routing_field || (WireFormatLite::GetTagWireType(tag) !=
+                              WireFormatLite::WIRETYPE_LENGTH_DELIMITED)) {
+      if (!WireFormatLite::SkipField(&input, tag)) {
+        return false;
+      }
+      continue;
+    }
+    uint32 length;
+    if (!input.ReadVarint32(&length) ||
+        !input.ReadString(&field_bytes, length)) {
+      return false;
+    }
+    if (field_number == ClientToServerMessage::kHeaderFieldNumber) {
+      ClientHeader header;
+      if (!header.ParseFromString(field_bytes)) {
+        return false;
+      }
+      if (!header.client_token().empty()) {
+        // The token takes precedence, so the rest need not be looked at.
+        *key = header.client_token();
+        return true;
+      }
+    } else {
+      InitializeMessage initialize_message;
+      if (!initialize_message.ParseFromString(field_bytes)) {
+        return false;
+      }
+      nonce = initialize_message.nonce();
+    }
+  }
+  if (!input.ConsumedEntireMessage()) {
+    return false;
+  }
+  key->swap(nonce);
+  return true;
+}
+
+/* The channel of one client. Messages are sent through the multiplexer, which
+ * delivers the messages for the client with DeliverMessage.
+ *
+ * The receivers must be set before the underlying network delivers any
+ * messages, as for any network channel.
+ */
+class ChannelMultiplexer::ClientChannel : public NetworkChannel {
+ public:
+  explicit ClientChannel(ChannelMultiplexer* multiplexer)
+      : multiplexer_(multiplexer) {}
+
+  virtual ~ClientChannel() {
+    for (size_t i = 0; i < network_status_receivers_.size(); ++i) {
+      delete network_status_receivers_[i];
+    }
+  }
+
+  virtual void SendMessage(const string& outgoing_message) {
+    string message(outgoing_message);
+    multiplexer_->SendMessage(this, &message);
+  }
+
+  virtual void SendMessage(string* outgoing_message) {
+    multiplexer_->SendMessage(this, outgoing_message);
+  }
+
+  virtual void SetMessageReceiver(MessageCallback* incoming_receiver) {
+    message_receiver_.reset(incoming_receiver);
+  }
+
+  virtual void SetMessageBufferReceiver(
+      MessageBufferCallback* incoming_receiver) {
+    message_buffer_receiver_.reset(incoming_receiver);
+  }
+
+  virtual void AddNetworkStatusReceiver(
+      NetworkStatusCallback* network_status_receiver) {
+    network_status_receivers_.push_back(network_status_receiver);
+  }
+
+  /* Gives *message to the receiver, which may take its contents. */
+  void DeliverMessage(string* message) {
+    if (message_buffer_receiver_.get() != NULL) {
+      message_buffer_receiver_->Run(message);
+    } else if (message_receiver_.get() != NULL) {
+      message_receiver_->Run(*message);
+    }
+  }
+
+  /* Informs the network status receivers of status. */
+  void DeliverNetworkStatus(bool status) {
+    for (size_t i = 0; i < network_status_receivers_.size(); ++i) {
+      network_status_receivers_[i]->Run(status);
+    }
+  }
+
+  /* The token or nonce with which the server addresses this client. Accessed
+   * with the multiplexer's lock held.
+   */
+  string routing_key;
+
+ private:
+  ChannelMultiplexer* multiplexer_;
+  scoped_ptr<MessageCallback> message_receiver_;
+  scoped_ptr<MessageBufferCallback> message_buffer_receiver_;
+  vector<NetworkStatusCallback*> network_status_receivers_;
+};
+
+ChannelMultiplexer::ChannelMultiplexer(
+    NetworkChannel* network, Scheduler* scheduler, Logger* logger,
+    TimeDelta batching_delay)
+    : network_(network),
+      scheduler_(scheduler),
+      logger_(logger),
+      batching_delay_(batching_delay),
+      is_batch_scheduled_(false) {
+  network_->SetMessageReceiver(NewPermanentCallback(
+      this, &ChannelMultiplexer::HandleIncomingBatch));
+  network_->AddNetworkStatusReceiver(NewPermanentCallback(
+      this, &ChannelMultiplexer::HandleNetworkStatus));
+}
+
+ChannelMultiplexer::~ChannelMultiplexer() {
+  for (size_t i = 0; i < clients_.size(); ++i) {
+    delete clients_[i];
+  }
+}
+
+NetworkChannel* ChannelMultiplexer::NewClientChannel() {
+  MutexLock m(&lock_);
+  ClientChannel* channel = new ClientChannel(this);
+  clients_.push_back(channel);
+  return channel;
+}
+
+int ChannelMultiplexer::num_clients() {
+  MutexLock m(&lock_);
+  return clients_.size();
+}
+
+void ChannelMultiplexer::SendMessage(ClientChannel* channel,
+                                     string* message) {
+  // The server addresses the client by its token, or by the nonce in its
+  // initialize message until it has one.
+  string key;
+  if (!GetRoutingKey(*message, &key)) {
+    TLOG(logger_, WARNING, "Dropping unparseable outgoing message: %s",
+         ProtoHelpers::ToString(*message).c_str());
+    return;
+  }
+
+  bool must_schedule;
+  {
+    MutexLock m(&lock_);
+    if (!key.empty()) {
+      SetRoutingKey(channel, key);
+    }
+    pending_messages_.push_back(string());
+    pending_messages_.back().swap(*message);
+    must_schedule = !is_batch_scheduled_;
+    is_batch_scheduled_ = true;
+  }
+  if (must_schedule) {
+    scheduler_->Schedule(batching_delay_, NewPermanentCallback(
+        this, &ChannelMultiplexer::SendBatch));
+  }
+}
+
+void ChannelMultiplexer::SendBatch() {
+  ClientToServerMessageBatch batch;
+  {
+    MutexLock m(&lock_);
+    is_batch_scheduled_ = false;
+    for (size_t i = 0; i < pending_messages_.size(); ++i) {
+      batch.add_message()->swap(pending_messages_[i]);
+    }
+    pending_messages_.clear();
+  }
+  TLOG(logger_, FINE, "Sending batch of %d messages", batch.message_size());
+  string serialized;
+  batch.SerializeToString(&serialized);
+  network_->SendMessage(&serialized);
+}
+
+void ChannelMultiplexer::HandleIncomingBatch(const string& batch_message) {
+  ServerToClientMessageBatch batch;
+  if (!batch.ParseFromString(batch_message)) {
+    TLOG(logger_, WARNING, "Dropping unparseable incoming batch: %s",
+         ProtoHelpers::ToString(batch_message).c_str());
+    return;
+  }
+
+  // Route the messages with the lock held, but deliver them without it, since
+  // the receivers may send messages.
+  vector<pair<ClientChannel*, string*> > deliveries;
+  {
+    MutexLock m(&lock_);
+    ServerToClientMessage message;
+    for (int i = 0; i < batch.message_size(); ++i) {
+      if (!message.ParseFromString(batch.message(i))) {
+        TLOG(logger_, WARNING, "Dropping unparseable incoming message: %s",
+             ProtoHelpers::ToString(batch.message(i)).c_str());
+        continue;
+      }
+      map<string, ClientChannel*>::iterator iter =
+          clients_by_key_.find(message.header().client_token());
+      if (iter == clients_by_key_.end()) {
+        TLOG(logger_, WARNING, "Dropping message for unknown client: %s",
+             ProtoHelpers::ToString(message.header().client_token()).c_str());
+        continue;
+      }
+      ClientChannel* channel = iter->second;
+
+      // Later messages for the client will be addressed to its new token,
+      // possibly before the client sends one with it.
+      if (message.has_token_control_message() &&
+          message.token_control_message().has_new_token()) {
+        SetRoutingKey(channel, message.token_control_message().new_token());
+      }
+      deliveries.push_back(make_pair(channel, batch.mutable_message(i)));
+    }
+  }
+  for (size_t i = 0; i < deliveries.size(); ++i) {
+    deliveries[i].first->DeliverMessage(deliveries[i].second);
+  }
+}
+
+void ChannelMultiplexer::HandleNetworkStatus(bool status) {
+  vector<ClientChannel*> clients;
+  {
+    MutexLock m(&lock_);
+    clients = clients_;
+  }
+  for (size_t i = 0; i < clients.size(); ++i) {
+    clients[i]->DeliverNetworkStatus(status);
+  }
+}
+
+void ChannelMultiplexer::SetRoutingKey(ClientChannel* channel,
+                                       const string& key) {
+  if (channel->routing_key == key) {
+    return;
+  }
+  map<string, ClientChannel*>::iterator iter =
+      clients_by_key_.find(channel->routing_key);
+  if ((iter != clients_by_key_.end()) && (iter->second == channel)) {
+    clients_by_key_.erase(iter);
+  }
+  clients_by_key_[key] = channel;
+  channel->routing_key = key;
+}
+
+}  // namespace invalidation
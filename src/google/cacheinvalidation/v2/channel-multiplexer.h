@@ -0,0 +1,115 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Network channel shared by many clients in one process.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_CHANNEL_MULTIPLEXER_H_
+#define GOOGLE_CACHEINVALIDATION_V2_CHANNEL_MULTIPLEXER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/mutex.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Multiplexes the network channels of many clients (e.g., one
+ * InvalidationClientImpl per tenant in a backend process) over one
+ * NetworkChannel.
+ *
+ * Each client is given its own NetworkChannel by NewClientChannel. The
+ * messages the clients send are collected and sent as one
+ * ClientToServerMessageBatch at most batching_delay after the first of them,
+ * using a single timer for all the clients. Each message received from the
+ * network is a ServerToClientMessageBatch whose messages are delivered to the
+ * clients by the token (or nonce) in their headers, as learnt from the
+ * messages of each client. Network status changes are passed on to all the
+ * clients.
+ *
+ * This class is thread-safe: the clients may send messages on any thread.
+ */
+class ChannelMultiplexer {
+ public:
+  /* Creates a multiplexer over network, which it installs itself as the
+   * receiver of. The caller keeps ownership of network, scheduler (on which
+   * batches are sent) and logger.
+   */
+  ChannelMultiplexer(NetworkChannel* network, Scheduler* scheduler,
+                     Logger* logger, TimeDelta batching_delay);
+
+  ~ChannelMultiplexer();
+
+  /* Returns a new channel for one client. The channel is owned by the
+   * multiplexer and is valid as long as the multiplexer.
+   */
+  NetworkChannel* NewClientChannel();
+
+  /* Returns the number of client channels. */
+  int num_clients();
+
+ private:
+  class ClientChannel;
+
+  /* Queues message from channel for the next batch, taking its contents, and
+   * notes the key with which messages from the server for channel are
+   * addressed.
+   */
+  void SendMessage(ClientChannel* channel, string* message);
+
+  /* Sends the queued messages to the network as one batch. */
+  void SendBatch();
+
+  /* Delivers the messages in batch to the clients they are addressed to. */
+  void HandleIncomingBatch(const string& batch);
+
+  /* Passes status on to all the clients. */
+  void HandleNetworkStatus(bool status);
+
+  /* Makes messages addressed to key go to channel. Requires that lock_ is
+   * held.
+   */
+  void SetRoutingKey(ClientChannel* channel, const string& key);
+
+  NetworkChannel* network_;
+  Scheduler* scheduler_;
+  Logger* logger_;
+  TimeDelta batching_delay_;
+
+  /* Lock for the fields below. */
+  Mutex lock_;
+
+  /* The channels given out by NewClientChannel. Owned. */
+  vector<ClientChannel*> clients_;
+
+  /* The client to which messages addressed to each token or nonce go. */
+  map<string, ClientChannel*> clients_by_key_;
+
+  /* Serialized messages waiting for the next batch. */
+  vector<string> pending_messages_;
+
+  /* Whether SendBatch has been scheduled and has not yet run. */
+  bool is_batch_scheduled_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_CHANNEL_MULTIPLEXER_H_
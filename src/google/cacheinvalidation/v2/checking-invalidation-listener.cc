@@ -17,23 +17,159 @@
 
 #include "google/cacheinvalidation/v2/checking-invalidation-listener.h"
 #include "google/cacheinvalidation/v2/log-macro.h"
+#include "google/cacheinvalidation/v2/pooled-callback.h"
+#include "google/cacheinvalidation/v2/trace.h"
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+// Returns the object id of a batch entry.
+static const ObjectId& GetObjectId(const ObjectId& object_id) {
+  return object_id;
+}
+
+static const ObjectId& GetObjectId(const Invalidation& invalidation) {
+  return invalidation.object_id();
+}
+
 CheckingInvalidationListener::CheckingInvalidationListener(
     InvalidationListener* delegate, Statistics* statistics,
     Scheduler* internal_scheduler, Scheduler* listener_scheduler,
-    Logger* logger)
+    Logger* logger, int num_dispatch_threads, bool coalesce_invalidations)
     : delegate_(delegate),
       statistics_(statistics),
       internal_scheduler_(internal_scheduler),
       listener_scheduler_(listener_scheduler),
-      logger_(logger) {
+      logger_(logger),
+      trace_id_(0),
+      coalesce_invalidations_(coalesce_invalidations) {
   CHECK(delegate != NULL);
   CHECK(statistics != NULL);
   CHECK(internal_scheduler_ != NULL);
   CHECK(listener_scheduler != NULL);
   CHECK(logger != NULL);
+  if (num_dispatch_threads > 0) {
+    object_dispatcher_.reset(new ShardedDispatcher(num_dispatch_threads));
+  }
+}
+
+Closure* CheckingInvalidationListener::TraceUpcall(Closure* task) {
+#ifdef INVALIDATION_ENABLE_TRACING
+  TICL_TRACE(TRACE_LISTENER_SCHEDULED, trace_id_);
+  return NewPooledCallback(
+      this, &CheckingInvalidationListener::RunTracedUpcall, trace_id_, task);
+#else
+  return task;
+#endif
+}
+
+void CheckingInvalidationListener::RunTracedUpcall(uint64 trace_id,
+                                                   Closure* task) {
+  TICL_TRACE(TRACE_LISTENER_UPCALL, trace_id);
+  task->Run();
+  delete task;
+}
+
+bool CheckingInvalidationListener::CoalesceInvalidation(
+    InvalidationClient* client, const Invalidation& invalidation,
+    const AckHandle& ack_handle) {
+  AckHandle superseded_ack_handle(ack_handle);
+  {
+    MutexLock m(&pending_lock_);
+    pair<PendingMap::iterator, bool> result =
+        pending_invalidations_.insert(make_pair(
+            invalidation.object_id(), make_pair(invalidation, ack_handle)));
+    if (result.second) {
+      return true;
+    }
+    pair<Invalidation, AckHandle>& pending = result.first->second;
+    if (pending.first.version() < invalidation.version()) {
+      superseded_ack_handle = pending.second;
+      pending.first = invalidation;
+      pending.second = ack_handle;
+    }
+  }
+  TLOG(logger_, FINE, "Coalesced invalidations of an object of source %d",
+       invalidation.object_id().source());
+  client->Acknowledge(superseded_ack_handle);
+  return false;
+}
+
+pair<Invalidation, AckHandle>
+CheckingInvalidationListener::TakeCoalescedInvalidation(
+    const ObjectId& object_id) {
+  MutexLock m(&pending_lock_);
+  PendingMap::iterator iter = pending_invalidations_.find(object_id);
+  CHECK(iter != pending_invalidations_.end());
+  pair<Invalidation, AckHandle> entry(iter->second);
+  pending_invalidations_.erase(iter);
+  return entry;
+}
+
+void CheckingInvalidationListener::IssueCoalescedInvalidation(
+    InvalidationClient* client, const ObjectId& object_id) {
+  pair<Invalidation, AckHandle> entry(TakeCoalescedInvalidation(object_id));
+  delegate_->Invalidate(client, entry.first, entry.second);
+}
+
+void CheckingInvalidationListener::IssueCoalescedBatch(
+    InvalidationClient* client, const vector<ObjectId>& object_ids) {
+  vector<pair<Invalidation, AckHandle> > batch;
+  batch.reserve(object_ids.size());
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    batch.push_back(TakeCoalescedInvalidation(object_ids[i]));
+  }
+  delegate_->InvalidateBatch(client, batch);
+}
+
+void CheckingInvalidationListener::DispatchForObject(
+    const ObjectId& object_id, Closure* task) {
+  task = TraceUpcall(task);
+  if (object_dispatcher_.get() == NULL) {
+    listener_scheduler_->Schedule(Scheduler::NoDelay(), task);
+    return;
+  }
+  object_dispatcher_->Dispatch(object_id.hash(), task);
+}
+
+void CheckingInvalidationListener::DispatchForAll(Closure* task) {
+  if (object_dispatcher_.get() == NULL) {
+    listener_scheduler_->Schedule(Scheduler::NoDelay(), task);
+    return;
+  }
+  object_dispatcher_->DispatchToAll(task);
+}
+
+template <class Entry>
+void CheckingInvalidationListener::DispatchBatch(
+    InvalidationClient* client, vector<Entry>* batch,
+    void (InvalidationListener::*method)(InvalidationClient*,
+                                         const vector<Entry>&)) {
+  if (batch->empty()) {
+    return;
+  }
+  if (object_dispatcher_.get() == NULL) {
+    listener_scheduler_->Schedule(
+        Scheduler::NoDelay(),
+        TraceUpcall(NewPooledSwapCallback(delegate_, method, client, batch)));
+    return;
+  }
+  // Split the batch by dispatch thread, keeping the order within each part.
+  int num_threads = object_dispatcher_->num_threads();
+  vector<vector<Entry> > parts(num_threads);
+  for (size_t i = 0; i < batch->size(); ++i) {
+    uint64 key = GetObjectId((*batch)[i].first).hash();
+    parts[key % num_threads].push_back((*batch)[i]);
+  }
+  batch->clear();
+  for (int i = 0; i < num_threads; ++i) {
+    if (!parts[i].empty()) {
+      object_dispatcher_->Dispatch(
+          i, TraceUpcall(
+              NewPooledSwapCallback(delegate_, method, client, &parts[i])));
+    }
+  }
 }
 
 void CheckingInvalidationListener::Invalidate(
@@ -41,9 +177,20 @@ void CheckingInvalidationListener::Invalidate(
     const AckHandle& ack_handle) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(Statistics::ListenerEventType_INVALIDATE);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
-      NewPermanentCallback(
+  if (coalesce_invalidations_) {
+    if (CoalesceInvalidation(client, invalidation, ack_handle)) {
+      // The upcall issues whichever invalidation is waiting when it runs.
+      DispatchForObject(
+          invalidation.object_id(),
+          NewPooledCallback(
+              this, &CheckingInvalidationListener::IssueCoalescedInvalidation,
+              client, invalidation.object_id()));
+    }
+    return;
+  }
+  DispatchForObject(
+      invalidation.object_id(),
+      NewPooledCallback(
           delegate_, &InvalidationListener::Invalidate, client, invalidation,
           ack_handle));
 }
@@ -54,9 +201,9 @@ void CheckingInvalidationListener::InvalidateUnknownVersion(
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(
       Statistics::ListenerEventType_INVALIDATE_UNKNOWN);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
-      NewPermanentCallback(
+  DispatchForObject(
+      object_id,
+      NewPooledCallback(
           delegate_, &InvalidationListener::InvalidateUnknownVersion, client,
           object_id, ack_handle));
 }
@@ -66,11 +213,10 @@ void CheckingInvalidationListener::InvalidateAll(
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(
       Statistics::ListenerEventType_INVALIDATE_ALL);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
-      NewPermanentCallback(
+  DispatchForAll(
+      TraceUpcall(NewPooledCallback(
           delegate_, &InvalidationListener::InvalidateAll, client,
-          ack_handle));
+          ack_handle)));
 }
 
 void CheckingInvalidationListener::InformRegistrationFailure(
@@ -79,9 +225,9 @@ void CheckingInvalidationListener::InformRegistrationFailure(
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(
       Statistics::ListenerEventType_INFORM_REGISTRATION_FAILURE);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
-      NewPermanentCallback(
+  DispatchForObject(
+      object_id,
+      NewPooledCallback(
           delegate_, &InvalidationListener::InformRegistrationFailure, client,
           object_id, is_transient, error_message));
 }
@@ -92,9 +238,9 @@ void CheckingInvalidationListener::InformRegistrationStatus(
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(
       Statistics::ListenerEventType_INFORM_REGISTRATION_STATUS);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
-      NewPermanentCallback(
+  DispatchForObject(
+      object_id,
+      NewPooledCallback(
           delegate_, &InvalidationListener::InformRegistrationStatus, client,
           object_id, reg_state));
 }
@@ -104,9 +250,8 @@ void CheckingInvalidationListener::ReissueRegistrations(
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(
       Statistics::ListenerEventType_REISSUE_REGISTRATIONS);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
-      NewPermanentCallback(
+  DispatchForAll(
+      NewPooledCallback(
           delegate_, &InvalidationListener::ReissueRegistrations,
           client, prefix, prefix_len));
 }
@@ -116,18 +261,96 @@ void CheckingInvalidationListener::InformError(
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(
       Statistics::ListenerEventType_INFORM_ERROR);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
-      NewPermanentCallback(
+  DispatchForAll(
+      NewPooledCallback(
           delegate_, &InvalidationListener::InformError, client, error_info));
 }
 
 void CheckingInvalidationListener::Ready(InvalidationClient* client) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   TLOG(logger_, INFO, "Informing app that ticl is ready");
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
-      NewPermanentCallback(delegate_, &InvalidationListener::Ready, client));
+  DispatchForAll(
+      NewPooledCallback(delegate_, &InvalidationListener::Ready, client));
+}
+
+void CheckingInvalidationListener::InvalidateBatch(
+    InvalidationClient* client,
+    const vector<pair<Invalidation, AckHandle> >& invalidations) {
+  vector<pair<Invalidation, AckHandle> > batch(invalidations);
+  TakeInvalidationBatch(client, &batch);
+}
+
+void CheckingInvalidationListener::TakeInvalidationBatch(
+    InvalidationClient* client,
+    vector<pair<Invalidation, AckHandle> >* batch) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  const vector<pair<Invalidation, AckHandle> >& invalidations = *batch;
+  for (size_t i = 0; i < invalidations.size(); ++i) {
+    statistics_->RecordListenerEvent(Statistics::ListenerEventType_INVALIDATE);
+  }
+  if (!coalesce_invalidations_) {
+    DispatchBatch(client, batch, &InvalidationListener::InvalidateBatch);
+    return;
+  }
+
+  // Keep the invalidations that are not merged into waiting ones, split by
+  // dispatch thread as DispatchBatch does.
+  int num_parts = (object_dispatcher_.get() == NULL) ? 1 :
+      object_dispatcher_->num_threads();
+  vector<vector<ObjectId> > parts(num_parts);
+  for (size_t i = 0; i < invalidations.size(); ++i) {
+    const ObjectId& object_id = invalidations[i].first.object_id();
+    if (CoalesceInvalidation(client, invalidations[i].first,
+                             invalidations[i].second)) {
+      parts[object_id.hash() % num_parts].push_back(object_id);
+    }
+  }
+  batch->clear();
+  for (int i = 0; i < num_parts; ++i) {
+    if (parts[i].empty()) {
+      continue;
+    }
+    Closure* task = TraceUpcall(NewPooledSwapCallback(
+        this, &CheckingInvalidationListener::IssueCoalescedBatch, client,
+        &parts[i]));
+    if (object_dispatcher_.get() == NULL) {
+      listener_scheduler_->Schedule(Scheduler::NoDelay(), task);
+    } else {
+      object_dispatcher_->Dispatch(i, task);
+    }
+  }
+}
+
+void CheckingInvalidationListener::InvalidateUnknownVersionBatch(
+    InvalidationClient* client,
+    const vector<pair<ObjectId, AckHandle> >& invalidations) {
+  vector<pair<ObjectId, AckHandle> > batch(invalidations);
+  TakeInvalidationUnknownVersionBatch(client, &batch);
+}
+
+void CheckingInvalidationListener::TakeInvalidationUnknownVersionBatch(
+    InvalidationClient* client,
+    vector<pair<ObjectId, AckHandle> >* invalidations) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  for (size_t i = 0; i < invalidations->size(); ++i) {
+    statistics_->RecordListenerEvent(
+        Statistics::ListenerEventType_INVALIDATE_UNKNOWN);
+  }
+  DispatchBatch(client, invalidations,
+                &InvalidationListener::InvalidateUnknownVersionBatch);
+}
+
+void CheckingInvalidationListener::InformRegistrationStatusBatch(
+    InvalidationClient* client,
+    const vector<pair<ObjectId, RegistrationState> >& reg_states) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  for (size_t i = 0; i < reg_states.size(); ++i) {
+    statistics_->RecordListenerEvent(
+        Statistics::ListenerEventType_INFORM_REGISTRATION_STATUS);
+  }
+  vector<pair<ObjectId, RegistrationState> > batch(reg_states);
+  DispatchBatch(client, &batch,
+                &InvalidationListener::InformRegistrationStatusBatch);
 }
 
 }  // namespace invalidation
@@ -18,20 +18,51 @@
 #ifndef GOOGLE_CACHEINVALIDATION_V2_CHECKING_INVALIDATION_LISTENER_H_
 #define GOOGLE_CACHEINVALIDATION_V2_CHECKING_INVALIDATION_LISTENER_H_
 
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/stl-namespace.h"
 #include "google/cacheinvalidation/v2/invalidation-client.h"
 #include "google/cacheinvalidation/v2/invalidation-listener.h"
+#include "google/cacheinvalidation/v2/mutex.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/sharded-dispatcher.h"
 #include "google/cacheinvalidation/v2/system-resources.h"
 #include "google/cacheinvalidation/v2/types.h"
 #include "google/cacheinvalidation/v2/statistics.h"
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
 class CheckingInvalidationListener : public InvalidationListener {
  public:
+  /* Creates a listener that issues the upcalls to delegate on
+   * listener_scheduler. If num_dispatch_threads is positive, the upcalls about
+   * a single object (invalidations and registration status and failures) are
+   * instead issued on a pool of that many threads, picked by object id, so
+   * that they stay in order for each object but run in parallel across
+   * objects. The other upcalls (Ready, InvalidateAll, ReissueRegistrations
+   * and InformError) are then issued on one of those threads once all of them
+   * have issued the per-object upcalls before it, and before any issues the
+   * ones after, so they stay in order with all objects. Since upcalls run on
+   * several threads at once, the delegate must then be thread-safe.
+   *
+   * If coalesce_invalidations, an invalidation for a known version of an
+   * object that is still waiting to be issued is replaced by a later one for
+   * a newer version of the object, which subsumes it: the delegate sees only
+   * the newest version, and the superseded invalidations (older or equal
+   * versions) are acknowledged on its behalf.
+   */
   CheckingInvalidationListener(
       InvalidationListener* delegate, Statistics* statistics,
       Scheduler* internal_scheduler, Scheduler* listener_scheduler,
-      Logger* logger);
+      Logger* logger, int num_dispatch_threads, bool coalesce_invalidations);
 
   virtual ~CheckingInvalidationListener() {}
 
@@ -60,6 +91,13 @@ class CheckingInvalidationListener : public InvalidationListener {
   virtual void InformError(
       InvalidationClient* client, const ErrorInfo& error_info);
 
+  /* Sets the trace id of the message about which the next upcalls are issued
+   * (see trace.h).
+   */
+  void set_trace_id(uint64 trace_id) {
+    trace_id_ = trace_id;
+  }
+
   /* Returns the delegate InvalidationListener. */
   InvalidationListener* delegate() {
     return delegate_;
@@ -67,7 +105,91 @@ class CheckingInvalidationListener : public InvalidationListener {
 
   virtual void Ready(InvalidationClient* client);
 
+  /* Each batch is issued in one upcall (or, with a dispatch pool, one per
+   * dispatch thread, with the entries that belong to it).
+   */
+  virtual void InvalidateBatch(
+      InvalidationClient* client,
+      const vector<pair<Invalidation, AckHandle> >& invalidations);
+
+  virtual void InvalidateUnknownVersionBatch(
+      InvalidationClient* client,
+      const vector<pair<ObjectId, AckHandle> >& invalidations);
+
+  virtual void InformRegistrationStatusBatch(
+      InvalidationClient* client,
+      const vector<pair<ObjectId, RegistrationState> >& reg_states);
+
+  /* Like InvalidateBatch and InvalidateUnknownVersionBatch, but take the
+   * entries of *invalidations, which are left empty, into the upcall instead
+   * of copying them, for callers that build a batch only to issue it.
+   */
+  void TakeInvalidationBatch(
+      InvalidationClient* client,
+      vector<pair<Invalidation, AckHandle> >* batch);
+
+  void TakeInvalidationUnknownVersionBatch(
+      InvalidationClient* client,
+      vector<pair<ObjectId, AckHandle> >* invalidations);
+
  private:
+  typedef map<ObjectId, pair<Invalidation, AckHandle>, ObjectIdLess>
+      PendingMap;
+
+  /* Keeps invalidation waiting to be issued, unless an invalidation for its
+   * object already is: then only the one for the newer version is kept, and
+   * the other one acknowledged. Returns whether invalidation is waiting for an
+   * upcall of its own, which the caller must then dispatch.
+   */
+  bool CoalesceInvalidation(InvalidationClient* client,
+                            const Invalidation& invalidation,
+                            const AckHandle& ack_handle);
+
+  /* Issues the invalidation waiting for object_id. */
+  void IssueCoalescedInvalidation(InvalidationClient* client,
+                                  const ObjectId& object_id);
+
+  /* Issues the invalidations waiting for object_ids, in one batch. */
+  void IssueCoalescedBatch(InvalidationClient* client,
+                           const vector<ObjectId>& object_ids);
+
+  /* Removes and returns the invalidation waiting for object_id, with its ack
+   * handle.
+   */
+  pair<Invalidation, AckHandle> TakeCoalescedInvalidation(
+      const ObjectId& object_id);
+
+  /* Issues the upcall task about object_id on its dispatch thread, or on the
+   * listener scheduler if there is no dispatch pool.
+   */
+  void DispatchForObject(const ObjectId& object_id, Closure* task);
+
+  /* Issues the upcall task that is not about one object, after the upcalls
+   * issued before it on every dispatch thread and before those issued after
+   * it, or on the listener scheduler if there is no dispatch pool.
+   */
+  void DispatchForAll(Closure* task);
+
+  /* Issues the upcall method with the entries of *batch, split by dispatch
+   * thread if there is a dispatch pool, and leaves *batch empty. Entries are
+   * pairs whose first element is an object id or an invalidation.
+   */
+  template <class Entry>
+  void DispatchBatch(
+      InvalidationClient* client, vector<Entry>* batch,
+      void (InvalidationListener::*method)(InvalidationClient*,
+                                           const vector<Entry>&));
+
+  /* Returns task, wrapped to trace the start of the upcall if tracing is
+   * compiled in.
+   */
+  Closure* TraceUpcall(Closure* task);
+
+  /* Traces the start of the upcall of the message with trace_id, then runs
+   * and deletes task.
+   */
+  void RunTracedUpcall(uint64 trace_id, Closure* task);
+
   /* The actual listener to which this listener delegates. */
   InvalidationListener* delegate_;
 
@@ -80,7 +202,26 @@ class CheckingInvalidationListener : public InvalidationListener {
   /* The scheduler for scheduling events for the delegate. */
   Scheduler* listener_scheduler_;
 
+  /* The threads for the per-object upcalls, if enabled. */
+  scoped_ptr<ShardedDispatcher> object_dispatcher_;
+
   Logger* logger_;
+
+  /* Trace id of the message about which upcalls are being issued. */
+  uint64 trace_id_;
+
+  /* Whether invalidations waiting to be issued are coalesced. */
+  bool coalesce_invalidations_;
+
+  /* Lock for pending_invalidations_, which the internal thread adds to and
+   * the upcall threads take from.
+   */
+  Mutex pending_lock_;
+
+  /* The known-version invalidations waiting to be issued, with their ack
+   * handles, if coalesce_invalidations_.
+   */
+  PendingMap pending_invalidations_;
 };
 
 }  // namespace invalidation
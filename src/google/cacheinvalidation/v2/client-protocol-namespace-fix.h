@@ -27,6 +27,8 @@ using ::google::protobuf::RepeatedField;
 using ::google::protobuf::RepeatedPtrField;
 
 // Client
+using ::ipc::invalidation::PersistentRegistrationLogEntry;
+using ::ipc::invalidation::PersistentRegistrationSnapshot;
 using ::ipc::invalidation::PersistentStateBlob;
 using ::ipc::invalidation::PersistentTiclState;
 
@@ -36,6 +38,7 @@ using ::ipc::invalidation::ApplicationClientIdP;
 using ::ipc::invalidation::ClientHeader;
 using ::ipc::invalidation::ClientVersion;
 using ::ipc::invalidation::ClientToServerMessage;
+using ::ipc::invalidation::ClientToServerMessageBatch;
 using ::ipc::invalidation::ConfigChangeMessage;
 using ::ipc::invalidation::ErrorMessage;
 using ::ipc::invalidation::ErrorMessage_Code_AUTH_FAILURE;
@@ -44,13 +47,19 @@ using ::ipc::invalidation::InfoMessage;
 using ::ipc::invalidation::InfoRequestMessage;
 using ::ipc::invalidation::InfoRequestMessage_InfoType_GET_PERFORMANCE_COUNTERS;
 using ::ipc::invalidation::InitializeMessage;
+using ::ipc::invalidation::InitializeMessage_CompressionType_DEFLATE;
 using ::ipc::invalidation::InitializeMessage_DigestSerializationType_BYTE_BASED;
 using ::ipc::invalidation::InitializeMessage_DigestSerializationType_NUMBER_BASED;
+using ::ipc::invalidation::InitializeMessage_NameEncoding_FRONT_CODED;
 using ::ipc::invalidation::InvalidationMessage;
 using ::ipc::invalidation::InvalidationP;
 using ::ipc::invalidation::ObjectIdP;
+using ::ipc::invalidation::PayloadFetchMessage;
+using ::ipc::invalidation::PayloadMessage;
+using ::ipc::invalidation::PayloadP;
 using ::ipc::invalidation::PropertyRecord;
 using ::ipc::invalidation::ProtocolVersion;
+using ::ipc::invalidation::RateLimitP;
 using ::ipc::invalidation::RegistrationMessage;
 using ::ipc::invalidation::RegistrationP;
 using ::ipc::invalidation::RegistrationP_OpType_REGISTER;
@@ -64,6 +73,7 @@ using ::ipc::invalidation::RegistrationSyncMessage;
 using ::ipc::invalidation::RegistrationSyncRequestMessage;
 using ::ipc::invalidation::ServerHeader;
 using ::ipc::invalidation::ServerToClientMessage;
+using ::ipc::invalidation::ServerToClientMessageBatch;
 using ::ipc::invalidation::StatusP;
 using ::ipc::invalidation::StatusP_Code_SUCCESS;
 using ::ipc::invalidation::StatusP_Code_PERMANENT_FAILURE;
@@ -72,7 +82,9 @@ using ::ipc::invalidation::TokenControlMessage;
 using ::ipc::invalidation::Version;
 
 // Types
+using ::ipc::invalidation::ClientType_Type_INTERNAL;
 using ::ipc::invalidation::ObjectSource_Type_INTERNAL;
+using ::ipc::invalidation::ObjectSource_Type_TEST;
 
 }  // namespace invalidation
 
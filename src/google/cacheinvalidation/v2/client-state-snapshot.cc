@@ -0,0 +1,52 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Snapshot of the state of a Ticl that any thread can read without a lock.
+
+#include "google/cacheinvalidation/v2/client-state-snapshot.h"
+
+#include <string.h>
+
+namespace invalidation {
+
+void ClientStateSnapshot::Publish(const ClientState& state) {
+  uint64 sequence = sequence_;
+  sequence_ = sequence + 1;
+  __sync_synchronize();
+  memcpy(&state_, &state, sizeof(state_));
+  __sync_synchronize();
+  sequence_ = sequence + 2;
+}
+
+bool ClientStateSnapshot::Read(ClientState* state) const {
+  ClientState copy;
+  while (true) {
+    uint64 sequence = sequence_;
+    __sync_synchronize();
+    if (sequence == 0) {
+      return false;
+    }
+    if ((sequence & 1) == 0) {
+      memcpy(&copy, &state_, sizeof(copy));
+      __sync_synchronize();
+      if (sequence_ == sequence) {
+        break;
+      }
+    }
+  }
+  *state = copy;
+  return true;
+}
+
+}  // namespace invalidation
@@ -0,0 +1,101 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Snapshot of the state of a Ticl that any thread can read without a lock.
+//
+// The state of a Ticl belongs to its internal thread. Rather than have
+// application threads (e.g., health checks) schedule work there and wait for
+// it, the internal thread publishes a copy of the state after it changes, in
+// a sequence lock that readers copy out of without ever making the writer
+// wait.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_CLIENT_STATE_SNAPSHOT_H_
+#define GOOGLE_CACHEINVALIDATION_V2_CLIENT_STATE_SNAPSHOT_H_
+
+#include "base/basictypes.h"
+
+namespace invalidation {
+
+/* The state of a Ticl as last published by its internal thread. */
+struct ClientState {
+  /* Time of the internal scheduler at which the state was published. */
+  int64 publish_time_ms;
+
+  /* Whether the Ticl is started: it got a token once and is not stopped. */
+  bool is_started;
+
+  /* Whether the Ticl currently holds a client token. */
+  bool has_token;
+
+  /* Whether the desired registrations agree with the last summary from the
+   * server.
+   */
+  bool is_registration_in_sync;
+
+  /* Number of desired registrations. */
+  int num_registrations;
+
+  /* Number of invalidations issued to the listener and not yet acknowledged,
+   * if Config::max_outstanding_invalidations is positive.
+   */
+  int num_outstanding_invalidations;
+
+  /* Counters from the statistics of the Ticl. */
+  int num_messages_sent;
+  int num_messages_received;
+  int num_invalidations_issued;
+  int num_errors;
+};
+
+/* A ClientState written by one thread and read by any, in a sequence lock.
+ *
+ * The writer makes the sequence number odd, copies the state in and makes the
+ * sequence number even again. A reader copies the state out between two reads
+ * of the sequence number and keeps the copy if they are equal and even;
+ * otherwise it raced a publication, which only copies a few dozen bytes, and
+ * retries. The writer never waits for readers, and readers never write, so
+ * any number of them can read at once.
+ */
+class ClientStateSnapshot {
+ public:
+  ClientStateSnapshot() : sequence_(0) {}
+
+  /* Publishes state for the readers.
+   *
+   * REQUIRES: called on a single thread, the internal thread of the Ticl.
+   */
+  void Publish(const ClientState& state);
+
+  /* Sets state to the last published state. Returns false, leaving state
+   * unchanged, if none has been published yet. May be called from any thread.
+   */
+  bool Read(ClientState* state) const;
+
+  /* Returns the number of states ever published. */
+  uint64 num_published() const {
+    return sequence_ / 2;
+  }
+
+ private:
+  /* Twice the number of states published, plus one while one is being
+   * published.
+   */
+  volatile uint64 sequence_;
+
+  ClientState state_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_CLIENT_STATE_SNAPSHOT_H_
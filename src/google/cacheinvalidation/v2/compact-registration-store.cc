@@ -0,0 +1,343 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Memory-efficient, hash-table-based implementation of DigestStore.
+
+#include "google/cacheinvalidation/v2/compact-registration-store.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "google/cacheinvalidation/v2/logging.h"
+#include "google/cacheinvalidation/v2/object-id-digest-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::sort;
+
+const int CompactRegistrationStore::kDigestSize;
+const uint32 CompactRegistrationStore::kEmptySlot;
+const uint32 CompactRegistrationStore::kDeletedSlot;
+const int CompactRegistrationStore::kMinSlots;
+
+CompactRegistrationStore::CompactRegistrationStore(
+    DigestFunction* digest_function)
+    : digest_function_(digest_function),
+      num_registrations_(0),
+      num_deleted_slots_(0),
+      is_sorted_view_valid_(false),
+      is_summary_digest_stale_(true) {
+  Rehash(kMinSlots);
+}
+
+void CompactRegistrationStore::Add(const ObjectIdP& oid) {
+  char digest[DigestFunction::kMaxDigestSize];
+  ComputeDigest(oid, digest);
+  if (AddWithDigest(oid, digest)) {
+    InvalidateSortedView();
+  }
+}
+
+void CompactRegistrationStore::Add(const vector<ObjectIdP>& oids) {
+  vector<string> digests;
+  ObjectIdDigestUtils::GetDigests(oids, digest_function_, &digests);
+  AddWithDigests(oids, digests);
+}
+
+void CompactRegistrationStore::AddWithDigests(const vector<ObjectIdP>& oids,
+                                              const vector<string>& digests) {
+  CHECK(digests.size() == oids.size());
+  ReserveForAdds(static_cast<int>(oids.size()));
+  bool changed = false;
+  for (size_t i = 0; i < oids.size(); ++i) {
+    CHECK(digests[i].size() == static_cast<size_t>(kDigestSize));
+    changed |= AddWithDigest(oids[i], digests[i].data());
+  }
+  if (changed) {
+    InvalidateSortedView();
+  }
+}
+
+void CompactRegistrationStore::Remove(const ObjectIdP& oid) {
+  char digest[DigestFunction::kMaxDigestSize];
+  ComputeDigest(oid, digest);
+  if (RemoveWithDigest(digest)) {
+    InvalidateSortedView();
+  }
+}
+
+void CompactRegistrationStore::Remove(const vector<ObjectIdP>& oids) {
+  bool changed = false;
+  for (size_t i = 0; i < oids.size(); ++i) {
+    char digest[DigestFunction::kMaxDigestSize];
+    ComputeDigest(oids[i], digest);
+    changed |= RemoveWithDigest(digest);
+  }
+  if (changed) {
+    InvalidateSortedView();
+  }
+}
+
+void CompactRegistrationStore::RemoveWithDigests(
+    const vector<ObjectIdP>& oids, const vector<string>& digests) {
+  CHECK(digests.size() == oids.size());
+  bool changed = false;
+  for (size_t i = 0; i < oids.size(); ++i) {
+    CHECK(digests[i].size() == static_cast<size_t>(kDigestSize));
+    changed |= RemoveWithDigest(digests[i].data());
+  }
+  if (changed) {
+    InvalidateSortedView();
+  }
+}
+
+void CompactRegistrationStore::RemoveAll(vector<ObjectIdP>* oids) {
+  if (num_registrations_ == 0) {
+    return;
+  }
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    if (slots_[i].in_use()) {
+      oids->push_back(ObjectIdP());
+      GetObjectId(slots_[i], &oids->back());
+    }
+  }
+  slots_.clear();
+  names_.clear();
+  num_registrations_ = 0;
+  Rehash(kMinSlots);
+  InvalidateSortedView();
+}
+
+bool CompactRegistrationStore::Contains(const ObjectIdP& oid) {
+  char digest[DigestFunction::kMaxDigestSize];
+  ComputeDigest(oid, digest);
+  return FindSlot(digest) >= 0;
+}
+
+string CompactRegistrationStore::GetDigest() {
+  if (is_summary_digest_stale_) {
+    BuildSortedView();
+    digest_function_->Reset();
+    for (size_t i = 0; i < sorted_slots_.size(); ++i) {
+      digest_function_->Update(slots_[sorted_slots_[i]].digest, kDigestSize);
+    }
+    summary_digest_ = digest_function_->GetDigest();
+    is_summary_digest_stale_ = false;
+  }
+  return summary_digest_;
+}
+
+string CompactRegistrationStore::GetDigestForPrefix(
+    const string& oid_digest_prefix, int prefix_len, int* num_elements) {
+  BuildSortedView();
+  *num_elements = 0;
+  digest_function_->Reset();
+  string digest;
+  for (size_t i = 0; i < sorted_slots_.size(); ++i) {
+    const Slot& slot = slots_[sorted_slots_[i]];
+    digest.assign(slot.digest, kDigestSize);
+    if (ObjectIdDigestUtils::MatchesPrefix(
+            digest, oid_digest_prefix, prefix_len)) {
+      digest_function_->Update(slot.digest, kDigestSize);
+      ++*num_elements;
+    }
+  }
+  return digest_function_->GetDigest();
+}
+
+void CompactRegistrationStore::GetElements(
+    const string& oid_digest_prefix, int prefix_len,
+    vector<ObjectIdP>* result) {
+  string digest;
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    const Slot& slot = slots_[i];
+    if (!slot.in_use()) {
+      continue;
+    }
+    digest.assign(slot.digest, kDigestSize);
+    if (ObjectIdDigestUtils::MatchesPrefix(
+            digest, oid_digest_prefix, prefix_len)) {
+      result->push_back(ObjectIdP());
+      GetObjectId(slot, &result->back());
+    }
+  }
+}
+
+size_t CompactRegistrationStore::GetAllocatedBytes() const {
+  return slots_.capacity() * sizeof(Slot) + names_.capacity() +
+      sorted_slots_.capacity() * sizeof(int);
+}
+
+void CompactRegistrationStore::ComputeDigest(const ObjectIdP& oid,
+                                             char* digest) {
+  int digest_size =
+      ObjectIdDigestUtils::GetDigest(oid, digest_function_, digest);
+  CHECK(digest_size == kDigestSize) << "Unsupported digest size: "
+                                    << digest_size;
+}
+
+int CompactRegistrationStore::FindSlot(const char* digest) const {
+  uint32 mask = slots_.size() - 1;
+  for (uint32 index = GetHash(digest) & mask; ; index = (index + 1) & mask) {
+    const Slot& slot = slots_[index];
+    if (slot.name_offset == kEmptySlot) {
+      return -1;
+    }
+    if (slot.in_use() && (memcmp(slot.digest, digest, kDigestSize) == 0)) {
+      return index;
+    }
+  }
+}
+
+void CompactRegistrationStore::ReserveForAdds(int num_added) {
+  // Grow the table once up front rather than repeatedly while adding.
+  int needed = num_registrations_ + num_added;
+  if (4 * (needed + num_deleted_slots_) >
+      3 * static_cast<int>(slots_.size())) {
+    int num_slots = kMinSlots;
+    while (num_slots < 2 * needed) {
+      num_slots *= 2;
+    }
+    Rehash(num_slots);
+  }
+}
+
+bool CompactRegistrationStore::AddWithDigest(const ObjectIdP& oid,
+                                             const char* digest) {
+  if (FindSlot(digest) >= 0) {
+    return false;
+  }
+
+  // Keep at least a quarter of the slots empty so that probes stay short and
+  // always terminate.
+  if (4 * (num_registrations_ + num_deleted_slots_ + 1) >
+      3 * static_cast<int>(slots_.size())) {
+    int num_slots = slots_.size();
+    while (4 * (num_registrations_ + 1) > 2 * num_slots) {
+      num_slots *= 2;
+    }
+    Rehash(num_slots);
+  }
+
+  uint32 mask = slots_.size() - 1;
+  uint32 index = GetHash(digest) & mask;
+  while (slots_[index].in_use()) {
+    index = (index + 1) & mask;
+  }
+  Slot& slot = slots_[index];
+  if (slot.name_offset == kDeletedSlot) {
+    --num_deleted_slots_;
+  }
+  memcpy(slot.digest, digest, kDigestSize);
+  slot.source = oid.source();
+  slot.name_offset = names_.size();
+  slot.name_length = oid.name().size();
+  names_.append(oid.name());
+  ++num_registrations_;
+  return true;
+}
+
+bool CompactRegistrationStore::RemoveWithDigest(const char* digest) {
+  int index = FindSlot(digest);
+  if (index < 0) {
+    return false;
+  }
+
+  // The name stays in names_ until the next Rehash. Compact once the removed
+  // objects outnumber the live ones (and the table is not tiny).
+  slots_[index].name_offset = kDeletedSlot;
+  --num_registrations_;
+  ++num_deleted_slots_;
+  if ((num_deleted_slots_ > num_registrations_) &&
+      (num_deleted_slots_ >= kMinSlots)) {
+    int num_slots = kMinSlots;
+    while (4 * num_registrations_ > 2 * num_slots) {
+      num_slots *= 2;
+    }
+    Rehash(num_slots);
+  }
+  return true;
+}
+
+void CompactRegistrationStore::Rehash(int num_slots) {
+  vector<Slot> old_slots;
+  old_slots.swap(slots_);
+  string old_names;
+  old_names.swap(names_);
+
+  Slot empty_slot;
+  memset(&empty_slot, 0, sizeof(empty_slot));
+  empty_slot.name_offset = kEmptySlot;
+  slots_.assign(num_slots, empty_slot);
+  num_deleted_slots_ = 0;
+
+  uint32 mask = num_slots - 1;
+  for (size_t i = 0; i < old_slots.size(); ++i) {
+    const Slot& old_slot = old_slots[i];
+    if (!old_slot.in_use()) {
+      continue;
+    }
+    uint32 index = GetHash(old_slot.digest) & mask;
+    while (slots_[index].in_use()) {
+      index = (index + 1) & mask;
+    }
+    Slot& slot = slots_[index];
+    slot = old_slot;
+    slot.name_offset = names_.size();
+    names_.append(old_names, old_slot.name_offset, old_slot.name_length);
+  }
+
+  // Slots moved, so the indices in the sorted view are stale, but the set of
+  // objects (and hence the summary digest) is not.
+  is_sorted_view_valid_ = false;
+  sorted_slots_.clear();
+}
+
+void CompactRegistrationStore::GetObjectId(const Slot& slot,
+                                           ObjectIdP* oid) const {
+  oid->set_source(slot.source);
+  oid->set_name(names_.data() + slot.name_offset, slot.name_length);
+}
+
+void CompactRegistrationStore::BuildSortedView() {
+  if (is_sorted_view_valid_) {
+    return;
+  }
+  sorted_slots_.clear();
+  sorted_slots_.reserve(num_registrations_);
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    if (slots_[i].in_use()) {
+      sorted_slots_.push_back(i);
+    }
+  }
+  sort(sorted_slots_.begin(), sorted_slots_.end(), SlotDigestLess(&slots_));
+  is_sorted_view_valid_ = true;
+}
+
+void CompactRegistrationStore::InvalidateSortedView() {
+  is_sorted_view_valid_ = false;
+  is_summary_digest_stale_ = true;
+
+  // Release the memory of the view; it is rebuilt only when needed.
+  vector<int>().swap(sorted_slots_);
+}
+
+uint32 CompactRegistrationStore::GetHash(const char* digest) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(digest);
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+      (static_cast<uint32>(bytes[3]) << 24);
+}
+
+}  // namespace invalidation
@@ -0,0 +1,208 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Memory-efficient, hash-table-based implementation of DigestStore for clients
+// with very many registrations.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_COMPACT_REGISTRATION_STORE_H_
+#define GOOGLE_CACHEINVALIDATION_V2_COMPACT_REGISTRATION_STORE_H_
+
+#include <string.h>
+
+#include <vector>
+
+#include "base/basictypes.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/digest-function.h"
+#include "google/cacheinvalidation/v2/digest-store.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Implementation notes: the objects are kept in an open-addressing hash table
+ * with linear probing. Each slot holds the object digest inline, the object
+ * source and the location of the object name in names_, a single buffer shared
+ * by all the names, so that an object costs a fixed 32 bytes plus its name
+ * (compared to a tree node, a digest string and a protocol buffer for
+ * SimpleRegistrationStore). Object digests are uniformly distributed, so their
+ * first bytes are used directly as the hash.
+ *
+ * The summary digest is over the object digests in sorted order, which the
+ * table does not maintain. The sorted view is built when a digest is needed
+ * and dropped on the next change.
+ *
+ * REQUIRES: the digest function produces kDigestSize digests (e.g., SHA1).
+ */
+class CompactRegistrationStore : public DigestStore<ObjectIdP> {
+ public:
+  explicit CompactRegistrationStore(DigestFunction* digest_function);
+
+  virtual ~CompactRegistrationStore() {}
+
+  virtual void Add(const ObjectIdP& oid);
+
+  virtual void Add(const vector<ObjectIdP>& oids);
+
+  virtual void Remove(const ObjectIdP& oid);
+
+  virtual void Remove(const vector<ObjectIdP>& oids);
+
+  virtual void AddWithDigests(const vector<ObjectIdP>& oids,
+                              const vector<string>& digests);
+
+  virtual void RemoveWithDigests(const vector<ObjectIdP>& oids,
+                                 const vector<string>& digests);
+
+  virtual void RemoveAll(vector<ObjectIdP>* oids);
+
+  virtual bool Contains(const ObjectIdP& oid);
+
+  virtual int size() {
+    return num_registrations_;
+  }
+
+  virtual string GetDigest();
+
+  virtual string GetDigestForPrefix(const string& oid_digest_prefix,
+                                    int prefix_len, int* num_elements);
+
+  virtual void GetElements(const string& oid_digest_prefix, int prefix_len,
+                           vector<ObjectIdP>* result);
+
+  virtual string ToString() {
+    return StringPrintf(
+        "CompactRegistrationStore: %d registrations, %d slots",
+        num_registrations_, static_cast<int>(slots_.size()));
+  }
+
+  /* Returns the number of bytes allocated for the table, the names and the
+   * sorted view.
+   */
+  virtual size_t GetAllocatedBytes() const;
+
+  /* Size in bytes of the object digests held inline. */
+  static const int kDigestSize = 20;
+
+ private:
+  /* A slot of the hash table. */
+  struct Slot {
+    /* The object digest, if the slot is in use. */
+    char digest[kDigestSize];
+
+    /* The object source. */
+    int32 source;
+
+    /* Offset of the object name in names_, or kEmptySlot / kDeletedSlot. */
+    uint32 name_offset;
+
+    /* Length of the object name. */
+    uint32 name_length;
+
+    bool in_use() const {
+      return name_offset < kDeletedSlot;
+    }
+  };
+
+  /* Orders slot indices by the digests in the slots. */
+  class SlotDigestLess {
+   public:
+    explicit SlotDigestLess(const vector<Slot>* slots) : slots_(slots) {}
+
+    bool operator()(int a, int b) const {
+      return memcmp((*slots_)[a].digest, (*slots_)[b].digest,
+                    kDigestSize) < 0;
+    }
+
+   private:
+    const vector<Slot>* slots_;
+  };
+
+  /* Markers stored in Slot::name_offset for unused slots. */
+  static const uint32 kEmptySlot = 0xffffffff;
+  static const uint32 kDeletedSlot = 0xfffffffe;
+
+  /* Smallest number of slots in the table. Always a power of two. */
+  static const int kMinSlots = 16;
+
+  /* Stores the digest of oid in digest. */
+  void ComputeDigest(const ObjectIdP& oid, char* digest);
+
+  /* Returns the index of the slot holding digest, or -1 if there is none. */
+  int FindSlot(const char* digest) const;
+
+  /* Grows the table, if needed, to take num_added more objects without
+   * rehashing.
+   */
+  void ReserveForAdds(int num_added);
+
+  /* Adds the object with digest and returns whether it was not present. */
+  bool AddWithDigest(const ObjectIdP& oid, const char* digest);
+
+  /* Removes the object with digest and returns whether it was present. */
+  bool RemoveWithDigest(const char* digest);
+
+  /* Rebuilds the table with num_slots slots, dropping deleted slots and the
+   * names of removed objects.
+   */
+  void Rehash(int num_slots);
+
+  /* Stores in oid the object in slot. */
+  void GetObjectId(const Slot& slot, ObjectIdP* oid) const;
+
+  /* Ensures that sorted_slots_ holds the indices of the slots in use in
+   * increasing order of digest.
+   */
+  void BuildSortedView();
+
+  /* Marks the sorted view and the summary digest as out of date. */
+  void InvalidateSortedView();
+
+  /* Returns the hash of digest, used to pick its first slot. */
+  static uint32 GetHash(const char* digest);
+
+  /* The function used to compute digests of objects. */
+  DigestFunction* digest_function_;
+
+  /* The hash table. The size is always a power of two. */
+  vector<Slot> slots_;
+
+  /* The names of the objects, back to back. Contains the names of removed
+   * objects until the next Rehash.
+   */
+  string names_;
+
+  /* Number of slots in use. */
+  int num_registrations_;
+
+  /* Number of slots marked as deleted. */
+  int num_deleted_slots_;
+
+  /* Indices of the slots in use, sorted by digest, if is_sorted_view_valid_. */
+  vector<int> sorted_slots_;
+
+  /* Whether sorted_slots_ is up to date. */
+  bool is_sorted_view_valid_;
+
+  /* Whether summary_digest_ must be recomputed before being returned. */
+  bool is_summary_digest_stale_;
+
+  /* The memoized digest over all the object digests. */
+  string summary_digest_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_COMPACT_REGISTRATION_STORE_H_
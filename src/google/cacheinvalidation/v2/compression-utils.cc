@@ -0,0 +1,65 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Utilities to compress and decompress message contents.
+
+#include "google/cacheinvalidation/v2/compression-utils.h"
+
+#include "google/cacheinvalidation/zlib.h"
+
+namespace invalidation {
+
+bool CompressionUtils::Deflate(const string& data, string* compressed) {
+  uLongf compressed_size = compressBound(data.size());
+  compressed->resize(compressed_size);
+  int status = compress2(
+      reinterpret_cast<Bytef*>(&(*compressed)[0]), &compressed_size,
+      reinterpret_cast<const Bytef*>(data.data()), data.size(),
+      Z_DEFAULT_COMPRESSION);
+  if (status != Z_OK) {
+    compressed->clear();
+    return false;
+  }
+  compressed->resize(compressed_size);
+  return true;
+}
+
+bool CompressionUtils::Inflate(const string& compressed, string* data) {
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+  stream.avail_in = compressed.size();
+  if (inflateInit(&stream) != Z_OK) {
+    return false;
+  }
+
+  // Decompress into data, growing it as needed.
+  data->clear();
+  int status = Z_OK;
+  while (status == Z_OK) {
+    size_t offset = data->size();
+    data->resize(offset + compressed.size() * 4 + 64);
+    stream.next_out = reinterpret_cast<Bytef*>(&(*data)[offset]);
+    stream.avail_out = data->size() - offset;
+    status = inflate(&stream, Z_NO_FLUSH);
+    data->resize(data->size() - stream.avail_out);
+  }
+  inflateEnd(&stream);
+  return (status == Z_STREAM_END) && (stream.avail_in == 0);
+}
+
+}  // namespace invalidation
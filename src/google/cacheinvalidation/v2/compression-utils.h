@@ -0,0 +1,43 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Utilities to compress and decompress message contents.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_COMPRESSION_UTILS_H_
+#define GOOGLE_CACHEINVALIDATION_V2_COMPRESSION_UTILS_H_
+
+#include <string>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+
+class CompressionUtils {
+ public:
+  /* Stores in compressed the DEFLATE (zlib format) compression of data.
+   * Returns whether compression succeeded.
+   */
+  static bool Deflate(const string& data, string* compressed);
+
+  /* Stores in data the decompression of compressed, the output of Deflate.
+   * Returns whether compressed was well-formed.
+   */
+  static bool Inflate(const string& compressed, string* data);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_COMPRESSION_UTILS_H_
@@ -17,13 +17,19 @@
 #ifndef GOOGLE_CACHEINVALIDATION_V2_DIGEST_FUNCTION_H_
 #define GOOGLE_CACHEINVALIDATION_V2_DIGEST_FUNCTION_H_
 
+#include <stddef.h>
+#include <string.h>
+
 #include <string>
+#include <vector>
 
+#include "google/cacheinvalidation/v2/logging.h"
 #include "google/cacheinvalidation/stl-namespace.h"
 
 namespace invalidation {
 
 using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
 
 class DigestFunction {
  public:
@@ -32,13 +38,51 @@ class DigestFunction {
   /* Clears the digest state. */
   virtual void Reset() = 0;
 
+  /* Upper bound on the size in bytes of the digests of any implementation. */
+  static const int kMaxDigestSize = 64;
+
   /* Adds data to the digest being computed. */
   virtual void Update(const string& data) = 0;
 
+  /* Adds the size bytes at data to the digest being computed. Implementations
+   * should override this to avoid the copy into a string.
+   */
+  virtual void Update(const char* data, size_t size) {
+    Update(string(data, size));
+  }
+
   /* Stores the digest of the data added by Update. After this call has been
    * made, reset must be called before Update and GetDigest can be called.
    */
   virtual string GetDigest() = 0;
+
+  /* Like GetDigest(), but stores the digest in digest, which must have room
+   * for max_size bytes, and returns its size. Implementations should override
+   * this to avoid allocating a string.
+   *
+   * REQUIRES: max_size is at least the size of the digest.
+   */
+  virtual int GetDigest(char* digest, int max_size) {
+    string result = GetDigest();
+    CHECK(static_cast<int>(result.size()) <= max_size);
+    memcpy(digest, result.data(), result.size());
+    return result.size();
+  }
+
+  /* Stores in digests the digest of each of inputs, in order, replacing its
+   * contents. Implementations may compute them faster than one at a time.
+   * After this call has been made, reset must be called before Update and
+   * GetDigest can be called.
+   */
+  virtual void GetDigests(const vector<string>& inputs,
+                          vector<string>* digests) {
+    digests->resize(inputs.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      Reset();
+      Update(inputs[i]);
+      (*digests)[i] = GetDigest();
+    }
+  }
 };
 
 }  // namespace invalidation
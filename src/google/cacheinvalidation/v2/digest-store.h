@@ -18,6 +18,8 @@
 #ifndef GOOGLE_CACHEINVALIDATION_V2_DIGEST_STORE_H_
 #define GOOGLE_CACHEINVALIDATION_V2_DIGEST_STORE_H_
 
+#include <stddef.h>
+
 #include <vector>
 
 namespace invalidation {
@@ -42,6 +44,13 @@ class DigestStore {
    */
   virtual string GetDigest() = 0;
 
+  /* Returns the digest over the elements whose digests begin with the first
+   * prefix_len bits of digest_prefix, computed as GetDigest() is but over only
+   * those elements, and stores their number in num_elements.
+   */
+  virtual string GetDigestForPrefix(const string& digest_prefix, int prefix_len,
+                                    int* num_elements) = 0;
+
   /* Stores iterators bounding the elements whose digest prefixes begin with the
    * bit prefix digest_prefix.  prefix_len is the length of digest_prefix in
    * bits, which may be less than digest_prefix.length (and may be 0). The
@@ -67,9 +76,30 @@ class DigestStore {
    */
   virtual void Remove(const vector<ElementType>& elements) = 0;
 
+  /* Adds elements to the store, like Add, given digests[i], the digest of
+   * elements[i] under the digest function of the store (e.g., computed on
+   * another thread). Stores that digest their elements use the given digests
+   * instead of computing them. The default implementation ignores digests.
+   */
+  virtual void AddWithDigests(const vector<ElementType>& elements,
+                              const vector<string>& digests) {
+    Add(elements);
+  }
+
+  /* Removes elements from the store, like Remove, given their digests as for
+   * AddWithDigests.
+   */
+  virtual void RemoveWithDigests(const vector<ElementType>& elements,
+                                 const vector<string>& digests) {
+    Remove(elements);
+  }
+
   /* Removes all elements in this and stores them in elements. */
   virtual void RemoveAll(vector<ElementType>* elements) = 0;
 
+  /* Returns the approximate number of heap bytes held by the store. */
+  virtual size_t GetAllocatedBytes() const = 0;
+
   /* Returns a string representation of this digest store. */
   virtual string ToString() = 0;
 };
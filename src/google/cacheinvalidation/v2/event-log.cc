@@ -0,0 +1,147 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Binary log of the events of a Ticl, cheap enough to keep on in production.
+
+#include "google/cacheinvalidation/v2/event-log.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "google/cacheinvalidation/v2/logging.h"
+
+namespace invalidation {
+
+// The coarse clock is read from the vDSO without reading the hardware clock,
+// in a few nanoseconds.
+#ifdef CLOCK_MONOTONIC_COARSE
+static const clockid_t kEventClock = CLOCK_MONOTONIC_COARSE;
+#else
+static const clockid_t kEventClock = CLOCK_MONOTONIC;
+#endif
+
+static const char* kEventNames[] = {
+  "MESSAGE_SENT",
+  "MESSAGE_RECEIVED",
+  "MESSAGE_REJECTED",
+  "TOKEN_CHANGED",
+  "REGISTER_OPERATIONS",
+  "REGISTRATION_STATUS",
+  "INVALIDATION_ISSUED",
+  "INVALIDATION_ACKED",
+  "NETWORK_STATUS",
+  "SERVER_ERROR",
+};
+
+/* The start of a snapshot. */
+struct SnapshotHeader {
+  uint32 magic;
+  uint32 event_size;
+};
+
+const size_t EventLog::kMaxEventBytes;
+
+EventLog::EventLog(int log2_capacity)
+    : mask_((static_cast<uint64>(1) << log2_capacity) - 1),
+      num_recorded_(0),
+      events_(mask_ + 1) {
+  CHECK(log2_capacity >= 0) << "Invalid capacity: " << log2_capacity;
+}
+
+void EventLog::Record(EventId event_id, int64 value1, int64 value2,
+                      const char* data, size_t size) {
+  uint64 index = num_recorded_;
+  struct timespec now;
+  clock_gettime(kEventClock, &now);
+  Event& event = events_[index & mask_];
+  event.event_id = event_id;
+  event.bytes_size = (size < kMaxEventBytes) ? size : kMaxEventBytes;
+  event.reserved = 0;
+  event.time_us = static_cast<int64>(now.tv_sec) * 1000000 +
+      now.tv_nsec / 1000;
+  event.values[0] = value1;
+  event.values[1] = value2;
+  memcpy(event.bytes, data, event.bytes_size);
+
+  // Publish the event only once it is in place.
+  __sync_synchronize();
+  num_recorded_ = index + 1;
+}
+
+void EventLog::GetSnapshot(string* snapshot) {
+  uint64 num_recorded = num_recorded_;
+  __sync_synchronize();
+  uint64 first = (num_recorded > mask_ + 1) ? num_recorded - (mask_ + 1) : 0;
+  vector<Event> events;
+  events.reserve(num_recorded - first);
+  for (uint64 i = first; i < num_recorded; ++i) {
+    events.push_back(events_[i & mask_]);
+  }
+
+  // The recording thread may since have overwritten the oldest events, and
+  // be overwriting the one after, while they were copied.
+  __sync_synchronize();
+  uint64 num_recorded_after = num_recorded_;
+  size_t num_overwritten = 0;
+  if (num_recorded_after + 1 > first + mask_ + 1) {
+    num_overwritten = num_recorded_after + 1 - (first + mask_ + 1);
+    if (num_overwritten > events.size()) {
+      num_overwritten = events.size();
+    }
+  }
+
+  SnapshotHeader header;
+  header.magic = kSnapshotMagic;
+  header.event_size = sizeof(Event);
+  snapshot->assign(reinterpret_cast<const char*>(&header), sizeof(header));
+  if (num_overwritten < events.size()) {
+    snapshot->append(
+        reinterpret_cast<const char*>(&events[num_overwritten]),
+        (events.size() - num_overwritten) * sizeof(Event));
+  }
+}
+
+bool EventLog::Decode(const string& snapshot, vector<Event>* events) {
+  events->clear();
+  SnapshotHeader header;
+  if (snapshot.size() < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, snapshot.data(), sizeof(header));
+  size_t events_size = snapshot.size() - sizeof(header);
+  if ((header.magic != kSnapshotMagic) ||
+      (header.event_size != sizeof(Event)) ||
+      (events_size % sizeof(Event) != 0)) {
+    return false;
+  }
+  events->resize(events_size / sizeof(Event));
+  if (!events->empty()) {
+    memcpy(&(*events)[0], snapshot.data() + sizeof(header), events_size);
+  }
+  for (size_t i = 0; i < events->size(); ++i) {
+    if (((*events)[i].event_id >= EVENT_MAX) ||
+        ((*events)[i].bytes_size > kMaxEventBytes)) {
+      events->clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+const char* EventLog::EventName(EventId event_id) {
+  return ((event_id >= 0) && (event_id < EVENT_MAX)) ?
+      kEventNames[event_id] : "UNKNOWN";
+}
+
+}  // namespace invalidation
@@ -0,0 +1,197 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Binary log of the events of a Ticl, cheap enough to keep on in production.
+//
+// Unlike TLOG, which formats its arguments (often with ProtoHelpers::ToString)
+// on every call, recording an event copies a fixed id and raw values into a
+// fixed-size record of a ring buffer; the records are only decoded offline,
+// from a snapshot of the ring.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_EVENT_LOG_H_
+#define GOOGLE_CACHEINVALIDATION_V2_EVENT_LOG_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* The events logged by a Ticl. The ids are stored in the log, so new events
+ * must be added at the end, before EVENT_MAX.
+ */
+enum EventId {
+  /* A message was sent; values are its id and size in bytes. */
+  EVENT_MESSAGE_SENT,
+
+  /* A message was received; values are its trace id and size in bytes. */
+  EVENT_MESSAGE_RECEIVED,
+
+  /* A received message was dropped as invalid; values are its trace id and
+   * size in bytes.
+   */
+  EVENT_MESSAGE_REJECTED,
+
+  /* The client token changed; values are the sizes of the old and new
+   * tokens, bytes is a prefix of the new one.
+   */
+  EVENT_TOKEN_CHANGED,
+
+  /* The application (un)registered objects; values are the op type and the
+   * number of objects.
+   */
+  EVENT_REGISTER_OPERATIONS,
+
+  /* The server reported the status of a registration; values are the op
+   * type and whether it succeeded, bytes is a prefix of the object name.
+   */
+  EVENT_REGISTRATION_STATUS,
+
+  /* An invalidation was issued to the listener; values are its version and
+   * whether the version is known, bytes is a prefix of the object name.
+   */
+  EVENT_INVALIDATION_ISSUED,
+
+  /* The listener acknowledged an invalidation; values are its version and
+   * source, bytes is a prefix of the object name.
+   */
+  EVENT_INVALIDATION_ACKED,
+
+  /* The network status changed; the first value is whether it is online. */
+  EVENT_NETWORK_STATUS,
+
+  /* The server sent an error; the first value is its code. */
+  EVENT_SERVER_ERROR,
+
+  EVENT_MAX,
+};
+
+/* A ring buffer keeping the last events of one Ticl in fixed-size records.
+ *
+ * Events are recorded by a single thread, the internal thread of the Ticl,
+ * so recording takes no lock and no atomic instruction: it fills the next
+ * record in place and then publishes it by advancing the count of events.
+ * Snapshots may be taken from any thread while events are recorded; they
+ * drop the records that may have been overwritten while they were copied.
+ */
+class EventLog {
+ public:
+  /* The bytes of an event beyond this many are dropped. */
+  static const size_t kMaxEventBytes = 32;
+
+  /* A logged event, as stored in the ring (64 bytes). */
+  struct Event {
+    /* The EventId. */
+    uint16 event_id;
+
+    /* The number of bytes in bytes. */
+    uint16 bytes_size;
+
+    uint32 reserved;
+
+    /* Monotonic time in microseconds, from a coarse clock (a few
+     * milliseconds of resolution) that is cheap to read.
+     */
+    int64 time_us;
+
+    int64 values[2];
+    char bytes[kMaxEventBytes];
+  };
+
+  /* Creates a log that keeps the last 2^log2_capacity events. */
+  explicit EventLog(int log2_capacity);
+
+  /* Records event_id with value1, value2 and the first kMaxEventBytes of the
+   * size bytes at data.
+   *
+   * REQUIRES: called on the recording thread.
+   */
+  void Record(EventId event_id, int64 value1, int64 value2, const char* data,
+              size_t size);
+
+  void Record(EventId event_id, int64 value1, int64 value2) {
+    Record(event_id, value1, value2, NULL, 0);
+  }
+
+  /* Sets snapshot to the events kept, oldest first, serialized for Decode.
+   * The events are stored in the byte order of the host. The oldest event
+   * kept is left out when the ring is full, as the next event may be
+   * overwriting it, so a snapshot holds at most 2^log2_capacity - 1 events.
+   */
+  void GetSnapshot(string* snapshot);
+
+  /* Returns the number of events ever recorded. */
+  uint64 num_recorded() const {
+    return num_recorded_;
+  }
+
+  /* Returns the number of bytes allocated for the ring. */
+  size_t GetAllocatedBytes() const {
+    return events_.capacity() * sizeof(Event);
+  }
+
+  /* Sets events to the events in snapshot, as returned by GetSnapshot on a
+   * host with the same byte order. Returns false if snapshot is malformed.
+   */
+  static bool Decode(const string& snapshot, vector<Event>* events);
+
+  /* Returns the name of event_id, for decoding tools. */
+  static const char* EventName(EventId event_id);
+
+ private:
+  /* Marks the start of a snapshot, and its version. */
+  static const uint32 kSnapshotMagic = 0x45764c31;
+
+  /* Size of events_ minus one, to mask indices. */
+  uint64 mask_;
+
+  /* Number of events ever recorded, only written by the recording thread. */
+  volatile uint64 num_recorded_;
+
+  vector<Event> events_;
+};
+
+/* Records an event in event_log, a possibly NULL EventLog*, so that the
+ * event costs one test when the log is off.
+ */
+#define TICL_EVENT(event_log, event_id, value1, value2)                 \
+  do {                                                                  \
+    EventLog* ticl_event_log = (event_log);                             \
+    if (ticl_event_log != NULL) {                                       \
+      ticl_event_log->Record((event_id), (value1), (value2));           \
+    }                                                                   \
+  } while (false)
+
+/* Like TICL_EVENT, with the bytes of the string bytes. */
+#define TICL_EVENT_BYTES(event_log, event_id, value1, value2, bytes)    \
+  do {                                                                  \
+    EventLog* ticl_event_log = (event_log);                             \
+    if (ticl_event_log != NULL) {                                       \
+      const string& ticl_event_bytes = (bytes);                         \
+      ticl_event_log->Record((event_id), (value1), (value2),            \
+                             ticl_event_bytes.data(),                   \
+                             ticl_event_bytes.size());                  \
+    }                                                                   \
+  } while (false)
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_EVENT_LOG_H_
@@ -17,6 +17,17 @@
 namespace invalidation {
 
 TimeDelta ExponentialBackoffDelayGenerator::GetNextDelay() {
+  if (decorrelated_) {
+    // Draw from [initial, 3 * last], capped at the max.
+    TimeDelta upper = last_delay_ * 3;
+    if ((upper > max_delay_) || (upper < last_delay_)) {  // Overflow guard.
+      upper = max_delay_;
+    }
+    last_delay_ = initial_delay_ +
+        random_->RandDouble() * (upper - initial_delay_);
+    return last_delay_;
+  }
+
   // Generate the delay.
   TimeDelta delay = random_->RandDouble() * current_max_delay_;
 
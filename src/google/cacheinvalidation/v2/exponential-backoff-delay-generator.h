@@ -36,7 +36,7 @@ class ExponentialBackoffDelayGenerator {
    */
   ExponentialBackoffDelayGenerator(Random* random, TimeDelta max_delay,
                                    TimeDelta initial_max_delay) :
-    max_delay_(max_delay), random_(random) {
+    max_delay_(max_delay), decorrelated_(false), random_(random) {
     CHECK(max_delay > TimeDelta()) << "max delay must be positive";
     CHECK(random_ != NULL);
     Reset(initial_max_delay);
@@ -49,6 +49,37 @@ class ExponentialBackoffDelayGenerator {
     CHECK(delay > TimeDelta()) << "initial delay must be positive";
     CHECK(delay <= max_delay_) << "initial delay cannot be more than max delay";
     current_max_delay_ = delay;
+    initial_delay_ = delay;
+    last_delay_ = delay;
+  }
+
+  /* Sets whether delays are decorrelated: each one is drawn uniformly between
+   * the initial delay and three times the previous one (capped at the
+   * maximum), instead of between zero and a cap that doubles on every call.
+   * Clients that start backing off together then drift apart, rather than
+   * retrying in waves whose spread is only the current cap.
+   */
+  void set_decorrelated(bool decorrelated) {
+    decorrelated_ = decorrelated;
+  }
+
+  /* Changes the maximum delay, e.g. at the server's request. Delays already
+   * above it are lowered to it. max_delay must be at least the initial delay.
+   */
+  void SetMaxDelay(TimeDelta max_delay) {
+    CHECK(max_delay >= initial_delay_)
+        << "max delay cannot be less than initial delay";
+    max_delay_ = max_delay;
+    if (current_max_delay_ > max_delay_) {
+      current_max_delay_ = max_delay_;
+    }
+    if (last_delay_ > max_delay_) {
+      last_delay_ = max_delay_;
+    }
+  }
+
+  TimeDelta max_delay() const {
+    return max_delay_;
   }
 
   /* Gets the next delay interval to use. */
@@ -61,6 +92,17 @@ class ExponentialBackoffDelayGenerator {
   /* Next delay time to use. */
   TimeDelta current_max_delay_;
 
+  /* The delay given to the last Reset. */
+  TimeDelta initial_delay_;
+
+  /* The last delay returned, or initial_delay_ if there was none since the
+   * last Reset. Only used for decorrelated delays.
+   */
+  TimeDelta last_delay_;
+
+  /* Whether delays are decorrelated (see set_decorrelated). */
+  bool decorrelated_;
+
   scoped_ptr<Random> random_;
 };
 }  // namespace invalidation
@@ -0,0 +1,265 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Network channel shared by the clients of many processes on a host, through
+// a daemon that holds the connection.
+
+#include "google/cacheinvalidation/v2/host-channel.h"
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/v2/log-macro.h"
+
+namespace invalidation {
+
+/* A scheduled run of the poll of a HostChannelPoller, which schedules the next
+ * one unless the poller has been deleted.
+ */
+class HostChannelPoller::PollTask : public Closure {
+ public:
+  /* Creates a task holding a reference to state, which the caller has
+   * counted.
+   */
+  explicit PollTask(PollState* state) : state_(state) {}
+
+  virtual ~PollTask() {
+    ReleaseState(state_);
+  }
+
+  virtual bool IsRepeatable() const {
+    return true;
+  }
+
+  virtual void Run() {
+    MutexLock m(&state_->lock);
+    if (state_->is_stopped) {
+      return;
+    }
+    state_->poll->Run();
+    ++state_->num_references;
+    state_->scheduler->Schedule(state_->interval, new PollTask(state_));
+  }
+
+ private:
+  PollState* state_;
+};
+
+HostChannelPoller::HostChannelPoller(Scheduler* scheduler, TimeDelta interval,
+                                     Closure* poll)
+    : state_(new PollState(scheduler, interval, poll)) {
+  scheduler->Schedule(interval, new PollTask(state_));
+}
+
+HostChannelPoller::~HostChannelPoller() {
+  {
+    MutexLock m(&state_->lock);
+    state_->is_stopped = true;
+  }
+  ReleaseState(state_);
+}
+
+void HostChannelPoller::ReleaseState(PollState* state) {
+  {
+    MutexLock m(&state->lock);
+    if (--state->num_references > 0) {
+      return;
+    }
+  }
+  delete state->poll;
+  delete state;
+}
+
+HostChannelDaemon::HostChannelDaemon(
+    const Config& config, NetworkChannel* network, Scheduler* scheduler,
+    Logger* logger)
+    : config_(config),
+      scheduler_(scheduler),
+      logger_(logger),
+      multiplexer_(network, scheduler, logger,
+                   config.multiplexer_batching_delay) {
+  poller_.reset(new HostChannelPoller(
+      scheduler_, config_.poll_interval,
+      NewPermanentCallback(this, &HostChannelDaemon::PollClients)));
+}
+
+HostChannelDaemon::~HostChannelDaemon() {
+  // Stop polling before the clients go away.
+  poller_.reset();
+  for (size_t i = 0; i < clients_.size(); ++i) {
+    delete clients_[i];
+  }
+}
+
+bool HostChannelDaemon::AddClient(const string& client_name) {
+  HostedClient* client = new HostedClient();
+  client->outgoing_ring.reset(new SharedMemoryRing(
+      GetRingPath(config_.directory, client_name, true),
+      config_.ring_capacity, true, logger_));
+  client->incoming_ring.reset(new SharedMemoryRing(
+      GetRingPath(config_.directory, client_name, false),
+      config_.ring_capacity, true, logger_));
+  if (!client->outgoing_ring->IsOpen() || !client->incoming_ring->IsOpen()) {
+    TLOG(logger_, WARNING, "Cannot create the rings of client %s",
+         client_name.c_str());
+    delete client;
+    return false;
+  }
+  client->channel = multiplexer_.NewClientChannel();
+  client->channel->SetMessageReceiver(NewPermanentCallback(
+      this, &HostChannelDaemon::DeliverMessage, client));
+  client->channel->AddNetworkStatusReceiver(NewPermanentCallback(
+      this, &HostChannelDaemon::DeliverNetworkStatus, client));
+  MutexLock m(&lock_);
+  clients_.push_back(client);
+  TLOG(logger_, INFO, "Added client %s", client_name.c_str());
+  return true;
+}
+
+int HostChannelDaemon::num_clients() {
+  MutexLock m(&lock_);
+  return clients_.size();
+}
+
+string HostChannelDaemon::GetRingPath(
+    const string& directory, const string& client_name, bool is_outgoing) {
+  return directory + "/" + client_name + (is_outgoing ? ".out" : ".in");
+}
+
+void HostChannelDaemon::DeliverMessage(HostedClient* client,
+                                       const string& message) {
+  WriteIncomingRecord(client, kMessageRecord, message);
+}
+
+void HostChannelDaemon::DeliverNetworkStatus(HostedClient* client,
+                                             bool status) {
+  WriteIncomingRecord(client, kNetworkStatusRecord, status ? "1" : "0");
+}
+
+void HostChannelDaemon::WriteIncomingRecord(
+    HostedClient* client, char record_type, const string& record) {
+  string typed_record;
+  typed_record.reserve(1 + record.size());
+  typed_record.push_back(record_type);
+  typed_record.append(record);
+  MutexLock m(&client->incoming_lock);
+  if (!client->incoming_ring->Write(typed_record.data(),
+                                    typed_record.size())) {
+    // The client has fallen behind; it recovers as from a lost message.
+    TLOG(logger_, WARNING, "Ring full, dropping %d-byte record",
+         static_cast<int>(typed_record.size()));
+  }
+}
+
+void HostChannelDaemon::PollClients() {
+  vector<HostedClient*> clients;
+  {
+    MutexLock m(&lock_);
+    clients = clients_;
+  }
+  string message;
+  for (size_t i = 0; i < clients.size(); ++i) {
+    while (clients[i]->outgoing_ring->Read(&message)) {
+      clients[i]->channel->SendMessage(&message);
+    }
+  }
+}
+
+HostChannelClient::HostChannelClient(
+    const string& directory, const string& client_name, Scheduler* scheduler,
+    Logger* logger, TimeDelta poll_interval)
+    : directory_(directory),
+      client_name_(client_name),
+      logger_(logger) {
+  bool is_open;
+  {
+    MutexLock m(&lock_);
+    is_open = OpenRings();
+  }
+  if (!is_open) {
+    TLOG(logger_, WARNING, "Cannot open the rings of client %s yet",
+         client_name.c_str());
+  }
+  poller_.reset(new HostChannelPoller(
+      scheduler, poll_interval,
+      NewPermanentCallback(this, &HostChannelClient::PollDaemon)));
+}
+
+HostChannelClient::~HostChannelClient() {
+  // Stop polling before the receivers go away.
+  poller_.reset();
+  for (size_t i = 0; i < network_status_receivers_.size(); ++i) {
+    delete network_status_receivers_[i];
+  }
+}
+
+bool HostChannelClient::IsOpen() const {
+  MutexLock m(&lock_);
+  return outgoing_ring_->IsOpen() && incoming_ring_->IsOpen();
+}
+
+bool HostChannelClient::OpenRings() {
+  if ((outgoing_ring_.get() == NULL) || !outgoing_ring_->IsOpen()) {
+    outgoing_ring_.reset(new SharedMemoryRing(
+        HostChannelDaemon::GetRingPath(directory_, client_name_, true), 0,
+        false, logger_));
+  }
+  if ((incoming_ring_.get() == NULL) || !incoming_ring_->IsOpen()) {
+    incoming_ring_.reset(new SharedMemoryRing(
+        HostChannelDaemon::GetRingPath(directory_, client_name_, false), 0,
+        false, logger_));
+  }
+  return outgoing_ring_->IsOpen() && incoming_ring_->IsOpen();
+}
+
+void HostChannelClient::SendMessage(const string& outgoing_message) {
+  MutexLock m(&lock_);
+  if (!outgoing_ring_->Write(outgoing_message.data(),
+                            outgoing_message.size())) {
+    TLOG(logger_, WARNING, "Ring full or not open, dropping %d-byte message",
+         static_cast<int>(outgoing_message.size()));
+  }
+}
+
+void HostChannelClient::SetMessageReceiver(MessageCallback* incoming_receiver) {
+  message_receiver_.reset(incoming_receiver);
+}
+
+void HostChannelClient::AddNetworkStatusReceiver(
+    NetworkStatusCallback* network_status_receiver) {
+  network_status_receivers_.push_back(network_status_receiver);
+}
+
+void HostChannelClient::PollDaemon() {
+  {
+    MutexLock m(&lock_);
+    if (!OpenRings()) {
+      return;
+    }
+  }
+  string record;
+  while (incoming_ring_->Read(&record)) {
+    if (record.empty()) {
+      continue;
+    }
+    if (record[0] == HostChannelDaemon::kNetworkStatusRecord) {
+      bool status = (record.size() > 1) && (record[1] == '1');
+      for (size_t i = 0; i < network_status_receivers_.size(); ++i) {
+        network_status_receivers_[i]->Run(status);
+      }
+    } else if (message_receiver_.get() != NULL) {
+      message_receiver_->Run(record.substr(1));
+    }
+  }
+}
+
+}  // namespace invalidation
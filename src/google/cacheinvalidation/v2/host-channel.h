@@ -0,0 +1,270 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Network channel shared by the clients of many processes on a host, through
+// a daemon that holds the connection.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_HOST_CHANNEL_H_
+#define GOOGLE_CACHEINVALIDATION_V2_HOST_CHANNEL_H_
+
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/channel-multiplexer.h"
+#include "google/cacheinvalidation/v2/mutex.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/shared-memory-ring.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Runs a poll closure on a scheduler at an interval, until deleted. Each run
+ * is scheduled as a task sharing a stopped flag with the poller, so that the
+ * task left pending when the poller is deleted does nothing, even though the
+ * scheduler keeps running.
+ *
+ * This class is thread-safe.
+ */
+class HostChannelPoller {
+ public:
+  /* Starts polling with poll, which must be repeatable and which it takes
+   * ownership of. The caller keeps ownership of scheduler.
+   */
+  HostChannelPoller(Scheduler* scheduler, TimeDelta interval, Closure* poll);
+
+  /* Stops polling, waiting for a running poll to finish. Must not be called
+   * from the poll.
+   */
+  ~HostChannelPoller();
+
+ private:
+  /* The state shared by the poller and its pending task. */
+  struct PollState {
+    PollState(Scheduler* scheduler, TimeDelta interval, Closure* poll)
+        : scheduler(scheduler), interval(interval), poll(poll),
+          is_stopped(false), num_references(2) {}
+
+    /* Lock held while polling, and for the fields below. */
+    Mutex lock;
+
+    Scheduler* scheduler;
+    TimeDelta interval;
+
+    /* Owned. */
+    Closure* poll;
+
+    /* Whether the poller has been deleted. */
+    bool is_stopped;
+
+    /* Number of holders of the state, the poller and its pending task (at
+     * first, both); the last one deletes it.
+     */
+    int num_references;
+  };
+
+  class PollTask;
+
+  /* Drops a reference to state, deleting it with the last one. */
+  static void ReleaseState(PollState* state);
+
+  PollState* state_;
+};
+
+/* The daemon of a host whose processes share one connection to the server.
+ *
+ * Each client process gets a HostChannelClient as the network channel of its
+ * Ticl. The daemon multiplexes the messages of all the clients over its own
+ * channel with a ChannelMultiplexer, so that the host keeps one connection,
+ * and the heartbeats of its clients go out in the same batches, rather than
+ * one connection per process. A client and the daemon exchange messages
+ * through two SharedMemoryRings in a directory they share (e.g., under
+ * /dev/shm): one that the client writes and the daemon reads, and one the
+ * other way, which also carries the network status changes. Both sides poll
+ * the rings they read on a scheduler.
+ *
+ * The daemon creates the rings of a client with AddClient, which must be
+ * called before the client process creates its channel. The clients keep
+ * their own Ticl state (token, registrations and persistent state); only the
+ * connection is shared.
+ *
+ * This class is thread-safe.
+ */
+class HostChannelDaemon {
+ public:
+  struct Config {
+    Config() : ring_capacity(SharedMemoryRing::kDefaultCapacity),
+               poll_interval(
+                   TimeDelta::FromMilliseconds(kDefaultPollIntervalMs)),
+               multiplexer_batching_delay(TimeDelta::FromMilliseconds(
+                   kDefaultMultiplexerBatchingDelayMs)) {}
+
+    /* Directory holding the rings of the clients. */
+    string directory;
+
+    /* Capacity of each ring, a power of two. Messages that do not fit in the
+     * free space of a ring are dropped, as by a lossy network.
+     */
+    int ring_capacity;
+
+    /* Interval at which the rings are polled. */
+    TimeDelta poll_interval;
+
+    /* Batching delay of the multiplexer of the shared network channel. */
+    TimeDelta multiplexer_batching_delay;
+  };
+
+  /* Creates a daemon that sends the messages of its clients on network, and
+   * starts polling their rings on scheduler, on which the batches are also
+   * sent. The caller keeps ownership of network, scheduler and logger.
+   */
+  HostChannelDaemon(const Config& config, NetworkChannel* network,
+                    Scheduler* scheduler, Logger* logger);
+
+  /* Stops polling, and removes nothing from the directory. */
+  ~HostChannelDaemon();
+
+  /* Creates the rings of the client named client_name, a file name unique
+   * among the clients, replacing any left from an earlier client of that
+   * name. Returns whether they could be created.
+   */
+  bool AddClient(const string& client_name);
+
+  /* Returns the number of clients added. */
+  int num_clients();
+
+  /* Returns the path of the ring written by the client named client_name in
+   * directory if is_outgoing, and of the ring it reads otherwise.
+   */
+  static string GetRingPath(const string& directory, const string& client_name,
+                            bool is_outgoing);
+
+  /* Type of a record in the ring read by a client, its first byte. */
+  static const char kMessageRecord = 'M';
+  static const char kNetworkStatusRecord = 'S';
+
+  static const int kDefaultPollIntervalMs = 5;
+  static const int kDefaultMultiplexerBatchingDelayMs = 20;
+
+ private:
+  /* The rings of a client, and its channel of the multiplexer. */
+  struct HostedClient {
+    scoped_ptr<SharedMemoryRing> outgoing_ring;
+    scoped_ptr<SharedMemoryRing> incoming_ring;
+
+    /* Channel of the multiplexer, owned by it. */
+    NetworkChannel* channel;
+
+    /* Lock serializing the writers of incoming_ring. */
+    Mutex incoming_lock;
+  };
+
+  /* Passes message from the server on to client. */
+  void DeliverMessage(HostedClient* client, const string& message);
+
+  /* Passes a network status change on to client. */
+  void DeliverNetworkStatus(HostedClient* client, bool status);
+
+  /* Writes record of record_type to the ring that client reads. */
+  void WriteIncomingRecord(HostedClient* client, char record_type,
+                           const string& record);
+
+  /* Sends the messages that the clients have written since the last poll. */
+  void PollClients();
+
+  Config config_;
+  Scheduler* scheduler_;
+  Logger* logger_;
+  ChannelMultiplexer multiplexer_;
+
+  /* Lock for clients_. */
+  Mutex lock_;
+
+  /* The clients added. Owned. */
+  vector<HostedClient*> clients_;
+
+  /* Runs PollClients. */
+  scoped_ptr<HostChannelPoller> poller_;
+};
+
+/* The network channel of a client process of a HostChannelDaemon: its
+ * messages go through the rings that the daemon created for it.
+ *
+ * This class is thread-safe.
+ */
+class HostChannelClient : public NetworkChannel {
+ public:
+  /* Creates the channel of the client named client_name, whose rings are in
+   * directory, and starts polling the ring from the daemon on scheduler every
+   * poll_interval. If the daemon has not added the client yet, the rings are
+   * opened by a later poll once it has, and messages sent until then are
+   * dropped. The caller keeps ownership of scheduler and logger.
+   */
+  HostChannelClient(const string& directory, const string& client_name,
+                    Scheduler* scheduler, Logger* logger,
+                    TimeDelta poll_interval);
+
+  /* Stops polling. */
+  virtual ~HostChannelClient();
+
+  /* Returns whether the rings created by the daemon have been opened. */
+  bool IsOpen() const;
+
+  virtual void SendMessage(const string& outgoing_message);
+
+  virtual void SetMessageReceiver(MessageCallback* incoming_receiver);
+
+  virtual void AddNetworkStatusReceiver(
+      NetworkStatusCallback* network_status_receiver);
+
+ private:
+  /* Opens the rings that are not open yet. Returns whether both are.
+   *
+   * REQUIRES: lock_ is held.
+   */
+  bool OpenRings();
+
+  /* Delivers the records that the daemon has written since the last poll,
+   * once the rings are open.
+   */
+  void PollDaemon();
+
+  string directory_;
+  string client_name_;
+  Logger* logger_;
+
+  /* Lock for replacing the rings, serializing the writers of outgoing_ring_.
+   */
+  mutable Mutex lock_;
+
+  /* The ring the client writes. */
+  scoped_ptr<SharedMemoryRing> outgoing_ring_;
+
+  /* The ring the daemon writes, only read by PollDaemon. */
+  scoped_ptr<SharedMemoryRing> incoming_ring_;
+
+  /* The receivers, which must be set before messages arrive. */
+  scoped_ptr<MessageCallback> message_receiver_;
+  vector<NetworkStatusCallback*> network_status_receivers_;
+
+  /* Runs PollDaemon. */
+  scoped_ptr<HostChannelPoller> poller_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_HOST_CHANNEL_H_
@@ -0,0 +1,116 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Scheduler wrapper that measures how late and how long its tasks run.
+
+#include "google/cacheinvalidation/v2/instrumented-scheduler.h"
+
+#include "google/cacheinvalidation/v2/pooled-callback.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+const char* InstrumentedScheduler::kMeasurementNames[] = {
+  "TASKS_RUN",
+  "QUEUE_DEPTH",
+  "MAX_QUEUE_DEPTH",
+  "TOTAL_LAG_MS",
+  "MAX_LAG_MS",
+  "TOTAL_RUN_TIME_MS",
+  "MAX_RUN_TIME_MS",
+};
+
+/* Task given to the delegate for a task scheduled on the instrumented
+ * scheduler. Owns the task, so that it is deleted with the wrapper if the
+ * delegate drops it without running it.
+ */
+class InstrumentedScheduler::InstrumentedTask : public PooledClosure {
+ public:
+  InstrumentedTask(InstrumentedScheduler* scheduler, Time due_time,
+                   Closure* task)
+      : scheduler_(scheduler), due_time_(due_time), task_(task) {}
+
+  virtual ~InstrumentedTask() {
+    delete task_;
+  }
+
+  virtual void Run() {
+    scheduler_->RunTask(due_time_, task_);
+  }
+
+ private:
+  InstrumentedScheduler* scheduler_;
+  Time due_time_;
+  Closure* task_;
+};
+
+InstrumentedScheduler::InstrumentedScheduler(Scheduler* delegate)
+    : delegate_(delegate) {
+  for (int i = 0; i < NUM_MEASUREMENTS; ++i) {
+    measurements_[i] = 0;
+  }
+}
+
+void InstrumentedScheduler::Schedule(TimeDelta delay, Closure* runnable) {
+  RaiseMax(MAX_QUEUE_DEPTH, __sync_add_and_fetch(&measurements_[QUEUE_DEPTH],
+                                                 1));
+  delegate_->Schedule(
+      delay, new InstrumentedTask(this, GetCurrentTime() + delay, runnable));
+}
+
+void InstrumentedScheduler::GetNonZeroMeasurements(
+    const char* prefix, vector<pair<string, int> >* destination) {
+  for (int i = 0; i < NUM_MEASUREMENTS; ++i) {
+    int value = GetMeasurement(static_cast<Measurement>(i));
+    if (value != 0) {
+      destination->push_back(
+          make_pair(StringPrintf("%s%s", prefix, kMeasurementNames[i]),
+                    value));
+    }
+  }
+}
+
+void InstrumentedScheduler::RunTask(Time due_time, Closure* task) {
+  __sync_sub_and_fetch(&measurements_[QUEUE_DEPTH], 1);
+  Time start_time = GetCurrentTime();
+  int lag_ms = static_cast<int>((start_time - due_time).InMilliseconds());
+  AddAndRaiseMax(TOTAL_LAG_MS, MAX_LAG_MS, (lag_ms > 0) ? lag_ms : 0);
+  task->Run();
+  AddAndRaiseMax(
+      TOTAL_RUN_TIME_MS, MAX_RUN_TIME_MS,
+      static_cast<int>((GetCurrentTime() - start_time).InMilliseconds()));
+  __sync_add_and_fetch(&measurements_[TASKS_RUN], 1);
+}
+
+void InstrumentedScheduler::AddAndRaiseMax(
+    Measurement measurement, Measurement max_measurement, int value) {
+  __sync_add_and_fetch(&measurements_[measurement], value);
+  RaiseMax(max_measurement, value);
+}
+
+void InstrumentedScheduler::RaiseMax(Measurement measurement, int value) {
+  int current = measurements_[measurement];
+  while (value > current) {
+    int previous = __sync_val_compare_and_swap(&measurements_[measurement],
+                                               current, value);
+    if (previous == current) {
+      return;
+    }
+    current = previous;
+  }
+}
+
+}  // namespace invalidation
@@ -0,0 +1,117 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Scheduler wrapper that measures how late and how long its tasks run.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_INSTRUMENTED_SCHEDULER_H_
+#define GOOGLE_CACHEINVALIDATION_V2_INSTRUMENTED_SCHEDULER_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
+#include "google/cacheinvalidation/v2/time.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* A scheduler that runs its tasks on another one and measures the number of
+ * tasks waiting to run, how long after they were due they ran and how long
+ * they took. Wrap the schedulers of a SystemResources with it, and give it to
+ * the Ticl through InvalidationClientImpl::Config to have the measurements
+ * reported with the Ticl statistics.
+ *
+ * The measurements are updated atomically, so they can be read from any
+ * thread. May be called from any thread.
+ */
+class InstrumentedScheduler : public Scheduler {
+ public:
+  /* Measurements kept by the scheduler. */
+  enum Measurement {
+    /* Number of tasks run. */
+    TASKS_RUN,
+
+    /* Number of tasks scheduled and not yet run. */
+    QUEUE_DEPTH,
+
+    /* Largest number of tasks that were scheduled and not yet run. */
+    MAX_QUEUE_DEPTH,
+
+    /* Total and largest time in milliseconds by which tasks ran later than
+     * they were due.
+     */
+    TOTAL_LAG_MS,
+    MAX_LAG_MS,
+
+    /* Total and largest time in milliseconds that tasks took to run. */
+    TOTAL_RUN_TIME_MS,
+    MAX_RUN_TIME_MS,
+
+    NUM_MEASUREMENTS
+  };
+  static const char* kMeasurementNames[];
+
+  /* Creates a scheduler that runs its tasks on delegate, which it does not
+   * own.
+   */
+  explicit InstrumentedScheduler(Scheduler* delegate);
+
+  virtual void Schedule(TimeDelta delay, Closure* runnable);
+
+  virtual bool IsRunningOnThread() const {
+    return delegate_->IsRunningOnThread();
+  }
+
+  virtual Time GetCurrentTime() const {
+    return delegate_->GetCurrentTime();
+  }
+
+  /* Returns the value of measurement. */
+  int GetMeasurement(Measurement measurement) {
+    return __sync_fetch_and_add(&measurements_[measurement], 0);
+  }
+
+  /* Appends the non-zero measurements to destination, each with its name
+   * after prefix.
+   */
+  void GetNonZeroMeasurements(const char* prefix,
+                              vector<pair<string, int> >* destination);
+
+ private:
+  class InstrumentedTask;
+
+  /* Runs task, which was due at due_time, and measures it. */
+  void RunTask(Time due_time, Closure* task);
+
+  /* Adds value to measurement, and raises max_measurement to value. */
+  void AddAndRaiseMax(Measurement measurement, Measurement max_measurement,
+                      int value);
+
+  /* Raises measurement to value if it is lower. */
+  void RaiseMax(Measurement measurement, int value);
+
+  /* The scheduler that runs the tasks. */
+  Scheduler* delegate_;
+
+  int measurements_[NUM_MEASUREMENTS];
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_INSTRUMENTED_SCHEDULER_H_
@@ -16,23 +16,51 @@
 
 #include "google/cacheinvalidation/v2/invalidation-client-impl.h"
 
+#include <algorithm>
 #include <sstream>
 
 #include "google/cacheinvalidation/callback.h"
 #include "google/cacheinvalidation/random.h"
 #include "google/cacheinvalidation/v2/client_test_internal.pb.h"
+#include "google/cacheinvalidation/v2/compact-registration-store.h"
 #include "google/cacheinvalidation/v2/invalidation-client-util.h"
 #include "google/cacheinvalidation/v2/log-macro.h"
+#include "google/cacheinvalidation/v2/memory-usage.h"
+#include "google/cacheinvalidation/v2/object-id-digest-utils.h"
+#include "google/cacheinvalidation/v2/partitioned-registration-store.h"
 #include "google/cacheinvalidation/v2/persistence-utils.h"
+#include "google/cacheinvalidation/v2/pooled-callback.h"
 #include "google/cacheinvalidation/v2/proto-converter.h"
 #include "google/cacheinvalidation/v2/proto-helpers.h"
 #include "google/cacheinvalidation/v2/sha1-digest-function.h"
 #include "google/cacheinvalidation/v2/smearer.h"
 #include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/trace.h"
 
 namespace invalidation {
 
 using ::ipc::invalidation::RegistrationManagerStateP;
+using INVALIDATION_STL_NAMESPACE::stable_partition;
+
+/* Predicate for the batch entries about objects of the urgent sources of a
+ * protocol handler.
+ */
+class IsUrgentEntry {
+ public:
+  explicit IsUrgentEntry(const ProtocolHandler* protocol_handler)
+      : protocol_handler_(protocol_handler) {}
+
+  bool operator()(const pair<Invalidation, AckHandle>& entry) const {
+    return protocol_handler_->IsUrgentSource(entry.first.object_id().source());
+  }
+
+  bool operator()(const pair<ObjectId, AckHandle>& entry) const {
+    return protocol_handler_->IsUrgentSource(entry.first.source());
+  }
+
+ private:
+  const ProtocolHandler* protocol_handler_;
+};
 
 /* Modifies configParams to contain the list of configuration parameter
  * names and their values.
@@ -46,10 +74,62 @@ void InvalidationClientImpl::Config::GetConfigParams(
       make_pair("writeRetryDelay", write_retry_delay.InMilliseconds()));
   config_params->push_back(
       make_pair("heartbeatInterval", heartbeat_interval.InMilliseconds()));
+  config_params->push_back(
+      make_pair("suppressRedundantHeartbeats",
+                suppress_redundant_heartbeats ? 1 : 0));
   config_params->push_back(
       make_pair("perfCounterDelay", perf_counter_delay.InMilliseconds()));
   config_params->push_back(
       make_pair("maxExponentialBackoffFactor", max_exponential_backoff_factor));
+  config_params->push_back(
+      make_pair("decorrelatedTokenBackoff",
+                decorrelated_token_backoff ? 1 : 0));
+  config_params->push_back(
+      make_pair("maxRegistrationSyncSubtreeSize",
+                max_registration_sync_subtree_size));
+  config_params->push_back(
+      make_pair("useCompactRegistrationStore",
+                use_compact_registration_store ? 1 : 0));
+  config_params->push_back(
+      make_pair("partitionRegistrationsBySource",
+                partition_registrations_by_source ? 1 : 0));
+  config_params->push_back(
+      make_pair("useRegistrationFilter", use_registration_filter ? 1 : 0));
+  config_params->push_back(
+      make_pair("elideRedundantRegistrations",
+                elide_redundant_registrations ? 1 : 0));
+  config_params->push_back(
+      make_pair("minPreparedRegistrationBatchSize",
+                min_prepared_registration_batch_size));
+  config_params->push_back(
+      make_pair("numListenerDispatchThreads", num_listener_dispatch_threads));
+  config_params->push_back(
+      make_pair("coalesceInvalidations", coalesce_invalidations ? 1 : 0));
+  config_params->push_back(
+      make_pair("maxOutstandingInvalidations", max_outstanding_invalidations));
+  config_params->push_back(
+      make_pair("ackedVersionCacheSize", acked_version_cache_size));
+  config_params->push_back(
+      make_pair("catchUpAfterTokenLoss", catch_up_after_token_loss ? 1 : 0));
+  config_params->push_back(
+      make_pair("persistRegistrations", persist_registrations ? 1 : 0));
+  config_params->push_back(
+      make_pair("registrationLogCompactionThreshold",
+                registration_log_compaction_threshold));
+  config_params->push_back(
+      make_pair("registrationLease", registration_lease.InMilliseconds()));
+  config_params->push_back(
+      make_pair("statisticsExportInterval",
+                statistics_export_interval.InMilliseconds()));
+  config_params->push_back(
+      make_pair("eventLogLog2Capacity", event_log_log2_capacity));
+  config_params->push_back(
+      make_pair("publishClientState", publish_client_state ? 1 : 0));
+  config_params->push_back(
+      make_pair("shardStatisticsCounters",
+                shard_statistics_counters ? 1 : 0));
+  config_params->push_back(
+      make_pair("provisionedState", provisioned_state.empty() ? 0 : 1));
   protocol_handler_config.GetConfigParams(config_params);
 }
 
@@ -61,6 +141,26 @@ string InvalidationClientImpl::Config::ToString() {
   return stream.str();
 }
 
+/* Returns the seed for the token backoff delays of a client: the current
+ * time, mixed with a hash of client_name if the delays are decorrelated, so
+ * that clients started at the same time do not draw the same delays.
+ */
+static int64 GetTokenBackoffSeed(
+    SystemResources* resources, const string& client_name,
+    const InvalidationClientImpl::Config& config) {
+  int64 seed = InvalidationClientUtil::GetCurrentTimeMs(
+      resources->internal_scheduler());
+  if (config.decorrelated_token_backoff) {
+    uint64 hash = 14695981039346656037ULL;  // FNV-1a.
+    for (size_t i = 0; i < client_name.size(); ++i) {
+      hash = (hash ^ static_cast<unsigned char>(client_name[i])) *
+          1099511628211ULL;
+    }
+    seed ^= static_cast<int64>(hash);
+  }
+  return seed;
+}
+
 InvalidationClientImpl::InvalidationClientImpl(
     SystemResources* resources, int client_type, const string& client_name,
     Config config, const string& application_name,
@@ -68,10 +168,16 @@ InvalidationClientImpl::InvalidationClientImpl(
     : resources_(resources),
       internal_scheduler_(resources->internal_scheduler()),
       logger_(resources->logger()),
-      statistics_(new Statistics()),
+      statistics_(new Statistics(config.shard_statistics_counters)),
+      event_log_((config.event_log_log2_capacity > 0) ?
+                 new EventLog(config.event_log_log2_capacity) : NULL),
+      state_snapshot_(config.publish_client_state ?
+                      new ClientStateSnapshot() : NULL),
       listener_(new CheckingInvalidationListener(
           listener, statistics_.get(), internal_scheduler_,
-          resources_->listener_scheduler(), logger_)),
+          resources_->listener_scheduler(), logger_,
+          config.num_listener_dispatch_threads,
+          config.coalesce_invalidations)),
       config_(config),
       client_type_(client_type),
       digest_fn_(new Sha1DigestFunction()),
@@ -79,35 +185,137 @@ InvalidationClientImpl::InvalidationClientImpl(
       msg_validator_(new TiclMessageValidator(logger_)),
       protocol_handler_(config.protocol_handler_config, resources,
                         statistics_.get(), application_name, this,
-                        msg_validator_.get()),
+                        msg_validator_.get(), event_log_.get()),
       operation_scheduler_(logger_, internal_scheduler_),
+      submission_queue_(internal_scheduler_),
       token_exponential_backoff_(
-          new Random(InvalidationClientUtil::GetCurrentTimeMs(
-              resources->internal_scheduler())),
+          new Random(GetTokenBackoffSeed(resources, client_name, config)),
           config.max_exponential_backoff_factor *
               config.network_timeout_delay,
           config.network_timeout_delay),
-      persistence_exponential_backoff_(
-          new Random(InvalidationClientUtil::GetCurrentTimeMs(
-              resources->internal_scheduler())),
-          config.max_exponential_backoff_factor *
-              config.write_retry_delay,
+      state_writer_(
+          resources->storage(), internal_scheduler_, logger_,
+          statistics_.get(), kClientTokenKey,
+          new ExponentialBackoffDelayGenerator(
+              new Random(InvalidationClientUtil::GetCurrentTimeMs(
+                  resources->internal_scheduler())),
+              config.max_exponential_backoff_factor *
+                  config.write_retry_delay,
+              config.write_retry_delay),
           config.write_retry_delay),
       smearer_(new Random(InvalidationClientUtil::GetCurrentTimeMs(
           resources->internal_scheduler()))),
+      restored_registrations_(false),
+      start_internal_done_(false),
+      is_state_blob_read_(false),
+      is_registration_log_loaded_(false),
+      is_timeout_check_deferred_(false),
       heartbeat_task_(
           NewPermanentCallback(this, &InvalidationClientImpl::HeartbeatTask)),
       timeout_task_(
           NewPermanentCallback(
-              this, &InvalidationClientImpl::CheckNetworkTimeouts)) {
+              this, &InvalidationClientImpl::CheckNetworkTimeouts)),
+      registration_sync_task_(
+          NewPermanentCallback(
+              this, &InvalidationClientImpl::RegistrationSyncTask)),
+      export_statistics_task_(
+          NewPermanentCallback(
+              this, &InvalidationClientImpl::ExportStatisticsTask)),
+      registration_lease_task_(
+          NewPermanentCallback(
+              this, &InvalidationClientImpl::RegistrationLeaseTask)),
+      payload_fetch_timeout_task_(
+          NewPermanentCallback(
+              this, &InvalidationClientImpl::PayloadFetchTimeoutTask)),
+      registration_lease_operation_(NULL) {
   application_client_id_.set_client_name(client_name);
-  operation_scheduler_.SetOperation(
+  statistics_->SetInstrumentedSchedulers(
+      config.instrumented_internal_scheduler,
+      config.instrumented_listener_scheduler);
+  token_exponential_backoff_.set_decorrelated(
+      config.decorrelated_token_backoff);
+  if (config.use_compact_registration_store) {
+    registration_manager_.SetDigestStore(
+        new CompactRegistrationStore(digest_fn_.get()));
+  } else if (config.partition_registrations_by_source) {
+    registration_manager_.SetDigestStore(
+        new PartitionedRegistrationStore(digest_fn_.get()));
+  }
+  if (config.use_registration_filter) {
+    registration_manager_.EnableRegistrationFilter();
+  }
+  if (config.acked_version_cache_size > 0) {
+    acked_versions_.reset(
+        new AckedVersionCache(config.acked_version_cache_size));
+  }
+  if (config.persist_registrations) {
+    registration_log_.reset(new RegistrationLog(
+        resources->storage(), internal_scheduler_, logger_, statistics_.get(),
+        config.registration_log_compaction_threshold,
+        new ExponentialBackoffDelayGenerator(
+            new Random(InvalidationClientUtil::GetCurrentTimeMs(
+                resources->internal_scheduler())),
+            config.max_exponential_backoff_factor * config.write_retry_delay,
+            config.write_retry_delay),
+        config.write_retry_delay));
+    registration_manager_.EnableRegistrationLog(registration_log_.get());
+  }
+  timeout_operation_ = operation_scheduler_.SetOperation(
       config.network_timeout_delay, timeout_task_.get(), "[timeout task]");
-  operation_scheduler_.SetOperation(
+  heartbeat_operation_ = operation_scheduler_.SetOperation(
       config.heartbeat_interval, heartbeat_task_.get(), "[heartbeat task]");
+  registration_sync_operation_ = operation_scheduler_.SetOperation(
+      config.protocol_handler_config.batching_delay,
+      registration_sync_task_.get(), "[registration sync task]");
+  export_statistics_operation_ = operation_scheduler_.SetOperation(
+      config.statistics_export_interval, export_statistics_task_.get(),
+      "[export statistics task]");
+  if (config.registration_lease > TimeDelta()) {
+    registration_leases_.reset(new RegistrationLeaseWheel(
+        config.registration_lease.InMilliseconds(),
+        InvalidationClientUtil::GetCurrentTimeMs(internal_scheduler_)));
+    registration_lease_operation_ = operation_scheduler_.SetOperation(
+        TimeDelta::FromMilliseconds(registration_leases_->tick_ms()),
+        registration_lease_task_.get(), "[registration lease task]");
+  }
+  payload_fetch_timeout_operation_ = operation_scheduler_.SetOperation(
+      config.network_timeout_delay, payload_fetch_timeout_task_.get(),
+      "[payload fetch timeout task]");
   TLOG(logger_, INFO, "Created client: %s", ToString().c_str());
 }
 
+InvalidationClientImpl::~InvalidationClientImpl() {
+  for (map<string, PendingPayloadFetch>::iterator iter =
+           pending_payload_fetches_.begin();
+       iter != pending_payload_fetches_.end(); ++iter) {
+    for (size_t i = 0; i < iter->second.callbacks.size(); ++i) {
+      delete iter->second.callbacks[i];
+    }
+  }
+  // Each call is deleted with its last waiting object.
+  for (CompletionMap::iterator iter = pending_completions_.begin();
+       iter != pending_completions_.end(); ++iter) {
+    PendingCompletion* completion = iter->second.second;
+    if (--completion->num_pending == 0) {
+      delete completion->callback;
+      delete completion;
+    }
+  }
+  // The calls held until start are not tracked by any PendingCompletion yet,
+  // so each is owned by its operation alone.
+  for (size_t i = 0; i < pre_start_operations_.size(); ++i) {
+    delete pre_start_operations_[i].callback;
+  }
+}
+
+void InvalidationClientImpl::SerializeProvisionedState(
+    const string& client_token, string* state_blob) {
+  PersistentTiclState state;
+  state.set_client_token(client_token);
+  Sha1DigestFunction digest_fn;
+  PersistenceUtils::SerializeState(state, &digest_fn, state_blob);
+}
+
 void InvalidationClientImpl::Start() {
   // Initialize the nonce so that we can maintain the invariant that exactly
   // one of "nonce" and "clientToken" is non-null.
@@ -116,14 +324,35 @@ void InvalidationClientImpl::Start() {
 
   TLOG(logger_, INFO, "Starting with C++ config: %s",
        config_.ToString().c_str());
+  start_time_ = internal_scheduler_->GetCurrentTime();
 
-  // Read the state blob and then schedule startInternal once the value is
-  // there.
-  ScheduleStartAfterReadingStateBlob();
+  // The registration log and the state blob are independent, so load the log
+  // while the blob is being read. StartInternal runs once both are there.
+  if (registration_log_.get() != NULL) {
+    internal_scheduler_->Schedule(
+        Scheduler::NoDelay(),
+        NewPermanentCallback(
+            registration_log_.get(), &RegistrationLog::Load,
+            NewPermanentCallback(
+                this, &InvalidationClientImpl::HandleRegistrationLogLoaded)));
+  } else {
+    is_registration_log_loaded_ = true;
+  }
+  if (!config_.provisioned_state.empty()) {
+    // The token was acquired for us: start from it rather than from storage.
+    internal_scheduler_->Schedule(
+        Scheduler::NoDelay(),
+        NewPermanentCallback(
+            this, &InvalidationClientImpl::HandleStateBlobRead,
+            config_.provisioned_state));
+  } else {
+    ScheduleStartAfterReadingStateBlob();
+  }
 }
 
 void InvalidationClientImpl::StartInternal(const string& serialized_state) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  Time restore_start_time = internal_scheduler_->GetCurrentTime();
 
   // Initialize the session manager using the persisted client token.
   PersistentTiclState persistent_state;
@@ -148,22 +377,28 @@ void InvalidationClientImpl::StartInternal(const string& serialized_state) {
     //
     // In the common case, the server will already have all of our
     // registrations, but we won't know for sure until we've gotten its summary.
-    // We'll ask the application for all of its registrations, but to avoid
-    // making the registrar redo the work of performing registrations that
-    // probably already exist, we'll suppress sending them to the registrar.
+    // Unless we restore the registrations persisted along with the summary
+    // that the server last sent, we'll ask the application for all of its
+    // registrations, but to avoid making the registrar redo the work of
+    // performing registrations that probably already exist, we'll suppress
+    // sending them to the registrar.
     TLOG(logger_, INFO, "Restarting from persistent state: %s",
          ProtoHelpers::ToString(
              persistent_state.client_token()).c_str());
+    restored_registrations_ = (registration_log_.get() != NULL) &&
+        registration_manager_.RestoreRegistrations();
     set_nonce("");
     set_client_token(persistent_state.client_token());
-    should_send_registrations_ = false;
+    // A provisioned token has typically never been used, so the server has
+    // none of our registrations: send them as when starting fresh.
+    should_send_registrations_ = !config_.provisioned_state.empty();
     SendInfoMessageToServer(false, true);
 
     // We need to ensure that heartbeats are sent, regardless of whether we
     // start fresh or from persistent state.  The line below ensures that they
     // are scheduled in the persistent startup case.  For the other case, the
     // task is scheduled when we acquire a token.
-    operation_scheduler_.Schedule(heartbeat_task_.get());
+    operation_scheduler_.Schedule(heartbeat_operation_);
   } else {
     // If we had no persistent state or couldn't deserialize the state that we
     // had, start fresh.  Request a new client identifier.
@@ -171,9 +406,31 @@ void InvalidationClientImpl::StartInternal(const string& serialized_state) {
     // The server can't possibly have our registrations, so whatever we get
     // from the application we should send to the registrar.
     TLOG(logger_, INFO, "Starting with no previous state");
+    if (registration_log_.get() != NULL) {
+      registration_manager_.DiscardRestoredRegistrations();
+    }
+    restored_registrations_ = false;
     should_send_registrations_ = true;
     ScheduleAcquireToken("Startup");
   }
+  start_internal_done_ = true;
+  start_internal_done_time_ = internal_scheduler_->GetCurrentTime();
+  if (config_.statistics_sink != NULL) {
+    operation_scheduler_.Schedule(export_statistics_operation_);
+  }
+  RecordStartupPhaseSince(Statistics::StartupPhaseType_STATE_RESTORE_MS,
+                          restore_start_time);
+
+  // Perform the operations that the application submitted before the Ticl
+  // started.  When starting fresh, the registrations are batched with the
+  // initialize message instead of waiting for the Ticl to acquire a token.
+  for (size_t i = 0; i < pre_start_operations_.size(); ++i) {
+    const PreStartOperation& operation = pre_start_operations_[i];
+    PerformRegisterOperationsInternal(operation.object_ids,
+                                      operation.reg_op_type,
+                                      operation.callback);
+  }
+  pre_start_operations_.clear();
   // InvalidationListener.Ready() is called when the ticl has acquired a
   // new token.
 }
@@ -189,50 +446,123 @@ void InvalidationClientImpl::StopInternal() {
   if (ticl_state_.IsStarted()) {
     ticl_state_.Stop();
   }
+  PublishState();
 }
 
 void InvalidationClientImpl::Register(const ObjectId& object_id) {
   vector<ObjectId> object_ids;
   object_ids.push_back(object_id);
-  PerformRegisterOperations(object_ids, RegistrationP_OpType_REGISTER);
+  PerformRegisterOperations(object_ids, RegistrationP_OpType_REGISTER, NULL);
 }
 
 void InvalidationClientImpl::Unregister(const ObjectId& object_id) {
   vector<ObjectId> object_ids;
   object_ids.push_back(object_id);
-  PerformRegisterOperations(object_ids, RegistrationP_OpType_UNREGISTER);
+  PerformRegisterOperations(object_ids, RegistrationP_OpType_UNREGISTER,
+                            NULL);
 }
 
 void InvalidationClientImpl::PerformRegisterOperations(
-    const vector<ObjectId>& object_ids, RegistrationP::OpType reg_op_type) {
+    const vector<ObjectId>& object_ids, RegistrationP::OpType reg_op_type,
+    CompletionCallback* callback) {
   CHECK(!object_ids.empty()) << "Must specify some object id";
 
-  CHECK(ticl_state_.IsStarted() || ticl_state_.IsStopped()) <<
-      "Cannot call " << reg_op_type << " for object " <<
-      " when the Ticl has not been started. If start has been " <<
-      "called, caller must wait for InvalidationListener.Ready";
+  // Operations submitted before the Ticl has started are held on the internal
+  // thread until StartInternal runs (see PerformRegisterOperationsInternal).
   if (ticl_state_.IsStopped()) {
     // The Ticl has been stopped. This might be some old registration op
     // coming in. Just ignore instead of crashing.
     TLOG(logger_, WARNING, "Ticl stopped: register (%d) of %d objects ignored.",
          reg_op_type, object_ids.size());
+    delete callback;
     return;
   }
 
-  internal_scheduler_->Schedule(
-      Scheduler::NoDelay(),
-      NewPermanentCallback(
+  int min_batch_size = config_.min_prepared_registration_batch_size;
+  if ((min_batch_size > 0) &&
+      (object_ids.size() >= static_cast<size_t>(min_batch_size))) {
+    // Do the conversions and the digests here, on the caller's thread, with a
+    // digest function of its own since digest_fn_ belongs to the internal
+    // thread.
+    PreparedRegisterOperations* operations = new PreparedRegisterOperations();
+    operations->object_ids = object_ids;
+    operations->reg_op_type = reg_op_type;
+    operations->callback = callback;
+    operations->object_id_protos.resize(object_ids.size());
+    for (size_t i = 0; i < object_ids.size(); ++i) {
+      ProtoConverter::ConvertToObjectIdProto(
+          object_ids[i], &operations->object_id_protos[i]);
+    }
+    Sha1DigestFunction digest_fn;
+    ObjectIdDigestUtils::GetDigests(operations->object_id_protos, &digest_fn,
+                                    &operations->digests);
+    submission_queue_.Submit(
+        NewPooledCallback(
+            this, &InvalidationClientImpl::PerformPreparedRegisterOperations,
+            operations));
+    return;
+  }
+
+  submission_queue_.Submit(
+      NewPooledCallback(
           this, &InvalidationClientImpl::PerformRegisterOperationsInternal,
-          object_ids, reg_op_type));
+          object_ids, reg_op_type, callback));
 }
 
 void InvalidationClientImpl::PerformRegisterOperationsInternal(
-    const vector<ObjectId>& object_ids, RegistrationP::OpType reg_op_type) {
-  vector<ObjectIdP> object_id_protos;
+    const vector<ObjectId>& object_ids, RegistrationP::OpType reg_op_type,
+    CompletionCallback* callback) {
+  if (!start_internal_done_) {
+    // The persistent state has not been read yet, so we don't know whether the
+    // registrations need to be sent.  Hold on to them until StartInternal,
+    // which lets them ride along with the first message to the server.  They
+    // are tracked when StartInternal performs them, through this method again.
+    TLOG(logger_, INFO, "Queueing register (%d) of %d objects until start",
+         reg_op_type, static_cast<int>(object_ids.size()));
+    PreStartOperation operation;
+    operation.object_ids = object_ids;
+    operation.reg_op_type = reg_op_type;
+    operation.callback = callback;
+    pre_start_operations_.push_back(operation);
+    return;
+  }
+  vector<ObjectIdP> object_id_protos(object_ids.size());
   for (size_t i = 0; i < object_ids.size(); ++i) {
-    const ObjectId& object_id = object_ids[i];
-    ObjectIdP object_id_proto;
-    ProtoConverter::ConvertToObjectIdProto(object_id, &object_id_proto);
+    ProtoConverter::ConvertToObjectIdProto(object_ids[i],
+                                           &object_id_protos[i]);
+  }
+  TrackRegistrationTimes(object_id_protos, reg_op_type);
+  TrackCompletion(object_id_protos, reg_op_type, callback);
+  ApplyRegisterOperations(object_id_protos, NULL, reg_op_type);
+}
+
+void InvalidationClientImpl::PerformPreparedRegisterOperations(
+    PreparedRegisterOperations* operations) {
+  scoped_ptr<PreparedRegisterOperations> deleter(operations);
+  if (!start_internal_done_) {
+    // Queue the operations like any other; they are digested again when the
+    // Ticl starts, which is rare enough not to keep the digests for.
+    PerformRegisterOperationsInternal(operations->object_ids,
+                                      operations->reg_op_type,
+                                      operations->callback);
+    return;
+  }
+  TrackRegistrationTimes(operations->object_id_protos,
+                         operations->reg_op_type);
+  TrackCompletion(operations->object_id_protos, operations->reg_op_type,
+                  operations->callback);
+  ApplyRegisterOperations(operations->object_id_protos,
+                          &operations->digests, operations->reg_op_type);
+}
+
+void InvalidationClientImpl::ApplyRegisterOperations(
+    const vector<ObjectIdP>& requested_object_ids,
+    const vector<string>* requested_digests,
+    RegistrationP::OpType reg_op_type) {
+  TICL_EVENT(event_log_.get(), EVENT_REGISTER_OPERATIONS, reg_op_type,
+             requested_object_ids.size());
+  for (size_t i = 0; i < requested_object_ids.size(); ++i) {
+    const ObjectIdP& object_id_proto = requested_object_ids[i];
     Statistics::IncomingOperationType op_type =
         (reg_op_type == RegistrationP_OpType_REGISTER) ?
         Statistics::IncomingOperationType_REGISTRATION :
@@ -240,19 +570,145 @@ void InvalidationClientImpl::PerformRegisterOperationsInternal(
     statistics_->RecordIncomingOperation(op_type);
     TLOG(logger_, INFO, "Register %s, %d",
          ProtoHelpers::ToString(object_id_proto).c_str(), reg_op_type);
-    object_id_protos.push_back(object_id_proto);
+  }
+
+  // The operations beyond the budget of their source are failed rather than
+  // queued, as if never requested.
+  vector<ObjectIdP> admitted_object_ids;
+  vector<string> admitted_digests;
+  bool has_rejected = should_send_registrations_ &&
+      protocol_handler_.HasRegistrationBudgets() &&
+      RejectOverBudgetOperations(requested_object_ids, requested_digests,
+                                 reg_op_type, &admitted_object_ids,
+                                 &admitted_digests);
+  const vector<ObjectIdP>& object_id_protos =
+      has_rejected ? admitted_object_ids : requested_object_ids;
+  const vector<string>* digests = (has_rejected && requested_digests != NULL) ?
+      &admitted_digests : requested_digests;
+  if (object_id_protos.empty()) {
+    return;
+  }
+
+  // Once the server is known to agree with the desired registrations, the
+  // operations that leave them unchanged need not be sent.
+  const vector<ObjectIdP>* changed_object_ids = &object_id_protos;
+  const vector<string>* changed_digests = digests;
+  vector<ObjectIdP> remaining_object_ids;
+  vector<string> remaining_digests;
+  if (config_.elide_redundant_registrations && start_internal_done_ &&
+      registration_manager_.IsStateInSyncWithServer() &&
+      ElideRedundantOperations(object_id_protos, digests, reg_op_type,
+                               &remaining_object_ids, &remaining_digests)) {
+    changed_object_ids = &remaining_object_ids;
+    changed_digests = (digests != NULL) ? &remaining_digests : NULL;
+  }
+
+  // Leases are renewed whether or not the registration is sent.
+  if (registration_leases_.get() != NULL) {
+    if (reg_op_type == RegistrationP_OpType_REGISTER) {
+      registration_leases_->Renew(
+          object_id_protos,
+          InvalidationClientUtil::GetCurrentTimeMs(internal_scheduler_));
+      operation_scheduler_.Schedule(registration_lease_operation_);
+    } else {
+      registration_leases_->Remove(object_id_protos);
+    }
+  }
+  if (changed_object_ids->empty()) {
+    return;
   }
 
   // Update the registration manager state, then have the protocol client send a
   // message.
-  registration_manager_.PerformOperations(object_id_protos, reg_op_type);
+  registration_manager_.PerformOperations(*changed_object_ids, changed_digests,
+                                          reg_op_type);
+  PublishState();
 
   // Check whether we should suppress sending registrations because we don't
   // yet know the server's summary.
   if (should_send_registrations_) {
-    protocol_handler_.SendRegistrations(object_id_protos, reg_op_type);
+    protocol_handler_.SendRegistrations(*changed_object_ids, reg_op_type);
+  }
+  operation_scheduler_.Schedule(timeout_operation_);
+}
+
+bool InvalidationClientImpl::RejectOverBudgetOperations(
+    const vector<ObjectIdP>& object_ids, const vector<string>* digests,
+    RegistrationP::OpType reg_op_type, vector<ObjectIdP>* admitted_object_ids,
+    vector<string>* admitted_digests) {
+  vector<bool> is_admitted;
+  protocol_handler_.AdmitRegistrations(object_ids, &is_admitted);
+  vector<ObjectIdP> rejected_object_ids;
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    if (is_admitted[i]) {
+      admitted_object_ids->push_back(object_ids[i]);
+      if (digests != NULL) {
+        admitted_digests->push_back((*digests)[i]);
+      }
+    } else {
+      rejected_object_ids.push_back(object_ids[i]);
+    }
+  }
+  if (rejected_object_ids.empty()) {
+    return false;
+  }
+  TLOG(logger_, WARNING, "Rejecting %d (un)registrations over budget (%d)",
+       static_cast<int>(rejected_object_ids.size()), reg_op_type);
+
+  // They are not sent, so no confirmation will come from the server.
+  UntrackRegistrationTimes(rejected_object_ids);
+  Status status(Status::TRANSIENT_FAILURE, "Over the budget of its source");
+  for (size_t i = 0; i < rejected_object_ids.size(); ++i) {
+    ObjectId object_id;
+    ProtoConverter::ConvertFromObjectIdProto(rejected_object_ids[i],
+                                             &object_id);
+    listener_->InformRegistrationFailure(this, object_id, true,
+                                         status.message());
+    CompleteOperation(rejected_object_ids[i], reg_op_type, status);
+  }
+  return true;
+}
+
+bool InvalidationClientImpl::ElideRedundantOperations(
+    const vector<ObjectIdP>& object_ids, const vector<string>* digests,
+    RegistrationP::OpType reg_op_type, vector<ObjectIdP>* changed_object_ids,
+    vector<string>* changed_digests) {
+  bool is_register = (reg_op_type == RegistrationP_OpType_REGISTER);
+  vector<ObjectIdP> elided_object_ids;
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    if (registration_manager_.IsDesiredRegistration(object_ids[i]) ==
+        is_register) {
+      elided_object_ids.push_back(object_ids[i]);
+    } else {
+      changed_object_ids->push_back(object_ids[i]);
+      if (digests != NULL) {
+        changed_digests->push_back((*digests)[i]);
+      }
+    }
+  }
+  if (elided_object_ids.empty()) {
+    return false;
+  }
+  TLOG(logger_, FINE, "Eliding %d redundant (un)registrations (%d)",
+       static_cast<int>(elided_object_ids.size()), reg_op_type);
+
+  // No confirmation will come from the server for these.
+  UntrackRegistrationTimes(elided_object_ids);
+  InvalidationListener::RegistrationState reg_state = is_register ?
+      InvalidationListener::REGISTERED : InvalidationListener::UNREGISTERED;
+  vector<pair<ObjectId, InvalidationListener::RegistrationState> >
+      reg_state_batch(elided_object_ids.size());
+  for (size_t i = 0; i < elided_object_ids.size(); ++i) {
+    ProtoConverter::ConvertFromObjectIdProto(elided_object_ids[i],
+                                             &reg_state_batch[i].first);
+    reg_state_batch[i].second = reg_state;
   }
-  operation_scheduler_.Schedule(timeout_task_.get());
+  listener_->InformRegistrationStatusBatch(this, reg_state_batch);
+  for (size_t i = 0; i < elided_object_ids.size(); ++i) {
+    CompleteOperation(elided_object_ids[i], reg_op_type,
+                      Status(Status::SUCCESS, ""));
+  }
+  return true;
 }
 
 void InvalidationClientImpl::Acknowledge(const AckHandle& acknowledge_handle) {
@@ -262,19 +718,120 @@ void InvalidationClientImpl::Acknowledge(const AckHandle& acknowledge_handle) {
     return;
   }
 
-  internal_scheduler_->Schedule(
-      Scheduler::NoDelay(),
-      NewPermanentCallback(
+  submission_queue_.Submit(
+      NewPooledCallback(
           this, &InvalidationClientImpl::AcknowledgeInternal,
           acknowledge_handle));
 }
 
+void InvalidationClientImpl::Acknowledge(
+    const vector<AckHandle>& ack_handles) {
+  Acknowledge(ack_handles, NULL);
+}
+
+void InvalidationClientImpl::Acknowledge(
+    const vector<AckHandle>& ack_handles, CompletionCallback* callback) {
+  // Like PerformRegisterOperations, hand all the handles to the internal
+  // thread in one task.
+  if (ack_handles.empty() && (callback == NULL)) {
+    return;
+  }
+  submission_queue_.Submit(
+      NewPooledCallback(
+          this, &InvalidationClientImpl::AcknowledgeAllInternal,
+          ack_handles, callback));
+}
+
+void InvalidationClientImpl::FetchPayload(const Invalidation& invalidation,
+                                          PayloadCallback* callback) {
+  submission_queue_.Submit(
+      NewPooledCallback(
+          this, &InvalidationClientImpl::FetchPayloadInternal,
+          invalidation.payload_reference(), callback));
+}
+
+void InvalidationClientImpl::FetchPayloadInternal(
+    const string& payload_reference, PayloadCallback* callback) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (payload_reference.empty()) {
+    resources_->listener_scheduler()->Schedule(
+        Scheduler::NoDelay(),
+        NewPooledCallback(
+            this, &InvalidationClientImpl::RunPayloadCallback, callback,
+            StatusStringPair(Status(Status::PERMANENT_FAILURE,
+                                    "No payload reference"), "")));
+    return;
+  }
+  PendingPayloadFetch& fetch = pending_payload_fetches_[payload_reference];
+  if (fetch.callbacks.empty()) {
+    fetch.request_time = internal_scheduler_->GetCurrentTime();
+    protocol_handler_.SendPayloadFetch(payload_reference);
+    operation_scheduler_.Schedule(payload_fetch_timeout_operation_);
+  }
+  fetch.callbacks.push_back(callback);
+}
+
+void InvalidationClientImpl::CompletePayloadFetch(
+    const string& payload_reference, const StatusStringPair& result) {
+  map<string, PendingPayloadFetch>::iterator iter =
+      pending_payload_fetches_.find(payload_reference);
+  if (iter == pending_payload_fetches_.end()) {
+    return;
+  }
+  const vector<PayloadCallback*>& callbacks = iter->second.callbacks;
+  for (size_t i = 0; i < callbacks.size(); ++i) {
+    resources_->listener_scheduler()->Schedule(
+        Scheduler::NoDelay(),
+        NewPooledCallback(
+            this, &InvalidationClientImpl::RunPayloadCallback, callbacks[i],
+            result));
+  }
+  pending_payload_fetches_.erase(iter);
+}
+
+void InvalidationClientImpl::RunPayloadCallback(PayloadCallback* callback,
+                                                StatusStringPair result) {
+  callback->Run(result);
+  delete callback;
+}
+
+void InvalidationClientImpl::AcknowledgeAllInternal(
+    const vector<AckHandle>& ack_handles, CompletionCallback* callback) {
+  int num_malformed = 0;
+  for (size_t i = 0; i < ack_handles.size(); ++i) {
+    if (!ack_handles[i].IsNoOp() && !SendAcknowledgement(ack_handles[i])) {
+      ++num_malformed;
+    }
+  }
+  PublishState();
+  if (callback == NULL) {
+    return;
+  }
+  Status status(Status::SUCCESS, "");
+  if (num_malformed > 0) {
+    status = Status(Status::PERMANENT_FAILURE,
+                    StringPrintf("%d malformed ack handles", num_malformed));
+  }
+  resources_->listener_scheduler()->Schedule(
+      Scheduler::NoDelay(),
+      NewPooledCallback(
+          this, &InvalidationClientImpl::RunCompletionCallback, callback,
+          status));
+}
+
 void InvalidationClientImpl::AcknowledgeInternal(
     const AckHandle& acknowledge_handle) {
+  SendAcknowledgement(acknowledge_handle);
+  PublishState();
+}
+
+bool InvalidationClientImpl::SendAcknowledgement(
+    const AckHandle& acknowledge_handle) {
   // Validate the ack handle.
 
-  // 1. Parse the ack handle first.
-  AckHandleP ack_handle;
+  // 1. Parse the ack handle first, into the reused proto so that, once warmed
+  // up, parsing does not allocate.
+  AckHandleP& ack_handle = parsed_ack_handle_;
   ack_handle.ParseFromString(acknowledge_handle.handle_data());
   if (!ack_handle.IsInitialized()) {
     TLOG(logger_, WARNING, "Bad ack handle : %s",
@@ -282,7 +839,7 @@ void InvalidationClientImpl::AcknowledgeInternal(
              acknowledge_handle.handle_data()).c_str());
     statistics_->RecordError(
         Statistics::ClientErrorType_ACKNOWLEDGE_HANDLE_FAILURE);
-    return;
+    return false;
   }
 
   // 2. Validate ack handle - it should have a valid invalidation.
@@ -292,14 +849,121 @@ void InvalidationClientImpl::AcknowledgeInternal(
          ProtoHelpers::ToString(ack_handle).c_str());
     statistics_->RecordError(
         Statistics::ClientErrorType_ACKNOWLEDGE_HANDLE_FAILURE);
-    return;
+    return false;
   }
 
   // Currently, only invalidations have non-trivial ack handle.
   const InvalidationP& invalidation = ack_handle.invalidation();
+  TICL_EVENT_BYTES(event_log_.get(), EVENT_INVALIDATION_ACKED,
+                   invalidation.version(), invalidation.object_id().source(),
+                   invalidation.object_id().name());
   statistics_->RecordIncomingOperation(
       Statistics::IncomingOperationType_ACKNOWLEDGE);
+  if (!outstanding_invalidations_.empty()) {
+    // Only the ack of the invalidation last issued for the object frees its
+    // place; duplicate and stale acks do not.
+    string object_key;
+    invalidation.object_id().SerializeToString(&object_key);
+    map<string, string>::iterator iter =
+        outstanding_invalidations_.find(object_key);
+    if ((iter != outstanding_invalidations_.end()) &&
+        (iter->second == acknowledge_handle.handle_data())) {
+      outstanding_invalidations_.erase(iter);
+      statistics_->RecordListenerBacklog(
+          static_cast<int>(outstanding_invalidations_.size()));
+    }
+  }
+  if ((acked_versions_.get() != NULL) && invalidation.is_known_version() &&
+      !ProtoConverter::IsAllObjectIdP(invalidation.object_id()) &&
+      acked_versions_->RecordAck(invalidation.object_id(),
+                                 invalidation.version())) {
+    statistics_->RecordAckedVersionEviction();
+  }
   protocol_handler_.SendInvalidationAck(invalidation);
+  return true;
+}
+
+void InvalidationClientImpl::TrackCompletion(
+    const vector<ObjectIdP>& object_ids, RegistrationP::OpType reg_op_type,
+    CompletionCallback* callback) {
+  if (callback == NULL) {
+    return;
+  }
+  PendingCompletion* completion =
+      new PendingCompletion(callback, object_ids.size());
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    string key;
+    object_ids[i].SerializeToString(&key);
+    pending_completions_.insert(
+        make_pair(key, make_pair(reg_op_type, completion)));
+  }
+}
+
+void InvalidationClientImpl::CompleteOperation(
+    const ObjectIdP& object_id, RegistrationP::OpType reg_op_type,
+    const Status& status) {
+  if (pending_completions_.empty()) {
+    return;
+  }
+  string key;
+  object_id.SerializeToString(&key);
+  CompletionMap::iterator iter = pending_completions_.lower_bound(key);
+  while ((iter != pending_completions_.end()) && (iter->first == key)) {
+    if (iter->second.first == reg_op_type) {
+      CompleteObject(iter->second.second, status);
+      pending_completions_.erase(iter++);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+void InvalidationClientImpl::CompleteOperationsInSync() {
+  ObjectIdP object_id;
+  for (CompletionMap::iterator iter = pending_completions_.begin();
+       iter != pending_completions_.end(); ++iter) {
+    object_id.ParseFromString(iter->first);
+    bool is_register = (iter->second.first == RegistrationP_OpType_REGISTER);
+    if (registration_manager_.IsDesiredRegistration(object_id) ==
+        is_register) {
+      CompleteObject(iter->second.second, Status(Status::SUCCESS, ""));
+    } else {
+      CompleteObject(iter->second.second,
+                     Status(Status::TRANSIENT_FAILURE,
+                            "Reversed by a later operation"));
+    }
+  }
+  pending_completions_.clear();
+}
+
+void InvalidationClientImpl::FailAllOperations(const Status& status) {
+  for (CompletionMap::iterator iter = pending_completions_.begin();
+       iter != pending_completions_.end(); ++iter) {
+    CompleteObject(iter->second.second, status);
+  }
+  pending_completions_.clear();
+}
+
+void InvalidationClientImpl::CompleteObject(PendingCompletion* completion,
+                                            const Status& status) {
+  if (!status.IsSuccess() && completion->status.IsSuccess()) {
+    completion->status = status;
+  }
+  if (--completion->num_pending > 0) {
+    return;
+  }
+  resources_->listener_scheduler()->Schedule(
+      Scheduler::NoDelay(),
+      NewPooledCallback(
+          this, &InvalidationClientImpl::RunCompletionCallback,
+          completion->callback, completion->status));
+  delete completion;
+}
+
+void InvalidationClientImpl::RunCompletionCallback(
+    CompletionCallback* callback, Status status) {
+  callback->Run(status);
+  delete callback;
 }
 
 string InvalidationClientImpl::ToString() {
@@ -341,12 +1005,15 @@ void InvalidationClientImpl::HandleTokenChanged(
   HandleIncomingHeader(header);
 
   if (new_token.empty()) {
+    TICL_EVENT(event_log_.get(), EVENT_TOKEN_CHANGED, client_token_.size(), 0);
     TLOG(logger_, INFO, "Destroying existing token: %s",
          ProtoHelpers::ToString(client_token_).c_str());
     ScheduleAcquireToken("Destroy");
   } else {
     // We just received a new token. Start the regular heartbeats now.
-    operation_scheduler_.Schedule(heartbeat_task_.get());
+    TICL_EVENT_BYTES(event_log_.get(), EVENT_TOKEN_CHANGED,
+                     client_token_.size(), new_token.size(), new_token);
+    operation_scheduler_.Schedule(heartbeat_operation_);
     set_nonce("");
     set_client_token(new_token);
     WriteStateBlob();
@@ -367,36 +1034,183 @@ void InvalidationClientImpl::ScheduleAcquireToken(const string& debug_string) {
           &InvalidationClientImpl::AcquireToken, debug_string));
 }
 
+void InvalidationClientImpl::SerializeAckHandle(
+    const InvalidationP& full_invalidation, string* serialized) {
+  // Acknowledging only needs the object, version and kind of the
+  // invalidation (see ProtocolHandler::SendInvalidationAck), so leave out the
+  // payload (or its reference), which may be much larger than the rest.
+  InvalidationP invalidation_without_payload;
+  const InvalidationP* invalidation = &full_invalidation;
+  if (full_invalidation.has_payload() ||
+      full_invalidation.has_payload_reference()) {
+    invalidation_without_payload.mutable_object_id()->CopyFrom(
+        full_invalidation.object_id());
+    invalidation_without_payload.set_is_known_version(
+        full_invalidation.is_known_version());
+    invalidation_without_payload.set_version(full_invalidation.version());
+    invalidation = &invalidation_without_payload;
+  }
+
+  // Same bytes as serializing an AckHandleP with just the invalidation field
+  // set, i.e., the field's tag and length followed by the invalidation, but
+  // without first copying the invalidation into an AckHandleP.
+  serialized->clear();
+  serialized->push_back(static_cast<char>(
+      (AckHandleP::kInvalidationFieldNumber << 3) | 2));
+  int length = invalidation->ByteSize();
+  uint32 remaining = length;
+  do {
+    char byte = remaining & 0x7f;
+    remaining >>= 7;
+    serialized->push_back(remaining != 0 ? (byte | 0x80) : byte);
+  } while (remaining != 0);
+  size_t header_size = serialized->size();
+  serialized->resize(header_size + length);
+  invalidation->SerializeWithCachedSizesToArray(
+      reinterpret_cast<uint8*>(&(*serialized)[header_size]));
+}
+
 void InvalidationClientImpl::HandleInvalidations(
     const ServerMessageHeader& header,
-    const RepeatedPtrField<InvalidationP>& invalidations) {
+    RepeatedPtrField<InvalidationP>* invalidations) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   HandleIncomingHeader(header);
 
-  for (int i = 0; i < invalidations.size(); ++i) {
-    const InvalidationP& invalidation = invalidations.Get(i);
-    AckHandleP ack_handle_proto;
-    ack_handle_proto.mutable_invalidation()->CopyFrom(invalidation);
+  // Issue the invalidations of the message in batches, one for known versions
+  // and one for unknown versions.
+  vector<pair<Invalidation, AckHandle> > known_version_batch;
+  vector<pair<ObjectId, AckHandle> > unknown_version_batch;
+  int num_issued = 0;
+  int num_deferred = 0;
+
+  // The desired registrations can only rule out an object once they are
+  // complete, i.e., once the Ticl has started (so they were restored or the
+  // application was asked to reissue them) and the server agrees with them.
+  // Until then, e.g., after a restart while the application is still
+  // reissuing, the server may rightly send invalidations for objects that
+  // are missing locally, so they are issued as usual.
+  bool is_registration_filter_usable = ticl_state_.IsStarted() &&
+      registration_manager_.IsStateInSyncWithServer();
+  for (int i = 0; i < invalidations->size(); ++i) {
+    InvalidationP* invalidation_proto = invalidations->Mutable(i);
+    const InvalidationP& invalidation = *invalidation_proto;
+    if (is_registration_filter_usable &&
+        !ProtoConverter::IsAllObjectIdP(invalidation.object_id()) &&
+        !registration_manager_.MightBeRegistered(invalidation.object_id())) {
+      // Not registered (e.g., unregistered while the invalidation was in
+      // flight): the application does not want it, so just acknowledge it.
+      TLOG(logger_, FINE, "Acknowledging invalidation for unregistered "
+           "object: %s", ProtoHelpers::ToString(invalidation).c_str());
+      protocol_handler_.SendInvalidationAck(invalidation);
+      continue;
+    }
+    if ((acked_versions_.get() != NULL) && invalidation.is_known_version() &&
+        !ProtoConverter::IsAllObjectIdP(invalidation.object_id())) {
+      bool is_stale = acked_versions_->IsAcknowledged(
+          invalidation.object_id(), invalidation.version());
+      statistics_->RecordAckedVersionLookup(is_stale);
+      if (is_stale) {
+        // A redelivery of a version the listener has already handled.
+        TLOG(logger_, FINE, "Acknowledging stale invalidation: %s",
+             ProtoHelpers::ToString(invalidation).c_str());
+        protocol_handler_.SendInvalidationAck(invalidation);
+        continue;
+      }
+    }
+    // An invalidation for an object that already has one outstanding takes
+    // its place rather than a new one.
+    string object_key;
+    if (config_.max_outstanding_invalidations > 0) {
+      invalidation.object_id().SerializeToString(&object_key);
+      if ((outstanding_invalidations_.size() >=
+           static_cast<size_t>(config_.max_outstanding_invalidations)) &&
+          (outstanding_invalidations_.find(object_key) ==
+           outstanding_invalidations_.end())) {
+        // The listener is behind: leave the invalidation unacknowledged, so
+        // that the server resends it later.
+        ++num_deferred;
+        statistics_->RecordDeferredInvalidation();
+        continue;
+      }
+    }
+    ++num_issued;
+    TICL_EVENT_BYTES(event_log_.get(), EVENT_INVALIDATION_ISSUED,
+                     invalidation.version(),
+                     invalidation.is_known_version() ? 1 : 0,
+                     invalidation.object_id().name());
     string serialized;
-    ack_handle_proto.SerializeToString(&serialized);
+    SerializeAckHandle(invalidation, &serialized);
+    if (config_.max_outstanding_invalidations > 0) {
+      if (ProtoConverter::IsAllObjectIdP(invalidation.object_id())) {
+        // Invalidating everything subsumes the invalidations outstanding.
+        outstanding_invalidations_.clear();
+      }
+      outstanding_invalidations_[object_key] = serialized;
+    }
     AckHandle ack_handle(serialized);
     if (ProtoConverter::IsAllObjectIdP(invalidation.object_id())) {
+      // Issue the invalidations before this one first.
+      IssueInvalidationBatches(&known_version_batch, &unknown_version_batch);
       TLOG(logger_, INFO, "Issuing invalidate all");
       listener_->InvalidateAll(this, ack_handle);
     } else {
-      // Regular object. Could be unknown version or not.
-      Invalidation inv;
-      ProtoConverter::ConvertFromInvalidationProto(invalidation, &inv);
+      // Regular object. Could be unknown version or not. The entry is
+      // converted in place, taking the payload out of the message, and the
+      // batch handed to the listener without a copy, so that the payload is
+      // not copied after parsing.
       TLOG(logger_, INFO, "Issuing invalidate: %s",
            ProtoHelpers::ToString(invalidation).c_str());
       if (invalidation.is_known_version()) {
-        listener_->Invalidate(this, inv, ack_handle);
+        known_version_batch.push_back(make_pair(Invalidation(), ack_handle));
+        ProtoConverter::ConvertFromInvalidationProtoTakingPayload(
+            invalidation_proto, &known_version_batch.back().first);
       } else {
         // Unknown version
-        listener_->InvalidateUnknownVersion(this, inv.object_id(), ack_handle);
+        unknown_version_batch.push_back(make_pair(ObjectId(), ack_handle));
+        ProtoConverter::ConvertFromObjectIdProto(
+            invalidation.object_id(), &unknown_version_batch.back().first);
       }
     }
   }
+  IssueInvalidationBatches(&known_version_batch, &unknown_version_batch);
+  if (config_.max_outstanding_invalidations > 0) {
+    statistics_->RecordListenerBacklog(
+        static_cast<int>(outstanding_invalidations_.size()));
+  }
+  if (num_deferred > 0) {
+    TLOG(logger_, WARNING, "Listener backlog full (%d outstanding): deferred "
+         "%d invalidations",
+         static_cast<int>(outstanding_invalidations_.size()), num_deferred);
+  }
+  int dispatch_latency_ms = static_cast<int>(
+      (internal_scheduler_->GetCurrentTime() - header.receive_time)
+          .InMilliseconds());
+  for (int i = 0; i < num_issued; ++i) {
+    statistics_->RecordLatency(Statistics::LatencyType_INVALIDATION_DISPATCH,
+                               dispatch_latency_ms);
+  }
+  PublishState();
+  TICL_TRACE(TRACE_INVALIDATIONS_HANDLED, header.trace_id);
+}
+
+void InvalidationClientImpl::IssueInvalidationBatches(
+    vector<pair<Invalidation, AckHandle> >* known_version_batch,
+    vector<pair<ObjectId, AckHandle> >* unknown_version_batch) {
+  if (!config_.protocol_handler_config.urgent_object_sources.empty()) {
+    // Put the invalidations for urgent objects first in their batches.
+    IsUrgentEntry is_urgent(&protocol_handler_);
+    stable_partition(known_version_batch->begin(), known_version_batch->end(),
+                     is_urgent);
+    stable_partition(unknown_version_batch->begin(),
+                     unknown_version_batch->end(), is_urgent);
+  }
+  if (!known_version_batch->empty()) {
+    listener_->TakeInvalidationBatch(this, known_version_batch);
+  }
+  if (!unknown_version_batch->empty()) {
+    listener_->TakeInvalidationUnknownVersionBatch(this,
+                                                   unknown_version_batch);
+  }
 }
 
 void InvalidationClientImpl::HandleRegistrationStatus(
@@ -413,27 +1227,100 @@ void InvalidationClientImpl::HandleRegistrationStatus(
       "Not all registration statuses were processed";
 
   // Inform app about the success or failure of each registration based
-  // on what the registration manager has indicated.
+  // on what the registration manager has indicated. Successes are issued
+  // together at the end.
+  vector<pair<ObjectId, InvalidationListener::RegistrationState> >
+      reg_state_batch;
   for (int i = 0; i < reg_status_list.size(); ++i) {
     const RegistrationStatus& reg_status = reg_status_list.Get(i);
     bool was_success = local_processing_statuses[i];
+    TICL_EVENT_BYTES(event_log_.get(), EVENT_REGISTRATION_STATUS,
+                     reg_status.registration().op_type(), was_success ? 1 : 0,
+                     reg_status.registration().object_id().name());
     TLOG(logger_, FINE, "Process reg status: %s",
          ProtoHelpers::ToString(reg_status).c_str());
 
     ObjectId object_id;
     ProtoConverter::ConvertFromObjectIdProto(
         reg_status.registration().object_id(), &object_id);
+    if (!registration_start_times_.empty()) {
+      RecordRegistrationLatency(reg_status, was_success);
+    }
     if (was_success) {
       InvalidationListener::RegistrationState reg_state =
           ConvertOpTypeToRegState(reg_status);
-      listener_->InformRegistrationStatus(this, object_id, reg_state);
+      reg_state_batch.push_back(make_pair(object_id, reg_state));
+      CompleteOperation(reg_status.registration().object_id(),
+                        reg_status.registration().op_type(),
+                        Status(Status::SUCCESS, ""));
     } else {
+      if (registration_leases_.get() != NULL) {
+        // The registration manager no longer has the object either.
+        registration_leases_->Remove(
+            vector<ObjectIdP>(1, reg_status.registration().object_id()));
+      }
       bool is_permanent =
           (reg_status.status().code() == StatusP_Code_PERMANENT_FAILURE);
       listener_->InformRegistrationFailure(
           this, object_id, !is_permanent, reg_status.status().description());
+      CompleteOperation(
+          reg_status.registration().object_id(),
+          reg_status.registration().op_type(),
+          Status(is_permanent ? Status::PERMANENT_FAILURE :
+                 Status::TRANSIENT_FAILURE,
+                 reg_status.status().description()));
     }
   }
+  if (!reg_state_batch.empty()) {
+    listener_->InformRegistrationStatusBatch(this, reg_state_batch);
+  }
+}
+
+void InvalidationClientImpl::TrackRegistrationTimes(
+    const vector<ObjectIdP>& object_ids, RegistrationP::OpType reg_op_type) {
+  if (reg_op_type != RegistrationP_OpType_REGISTER) {
+    UntrackRegistrationTimes(object_ids);
+    return;
+  }
+  Time now = internal_scheduler_->GetCurrentTime();
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    if (registration_start_times_.size() >=
+        static_cast<size_t>(kMaxTrackedRegistrations)) {
+      return;
+    }
+    string key;
+    object_ids[i].SerializeToString(&key);
+    // Keeps the time of an earlier registration that is still unconfirmed.
+    registration_start_times_.insert(make_pair(key, now));
+  }
+}
+
+void InvalidationClientImpl::UntrackRegistrationTimes(
+    const vector<ObjectIdP>& object_ids) {
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    string key;
+    object_ids[i].SerializeToString(&key);
+    registration_start_times_.erase(key);
+  }
+}
+
+void InvalidationClientImpl::RecordRegistrationLatency(
+    const RegistrationStatus& reg_status, bool was_success) {
+  string key;
+  reg_status.registration().object_id().SerializeToString(&key);
+  map<string, Time>::iterator iter = registration_start_times_.find(key);
+  if (iter == registration_start_times_.end()) {
+    return;
+  }
+  if (was_success &&
+      (reg_status.registration().op_type() == RegistrationP_OpType_REGISTER)) {
+    statistics_->RecordLatency(
+        Statistics::LatencyType_REGISTRATION,
+        static_cast<int>(
+            (internal_scheduler_->GetCurrentTime() - iter->second)
+                .InMilliseconds()));
+  }
+  registration_start_times_.erase(iter);
 }
 
 void InvalidationClientImpl::HandleRegistrationSyncRequest(
@@ -442,10 +1329,29 @@ void InvalidationClientImpl::HandleRegistrationSyncRequest(
   // Send all the registrations in the reg sync message.
   HandleIncomingHeader(header);
 
-  // Generate a single subtree for all the registrations.
-  RegistrationSubtree subtree;
-  registration_manager_.GetRegistrations("", 0, &subtree);
-  protocol_handler_.SendRegistrationSyncSubtree(subtree);
+  // Stream the registrations as a sequence of size-bounded subtrees, one per
+  // message, so that large registration sets do not produce a single huge
+  // message. If the server summarized its registrations by range, only the
+  // ranges that differ are sent. A new request restarts the sync.
+  registration_manager_.StartRegistrationSync(
+      config_.max_registration_sync_subtree_size,
+      header.registration_summary);
+  RegistrationSyncTask();
+}
+
+void InvalidationClientImpl::RegistrationSyncTask() {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (!registration_manager_.HasPendingRegistrationSync()) {
+    return;
+  }
+  if (!protocol_handler_.HasPendingRegistrationSyncSubtrees()) {
+    RegistrationSubtree subtree;
+    registration_manager_.GetNextRegistrationSyncSubtree(&subtree);
+    protocol_handler_.SendRegistrationSyncSubtree(subtree);
+  }
+  if (registration_manager_.HasPendingRegistrationSync()) {
+    operation_scheduler_.Schedule(registration_sync_operation_);
+  }
 }
 
 void InvalidationClientImpl::HandleInfoMessage(
@@ -472,6 +1378,7 @@ void InvalidationClientImpl::HandleErrorMessage(
       const string& description) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   HandleIncomingHeader(header);
+  TICL_EVENT(event_log_.get(), EVENT_SERVER_ERROR, code, 0);
 
   // If it is an auth failure, we shut down the ticl.
   TLOG(logger_, SEVERE, "Received error message: %s, %s, %s",
@@ -505,6 +1412,9 @@ void InvalidationClientImpl::HandleErrorMessage(
   // failure.
   vector<ObjectIdP> desired_registrations;
   registration_manager_.RemoveRegisteredObjects(&desired_registrations);
+  if (registration_leases_.get() != NULL) {
+    registration_leases_->Clear();
+  }
   TLOG(logger_, WARNING, "Issuing failure for %d objects",
        desired_registrations.size());
   for (size_t i = 0; i < desired_registrations.size(); ++i) {
@@ -514,6 +1424,14 @@ void InvalidationClientImpl::HandleErrorMessage(
     listener_->InformRegistrationFailure(
         this, object_id, false, "Auth error");
   }
+  FailAllOperations(Status(Status::PERMANENT_FAILURE, "Auth error"));
+
+  // The server will not answer the payload fetches either.
+  while (!pending_payload_fetches_.empty()) {
+    CompletePayloadFetch(
+        pending_payload_fetches_.begin()->first,
+        StatusStringPair(Status(Status::PERMANENT_FAILURE, "Auth error"), ""));
+  }
 
   // Schedule the stop on the listener work queue so that it happens after the
   // inform registration failure calls above
@@ -522,6 +1440,36 @@ void InvalidationClientImpl::HandleErrorMessage(
       NewPermanentCallback(this, &InvalidationClientImpl::Stop));
 }
 
+void InvalidationClientImpl::HandlePayloads(
+    const ServerMessageHeader& header, RepeatedPtrField<PayloadP>* payloads) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  HandleIncomingHeader(header);
+  for (int i = 0; i < payloads->size(); ++i) {
+    PayloadP* payload = payloads->Mutable(i);
+    Status::Code code;
+    switch (payload->status().code()) {
+      case StatusP_Code_SUCCESS:
+        code = Status::SUCCESS;
+        break;
+      case StatusP_Code_TRANSIENT_FAILURE:
+        code = Status::TRANSIENT_FAILURE;
+        break;
+      default:
+        code = Status::PERMANENT_FAILURE;
+        break;
+    }
+    StatusStringPair result(Status(code, payload->status().description()),
+                            "");
+    if (code == Status::SUCCESS) {
+      // Take the payload out of the message rather than copy it.
+      result.second.swap(*payload->mutable_payload());
+    }
+    TLOG(logger_, FINE, "Received payload for %s: %d",
+         ProtoHelpers::ToString(payload->payload_reference()).c_str(), code);
+    CompletePayloadFetch(payload->payload_reference(), result);
+  }
+}
+
 void InvalidationClientImpl::GetRegistrationManagerStateAsSerializedProto(
     string* result) {
   RegistrationManagerStateP reg_state;
@@ -535,6 +1483,58 @@ void InvalidationClientImpl::GetRegistrationManagerStateAsSerializedProto(
   reg_state.SerializeToString(result);
 }
 
+void InvalidationClientImpl::GetMemoryUsage(
+    vector<pair<string, size_t> >* usage) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  usage->clear();
+  size_t client_bytes = sizeof(*this) +
+      MemoryUsage::StringBytes(last_serialized_ticl_state_) +
+      MemoryUsage::TreeNodeBytes(registration_start_times_) +
+      MemoryUsage::TreeNodeBytes(last_exported_statistics_) +
+      pre_start_operations_.capacity() * sizeof(PreStartOperation);
+  for (map<string, Time>::iterator iter = registration_start_times_.begin();
+       iter != registration_start_times_.end(); ++iter) {
+    client_bytes += MemoryUsage::StringBytes(iter->first);
+  }
+  for (map<string, int>::iterator iter = last_exported_statistics_.begin();
+       iter != last_exported_statistics_.end(); ++iter) {
+    client_bytes += MemoryUsage::StringBytes(iter->first);
+  }
+  client_bytes += MemoryUsage::TreeNodeBytes(outstanding_invalidations_);
+  for (map<string, string>::iterator iter = outstanding_invalidations_.begin();
+       iter != outstanding_invalidations_.end(); ++iter) {
+    client_bytes += MemoryUsage::StringBytes(iter->first) +
+        MemoryUsage::StringBytes(iter->second);
+  }
+  client_bytes += MemoryUsage::TreeNodeBytes(pending_completions_);
+  for (CompletionMap::iterator iter = pending_completions_.begin();
+       iter != pending_completions_.end(); ++iter) {
+    client_bytes += MemoryUsage::StringBytes(iter->first);
+  }
+  for (size_t i = 0; i < pre_start_operations_.size(); ++i) {
+    const vector<ObjectId>& object_ids = pre_start_operations_[i].object_ids;
+    client_bytes += object_ids.capacity() * sizeof(ObjectId);
+    for (size_t j = 0; j < object_ids.size(); ++j) {
+      client_bytes += MemoryUsage::StringBytes(object_ids[j].name());
+    }
+  }
+  usage->push_back(make_pair("Client", client_bytes));
+  usage->push_back(make_pair("Statistics", statistics_->GetMemoryUsage()));
+  if (event_log_.get() != NULL) {
+    usage->push_back(make_pair("EventLog", event_log_->GetAllocatedBytes()));
+  }
+  registration_manager_.GetMemoryUsage(usage);
+  if (acked_versions_.get() != NULL) {
+    usage->push_back(make_pair("AckedVersionCache",
+                               acked_versions_->GetAllocatedBytes()));
+  }
+  if (registration_leases_.get() != NULL) {
+    usage->push_back(make_pair("RegistrationLeases",
+                               registration_leases_->GetAllocatedBytes()));
+  }
+  protocol_handler_.GetMemoryUsage(usage);
+}
+
 void InvalidationClientImpl::GetStatisticsAsSerializedProto(
     string* result) {
   vector<pair<string, int> > properties;
@@ -557,11 +1557,17 @@ void InvalidationClientImpl::AcquireToken(const string& debug_string) {
     // Allocate a nonce and send a message requesting a new token.
     set_nonce(IntToString(
         internal_scheduler_->GetCurrentTime().ToInternalValue()));
+    vector<InvalidationP> catch_up_versions;
+    if (config_.catch_up_after_token_loss && (acked_versions_.get() != NULL)) {
+      acked_versions_->GetVersions(&catch_up_versions);
+    }
     protocol_handler_.SendInitializeMessage(
-        client_type_, application_client_id_, nonce_, debug_string);
+        client_type_, application_client_id_, nonce_,
+        config_.catch_up_after_token_loss ? &catch_up_versions : NULL,
+        debug_string);
 
     // Schedule a timeout to retry if we don't receive a response.
-    operation_scheduler_.Schedule(timeout_task_.get());
+    operation_scheduler_.Schedule(timeout_operation_);
   }
 }
 
@@ -574,20 +1580,67 @@ void InvalidationClientImpl::CheckNetworkTimeouts() {
    * We simply check for both conditions and taken corrective action when
    * needed.
    */
-  // If we have no token, send a message for one.
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+
+  // Nothing can have been answered while the network is down, so don't back
+  // off or resend until it is back.
+  if (protocol_handler_.IsPausedOffline()) {
+    TLOG(logger_, INFO, "Deferring network timeout check while offline");
+    is_timeout_check_deferred_ = true;
+    return;
+  }
+
+  // If we have no token, send a message for one.
   if (client_token_.empty()) {
     TLOG(logger_, INFO, "Request for token timed out");
     ScheduleAcquireToken("Network timeout");
     return;
   }
 
+  // Pipelined messages that were lost are resent on their own, so wait for
+  // them before falling back to a full resync.
+  if (protocol_handler_.HasMessagesInFlight()) {
+    TLOG(logger_, INFO, "Waiting for unacknowledged messages to be resent");
+    operation_scheduler_.Schedule(timeout_operation_);
+    return;
+  }
+
   // Simply send an info message to ensure syncing happens.
   if (!registration_manager_.IsStateInSyncWithServer()) {
     TLOG(logger_, INFO, "Registration state not in sync with server: %s",
          registration_manager_.ToString().c_str());
     SendInfoMessageToServer(false, true);
-    operation_scheduler_.Schedule(timeout_task_.get());
+    operation_scheduler_.Schedule(timeout_operation_);
+  }
+}
+
+void InvalidationClientImpl::HandleNetworkStatusChange(bool is_online) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (is_online && is_timeout_check_deferred_) {
+    is_timeout_check_deferred_ = false;
+    CheckNetworkTimeouts();
+  }
+}
+
+void InvalidationClientImpl::HandleConfigChange(
+    const ConfigChangeMessage& config_change) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (config_change.has_max_token_backoff_delay_ms()) {
+    // Never back off less than the initial delay.
+    TimeDelta max_delay = TimeDelta::FromMilliseconds(
+        config_change.max_token_backoff_delay_ms());
+    if (max_delay < config_.network_timeout_delay) {
+      max_delay = config_.network_timeout_delay;
+    }
+    token_exponential_backoff_.SetMaxDelay(max_delay);
+  }
+  if (config_change.has_heartbeat_interval_ms()) {
+    // The heartbeat already scheduled keeps its delay; the ones after it use
+    // the new interval.
+    config_.heartbeat_interval =
+        TimeDelta::FromMilliseconds(config_change.heartbeat_interval_ms());
+    operation_scheduler_.ChangeDelay(
+        heartbeat_operation_, config_.heartbeat_interval);
   }
 }
 
@@ -598,11 +1651,56 @@ void InvalidationClientImpl::HandleIncomingHeader(
       "Cannot process server header " << header.ToString() <<
       " with non-empty nonce " << nonce_;
 
+  // The upcalls issued from here on are about this message.
+  listener_->set_trace_id(header.trace_id);
+
   // We've received a summary from the server, so if we were suppressing
   // registrations, we should now allow them to go to the registrar.
   should_send_registrations_ = true;
   registration_manager_.InformServerRegistrationSummary(
       header.registration_summary);
+  if (!pending_completions_.empty() &&
+      registration_manager_.IsStateInSyncWithServer()) {
+    CompleteOperationsInSync();
+  }
+  PublishState();
+}
+
+void InvalidationClientImpl::ExportStatisticsTask() {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  vector<pair<string, int> > statistics;
+  statistics_->GetNonZeroStatistics(&statistics);
+
+  // A statistic that is no longer reported (e.g., a startup phase) has gone
+  // back to zero.
+  map<string, int> current(statistics.begin(), statistics.end());
+  vector<pair<string, int> > deltas;
+  map<string, int>::iterator last = last_exported_statistics_.begin();
+  map<string, int>::iterator iter = current.begin();
+  while ((last != last_exported_statistics_.end()) ||
+         (iter != current.end())) {
+    if ((iter == current.end()) ||
+        ((last != last_exported_statistics_.end()) &&
+         (last->first < iter->first))) {
+      deltas.push_back(make_pair(last->first, -last->second));
+      ++last;
+    } else if ((last == last_exported_statistics_.end()) ||
+               (iter->first < last->first)) {
+      deltas.push_back(*iter);
+      ++iter;
+    } else {
+      if (iter->second != last->second) {
+        deltas.push_back(make_pair(iter->first, iter->second - last->second));
+      }
+      ++last;
+      ++iter;
+    }
+  }
+  last_exported_statistics_.swap(current);
+  if (!deltas.empty()) {
+    config_.statistics_sink->ReportDeltas(deltas);
+  }
+  operation_scheduler_.Schedule(export_statistics_operation_);
 }
 
 void InvalidationClientImpl::SendInfoMessageToServer(
@@ -630,13 +1728,23 @@ void InvalidationClientImpl::SendInfoMessageToServer(
 void InvalidationClientImpl::WriteStateBlob() {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   CHECK(!client_token_.empty());
-  PersistentTiclState state;
+  PersistentTiclState& state = ticl_state_to_write_;
+  state.Clear();
   state.set_client_token(client_token_);
   string serialized_state;
-  PersistenceUtils::SerializeState(state, digest_fn_.get(), &serialized_state);
-  resources_->storage()->WriteKey(
-      kClientTokenKey, serialized_state,
-      NewPermanentCallback(this, &InvalidationClientImpl::WriteCallback));
+  state.SerializeToString(&serialized_state);
+  if (!StateBlobWouldChange(serialized_state)) {
+    // Skip the digest and the blob encoding: the writer already has this
+    // state.
+    TLOG(logger_, FINE, "Ticl state unchanged, not writing");
+    statistics_->RecordSkippedPersistentWrite();
+    return;
+  }
+  string state_blob;
+  PersistenceUtils::SerializeStateFromBytes(
+      serialized_state, digest_fn_.get(), &state_blob);
+  last_serialized_ticl_state_.swap(serialized_state);
+  state_writer_.Write(state_blob);
 }
 
 void InvalidationClientImpl::set_nonce(const string& new_nonce) {
@@ -654,6 +1762,13 @@ void InvalidationClientImpl::set_client_token(const string& new_client_token) {
   // application.
   bool finish_starting_ticl = !ticl_state_.IsStarted() &&
       client_token_.empty() && !new_client_token.empty();
+  if ((new_client_token != client_token_) &&
+      !outstanding_invalidations_.empty()) {
+    // The server resends what the old session left unacknowledged, so the
+    // invalidations outstanding under it no longer hold places.
+    outstanding_invalidations_.clear();
+    statistics_->RecordListenerBacklog(0);
+  }
   client_token_ = new_client_token;
 
   if (!new_client_token.empty()) {
@@ -665,34 +1780,46 @@ void InvalidationClientImpl::set_client_token(const string& new_client_token) {
   if (finish_starting_ticl) {
     FinishStartingTiclAndInformListener();
   }
+  PublishState();
 }
 
 void InvalidationClientImpl::FinishStartingTiclAndInformListener() {
   CHECK(!ticl_state_.IsStarted());
 
   ticl_state_.Start();
+  if (start_internal_done_) {
+    // The token came from the server rather than from persistent state.
+    RecordStartupPhaseSince(Statistics::StartupPhaseType_TOKEN_ACQUISITION_MS,
+                            start_internal_done_time_);
+  }
+  RecordStartupPhaseSince(Statistics::StartupPhaseType_TOTAL_MS, start_time_);
   listener_->Ready(this);
 
-  // We are not currently persisting our registration digest, so regardless of
-  // whether or not we are restarting from persistent state, we need to query
-  // the application for all of its registrations.
-  listener_->ReissueRegistrations(this, RegistrationManager::kEmptyPrefix, 0);
+  // Unless we restored the registrations that the server had when we stopped,
+  // we need to query the application for all of its registrations, regardless
+  // of whether or not we are restarting from persistent state.
+  if (!restored_registrations_) {
+    listener_->ReissueRegistrations(this, RegistrationManager::kEmptyPrefix, 0);
+  }
   TLOG(logger_, INFO, "Ticl started: %s", ToString().c_str());
 }
 
-void InvalidationClientImpl::WriteCallback(Status status) {
-  TLOG(logger_, INFO, "Write state completed: %s", status.message().c_str());
-  if (!status.IsSuccess()) {
-    // Retry with exponential backoff.
-    statistics_->RecordError(
-        Statistics::ClientErrorType_PERSISTENT_WRITE_FAILURE);
-    internal_scheduler_->Schedule(
-        persistence_exponential_backoff_.GetNextDelay(),
-        NewPermanentCallback(this, &InvalidationClientImpl::WriteStateBlob));
-  } else {
-    // Write succeeded - reset the backoff delay.
-    persistence_exponential_backoff_.Reset(config_.write_retry_delay);
+void InvalidationClientImpl::PublishState() {
+  if (state_snapshot_.get() == NULL) {
+    return;
   }
+  ClientState state;
+  state.publish_time_ms =
+      InvalidationClientUtil::GetCurrentTimeMs(internal_scheduler_);
+  state.is_started = ticl_state_.IsStarted();
+  state.has_token = !client_token_.empty();
+  state.is_registration_in_sync =
+      registration_manager_.IsStateInSyncWithServer();
+  state.num_registrations = registration_manager_.GetNumDesiredRegistrations();
+  state.num_outstanding_invalidations =
+      static_cast<int>(outstanding_invalidations_.size());
+  statistics_->GetClientStateCounters(&state);
+  state_snapshot_->Publish(state);
 }
 
 void InvalidationClientImpl::ScheduleStartAfterReadingStateBlob() {
@@ -712,19 +1839,122 @@ void InvalidationClientImpl::ReadCallback(
     TLOG(logger_, WARNING, "Could not read state blob: %s",
          read_result.first.message().c_str());
   }
-  // Call start now.
   internal_scheduler_->Schedule(
       Scheduler::NoDelay(),
       NewPermanentCallback(
-          this, &InvalidationClientImpl::StartInternal, serialized_state));
+          this, &InvalidationClientImpl::HandleStateBlobRead,
+          serialized_state));
+}
+
+void InvalidationClientImpl::HandleStateBlobRead(
+    const string& serialized_state) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  RecordStartupPhaseSince(Statistics::StartupPhaseType_STATE_READ_MS,
+                          start_time_);
+  is_state_blob_read_ = true;
+  read_state_blob_ = serialized_state;
+  MaybeStartInternal();
+}
+
+void InvalidationClientImpl::HandleRegistrationLogLoaded() {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  RecordStartupPhaseSince(
+      Statistics::StartupPhaseType_REGISTRATION_LOG_LOAD_MS, start_time_);
+  is_registration_log_loaded_ = true;
+  MaybeStartInternal();
+}
+
+void InvalidationClientImpl::MaybeStartInternal() {
+  // Call start now, after reading the persisted registrations if any.
+  if (is_state_blob_read_ && is_registration_log_loaded_) {
+    string serialized_state;
+    serialized_state.swap(read_state_blob_);
+    StartInternal(serialized_state);
+  }
+}
+
+void InvalidationClientImpl::RecordStartupPhaseSince(
+    Statistics::StartupPhaseType startup_phase_type, Time start_time) {
+  statistics_->RecordStartupPhase(
+      startup_phase_type,
+      static_cast<int>(
+          (internal_scheduler_->GetCurrentTime() - start_time)
+              .InMilliseconds()));
 }
 
 void InvalidationClientImpl::HeartbeatTask() {
-  // Send info message.
+  bool request_server_summary =
+      !registration_manager_.IsStateInSyncWithServer();
+  if (config_.suppress_redundant_heartbeats && !request_server_summary) {
+    // Any message told the server that the client is alive, so wait until
+    // heartbeat_interval has passed since the last one.
+    int64 next_heartbeat_time_ms =
+        protocol_handler_.last_message_sent_time_ms() +
+        config_.heartbeat_interval.InMilliseconds();
+    int64 now_ms = InvalidationClientUtil::GetCurrentTimeMs(
+        internal_scheduler_);
+    if (next_heartbeat_time_ms > now_ms) {
+      TLOG(logger_, FINE, "Suppressing heartbeat for %lld ms",
+           next_heartbeat_time_ms - now_ms);
+      operation_scheduler_.ScheduleWithDelay(
+          heartbeat_operation_,
+          TimeDelta::FromMilliseconds(next_heartbeat_time_ms - now_ms));
+      return;
+    }
+  }
+
+  // Send info message. If other operations are pending, it goes out in the
+  // same message as them.
   TLOG(logger_, INFO, "Sending heartbeat to server: %s", ToString().c_str());
-  SendInfoMessageToServer(
-      false, !registration_manager_.IsStateInSyncWithServer());
-  operation_scheduler_.Schedule(heartbeat_task_.get());
+  SendInfoMessageToServer(false, request_server_summary);
+  operation_scheduler_.Schedule(heartbeat_operation_);
+}
+
+void InvalidationClientImpl::RegistrationLeaseTask() {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (ticl_state_.IsStopped()) {
+    return;
+  }
+  vector<ObjectIdP> expired;
+  registration_leases_->Advance(
+      InvalidationClientUtil::GetCurrentTimeMs(internal_scheduler_),
+      &expired);
+  if (!expired.empty()) {
+    // One batch for all the leases of the tick, sent like an unregistration
+    // by the application.
+    TLOG(logger_, INFO, "Registration leases expired for %d objects",
+         static_cast<int>(expired.size()));
+    TrackRegistrationTimes(expired, RegistrationP_OpType_UNREGISTER);
+    ApplyRegisterOperations(expired, NULL, RegistrationP_OpType_UNREGISTER);
+  }
+  if (registration_leases_->size() > 0) {
+    operation_scheduler_.Schedule(registration_lease_operation_);
+  }
+}
+
+void InvalidationClientImpl::PayloadFetchTimeoutTask() {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  Time now = internal_scheduler_->GetCurrentTime();
+  vector<string> timed_out;
+  for (map<string, PendingPayloadFetch>::iterator iter =
+           pending_payload_fetches_.begin();
+       iter != pending_payload_fetches_.end(); ++iter) {
+    if (now - iter->second.request_time >= config_.network_timeout_delay) {
+      timed_out.push_back(iter->first);
+    }
+  }
+  if (!timed_out.empty()) {
+    TLOG(logger_, INFO, "Payload fetches timed out for %d payloads",
+         static_cast<int>(timed_out.size()));
+  }
+  for (size_t i = 0; i < timed_out.size(); ++i) {
+    CompletePayloadFetch(
+        timed_out[i],
+        StatusStringPair(Status(Status::TRANSIENT_FAILURE, "Timed out"), ""));
+  }
+  if (!pending_payload_fetches_.empty()) {
+    operation_scheduler_.Schedule(payload_fetch_timeout_operation_);
+  }
 }
 
 InvalidationListener::RegistrationState
@@ -738,4 +1968,6 @@ InvalidationClientImpl::ConvertOpTypeToRegState(RegistrationStatus reg_status) {
 
 const char* InvalidationClientImpl::kClientTokenKey = "ClientToken";
 
+const int InvalidationClientImpl::kMaxTrackedRegistrations = 1000;
+
 }  // namespace invalidation
@@ -17,23 +17,34 @@
 #ifndef GOOGLE_CACHEINVALIDATION_V2_INVALIDATION_CLIENT_IMPL_H_
 #define GOOGLE_CACHEINVALIDATION_V2_INVALIDATION_CLIENT_IMPL_H_
 
+#include <map>
 #include <string>
 #include <utility>
 
+#include "google/cacheinvalidation/v2/acked-version-cache.h"
 #include "google/cacheinvalidation/v2/invalidation-client.h"
 #include "google/cacheinvalidation/v2/invalidation-listener.h"
 #include "google/cacheinvalidation/v2/checking-invalidation-listener.h"
 #include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/client-state-snapshot.h"
 #include "google/cacheinvalidation/v2/digest-function.h"
 #include "google/cacheinvalidation/v2/digest-store.h"
+#include "google/cacheinvalidation/v2/event-log.h"
 #include "google/cacheinvalidation/v2/exponential-backoff-delay-generator.h"
+#include "google/cacheinvalidation/v2/mpsc-queue.h"
+#include "google/cacheinvalidation/v2/persistent-state-writer.h"
 #include "google/cacheinvalidation/v2/protocol-handler.h"
+#include "google/cacheinvalidation/v2/registration-lease-wheel.h"
+#include "google/cacheinvalidation/v2/registration-log.h"
 #include "google/cacheinvalidation/v2/registration-manager.h"
 #include "google/cacheinvalidation/v2/run-state.h"
 #include "google/cacheinvalidation/v2/smearer.h"
+#include "google/cacheinvalidation/v2/statistics-sink.h"
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::multimap;
+
 class InvalidationClientImpl : public InvalidationClient,
                                public ProtocolListener {
  public:
@@ -41,8 +52,31 @@ class InvalidationClientImpl : public InvalidationClient,
     Config() : network_timeout_delay(TimeDelta::FromMinutes(1)),
                write_retry_delay(TimeDelta::FromSeconds(10)),
                heartbeat_interval(TimeDelta::FromMinutes(20)),
+               suppress_redundant_heartbeats(false),
                perf_counter_delay(TimeDelta::FromHours(6)),
-               max_exponential_backoff_factor(500) {}
+               max_exponential_backoff_factor(500),
+               decorrelated_token_backoff(false),
+               max_registration_sync_subtree_size(1000),
+               use_compact_registration_store(false),
+               partition_registrations_by_source(false),
+               use_registration_filter(false),
+               elide_redundant_registrations(false),
+               min_prepared_registration_batch_size(0),
+               num_listener_dispatch_threads(0),
+               coalesce_invalidations(false),
+               max_outstanding_invalidations(0),
+               acked_version_cache_size(0),
+               catch_up_after_token_loss(false),
+               persist_registrations(false),
+               registration_log_compaction_threshold(100),
+               registration_lease(TimeDelta()),
+               statistics_sink(NULL),
+               statistics_export_interval(TimeDelta::FromSeconds(10)),
+               instrumented_internal_scheduler(NULL),
+               instrumented_listener_scheduler(NULL),
+               event_log_log2_capacity(0),
+               publish_client_state(false),
+               shard_statistics_counters(false) {}
 
     /* The delay after which a network message sent to the server is considered
      * timed out.
@@ -55,6 +89,12 @@ class InvalidationClientImpl : public InvalidationClient,
     /* Delay for sending heartbeats to the server. */
     TimeDelta heartbeat_interval;
 
+    /* Whether any message to the server counts as a heartbeat, so that a
+     * heartbeat is only sent after heartbeat_interval without other traffic
+     * (or when the client needs the server's registration summary).
+     */
+    bool suppress_redundant_heartbeats;
+
     /* Delay after which performance counters are sent to the server. */
     TimeDelta perf_counter_delay;
 
@@ -63,6 +103,162 @@ class InvalidationClientImpl : public InvalidationClient,
      */
     int max_exponential_backoff_factor;
 
+    /* Whether the delays between attempts to acquire a token are
+     * decorrelated (see ExponentialBackoffDelayGenerator::set_decorrelated)
+     * and drawn from a generator seeded with the client name as well as the
+     * time, so that clients restarted together do not retry together.
+     */
+    bool decorrelated_token_backoff;
+
+    /* The maximum number of objects to send in one registration sync subtree.
+     * Larger registration sets are streamed to the server as several subtrees,
+     * one per message.
+     */
+    int max_registration_sync_subtree_size;
+
+    /* Whether to keep the desired registrations in a CompactRegistrationStore,
+     * which needs several times less memory per registration than the default
+     * store, for clients with very many registrations.
+     */
+    bool use_compact_registration_store;
+
+    /* Whether to keep the desired registrations in a
+     * PartitionedRegistrationStore, which keeps the objects of each source
+     * apart so that churn in one source does not make the client rehash the
+     * others. Ignored if use_compact_registration_store is set.
+     */
+    bool partition_registrations_by_source;
+
+    /* Whether to keep a filter over the desired registrations and acknowledge
+     * invalidations for objects that are definitely not registered (e.g.,
+     * ones that race with an unregistration) without issuing them to the
+     * listener. The filter is only consulted while the desired registrations
+     * are in sync with the server's, since until then (e.g., while the
+     * application reissues its registrations after a restart) they may lack
+     * objects that the server has registered.
+     */
+    bool use_registration_filter;
+
+    /* Whether (un)registrations that do not change the desired registrations
+     * are confirmed to the listener locally, without being sent, while the
+     * client is in sync with the server, so that applications that
+     * periodically reissue all their registrations do not resend them.
+     */
+    bool elide_redundant_registrations;
+
+    /* If positive, the object ids of calls to PerformRegisterOperations with
+     * at least this many of them are converted and digested on the calling
+     * thread, so that only the update of the desired registrations runs on
+     * the internal thread and a bulk (un)registration does not hold up the
+     * delivery of invalidations for the length of the digest work.
+     */
+    int min_prepared_registration_batch_size;
+
+    /* If positive, the number of threads on which to issue the listener
+     * upcalls about single objects (e.g., invalidations), so that slow
+     * handlers for one object do not hold up the others. Upcalls about the
+     * same object are still issued in order, and the other upcalls in order
+     * with all of them. The listener must then be thread-safe. If zero, all
+     * upcalls are issued on the listener scheduler.
+     */
+    int num_listener_dispatch_threads;
+
+    /* Whether an invalidation still waiting for its upcall is replaced by a
+     * later one for a newer version of the object, and acknowledged, so that
+     * a listener that falls behind handles each object once (see
+     * CheckingInvalidationListener).
+     */
+    bool coalesce_invalidations;
+
+    /* If positive, the maximum number of invalidations issued to the listener
+     * and not yet acknowledged. Further invalidations from the server are
+     * then neither issued nor acknowledged, so that the server resends them
+     * once the listener has caught up, instead of their upcalls piling up on
+     * the listener scheduler. An invalidation stays outstanding until the
+     * listener acknowledges it, another for the same object is issued in its
+     * place, or the client token changes.
+     */
+    int max_outstanding_invalidations;
+
+    /* If positive, the number of objects for which the client remembers the
+     * highest known version the listener acknowledged. A known-version
+     * invalidation at or below it, as the server redelivers after reconnects
+     * and failovers, is then acknowledged without being issued.
+     */
+    int acked_version_cache_size;
+
+    /* Whether to offer the server to catch up incrementally when it has lost
+     * track of the client, so that the listener gets invalidations for the
+     * objects that changed meanwhile rather than an InvalidateAll. The
+     * highest versions the client presents are those of the acked version
+     * cache, if any; the server sends an invalidation for any other object
+     * that changed at all.
+     */
+    bool catch_up_after_token_loss;
+
+    /* Whether to persist the desired registrations and the last server
+     * summary, so that a restarted client that finds them in sync resumes with
+     * them instead of asking the application to reissue its registrations.
+     */
+    bool persist_registrations;
+
+    /* The number of entries in the persisted registration log after which it
+     * is replaced by a snapshot of the registrations.
+     */
+    int registration_log_compaction_threshold;
+
+    /* If positive, how long a registration lasts after the application last
+     * registered the object: registrations not renewed by another Register
+     * within registration_lease are unregistered by the client, in batches,
+     * so that the ones the application forgot about do not accumulate. The
+     * listener learns of the expiry through InformRegistrationStatus once the
+     * server confirms the unregistration. Registrations restored from
+     * persistent state have no lease until they are registered again.
+     */
+    TimeDelta registration_lease;
+
+    /* If not NULL, receives the changes of the statistics every
+     * statistics_export_interval once the Ticl has started. Not owned; must
+     * outlive the client.
+     */
+    StatisticsSink* statistics_sink;
+
+    /* Interval at which the statistics are exported to statistics_sink. */
+    TimeDelta statistics_export_interval;
+
+    /* If not NULL, the InstrumentedSchedulers that wrap the internal and
+     * listener schedulers of the resources, whose queue depths, lags and run
+     * times are then reported with the statistics. Not owned.
+     */
+    InstrumentedScheduler* instrumented_internal_scheduler;
+    InstrumentedScheduler* instrumented_listener_scheduler;
+
+    /* If positive, the client keeps a binary log of its last
+     * 2^event_log_log2_capacity events (see EventLog), to be read with
+     * InvalidationClientImpl::event_log.
+     */
+    int event_log_log2_capacity;
+
+    /* Whether the internal thread publishes a ClientState after each change
+     * to it, to be read from any thread with
+     * InvalidationClientImpl::state_snapshot.
+     */
+    bool publish_client_state;
+
+    /* Whether the additive statistics are sharded across threads (see
+     * ShardedCounters), so that threads recording at once do not contend on
+     * their cache lines. Costs about 10 KB per client.
+     */
+    bool shard_statistics_counters;
+
+    /* If not empty, a state blob (see SerializeProvisionedState) that the
+     * client starts from instead of the one in its storage, e.g., handed over
+     * by a daemon that acquired the token, so that a short-lived client is
+     * ready without an initialize round trip to the server. If the blob is
+     * malformed, the client acquires a token as usual.
+     */
+    string provisioned_state;
+
     /* Configuration for the protocol client to control batching etc. */
     ProtocolHandler::Config protocol_handler_config;
 
@@ -88,6 +284,15 @@ class InvalidationClientImpl : public InvalidationClient,
       Config config, const string& application_name,
       InvalidationListener* listener);
 
+  /* Deletes the callbacks of the payload fetches still pending. */
+  virtual ~InvalidationClientImpl();
+
+  /* Sets state_blob to a state blob holding client_token, for
+   * Config::provisioned_state.
+   */
+  static void SerializeProvisionedState(const string& client_token,
+                                        string* state_blob);
+
   /* Stores the client id that is used for squelching invalidations on the
    * server side.
    */
@@ -112,6 +317,21 @@ class InvalidationClientImpl : public InvalidationClient,
     return resources_;
   }
 
+  /* Returns the binary log of events, or NULL if
+   * Config::event_log_log2_capacity is not positive. Snapshots of it may be
+   * taken from any thread.
+   */
+  EventLog* event_log() {
+    return event_log_.get();
+  }
+
+  /* Returns the published state of the Ticl, or NULL if
+   * Config::publish_client_state is false. It may be read from any thread.
+   */
+  const ClientStateSnapshot* state_snapshot() const {
+    return state_snapshot_.get();
+  }
+
   /* Returns the performance counters/statistics. */
   Statistics* GetStatisticsForTest() {
     return statistics_.get();
@@ -163,11 +383,24 @@ class InvalidationClientImpl : public InvalidationClient,
   virtual void Unregister(const ObjectId& object_id);
 
   virtual void Register(const vector<ObjectId>& object_ids) {
-    PerformRegisterOperations(object_ids, RegistrationP_OpType_REGISTER);
+    PerformRegisterOperations(object_ids, RegistrationP_OpType_REGISTER, NULL);
   }
 
   virtual void Unregister(const vector<ObjectId>& object_ids) {
-    PerformRegisterOperations(object_ids, RegistrationP_OpType_UNREGISTER);
+    PerformRegisterOperations(object_ids, RegistrationP_OpType_UNREGISTER,
+                              NULL);
+  }
+
+  virtual void Register(const vector<ObjectId>& object_ids,
+                        CompletionCallback* callback) {
+    PerformRegisterOperations(object_ids, RegistrationP_OpType_REGISTER,
+                              callback);
+  }
+
+  virtual void Unregister(const vector<ObjectId>& object_ids,
+                          CompletionCallback* callback) {
+    PerformRegisterOperations(object_ids, RegistrationP_OpType_UNREGISTER,
+                              callback);
   }
 
   /* Implementation of (un)registration.
@@ -175,15 +408,63 @@ class InvalidationClientImpl : public InvalidationClient,
    * Arguments:
    * object_ids - object ids on which to operate
    * reg_op_type - whether to register or unregister
+   * callback - if not NULL, the completion callback of the operations
    */
   virtual void PerformRegisterOperations(
-      const vector<ObjectId>& object_ids, RegistrationP::OpType reg_op_type);
+      const vector<ObjectId>& object_ids, RegistrationP::OpType reg_op_type,
+      CompletionCallback* callback);
 
   void PerformRegisterOperationsInternal(
-      const vector<ObjectId>& object_ids, RegistrationP::OpType reg_op_type);
+      const vector<ObjectId>& object_ids, RegistrationP::OpType reg_op_type,
+      CompletionCallback* callback);
+
+  /* (Un)registrations whose object ids have been converted and digested
+   * before being handed to the internal thread.
+   */
+  struct PreparedRegisterOperations {
+    vector<ObjectId> object_ids;
+    vector<ObjectIdP> object_id_protos;
+
+    /* The digests of object_id_protos, under digest_fn_. */
+    vector<string> digests;
+
+    RegistrationP::OpType reg_op_type;
+
+    /* The completion callback of the operations, or NULL. */
+    CompletionCallback* callback;
+  };
+
+  /* An (un)registration call that reached the internal thread before
+   * StartInternal ran.
+   */
+  struct PreStartOperation {
+    vector<ObjectId> object_ids;
+    RegistrationP::OpType reg_op_type;
+
+    /* The completion callback of the operations, or NULL. */
+    CompletionCallback* callback;
+  };
+
+  /* Performs operations, which it takes ownership of, as
+   * PerformRegisterOperationsInternal does.
+   */
+  void PerformPreparedRegisterOperations(
+      PreparedRegisterOperations* operations);
 
   virtual void Acknowledge(const AckHandle& acknowledge_handle);
 
+  virtual void Acknowledge(const vector<AckHandle>& ack_handles);
+
+  virtual void Acknowledge(const vector<AckHandle>& ack_handles,
+                           CompletionCallback* callback);
+
+  /* Payloads are fetched with the priority operations (see
+   * ProtocolHandler::SendPayloadFetch), and concurrent fetches of the same
+   * payload share one request.
+   */
+  virtual void FetchPayload(const Invalidation& invalidation,
+                            PayloadCallback* callback);
+
   string ToString();
 
   //
@@ -200,7 +481,7 @@ class InvalidationClientImpl : public InvalidationClient,
 
   virtual void HandleInvalidations(
       const ServerMessageHeader& header,
-      const RepeatedPtrField<InvalidationP>& invalidations);
+      RepeatedPtrField<InvalidationP>* invalidations);
 
   virtual void HandleRegistrationStatus(
       const ServerMessageHeader& header,
@@ -218,10 +499,17 @@ class InvalidationClientImpl : public InvalidationClient,
       const ErrorMessage::Code code,
       const string& description);
 
+  virtual void HandlePayloads(const ServerMessageHeader& header,
+                              RepeatedPtrField<PayloadP>* payloads);
+
   virtual void GetRegistrationSummary(RegistrationSummary* summary) {
     registration_manager_.GetClientSummary(summary);
   }
 
+  virtual void HandleNetworkStatusChange(bool is_online);
+
+  virtual void HandleConfigChange(const ConfigChangeMessage& config_change);
+
   /* Gets registration manager state as a serialized RegistrationManagerState.
    */
   void GetRegistrationManagerStateAsSerializedProto(string* result);
@@ -229,9 +517,23 @@ class InvalidationClientImpl : public InvalidationClient,
   /* Gets statistics as a serialized InfoMessage. */
   void GetStatisticsAsSerializedProto(string* result);
 
+  /* Stores in usage the approximate heap bytes held by each component of the
+   * Ticl, by component name; "Client" counts the Ticl object itself. Walks
+   * all the registrations, so it takes time linear in their number. Tasks
+   * waiting in the schedulers are not counted.
+   *
+   * REQUIRES: Called on the internal thread.
+   */
+  void GetMemoryUsage(vector<pair<string, size_t> >* usage);
+
   /* The single key used to write all the Ticl state. */
   static const char* kClientTokenKey;
 
+  /* Maximum number of unconfirmed registrations whose start time is kept for
+   * the latency statistics.
+   */
+  static const int kMaxTrackedRegistrations;
+
  private:
   //
   // Private methods.
@@ -247,6 +549,95 @@ class InvalidationClientImpl : public InvalidationClient,
 
   void AcknowledgeInternal(const AckHandle& acknowledge_handle);
 
+  /* Validates acknowledge_handle and sends its acknowledgement. Returns
+   * whether the handle was valid.
+   */
+  bool SendAcknowledgement(const AckHandle& acknowledge_handle);
+
+  /* Acknowledges each of the ack_handles that is not a no-op, then completes
+   * callback, if not NULL.
+   */
+  void AcknowledgeAllInternal(const vector<AckHandle>& ack_handles,
+                              CompletionCallback* callback);
+
+  /* An (un)registration call with a completion callback, waiting for the
+   * outcome of each of its objects.
+   */
+  struct PendingCompletion {
+    PendingCompletion(CompletionCallback* callback, int num_pending)
+        : callback(callback), num_pending(num_pending),
+          status(Status::SUCCESS, "") {}
+
+    CompletionCallback* callback;
+
+    /* The number of objects of the call without an outcome yet. */
+    int num_pending;
+
+    /* Success, or the first failure among the outcomes so far. */
+    Status status;
+  };
+
+  /* The calls waiting for the outcome of an object, keyed by the serialized
+   * object id, with the operation they wait for. An object appears once per
+   * call (and per occurrence in the call).
+   */
+  typedef multimap<string, pair<RegistrationP::OpType, PendingCompletion*> >
+      CompletionMap;
+
+  /* Makes callback, if not NULL, wait for the outcome of the reg_op_type
+   * operations on object_ids.
+   */
+  void TrackCompletion(const vector<ObjectIdP>& object_ids,
+                       RegistrationP::OpType reg_op_type,
+                       CompletionCallback* callback);
+
+  /* Gives status as the outcome of the reg_op_type operation on object_id to
+   * the calls waiting for it.
+   */
+  void CompleteOperation(const ObjectIdP& object_id,
+                         RegistrationP::OpType reg_op_type,
+                         const Status& status);
+
+  /* Gives each object of the waiting calls the outcome implied by the desired
+   * registrations, which the server is known to agree with: success if the
+   * object is in the state the call asked for, failure if a later call
+   * reversed it. Registrations that are sent with a registration sync get no
+   * status from the server, so this is how their calls complete.
+   */
+  void CompleteOperationsInSync();
+
+  /* Gives status as the outcome of every object of the waiting calls. */
+  void FailAllOperations(const Status& status);
+
+  /* Records status as the outcome of one object of completion and, if it was
+   * the last one, schedules the callback on the listener scheduler and deletes
+   * completion.
+   */
+  void CompleteObject(PendingCompletion* completion, const Status& status);
+
+  /* Runs callback with status, then deletes it. */
+  void RunCompletionCallback(CompletionCallback* callback, Status status);
+
+  /* Requests the payload with payload_reference from the server, unless it
+   * already has been, and keeps callback to run with it.
+   */
+  void FetchPayloadInternal(const string& payload_reference,
+                            PayloadCallback* callback);
+
+  /* Runs the callbacks of the fetch of the payload with payload_reference, if
+   * any, with result on the listener scheduler, and forgets the fetch.
+   */
+  void CompletePayloadFetch(const string& payload_reference,
+                            const StatusStringPair& result);
+
+  /* Runs callback with result, then deletes it. */
+  void RunPayloadCallback(PayloadCallback* callback, StatusStringPair result);
+
+  /* Fails the payload fetches that the server has not answered within the
+   * network timeout, then reschedules itself while any are left.
+   */
+  void PayloadFetchTimeoutTask();
+
   /* Set client_token to NULL and schedule acquisition of the token. */
   void ScheduleAcquireToken(const string& debug_string);
 
@@ -262,6 +653,68 @@ class InvalidationClientImpl : public InvalidationClient,
   /* Function called to check for timed-out network messages. */
   void CheckNetworkTimeouts();
 
+  /* Issues the non-empty batches of invalidations to the listener, with the
+   * ones for urgent objects first (see
+   * ProtocolHandler::Config::urgent_object_sources), and clears them.
+   */
+  void IssueInvalidationBatches(
+      vector<pair<Invalidation, AckHandle> >* known_version_batch,
+      vector<pair<ObjectId, AckHandle> >* unknown_version_batch);
+
+  /* Records when the objects in object_ids start being registered, unless
+   * they already are, or stops tracking them if reg_op_type is an
+   * unregistration.
+   */
+  void TrackRegistrationTimes(const vector<ObjectIdP>& object_ids,
+                              RegistrationP::OpType reg_op_type);
+
+  /* Stops tracking the registration times of the objects in object_ids, e.g.,
+   * when no confirmation of them will come from the server.
+   */
+  void UntrackRegistrationTimes(const vector<ObjectIdP>& object_ids);
+
+  /* Records the (un)registrations of object_ids, whose digests are given if
+   * digests is not NULL, in the registration manager and sends them to the
+   * server, except those over the budget of their source.
+   */
+  void ApplyRegisterOperations(const vector<ObjectIdP>& object_ids,
+                               const vector<string>* digests,
+                               RegistrationP::OpType reg_op_type);
+
+  /* Appends to admitted_object_ids the object_ids (and to admitted_digests
+   * their digests, if digests is not NULL) that the protocol handler admits
+   * (see ProtocolHandler::Config::max_pending_registrations_per_source), and
+   * informs the listener of transient failures of the others. Returns whether
+   * any were left out.
+   */
+  bool RejectOverBudgetOperations(const vector<ObjectIdP>& object_ids,
+                                  const vector<string>* digests,
+                                  RegistrationP::OpType reg_op_type,
+                                  vector<ObjectIdP>* admitted_object_ids,
+                                  vector<string>* admitted_digests);
+
+  /* Appends to changed_object_ids the object_ids (and to changed_digests
+   * their digests, if digests is not NULL) whose desired registration state
+   * reg_op_type changes, and informs the listener of the state of the others
+   * as if the server had confirmed them. Returns whether any were left out.
+   */
+  bool ElideRedundantOperations(const vector<ObjectIdP>& object_ids,
+                                const vector<string>* digests,
+                                RegistrationP::OpType reg_op_type,
+                                vector<ObjectIdP>* changed_object_ids,
+                                vector<string>* changed_digests);
+
+  /* Stops tracking the object of reg_status and, if it was successfully
+   * registered, records how long the registration took.
+   */
+  void RecordRegistrationLatency(const RegistrationStatus& reg_status,
+                                 bool was_success);
+
+  /* Reports the statistics that changed since the last export to the
+   * statistics sink, then schedules the next export.
+   */
+  void ExportStatisticsTask();
+
   /* Sends an info message to the server. If mustSendPerformanceCounters is
    * true, the performance counters are sent regardless of when they were sent
    * earlier.
@@ -269,9 +722,20 @@ class InvalidationClientImpl : public InvalidationClient,
   void SendInfoMessageToServer(
       bool mustSendPerformanceCounters, bool request_server_summary);
 
-  /* Writes the Ticl state to persistent storage. */
+  /* Writes the Ticl state to persistent storage, unless it is unchanged since
+   * the last write.
+   */
   void WriteStateBlob();
 
+  /* Returns whether writing the Ticl state whose serialization is
+   * serialized_state would change what is (or will be) persisted, i.e.,
+   * whether it differs from the state last handed to the state writer.
+   */
+  bool StateBlobWouldChange(const string& serialized_state) const {
+    return last_serialized_ticl_state_.empty() ||
+        (serialized_state != last_serialized_ticl_state_);
+  }
+
   /* Sets the nonce to new_nonce.
    *
    * REQUIRES: new_nonce be empty or client_token_ be empty.  The goal is to
@@ -288,9 +752,6 @@ class InvalidationClientImpl : public InvalidationClient,
    */
   void set_client_token(const string& new_client_token);
 
-  /* Handles the result of a request to write to persistent storage. */
-  void WriteCallback(Status status);
-
   /* Reads the Ticl state from persistent storage (if any) and calls
    * startInternal.
    */
@@ -299,18 +760,57 @@ class InvalidationClientImpl : public InvalidationClient,
   /* Handles the result of a request to read from persistent storage. */
   void ReadCallback(pair<Status, string> read_result);
 
-  /* Ensures that a heartbeat message is sent periodically. */
+  /* Handles the state blob read from persistent storage on the internal
+   * thread.
+   */
+  void HandleStateBlobRead(const string& serialized_state);
+
+  /* Handles the end of the load of the registration log. */
+  void HandleRegistrationLogLoaded();
+
+  /* Calls StartInternal once both the state blob has been read and the
+   * registration log (if any) has been loaded.
+   */
+  void MaybeStartInternal();
+
+  /* Records that startup_phase_type took from start_time until now. */
+  void RecordStartupPhaseSince(Statistics::StartupPhaseType startup_phase_type,
+                               Time start_time);
+
+  /* Ensures that a heartbeat message is sent periodically, or, if
+   * Config::suppress_redundant_heartbeats, that some message is.
+   */
   void HeartbeatTask();
 
+  /* Unregisters the objects whose registration leases have expired, then
+   * reschedules itself while any lease is left.
+   */
+  void RegistrationLeaseTask();
+
+  /* Hands the next subtree of the registration sync in progress to the
+   * protocol handler once the previous one has been sent, and reschedules
+   * itself until the sync is complete.
+   */
+  void RegistrationSyncTask();
+
   /* Finish starting the ticl and inform the listener that it is ready. */
   void FinishStartingTiclAndInformListener();
 
+  /* Publishes the current state in state_snapshot_, if any. */
+  void PublishState();
+
   /* Converts an operation type reg_status to a
    * InvalidationListener::RegistrationState.
    */
   static InvalidationListener::RegistrationState ConvertOpTypeToRegState(
       RegistrationStatus reg_status);
 
+  /* Stores in serialized the serialization of an AckHandleP for
+   * invalidation, without its payload.
+   */
+  static void SerializeAckHandle(const InvalidationP& invalidation,
+                                 string* serialized);
+
  private:
   /* Resources for the Ticl. */
   SystemResources* resources_;  // Owned by application.
@@ -326,12 +826,29 @@ class InvalidationClientImpl : public InvalidationClient,
   /* Statistics objects to track number of sent messages, etc. */
   scoped_ptr<Statistics> statistics_;
 
+  /* Binary log of events, if Config::event_log_log2_capacity is positive. */
+  scoped_ptr<EventLog> event_log_;
+
+  /* Published state, if Config::publish_client_state. */
+  scoped_ptr<ClientStateSnapshot> state_snapshot_;
+
   /* Application callback interface. */
   scoped_ptr<CheckingInvalidationListener> listener_;
 
   /* Configuration for this instance. */
   Config config_;
 
+  /* The ack handle being acknowledged by AcknowledgeInternal, reused for every
+   * acknowledgement.
+   */
+  AckHandleP parsed_ack_handle_;
+
+  /* The serialized ack handles of the invalidations issued to the listener and
+   * not yet acknowledged, by serialized object id, when
+   * config_.max_outstanding_invalidations bounds them.
+   */
+  map<string, string> outstanding_invalidations_;
+
   /* The client type code as assigned by the notification system's backend. */
   int client_type_;
 
@@ -354,6 +871,11 @@ class InvalidationClientImpl : public InvalidationClient,
   /* Object to schedule future events. */
   OperationScheduler operation_scheduler_;
 
+  /* Queue through which the operations called by the application (e.g.,
+   * registrations and acknowledgements) reach the internal thread.
+   */
+  SubmissionQueue submission_queue_;
+
   /* The state of the Ticl whether it has started or not. */
   RunState ticl_state_;
 
@@ -363,8 +885,27 @@ class InvalidationClientImpl : public InvalidationClient,
   /* Exponential backoff generator for acquire-token timeouts. */
   ExponentialBackoffDelayGenerator token_exponential_backoff_;
 
-  /* Exponential backoff generator for persistence timeouts. */
-  ExponentialBackoffDelayGenerator persistence_exponential_backoff_;
+  /* Writer of the Ticl state to persistent storage. */
+  PersistentStateWriter state_writer_;
+
+  /* Serialization of the Ticl state last handed to state_writer_, or empty if
+   * none has been.
+   */
+  string last_serialized_ticl_state_;
+
+  /* The Ticl state being written, reused across writes. */
+  PersistentTiclState ticl_state_to_write_;
+
+  /* Persistent log of the desired registrations, if enabled. */
+  scoped_ptr<RegistrationLog> registration_log_;
+
+  /* The leases of the registrations, if config_.registration_lease is
+   * positive.
+   */
+  scoped_ptr<RegistrationLeaseWheel> registration_leases_;
+
+  /* The highest acknowledged version of recent objects, if enabled. */
+  scoped_ptr<AckedVersionCache> acked_versions_;
 
   /* A smearer to make sure that delays are randomized a little bit. */
   Smearer smearer_;
@@ -382,11 +923,88 @@ class InvalidationClientImpl : public InvalidationClient,
   // and replace this variable with a test for whether it's null or not.
   bool should_send_registrations_;
 
+  /* Whether the desired registrations were restored from persistent storage,
+   * in which case the application is not asked to reissue them.
+   */
+  bool restored_registrations_;
+
+  /* Whether StartInternal has run, i.e., whether the registrations submitted
+   * by the application can be performed.
+   */
+  bool start_internal_done_;
+
+  /* Time at which Start was called, and at which StartInternal finished. */
+  Time start_time_;
+  Time start_internal_done_time_;
+
+  /* Whether the state blob has been read, and the blob (empty if there was
+   * none) until StartInternal runs.
+   */
+  bool is_state_blob_read_;
+  string read_state_blob_;
+
+  /* Whether the registration log (if any) has been loaded. */
+  bool is_registration_log_loaded_;
+
+  /* Whether a network timeout check came due while the protocol handler was
+   * holding back messages for lack of network, and is to be made when the
+   * network is back.
+   */
+  bool is_timeout_check_deferred_;
+
+  /* When each unconfirmed registration started, keyed by serialized object id.
+   */
+  map<string, Time> registration_start_times_;
+
+  /* A payload fetch waiting for the server: when it was requested, and the
+   * callbacks of the application to run with the payload.
+   */
+  struct PendingPayloadFetch {
+    Time request_time;
+    vector<PayloadCallback*> callbacks;
+  };
+
+  /* The payload fetches waiting for the server, by payload reference. */
+  map<string, PendingPayloadFetch> pending_payload_fetches_;
+
+  /* The (un)registration calls waiting for the outcome of their objects. */
+  CompletionMap pending_completions_;
+
+  /* The (un)registrations submitted by the application before StartInternal
+   * ran, in order.
+   */
+  vector<PreStartOperation> pre_start_operations_;
+
   /* A task for periodic heartbeats. */
   scoped_ptr<Closure> heartbeat_task_;
 
   /* A task to periodically check network timeouts. */
   scoped_ptr<Closure> timeout_task_;
+
+  /* A task to stream registration sync subtrees to the server. */
+  scoped_ptr<Closure> registration_sync_task_;
+
+  /* A task to export the statistics to the statistics sink. */
+  scoped_ptr<Closure> export_statistics_task_;
+
+  /* A task to expire the registration leases. */
+  scoped_ptr<Closure> registration_lease_task_;
+
+  /* A task to time out the payload fetches. */
+  scoped_ptr<Closure> payload_fetch_timeout_task_;
+
+  /* The value of each statistic as of the last export. */
+  map<string, int> last_exported_statistics_;
+
+  /* The operation scheduler's information for the tasks above, with which
+   * they are scheduled without lookup or allocation.
+   */
+  OperationScheduleInfo* heartbeat_operation_;
+  OperationScheduleInfo* timeout_operation_;
+  OperationScheduleInfo* registration_sync_operation_;
+  OperationScheduleInfo* export_statistics_operation_;
+  OperationScheduleInfo* registration_lease_operation_;
+  OperationScheduleInfo* payload_fetch_timeout_operation_;
 };
 
 }  // namespace invalidation
@@ -20,6 +20,7 @@
 #include <vector>
 
 #include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
 
 namespace invalidation {
 
@@ -29,6 +30,17 @@ class AckHandle;
 class Invalidation;
 class ObjectId;
 
+/* Receives the outcome of InvalidationClient::FetchPayload: the status of the
+ * fetch and, if it succeeded, the payload.
+ */
+typedef INVALIDATION_CALLBACK1_TYPE(StatusStringPair) PayloadCallback;
+
+/* Receives the outcome of an InvalidationClient operation that was given a
+ * completion callback: success once the whole operation has completed, or the
+ * first failure among its parts.
+ */
+typedef INVALIDATION_CALLBACK1_TYPE(Status) CompletionCallback;
+
 class InvalidationClient {
  public:
   virtual ~InvalidationClient() {}
@@ -61,8 +73,11 @@ class InvalidationClient {
    * network is disconnected, the listener events will probably show up when the
    * network connection is repaired.
    *
-   * REQUIRES: Start has been called and and InvalidationListener::Ready has
-   * been received by the application's listener.
+   * Registrations requested before InvalidationListener::Ready has been
+   * received are held until the client has read its persistent state, and are
+   * then sent along with the client's first message to the server.
+   *
+   * REQUIRES: Start has been called.
    */
   virtual void Register(const ObjectId& object_id) = 0;
 
@@ -73,6 +88,17 @@ class InvalidationClient {
    */
   virtual void Register(const vector<ObjectId>& object_ids) = 0;
 
+  /* Like Register(const vector<ObjectId>&), but also runs callback on the
+   * listener's thread once every one of object_ids has an outcome: with
+   * success if they are all registered, or with the status of the first
+   * failure. The listener is informed of each object as usual. This lets an
+   * application keep many registrations in flight without correlating the
+   * listener events itself. Takes ownership of callback; if the client is
+   * stopped first, callback is deleted without being run.
+   */
+  virtual void Register(const vector<ObjectId>& object_ids,
+                        CompletionCallback* callback) = 0;
+
   /* Requests that the Ticl unregister for notifications for the object with id
    * object_id.  The library guarantees that the caller will be informed of the
    * results of this call either via
@@ -86,8 +112,10 @@ class InvalidationClient {
    * network is disconnected, the listener events will probably show up when the
    * network connection is repaired.
    *
-   * REQUIRES: Start has been called and and InvalidationListener::Ready has
-   * been receiveed by the application's listener.
+   * Like registrations, unregistrations may be requested before
+   * InvalidationListener::Ready has been received.
+   *
+   * REQUIRES: Start has been called.
    */
   virtual void Unregister(const ObjectId& object_id) = 0;
 
@@ -98,6 +126,12 @@ class InvalidationClient {
    */
   virtual void Unregister(const vector<ObjectId>& object_ids) = 0;
 
+  /* Like Unregister(const vector<ObjectId>&), with a callback run as for
+   * Register(const vector<ObjectId>&, CompletionCallback*).
+   */
+  virtual void Unregister(const vector<ObjectId>& object_ids,
+                          CompletionCallback* callback) = 0;
+
   /* Acknowledges the InvalidationListener event that was delivered with the
    * provided acknowledgement handle. This indicates that the client has
    * accepted responsibility for processing the event and it does not need to be
@@ -107,6 +141,34 @@ class InvalidationClient {
    * received by the application's listener.
    */
   virtual void Acknowledge(const AckHandle& ackHandle) = 0;
+
+  /* Acknowledges the events delivered with each of the ack_handles. See the
+   * specs on Acknowledge(const AckHandle&) for more details. If the caller
+   * needs to acknowledge a number of events (e.g., after handling them in
+   * bulk), this method is more efficient than calling Acknowledge in a loop.
+   */
+  virtual void Acknowledge(const vector<AckHandle>& ack_handles) = 0;
+
+  /* Like Acknowledge(const vector<AckHandle>&), but also runs callback on the
+   * listener's thread once the acknowledgements have been queued for the
+   * server (which does not confirm them): with success, or with a permanent
+   * failure if any of ack_handles is malformed. Takes ownership of callback.
+   */
+  virtual void Acknowledge(const vector<AckHandle>& ack_handles,
+                           CompletionCallback* callback) = 0;
+
+  /* Fetches the payload of invalidation, which the server held back because
+   * it is large (see Invalidation::has_payload_reference), and runs callback
+   * with it on the listener's thread. The status is a transient failure if
+   * the server does not answer within the network timeout, and a permanent
+   * failure if it no longer has the payload or invalidation has no payload
+   * reference. Takes ownership of callback.
+   *
+   * REQUIRES: Start been called and and InvalidationListener::Ready has been
+   * received by the application's listener.
+   */
+  virtual void FetchPayload(const Invalidation& invalidation,
+                            PayloadCallback* callback) = 0;
 };
 
 }  // namespace invalidation
@@ -23,10 +23,14 @@
 #include "google/cacheinvalidation/v2/types.h"
 
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::pair;
 using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
 
 class AckHandle;
 class ErrorInfo;
@@ -186,6 +190,55 @@ class InvalidationListener {
    */
   virtual void InformError(InvalidationClient* client,
                            const ErrorInfo& error_info) = 0;
+
+  /* Indicates that several objects have been updated, each as in Invalidate.
+   * Called for the invalidations that arrive together (e.g., in one message
+   * from the server), so that the application can handle them in bulk. Each
+   * invalidation must be acknowledged with its ack handle.
+   *
+   * The default implementation calls Invalidate for each invalidation in turn.
+   *
+   * Arguments:
+   *     client - the InvalidationClient invoking the listener
+   *     invalidations - the invalidations and their ack handles
+   */
+  virtual void InvalidateBatch(
+      InvalidationClient* client,
+      const vector<pair<Invalidation, AckHandle> >& invalidations) {
+    for (size_t i = 0; i < invalidations.size(); ++i) {
+      Invalidate(client, invalidations[i].first, invalidations[i].second);
+    }
+  }
+
+  /* As InvalidateBatch, but for invalidations of unknown versions, each as in
+   * InvalidateUnknownVersion. The default implementation calls
+   * InvalidateUnknownVersion for each object in turn.
+   */
+  virtual void InvalidateUnknownVersionBatch(
+      InvalidationClient* client,
+      const vector<pair<ObjectId, AckHandle> >& invalidations) {
+    for (size_t i = 0; i < invalidations.size(); ++i) {
+      InvalidateUnknownVersion(client, invalidations[i].first,
+                               invalidations[i].second);
+    }
+  }
+
+  /* Indicates that the registration states of several objects have changed,
+   * each as in InformRegistrationStatus. The default implementation calls
+   * InformRegistrationStatus for each object in turn.
+   *
+   * Arguments:
+   *     client - the InvalidationClient invoking the listener
+   *     reg_states - the ids of the objects and their new states
+   */
+  virtual void InformRegistrationStatusBatch(
+      InvalidationClient* client,
+      const vector<pair<ObjectId, RegistrationState> >& reg_states) {
+    for (size_t i = 0; i < reg_states.size(); ++i) {
+      InformRegistrationStatus(client, reg_states[i].first,
+                               reg_states[i].second);
+    }
+  }
 };
 
 }  // namespace invalidation
@@ -17,7 +17,14 @@
 #ifndef GOOGLE_CACHEINVALIDATION_V2_LOG_MACRO_H_
 #define GOOGLE_CACHEINVALIDATION_V2_LOG_MACRO_H_
 
+// The arguments are only evaluated if the logger is enabled for the level, so
+// they may be expensive to compute (e.g., ProtoHelpers::ToString of a message).
 #define TLOG(logger, level, str, ...)                                   \
-  logger->Log(Logger::level ## _LEVEL, __FILE__, __LINE__, str, ##__VA_ARGS__);
+  do {                                                                  \
+    if ((logger)->IsEnabled(Logger::level ## _LEVEL)) {                 \
+      (logger)->Log(Logger::level ## _LEVEL, __FILE__, __LINE__, str,   \
+                    ##__VA_ARGS__);                                     \
+    }                                                                   \
+  } while (false)
 
 #endif  // GOOGLE_CACHEINVALIDATION_V2_LOG_MACRO_H_
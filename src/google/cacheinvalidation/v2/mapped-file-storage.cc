@@ -0,0 +1,608 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Storage over a memory-mapped, append-only file.
+
+#include "google/cacheinvalidation/v2/mapped-file-storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/zlib.h"
+#include "google/cacheinvalidation/v2/log-macro.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+// Layout of a record: a header of little-endian 32-bit fields, followed by the
+// key and the value.
+static const uint32 kRecordMagic = 0x3153464d;  // "MFS1"
+static const size_t kMagicOffset = 0;
+static const size_t kFlagsOffset = 4;
+static const size_t kKeySizeOffset = 8;
+static const size_t kValueSizeOffset = 12;
+static const size_t kValueChecksumOffset = 16;
+static const size_t kHeaderChecksumOffset = 20;
+static const size_t kHeaderSize = 24;
+
+// Flag of the records that delete their key.
+static const uint32 kDeletionFlag = 1;
+
+static void PutUint32(uint32 value, char* buffer) {
+  for (int i = 0; i < 4; ++i) {
+    buffer[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+}
+
+static uint32 GetUint32(const char* buffer) {
+  uint32 value = 0;
+  for (int i = 0; i < 4; ++i) {
+    value |= static_cast<uint32>(static_cast<unsigned char>(buffer[i])) <<
+        (8 * i);
+  }
+  return value;
+}
+
+static uint32 Checksum(const char* data, size_t size, uint32 checksum) {
+  return crc32(checksum, reinterpret_cast<const Bytef*>(data), size);
+}
+
+// Returns the checksum of the header fields before it and of the key.
+static uint32 GetHeaderChecksum(const char* record, size_t key_size) {
+  uint32 checksum = Checksum(record, kHeaderChecksumOffset, crc32(0, NULL, 0));
+  return Checksum(record + kHeaderSize, key_size, checksum);
+}
+
+// Writes size bytes of data to fd at offset. Returns whether all were written.
+static bool WriteFully(int fd, const char* data, size_t size, size_t offset) {
+  while (size > 0) {
+    ssize_t written = pwrite(fd, data, size, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+MappedFileStorage::MappedFileStorage(
+    const string& path, const Config& config, Scheduler* scheduler,
+    Logger* logger)
+    : path_(path),
+      config_(config),
+      scheduler_(scheduler),
+      sync_task_state_(NULL),
+      logger_(logger),
+      fd_(-1),
+      mapping_(NULL),
+      mapped_size_(0),
+      end_offset_(0),
+      live_size_(0) {
+  CHECK((config.sync_policy != SYNC_BATCHED) || (scheduler != NULL)) <<
+      "Batched syncs need a scheduler";
+  if (config.sync_policy == SYNC_BATCHED) {
+    sync_task_state_ = new SyncTaskState(this);
+  }
+  MutexLock m(&lock_);
+  if (!OpenFile()) {
+    TLOG(logger_, SEVERE, "Could not open storage file %s: %s", path.c_str(),
+         strerror(errno));
+  }
+}
+
+MappedFileStorage::~MappedFileStorage() {
+  if (sync_task_state_ != NULL) {
+    // Waits for a sync that is running; the tasks still held by the
+    // scheduler then find the storage gone, and the last one deletes the
+    // state.
+    bool has_tasks;
+    {
+      MutexLock m(&sync_task_state_->lock);
+      sync_task_state_->storage = NULL;
+      has_tasks = (sync_task_state_->num_tasks > 0);
+    }
+    if (!has_tasks) {
+      delete sync_task_state_;
+    }
+  }
+  MutexLock m(&lock_);
+  if (!pending_writes_.empty()) {
+    if (fd_ >= 0) {
+      fdatasync(fd_);
+    }
+    for (size_t i = 0; i < pending_writes_.size(); ++i) {
+      delete pending_writes_[i].write_done;
+      delete pending_writes_[i].delete_done;
+    }
+  }
+  CloseFile();
+}
+
+void MappedFileStorage::WriteKey(const string& key, const string& value,
+                                 WriteKeyCallback* done) {
+  bool success;
+  {
+    MutexLock m(&lock_);
+    success = AppendRecord(key, value, false);
+  }
+  CompleteWrite(done, NULL, success);
+}
+
+void MappedFileStorage::ReadKey(const string& key, ReadKeyCallback* done) {
+  StatusStringPair result(Status(Status::SUCCESS, ""), "");
+  {
+    MutexLock m(&lock_);
+    Index::iterator iter = index_.find(key);
+    if (iter == index_.end()) {
+      result.first = Status(Status::PERMANENT_FAILURE, "No value for key");
+    } else if (!IsValueValid(iter->second)) {
+      TLOG(logger_, SEVERE, "Corrupt value for key %s", key.c_str());
+      result.first = Status(Status::PERMANENT_FAILURE, "Corrupt value");
+    } else {
+      const RecordLocation& location = iter->second;
+      result.second.assign(
+          mapping_ + location.offset + location.size - location.value_size,
+          location.value_size);
+    }
+  }
+  done->Run(result);
+  delete done;
+}
+
+void MappedFileStorage::DeleteKey(const string& key, DeleteKeyCallback* done) {
+  bool success;
+  {
+    MutexLock m(&lock_);
+
+    // A key without a value needs no deletion record.
+    success = (fd_ >= 0) && ((index_.find(key) == index_.end()) ||
+                             AppendRecord(key, "", true));
+  }
+  CompleteWrite(NULL, done, success);
+}
+
+void MappedFileStorage::ReadAllKeys(ReadAllKeysCallback* key_callback) {
+  vector<string> keys;
+  {
+    MutexLock m(&lock_);
+    for (Index::iterator iter = index_.begin(); iter != index_.end(); ++iter) {
+      keys.push_back(iter->first);
+    }
+  }
+  for (size_t i = 0; i < keys.size(); ++i) {
+    key_callback->Run(StatusStringPair(Status(Status::SUCCESS, ""), keys[i]));
+  }
+  delete key_callback;
+}
+
+bool MappedFileStorage::ReadKeyView(const string& key, const char** data,
+                                    size_t* size) {
+  MutexLock m(&lock_);
+  Index::iterator iter = index_.find(key);
+  if ((iter == index_.end()) || !IsValueValid(iter->second)) {
+    return false;
+  }
+  const RecordLocation& location = iter->second;
+  *data = mapping_ + location.offset + location.size - location.value_size;
+  *size = location.value_size;
+  return true;
+}
+
+/* Task that completes the writes waiting for a batched sync, unless the
+ * storage is gone. Counts itself in the shared state until the scheduler
+ * deletes it, whether or not it ran.
+ */
+class MappedFileStorage::BatchedSyncTask : public Closure {
+ public:
+  explicit BatchedSyncTask(SyncTaskState* state) : state_(state) {
+    MutexLock m(&state->lock);
+    ++state->num_tasks;
+  }
+
+  virtual ~BatchedSyncTask() {
+    bool is_last;
+    {
+      MutexLock m(&state_->lock);
+      is_last = (--state_->num_tasks == 0) && (state_->storage == NULL);
+    }
+    if (is_last) {
+      delete state_;
+    }
+  }
+
+  virtual bool IsRepeatable() const {
+    return true;
+  }
+
+  virtual void Run() {
+    vector<PendingWrite> pending_writes;
+    bool synced;
+    {
+      MutexLock m(&state_->lock);
+      if (state_->storage == NULL) {
+        return;
+      }
+      synced = state_->storage->SyncPendingWrites(&pending_writes);
+    }
+    // The callbacks may write again, which takes the locks.
+    for (size_t i = 0; i < pending_writes.size(); ++i) {
+      RunCallback(pending_writes[i], synced);
+    }
+  }
+
+ private:
+  SyncTaskState* state_;
+};
+
+/* Cursor that reads each batch from the index under the lock of the storage,
+ * resuming after the last key read.
+ */
+class MappedFileStorage::Cursor : public StorageCursor {
+ public:
+  Cursor(MappedFileStorage* storage, const string& key_prefix)
+      : storage_(storage), key_prefix_(key_prefix), last_key_(key_prefix),
+        has_read_(false), is_done_(false) {}
+
+  virtual void ReadNext(int max_entries, KeyValueBatchCallback* done) {
+    CHECK(max_entries > 0) << "Invalid batch size: " << max_entries;
+    buffer_.clear();
+    vector<pair<size_t, size_t> > sizes;
+    KeyValueBatch batch;
+    batch.is_last = true;
+    if (!is_done_) {
+      batch.success = storage_->ReadEntries(
+          key_prefix_, last_key_, !has_read_, max_entries, &buffer_, &sizes,
+          &batch.is_last);
+    }
+
+    // The buffer is complete, so views into it stay valid.
+    const char* data = buffer_.data();
+    for (size_t i = 0; i < sizes.size(); ++i) {
+      batch.entries.push_back(KeyValueView(data, sizes[i].first,
+                                           data + sizes[i].first,
+                                           sizes[i].second));
+      data += sizes[i].first + sizes[i].second;
+    }
+    if (!batch.entries.empty()) {
+      last_key_ = batch.entries.back().key();
+    }
+    has_read_ = true;
+    is_done_ = batch.is_last || !batch.success;
+    done->Run(batch);
+    delete done;
+  }
+
+ private:
+  MappedFileStorage* storage_;
+
+  /* Prefix of the keys to read. */
+  string key_prefix_;
+
+  /* Last key read, or key_prefix_ before the first batch. */
+  string last_key_;
+
+  /* Whether a batch was read. */
+  bool has_read_;
+
+  /* Whether the last batch was read or a read failed. */
+  bool is_done_;
+
+  /* Keys and values of the last batch, which its views point into. */
+  string buffer_;
+};
+
+StorageCursor* MappedFileStorage::OpenCursor(const string& key_prefix) {
+  return new Cursor(this, key_prefix);
+}
+
+bool MappedFileStorage::ReadEntries(
+    const string& key_prefix, const string& start_key, bool inclusive,
+    int max_entries, string* buffer, vector<pair<size_t, size_t> >* sizes,
+    bool* is_last) {
+  MutexLock m(&lock_);
+  Index::iterator iter = inclusive ? index_.lower_bound(start_key) :
+      index_.upper_bound(start_key);
+  for (int i = 0; (i < max_entries) && (iter != index_.end()) &&
+           (iter->first.compare(0, key_prefix.size(), key_prefix) == 0);
+       ++i, ++iter) {
+    if (!IsValueValid(iter->second)) {
+      TLOG(logger_, SEVERE, "Corrupt value for key %s", iter->first.c_str());
+      return false;
+    }
+    const RecordLocation& location = iter->second;
+    buffer->append(iter->first);
+    buffer->append(
+        mapping_ + location.offset + location.size - location.value_size,
+        location.value_size);
+    sizes->push_back(make_pair(iter->first.size(), location.value_size));
+  }
+  *is_last = (iter == index_.end()) ||
+      (iter->first.compare(0, key_prefix.size(), key_prefix) != 0);
+  return true;
+}
+
+bool MappedFileStorage::OpenFile() {
+  fd_ = open(path_.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd_ < 0) {
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd_, &file_stat) != 0) {
+    CloseFile();
+    return false;
+  }
+  size_t file_size = file_stat.st_size;
+  if (file_size < kHeaderSize) {
+    file_size = config_.initial_file_size;
+    if (ftruncate(fd_, file_size) != 0) {
+      CloseFile();
+      return false;
+    }
+  }
+  if (!MapFile(file_size)) {
+    CloseFile();
+    return false;
+  }
+
+  // Only the last record can have been torn by a crash. If it was, read the
+  // file again without it.
+  RecordLocation last_record;
+  if (ScanRecords(mapped_size_, &last_record) && !IsValueValid(last_record)) {
+    TLOG(logger_, WARNING, "Dropping torn record at %d",
+         static_cast<int>(last_record.offset));
+    ScanRecords(last_record.offset, &last_record);
+  }
+  TLOG(logger_, INFO, "Opened storage file %s: %d keys, %d bytes of records",
+       path_.c_str(), static_cast<int>(index_.size()),
+       static_cast<int>(end_offset_));
+  return true;
+}
+
+void MappedFileStorage::CloseFile() {
+  if (mapping_ != NULL) {
+    munmap(mapping_, mapped_size_);
+    mapping_ = NULL;
+    mapped_size_ = 0;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  index_.clear();
+  end_offset_ = 0;
+  live_size_ = 0;
+}
+
+bool MappedFileStorage::MapFile(size_t size) {
+  if (mapping_ != NULL) {
+    munmap(mapping_, mapped_size_);
+    mapping_ = NULL;
+    mapped_size_ = 0;
+  }
+  void* mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd_, 0);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  mapping_ = static_cast<char*>(mapping);
+  mapped_size_ = size;
+  return true;
+}
+
+bool MappedFileStorage::ScanRecords(size_t limit,
+                                    RecordLocation* last_record) {
+  index_.clear();
+  live_size_ = 0;
+  size_t offset = 0;
+  bool found_record = false;
+  while (limit - offset >= kHeaderSize) {
+    const char* record = mapping_ + offset;
+    if (GetUint32(record + kMagicOffset) != kRecordMagic) {
+      break;
+    }
+    size_t key_size = GetUint32(record + kKeySizeOffset);
+    size_t value_size = GetUint32(record + kValueSizeOffset);
+    size_t available = limit - offset - kHeaderSize;
+    if ((key_size > available) || (value_size > available - key_size) ||
+        (GetUint32(record + kHeaderChecksumOffset) !=
+         GetHeaderChecksum(record, key_size))) {
+      break;
+    }
+    RecordLocation location;
+    location.offset = offset;
+    location.size = kHeaderSize + key_size + value_size;
+    location.value_size = value_size;
+    string key(record + kHeaderSize, key_size);
+    Index::iterator iter = index_.find(key);
+    if (iter != index_.end()) {
+      live_size_ -= iter->second.size;
+    }
+    if ((GetUint32(record + kFlagsOffset) & kDeletionFlag) != 0) {
+      if (iter != index_.end()) {
+        index_.erase(iter);
+      }
+    } else {
+      index_[key] = location;
+      live_size_ += location.size;
+    }
+    *last_record = location;
+    found_record = true;
+    offset += location.size;
+  }
+  end_offset_ = offset;
+  return found_record;
+}
+
+bool MappedFileStorage::IsValueValid(const RecordLocation& location) {
+  const char* record = mapping_ + location.offset;
+  return GetUint32(record + kValueChecksumOffset) ==
+      Checksum(record + location.size - location.value_size,
+               location.value_size, crc32(0, NULL, 0));
+}
+
+bool MappedFileStorage::AppendRecord(const string& key, const string& value,
+                                     bool is_deletion) {
+  if (fd_ < 0) {
+    return false;
+  }
+  string record(kHeaderSize, 0);
+  record.append(key);
+  record.append(value);
+  char* header = &record[0];
+  PutUint32(kRecordMagic, header + kMagicOffset);
+  PutUint32(is_deletion ? kDeletionFlag : 0, header + kFlagsOffset);
+  PutUint32(key.size(), header + kKeySizeOffset);
+  PutUint32(value.size(), header + kValueSizeOffset);
+  PutUint32(Checksum(value.data(), value.size(), crc32(0, NULL, 0)),
+            header + kValueChecksumOffset);
+  PutUint32(GetHeaderChecksum(header, key.size()),
+            header + kHeaderChecksumOffset);
+
+  // Grow the file by doubling so that it is rarely remapped.
+  size_t new_end_offset = end_offset_ + record.size();
+  if (new_end_offset > mapped_size_) {
+    size_t new_size = 2 * mapped_size_;
+    if (new_size < new_end_offset) {
+      new_size = new_end_offset;
+    }
+    if ((ftruncate(fd_, new_size) != 0) || !MapFile(new_size)) {
+      TLOG(logger_, SEVERE, "Could not grow storage file to %d bytes: %s",
+           static_cast<int>(new_size), strerror(errno));
+      return false;
+    }
+  }
+  if (!WriteFully(fd_, record.data(), record.size(), end_offset_)) {
+    TLOG(logger_, SEVERE, "Could not write to storage file: %s",
+         strerror(errno));
+    return false;
+  }
+
+  RecordLocation location;
+  location.offset = end_offset_;
+  location.size = record.size();
+  location.value_size = value.size();
+  end_offset_ = new_end_offset;
+  Index::iterator iter = index_.find(key);
+  if (iter != index_.end()) {
+    live_size_ -= iter->second.size;
+    if (is_deletion) {
+      index_.erase(iter);
+    }
+  }
+  if (!is_deletion) {
+    index_[key] = location;
+    live_size_ += location.size;
+  }
+
+  bool success = (config_.sync_policy != SYNC_EVERY_WRITE) ||
+      (fdatasync(fd_) == 0);
+
+  // The record is written either way: a failed compaction only leaves the
+  // superseded records in place until a later write compacts them.
+  if ((end_offset_ >= static_cast<size_t>(config_.min_compaction_size)) &&
+      (end_offset_ - live_size_ > live_size_) && !Compact()) {
+    TLOG(logger_, WARNING, "Compaction failed after writing %s; retrying on "
+         "a later write", key.c_str());
+  }
+  return success;
+}
+
+bool MappedFileStorage::Compact() {
+  TLOG(logger_, INFO, "Compacting storage file: %d of %d bytes live",
+       static_cast<int>(live_size_), static_cast<int>(end_offset_));
+
+  // Write the live records to a new file, then atomically rename it over the
+  // current one. Whether or not the rename survives a crash, one of the two
+  // complete files does.
+  string new_path = path_ + ".tmp";
+  int new_fd = open(new_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (new_fd < 0) {
+    TLOG(logger_, SEVERE, "Could not create %s: %s", new_path.c_str(),
+         strerror(errno));
+    return false;
+  }
+  size_t new_size = 2 * live_size_;
+  if (new_size < static_cast<size_t>(config_.initial_file_size)) {
+    new_size = config_.initial_file_size;
+  }
+  bool success = (ftruncate(new_fd, new_size) == 0);
+  size_t offset = 0;
+  for (Index::iterator iter = index_.begin();
+       success && (iter != index_.end()); ++iter) {
+    success = WriteFully(new_fd, mapping_ + iter->second.offset,
+                         iter->second.size, offset);
+    offset += iter->second.size;
+  }
+  success = success && (fdatasync(new_fd) == 0);
+  close(new_fd);
+  if (!success || (rename(new_path.c_str(), path_.c_str()) != 0)) {
+    TLOG(logger_, SEVERE, "Could not compact storage file: %s",
+         strerror(errno));
+    unlink(new_path.c_str());
+    return false;
+  }
+  CloseFile();
+  return OpenFile();
+}
+
+void MappedFileStorage::CompleteWrite(WriteKeyCallback* write_done,
+                                      DeleteKeyCallback* delete_done,
+                                      bool success) {
+  if (config_.sync_policy == SYNC_BATCHED) {
+    bool must_schedule_sync;
+    {
+      MutexLock m(&lock_);
+      must_schedule_sync = pending_writes_.empty();
+      pending_writes_.push_back(
+          PendingWrite(write_done, delete_done, success));
+    }
+    if (must_schedule_sync) {
+      scheduler_->Schedule(Scheduler::NoDelay(),
+                           new BatchedSyncTask(sync_task_state_));
+    }
+    return;
+  }
+  RunCallback(PendingWrite(write_done, delete_done, success), true);
+}
+
+void MappedFileStorage::RunCallback(const PendingWrite& write, bool success) {
+  success = success && write.success;
+  if (write.write_done != NULL) {
+    write.write_done->Run(success ? Status(Status::SUCCESS, "") :
+                          Status(Status::TRANSIENT_FAILURE, "Write failed"));
+    delete write.write_done;
+  } else {
+    write.delete_done->Run(success);
+    delete write.delete_done;
+  }
+}
+
+bool MappedFileStorage::SyncPendingWrites(
+    vector<PendingWrite>* pending_writes) {
+  MutexLock m(&lock_);
+  pending_writes->swap(pending_writes_);
+  return (fd_ >= 0) && (fdatasync(fd_) == 0);
+}
+
+}  // namespace invalidation
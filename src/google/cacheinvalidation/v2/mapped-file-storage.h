@@ -0,0 +1,286 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Storage over a memory-mapped, append-only file.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_MAPPED_FILE_STORAGE_H_
+#define GOOGLE_CACHEINVALIDATION_V2_MAPPED_FILE_STORAGE_H_
+
+#include <stddef.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/mutex.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
+#include "google/cacheinvalidation/v2/types.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* A Storage that keeps all the keys in one file, which it reads through a
+ * memory mapping.
+ *
+ * The file is a sequence of records, each holding a key and either its new
+ * value or a deletion mark; the last record for a key wins. Writes and
+ * deletions only ever append a record, so a crash can at worst leave a torn
+ * record at the end, which is detected by its checksum and ignored when the
+ * file is next opened: each write is either entirely there or not at all.
+ *
+ * Opening the file only reads the record headers and keys (and the value of the
+ * last record, the only one a crash can have torn), so it touches pages in
+ * proportion to the number of records rather than to the size of the values.
+ * The other values are checked when they are read. Values can be read without
+ * a copy with ReadKeyView.
+ *
+ * Once the superseded records take up more than half of the file, the live
+ * ones are copied to a new file, which atomically replaces the old one.
+ *
+ * May be called from any thread.
+ */
+class MappedFileStorage : public Storage {
+ public:
+  /* When the file is synced to disk. */
+  enum SyncPolicy {
+    /* Never explicitly: the operating system writes the data back eventually.
+     * Writes survive a crash of the process but not of the system.
+     */
+    SYNC_NEVER,
+
+    /* Before completing each write or deletion. */
+    SYNC_EVERY_WRITE,
+
+    /* Once for all the writes and deletions issued before a sync task runs on
+     * the scheduler, which completes them. Costs one sync per batch of writes
+     * rather than one per write.
+     */
+    SYNC_BATCHED
+  };
+
+  struct Config {
+    Config() : sync_policy(SYNC_EVERY_WRITE),
+               initial_file_size(64 * 1024),
+               min_compaction_size(64 * 1024) {}
+
+    /* When the file is synced to disk. */
+    SyncPolicy sync_policy;
+
+    /* Size to which a new file is extended. The file then grows by doubling,
+     * so that it need not be remapped on every write.
+     */
+    int initial_file_size;
+
+    /* Smallest amount of data in the file for which it is compacted. */
+    int min_compaction_size;
+  };
+
+  /* Creates a storage over the file at path, creating the file if it does not
+   * exist. scheduler runs the batched syncs, and must be given if the sync
+   * policy is SYNC_BATCHED. If the file cannot be opened, all the operations
+   * fail.
+   */
+  MappedFileStorage(const string& path, const Config& config,
+                    Scheduler* scheduler, Logger* logger);
+
+  /* Syncs the file if writes are waiting for a batched sync, without running
+   * their callbacks, and closes it. A sync task that the scheduler still
+   * holds does nothing once the storage is gone, so the scheduler may outlive
+   * the storage.
+   */
+  virtual ~MappedFileStorage();
+
+  /* Returns whether the file was opened. */
+  bool IsOpen() const {
+    return fd_ >= 0;
+  }
+
+  virtual void WriteKey(const string& key, const string& value,
+                        WriteKeyCallback* done);
+
+  virtual void ReadKey(const string& key, ReadKeyCallback* done);
+
+  virtual void DeleteKey(const string& key, DeleteKeyCallback* done);
+
+  /* Calls key_callback with each key, and a success status, then deletes it. */
+  virtual void ReadAllKeys(ReadAllKeysCallback* key_callback);
+
+  /* If key has a value, sets *data and *size to the value in the mapped file,
+   * without copying it, and returns true. The value stays valid until the next
+   * write or deletion.
+   */
+  bool ReadKeyView(const string& key, const char** data, size_t* size);
+
+  /* Returns a cursor that copies each batch into one buffer, rather than each
+   * key and value into its own string. The cursor must be deleted before the
+   * storage.
+   */
+  virtual StorageCursor* OpenCursor(const string& key_prefix);
+
+  /* Returns the size of the data in the file (i.e., of all its records). */
+  size_t GetDataSizeForTest() {
+    MutexLock m(&lock_);
+    return end_offset_;
+  }
+
+ private:
+  class BatchedSyncTask;
+  class Cursor;
+
+  /* Where the latest record for a key is in the file. */
+  struct RecordLocation {
+    size_t offset;
+    size_t size;
+    size_t value_size;
+  };
+
+  typedef map<string, RecordLocation> Index;
+
+  /* A write or deletion waiting for the batched sync, with the status of the
+   * write itself.
+   */
+  struct PendingWrite {
+    PendingWrite(WriteKeyCallback* write_done, DeleteKeyCallback* delete_done,
+                 bool success)
+        : write_done(write_done), delete_done(delete_done), success(success) {}
+
+    WriteKeyCallback* write_done;
+    DeleteKeyCallback* delete_done;
+    bool success;
+  };
+
+  /* State shared by the storage and the batched sync tasks it scheduled,
+   * which the scheduler may hold, and run, after the storage is destroyed.
+   */
+  struct SyncTaskState {
+    explicit SyncTaskState(MappedFileStorage* sync_storage)
+        : storage(sync_storage), num_tasks(0) {}
+
+    /* Protects the fields below. Held while a task syncs, so that the storage
+     * is not destroyed meanwhile, and acquired before the lock_ of storage.
+     */
+    Mutex lock;
+
+    /* The storage, or NULL once it is destroyed. */
+    MappedFileStorage* storage;
+
+    /* Number of sync tasks that the scheduler holds. The last one deletes
+     * the state once the storage is gone.
+     */
+    int num_tasks;
+  };
+
+  /* Opens the file at path_ and maps it, then reads its records into
+   * index_. Returns false, leaving no file open, on failure.
+   */
+  bool OpenFile();
+
+  /* Unmaps and closes the file. */
+  void CloseFile();
+
+  /* (Re)maps the first size bytes of the file. */
+  bool MapFile(size_t size);
+
+  /* Reads the records in the first limit bytes of the mapped file into
+   * index_, up to the first invalid one, and sets end_offset_ after the last
+   * valid one. Returns whether there was a valid record, setting *last_record
+   * to the location of the last one if so.
+   */
+  bool ScanRecords(size_t limit, RecordLocation* last_record);
+
+  /* Returns whether the value of the record at location has a valid checksum.
+   */
+  bool IsValueValid(const RecordLocation& location);
+
+  /* Appends to buffer the keys after start_key (or from it, if inclusive)
+   * that start with key_prefix, up to max_entries of them, each followed by
+   * its value, and appends the sizes of each key and value to sizes. Sets
+   * *is_last to whether no such keys remain. Returns false if a value is
+   * corrupt.
+   */
+  bool ReadEntries(const string& key_prefix, const string& start_key,
+                   bool inclusive, int max_entries, string* buffer,
+                   vector<pair<size_t, size_t> >* sizes, bool* is_last);
+
+  /* Appends a record for key, with value or a deletion mark, and updates the
+   * index. Compacts the file if needed. Returns whether the record was written
+   * (and, if the policy is SYNC_EVERY_WRITE, synced).
+   */
+  bool AppendRecord(const string& key, const string& value, bool is_deletion);
+
+  /* Copies the live records to a new file that replaces the current one. */
+  bool Compact();
+
+  /* Completes a write or deletion whose record was appended (if success) or
+   * not. Exactly one of write_done and delete_done is not NULL.
+   */
+  void CompleteWrite(WriteKeyCallback* write_done,
+                     DeleteKeyCallback* delete_done, bool success);
+
+  /* Runs and deletes the callback of write, passing whether it succeeded. */
+  static void RunCallback(const PendingWrite& write, bool success);
+
+  /* Moves the writes waiting for the batched sync to pending_writes and syncs
+   * the file. Returns whether the sync succeeded.
+   */
+  bool SyncPendingWrites(vector<PendingWrite>* pending_writes);
+
+  /* Path of the file. */
+  string path_;
+
+  const Config config_;
+
+  /* Scheduler for the batched syncs (if any). */
+  Scheduler* scheduler_;
+
+  /* If the sync policy is SYNC_BATCHED, the state shared with the sync tasks.
+   * Owned by the storage, unless the scheduler still holds tasks when the
+   * storage is destroyed.
+   */
+  SyncTaskState* sync_task_state_;
+
+  Logger* logger_;
+
+  /* Protects all the fields below. */
+  Mutex lock_;
+
+  /* Descriptor of the file, or -1 if it is not open. */
+  int fd_;
+
+  /* Mapping of the file and its size, which is that of the file. */
+  char* mapping_;
+  size_t mapped_size_;
+
+  /* Offset after the last record. */
+  size_t end_offset_;
+
+  /* Total size of the records in index_. */
+  size_t live_size_;
+
+  /* Location of the latest record of each key that has a value. */
+  Index index_;
+
+  /* Writes waiting for the batched sync. */
+  vector<PendingWrite> pending_writes_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_MAPPED_FILE_STORAGE_H_
@@ -0,0 +1,110 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Helpers to approximate the heap memory held by the Ticl's containers and
+// protocol buffers, for InvalidationClientImpl::GetMemoryUsage. The estimates
+// ignore allocator overhead and count short strings as if they were on the
+// heap, so they are meant for comparing configurations and catching
+// regressions, not for exact accounting.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_MEMORY_USAGE_H_
+#define GOOGLE_CACHEINVALIDATION_V2_MEMORY_USAGE_H_
+
+#include <stddef.h>
+
+#include <map>
+#include <string>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::string;
+
+class MemoryUsage {
+ public:
+  /* Bytes of bookkeeping per node of a map or set: the color and the three
+   * links of a red-black tree node.
+   */
+  static const size_t kTreeNodeOverhead = 4 * sizeof(void*);
+
+  /* Returns the heap bytes held by value. */
+  static size_t StringBytes(const string& value) {
+    return value.capacity();
+  }
+
+  /* Returns the heap bytes held by a string field of a protocol buffer, which
+   * is allocated separately from the message.
+   */
+  static size_t StringFieldBytes(const string& value) {
+    return sizeof(string) + value.capacity();
+  }
+
+  /* Returns the heap bytes held by object_id, not counting
+   * sizeof(ObjectIdP).
+   */
+  static size_t ObjectIdBytes(const ObjectIdP& object_id) {
+    return StringFieldBytes(object_id.name());
+  }
+
+  /* Returns the heap bytes held by invalidation, not counting
+   * sizeof(InvalidationP).
+   */
+  static size_t InvalidationBytes(const InvalidationP& invalidation) {
+    size_t bytes = sizeof(ObjectIdP) + ObjectIdBytes(invalidation.object_id());
+    if (invalidation.has_payload()) {
+      bytes += StringFieldBytes(invalidation.payload());
+    }
+    return bytes;
+  }
+
+  /* Returns the heap bytes held by subtree, not counting
+   * sizeof(RegistrationSubtree).
+   */
+  static size_t SubtreeBytes(const RegistrationSubtree& subtree) {
+    size_t bytes = StringFieldBytes(subtree.digest_prefix()) +
+        subtree.registered_object_size() * (sizeof(void*) + sizeof(ObjectIdP));
+    for (int i = 0; i < subtree.registered_object_size(); ++i) {
+      bytes += ObjectIdBytes(subtree.registered_object(i));
+    }
+    return bytes;
+  }
+
+  /* Returns the heap bytes held by the nodes of container, a map or set,
+   * not counting what the entries themselves point to.
+   */
+  template <typename Container>
+  static size_t TreeNodeBytes(const Container& container) {
+    return container.size() *
+        (kTreeNodeOverhead + sizeof(typename Container::value_type));
+  }
+
+  /* Returns the heap bytes held by objects, a map from object digests to
+   * object ids as kept by the registration stores.
+   */
+  static size_t DigestMapBytes(const map<string, ObjectIdP>& objects) {
+    size_t bytes = TreeNodeBytes(objects);
+    for (map<string, ObjectIdP>::const_iterator iter = objects.begin();
+         iter != objects.end(); ++iter) {
+      bytes += StringBytes(iter->first) + ObjectIdBytes(iter->second);
+    }
+    return bytes;
+  }
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_MEMORY_USAGE_H_
@@ -0,0 +1,354 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Merkle-trie-based implementation of DigestStore.
+
+#include "google/cacheinvalidation/v2/merkle-trie-registration-store.h"
+
+#include <algorithm>
+
+#include "google/cacheinvalidation/v2/logging.h"
+#include "google/cacheinvalidation/v2/memory-usage.h"
+#include "google/cacheinvalidation/v2/object-id-digest-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+using INVALIDATION_STL_NAMESPACE::min;
+using INVALIDATION_STL_NAMESPACE::sort;
+
+/* Orders pointed-to strings lexicographically. */
+static bool CompareStringPointers(const string* a, const string* b) {
+  return *a < *b;
+}
+
+MerkleTrieRegistrationStore::MerkleTrieRegistrationStore(
+    DigestFunction* digest_function, int levels)
+    : digest_function_(digest_function),
+      digest_cache_(digest_function),
+      levels_(levels),
+      num_registrations_(0),
+      is_summary_digest_stale_(true) {
+  // Each level consumes one bit of the object digest; keep the tree to a sane
+  // size.
+  CHECK((levels >= 0) && (levels <= 20)) << "Bad number of levels: " << levels;
+  int num_buckets = 1 << levels;
+  buckets_.resize(num_buckets);
+  digests_.resize(2 * num_buckets - 1);
+  RecomputeAllDigests();
+}
+
+void MerkleTrieRegistrationStore::Add(const ObjectIdP& oid) {
+  int bucket_number = AddToBucket(oid);
+  if (bucket_number >= 0) {
+    RecomputePathsFromBuckets(vector<int>(1, bucket_number));
+  }
+}
+
+void MerkleTrieRegistrationStore::Add(const vector<ObjectIdP>& oids) {
+  digest_cache_.CacheDigests(oids);
+  AddCached(oids);
+}
+
+void MerkleTrieRegistrationStore::AddWithDigests(
+    const vector<ObjectIdP>& oids, const vector<string>& digests) {
+  digest_cache_.CacheDigests(oids, digests);
+  AddCached(oids);
+}
+
+void MerkleTrieRegistrationStore::AddCached(const vector<ObjectIdP>& oids) {
+  vector<int> changed_buckets;
+  for (size_t i = 0; i < oids.size(); ++i) {
+    int bucket_number = AddToBucket(oids[i]);
+    if (bucket_number >= 0) {
+      changed_buckets.push_back(bucket_number);
+    }
+  }
+  RecomputePathsFromBuckets(changed_buckets);
+}
+
+void MerkleTrieRegistrationStore::Remove(const ObjectIdP& oid) {
+  int bucket_number = RemoveFromBucket(oid);
+  if (bucket_number >= 0) {
+    RecomputePathsFromBuckets(vector<int>(1, bucket_number));
+  }
+}
+
+void MerkleTrieRegistrationStore::Remove(const vector<ObjectIdP>& oids) {
+  vector<int> changed_buckets;
+  for (size_t i = 0; i < oids.size(); ++i) {
+    int bucket_number = RemoveFromBucket(oids[i]);
+    if (bucket_number >= 0) {
+      changed_buckets.push_back(bucket_number);
+    }
+  }
+  RecomputePathsFromBuckets(changed_buckets);
+}
+
+void MerkleTrieRegistrationStore::RemoveAll(vector<ObjectIdP>* oids) {
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    for (Bucket::const_iterator iter = buckets_[i].begin();
+         iter != buckets_[i].end(); ++iter) {
+      oids->push_back(iter->second);
+    }
+    buckets_[i].clear();
+  }
+  num_registrations_ = 0;
+  digest_cache_.Clear();
+  RecomputeAllDigests();
+}
+
+bool MerkleTrieRegistrationStore::Contains(const ObjectIdP& oid) {
+  return digest_cache_.Find(oid) != NULL;
+}
+
+string MerkleTrieRegistrationStore::GetDigest() {
+  if (is_summary_digest_stale_) {
+    // The summary digest is over all the object digests in sorted order, and
+    // the buckets split the digests on their low-order bits, so gather and
+    // sort them first.
+    vector<const string*> oid_digests;
+    oid_digests.reserve(num_registrations_);
+    for (size_t i = 0; i < buckets_.size(); ++i) {
+      for (Bucket::const_iterator iter = buckets_[i].begin();
+           iter != buckets_[i].end(); ++iter) {
+        oid_digests.push_back(&iter->first);
+      }
+    }
+    summary_digest_ = ComputeSortedDigest(&oid_digests);
+    is_summary_digest_stale_ = false;
+  }
+  return summary_digest_;
+}
+
+string MerkleTrieRegistrationStore::GetDigestForPrefix(
+    const string& oid_digest_prefix, int prefix_len, int* num_elements) {
+  int first_bucket, num_buckets;
+  GetBucketRange(oid_digest_prefix, prefix_len, &first_bucket, &num_buckets);
+  if (prefix_len == levels_) {
+    // Exactly one bucket, whose digest is already known.
+    *num_elements = buckets_[first_bucket].size();
+    return digests_[DigestIndexForBucket(first_bucket)];
+  }
+  vector<const string*> oid_digests;
+  for (int i = first_bucket; i < first_bucket + num_buckets; ++i) {
+    for (Bucket::const_iterator iter = buckets_[i].begin();
+         iter != buckets_[i].end(); ++iter) {
+      if ((prefix_len < levels_) ||
+          ObjectIdDigestUtils::MatchesPrefix(
+              iter->first, oid_digest_prefix, prefix_len)) {
+        oid_digests.push_back(&iter->first);
+      }
+    }
+  }
+  *num_elements = oid_digests.size();
+  return ComputeSortedDigest(&oid_digests);
+}
+
+void MerkleTrieRegistrationStore::GetElements(
+    const string& oid_digest_prefix, int prefix_len,
+    vector<ObjectIdP>* result) {
+  int first_bucket, num_buckets;
+  GetBucketRange(oid_digest_prefix, prefix_len, &first_bucket, &num_buckets);
+
+  // If the prefix is longer than the trie is deep, the remaining bits have to
+  // be checked against each object in the (single) bucket.
+  bool must_filter = prefix_len > levels_;
+  for (int i = first_bucket; i < first_bucket + num_buckets; ++i) {
+    for (Bucket::const_iterator iter = buckets_[i].begin();
+         iter != buckets_[i].end(); ++iter) {
+      if (!must_filter ||
+          ObjectIdDigestUtils::MatchesPrefix(
+              iter->first, oid_digest_prefix, prefix_len)) {
+        result->push_back(iter->second);
+      }
+    }
+  }
+}
+
+string MerkleTrieRegistrationStore::GetSubtreeDigest(
+    const string& digest_prefix, int prefix_len) {
+  CHECK((prefix_len >= 0) && (prefix_len <= levels_));
+  CHECK(prefix_len <= static_cast<int>(8 * digest_prefix.size()));
+  return digests_[GetNodeIndex(digest_prefix, prefix_len)];
+}
+
+size_t MerkleTrieRegistrationStore::GetAllocatedBytes() const {
+  size_t bytes = buckets_.capacity() * sizeof(Bucket) +
+      digests_.capacity() * sizeof(string) +
+      digest_cache_.GetAllocatedBytes() +
+      MemoryUsage::StringBytes(summary_digest_);
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    bytes += MemoryUsage::DigestMapBytes(buckets_[i]);
+  }
+  for (size_t i = 0; i < digests_.size(); ++i) {
+    bytes += MemoryUsage::StringBytes(digests_[i]);
+  }
+  return bytes;
+}
+
+bool MerkleTrieRegistrationStore::CheckRepForTest() {
+  int total = 0;
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    total += buckets_[i].size();
+    for (Bucket::const_iterator iter = buckets_[i].begin();
+         iter != buckets_[i].end(); ++iter) {
+      if (GetBucketNumber(iter->first) != static_cast<int>(i)) {
+        return false;
+      }
+    }
+    string digest;
+    ComputeBucketDigest(i, &digest);
+    if (digests_[DigestIndexForBucket(i)] != digest) {
+      return false;
+    }
+  }
+  for (int i = 0; i < DigestIndexForBucket(0); ++i) {
+    string digest;
+    ComputeInteriorDigest(i, &digest);
+    if (digests_[i] != digest) {
+      return false;
+    }
+  }
+  return (total == num_registrations_) &&
+      (digest_cache_.size() == num_registrations_);
+}
+
+void MerkleTrieRegistrationStore::GetBucketRange(
+    const string& digest_prefix, int prefix_len, int* first_bucket,
+    int* num_buckets) {
+  CHECK(prefix_len >= 0);
+  CHECK(prefix_len <= static_cast<int>(8 * digest_prefix.size())) <<
+      "Prefix length " << prefix_len << " exceeds prefix";
+
+  // Find the subtree whose buckets hold the objects with the prefix. Its
+  // buckets are contiguous at the bottom of the tree.
+  int depth = min(prefix_len, levels_);
+  int first_index = GetNodeIndex(digest_prefix, depth);
+  for (int i = depth; i < levels_; ++i) {
+    first_index = 2 * first_index + 1;
+  }
+  *first_bucket = first_index - DigestIndexForBucket(0);
+  *num_buckets = 1 << (levels_ - depth);
+}
+
+string MerkleTrieRegistrationStore::ComputeSortedDigest(
+    vector<const string*>* oid_digests) {
+  sort(oid_digests->begin(), oid_digests->end(), CompareStringPointers);
+  digest_function_->Reset();
+  for (size_t i = 0; i < oid_digests->size(); ++i) {
+    digest_function_->Update(*(*oid_digests)[i]);
+  }
+  return digest_function_->GetDigest();
+}
+
+int MerkleTrieRegistrationStore::GetNodeIndex(
+    const string& digest, int depth) {
+  int node_index = 0;
+  for (int i = 0; i < depth; ++i) {
+    node_index = 2 * node_index + 1 + ObjectIdDigestUtils::GetBit(digest, i);
+  }
+  return node_index;
+}
+
+int MerkleTrieRegistrationStore::AddToBucket(const ObjectIdP& oid) {
+  const string& oid_digest = digest_cache_.GetDigest(oid);
+  int bucket_number = GetBucketNumber(oid_digest);
+  Bucket& bucket = buckets_[bucket_number];
+  if (!bucket.insert(make_pair(oid_digest, oid)).second) {
+    return -1;
+  }
+  ++num_registrations_;
+  return bucket_number;
+}
+
+int MerkleTrieRegistrationStore::RemoveFromBucket(const ObjectIdP& oid) {
+  // Objects without a cached digest are not in the trie.
+  const string* oid_digest = digest_cache_.Find(oid);
+  if (oid_digest == NULL) {
+    return -1;
+  }
+  int bucket_number = GetBucketNumber(*oid_digest);
+  buckets_[bucket_number].erase(*oid_digest);
+  digest_cache_.Erase(oid);
+  --num_registrations_;
+  return bucket_number;
+}
+
+void MerkleTrieRegistrationStore::ComputeBucketDigest(
+    int bucket_number, string* digest) {
+  const Bucket& bucket = buckets_[bucket_number];
+  digest_function_->Reset();
+  for (Bucket::const_iterator iter = bucket.begin(); iter != bucket.end();
+       ++iter) {
+    digest_function_->Update(iter->first);
+  }
+  StoreDigest(digest);
+}
+
+void MerkleTrieRegistrationStore::ComputeInteriorDigest(
+    int node_index, string* digest) {
+  digest_function_->Reset();
+  digest_function_->Update(digests_[2 * node_index + 1]);
+  digest_function_->Update(digests_[2 * node_index + 2]);
+  StoreDigest(digest);
+}
+
+void MerkleTrieRegistrationStore::StoreDigest(string* digest) {
+  // Digests are all the same size, so this reuses digest's buffer.
+  char buffer[DigestFunction::kMaxDigestSize];
+  int size = digest_function_->GetDigest(buffer, sizeof(buffer));
+  digest->assign(buffer, size);
+}
+
+void MerkleTrieRegistrationStore::RecomputePathsFromBuckets(
+    const vector<int>& bucket_numbers) {
+  if (bucket_numbers.empty()) {
+    return;
+  }
+  is_summary_digest_stale_ = true;
+
+  // Recompute the changed buckets and mark their ancestors. A parent always has
+  // a smaller index than its children, so a single downward sweep over the
+  // marked nodes recomputes each of them after its children.
+  vector<bool> is_dirty(DigestIndexForBucket(0), false);
+  for (size_t i = 0; i < bucket_numbers.size(); ++i) {
+    int node_index = DigestIndexForBucket(bucket_numbers[i]);
+    ComputeBucketDigest(bucket_numbers[i], &digests_[node_index]);
+    while (node_index > 0) {
+      node_index = (node_index - 1) / 2;
+      if (is_dirty[node_index]) {
+        break;  // The rest of the path is already marked.
+      }
+      is_dirty[node_index] = true;
+    }
+  }
+  for (int i = static_cast<int>(is_dirty.size()) - 1; i >= 0; --i) {
+    if (is_dirty[i]) {
+      ComputeInteriorDigest(i, &digests_[i]);
+    }
+  }
+}
+
+void MerkleTrieRegistrationStore::RecomputeAllDigests() {
+  is_summary_digest_stale_ = true;
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    ComputeBucketDigest(i, &digests_[DigestIndexForBucket(i)]);
+  }
+  for (int i = DigestIndexForBucket(0) - 1; i >= 0; --i) {
+    ComputeInteriorDigest(i, &digests_[i]);
+  }
+}
+
+}  // namespace invalidation
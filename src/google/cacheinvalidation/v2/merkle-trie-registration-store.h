@@ -0,0 +1,216 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Merkle-trie-based implementation of DigestStore. The trie is indexed on 0 and
+// 1 only, so it is a binary tree as well and we use trie and tree
+// interchangeably.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_MERKLE_TRIE_REGISTRATION_STORE_H_
+#define GOOGLE_CACHEINVALIDATION_V2_MERKLE_TRIE_REGISTRATION_STORE_H_
+
+#include <map>
+#include <vector>
+
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/digest-function.h"
+#include "google/cacheinvalidation/v2/digest-store.h"
+#include "google/cacheinvalidation/v2/object-id-digest-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Implementation notes: the trie is a complete binary tree, i.e., all nodes
+ * exist at every level including the leaves. It is stored in an array such
+ * that the children of node i are at 2i+1 (bit 0) and 2i+2 (bit 1). A node at
+ * depth d branches on bit d of the object digest, where bits are numbered from
+ * the LSB of byte 0 upwards (the same order as the Java MerkleTrie). Hence the
+ * node for a digest prefix of k bits (k <= levels) is found by walking k steps
+ * from the root, and its subtree holds exactly the objects with that prefix.
+ *
+ * Every node at the bottom of the tree has a bucket with the actual object
+ * ids. The digest of a bucket is the digest over its (sorted) object digests
+ * and the digest of an interior node is the digest of the concatenation of its
+ * children's digests. These are kept up to date on every change by
+ * recomputing only the paths from the affected buckets to the root.
+ *
+ * GetDigest() returns the digest that the server expects in the registration
+ * summary, i.e., the digest over all the sorted object digests. It is computed
+ * lazily and memoized until the next change to the store.
+ */
+class MerkleTrieRegistrationStore : public DigestStore<ObjectIdP> {
+ public:
+  /* Constructs an empty trie with levels levels (a trie with only a root node
+   * has levels == 0) that uses digest_function to compute digests.
+   */
+  MerkleTrieRegistrationStore(DigestFunction* digest_function, int levels);
+
+  virtual ~MerkleTrieRegistrationStore() {}
+
+  virtual void Add(const ObjectIdP& oid);
+
+  virtual void Add(const vector<ObjectIdP>& oids);
+
+  virtual void AddWithDigests(const vector<ObjectIdP>& oids,
+                              const vector<string>& digests);
+
+  virtual void Remove(const ObjectIdP& oid);
+
+  virtual void Remove(const vector<ObjectIdP>& oids);
+
+  virtual void RemoveAll(vector<ObjectIdP>* oids);
+
+  virtual bool Contains(const ObjectIdP& oid);
+
+  virtual int size() {
+    return num_registrations_;
+  }
+
+  virtual string GetDigest();
+
+  virtual string GetDigestForPrefix(const string& oid_digest_prefix,
+                                    int prefix_len, int* num_elements);
+
+  /* Stores in result exactly the objects whose digests begin with the first
+   * prefix_len bits of oid_digest_prefix.
+   */
+  virtual void GetElements(const string& oid_digest_prefix, int prefix_len,
+                           vector<ObjectIdP>* result);
+
+  /* Returns the digest of the trie node covering all objects whose digests
+   * begin with the first prefix_len bits of digest_prefix.
+   *
+   * REQUIRES: prefix_len <= levels.
+   */
+  string GetSubtreeDigest(const string& digest_prefix, int prefix_len);
+
+  int levels() {
+    return levels_;
+  }
+
+  virtual size_t GetAllocatedBytes() const;
+
+  virtual string ToString() {
+    return StringPrintf(
+        "MerkleTrieRegistrationStore: %d registrations, %d levels",
+        num_registrations_, levels_);
+  }
+
+  /* Returns whether the memoized trie digests match the buckets. This is an
+   * *expensive* method.
+   */
+  bool CheckRepForTest();
+
+ private:
+  /* Leaves in a bucket, keyed by the object digest. */
+  typedef map<string, ObjectIdP> Bucket;
+
+  /* Returns the index of the node reached from the root by following the first
+   * depth bits of digest.
+   */
+  int GetNodeIndex(const string& digest, int depth);
+
+  /* Stores in first_bucket and num_buckets the range of buckets holding the
+   * objects whose digests begin with the first prefix_len bits of
+   * digest_prefix. If prefix_len > levels, the single bucket may also hold
+   * other objects.
+   */
+  void GetBucketRange(const string& digest_prefix, int prefix_len,
+                      int* first_bucket, int* num_buckets);
+
+  /* Sorts oid_digests and returns the digest over them in that order. */
+  string ComputeSortedDigest(vector<const string*>* oid_digests);
+
+  /* Returns the index in digests_ of the node for bucket bucket_number. */
+  int DigestIndexForBucket(int bucket_number) {
+    return bucket_number + static_cast<int>(buckets_.size()) - 1;
+  }
+
+  /* Returns the bucket number for the object with digest oid_digest. */
+  int GetBucketNumber(const string& oid_digest) {
+    return GetNodeIndex(oid_digest, levels_) -
+        (static_cast<int>(buckets_.size()) - 1);
+  }
+
+  /* Adds oid to its bucket and returns the bucket number if it was not present
+   * (-1 otherwise). Does not recompute any digests.
+   */
+  int AddToBucket(const ObjectIdP& oid);
+
+  /* Adds oids, whose digests are cached, and recomputes the digests of the
+   * paths to the buckets that changed.
+   */
+  void AddCached(const vector<ObjectIdP>& oids);
+
+  /* Removes oid from its bucket and returns the bucket number if it was present
+   * (-1 otherwise). Does not recompute any digests.
+   */
+  int RemoveFromBucket(const ObjectIdP& oid);
+
+  /* Stores in digest the digest over the object digests in bucket
+   * bucket_number. The buckets are sorted by digest, so this is also the digest
+   * of the range of objects with the bucket's prefix.
+   */
+  void ComputeBucketDigest(int bucket_number, string* digest);
+
+  /* Stores in digest the digest of the concatenation of the digests of the
+   * children of node_index.
+   */
+  void ComputeInteriorDigest(int node_index, string* digest);
+
+  /* Stores in digest the digest computed by digest_function_. */
+  void StoreDigest(string* digest);
+
+  /* Recomputes the digests of the buckets in bucket_numbers and of every node
+   * on their paths to the root. Each affected node is recomputed only once.
+   */
+  void RecomputePathsFromBuckets(const vector<int>& bucket_numbers);
+
+  /* Recomputes the digests of all the nodes in the trie. */
+  void RecomputeAllDigests();
+
+  /* The function used to compute digests of objects. */
+  DigestFunction* digest_function_;
+
+  /* The digests of the objects in the trie, so that each object is hashed only
+   * once while it is in the trie.
+   */
+  ObjectIdDigestCache digest_cache_;
+
+  /* The number of levels in this tree. A tree with one node has levels == 0. */
+  int levels_;
+
+  /* The total number of objects in all the buckets. */
+  int num_registrations_;
+
+  /* The buckets at the bottom of the tree. The size is always 2^levels. */
+  vector<Bucket> buckets_;
+
+  /* The digests of all the nodes in the tree. The size is always
+   * 2^(levels+1) - 1.
+   */
+  vector<string> digests_;
+
+  /* Whether summary_digest_ must be recomputed before being returned. */
+  bool is_summary_digest_stale_;
+
+  /* The memoized digest over all the object digests in the trie. */
+  string summary_digest_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_MERKLE_TRIE_REGISTRATION_STORE_H_
@@ -0,0 +1,53 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Lock-free queues into which many threads push and one thread drains.
+
+#include "google/cacheinvalidation/v2/mpsc-queue.h"
+
+#include "google/cacheinvalidation/v2/pooled-callback.h"
+
+namespace invalidation {
+
+SubmissionQueue::~SubmissionQueue() {
+  MpscQueue<Closure*>::Node* nodes = queue_.TakeAll();
+  for (MpscQueue<Closure*>::Node* node = nodes; node != NULL;
+       node = node->next) {
+    delete node->value;
+  }
+  MpscQueue<Closure*>::DeleteNodes(nodes);
+}
+
+void SubmissionQueue::Submit(Closure* task) {
+  MpscQueue<Closure*>::Node* node = queue_.NewNode();
+  node->value = task;
+  if (queue_.Push(node)) {
+    scheduler_->Schedule(Scheduler::NoDelay(), NewPooledCallback(
+        this, &SubmissionQueue::RunSubmittedTasks));
+  }
+}
+
+void SubmissionQueue::RunSubmittedTasks() {
+  // Tasks submitted from now on find the queue empty and schedule another
+  // run.
+  MpscQueue<Closure*>::Node* nodes = queue_.TakeAll();
+  for (MpscQueue<Closure*>::Node* node = nodes; node != NULL;
+       node = node->next) {
+    node->value->Run();
+    delete node->value;
+  }
+  queue_.RecycleNodes(nodes);
+}
+
+}  // namespace invalidation
@@ -0,0 +1,188 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Lock-free queues into which many threads push and one thread drains.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_MPSC_QUEUE_H_
+#define GOOGLE_CACHEINVALIDATION_V2_MPSC_QUEUE_H_
+
+#include <cstddef>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
+
+namespace invalidation {
+
+/* A multi-producer, single-consumer queue of values of type T. Any thread may
+ * push without taking a lock; the consumer takes all the pushed values at
+ * once, in the order in which they were pushed by each thread.
+ *
+ * The pushed nodes form a stack whose head is swapped in with a
+ * compare-and-swap. The consumer only ever takes the whole stack, which it
+ * then reverses, so nodes are never popped one at a time and the stack is not
+ * subject to the ABA problem.
+ *
+ * The consumer hands the nodes it is done with back to the queue, which keeps
+ * a few of them in slots that producers take them from with an atomic
+ * exchange, so that pushing does not allocate once the queue is warm.
+ */
+template <class T>
+class MpscQueue {
+ public:
+  /* A value in the queue. */
+  struct Node {
+    Node() : next(NULL) {}
+
+    T value;
+    Node* next;
+  };
+
+  /* Number of nodes kept for reuse. */
+  static const int kNumSpareNodes = 4;
+
+  MpscQueue() : head_(NULL) {
+    for (int i = 0; i < kNumSpareNodes; ++i) {
+      spare_nodes_[i] = NULL;
+    }
+  }
+
+  /* Deletes the nodes still in the queue and the ones kept for reuse. */
+  ~MpscQueue() {
+    DeleteNodes(TakeAll());
+    for (int i = 0; i < kNumSpareNodes; ++i) {
+      delete spare_nodes_[i];
+    }
+  }
+
+  /* Returns a node to push, owned by the caller. It is one that the consumer
+   * handed back if any, with the value the consumer left in it, or else a new
+   * one.
+   */
+  Node* NewNode() {
+    // The consumer fills the slots from the first, so that is usually where
+    // a spare node is.
+    for (int i = 0; i < kNumSpareNodes; ++i) {
+      Node* node = __sync_lock_test_and_set(&spare_nodes_[i],
+                                            static_cast<Node*>(NULL));
+      if (node != NULL) {
+        node->next = NULL;
+        return node;
+      }
+    }
+    return new Node();
+  }
+
+  /* Pushes node, of which the queue takes ownership until it is taken. Returns
+   * whether the queue was empty, i.e., whether the consumer should be woken.
+   */
+  bool Push(Node* node) {
+    // Guess that the queue is empty; a wrong guess costs one more
+    // compare-and-swap, which returns the actual head.
+    Node* head = NULL;
+    while (true) {
+      node->next = head;
+      Node* old_head = __sync_val_compare_and_swap(&head_, head, node);
+      if (old_head == head) {
+        return head == NULL;
+      }
+      head = old_head;
+    }
+  }
+
+  /* Takes all the nodes in the queue and returns the oldest one, linked to the
+   * others through next (NULL if the queue was empty). The caller owns the
+   * nodes. Must only be called by the consumer.
+   */
+  Node* TakeAll() {
+    Node* node = __sync_lock_test_and_set(&head_, static_cast<Node*>(NULL));
+    Node* reversed = NULL;
+    while (node != NULL) {
+      Node* next = node->next;
+      node->next = reversed;
+      reversed = node;
+      node = next;
+    }
+    return reversed;
+  }
+
+  /* Takes back node and the ones linked to it, as taken by TakeAll, keeping
+   * them for NewNode while there are free slots and deleting the others. Must
+   * only be called by the consumer.
+   */
+  void RecycleNodes(Node* node) {
+    int slot = 0;
+    while (node != NULL) {
+      Node* next = node->next;
+      while ((slot < kNumSpareNodes) && !__sync_bool_compare_and_swap(
+                 &spare_nodes_[slot], static_cast<Node*>(NULL), node)) {
+        ++slot;
+      }
+      if (slot == kNumSpareNodes) {
+        delete node;
+      }
+      node = next;
+    }
+  }
+
+  /* Deletes node and the ones linked to it. */
+  static void DeleteNodes(Node* node) {
+    while (node != NULL) {
+      Node* next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+
+ private:
+  /* The most recently pushed node. */
+  Node* volatile head_;
+
+  /* Nodes handed back by the consumer, or NULL. */
+  Node* volatile spare_nodes_[kNumSpareNodes];
+};
+
+/* Runs tasks submitted from any thread on a scheduler (e.g., the internal
+ * scheduler of a client). Submitting a task only pushes it into an MpscQueue,
+ * on a node that the queue recycles;
+ * a single scheduler task is scheduled when the queue becomes non-empty, and
+ * runs all the tasks submitted until it runs. Application and network threads
+ * that submit operations thus neither contend on a lock nor cost a scheduler
+ * task each.
+ */
+class SubmissionQueue {
+ public:
+  explicit SubmissionQueue(Scheduler* scheduler) : scheduler_(scheduler) {}
+
+  /* Deletes the tasks that have not run. */
+  ~SubmissionQueue();
+
+  /* Queues task to run on the scheduler, after the tasks submitted before it
+   * by the calling thread. Takes ownership of task.
+   */
+  void Submit(Closure* task);
+
+ private:
+  /* Runs and deletes the submitted tasks. */
+  void RunSubmittedTasks();
+
+  /* The scheduler on which the tasks run. */
+  Scheduler* scheduler_;
+
+  /* The submitted tasks. Owned. */
+  MpscQueue<Closure*> queue_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_MPSC_QUEUE_H_
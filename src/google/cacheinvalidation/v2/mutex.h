@@ -19,6 +19,7 @@
 
 namespace invalidation {
 
+using ::CondVar;
 using ::Mutex;
 using ::MutexLock;
 }  // invalidation
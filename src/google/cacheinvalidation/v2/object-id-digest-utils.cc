@@ -16,23 +16,112 @@
 
 #include "google/cacheinvalidation/v2/object-id-digest-utils.h"
 
+#include "google/cacheinvalidation/v2/logging.h"
+#include "google/cacheinvalidation/v2/memory-usage.h"
+
 namespace invalidation {
 
-string ObjectIdDigestUtils::GetDigest(
-    const ObjectIdP& object_id, DigestFunction* digest_fn) {
-  digest_fn->Reset();
-  int source = object_id.source();
-  string buffer(4, 0);
+using INVALIDATION_STL_NAMESPACE::make_pair;
 
-  // Little endian number for type followed by bytes.
+/* Stores in buffer[0..4) the little endian number for the source of
+ * object_id.
+ */
+static void EncodeSource(const ObjectIdP& object_id, char* buffer) {
+  int source = object_id.source();
   buffer[0] = source & 0xff;
   buffer[1] = (source >> 8) & 0xff;
   buffer[2] = (source >> 16) & 0xff;
   buffer[3] = (source >> 24) & 0xff;
+}
+
+string ObjectIdDigestUtils::GetDigest(
+    const ObjectIdP& object_id, DigestFunction* digest_fn) {
+  char digest[DigestFunction::kMaxDigestSize];
+  int digest_size = GetDigest(object_id, digest_fn, digest);
+  return string(digest, digest_size);
+}
+
+int ObjectIdDigestUtils::GetDigest(
+    const ObjectIdP& object_id, DigestFunction* digest_fn, char* digest) {
+  digest_fn->Reset();
+  char buffer[4];
+
+  // Little endian number for type followed by bytes.
+  EncodeSource(object_id, buffer);
+  digest_fn->Update(buffer, sizeof(buffer));
+  digest_fn->Update(object_id.name().data(), object_id.name().size());
+  return digest_fn->GetDigest(digest, DigestFunction::kMaxDigestSize);
+}
+
+void ObjectIdDigestUtils::GetDigests(
+    const vector<ObjectIdP>& object_ids, DigestFunction* digest_fn,
+    vector<string>* digests) {
+  vector<string> inputs(object_ids.size());
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    char buffer[4];
+    EncodeSource(object_ids[i], buffer);
+    inputs[i].reserve(sizeof(buffer) + object_ids[i].name().size());
+    inputs[i].append(buffer, sizeof(buffer));
+    inputs[i].append(object_ids[i].name());
+  }
+  digest_fn->GetDigests(inputs, digests);
+}
+
+bool ObjectIdDigestUtils::MatchesPrefix(
+    const string& digest, const string& digest_prefix, int prefix_len) {
+  if (prefix_len > static_cast<int>(8 * digest.size())) {
+    return false;
+  }
+  for (int i = 0; i < prefix_len; ++i) {
+    if (GetBit(digest, i) != GetBit(digest_prefix, i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+const string& ObjectIdDigestCache::GetDigest(const ObjectIdP& object_id) {
+  DigestMap::iterator iter = digests_.find(object_id);
+  if (iter == digests_.end()) {
+    iter = digests_.insert(make_pair(
+        object_id, ObjectIdDigestUtils::GetDigest(object_id, digest_fn_))).first;
+  }
+  return iter->second;
+}
+
+void ObjectIdDigestCache::CacheDigests(const vector<ObjectIdP>& object_ids) {
+  vector<ObjectIdP> missing;
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    if (digests_.find(object_ids[i]) == digests_.end()) {
+      missing.push_back(object_ids[i]);
+    }
+  }
+  if (missing.empty()) {
+    return;
+  }
+  vector<string> digests;
+  ObjectIdDigestUtils::GetDigests(missing, digest_fn_, &digests);
+  for (size_t i = 0; i < missing.size(); ++i) {
+    digests_.insert(make_pair(missing[i], digests[i]));
+  }
+}
+
+void ObjectIdDigestCache::CacheDigests(const vector<ObjectIdP>& object_ids,
+                                       const vector<string>& digests) {
+  CHECK(digests.size() == object_ids.size());
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    digests_.insert(make_pair(object_ids[i], digests[i]));
+  }
+}
 
-  digest_fn->Update(buffer);
-  digest_fn->Update(object_id.name());
-  return digest_fn->GetDigest();
+size_t ObjectIdDigestCache::GetAllocatedBytes() const {
+  size_t bytes = MemoryUsage::TreeNodeBytes(digests_);
+  for (DigestMap::const_iterator iter = digests_.begin();
+       iter != digests_.end(); ++iter) {
+    bytes += MemoryUsage::ObjectIdBytes(iter->first) +
+        MemoryUsage::StringBytes(iter->second);
+  }
+  return bytes;
 }
 
 }  // namespace invalidation
@@ -18,22 +18,25 @@
 #define GOOGLE_CACHEINVALIDATION_V2_OBJECT_ID_DIGEST_UTILS_H_
 
 #include <map>
+#include <vector>
 
 #include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
 #include "google/cacheinvalidation/v2/digest-function.h"
+#include "google/cacheinvalidation/v2/proto-helpers.h"
 
 namespace invalidation {
 
 using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::vector;
 
 class ObjectIdDigestUtils {
  public:
   /* Returns the digest of the set of keys in the given map. */
   template<typename T>
   static string GetDigest(
-      map<string, T> registrations, DigestFunction* digest_fn) {
+      const map<string, T>& registrations, DigestFunction* digest_fn) {
     digest_fn->Reset();
-    for (map<string, ObjectIdP>::iterator iter = registrations.begin();
+    for (typename map<string, T>::const_iterator iter = registrations.begin();
          iter != registrations.end(); ++iter) {
       digest_fn->Update(iter->first);
     }
@@ -43,6 +46,91 @@ class ObjectIdDigestUtils {
   /* Returns the digest of object_id using digest_fn. */
   static string GetDigest(
       const ObjectIdP& object_id, DigestFunction* digest_fn);
+
+  /* Stores the digest of object_id using digest_fn in digest, which must have
+   * room for DigestFunction::kMaxDigestSize bytes, and returns its size.
+   */
+  static int GetDigest(
+      const ObjectIdP& object_id, DigestFunction* digest_fn, char* digest);
+
+  /* Stores in digests the digest of each of object_ids, in order, using
+   * digest_fn. Equivalent to calling GetDigest on each object id but lets
+   * digest_fn compute the digests together.
+   */
+  static void GetDigests(const vector<ObjectIdP>& object_ids,
+                         DigestFunction* digest_fn, vector<string>* digests);
+
+  /* Returns bit bit_index of digest. Bits are numbered from the
+   * least-significant bit of the first byte upwards.
+   */
+  static int GetBit(const string& digest, int bit_index) {
+    return (static_cast<unsigned char>(digest[bit_index / 8]) >>
+            (bit_index % 8)) & 1;
+  }
+
+  /* Returns whether the first prefix_len bits of digest and digest_prefix
+   * agree.
+   */
+  static bool MatchesPrefix(const string& digest, const string& digest_prefix,
+                            int prefix_len);
+};
+
+/* Memoizes the digests of object ids so that each object is hashed only once
+ * while it is held, e.g., by a registration store. Entries are kept until they
+ * are explicitly erased.
+ */
+class ObjectIdDigestCache {
+ public:
+  explicit ObjectIdDigestCache(DigestFunction* digest_fn)
+      : digest_fn_(digest_fn) {}
+
+  /* Returns the digest of object_id, computing and caching it if it is not
+   * already cached.
+   */
+  const string& GetDigest(const ObjectIdP& object_id);
+
+  /* Computes and caches the digests of those of object_ids that are not
+   * already cached, all in one batch.
+   */
+  void CacheDigests(const vector<ObjectIdP>& object_ids);
+
+  /* Caches digests[i] as the digest of object_ids[i], for those of
+   * object_ids that are not already cached.
+   */
+  void CacheDigests(const vector<ObjectIdP>& object_ids,
+                    const vector<string>& digests);
+
+  /* Returns the cached digest of object_id, or NULL if there is none. */
+  const string* Find(const ObjectIdP& object_id) const {
+    DigestMap::const_iterator iter = digests_.find(object_id);
+    return iter == digests_.end() ? NULL : &iter->second;
+  }
+
+  /* Removes the cached digest of object_id, if any. */
+  void Erase(const ObjectIdP& object_id) {
+    digests_.erase(object_id);
+  }
+
+  /* Removes all the cached digests. */
+  void Clear() {
+    digests_.clear();
+  }
+
+  int size() const {
+    return digests_.size();
+  }
+
+  /* Returns the approximate number of heap bytes held by the cache. */
+  size_t GetAllocatedBytes() const;
+
+ private:
+  typedef map<ObjectIdP, string, ProtoCompareLess> DigestMap;
+
+  /* The function used to compute digests of objects. */
+  DigestFunction* digest_fn_;
+
+  /* The cached digests, keyed by object id. */
+  DigestMap digests_;
 };
 }  // namespace invalidation
 
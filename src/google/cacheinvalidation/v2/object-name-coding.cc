@@ -0,0 +1,117 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Utilities to front-code the object names of registration messages.
+
+#include "google/cacheinvalidation/v2/object-name-coding.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "google/cacheinvalidation/v2/proto-helpers.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::min;
+using INVALIDATION_STL_NAMESPACE::sort;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Orders pointers to object ids by ProtoCompareLess on the object ids. */
+static bool ObjectIdPointerLess(const ObjectIdP* object_id1,
+                                const ObjectIdP* object_id2) {
+  return ProtoCompareLess()(*object_id1, *object_id2);
+}
+
+void ObjectNameCoding::EncodeRegistrations(RegistrationMessage* message) {
+  string previous_name;
+  for (int i = 0; i < message->registration_size(); ++i) {
+    EncodeName(message->mutable_registration(i)->mutable_object_id(),
+               &previous_name);
+  }
+}
+
+void ObjectNameCoding::EncodeSubtree(RegistrationSubtree* subtree) {
+  // Sort by moving the objects out of the repeated field and back, so that
+  // only pointers are swapped.
+  RepeatedPtrField<ObjectIdP>* objects = subtree->mutable_registered_object();
+  vector<ObjectIdP*> sorted_objects;
+  sorted_objects.reserve(objects->size());
+  while (objects->size() > 0) {
+    sorted_objects.push_back(objects->ReleaseLast());
+  }
+  sort(sorted_objects.begin(), sorted_objects.end(), ObjectIdPointerLess);
+  string previous_name;
+  for (size_t i = 0; i < sorted_objects.size(); ++i) {
+    EncodeName(sorted_objects[i], &previous_name);
+    objects->AddAllocated(sorted_objects[i]);
+  }
+}
+
+bool ObjectNameCoding::DecodeRegistrations(RegistrationMessage* message) {
+  string previous_name;
+  for (int i = 0; i < message->registration_size(); ++i) {
+    if (!DecodeName(message->mutable_registration(i)->mutable_object_id(),
+                    &previous_name)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ObjectNameCoding::DecodeSubtree(RegistrationSubtree* subtree) {
+  string previous_name;
+  for (int i = 0; i < subtree->registered_object_size(); ++i) {
+    if (!DecodeName(subtree->mutable_registered_object(i), &previous_name)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void ObjectNameCoding::EncodeName(ObjectIdP* object_id,
+                                  string* previous_name) {
+  const string& name = object_id->name();
+  size_t max_length = min(name.size(), previous_name->size());
+  size_t shared_length = 0;
+  while ((shared_length < max_length) &&
+         (name[shared_length] == (*previous_name)[shared_length])) {
+    ++shared_length;
+  }
+  previous_name->assign(name);
+  if (shared_length > static_cast<size_t>(kMinSharedPrefixLength)) {
+    object_id->mutable_name()->erase(0, shared_length);
+    object_id->set_shared_name_prefix_length(shared_length);
+  }
+}
+
+bool ObjectNameCoding::DecodeName(ObjectIdP* object_id,
+                                  string* previous_name) {
+  if (object_id->has_shared_name_prefix_length()) {
+    int shared_length = object_id->shared_name_prefix_length();
+    if ((shared_length < 0) ||
+        (static_cast<size_t>(shared_length) > previous_name->size())) {
+      return false;
+    }
+    // Build the full name in previous_name, which shares the prefix already.
+    previous_name->resize(shared_length);
+    previous_name->append(object_id->name());
+    object_id->set_name(*previous_name);
+    object_id->clear_shared_name_prefix_length();
+  } else {
+    previous_name->assign(object_id->name());
+  }
+  return true;
+}
+
+}  // namespace invalidation
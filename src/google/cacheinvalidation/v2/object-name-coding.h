@@ -0,0 +1,72 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Utilities to front-code the object names of registration messages (see
+// InitializeMessage.NameEncoding).
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_OBJECT_NAME_CODING_H_
+#define GOOGLE_CACHEINVALIDATION_V2_OBJECT_NAME_CODING_H_
+
+#include <string>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+
+class ObjectNameCoding {
+ public:
+  /* Front-codes the names of the registrations of message, which must be in
+   * the order of ProtoCompareLess (as taken from a sorted set), so that
+   * neighbouring names share their longest prefixes.
+   */
+  static void EncodeRegistrations(RegistrationMessage* message);
+
+  /* Sorts the registered objects of subtree in the order of ProtoCompareLess
+   * (their order carries no meaning) and front-codes their names.
+   */
+  static void EncodeSubtree(RegistrationSubtree* subtree);
+
+  /* Restores the full names of the registrations of message, as encoded by
+   * EncodeRegistrations; names that are not front-coded are left as they
+   * are. Returns whether message was well-formed.
+   */
+  static bool DecodeRegistrations(RegistrationMessage* message);
+
+  /* Like DecodeRegistrations, for the registered objects of subtree. */
+  static bool DecodeSubtree(RegistrationSubtree* subtree);
+
+ private:
+  /* A shared prefix no longer than this is sent in full, as its length would
+   * take as many bytes on the wire as it saves.
+   */
+  static const int kMinSharedPrefixLength = 2;
+
+  /* Front-codes the name of object_id against previous_name, the full name of
+   * the object id before it, then sets previous_name to its full name.
+   */
+  static void EncodeName(ObjectIdP* object_id, string* previous_name);
+
+  /* Restores the full name of object_id from previous_name, the full name of
+   * the object id before it, then sets previous_name to it. Returns whether
+   * the shared prefix is within previous_name.
+   */
+  static bool DecodeName(ObjectIdP* object_id, string* previous_name);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_OBJECT_NAME_CODING_H_
@@ -17,13 +17,86 @@
 
 #include "google/cacheinvalidation/v2/operation-scheduler.h"
 
+#include <new>
+
 #include "google/cacheinvalidation/v2/logging.h"
 #include "google/cacheinvalidation/v2/log-macro.h"
 
 namespace invalidation {
 
-void OperationScheduler::SetOperation(TimeDelta delay, Closure* operation,
-                                      const string& name) {
+/* Clears info->has_been_scheduled and runs the operation, unless the
+ * operation scheduler is gone.
+ */
+static void RunOperation(OperationScheduleInfo* info) {
+  if (!info->is_orphaned) {
+    info->has_been_scheduled = false;
+    info->operation->Run();
+  }
+}
+
+/* Deletes info if it is orphaned and the scheduler holds no more of its
+ * trampolines.
+ */
+static void MaybeDeleteOrphanedInfo(OperationScheduleInfo* info) {
+  if (info->is_orphaned && !info->HasTrampolinesInUse()) {
+    delete info;
+  }
+}
+
+/* A trampoline allocated on the heap, for when the scheduler holds both of
+ * the trampolines in the slots of the operation. Like those, it keeps the
+ * info alive and does not run the operation once the scheduler is gone.
+ */
+class HeapOperationTrampoline : public Closure {
+ public:
+  explicit HeapOperationTrampoline(OperationScheduleInfo* info) : info_(info) {
+    ++info_->num_heap_trampolines;
+  }
+
+  virtual ~HeapOperationTrampoline() {
+    --info_->num_heap_trampolines;
+    MaybeDeleteOrphanedInfo(info_);
+  }
+
+  virtual bool IsRepeatable() const {
+    return true;
+  }
+
+  virtual void Run() {
+    RunOperation(info_);
+  }
+
+ private:
+  OperationScheduleInfo* info_;
+};
+
+void OperationTrampoline::Run() {
+  RunOperation(info_);
+}
+
+void OperationTrampoline::operator delete(void* trampoline) {
+  // The trampoline is the storage at the start of its slot.
+  OperationScheduleInfo::TrampolineSlot* slot =
+      static_cast<OperationScheduleInfo::TrampolineSlot*>(trampoline);
+  slot->in_use = false;
+  MaybeDeleteOrphanedInfo(slot->info);
+}
+
+OperationScheduler::~OperationScheduler() {
+  // Infos whose trampolines the scheduler still holds are deleted with the
+  // last of them.
+  for (map<Closure*, OperationScheduleInfo*>::iterator it =
+           operations_.begin(); it != operations_.end(); ++it) {
+    if (it->second->HasTrampolinesInUse()) {
+      it->second->is_orphaned = true;
+    } else {
+      delete it->second;
+    }
+  }
+}
+
+OperationScheduleInfo* OperationScheduler::SetOperation(
+    TimeDelta delay, Closure* operation, const string& name) {
   CHECK(operations_.find(operation) == operations_.end()) << "operation " <<
       operation << " already set";
   CHECK(delay > TimeDelta::FromMilliseconds(0)) <<
@@ -31,44 +104,58 @@ void OperationScheduler::SetOperation(TimeDelta delay, Closure* operation,
   CHECK(operation != NULL);
   TLOG(logger_, FINE, "Set %s with delay %d", name.c_str(),
        delay.InMilliseconds());
-  operations_[operation] = OperationScheduleInfo(delay, name);
+  OperationScheduleInfo* op_info =
+      new OperationScheduleInfo(delay, name, operation);
+  operations_[operation] = op_info;
+  return op_info;
 }
 
-void OperationScheduler::ChangeDelayForTest(
-    Closure* operation, TimeDelta delay) {
-  map<Closure*, OperationScheduleInfo>::iterator it =
-      operations_.find(operation);
-  CHECK(it != operations_.end());
-  OperationScheduleInfo& op_info = it->second;
-  TLOG(logger_, FINE, "Changing delay for %s to be %d us", op_info.name.c_str(),
-       delay.InMilliseconds());
-  op_info.delay = delay;
+void OperationScheduler::ChangeDelay(Closure* operation, TimeDelta delay) {
+  ChangeDelay(GetInfo(operation), delay);
+}
+
+void OperationScheduler::ChangeDelay(OperationScheduleInfo* op_info,
+                                     TimeDelta delay) {
+  TLOG(logger_, FINE, "Changing delay for %s to be %d us",
+       op_info->name.c_str(), delay.InMilliseconds());
+  op_info->delay = delay;
 }
 
 void OperationScheduler::Schedule(Closure* operation) {
-  map<Closure*, OperationScheduleInfo>::iterator it =
-      operations_.find(operation);
-  CHECK(it != operations_.end()) << "cannot schedule operation: not set";
-  OperationScheduleInfo* op_info = &it->second;
+  Schedule(GetInfo(operation));
+}
 
+void OperationScheduler::ScheduleWithDelay(OperationScheduleInfo* op_info,
+                                           TimeDelta base_delay) {
   // Schedule an event if one has not been already scheduled.
   if (!op_info->has_been_scheduled) {
-    TimeDelta delay = smearer_.GetSmearedDelay(op_info->delay);
+    TimeDelta delay = smearer_.GetSmearedDelay(base_delay);
     TLOG(logger_, FINE, "Scheduling %s with a delay %d, Now = %d",
          op_info->name.c_str(), delay.InMilliseconds(),
          InvalidationClientUtil::GetCurrentTimeMs(scheduler_));
     op_info->has_been_scheduled = true;
-    scheduler_->Schedule(
-        delay,
-        NewPermanentCallback(
-            &OperationScheduler::RunAndClearScheduled, operation, op_info));
+    scheduler_->Schedule(delay, NewTrampoline(op_info));
   }
 }
 
-void OperationScheduler::RunAndClearScheduled(
-    Closure* closure, OperationScheduleInfo* info) {
-  info->has_been_scheduled = false;
-  closure->Run();
+Closure* OperationScheduler::NewTrampoline(OperationScheduleInfo* op_info) {
+  for (int i = 0; i < OperationScheduleInfo::kNumTrampolineSlots; ++i) {
+    OperationScheduleInfo::TrampolineSlot* slot = &op_info->trampolines[i];
+    if (!slot->in_use) {
+      slot->in_use = true;
+      return new(slot->storage.bytes) OperationTrampoline(op_info);
+    }
+  }
+  // The scheduler still holds both trampolines (e.g., it deletes the tasks it
+  // has run only later), so fall back to one on the heap.
+  return new HeapOperationTrampoline(op_info);
+}
+
+OperationScheduleInfo* OperationScheduler::GetInfo(Closure* operation) {
+  map<Closure*, OperationScheduleInfo*>::iterator it =
+      operations_.find(operation);
+  CHECK(it != operations_.end()) << "operation not set";
+  return it->second;
 }
 
 }  // namespace invalidation
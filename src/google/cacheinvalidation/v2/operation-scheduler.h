@@ -29,6 +29,35 @@ namespace invalidation {
 
 using INVALIDATION_STL_NAMESPACE::map;
 
+struct OperationScheduleInfo;
+
+/* The closure handed to the scheduler to run an operation. Trampolines live in
+ * the OperationScheduleInfo of their operation, so that scheduling it does not
+ * allocate: the scheduler deletes the closures that it runs, which for a
+ * trampoline only ends its lifetime and frees its slot in the info for reuse.
+ */
+class OperationTrampoline : public Closure {
+ public:
+  explicit OperationTrampoline(OperationScheduleInfo* info) : info_(info) {}
+
+  virtual bool IsRepeatable() const {
+    return true;
+  }
+
+  /* Clears info->has_been_scheduled and runs the operation, unless the
+   * operation scheduler is gone.
+   */
+  virtual void Run();
+
+  /* Frees the slot of the trampoline in its info (and the info, if it is
+   * orphaned and this was its last trampoline).
+   */
+  static void operator delete(void* trampoline);
+
+ private:
+  OperationScheduleInfo* info_;
+};
+
 /* Information about an operation. */
 struct OperationScheduleInfo {
  public:
@@ -36,17 +65,63 @@ struct OperationScheduleInfo {
   string name;
   bool has_been_scheduled;
 
-  OperationScheduleInfo() {}
+  /* The operation. Not owned. */
+  Closure* operation;
+
+  /* Whether the operation scheduler has been destroyed while the scheduler
+   * still held trampolines. The operation is then no longer run, and the info
+   * is deleted with the last trampoline.
+   */
+  bool is_orphaned;
 
-  OperationScheduleInfo(TimeDelta init_delay, const string& op_name)
-      : delay(init_delay), name(op_name), has_been_scheduled(false) {}
+  /* Number of trampolines of the operation allocated on the heap, when both
+   * slots below were in use, that the scheduler still holds.
+   */
+  int num_heap_trampolines;
+
+  /* Storage for a trampoline of the operation, which must come first. */
+  struct TrampolineSlot {
+    union {
+      void* alignment;
+      char bytes[sizeof(OperationTrampoline)];
+    } storage;
+    bool in_use;
+    OperationScheduleInfo* info;
+  };
+
+  /* Two slots are needed since the operation may be scheduled again while it
+   * runs, before the scheduler deletes the trampoline that is running it.
+   */
+  static const int kNumTrampolineSlots = 2;
+  TrampolineSlot trampolines[kNumTrampolineSlots];
+
+  OperationScheduleInfo(TimeDelta init_delay, const string& op_name,
+                        Closure* op)
+      : delay(init_delay), name(op_name), has_been_scheduled(false),
+        operation(op), is_orphaned(false), num_heap_trampolines(0) {
+    for (int i = 0; i < kNumTrampolineSlots; ++i) {
+      trampolines[i].in_use = false;
+      trampolines[i].info = this;
+    }
+  }
 
-  OperationScheduleInfo& operator=(const OperationScheduleInfo& other) {
-    delay = other.delay;
-    name = other.name;
-    has_been_scheduled = other.has_been_scheduled;
-    return *this;
+  /* Returns whether the scheduler holds any trampoline of the operation. */
+  bool HasTrampolinesInUse() const {
+    if (num_heap_trampolines > 0) {
+      return true;
+    }
+    for (int i = 0; i < kNumTrampolineSlots; ++i) {
+      if (trampolines[i].in_use) {
+        return true;
+      }
+    }
+    return false;
   }
+
+ private:
+  // Not copyable, since the scheduler may hold the trampolines.
+  OperationScheduleInfo(const OperationScheduleInfo& other);
+  void operator=(const OperationScheduleInfo& other);
 };
 
 class OperationScheduler {
@@ -56,7 +131,12 @@ class OperationScheduler {
         smearer_(
             new Random(InvalidationClientUtil::GetCurrentTimeMs(scheduler))) {}
 
+  /* Operations still pending in the scheduler are not run any more. */
+  ~OperationScheduler();
+
   /* Informs the scheduler about a new operation that can be scheduled.
+   * Returns the information kept for the operation (owned by this), with
+   * which the operation can be scheduled without looking it up.
    *
    * REQUIRES: has not previously been called for op_type.
    *
@@ -64,13 +144,26 @@ class OperationScheduler {
    * operation - implementation of the operation
    * name - a name for the operation (for logging)
    */
-  void SetOperation(TimeDelta delay, Closure* operation, const string& name);
+  OperationScheduleInfo* SetOperation(TimeDelta delay, Closure* operation,
+                                      const string& name);
+
+  /* Changes the existing delay for operation to be delay. Takes effect the
+   * next time the operation is scheduled.
+   *
+   * REQUIRES: an entry for operation already exists.
+   */
+  void ChangeDelay(Closure* operation, TimeDelta delay);
+
+  /* Like ChangeDelay above, for the operation of op_info. */
+  void ChangeDelay(OperationScheduleInfo* op_info, TimeDelta delay);
 
   /* Changes the existing delay for operation to be delay.
    *
    * REQUIRES: an entry for operation already exists.
    */
-  void ChangeDelayForTest(Closure* operation, TimeDelta delay);
+  void ChangeDelayForTest(Closure* operation, TimeDelta delay) {
+    ChangeDelay(operation, delay);
+  }
 
   /* Scheduled the operation represented by op_type. If the operation is already
    * pending, does nothing.
@@ -80,15 +173,31 @@ class OperationScheduler {
    */
   void Schedule(Closure* operation);
 
+  /* Like Schedule above, for the operation of op_info, but neither looks up
+   * the operation nor allocates.
+   */
+  void Schedule(OperationScheduleInfo* op_info) {
+    ScheduleWithDelay(op_info, op_info->delay);
+  }
+
+  /* Like Schedule above, but with the given delay instead of the operation's
+   * own, this time only.
+   */
+  void ScheduleWithDelay(OperationScheduleInfo* op_info, TimeDelta delay);
+
  private:
-  /* Runs the given closure and then sets info->has_been_scheduled to false. */
-  static void RunAndClearScheduled(
-      Closure* closure, OperationScheduleInfo* info);
+  /* Returns a closure that runs the operation of op_info: a trampoline in a
+   * slot of op_info if one is free, or else one on the heap.
+   */
+  static Closure* NewTrampoline(OperationScheduleInfo* op_info);
+
+  /* Returns the information for operation, which must have been set. */
+  OperationScheduleInfo* GetInfo(Closure* operation);
 
   /* Operations that can be scheduled - key is the actual closure being
-   * scheduled.
+   * scheduled. The values are owned.
    */
-  map<Closure*, OperationScheduleInfo> operations_;
+  map<Closure*, OperationScheduleInfo*> operations_;
   Logger* logger_;
   Scheduler* scheduler_;
 
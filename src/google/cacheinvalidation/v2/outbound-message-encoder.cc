@@ -0,0 +1,161 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Serialization of the messages sent to the server, reusing the encoded
+// fields that rarely change.
+
+#include "google/cacheinvalidation/v2/outbound-message-encoder.h"
+
+#include "google/cacheinvalidation/v2/constants.h"
+#include "google/cacheinvalidation/v2/logging.h"
+#include "google/cacheinvalidation/v2/memory-usage.h"
+
+namespace invalidation {
+
+// Numbers of the ClientToServerMessage fields encoded by hand.
+static const int kHeaderField = 1;
+static const int kInfoMessageField = 6;
+
+// Numbers of the ClientHeader fields encoded for each message.
+static const int kClientTimeMsField = 4;
+static const int kMaxKnownServerTimeMsField = 5;
+static const int kMessageIdField = 6;
+
+// Wire types of protocol buffer fields.
+static const int kVarintWireType = 0;
+static const int kLengthDelimitedWireType = 2;
+
+static void AppendVarint(uint64 value, string* buffer) {
+  while (value >= 0x80) {
+    buffer->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  buffer->push_back(static_cast<char>(value));
+}
+
+static void AppendTag(int field, int wire_type, string* buffer) {
+  AppendVarint((field << 3) | wire_type, buffer);
+}
+
+// Appends the decimal representation of value, as StringPrintf("%d") would.
+static void AppendDecimal(int value, string* buffer) {
+  char digits[12];
+  int num_digits = 0;
+  uint32 magnitude = (value < 0) ? -static_cast<uint32>(value) : value;
+  do {
+    digits[num_digits++] = static_cast<char>('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude > 0);
+  if (value < 0) {
+    buffer->push_back('-');
+  }
+  while (num_digits > 0) {
+    buffer->push_back(digits[--num_digits]);
+  }
+}
+
+OutboundMessageEncoder::OutboundMessageEncoder(
+    const ClientVersion& client_version)
+    : has_static_header_fields_(false) {
+  Version* version =
+      static_header_.mutable_protocol_version()->mutable_version();
+  version->set_major_version(Constants::kProtocolMajorVersion);
+  version->set_minor_version(Constants::kProtocolMinorVersion);
+
+  InfoMessage version_only;
+  version_only.mutable_client_version()->CopyFrom(client_version);
+  version_only.SerializeToString(&client_version_field_);
+}
+
+void OutboundMessageEncoder::EncodeBody(ClientToServerMessage* message,
+                                        string* body) {
+  CHECK(!message->has_header()) << "header is encoded separately";
+  if (!message->has_info_message()) {
+    message->SerializeToString(body);
+    return;
+  }
+  info_message_.Swap(message->mutable_info_message());
+  message->clear_info_message();
+  message->SerializeToString(body);
+
+  // Fields may come in any order, so the info message goes last, with its
+  // client version in front.
+  info_message_.clear_client_version();
+  info_message_.SerializeToString(&info_fields_);
+  AppendTag(kInfoMessageField, kLengthDelimitedWireType, body);
+  AppendVarint(client_version_field_.size() + info_fields_.size(), body);
+  body->append(client_version_field_);
+  body->append(info_fields_);
+}
+
+void OutboundMessageEncoder::EncodeMessage(
+    const string& client_token,
+    const RegistrationSummary& registration_summary, int message_id,
+    int64 client_time_ms, int64 max_known_server_time_ms, const string& body,
+    string* buffer) {
+  UpdateStaticHeaderFields(client_token, registration_summary);
+  header_fields_.clear();
+  AppendTag(kClientTimeMsField, kVarintWireType, &header_fields_);
+  AppendVarint(static_cast<uint64>(client_time_ms), &header_fields_);
+  AppendTag(kMaxKnownServerTimeMsField, kVarintWireType, &header_fields_);
+  AppendVarint(static_cast<uint64>(max_known_server_time_ms),
+               &header_fields_);
+
+  // The id has at most 11 characters, so its length fits in one byte.
+  size_t length_offset = header_fields_.size() + 1;
+  AppendTag(kMessageIdField, kLengthDelimitedWireType, &header_fields_);
+  header_fields_.push_back(0);
+  AppendDecimal(message_id, &header_fields_);
+  header_fields_[length_offset] =
+      static_cast<char>(header_fields_.size() - length_offset - 1);
+
+  buffer->clear();
+  AppendTag(kHeaderField, kLengthDelimitedWireType, buffer);
+  AppendVarint(static_header_fields_.size() + header_fields_.size(), buffer);
+  buffer->append(static_header_fields_);
+  buffer->append(header_fields_);
+  buffer->append(body);
+}
+
+size_t OutboundMessageEncoder::GetAllocatedBytes() const {
+  return MemoryUsage::StringBytes(static_header_fields_) +
+      MemoryUsage::StringBytes(client_version_field_) +
+      MemoryUsage::StringBytes(info_fields_) +
+      MemoryUsage::StringBytes(header_fields_);
+}
+
+void OutboundMessageEncoder::UpdateStaticHeaderFields(
+    const string& client_token,
+    const RegistrationSummary& registration_summary) {
+  const RegistrationSummary& summary = static_header_.registration_summary();
+  if (has_static_header_fields_ &&
+      (static_header_.client_token() == client_token) &&
+      (summary.num_registrations() ==
+       registration_summary.num_registrations()) &&
+      (summary.registration_digest() ==
+       registration_summary.registration_digest())) {
+    return;
+  }
+  if (client_token.empty()) {
+    static_header_.clear_client_token();
+  } else {
+    static_header_.set_client_token(client_token);
+  }
+  static_header_.mutable_registration_summary()->CopyFrom(
+      registration_summary);
+  static_header_.SerializeToString(&static_header_fields_);
+  has_static_header_fields_ = true;
+}
+
+}  // namespace invalidation
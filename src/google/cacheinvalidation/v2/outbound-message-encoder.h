@@ -0,0 +1,88 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Serialization of the messages sent to the server, reusing the encoded
+// fields that rarely change.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_OUTBOUND_MESSAGE_ENCODER_H_
+#define GOOGLE_CACHEINVALIDATION_V2_OUTBOUND_MESSAGE_ENCODER_H_
+
+#include <string>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/types.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+
+/* Serializes ClientToServerMessages without building their headers or copying
+ * the client version into their info messages.
+ *
+ * The protocol version, client token and registration summary of the header
+ * are kept serialized, and encoded again only when the token or summary
+ * changes; the client version of info messages is serialized once. Only the
+ * client time, the last known server time and the message id are encoded
+ * for each message. The result parses to the same message as serializing it
+ * with the header and client version filled in.
+ */
+class OutboundMessageEncoder {
+ public:
+  explicit OutboundMessageEncoder(const ClientVersion& client_version);
+
+  /* Stores in body the serialization of message, which must not have a
+   * header, with the client version added to its info message, if any.
+   * message is left without its info message.
+   */
+  void EncodeBody(ClientToServerMessage* message, string* body);
+
+  /* Stores in buffer a serialized ClientToServerMessage with a header for the
+   * given fields (with no client token if client_token is empty), followed by
+   * body, the serialization of the rest of the message.
+   */
+  void EncodeMessage(const string& client_token,
+                     const RegistrationSummary& registration_summary,
+                     int message_id, int64 client_time_ms,
+                     int64 max_known_server_time_ms, const string& body,
+                     string* buffer);
+
+  /* Returns the number of heap bytes held by the encoder's buffers. */
+  size_t GetAllocatedBytes() const;
+
+ private:
+  /* Encodes static_header_fields_ again if client_token or
+   * registration_summary differ from those it was encoded for.
+   */
+  void UpdateStaticHeaderFields(
+      const string& client_token,
+      const RegistrationSummary& registration_summary);
+
+  /* The header fields that rarely change, as last encoded. */
+  ClientHeader static_header_;
+  string static_header_fields_;
+  bool has_static_header_fields_;
+
+  /* The serialized client_version field of an InfoMessage. */
+  string client_version_field_;
+
+  /* Reused buffers for the parts of a message being encoded. */
+  InfoMessage info_message_;
+  string info_fields_;
+  string header_fields_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_OUTBOUND_MESSAGE_ENCODER_H_
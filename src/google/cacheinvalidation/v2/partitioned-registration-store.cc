@@ -0,0 +1,230 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation of DigestStore that partitions the objects by their source.
+
+#include "google/cacheinvalidation/v2/partitioned-registration-store.h"
+
+#include "google/cacheinvalidation/v2/logging.h"
+#include "google/cacheinvalidation/v2/memory-usage.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+using INVALIDATION_STL_NAMESPACE::pair;
+
+void PartitionedRegistrationStore::Add(const ObjectIdP& oid) {
+  Partition* partition = &partitions_[oid.source()];
+  if (partition->registrations.insert(
+          make_pair(digest_cache_.GetDigest(oid), oid)).second) {
+    ++num_registrations_;
+    InvalidateDigests(partition);
+  }
+}
+
+void PartitionedRegistrationStore::Add(const vector<ObjectIdP>& oids) {
+  digest_cache_.CacheDigests(oids);
+  for (size_t i = 0; i < oids.size(); ++i) {
+    Add(oids[i]);
+  }
+}
+
+void PartitionedRegistrationStore::AddWithDigests(
+    const vector<ObjectIdP>& oids, const vector<string>& digests) {
+  digest_cache_.CacheDigests(oids, digests);
+  for (size_t i = 0; i < oids.size(); ++i) {
+    Add(oids[i]);
+  }
+}
+
+void PartitionedRegistrationStore::Remove(const ObjectIdP& oid) {
+  // Objects without a cached digest are not in the store.
+  const string* oid_digest = digest_cache_.Find(oid);
+  if (oid_digest == NULL) {
+    return;
+  }
+  PartitionMap::iterator iter = partitions_.find(oid.source());
+  CHECK(iter != partitions_.end()) << "No partition for cached object";
+  iter->second.registrations.erase(*oid_digest);
+  digest_cache_.Erase(oid);
+  --num_registrations_;
+  InvalidateDigests(&iter->second);
+  if (iter->second.registrations.empty()) {
+    partitions_.erase(iter);
+  }
+}
+
+void PartitionedRegistrationStore::Remove(const vector<ObjectIdP>& oids) {
+  for (size_t i = 0; i < oids.size(); ++i) {
+    Remove(oids[i]);
+  }
+}
+
+void PartitionedRegistrationStore::RemoveAll(vector<ObjectIdP>* oids) {
+  if (num_registrations_ == 0) {
+    return;
+  }
+  for (PartitionMap::iterator iter = partitions_.begin();
+       iter != partitions_.end(); ++iter) {
+    GetElementsForSource(iter->first, oids);
+  }
+  partitions_.clear();
+  digest_cache_.Clear();
+  num_registrations_ = 0;
+  is_summary_digest_stale_ = true;
+}
+
+bool PartitionedRegistrationStore::Contains(const ObjectIdP& oid) {
+  return digest_cache_.Find(oid) != NULL;
+}
+
+string PartitionedRegistrationStore::GetDigest() {
+  if (is_summary_digest_stale_) {
+    digest_function_->Reset();
+    UpdateWithMergedDigests(string(), 0);
+    summary_digest_ = digest_function_->GetDigest();
+    is_summary_digest_stale_ = false;
+  }
+  return summary_digest_;
+}
+
+string PartitionedRegistrationStore::GetDigestForPrefix(
+    const string& oid_digest_prefix, int prefix_len, int* num_elements) {
+  digest_function_->Reset();
+  *num_elements = UpdateWithMergedDigests(oid_digest_prefix, prefix_len);
+  return digest_function_->GetDigest();
+}
+
+void PartitionedRegistrationStore::GetElements(
+    const string& oid_digest_prefix, int prefix_len,
+    vector<ObjectIdP>* result) {
+  // The caller does not need the elements in digest order, so each partition
+  // is filtered on its own.
+  for (PartitionMap::iterator partition = partitions_.begin();
+       partition != partitions_.end(); ++partition) {
+    const map<string, ObjectIdP>& registrations =
+        partition->second.registrations;
+    for (map<string, ObjectIdP>::const_iterator iter = registrations.begin();
+         iter != registrations.end(); ++iter) {
+      if (ObjectIdDigestUtils::MatchesPrefix(
+              iter->first, oid_digest_prefix, prefix_len)) {
+        result->push_back(iter->second);
+      }
+    }
+  }
+}
+
+void PartitionedRegistrationStore::GetSources(vector<int>* sources) {
+  for (PartitionMap::iterator iter = partitions_.begin();
+       iter != partitions_.end(); ++iter) {
+    sources->push_back(iter->first);
+  }
+}
+
+string PartitionedRegistrationStore::GetDigestForSource(
+    int source, int* num_elements) {
+  PartitionMap::iterator iter = partitions_.find(source);
+  if (iter == partitions_.end()) {
+    *num_elements = 0;
+    digest_function_->Reset();
+    return digest_function_->GetDigest();
+  }
+  Partition* partition = &iter->second;
+  if (partition->is_digest_stale) {
+    partition->digest = ObjectIdDigestUtils::GetDigest(
+        partition->registrations, digest_function_);
+    partition->is_digest_stale = false;
+  }
+  *num_elements = partition->registrations.size();
+  return partition->digest;
+}
+
+void PartitionedRegistrationStore::GetElementsForSource(
+    int source, vector<ObjectIdP>* result) {
+  PartitionMap::iterator partition = partitions_.find(source);
+  if (partition == partitions_.end()) {
+    return;
+  }
+  const map<string, ObjectIdP>& registrations =
+      partition->second.registrations;
+  for (map<string, ObjectIdP>::const_iterator iter = registrations.begin();
+       iter != registrations.end(); ++iter) {
+    result->push_back(iter->second);
+  }
+}
+
+void PartitionedRegistrationStore::RemoveAllForSource(
+    int source, vector<ObjectIdP>* oids) {
+  PartitionMap::iterator partition = partitions_.find(source);
+  if (partition == partitions_.end()) {
+    return;
+  }
+  const map<string, ObjectIdP>& registrations =
+      partition->second.registrations;
+  for (map<string, ObjectIdP>::const_iterator iter = registrations.begin();
+       iter != registrations.end(); ++iter) {
+    oids->push_back(iter->second);
+    digest_cache_.Erase(iter->second);
+  }
+  num_registrations_ -= registrations.size();
+  partitions_.erase(partition);
+  is_summary_digest_stale_ = true;
+}
+
+size_t PartitionedRegistrationStore::GetAllocatedBytes() const {
+  size_t bytes = MemoryUsage::TreeNodeBytes(partitions_) +
+      digest_cache_.GetAllocatedBytes() +
+      MemoryUsage::StringBytes(summary_digest_);
+  for (PartitionMap::const_iterator iter = partitions_.begin();
+       iter != partitions_.end(); ++iter) {
+    bytes += MemoryUsage::DigestMapBytes(iter->second.registrations) +
+        MemoryUsage::StringBytes(iter->second.digest);
+  }
+  return bytes;
+}
+
+int PartitionedRegistrationStore::UpdateWithMergedDigests(
+    const string& oid_digest_prefix, int prefix_len) {
+  // There are only a handful of sources, so the partition with the smallest
+  // next digest is found by a linear scan rather than with a heap.
+  typedef map<string, ObjectIdP>::const_iterator Iterator;
+  vector<pair<Iterator, Iterator> > cursors;
+  for (PartitionMap::const_iterator iter = partitions_.begin();
+       iter != partitions_.end(); ++iter) {
+    cursors.push_back(make_pair(iter->second.registrations.begin(),
+                                iter->second.registrations.end()));
+  }
+  int num_elements = 0;
+  while (true) {
+    pair<Iterator, Iterator>* next = NULL;
+    for (size_t i = 0; i < cursors.size(); ++i) {
+      if ((cursors[i].first != cursors[i].second) &&
+          ((next == NULL) || (cursors[i].first->first < next->first->first))) {
+        next = &cursors[i];
+      }
+    }
+    if (next == NULL) {
+      return num_elements;
+    }
+    const string& oid_digest = next->first->first;
+    if (ObjectIdDigestUtils::MatchesPrefix(
+            oid_digest, oid_digest_prefix, prefix_len)) {
+      digest_function_->Update(oid_digest);
+      ++num_elements;
+    }
+    ++next->first;
+  }
+}
+
+}  // namespace invalidation
@@ -0,0 +1,162 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation of DigestStore that partitions the objects by their source.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_PARTITIONED_REGISTRATION_STORE_H_
+#define GOOGLE_CACHEINVALIDATION_V2_PARTITIONED_REGISTRATION_STORE_H_
+
+#include <map>
+#include <vector>
+
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/digest-function.h"
+#include "google/cacheinvalidation/v2/digest-store.h"
+#include "google/cacheinvalidation/v2/object-id-digest-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Implementation notes: the objects of each ObjectSource are kept in a
+ * partition of their own, a map from the object digest to the object id, with
+ * its own memoized digest. A change to the objects of one source only marks
+ * that partition's digest stale, so a client whose sources churn at very
+ * different rates rehashes only the partitions of the sources that changed
+ * when it asks for them with GetDigestForSource.
+ *
+ * GetDigest() must still return the digest that the server expects in the
+ * registration summary, i.e., the digest over all the sorted object digests,
+ * so it is not a digest of the partition digests: it merges the (already
+ * sorted) partitions in digest order, without hashing any object again, and
+ * is memoized until the next change to the store.
+ */
+class PartitionedRegistrationStore : public DigestStore<ObjectIdP> {
+ public:
+  explicit PartitionedRegistrationStore(DigestFunction* digest_function)
+      : digest_function_(digest_function),
+        digest_cache_(digest_function),
+        num_registrations_(0),
+        is_summary_digest_stale_(true) {}
+
+  virtual ~PartitionedRegistrationStore() {}
+
+  virtual void Add(const ObjectIdP& oid);
+
+  virtual void Add(const vector<ObjectIdP>& oids);
+
+  virtual void AddWithDigests(const vector<ObjectIdP>& oids,
+                              const vector<string>& digests);
+
+  virtual void Remove(const ObjectIdP& oid);
+
+  virtual void Remove(const vector<ObjectIdP>& oids);
+
+  virtual void RemoveAll(vector<ObjectIdP>* oids);
+
+  virtual bool Contains(const ObjectIdP& oid);
+
+  virtual int size() {
+    return num_registrations_;
+  }
+
+  virtual string GetDigest();
+
+  virtual string GetDigestForPrefix(const string& oid_digest_prefix,
+                                    int prefix_len, int* num_elements);
+
+  virtual void GetElements(const string& oid_digest_prefix, int prefix_len,
+                           vector<ObjectIdP>* result);
+
+  /* Stores in sources the sources that have objects in the store, in
+   * increasing order.
+   */
+  void GetSources(vector<int>* sources);
+
+  /* Returns the digest over the objects of source, computed as GetDigest() is
+   * but over only those objects, and stores their number in num_elements. The
+   * digest is memoized until the objects of source change.
+   */
+  string GetDigestForSource(int source, int* num_elements);
+
+  /* Adds the objects of source to result, in digest order. */
+  void GetElementsForSource(int source, vector<ObjectIdP>* result);
+
+  /* Removes the objects of source and adds them to oids. */
+  void RemoveAllForSource(int source, vector<ObjectIdP>* oids);
+
+  virtual size_t GetAllocatedBytes() const;
+
+  virtual string ToString() {
+    return StringPrintf(
+        "PartitionedRegistrationStore: %d registrations, %d sources",
+        num_registrations_, static_cast<int>(partitions_.size()));
+  }
+
+ private:
+  /* The objects of one source. */
+  struct Partition {
+    Partition() : is_digest_stale(true) {}
+
+    /* The objects mapped from their digests. */
+    map<string, ObjectIdP> registrations;
+
+    /* Whether digest is out of date with respect to registrations. */
+    bool is_digest_stale;
+
+    /* The memoized digest over the objects in registrations. */
+    string digest;
+  };
+
+  typedef map<int, Partition> PartitionMap;
+
+  /* Notes that the objects of partition have changed. */
+  void InvalidateDigests(Partition* partition) {
+    partition->is_digest_stale = true;
+    is_summary_digest_stale_ = true;
+  }
+
+  /* Calls digest_function_->Update on the digests of all the objects whose
+   * digests begin with the first prefix_len bits of oid_digest_prefix, across
+   * all partitions and in sorted order, and returns their number. Does not
+   * reset digest_function_.
+   */
+  int UpdateWithMergedDigests(const string& oid_digest_prefix, int prefix_len);
+
+  /* The function used to compute digests of objects. */
+  DigestFunction* digest_function_;
+
+  /* The digests of the objects in all the partitions, so that each object is
+   * hashed only once while it is in the store.
+   */
+  ObjectIdDigestCache digest_cache_;
+
+  /* The partitions keyed by source. Partitions are removed once empty. */
+  PartitionMap partitions_;
+
+  /* The total number of objects in all the partitions. */
+  int num_registrations_;
+
+  /* Whether summary_digest_ must be recomputed before being returned. */
+  bool is_summary_digest_stale_;
+
+  /* The memoized digest over all the object digests in the store. */
+  string summary_digest_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_PARTITIONED_REGISTRATION_STORE_H_
@@ -16,15 +16,52 @@
 
 #include "google/cacheinvalidation/v2/persistence-utils.h"
 
+#include <string.h>
+
 namespace invalidation {
 
+namespace {
+
+// Wire-format tags of the length-delimited fields of PersistentStateBlob.
+const char kTiclStateTag = (1 << 3) | 2;  // ticl_state = 1
+const char kAuthenticationCodeTag = (2 << 3) | 2;  // authentication_code = 2
+
+// Appends the wire-format encoding of a length-delimited field with the given
+// tag and contents to result.
+void AppendLengthDelimitedField(char tag, const char* data, size_t size,
+                                string* result) {
+  result->push_back(tag);
+  uint32 length = static_cast<uint32>(size);
+  while (length >= 0x80) {
+    result->push_back(static_cast<char>((length & 0x7f) | 0x80));
+    length >>= 7;
+  }
+  result->push_back(static_cast<char>(length));
+  result->append(data, size);
+}
+
+}  // namespace
+
 void PersistenceUtils::SerializeState(
-    PersistentTiclState state, DigestFunction* digest_fn, string* result) {
-  string mac = GenerateMac(state, digest_fn);
-  PersistentStateBlob blob;
-  blob.mutable_ticl_state()->CopyFrom(state);
-  blob.set_authentication_code(mac);
-  blob.SerializeToString(result);
+    const PersistentTiclState& state, DigestFunction* digest_fn,
+    string* result) {
+  string serialized_state;
+  state.SerializeToString(&serialized_state);
+  SerializeStateFromBytes(serialized_state, digest_fn, result);
+}
+
+void PersistenceUtils::SerializeStateFromBytes(
+    const string& serialized_state, DigestFunction* digest_fn,
+    string* result) {
+  char mac[DigestFunction::kMaxDigestSize];
+  int mac_size = GenerateMacFromBytes(serialized_state, digest_fn, mac);
+  // Encode the PersistentStateBlob directly, in field order, as serializing
+  // the message would: it embeds the state's bytes as they are.
+  result->clear();
+  result->reserve(serialized_state.size() + mac_size + 12);
+  AppendLengthDelimitedField(kTiclStateTag, serialized_state.data(),
+                             serialized_state.size(), result);
+  AppendLengthDelimitedField(kAuthenticationCodeTag, mac, mac_size, result);
 }
 
 bool PersistenceUtils::DeserializeState(
@@ -40,10 +77,13 @@ bool PersistenceUtils::DeserializeState(
 
   // Check the mac in the envelope against the recomputed mac from the state.
   ticl_state->CopyFrom(state_blob.ticl_state());
-  const string& mac = GenerateMac(*ticl_state, digest_fn);
-  if (mac != state_blob.authentication_code()) {
+  char mac[DigestFunction::kMaxDigestSize];
+  int mac_size = GenerateMac(*ticl_state, digest_fn, mac);
+  const string& expected_mac = state_blob.authentication_code();
+  if ((mac_size != static_cast<int>(expected_mac.size())) ||
+      (memcmp(mac, expected_mac.data(), mac_size) != 0)) {
     TLOG(logger, WARNING, "Ticl state failed MAC check: computed %s vs %s",
-         mac.c_str(), state_blob.authentication_code().c_str());
+         string(mac, mac_size).c_str(), expected_mac.c_str());
     return false;
   }
   return true;
@@ -51,11 +91,23 @@ bool PersistenceUtils::DeserializeState(
 
 string PersistenceUtils::GenerateMac(
     const PersistentTiclState& state, DigestFunction* digest_fn) {
+  char mac[DigestFunction::kMaxDigestSize];
+  int mac_size = GenerateMac(state, digest_fn, mac);
+  return string(mac, mac_size);
+}
+
+int PersistenceUtils::GenerateMac(
+    const PersistentTiclState& state, DigestFunction* digest_fn, char* mac) {
   string serialized;
   state.SerializeToString(&serialized);
+  return GenerateMacFromBytes(serialized, digest_fn, mac);
+}
+
+int PersistenceUtils::GenerateMacFromBytes(
+    const string& serialized_state, DigestFunction* digest_fn, char* mac) {
   digest_fn->Reset();
-  digest_fn->Update(serialized);
-  return digest_fn->GetDigest();
+  digest_fn->Update(serialized_state.data(), serialized_state.size());
+  return digest_fn->GetDigest(mac, DigestFunction::kMaxDigestSize);
 }
 
 }  // namespace invalidation
@@ -30,7 +30,17 @@ class PersistenceUtils {
  public:
   /* Serializes a Ticl state blob. */
   static void SerializeState(
-      PersistentTiclState state, DigestFunction* digest_fn, string* result);
+      const PersistentTiclState& state, DigestFunction* digest_fn,
+      string* result);
+
+  /* Serializes a Ticl state blob for the state whose serialization is
+   * serialized_state.  The state is not serialized again, neither for its
+   * message authentication code nor for the blob, so callers that already
+   * have its bytes (e.g., to check whether it changed) should use this.
+   */
+  static void SerializeStateFromBytes(
+      const string& serialized_state, DigestFunction* digest_fn,
+      string* result);
 
   /* Deserializes a Ticl state blob. Returns whether the parsed state could be
    * parsed.
@@ -43,6 +53,18 @@ class PersistenceUtils {
   static string GenerateMac(
       const PersistentTiclState& state, DigestFunction* digest_fn);
 
+  /* Stores a message authentication code over state in mac, which must have
+   * room for DigestFunction::kMaxDigestSize bytes, and returns its size.
+   */
+  static int GenerateMac(
+      const PersistentTiclState& state, DigestFunction* digest_fn, char* mac);
+
+  /* Like GenerateMac(const PersistentTiclState&, DigestFunction*, char*), for
+   * the state whose serialization is serialized_state.
+   */
+  static int GenerateMacFromBytes(
+      const string& serialized_state, DigestFunction* digest_fn, char* mac);
+
  private:
   PersistenceUtils() {
     // Prevent instantiation.
@@ -0,0 +1,122 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Writer of a persistent state that coalesces successive writes.
+
+#include "google/cacheinvalidation/v2/persistent-state-writer.h"
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/v2/log-macro.h"
+#include "google/cacheinvalidation/v2/pooled-callback.h"
+
+namespace invalidation {
+
+PersistentStateWriter::PersistentStateWriter(
+    Storage* storage, Scheduler* internal_scheduler, Logger* logger,
+    Statistics* statistics, const string& key,
+    ExponentialBackoffDelayGenerator* retry_backoff,
+    TimeDelta initial_retry_delay)
+    : storage_(storage),
+      internal_scheduler_(internal_scheduler),
+      logger_(logger),
+      statistics_(statistics),
+      key_(key),
+      retry_backoff_(retry_backoff),
+      initial_retry_delay_(initial_retry_delay),
+      has_written_value_(false),
+      is_write_in_flight_(false),
+      has_queued_value_(false),
+      is_retry_scheduled_(false) {
+}
+
+void PersistentStateWriter::Write(const string& value) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (has_queued_value_) {
+    // The queued value has not been written yet and never will be.
+    statistics_->RecordSkippedPersistentWrite();
+  } else if (is_write_in_flight_ ? (value == in_flight_value_) :
+             (has_written_value_ && (value == written_value_))) {
+    TLOG(logger_, FINE, "State unchanged, not writing");
+    statistics_->RecordSkippedPersistentWrite();
+    return;
+  }
+  queued_value_ = value;
+  has_queued_value_ = true;
+  MaybeStartWrite();
+}
+
+void PersistentStateWriter::MaybeStartWrite() {
+  if (is_write_in_flight_ || is_retry_scheduled_ || !has_queued_value_) {
+    return;
+  }
+  has_queued_value_ = false;
+  if (has_written_value_ && (queued_value_ == written_value_)) {
+    // The state changed back to what was last written while a write was
+    // outstanding.
+    statistics_->RecordSkippedPersistentWrite();
+    return;
+  }
+  in_flight_value_.swap(queued_value_);
+  is_write_in_flight_ = true;
+  write_start_time_ = internal_scheduler_->GetCurrentTime();
+  storage_->WriteKey(
+      key_, in_flight_value_,
+      NewPermanentCallback(this, &PersistentStateWriter::WriteCallback));
+}
+
+void PersistentStateWriter::WriteCallback(Status status) {
+  // The storage may call back on any thread.
+  internal_scheduler_->Schedule(
+      Scheduler::NoDelay(),
+      NewPooledCallback(this, &PersistentStateWriter::HandleWriteDone,
+                        status));
+}
+
+void PersistentStateWriter::HandleWriteDone(Status status) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  TLOG(logger_, INFO, "Write state completed: %s", status.message().c_str());
+  is_write_in_flight_ = false;
+  statistics_->RecordPersistentWrite(
+      (internal_scheduler_->GetCurrentTime() - write_start_time_).
+          InMilliseconds());
+  if (status.IsSuccess()) {
+    // Write succeeded - reset the backoff delay.
+    written_value_.swap(in_flight_value_);
+    has_written_value_ = true;
+    retry_backoff_->Reset(initial_retry_delay_);
+    MaybeStartWrite();
+    return;
+  }
+
+  // What the storage holds is now unknown. Retry with exponential backoff,
+  // writing the latest value.
+  statistics_->RecordError(
+      Statistics::ClientErrorType_PERSISTENT_WRITE_FAILURE);
+  has_written_value_ = false;
+  if (!has_queued_value_) {
+    queued_value_.swap(in_flight_value_);
+    has_queued_value_ = true;
+  }
+  is_retry_scheduled_ = true;
+  internal_scheduler_->Schedule(
+      retry_backoff_->GetNextDelay(),
+      NewPooledCallback(this, &PersistentStateWriter::RetryWrite));
+}
+
+void PersistentStateWriter::RetryWrite() {
+  is_retry_scheduled_ = false;
+  MaybeStartWrite();
+}
+
+}  // namespace invalidation
@@ -0,0 +1,117 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Writer of a persistent state that coalesces successive writes.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_PERSISTENT_STATE_WRITER_H_
+#define GOOGLE_CACHEINVALIDATION_V2_PERSISTENT_STATE_WRITER_H_
+
+#include <string>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/exponential-backoff-delay-generator.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/statistics.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
+#include "google/cacheinvalidation/v2/time.h"
+#include "google/cacheinvalidation/v2/types.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+
+/* Writes successive values of a state to one key of a Storage, with at most
+ * one write outstanding at a time. A value given while a write is in flight
+ * (or waiting to be retried) is queued, replacing any value queued before it,
+ * so that only the latest value is written next. A value equal to the one last
+ * written (or being written) is not written again. Failed writes are retried,
+ * with the latest value, after an exponential backoff delay.
+ *
+ * Records in Statistics the latency of the writes, the writes skipped, and the
+ * failures.
+ *
+ * All methods must be called on the internal thread of the scheduler.
+ */
+class PersistentStateWriter {
+ public:
+  /* Creates a writer of key in storage, which runs on internal_scheduler.
+   * retry_backoff, which is owned by this after the call, gives the delays
+   * before retrying failed writes; it is reset to initial_retry_delay after a
+   * successful write.
+   */
+  PersistentStateWriter(
+      Storage* storage, Scheduler* internal_scheduler, Logger* logger,
+      Statistics* statistics, const string& key,
+      ExponentialBackoffDelayGenerator* retry_backoff,
+      TimeDelta initial_retry_delay);
+
+  /* Writes value to the key, or queues it to be written after the outstanding
+   * write.
+   */
+  void Write(const string& value);
+
+  /* Returns whether a write is outstanding (in flight or waiting to be
+   * retried) or queued.
+   */
+  bool HasPendingWrite() const {
+    return is_write_in_flight_ || is_retry_scheduled_ || has_queued_value_;
+  }
+
+ private:
+  /* Starts writing the queued value, if any, unless a write is outstanding. */
+  void MaybeStartWrite();
+
+  /* Called by the storage when the write in flight finishes. */
+  void WriteCallback(Status status);
+
+  /* Handles the result of the write in flight on the internal thread. */
+  void HandleWriteDone(Status status);
+
+  /* Retries writing after a failure. */
+  void RetryWrite();
+
+  Storage* storage_;
+  Scheduler* internal_scheduler_;
+  Logger* logger_;
+  Statistics* statistics_;
+
+  /* The key to which the state is written. */
+  string key_;
+
+  /* Exponential backoff generator for retrying failed writes. */
+  scoped_ptr<ExponentialBackoffDelayGenerator> retry_backoff_;
+
+  /* The delay to which retry_backoff_ is reset after a successful write. */
+  TimeDelta initial_retry_delay_;
+
+  /* The value last written successfully, if any. */
+  string written_value_;
+  bool has_written_value_;
+
+  /* The value being written, if any, and when the write started. */
+  string in_flight_value_;
+  bool is_write_in_flight_;
+  Time write_start_time_;
+
+  /* The value to write next, if any. */
+  string queued_value_;
+  bool has_queued_value_;
+
+  /* Whether a retry of a failed write is scheduled. */
+  bool is_retry_scheduled_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_PERSISTENT_STATE_WRITER_H_
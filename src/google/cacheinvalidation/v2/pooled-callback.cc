@@ -0,0 +1,114 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Closures for per-event tasks whose memory is recycled through a pool.
+
+#include "google/cacheinvalidation/v2/pooled-callback.h"
+
+#include <pthread.h>
+
+#include <new>
+
+namespace invalidation {
+
+// A free block, linked to the next one of its size class.
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+// The free blocks of a thread, in each size class, and their numbers.
+struct ThreadBlockCache {
+  FreeBlock* free_blocks[CallbackPool::kNumSizeClasses];
+  int num_free_blocks[CallbackPool::kNumSizeClasses];
+
+  // Whether the blocks are freed when the thread exits.
+  bool frees_at_exit;
+};
+
+static __thread ThreadBlockCache thread_block_cache;
+
+// Key whose value is set in the threads that have kept blocks, so that they
+// go back to the heap when the thread exits.
+static pthread_key_t thread_exit_key;
+static pthread_once_t thread_exit_key_once = PTHREAD_ONCE_INIT;
+
+// Frees the blocks kept by the exiting thread.
+static void FreeThreadBlocks(void* unused) {
+  ThreadBlockCache* cache = &thread_block_cache;
+  for (int i = 0; i < CallbackPool::kNumSizeClasses; ++i) {
+    while (cache->free_blocks[i] != NULL) {
+      FreeBlock* block = cache->free_blocks[i];
+      cache->free_blocks[i] = block->next;
+      ::operator delete(block);
+    }
+    cache->num_free_blocks[i] = 0;
+  }
+}
+
+static void CreateThreadExitKey() {
+  pthread_key_create(&thread_exit_key, &FreeThreadBlocks);
+}
+
+void* CallbackPool::Allocate(size_t size) {
+  int size_class = GetSizeClass(size);
+  if (size_class < 0) {
+    return ::operator new(size);
+  }
+  ThreadBlockCache* cache = &thread_block_cache;
+  FreeBlock* block = cache->free_blocks[size_class];
+  if (block != NULL) {
+    cache->free_blocks[size_class] = block->next;
+    --cache->num_free_blocks[size_class];
+    return block;
+  }
+  return ::operator new(kMinBlockSize << size_class);
+}
+
+void CallbackPool::Free(void* block, size_t size) {
+  int size_class = GetSizeClass(size);
+  ThreadBlockCache* cache = &thread_block_cache;
+  if ((size_class >= 0) &&
+      (cache->num_free_blocks[size_class] < kMaxFreeBlocksPerClass)) {
+    if (!cache->frees_at_exit) {
+      pthread_once(&thread_exit_key_once, &CreateThreadExitKey);
+      pthread_setspecific(thread_exit_key, cache);
+      cache->frees_at_exit = true;
+    }
+    FreeBlock* free_block = static_cast<FreeBlock*>(block);
+    free_block->next = cache->free_blocks[size_class];
+    cache->free_blocks[size_class] = free_block;
+    ++cache->num_free_blocks[size_class];
+    return;
+  }
+  ::operator delete(block);
+}
+
+int CallbackPool::GetNumFreeBlocksForTest() {
+  int num_blocks = 0;
+  for (int i = 0; i < kNumSizeClasses; ++i) {
+    num_blocks += thread_block_cache.num_free_blocks[i];
+  }
+  return num_blocks;
+}
+
+int CallbackPool::GetSizeClass(size_t size) {
+  for (int i = 0; i < kNumSizeClasses; ++i) {
+    if (size <= (kMinBlockSize << i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+}  // namespace invalidation
@@ -0,0 +1,298 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Closures for per-event tasks whose memory is recycled through a pool.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_POOLED_CALLBACK_H_
+#define GOOGLE_CACHEINVALIDATION_V2_POOLED_CALLBACK_H_
+
+#include <algorithm>
+#include <cstddef>
+
+#include "google/cacheinvalidation/callback.h"
+
+namespace invalidation {
+
+/* A pool of memory blocks for closures, in a few size classes, with a free
+ * list per thread so that no lock is taken. Freed blocks are kept by the
+ * freeing thread (up to a bound per size class) and handed out again to the
+ * closures it creates instead of going back to the heap, so that threads that
+ * run and delete the tasks they schedule (e.g., the internal thread) do not
+ * cost a malloc and free per task once warm. Blocks freed past the bound, or
+ * kept by a thread when it exits, go back to the heap, as do sizes above the
+ * largest class.
+ */
+class CallbackPool {
+ public:
+  /* Returns a block of at least size bytes. */
+  static void* Allocate(size_t size);
+
+  /* Takes back block, of size bytes, as returned by Allocate. */
+  static void Free(void* block, size_t size);
+
+  /* Returns the number of blocks kept for reuse by the calling thread. */
+  static int GetNumFreeBlocksForTest();
+
+  /* The smallest block size. Size class i has blocks of kMinBlockSize << i
+   * bytes.
+   */
+  static const size_t kMinBlockSize = 64;
+
+  /* Number of size classes. */
+  static const int kNumSizeClasses = 4;
+
+  /* Largest number of blocks kept per size class by each thread. */
+  static const int kMaxFreeBlocksPerClass = 256;
+
+ private:
+  /* Returns the size class for blocks of size bytes, or -1 if they are too
+   * large for the pool.
+   */
+  static int GetSizeClass(size_t size);
+};
+
+/* Base of the closures allocated from the pool. Like the closures of
+ * NewPermanentCallback, they are repeatable and deleted by whoever owns them
+ * (e.g., the scheduler they are given to), as any other Closure.
+ */
+class PooledClosure : public Closure {
+ public:
+  virtual ~PooledClosure() {}
+
+  virtual bool IsRepeatable() const {
+    return true;
+  }
+
+  static void* operator new(size_t size) {
+    return CallbackPool::Allocate(size);
+  }
+
+  static void operator delete(void* closure, size_t size) {
+    CallbackPool::Free(closure, size);
+  }
+};
+
+/* The type in which a closure stores an argument of type T, i.e., T without
+ * const reference.
+ */
+template <class T>
+struct PooledCallbackArg {
+  typedef T type;
+};
+
+template <class T>
+struct PooledCallbackArg<const T&> {
+  typedef T type;
+};
+
+/* Closure calling a method with no arguments. */
+template <class T>
+class PooledMethodClosure0 : public PooledClosure {
+ public:
+  typedef void (T::*Method)();
+
+  PooledMethodClosure0(T* object, Method method)
+      : object_(object), method_(method) {}
+
+  virtual void Run() {
+    (object_->*method_)();
+  }
+
+ private:
+  T* object_;
+  Method method_;
+};
+
+/* Closure calling a method with one bound argument. */
+template <class T, class P1>
+class PooledMethodClosure1 : public PooledClosure {
+ public:
+  typedef void (T::*Method)(P1);
+  typedef typename PooledCallbackArg<P1>::type A1;
+
+  PooledMethodClosure1(T* object, Method method, const A1& a1)
+      : object_(object), method_(method), a1_(a1) {}
+
+  virtual void Run() {
+    (object_->*method_)(a1_);
+  }
+
+ private:
+  T* object_;
+  Method method_;
+  A1 a1_;
+};
+
+/* Closure calling a method with two bound arguments. */
+template <class T, class P1, class P2>
+class PooledMethodClosure2 : public PooledClosure {
+ public:
+  typedef void (T::*Method)(P1, P2);
+  typedef typename PooledCallbackArg<P1>::type A1;
+  typedef typename PooledCallbackArg<P2>::type A2;
+
+  PooledMethodClosure2(T* object, Method method, const A1& a1, const A2& a2)
+      : object_(object), method_(method), a1_(a1), a2_(a2) {}
+
+  virtual void Run() {
+    (object_->*method_)(a1_, a2_);
+  }
+
+ private:
+  T* object_;
+  Method method_;
+  A1 a1_;
+  A2 a2_;
+};
+
+/* Closure calling a method with three bound arguments. */
+template <class T, class P1, class P2, class P3>
+class PooledMethodClosure3 : public PooledClosure {
+ public:
+  typedef void (T::*Method)(P1, P2, P3);
+  typedef typename PooledCallbackArg<P1>::type A1;
+  typedef typename PooledCallbackArg<P2>::type A2;
+  typedef typename PooledCallbackArg<P3>::type A3;
+
+  PooledMethodClosure3(T* object, Method method, const A1& a1, const A2& a2,
+                       const A3& a3)
+      : object_(object), method_(method), a1_(a1), a2_(a2), a3_(a3) {}
+
+  virtual void Run() {
+    (object_->*method_)(a1_, a2_, a3_);
+  }
+
+ private:
+  T* object_;
+  Method method_;
+  A1 a1_;
+  A2 a2_;
+  A3 a3_;
+};
+
+/* Closure calling a method with four bound arguments. */
+template <class T, class P1, class P2, class P3, class P4>
+class PooledMethodClosure4 : public PooledClosure {
+ public:
+  typedef void (T::*Method)(P1, P2, P3, P4);
+  typedef typename PooledCallbackArg<P1>::type A1;
+  typedef typename PooledCallbackArg<P2>::type A2;
+  typedef typename PooledCallbackArg<P3>::type A3;
+  typedef typename PooledCallbackArg<P4>::type A4;
+
+  PooledMethodClosure4(T* object, Method method, const A1& a1, const A2& a2,
+                       const A3& a3, const A4& a4)
+      : object_(object), method_(method), a1_(a1), a2_(a2), a3_(a3),
+        a4_(a4) {}
+
+  virtual void Run() {
+    (object_->*method_)(a1_, a2_, a3_, a4_);
+  }
+
+ private:
+  T* object_;
+  Method method_;
+  A1 a1_;
+  A2 a2_;
+  A3 a3_;
+  A4 a4_;
+};
+
+/* Closure calling a method with two bound arguments, the second of which it
+ * takes from the caller by swapping instead of copying.
+ */
+template <class T, class P1, class P2>
+class PooledSwapMethodClosure2 : public PooledClosure {
+ public:
+  typedef void (T::*Method)(P1, P2);
+  typedef typename PooledCallbackArg<P1>::type A1;
+  typedef typename PooledCallbackArg<P2>::type A2;
+
+  PooledSwapMethodClosure2(T* object, Method method, const A1& a1, A2* a2)
+      : object_(object), method_(method), a1_(a1) {
+    using std::swap;
+    swap(a2_, *a2);
+  }
+
+  virtual void Run() {
+    (object_->*method_)(a1_, a2_);
+  }
+
+ private:
+  T* object_;
+  Method method_;
+  A1 a1_;
+  A2 a2_;
+};
+
+/* Returns a pooled closure that calls method on object (of class T or a
+ * subclass) with the given arguments, which it keeps copies of (like
+ * NewPermanentCallback).
+ */
+template <class O, class T>
+Closure* NewPooledCallback(O* object, void (T::*method)()) {
+  return new PooledMethodClosure0<T>(object, method);
+}
+
+template <class O, class T, class P1>
+Closure* NewPooledCallback(
+    O* object, void (T::*method)(P1),
+    const typename PooledCallbackArg<P1>::type& a1) {
+  return new PooledMethodClosure1<T, P1>(object, method, a1);
+}
+
+template <class O, class T, class P1, class P2>
+Closure* NewPooledCallback(
+    O* object, void (T::*method)(P1, P2),
+    const typename PooledCallbackArg<P1>::type& a1,
+    const typename PooledCallbackArg<P2>::type& a2) {
+  return new PooledMethodClosure2<T, P1, P2>(object, method, a1, a2);
+}
+
+template <class O, class T, class P1, class P2, class P3>
+Closure* NewPooledCallback(
+    O* object, void (T::*method)(P1, P2, P3),
+    const typename PooledCallbackArg<P1>::type& a1,
+    const typename PooledCallbackArg<P2>::type& a2,
+    const typename PooledCallbackArg<P3>::type& a3) {
+  return new PooledMethodClosure3<T, P1, P2, P3>(object, method, a1, a2, a3);
+}
+
+template <class O, class T, class P1, class P2, class P3, class P4>
+Closure* NewPooledCallback(
+    O* object, void (T::*method)(P1, P2, P3, P4),
+    const typename PooledCallbackArg<P1>::type& a1,
+    const typename PooledCallbackArg<P2>::type& a2,
+    const typename PooledCallbackArg<P3>::type& a3,
+    const typename PooledCallbackArg<P4>::type& a4) {
+  return new PooledMethodClosure4<T, P1, P2, P3, P4>(
+      object, method, a1, a2, a3, a4);
+}
+
+/* Like NewPooledCallback, but takes the second argument from *a2, which is
+ * left as default-constructed, so that a large argument (e.g., a batch of
+ * events) is handed to the closure without a copy. The argument type must be
+ * default-constructible and swappable.
+ */
+template <class O, class T, class P1, class P2>
+Closure* NewPooledSwapCallback(
+    O* object, void (T::*method)(P1, P2),
+    const typename PooledCallbackArg<P1>::type& a1,
+    typename PooledCallbackArg<P2>::type* a2) {
+  return new PooledSwapMethodClosure2<T, P1, P2>(object, method, a1, a2);
+}
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_POOLED_CALLBACK_H_
@@ -43,6 +43,26 @@ void ProtoConverter::ConvertFromInvalidationProto(
   } else {
     invalidation->Init(object_id, invalidation_proto.version());
   }
+  if (invalidation_proto.has_payload_reference()) {
+    invalidation->set_payload_reference(
+        invalidation_proto.payload_reference());
+  }
+}
+
+void ProtoConverter::ConvertFromInvalidationProtoTakingPayload(
+    InvalidationP* invalidation_proto, Invalidation* invalidation) {
+  ObjectId object_id;
+  ConvertFromObjectIdProto(invalidation_proto->object_id(), &object_id);
+  if (invalidation_proto->has_payload()) {
+    invalidation->InitTakingPayload(object_id, invalidation_proto->version(),
+                                    invalidation_proto->mutable_payload());
+  } else {
+    invalidation->Init(object_id, invalidation_proto->version());
+  }
+  if (invalidation_proto->has_payload_reference()) {
+    invalidation->set_payload_reference(
+        invalidation_proto->payload_reference());
+  }
 }
 
 void ProtoConverter::ConvertToInvalidationProto(
@@ -53,6 +73,10 @@ void ProtoConverter::ConvertToInvalidationProto(
   if (invalidation.has_payload()) {
     invalidation_proto->set_payload(invalidation.payload());
   }
+  if (invalidation.has_payload_reference()) {
+    invalidation_proto->set_payload_reference(
+        invalidation.payload_reference());
+  }
 }
 
 }  // namespace invalidation
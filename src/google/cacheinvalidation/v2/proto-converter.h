@@ -43,6 +43,12 @@ class ProtoConverter {
   static void ConvertFromInvalidationProto(
       const InvalidationP& invalidation_proto, Invalidation* invalidation);
 
+  /* Like ConvertFromInvalidationProto, but takes the payload out of
+   * 'invalidation_proto' instead of copying it, leaving it empty.
+   */
+  static void ConvertFromInvalidationProtoTakingPayload(
+      InvalidationP* invalidation_proto, Invalidation* invalidation);
+
   /* Converts an invalidation to the corresponding protocol
    * buffer and returns it.
    */
@@ -211,9 +211,20 @@ DEFINE_TO_STRING(InfoRequestMessage) {
   END();
 }
 
+DEFINE_TO_STRING(RateLimitP) {
+  BEGIN();
+  OPTIONAL(window_ms);
+  OPTIONAL(count);
+  END();
+}
+
 DEFINE_TO_STRING(ConfigChangeMessage) {
   BEGIN();
   OPTIONAL(next_message_delay_ms);
+  OPTIONAL(max_token_backoff_delay_ms);
+  OPTIONAL(batching_delay_ms);
+  OPTIONAL(heartbeat_interval_ms);
+  REPEATED(rate_limit);
   END();
 }
 
@@ -240,17 +251,29 @@ DEFINE_TO_STRING(ErrorMessage) {
   END();
 }
 
-DEFINE_TO_STRING(RegistrationSummary) {
+DEFINE_TO_STRING(ObjectIdP) {
   BEGIN();
+  OPTIONAL(source);
+  OPTIONAL(name);
+  OPTIONAL(shared_name_prefix_length);
+  END();
+}
+
+DEFINE_TO_STRING(RegistrationSubtree) {
+  BEGIN();
+  REPEATED(registered_object);
+  OPTIONAL(digest_prefix);
+  OPTIONAL(prefix_len);
   OPTIONAL(num_registrations);
   OPTIONAL(registration_digest);
   END();
 }
 
-DEFINE_TO_STRING(ObjectIdP) {
+DEFINE_TO_STRING(RegistrationSummary) {
   BEGIN();
-  OPTIONAL(source);
-  OPTIONAL(name);
+  OPTIONAL(num_registrations);
+  OPTIONAL(registration_digest);
+  REPEATED(subtree_summary);
   END();
 }
 
@@ -260,6 +283,7 @@ DEFINE_TO_STRING(InvalidationP) {
   OPTIONAL(is_known_version);
   OPTIONAL(version);
   OPTIONAL(payload);
+  OPTIONAL(payload_reference);
   END();
 }
 
@@ -282,6 +306,14 @@ DEFINE_TO_STRING(StatusP) {
   END();
 }
 
+DEFINE_TO_STRING(PayloadP) {
+  BEGIN();
+  OPTIONAL(payload_reference);
+  OPTIONAL(status);
+  OPTIONAL(payload);
+  END();
+}
+
 DEFINE_TO_STRING(RegistrationP) {
   BEGIN();
   OPTIONAL(object_id);
@@ -313,6 +345,10 @@ DEFINE_TO_STRING(InitializeMessage) {
   OPTIONAL(nonce);
   OPTIONAL(application_client_id);
   OPTIONAL(digest_serialization_type);
+  OPTIONAL(max_inline_payload_size);
+  OPTIONAL(omit_payloads);
+  OPTIONAL(supports_catch_up);
+  REPEATED(catch_up_version);
   END();
 }
 
@@ -328,14 +364,15 @@ DEFINE_TO_STRING(InvalidationMessage) {
   END();
 }
 
-DEFINE_TO_STRING(RegistrationSubtree) {
+DEFINE_TO_STRING(RegistrationSyncMessage) {
   BEGIN();
-  REPEATED(registered_object);
+  REPEATED(subtree);
   END();
 }
-DEFINE_TO_STRING(RegistrationSyncMessage) {
+
+DEFINE_TO_STRING(PayloadFetchMessage) {
   BEGIN();
-  REPEATED(subtree);
+  REPEATED(payload_reference);
   END();
 }
 
@@ -347,6 +384,7 @@ DEFINE_TO_STRING(ClientToServerMessage) {
   OPTIONAL(registration_sync_message);
   OPTIONAL(invalidation_ack_message);
   OPTIONAL(info_message);
+  OPTIONAL(payload_fetch_message);
   END();
 }
 
@@ -357,6 +395,7 @@ DEFINE_TO_STRING(ServerHeader) {
   OPTIONAL(registration_summary);
   OPTIONAL(server_time_ms);
   OPTIONAL(message_id);
+  REPEATED(acked_message_id);
   END();
 }
 
@@ -372,6 +411,12 @@ DEFINE_TO_STRING(RegistrationStatusMessage) {
   END();
 }
 
+DEFINE_TO_STRING(PayloadMessage) {
+  BEGIN();
+  REPEATED(payload);
+  END();
+}
+
 DEFINE_TO_STRING(ServerToClientMessage) {
   BEGIN();
   OPTIONAL(header);
@@ -380,6 +425,7 @@ DEFINE_TO_STRING(ServerToClientMessage) {
   OPTIONAL(registration_status_message);
   OPTIONAL(registration_sync_request_message);
   OPTIONAL(info_request_message);
+  OPTIONAL(payload_message);
   END();
 }
 
@@ -76,6 +76,14 @@ struct ProtoCompareLess {
 
   bool operator()(const RegistrationSubtree& reg_subtree1,
                   const RegistrationSubtree& reg_subtree2) const {
+    // Subtrees for different ranges of the object space are different even if
+    // they hold the same objects (e.g., none).
+    if (reg_subtree1.prefix_len() != reg_subtree2.prefix_len()) {
+      return reg_subtree1.prefix_len() < reg_subtree2.prefix_len();
+    }
+    if (reg_subtree1.digest_prefix() != reg_subtree2.digest_prefix()) {
+      return reg_subtree1.digest_prefix() < reg_subtree2.digest_prefix();
+    }
     const RepeatedPtrField<ObjectIdP>& objects1 =
         reg_subtree1.registered_object();
     const RepeatedPtrField<ObjectIdP>& objects2 =
@@ -16,9 +16,15 @@
 
 #include "google/cacheinvalidation/v2/protocol-handler.h"
 
+#include <algorithm>
+
 #include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/compression-utils.h"
 #include "google/cacheinvalidation/v2/constants.h"
 #include "google/cacheinvalidation/v2/log-macro.h"
+#include "google/cacheinvalidation/v2/memory-usage.h"
+#include "google/cacheinvalidation/v2/object-name-coding.h"
+#include "google/cacheinvalidation/v2/pooled-callback.h"
 #include "google/cacheinvalidation/v2/proto-helpers.h"
 
 namespace invalidation {
@@ -28,35 +34,76 @@ using ::ipc::invalidation::InfoMessage;
 using ::ipc::invalidation::InitializeMessage;
 using ::ipc::invalidation::InitializeMessage_DigestSerializationType_BYTE_BASED;
 using ::ipc::invalidation::InvalidationMessage;
+using ::ipc::invalidation::PayloadFetchMessage;
 using ::ipc::invalidation::PropertyRecord;
+using ::ipc::invalidation::RateLimitP;
 using ::ipc::invalidation::RegistrationMessage;
 using ::ipc::invalidation::RegistrationSyncMessage;
 using ::ipc::invalidation::ServerHeader;
 using ::ipc::invalidation::ServerToClientMessage;
 using ::ipc::invalidation::TokenControlMessage;
+using INVALIDATION_STL_NAMESPACE::max;
+using INVALIDATION_STL_NAMESPACE::min;
+using INVALIDATION_STL_NAMESPACE::sort;
 
 ProtocolHandler::ProtocolHandler(
     const Config& config, SystemResources* resources, Statistics* statistics,
     const string& application_name, ProtocolListener* listener,
-    TiclMessageValidator* msg_validator)
+    TiclMessageValidator* msg_validator, EventLog* event_log)
     : resources_(resources),
       logger_(resources->logger()),
       internal_scheduler_(resources->internal_scheduler()),
-      throttled_message_sender_(config.rate_limits, internal_scheduler_,
-                NewPermanentCallback(
-                    this, &ProtocolHandler::SendMessageToServer)),
       listener_(listener),
       operation_scheduler_(new OperationScheduler(
           logger_, internal_scheduler_)),
       msg_validator_(msg_validator),
+      event_log_(event_log),
+      max_operations_per_message_(config.max_operations_per_message),
+      outbound_validation_interval_(config.outbound_validation_interval),
+      info_message_shedding_deficit_(config.info_message_shedding_deficit),
+      messages_until_validation_(0),
+      adaptive_batching_(config.adaptive_batching),
+      min_batching_delay_(config.min_batching_delay),
+      max_batching_delay_(config.batching_delay),
+      urgent_object_sources_(config.urgent_object_sources.begin(),
+                             config.urgent_object_sources.end()),
+      max_pending_registrations_per_source_(
+          config.max_pending_registrations_per_source),
+      fair_queue_registrations_(config.fair_queue_registrations),
+      is_batching_(false),
+      batch_start_time_ms_(0),
+      num_batched_arrivals_(0),
+      last_message_sent_time_ms_(0),
+      pause_while_offline_(config.pause_while_offline),
+      is_network_online_(true),
+      has_deferred_message_(false),
+      max_messages_in_flight_(max(config.max_messages_in_flight, 0)),
+      message_ack_timeout_(config.message_ack_timeout),
+      enable_compression_(config.enable_compression),
+      min_compressed_message_size_(config.min_compressed_message_size),
+      server_accepts_compression_(false),
+      front_code_object_names_(config.front_code_object_names),
+      server_accepts_front_coding_(false),
       message_id_(1),
+      next_trace_id_(0),
       last_known_server_time_ms_(0),
       next_message_send_time_ms_(0),
+      max_inline_payload_size_(config.max_inline_payload_size),
+      omit_payloads_(config.omit_payloads),
       pending_initialize_message_(NULL),
       pending_info_message_(NULL),
       statistics_(statistics),
       batching_task_(NewPermanentCallback(
-          this, &ProtocolHandler::BatchingTask)) {
+          this, &ProtocolHandler::BatchingTask)),
+      priority_batching_operation_(NULL),
+      retransmit_operation_(NULL) {
+  CHECK(max_operations_per_message_ > 0) <<
+      "max_operations_per_message must be positive: given " <<
+      max_operations_per_message_;
+  CHECK(outbound_validation_interval_ >= 0) <<
+      "outbound_validation_interval must not be negative: given " <<
+      outbound_validation_interval_;
+
   // Initialize client version.
   client_version_.mutable_version()->set_major_version(
       Constants::kClientMajorVersion);
@@ -65,27 +112,56 @@ ProtocolHandler::ProtocolHandler(
   client_version_.set_platform(resources->platform());
   client_version_.set_language("C++");
   client_version_.set_application_info(application_name);
+  outbound_encoder_.reset(new OutboundMessageEncoder(client_version_));
 
-  operation_scheduler_->SetOperation(
+  throttled_message_sender_.reset(NewThrottle(
+      config, config.rate_limits, &rate_budget_,
+      NewPermanentCallback(
+          this, &ProtocolHandler::SendMessageToServer, false)));
+  batching_operation_ = operation_scheduler_->SetOperation(
       config.batching_delay, batching_task_.get(), "[batching task]");
+  if (config.enable_priority_lane) {
+    priority_message_sender_.reset(NewThrottle(
+        config, config.priority_rate_limits, &priority_rate_budget_,
+        NewPermanentCallback(
+            this, &ProtocolHandler::SendMessageToServer, true)));
+    priority_batching_task_.reset(NewPermanentCallback(
+        this, &ProtocolHandler::PriorityBatchingTask));
+    priority_batching_operation_ = operation_scheduler_->SetOperation(
+        config.priority_batching_delay, priority_batching_task_.get(),
+        "[priority batching task]");
+  }
+  if (max_messages_in_flight_ > 0) {
+    retransmit_task_.reset(NewPermanentCallback(
+        this, &ProtocolHandler::RetransmitTask));
+    retransmit_operation_ = operation_scheduler_->SetOperation(
+        message_ack_timeout_, retransmit_task_.get(), "[retransmit task]");
+  }
 
   // Install ourselves as a receiver for server messages.
-  resources_->network()->SetMessageReceiver(
+  resources_->network()->SetMessageBufferReceiver(
       NewPermanentCallback(this, &ProtocolHandler::MessageReceiver));
 
   resources_->network()->AddNetworkStatusReceiver(
       NewPermanentCallback(this, &ProtocolHandler::NetworkStatusReceiver));
 }
 
-void ProtocolHandler::HandleIncomingMessage(string incoming_message) {
+void ProtocolHandler::HandleIncomingMessage(
+    const ReceivedMessage& received_message) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
-  ServerToClientMessage message;
+  TICL_TRACE(TRACE_MESSAGE_HANDLING_STARTED, received_message.trace_id);
+  const string& incoming_message = received_message.message;
+  // ParseFromString clears the message first; the memory it holds is kept.
+  ServerToClientMessage& message = incoming_message_;
   message.ParseFromString(incoming_message);
   if (!message.IsInitialized()) {
+    TICL_EVENT(event_log_, EVENT_MESSAGE_REJECTED, received_message.trace_id,
+               incoming_message.size());
     TLOG(logger_, WARNING, "Incoming message is unparseable: %s",
          ProtoHelpers::ToString(incoming_message).c_str());
     return;
   }
+  RecordReceivedBytes(message, static_cast<int>(incoming_message.size()));
 
   // Validate the message. If this passes, we can blindly assume valid messages
   // from here on.
@@ -93,6 +169,8 @@ void ProtocolHandler::HandleIncomingMessage(string incoming_message) {
        ProtoHelpers::ToString(message).c_str());
 
   if (!msg_validator_->IsValid(message)) {
+    TICL_EVENT(event_log_, EVENT_MESSAGE_REJECTED, received_message.trace_id,
+               incoming_message.size());
     statistics_->RecordError(
         Statistics::ClientErrorType_INCOMING_MESSAGE_FAILURE);
     TLOG(logger_, SEVERE, "Received invalid message: %s",
@@ -101,12 +179,16 @@ void ProtocolHandler::HandleIncomingMessage(string incoming_message) {
   }
 
   statistics_->RecordReceivedMessage(Statistics::ReceivedMessageType_TOTAL);
+  TICL_TRACE(TRACE_MESSAGE_VALIDATED, received_message.trace_id);
+  TICL_EVENT(event_log_, EVENT_MESSAGE_RECEIVED, received_message.trace_id,
+             incoming_message.size());
 
   // Construct a representation of the message header.
   const ServerHeader& message_header = message.header();
   ServerMessageHeader header(
       message_header.client_token(),
-      message_header.registration_summary());
+      message_header.registration_summary(), received_message.receive_time,
+      received_message.trace_id);
 
   // Check the version of the message
   if (message_header.protocol_version().version().major_version() !=
@@ -118,9 +200,9 @@ void ProtocolHandler::HandleIncomingMessage(string incoming_message) {
     return;
   }
 
-  // Check if it is a ConfigChangeMessage which indicates that messages should
-  // no longer be sent for a certain duration. Perform this check before the
-  // token is even checked.
+  // Check if it is a ConfigChangeMessage, which may indicate that messages
+  // should no longer be sent for a certain duration or change the client's
+  // parameters. Perform this check before the token is even checked.
   if (message.has_config_change_message()) {
     const ConfigChangeMessage& config_change_msg =
         message.config_change_message();
@@ -129,6 +211,7 @@ void ProtocolHandler::HandleIncomingMessage(string incoming_message) {
       next_message_send_time_ms_ = GetCurrentTimeMs() +
           config_change_msg.next_message_delay_ms();
     }
+    HandleConfigChange(config_change_msg);
     return;  // Ignore all other messages in the envelope.
   }
 
@@ -137,9 +220,19 @@ void ProtocolHandler::HandleIncomingMessage(string incoming_message) {
     return;
   }
 
+  HandleMessageAcks(message_header);
+
   if (message_header.server_time_ms() > last_known_server_time_ms_) {
     last_known_server_time_ms_ = message_header.server_time_ms();
   }
+  server_accepts_compression_ =
+      message_header.has_accepted_compression_type() &&
+      (message_header.accepted_compression_type() ==
+       InitializeMessage_CompressionType_DEFLATE);
+  server_accepts_front_coding_ =
+      message_header.has_accepted_name_encoding() &&
+      (message_header.accepted_name_encoding() ==
+       InitializeMessage_NameEncoding_FRONT_CODED);
 
   // Invoke callbacks as appropriate.
   if (message.has_token_control_message()) {
@@ -172,8 +265,16 @@ void ProtocolHandler::HandleIncomingMessage(string incoming_message) {
   if (message.has_invalidation_message()) {
     statistics_->RecordReceivedMessage(
         Statistics::ReceivedMessageType_INVALIDATION);
-    listener_->HandleInvalidations(
-        header, message.invalidation_message().invalidation());
+    RepeatedPtrField<InvalidationP>* invalidations =
+        message.mutable_invalidation_message()->mutable_invalidation();
+    if (omit_payloads_) {
+      // A server that does not know the option still sends payloads.
+      for (int i = 0; i < invalidations->size(); ++i) {
+        invalidations->Mutable(i)->clear_payload();
+        invalidations->Mutable(i)->clear_payload_reference();
+      }
+    }
+    listener_->HandleInvalidations(header, invalidations);
   }
   if (message.has_registration_status_message()) {
     statistics_->RecordReceivedMessage(
@@ -199,6 +300,11 @@ void ProtocolHandler::HandleIncomingMessage(string incoming_message) {
         header, message.error_message().code(),
         message.error_message().description());
   }
+  if (message.has_payload_message()) {
+    statistics_->RecordReceivedMessage(Statistics::ReceivedMessageType_PAYLOAD);
+    listener_->HandlePayloads(
+        header, message.mutable_payload_message()->mutable_payload());
+  }
 }
 
 bool ProtocolHandler::CheckServerToken(const string& server_token) {
@@ -227,7 +333,8 @@ bool ProtocolHandler::CheckServerToken(const string& server_token) {
 
 void ProtocolHandler::SendInitializeMessage(
     int client_type, const ApplicationClientIdP& application_client_id,
-    const string& nonce, const string& debug_string) {
+    const string& nonce, const vector<InvalidationP>* catch_up_versions,
+    const string& debug_string) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
 
   // Simply store the message in pending_initialize_message_ and send it
@@ -239,11 +346,33 @@ void ProtocolHandler::SendInitializeMessage(
   pending_initialize_message_->set_nonce(nonce);
   pending_initialize_message_->set_digest_serialization_type(
       InitializeMessage_DigestSerializationType_BYTE_BASED);
+  if (enable_compression_) {
+    pending_initialize_message_->add_supported_compression_type(
+        InitializeMessage_CompressionType_DEFLATE);
+  }
+  if (front_code_object_names_) {
+    pending_initialize_message_->add_supported_name_encoding(
+        InitializeMessage_NameEncoding_FRONT_CODED);
+  }
+  if (max_inline_payload_size_ > 0) {
+    pending_initialize_message_->set_max_inline_payload_size(
+        max_inline_payload_size_);
+  }
+  if (omit_payloads_) {
+    pending_initialize_message_->set_omit_payloads(true);
+  }
+  if (catch_up_versions != NULL) {
+    pending_initialize_message_->set_supports_catch_up(true);
+    for (size_t i = 0; i < catch_up_versions->size(); ++i) {
+      pending_initialize_message_->add_catch_up_version()->CopyFrom(
+          (*catch_up_versions)[i]);
+    }
+  }
 
   TLOG(logger_, INFO, "Batching initialize message for client: %s, %s",
        debug_string.c_str(),
        ProtoHelpers::ToString(*pending_initialize_message_).c_str());
-  operation_scheduler_->Schedule(batching_task_.get());
+  SchedulePriorityBatchingTask();
 }
 
 void ProtocolHandler::SendInfoMessage(
@@ -252,10 +381,22 @@ void ProtocolHandler::SendInfoMessage(
     bool request_server_registration_summary) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
 
+  // Shed the message if the rate limits have held back sending for too long,
+  // unless the server's response to it is needed.
+  if ((info_message_shedding_deficit_ > TimeDelta::FromMilliseconds(0)) &&
+      !request_server_registration_summary &&
+      (throttled_message_sender_->GetDeficit() >=
+       info_message_shedding_deficit_)) {
+    TLOG(logger_, INFO, "Shedding info message: sending is %lld ms behind",
+         throttled_message_sender_->GetDeficit().InMilliseconds());
+    pending_info_message_.reset();
+    return;
+  }
+
   // Simply store the message in pending_info_message_ and send it
   // when the batching task runs.
+  // The client version is added when the message is encoded.
   pending_info_message_.reset(new InfoMessage());
-  pending_info_message_->mutable_client_version()->CopyFrom(client_version_);
 
   // Add configuration parameters.
   for (size_t i = 0; i < config_params.size(); ++i) {
@@ -278,24 +419,99 @@ void ProtocolHandler::SendInfoMessage(
 
   TLOG(logger_, INFO, "Batching info message for client: %s",
        ProtoHelpers::ToString(*pending_info_message_).c_str());
-  operation_scheduler_->Schedule(batching_task_.get());
+  ScheduleBatchingTask();
 }
 
 void ProtocolHandler::SendRegistrations(
     const vector<ObjectIdP>& object_ids, RegistrationP::OpType reg_op_type) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  bool is_urgent = false;
+  bool counts_per_source = CountsRegistrationsPerSource();
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    pair<map<ObjectIdP, RegistrationP::OpType, ProtoCompareLess>::iterator,
+         bool> inserted = pending_registrations_.insert(
+             make_pair(object_ids[i], reg_op_type));
+    if (!inserted.second) {
+      inserted.first->second = reg_op_type;
+    } else if (counts_per_source) {
+      ++num_pending_registrations_per_source_[object_ids[i].source()];
+    }
+    is_urgent = is_urgent || IsUrgentSource(object_ids[i].source());
+  }
+  if (is_urgent) {
+    FlushUrgentOperations();
+  } else {
+    SchedulePriorityBatchingTask();
+  }
+}
+
+void ProtocolHandler::AdmitRegistrations(const vector<ObjectIdP>& object_ids,
+                                         vector<bool>* is_admitted) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  // Number of operations admitted so far by this call, by source.
+  map<int, int> num_admitted;
   for (size_t i = 0; i < object_ids.size(); ++i) {
-    pending_registrations_[object_ids[i]] = reg_op_type;
+    int source = object_ids[i].source();
+    bool admitted = (max_pending_registrations_per_source_ <= 0) ||
+        IsUrgentSource(source) ||
+        (pending_registrations_.count(object_ids[i]) > 0);
+    if (!admitted) {
+      int& num_source_admitted = num_admitted[source];
+      admitted = (GetNumPendingRegistrations(source) + num_source_admitted <
+                  max_pending_registrations_per_source_);
+      if (admitted) {
+        ++num_source_admitted;
+      }
+    }
+    is_admitted->push_back(admitted);
   }
-  operation_scheduler_->Schedule(batching_task_.get());
 }
 
 void ProtocolHandler::SendInvalidationAck(const InvalidationP& invalidation) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
-  // We could do squelching - we don't since it is unlikely to be too beneficial
-  // here.
-  pending_acked_invalidations_.insert(invalidation);
-  operation_scheduler_->Schedule(batching_task_.get());
+  // The ack only needs to identify the version, so leave out the payload.
+  InvalidationP ack;
+  ack.mutable_object_id()->CopyFrom(invalidation.object_id());
+  ack.set_is_known_version(invalidation.is_known_version());
+  ack.set_version(invalidation.version());
+
+  // An ack for a version of an object acknowledges all earlier versions of the
+  // same kind (known or system), so keep only the highest one per object. The
+  // acks are ordered by object, kind and version, so the pending ack for the
+  // same object and kind (at most one) is next to where ack would go.
+  map<InvalidationP, Time, ProtoCompareLess>::iterator iter =
+      pending_acked_invalidations_.lower_bound(ack);
+  if ((iter != pending_acked_invalidations_.end()) &&
+      IsAckForSameVersionSpace(iter->first, ack)) {
+    TLOG(logger_, FINE, "Ack already pending for version %lld >= %lld",
+         iter->first.version(), ack.version());
+    return;
+  }
+  // An ack that replaces a pending one has been waiting since that one was
+  // requested.
+  Time request_time = internal_scheduler_->GetCurrentTime();
+  if (iter != pending_acked_invalidations_.begin()) {
+    map<InvalidationP, Time, ProtoCompareLess>::iterator previous = iter;
+    --previous;
+    if (IsAckForSameVersionSpace(previous->first, ack)) {
+      request_time = previous->second;
+      pending_acked_invalidations_.erase(previous);
+    }
+  }
+  pending_acked_invalidations_.insert(iter, make_pair(ack, request_time));
+  if (IsUrgentSource(ack.object_id().source())) {
+    FlushUrgentOperations();
+  } else {
+    SchedulePriorityBatchingTask();
+  }
+}
+
+bool ProtocolHandler::IsAckForSameVersionSpace(const InvalidationP& ack1,
+                                               const InvalidationP& ack2) {
+  ProtoCompareLess compare_less_than;
+  return (ack1.is_known_version() == ack2.is_known_version()) &&
+      !compare_less_than(ack1.object_id(), ack2.object_id()) &&
+      !compare_less_than(ack2.object_id(), ack1.object_id());
 }
 
 void ProtocolHandler::SendRegistrationSyncSubtree(
@@ -304,11 +520,103 @@ void ProtocolHandler::SendRegistrationSyncSubtree(
   pending_reg_subtrees_.insert(reg_subtree);
   TLOG(logger_, INFO, "Adding subtree: %s",
        ProtoHelpers::ToString(reg_subtree).c_str());
-  operation_scheduler_->Schedule(batching_task_.get());
+  ScheduleBatchingTask();
 }
 
-void ProtocolHandler::SendMessageToServer() {
+void ProtocolHandler::SendPayloadFetch(const string& payload_reference) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (!pending_payload_fetches_.insert(payload_reference).second) {
+    return;
+  }
+  SchedulePriorityBatchingTask();
+}
+
+void ProtocolHandler::GetMemoryUsage(vector<pair<string, size_t> >* usage) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  size_t registration_bytes =
+      MemoryUsage::TreeNodeBytes(pending_registrations_) +
+      MemoryUsage::TreeNodeBytes(num_pending_registrations_per_source_);
+  for (map<ObjectIdP, RegistrationP::OpType, ProtoCompareLess>::iterator iter =
+           pending_registrations_.begin();
+       iter != pending_registrations_.end(); ++iter) {
+    registration_bytes += MemoryUsage::ObjectIdBytes(iter->first);
+  }
+  usage->push_back(make_pair("PendingRegistrations", registration_bytes));
+
+  size_t ack_bytes = MemoryUsage::TreeNodeBytes(pending_acked_invalidations_);
+  for (map<InvalidationP, Time, ProtoCompareLess>::iterator iter =
+           pending_acked_invalidations_.begin();
+       iter != pending_acked_invalidations_.end(); ++iter) {
+    ack_bytes += MemoryUsage::InvalidationBytes(iter->first);
+  }
+  usage->push_back(make_pair("PendingAcks", ack_bytes));
+
+  size_t subtree_bytes = MemoryUsage::TreeNodeBytes(pending_reg_subtrees_);
+  for (set<RegistrationSubtree, ProtoCompareLess>::iterator iter =
+           pending_reg_subtrees_.begin();
+       iter != pending_reg_subtrees_.end(); ++iter) {
+    subtree_bytes += MemoryUsage::SubtreeBytes(*iter);
+  }
+  usage->push_back(make_pair("PendingSubtrees", subtree_bytes));
+
+  size_t fetch_bytes = MemoryUsage::TreeNodeBytes(pending_payload_fetches_);
+  for (set<string>::iterator iter = pending_payload_fetches_.begin();
+       iter != pending_payload_fetches_.end(); ++iter) {
+    fetch_bytes += MemoryUsage::StringBytes(*iter);
+  }
+  usage->push_back(make_pair("PendingPayloadFetches", fetch_bytes));
+
+  // The reused messages hold sub-messages too, but the serialized buffers
+  // bound their size.
+  usage->push_back(make_pair("MessageBuffers",
+      MemoryUsage::StringBytes(compressed_content_) +
+      MemoryUsage::StringBytes(outgoing_buffer_) +
+      MemoryUsage::StringBytes(outgoing_body_) +
+      outbound_encoder_->GetAllocatedBytes()));
+
+  size_t in_flight_bytes = 0;
+  for (deque<InFlightMessage>::iterator iter = in_flight_messages_.begin();
+       iter != in_flight_messages_.end(); ++iter) {
+    in_flight_bytes += sizeof(*iter) +
+        MemoryUsage::StringBytes(iter->message_id) +
+        MemoryUsage::StringBytes(iter->client_token) +
+        MemoryUsage::StringBytes(iter->message) + iter->body.ByteSize();
+  }
+  usage->push_back(make_pair("InFlightMessages", in_flight_bytes));
+
+  size_t throttle_bytes = throttled_message_sender_->GetAllocatedBytes();
+  if (priority_message_sender_.get() != NULL) {
+    throttle_bytes += priority_message_sender_->GetAllocatedBytes();
+  }
+  if (rate_budget_.get() != NULL) {
+    throttle_bytes += rate_budget_->GetAllocatedBytes();
+  }
+  if (priority_rate_budget_.get() != NULL) {
+    throttle_bytes += priority_rate_budget_->GetAllocatedBytes();
+  }
+  usage->push_back(make_pair("Throttles", throttle_bytes));
+}
+
+int64 ProtocolHandler::GetNextPermittedSendTimeMs() {
+  int64 now_ms = GetCurrentTimeMs();
+  TimeDelta throttle_delay = throttled_message_sender_->GetNextPermittedTime() -
+      internal_scheduler_->GetCurrentTime();
+  return max(next_message_send_time_ms_,
+             now_ms + throttle_delay.InMilliseconds());
+}
+
+void ProtocolHandler::RecordThrottleDelay(Throttle* sender) {
+  int64 delay_ms = sender->last_call_delay().InMilliseconds();
+  if (delay_ms > 0) {
+    TLOG(logger_, FINE, "Rate limits delayed message by %lld ms", delay_ms);
+    statistics_->RecordThrottleDelay(static_cast<int>(delay_ms));
+  }
+}
+
+void ProtocolHandler::SendMessageToServer(bool is_priority_lane) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  RecordThrottleDelay(is_priority_lane ? priority_message_sender_.get() :
+                      throttled_message_sender_.get());
 
   if (next_message_send_time_ms_ > GetCurrentTimeMs()) {
     TLOG(logger_, WARNING, "In quiet period: not sending message to server: "
@@ -316,12 +624,27 @@ void ProtocolHandler::SendMessageToServer() {
     return;
   }
 
+  // A message the throttle deferred may come due while offline.
+  if (DeferIfPaused()) {
+    return;
+  }
+
+  // A message on the other lane may have taken the priority operations since
+  // this one was scheduled.
+  if (is_priority_lane && (pending_initialize_message_.get() == NULL) &&
+      !HasPendingPriorityOperations()) {
+    return;
+  }
+
   // Check if an initialize message needs to be sent.
-  ClientToServerMessage builder;
+  // The pending data is swapped into the message rather than copied where
+  // possible, since it is dropped right after.
+  ClientToServerMessage& builder = outgoing_message_;
+  builder.Clear();
   if (pending_initialize_message_.get() != NULL) {
     statistics_->RecordSentMessage(Statistics::SentMessageType_INITIALIZE);
-    builder.mutable_initialize_message()->CopyFrom(
-        *pending_initialize_message_);
+    builder.mutable_initialize_message()->Swap(
+        pending_initialize_message_.get());
     pending_initialize_message_.reset();
   }
 
@@ -340,87 +663,323 @@ void ProtocolHandler::SendMessageToServer() {
     return;
   }
 
-  ClientHeader* outgoing_header = builder.mutable_header();
-  InitClientHeader(outgoing_header);
+  // The header is added when the message is encoded.
+  int message_id = message_id_++;
+  int64 client_time_ms = GetCurrentTimeMs();
 
   // Check for pending batched operations and add to message builder if needed.
+  // At most max_operations_per_message_ operations are added; the rest stay
+  // pending for the next message.
+  int num_operations = 0;
 
-  // Add reg, acks, reg subtrees - clear them after adding.
+  // Add reg, acks, reg subtrees - remove them after adding.
   if (!pending_acked_invalidations_.empty()) {
     InvalidationMessage* ack_message =
         builder.mutable_invalidation_ack_message();
-    set<InvalidationP, ProtoCompareLess>::const_iterator iter;
-    for (iter = pending_acked_invalidations_.begin();
-         iter != pending_acked_invalidations_.end(); ++iter) {
-      ack_message->add_invalidation()->CopyFrom(*iter);
+    Time now = internal_scheduler_->GetCurrentTime();
+    while (!pending_acked_invalidations_.empty() &&
+           (num_operations < max_operations_per_message_)) {
+      map<InvalidationP, Time, ProtoCompareLess>::iterator iter =
+          pending_acked_invalidations_.begin();
+      const_cast<InvalidationP*>(&iter->first)->Swap(
+          ack_message->add_invalidation());
+      statistics_->RecordLatency(
+          Statistics::LatencyType_ACKNOWLEDGEMENT,
+          static_cast<int>((now - iter->second).InMilliseconds()));
+      pending_acked_invalidations_.erase(iter);
+      ++num_operations;
     }
-    pending_acked_invalidations_.clear();
     statistics_->RecordSentMessage(
         Statistics::SentMessageType_INVALIDATION_ACK);
   }
 
   // Check regs.
-  if (!pending_registrations_.empty()) {
-    map<ObjectIdP, RegistrationP::OpType, ProtoCompareLess>::const_iterator
-        iter;
+  if (!pending_registrations_.empty() &&
+      (num_operations < max_operations_per_message_)) {
     RegistrationMessage* reg_message = builder.mutable_registration_message();
-    for (iter = pending_registrations_.begin();
-         iter != pending_registrations_.end(); ++iter) {
+    if (fair_queue_registrations_ &&
+        (num_pending_registrations_per_source_.size() > 1)) {
+      TakeRegistrationsFairly(max_operations_per_message_ - num_operations,
+                              reg_message);
+      num_operations += reg_message->registration_size();
+    }
+    while (!pending_registrations_.empty() &&
+           (num_operations < max_operations_per_message_)) {
       RegistrationP* reg = reg_message->add_registration();
-      reg->mutable_object_id()->CopyFrom(iter->first);
-      reg->set_op_type(iter->second);
+      reg->mutable_object_id()->CopyFrom(pending_registrations_.begin()->first);
+      reg->set_op_type(pending_registrations_.begin()->second);
+      if (CountsRegistrationsPerSource()) {
+        int source = pending_registrations_.begin()->first.source();
+        if (--num_pending_registrations_per_source_[source] == 0) {
+          num_pending_registrations_per_source_.erase(source);
+        }
+      }
+      pending_registrations_.erase(pending_registrations_.begin());
+      ++num_operations;
+    }
+    // The registrations were taken in order from the sorted map.
+    if (front_code_object_names_ && server_accepts_front_coding_) {
+      ObjectNameCoding::EncodeRegistrations(reg_message);
     }
-    pending_registrations_.clear();
     statistics_->RecordSentMessage(Statistics::SentMessageType_REGISTRATION);
   }
 
-  // Check reg substrees.
-  if (!pending_reg_subtrees_.empty()) {
+  // Check payload fetches.
+  if (!pending_payload_fetches_.empty() &&
+      (num_operations < max_operations_per_message_)) {
+    PayloadFetchMessage* fetch_message =
+        builder.mutable_payload_fetch_message();
+    while (!pending_payload_fetches_.empty() &&
+           (num_operations < max_operations_per_message_)) {
+      set<string>::iterator iter = pending_payload_fetches_.begin();
+      fetch_message->add_payload_reference(*iter);
+      pending_payload_fetches_.erase(iter);
+      ++num_operations;
+    }
+    statistics_->RecordSentMessage(Statistics::SentMessageType_PAYLOAD_FETCH);
+  }
+
+  // Check reg substrees. A subtree counts as one operation per object in it,
+  // but is always sent whole.
+  if (!is_priority_lane && !pending_reg_subtrees_.empty() &&
+      (num_operations < max_operations_per_message_)) {
     RegistrationSyncMessage* sync_message =
         builder.mutable_registration_sync_message();
-    set<RegistrationSubtree, ProtoCompareLess>::const_iterator iter;
-    for (iter = pending_reg_subtrees_.begin();
-         iter != pending_reg_subtrees_.end(); ++iter) {
-      sync_message->add_subtree()->CopyFrom(*iter);
+    while (!pending_reg_subtrees_.empty()) {
+      const RegistrationSubtree& subtree = *pending_reg_subtrees_.begin();
+      int subtree_operations = max(1, subtree.registered_object_size());
+      if ((sync_message->subtree_size() > 0) &&
+          (num_operations + subtree_operations >
+           max_operations_per_message_)) {
+        break;
+      }
+      num_operations += subtree_operations;
+      RegistrationSubtree* sent_subtree = sync_message->add_subtree();
+      TakeFirst(&pending_reg_subtrees_, sent_subtree);
+      if (front_code_object_names_ && server_accepts_front_coding_) {
+        ObjectNameCoding::EncodeSubtree(sent_subtree);
+      }
     }
-    pending_reg_subtrees_.clear();
     statistics_->RecordSentMessage(
         Statistics::SentMessageType_REGISTRATION_SYNC);
   }
 
   // Check info message.
-  if (pending_info_message_.get() != NULL) {
+  if (!is_priority_lane && (pending_info_message_.get() != NULL)) {
     statistics_->RecordSentMessage(Statistics::SentMessageType_INFO);
-    builder.mutable_info_message()->CopyFrom(*pending_info_message_);
+    builder.mutable_info_message()->Swap(pending_info_message_.get());
     pending_info_message_.reset();
   }
 
-  // Validate the message and send it.
+  // Validate the message (unless configured to trust the messages built here)
+  // and send it.
   ++message_id_;
-  if (!msg_validator_->IsValid(builder)) {
-    TLOG(logger_, SEVERE, "Tried to send invalid message: %s",
-         ProtoHelpers::ToString(builder).c_str());
-    statistics_->RecordError(
-        Statistics::ClientErrorType_OUTGOING_MESSAGE_FAILURE);
-    return;
+  if (ShouldValidateOutgoingMessage()) {
+    // Validate the message as the server will see it.
+    InitClientHeader(message_id, client_time_ms, builder.mutable_header());
+    if (builder.has_info_message()) {
+      builder.mutable_info_message()->mutable_client_version()->CopyFrom(
+          client_version_);
+    }
+    bool is_valid = msg_validator_->IsValid(builder);
+    if (!is_valid) {
+      TLOG(logger_, SEVERE, "Tried to send invalid message: %s",
+           ProtoHelpers::ToString(builder).c_str());
+      statistics_->RecordError(
+          Statistics::ClientErrorType_OUTGOING_MESSAGE_FAILURE);
+      return;
+    }
+    builder.clear_header();
+    if (builder.has_info_message()) {
+      builder.mutable_info_message()->clear_client_version();
+    }
   }
 
   TLOG(logger_, FINE, "Sending message to server: %s",
        ProtoHelpers::ToString(builder).c_str());
   statistics_->RecordSentMessage(Statistics::SentMessageType_TOTAL);
-  string serialized;
-  builder.SerializeToString(&serialized);
-  resources_->network()->SendMessage(serialized);
+  last_message_sent_time_ms_ = GetCurrentTimeMs();
+  RecordSentBytes(builder);
+  bool has_initialize_message = builder.has_initialize_message();
+
+  // A pipelined message that (un)registers objects keeps its contents, so
+  // that it can be resent without the operations later messages supersede.
+  ClientToServerMessage in_flight_body;
+  bool keeps_body = (max_messages_in_flight_ > 0) && !has_initialize_message &&
+      (builder.has_registration_message() ||
+       builder.has_registration_sync_message());
+  if (keeps_body) {
+    in_flight_body.CopyFrom(builder);
+  }
+  outbound_encoder_->EncodeBody(&builder, &outgoing_body_);
+  if (!has_initialize_message) {
+    // An initialize message must stay visible to the server, which does not
+    // know the client yet.
+    CompressBody(&builder, &outgoing_body_);
+  }
+  string client_token = listener_->GetClientToken();
+  listener_->GetRegistrationSummary(&outgoing_summary_);
+  outbound_encoder_->EncodeMessage(
+      client_token, outgoing_summary_, message_id, client_time_ms,
+      last_known_server_time_ms_, outgoing_body_, &outgoing_buffer_);
+  statistics_->RecordSentBytes(Statistics::SentMessageType_TOTAL,
+                               static_cast<int>(outgoing_buffer_.size()));
+  if (!has_initialize_message) {
+    TrackInFlightMessage(message_id, client_time_ms, client_token,
+                         keeps_body ? &in_flight_body : NULL);
+  }
+  TICL_EVENT(event_log_, EVENT_MESSAGE_SENT, message_id,
+             outgoing_buffer_.size());
+  resources_->network()->SendMessage(&outgoing_buffer_);
+
+  // Send whatever did not fit in a following message, subject to the same
+  // batching delay and rate limits.
+  if (HasPendingOperations()) {
+    TLOG(logger_, FINE, "Deferring operations beyond the limit of %d per "
+         "message", max_operations_per_message_);
+    if (priority_message_sender_.get() == NULL) {
+      ScheduleBatchingTask();
+    } else {
+      if (HasPendingPriorityOperations()) {
+        SchedulePriorityBatchingTask();
+      }
+      if (!pending_reg_subtrees_.empty()) {
+        ScheduleBatchingTask();
+      }
+    }
+  }
+}
+
+void ProtocolHandler::RecordSentBytes(const ClientToServerMessage& message) {
+  // Computing the size of the whole message caches those of the sub-messages.
+  message.ByteSize();
+  if (message.has_initialize_message()) {
+    statistics_->RecordSentBytes(
+        Statistics::SentMessageType_INITIALIZE,
+        message.initialize_message().GetCachedSize());
+  }
+  if (message.has_invalidation_ack_message()) {
+    statistics_->RecordSentBytes(
+        Statistics::SentMessageType_INVALIDATION_ACK,
+        message.invalidation_ack_message().GetCachedSize());
+  }
+  if (message.has_registration_message()) {
+    statistics_->RecordSentBytes(
+        Statistics::SentMessageType_REGISTRATION,
+        message.registration_message().GetCachedSize());
+  }
+  if (message.has_registration_sync_message()) {
+    statistics_->RecordSentBytes(
+        Statistics::SentMessageType_REGISTRATION_SYNC,
+        message.registration_sync_message().GetCachedSize());
+  }
+  if (message.has_info_message()) {
+    statistics_->RecordSentBytes(
+        Statistics::SentMessageType_INFO,
+        message.info_message().GetCachedSize());
+  }
+  if (message.has_payload_fetch_message()) {
+    statistics_->RecordSentBytes(
+        Statistics::SentMessageType_PAYLOAD_FETCH,
+        message.payload_fetch_message().GetCachedSize());
+  }
+}
+
+void ProtocolHandler::RecordReceivedBytes(
+    const ServerToClientMessage& message, int num_bytes) {
+  statistics_->RecordReceivedBytes(Statistics::ReceivedMessageType_TOTAL,
+                                   num_bytes);
+  message.ByteSize();
+  if (message.has_token_control_message()) {
+    statistics_->RecordReceivedBytes(
+        Statistics::ReceivedMessageType_TOKEN_CONTROL,
+        message.token_control_message().GetCachedSize());
+  }
+  if (message.has_invalidation_message()) {
+    statistics_->RecordReceivedBytes(
+        Statistics::ReceivedMessageType_INVALIDATION,
+        message.invalidation_message().GetCachedSize());
+  }
+  if (message.has_registration_status_message()) {
+    statistics_->RecordReceivedBytes(
+        Statistics::ReceivedMessageType_REGISTRATION_STATUS,
+        message.registration_status_message().GetCachedSize());
+  }
+  if (message.has_registration_sync_request_message()) {
+    statistics_->RecordReceivedBytes(
+        Statistics::ReceivedMessageType_REGISTRATION_SYNC_REQUEST,
+        message.registration_sync_request_message().GetCachedSize());
+  }
+  if (message.has_info_request_message()) {
+    statistics_->RecordReceivedBytes(
+        Statistics::ReceivedMessageType_INFO_REQUEST,
+        message.info_request_message().GetCachedSize());
+  }
+  if (message.has_error_message()) {
+    statistics_->RecordReceivedBytes(
+        Statistics::ReceivedMessageType_ERROR,
+        message.error_message().GetCachedSize());
+  }
+  if (message.has_payload_message()) {
+    statistics_->RecordReceivedBytes(
+        Statistics::ReceivedMessageType_PAYLOAD,
+        message.payload_message().GetCachedSize());
+  }
+}
+
+void ProtocolHandler::CompressBody(ClientToServerMessage* builder,
+                                   string* body) {
+  if (!enable_compression_ || !server_accepts_compression_ ||
+      (body->size() < static_cast<size_t>(min_compressed_message_size_))) {
+    return;
+  }
+
+  // Compress everything but the header, which the server needs to read first.
+  if (!CompressionUtils::Deflate(*body, &compressed_content_) ||
+      (compressed_content_.size() >= body->size())) {
+    return;
+  }
+  TLOG(logger_, FINE, "Compressed message contents from %d to %d bytes",
+       static_cast<int>(body->size()),
+       static_cast<int>(compressed_content_.size()));
+  builder->Clear();
+  builder->set_compression_type(InitializeMessage_CompressionType_DEFLATE);
+  builder->mutable_compressed_content()->swap(compressed_content_);
+  builder->SerializeToString(body);
+  compressed_content_.swap(*builder->mutable_compressed_content());
+}
+
+bool ProtocolHandler::ShouldValidateOutgoingMessage() {
+  if (outbound_validation_interval_ == 0) {
+    return false;
+  }
+  if (messages_until_validation_ > 0) {
+    --messages_until_validation_;
+    return false;
+  }
+  messages_until_validation_ = outbound_validation_interval_ - 1;
+  return true;
 }
 
-void ProtocolHandler::InitClientHeader(ClientHeader* builder) {
+Throttle* ProtocolHandler::NewThrottle(
+    const Config& config, const vector<RateLimit>& rate_limits,
+    scoped_ptr<RateBudget>* budget, Closure* listener) {
+  if (!config.use_token_buckets && (config.shared_rate_budget == NULL)) {
+    return new Throttle(rate_limits, internal_scheduler_, listener);
+  }
+  budget->reset(new RateBudget(rate_limits, config.shared_rate_budget));
+  return new Throttle(budget->get(), internal_scheduler_, listener);
+}
+
+void ProtocolHandler::InitClientHeader(int message_id, int64 client_time_ms,
+                                       ClientHeader* builder) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   builder->mutable_protocol_version()->mutable_version()->set_major_version(
       Constants::kProtocolMajorVersion);
   builder->mutable_protocol_version()->mutable_version()->set_minor_version(
       Constants::kProtocolMinorVersion);
-  builder->set_client_time_ms(GetCurrentTimeMs());
-  builder->set_message_id(StringPrintf("%d", message_id_++));
+  builder->set_client_time_ms(client_time_ms);
+  builder->set_message_id(StringPrintf("%d", message_id));
   builder->set_max_known_server_time_ms(last_known_server_time_ms_);
   listener_->GetRegistrationSummary(builder->mutable_registration_summary());
   const string& client_token = listener_->GetClientToken();
@@ -431,19 +990,423 @@ void ProtocolHandler::InitClientHeader(ClientHeader* builder) {
   }
 }
 
+void ProtocolHandler::ScheduleBatchingTask() {
+  if (adaptive_batching_) {
+    if (!is_batching_) {
+      // Start a new wait. Wait less if no message was sent recently, but keep
+      // messages at least max_batching_delay_ apart.
+      int64 now_ms = GetCurrentTimeMs();
+      int64 delay_ms = max_batching_delay_.InMilliseconds() -
+          (now_ms - last_message_sent_time_ms_);
+      delay_ms = max(delay_ms, min_batching_delay_.InMilliseconds());
+
+      // The message cannot go out before the rate limits allow, so keep
+      // batching until then rather than having the throttle defer it.
+      delay_ms = max(delay_ms, GetNextPermittedSendTimeMs() - now_ms);
+      is_batching_ = true;
+      batch_start_time_ms_ = now_ms;
+      num_batched_arrivals_ = 0;
+      current_batching_delay_ = TimeDelta::FromMilliseconds(delay_ms);
+      operation_scheduler_->ChangeDelay(
+          batching_operation_, current_batching_delay_);
+    } else {
+      ++num_batched_arrivals_;
+    }
+  }
+  operation_scheduler_->Schedule(batching_operation_);
+}
+
+void ProtocolHandler::HandleConfigChange(
+    const ConfigChangeMessage& config_change) {
+  if (config_change.has_batching_delay_ms()) {
+    TimeDelta batching_delay =
+        TimeDelta::FromMilliseconds(config_change.batching_delay_ms());
+    max_batching_delay_ = batching_delay;
+    if (min_batching_delay_ > batching_delay) {
+      min_batching_delay_ = batching_delay;
+    }
+    // With adaptive batching, the delay is picked anew for each batch.
+    if (!adaptive_batching_) {
+      operation_scheduler_->ChangeDelay(batching_operation_, batching_delay);
+    }
+  }
+  if (config_change.rate_limit_size() > 0) {
+    // Only the main lane's limits change; the priority lane is for the few
+    // messages that must not wait behind it.
+    vector<RateLimit> rate_limits;
+    for (int i = 0; i < config_change.rate_limit_size(); ++i) {
+      const RateLimitP& rate_limit = config_change.rate_limit(i);
+      rate_limits.push_back(RateLimit(
+          TimeDelta::FromMilliseconds(rate_limit.window_ms()),
+          rate_limit.count()));
+    }
+    throttled_message_sender_->SetRateLimits(rate_limits);
+  }
+  TLOG(logger_, INFO, "Applied config change from server: %s",
+       ProtoHelpers::ToString(config_change).c_str());
+  listener_->HandleConfigChange(config_change);
+}
+
 void ProtocolHandler::BatchingTask() {
+  if (adaptive_batching_ && is_batching_) {
+    // If operations are still arriving, wait (twice as long) for more, as long
+    // as the total wait stays within max_batching_delay_.
+    int64 remaining_ms = max_batching_delay_.InMilliseconds() -
+        (GetCurrentTimeMs() - batch_start_time_ms_);
+    if ((num_batched_arrivals_ > 0) &&
+        (remaining_ms >= min_batching_delay_.InMilliseconds())) {
+      int64 delay_ms = min(2 * current_batching_delay_.InMilliseconds(),
+                           remaining_ms);
+      TLOG(logger_, FINE, "Extending batching by %lld ms after %d arrivals",
+           delay_ms, num_batched_arrivals_);
+      num_batched_arrivals_ = 0;
+      current_batching_delay_ = TimeDelta::FromMilliseconds(delay_ms);
+      operation_scheduler_->ChangeDelay(
+          batching_operation_, current_batching_delay_);
+      operation_scheduler_->Schedule(batching_operation_);
+      return;
+    }
+    is_batching_ = false;
+  }
+
+  // Keep the rate limits' budget for when the network is back.
+  if (DeferIfPaused()) {
+    return;
+  }
+
   // Go through a throttler to ensure that we obey rate limits in sending
   // messages.
-  throttled_message_sender_.Fire();
+  throttled_message_sender_->Fire();
+}
+
+void ProtocolHandler::SchedulePriorityBatchingTask() {
+  if (priority_message_sender_.get() == NULL) {
+    ScheduleBatchingTask();
+    return;
+  }
+  operation_scheduler_->Schedule(priority_batching_operation_);
 }
 
-void ProtocolHandler::MessageReceiver(const string& message) {
-  internal_scheduler_->Schedule(Scheduler::NoDelay(), NewPermanentCallback(this,
-      &ProtocolHandler::HandleIncomingMessage, message));
+void ProtocolHandler::PriorityBatchingTask() {
+  if (DeferIfPaused()) {
+    return;
+  }
+  priority_message_sender_->Fire();
+}
+
+void ProtocolHandler::FlushUrgentOperations() {
+  if (DeferIfPaused()) {
+    return;
+  }
+  TLOG(logger_, FINE, "Flushing pending operations for urgent object");
+  // The throttle sends right away or, if the rate limits do not allow it yet,
+  // as soon as they do.
+  if (priority_message_sender_.get() != NULL) {
+    priority_message_sender_->Fire();
+  } else {
+    throttled_message_sender_->Fire();
+  }
+}
+
+void ProtocolHandler::TakeRegistrationsFairly(
+    int max_registrations, RegistrationMessage* reg_message) {
+  // Share the room equally among the sources, smallest backlog first, so
+  // that the room a source leaves unused goes to the larger ones. Each source
+  // gets at least one while there is room.
+  vector<pair<int, int> > backlogs;  // (number pending, source)
+  for (map<int, int>::iterator iter =
+           num_pending_registrations_per_source_.begin();
+       iter != num_pending_registrations_per_source_.end(); ++iter) {
+    backlogs.push_back(make_pair(iter->second, iter->first));
+  }
+  sort(backlogs.begin(), backlogs.end());
+  map<int, int> num_to_take;
+  int room = max_registrations;
+  for (size_t i = 0; (i < backlogs.size()) && (room > 0); ++i) {
+    int share = max(1, room / static_cast<int>(backlogs.size() - i));
+    int num = min(backlogs[i].first, share);
+    num_to_take[backlogs[i].second] = num;
+    room -= num;
+  }
+
+  // The registrations of a source are contiguous in the map, from the object
+  // id with the source and an empty name, and the sources are taken in order,
+  // so the message stays sorted.
+  for (map<int, int>::iterator iter = num_to_take.begin();
+       iter != num_to_take.end(); ++iter) {
+    ObjectIdP first_object_id;
+    first_object_id.set_source(iter->first);
+    map<ObjectIdP, RegistrationP::OpType, ProtoCompareLess>::iterator
+        registration = pending_registrations_.lower_bound(first_object_id);
+    for (int i = 0; i < iter->second; ++i) {
+      RegistrationP* reg = reg_message->add_registration();
+      reg->mutable_object_id()->CopyFrom(registration->first);
+      reg->set_op_type(registration->second);
+      pending_registrations_.erase(registration++);
+    }
+    int& num_pending = num_pending_registrations_per_source_[iter->first];
+    num_pending -= iter->second;
+    if (num_pending == 0) {
+      num_pending_registrations_per_source_.erase(iter->first);
+    }
+  }
+}
+
+void ProtocolHandler::MessageReceiver(string* message) {
+  // A recycled node holds the buffer of an earlier message, which goes back
+  // to the channel empty in place of this one.
+  MpscQueue<ReceivedMessage>::Node* node = queued_messages_.NewNode();
+  node->value.receive_time = internal_scheduler_->GetCurrentTime();
+  node->value.trace_id = __sync_fetch_and_add(&next_trace_id_, 1);
+  TICL_TRACE(TRACE_MESSAGE_RECEIVED, node->value.trace_id);
+  node->value.message.swap(*message);
+  message->clear();
+  if (queued_messages_.Push(node)) {
+    internal_scheduler_->Schedule(Scheduler::NoDelay(), NewPooledCallback(
+        this, &ProtocolHandler::HandleQueuedMessages));
+  }
+}
+
+void ProtocolHandler::HandleQueuedMessages() {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  MpscQueue<ReceivedMessage>::Node* nodes = queued_messages_.TakeAll();
+  for (MpscQueue<ReceivedMessage>::Node* node = nodes; node != NULL;
+       node = node->next) {
+    HandleIncomingMessage(node->value);
+  }
+  queued_messages_.RecycleNodes(nodes);
 }
 
 void ProtocolHandler::NetworkStatusReceiver(bool status) {
-  // Do nothing for now.
+  internal_scheduler_->Schedule(Scheduler::NoDelay(), NewPooledCallback(
+      this, &ProtocolHandler::HandleNetworkStatus, status));
+}
+
+void ProtocolHandler::HandleNetworkStatus(bool is_online) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (is_online == is_network_online_) {
+    return;
+  }
+  TICL_EVENT(event_log_, EVENT_NETWORK_STATUS, is_online ? 1 : 0, 0);
+  TLOG(logger_, INFO, "Network is %s", is_online ? "online" : "offline");
+  is_network_online_ = is_online;
+  SendDeferredMessage();
+  listener_->HandleNetworkStatusChange(is_online);
+}
+
+bool ProtocolHandler::DeferIfPaused() {
+  if (!IsPausedOffline() && !IsWindowFull()) {
+    return false;
+  }
+  TLOG(logger_, FINE, "Holding back message: network %s, %d in flight",
+       is_network_online_ ? "online" : "offline",
+       static_cast<int>(in_flight_messages_.size()));
+  has_deferred_message_ = true;
+  return true;
+}
+
+void ProtocolHandler::SendDeferredMessage() {
+  if (!has_deferred_message_ || IsPausedOffline() || IsWindowFull()) {
+    return;
+  }
+  // Everything pending goes out in one message on the regular lane, which
+  // also carries the priority operations.
+  has_deferred_message_ = false;
+  throttled_message_sender_->Fire();
+}
+
+void ProtocolHandler::TrackInFlightMessage(int message_id,
+                                           int64 client_time_ms,
+                                           const string& client_token,
+                                           ClientToServerMessage* body) {
+  if (max_messages_in_flight_ == 0) {
+    return;
+  }
+  if (body != NULL) {
+    // Compare and rebuild with the full names.
+    if (body->has_registration_message()) {
+      ObjectNameCoding::DecodeRegistrations(
+          body->mutable_registration_message());
+    }
+    for (int i = 0; i < body->registration_sync_message().subtree_size();
+         ++i) {
+      ObjectNameCoding::DecodeSubtree(
+          body->mutable_registration_sync_message()->mutable_subtree(i));
+    }
+    SupersedeInFlightOperations(*body);
+  }
+  in_flight_messages_.push_back(InFlightMessage());
+  InFlightMessage& in_flight = in_flight_messages_.back();
+  in_flight.message_id = StringPrintf("%d", message_id);
+  in_flight.message_number = message_id;
+  in_flight.client_time_ms = client_time_ms;
+  in_flight.client_token = client_token;
+  in_flight.message = outgoing_buffer_;
+  if (body != NULL) {
+    in_flight.body.Swap(body);
+  }
+  in_flight.has_superseded_operations = false;
+  in_flight.last_send_time_ms = last_message_sent_time_ms_;
+  in_flight.num_retransmissions = 0;
+  operation_scheduler_->Schedule(retransmit_operation_);
+}
+
+void ProtocolHandler::SupersedeInFlightOperations(
+    const ClientToServerMessage& body) {
+  set<string> object_keys;
+  const RegistrationMessage& reg_message = body.registration_message();
+  for (int i = 0; i < reg_message.registration_size(); ++i) {
+    object_keys.insert(
+        reg_message.registration(i).object_id().SerializeAsString());
+  }
+  const RegistrationSyncMessage& sync_message =
+      body.registration_sync_message();
+  for (int i = 0; i < sync_message.subtree_size(); ++i) {
+    const RegistrationSubtree& subtree = sync_message.subtree(i);
+    for (int j = 0; j < subtree.registered_object_size(); ++j) {
+      object_keys.insert(subtree.registered_object(j).SerializeAsString());
+    }
+  }
+  for (deque<InFlightMessage>::iterator iter = in_flight_messages_.begin();
+       iter != in_flight_messages_.end(); ++iter) {
+    if (RemoveOperations(object_keys, &iter->body)) {
+      TLOG(logger_, FINE, "Operations of in-flight message %s superseded",
+           iter->message_id.c_str());
+      iter->has_superseded_operations = true;
+    }
+  }
+}
+
+bool ProtocolHandler::RemoveOperations(const set<string>& object_keys,
+                                       ClientToServerMessage* body) {
+  // The operations kept are moved to the front, in their order.
+  int num_removed = 0;
+  if (body->has_registration_message()) {
+    RepeatedPtrField<RegistrationP>* registrations =
+        body->mutable_registration_message()->mutable_registration();
+    int num_kept = 0;
+    for (int i = 0; i < registrations->size(); ++i) {
+      if (object_keys.count(
+              registrations->Get(i).object_id().SerializeAsString()) == 0) {
+        registrations->SwapElements(i, num_kept++);
+      }
+    }
+    num_removed += registrations->size() - num_kept;
+    while (registrations->size() > num_kept) {
+      registrations->RemoveLast();
+    }
+    if (registrations->size() == 0) {
+      body->clear_registration_message();
+    }
+  }
+  for (int i = 0; i < body->registration_sync_message().subtree_size(); ++i) {
+    RepeatedPtrField<ObjectIdP>* objects =
+        body->mutable_registration_sync_message()->mutable_subtree(i)->
+        mutable_registered_object();
+    int num_kept = 0;
+    for (int j = 0; j < objects->size(); ++j) {
+      if (object_keys.count(objects->Get(j).SerializeAsString()) == 0) {
+        objects->SwapElements(j, num_kept++);
+      }
+    }
+    num_removed += objects->size() - num_kept;
+    while (objects->size() > num_kept) {
+      objects->RemoveLast();
+    }
+  }
+  return num_removed > 0;
+}
+
+void ProtocolHandler::RebuildInFlightMessage(InFlightMessage* in_flight) {
+  TLOG(logger_, FINE, "Rebuilding in-flight message %s without superseded "
+       "operations", in_flight->message_id.c_str());
+  ClientToServerMessage& builder = outgoing_message_;
+  builder.CopyFrom(in_flight->body);
+  if (front_code_object_names_ && server_accepts_front_coding_) {
+    if (builder.has_registration_message()) {
+      ObjectNameCoding::EncodeRegistrations(
+          builder.mutable_registration_message());
+    }
+    for (int i = 0; i < builder.registration_sync_message().subtree_size();
+         ++i) {
+      ObjectNameCoding::EncodeSubtree(
+          builder.mutable_registration_sync_message()->mutable_subtree(i));
+    }
+  }
+  outbound_encoder_->EncodeBody(&builder, &outgoing_body_);
+  CompressBody(&builder, &outgoing_body_);
+  listener_->GetRegistrationSummary(&outgoing_summary_);
+  outbound_encoder_->EncodeMessage(
+      in_flight->client_token, outgoing_summary_, in_flight->message_number,
+      in_flight->client_time_ms, last_known_server_time_ms_, outgoing_body_,
+      &in_flight->message);
+  in_flight->has_superseded_operations = false;
+}
+
+void ProtocolHandler::HandleMessageAcks(const ServerHeader& header) {
+  if (in_flight_messages_.empty()) {
+    return;
+  }
+  // The window is small, so a linear search per ack is cheap.
+  for (int i = 0; i < header.acked_message_id_size(); ++i) {
+    const string& message_id = header.acked_message_id(i);
+    for (deque<InFlightMessage>::iterator iter = in_flight_messages_.begin();
+         iter != in_flight_messages_.end(); ++iter) {
+      if (iter->message_id == message_id) {
+        in_flight_messages_.erase(iter);
+        break;
+      }
+    }
+  }
+  SendDeferredMessage();
+}
+
+void ProtocolHandler::RetransmitTask() {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  int64 now_ms = GetCurrentTimeMs();
+  int64 next_due_ms = now_ms + message_ack_timeout_.InMilliseconds();
+  const string& client_token = listener_->GetClientToken();
+  deque<InFlightMessage>::iterator iter = in_flight_messages_.begin();
+  while (iter != in_flight_messages_.end()) {
+    int64 due_ms =
+        iter->last_send_time_ms + message_ack_timeout_.InMilliseconds();
+    if (due_ms > now_ms) {
+      next_due_ms = min(next_due_ms, due_ms);
+      ++iter;
+      continue;
+    }
+
+    // A message sent under another token would be dropped by the server, and
+    // one resent too often is left to the Ticl's network timeouts.
+    if ((iter->client_token != client_token) ||
+        (iter->num_retransmissions >= kMaxMessageRetransmissions)) {
+      TLOG(logger_, INFO, "Giving up on unacknowledged message %s",
+           iter->message_id.c_str());
+      iter = in_flight_messages_.erase(iter);
+      continue;
+    }
+
+    // Nothing can get through while offline; try again later.
+    if (!IsPausedOffline()) {
+      TLOG(logger_, FINE, "Resending unacknowledged message %s",
+           iter->message_id.c_str());
+      if (iter->has_superseded_operations) {
+        RebuildInFlightMessage(&*iter);
+      }
+      ++iter->num_retransmissions;
+      iter->last_send_time_ms = now_ms;
+      statistics_->RecordSentMessage(Statistics::SentMessageType_TOTAL);
+      resources_->network()->SendMessage(iter->message);
+    }
+    ++iter;
+  }
+
+  if (!in_flight_messages_.empty()) {
+    int64 delay_ms = max(next_due_ms - now_ms, static_cast<int64>(1));
+    operation_scheduler_->ScheduleWithDelay(
+        retransmit_operation_, TimeDelta::FromMilliseconds(delay_ms));
+  }
+  SendDeferredMessage();
 }
 
 }  // namespace invalidation
@@ -17,6 +17,7 @@
 #ifndef GOOGLE_CACHEINVALIDATION_V2_PROTOCOL_HANDLER_H_
 #define GOOGLE_CACHEINVALIDATION_V2_PROTOCOL_HANDLER_H_
 
+#include <deque>
 #include <map>
 #include <set>
 #include <string>
@@ -24,23 +25,32 @@
 
 #include "google/cacheinvalidation/v2/system-resources.h"
 #include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/event-log.h"
 #include "google/cacheinvalidation/v2/invalidation-client-util.h"
+#include "google/cacheinvalidation/v2/mpsc-queue.h"
 #include "google/cacheinvalidation/v2/operation-scheduler.h"
+#include "google/cacheinvalidation/v2/outbound-message-encoder.h"
 #include "google/cacheinvalidation/v2/proto-helpers.h"
 #include "google/cacheinvalidation/v2/scoped_ptr.h"
 #include "google/cacheinvalidation/v2/statistics.h"
 #include "google/cacheinvalidation/v2/throttle.h"
 #include "google/cacheinvalidation/v2/ticl-message-validator.h"
+#include "google/cacheinvalidation/v2/trace.h"
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::deque;
 using INVALIDATION_STL_NAMESPACE::make_pair;
 using INVALIDATION_STL_NAMESPACE::map;
 using INVALIDATION_STL_NAMESPACE::pair;
 using INVALIDATION_STL_NAMESPACE::set;
 using INVALIDATION_STL_NAMESPACE::string;
 
-/* Representation of a message header for use in a server message. */
+/* Representation of a message header for use in a server message. The header
+ * refers to the fields of the message it was constructed from, so it is only
+ * valid while that message is being handled: listeners that need the token or
+ * summary afterwards must copy them.
+ */
 struct ServerMessageHeader {
  public:
   /* Constructs an instance.
@@ -50,10 +60,12 @@ struct ServerMessageHeader {
    *     init_registration_summary - summary over server registration state
    */
   ServerMessageHeader(const string& init_token,
-                      const RegistrationSummary& init_registration_summary)
-      : token(init_token) {
-    registration_summary.CopyFrom(init_registration_summary);
-  }
+                      const RegistrationSummary& init_registration_summary,
+                      Time init_receive_time, uint64 init_trace_id)
+      : token(init_token),
+        registration_summary(init_registration_summary),
+        receive_time(init_receive_time),
+        trace_id(init_trace_id) {}
 
   string ToString() const {
     return StringPrintf(
@@ -61,8 +73,14 @@ struct ServerMessageHeader {
         ProtoHelpers::ToString(registration_summary).c_str());
   }
 
-  string token;
-  RegistrationSummary registration_summary;
+  const string& token;
+  const RegistrationSummary& registration_summary;
+
+  /* When the message was received from the network. */
+  Time receive_time;
+
+  /* Identifier of the message in the trace spans (see trace.h). */
+  uint64 trace_id;
 };
 
 /*
@@ -100,10 +118,12 @@ class ProtocolListener {
    *
    * Arguments:
    * header - server message header
+   * invalidations - the invalidations of the message, whose payloads the
+   *     listener may take
    */
   virtual void HandleInvalidations(
       const ServerMessageHeader& header,
-      const RepeatedPtrField<InvalidationP>& invalidations) = 0;
+      RepeatedPtrField<InvalidationP>* invalidations) = 0;
 
   /* Handles registration updates from the server.
    *
@@ -144,11 +164,31 @@ class ProtocolListener {
       const ErrorMessage::Code code,
       const string& description) = 0;
 
+  /* Handles the payloads fetched from the server.
+   *
+   * Arguments:
+   * header - server message header
+   * payloads - the payloads of the message, which the listener may take
+   */
+  virtual void HandlePayloads(const ServerMessageHeader& header,
+                              RepeatedPtrField<PayloadP>* payloads) = 0;
+
   /* Stores a summary of the current desired registrations. */
   virtual void GetRegistrationSummary(RegistrationSummary* summary) = 0;
 
   /* Returns the current server-assigned client token, if any. */
   virtual string GetClientToken() = 0;
+
+  /* Handles a change in network connectivity, as reported by the network
+   * channel.
+   */
+  virtual void HandleNetworkStatusChange(bool is_online) = 0;
+
+  /* Applies the parameters of a ConfigChangeMessage that the listener owns
+   * (the token backoff cap and the heartbeat interval). The protocol handler
+   * applies the batching delay and rate limits itself.
+   */
+  virtual void HandleConfigChange(const ConfigChangeMessage& config_change) = 0;
 };
 
 class ProtocolHandler {
@@ -157,11 +197,39 @@ class ProtocolHandler {
   class Config {
    public:
     Config() : batching_delay(
-        TimeDelta::FromMilliseconds(kDefaultBatchingDelayMs)) {
+                   TimeDelta::FromMilliseconds(kDefaultBatchingDelayMs)),
+               max_operations_per_message(kDefaultMaxOperationsPerMessage),
+               adaptive_batching(false),
+               min_batching_delay(
+                   TimeDelta::FromMilliseconds(kDefaultMinBatchingDelayMs)),
+               enable_compression(false),
+               min_compressed_message_size(kDefaultMinCompressedMessageSize),
+               enable_priority_lane(false),
+               priority_batching_delay(TimeDelta::FromMilliseconds(
+                   kDefaultPriorityBatchingDelayMs)),
+               outbound_validation_interval(1),
+               use_token_buckets(false),
+               shared_rate_budget(NULL),
+               info_message_shedding_deficit(TimeDelta::FromMilliseconds(0)),
+               pause_while_offline(false),
+               max_messages_in_flight(0),
+               message_ack_timeout(TimeDelta::FromMilliseconds(
+                   kDefaultMessageAckTimeoutMs)),
+               max_inline_payload_size(0),
+               omit_payloads(false),
+               front_code_object_names(false),
+               max_pending_registrations_per_source(0),
+               fair_queue_registrations(false) {
       // At most one message per second.
       rate_limits.push_back(RateLimit(TimeDelta::FromSeconds(1), 1));
       // At most six messages per minute.
       rate_limits.push_back(RateLimit(TimeDelta::FromMinutes(1), 6));
+
+      // At most one priority message per half second.
+      priority_rate_limits.push_back(
+          RateLimit(TimeDelta::FromMilliseconds(500), 1));
+      // At most six priority messages per minute.
+      priority_rate_limits.push_back(RateLimit(TimeDelta::FromMinutes(1), 6));
     }
 
     /* Batching delay - certain messages (e.g., registrations, invalidation
@@ -172,15 +240,209 @@ class ProtocolHandler {
     /* Rate limits for sending messages. */
     vector<RateLimit> rate_limits;
 
+    /* The maximum number of operations (invalidation acks, registrations and
+     * objects in registration subtrees) to put in one message. Pending
+     * operations beyond this are sent in later messages. An operation larger
+     * than the limit (e.g., a big subtree) is sent in a message on its own.
+     */
+    int max_operations_per_message;
+
+    /* Whether to adapt the batching delay to the traffic. If so, a message is
+     * sent min_batching_delay after the first pending operation if no others
+     * arrive and no message was sent recently. While operations keep arriving,
+     * the delay is doubled, with batching_delay as the cap on the total wait.
+     * Messages are never closer together than with a fixed batching_delay.
+     */
+    bool adaptive_batching;
+
+    /* Smallest batching delay, if adaptive_batching. */
+    TimeDelta min_batching_delay;
+
+    /* Whether to offer the server to compress messages. If the server accepts,
+     * messages whose contents other than the header take at least
+     * min_compressed_message_size bytes are sent compressed.
+     */
+    bool enable_compression;
+    int min_compressed_message_size;
+
+    /* Whether to send the initialize message, registrations and invalidation
+     * acks on a separate priority lane, after priority_batching_delay and
+     * within priority_rate_limits, so that they do not wait behind
+     * registration sync subtrees and info messages. Messages sent for those
+     * (after batching_delay and within rate_limits) also carry whatever
+     * priority operations are pending.
+     */
+    bool enable_priority_lane;
+    TimeDelta priority_batching_delay;
+    vector<RateLimit> priority_rate_limits;
+
+    /* How often to validate the messages sent to the server, which the Ticl
+     * builds itself: 1 validates every message, N > 1 validates the first and
+     * then one in N, and 0 validates none. Messages from the server are always
+     * validated.
+     */
+    int outbound_validation_interval;
+
+    /* Whether to enforce rate_limits and priority_rate_limits with token
+     * buckets (see RateBudget), which take constant space and time whatever
+     * the limits, instead of sliding windows.
+     */
+    bool use_token_buckets;
+
+    /* If not NULL, a budget (e.g., shared by all the clients in a process)
+     * that every message must also be allowed by. Implies use_token_buckets.
+     * Not owned.
+     */
+    RateBudget* shared_rate_budget;
+
+    /* If positive, info messages (other than those requesting the server's
+     * registration summary) are dropped while the rate limits have held back
+     * the sending of messages for at least this long, since they would only
+     * add to the backlog.
+     */
+    TimeDelta info_message_shedding_deficit;
+
+    /* Whether to hold back messages while the network channel reports that it
+     * is offline. The pending operations keep coalescing meanwhile, and are
+     * sent in one message as soon as the channel is back online.
+     */
+    bool pause_while_offline;
+
+    /* If positive, messages are pipelined: each one is kept until the server
+     * acknowledges its message id (ServerHeader.acked_message_id), at most
+     * this many are unacknowledged at once (later ones wait, with the pending
+     * operations coalescing, until acks free the window), and one still
+     * unacknowledged after message_ack_timeout is resent on its own, up to
+     * kMaxMessageRetransmissions times. A resent message leaves out the
+     * (un)registrations of objects that a later message also (un)registered,
+     * so that it cannot undo them at the server. The server must acknowledge
+     * the messages it receives.
+     */
+    int max_messages_in_flight;
+    TimeDelta message_ack_timeout;
+
+    /* Object sources (e.g., of revocations or kill switches) whose
+     * registrations and invalidation acks are sent as soon as the rate limits
+     * (of the priority lane, if enabled) allow, instead of after a batching
+     * delay. The message also carries the other pending operations. The
+     * listener is given invalidations of these sources ahead of the others of
+     * the same message.
+     */
+    vector<int> urgent_object_sources;
+
+    /* If positive, the largest payload in bytes that the server is asked to
+     * send inline in invalidations. Larger payloads are sent as references,
+     * which the application fetches with InvalidationClient::FetchPayload if
+     * it needs them, so that invalidation messages stay small.
+     */
+    int max_inline_payload_size;
+
+    /* Whether the application only uses the versions of invalidations. The
+     * server is then asked to leave payloads out of invalidations, and any
+     * it sends anyway are dropped on receipt, before they are copied into
+     * the upcalls.
+     */
+    bool omit_payloads;
+
+    /* Whether to offer the server to front-code object names. If the server
+     * accepts, the names of registrations and registration sync subtrees are
+     * sent sorted, each without the prefix it shares with the one before.
+     * This suits hierarchical names with long common prefixes, and costs far
+     * less CPU than compressing the whole message.
+     */
+    bool front_code_object_names;
+
+    /* If positive, the most registrations of a source that may be pending at
+     * once; the client reports further ones to the listener as transient
+     * failures (see AdmitRegistrations), so that a source with a runaway
+     * backlog cannot hold back the others. Urgent sources are exempt.
+     */
+    int max_pending_registrations_per_source;
+
+    /* Whether the registrations of each message are shared among the sources
+     * with some pending, the smaller backlogs first, rather than taken in
+     * order of object id, so that a source with a large backlog does not
+     * delay the others.
+     */
+    bool fair_queue_registrations;
+
     void GetConfigParams(vector<pair<string, int> >* config_params) {
       config_params->push_back(
           make_pair("batching_delay", batching_delay.InMilliseconds()));
+      config_params->push_back(
+          make_pair("max_operations_per_message", max_operations_per_message));
+      config_params->push_back(
+          make_pair("adaptive_batching", adaptive_batching ? 1 : 0));
+      config_params->push_back(
+          make_pair("min_batching_delay", min_batching_delay.InMilliseconds()));
+      config_params->push_back(
+          make_pair("enable_compression", enable_compression ? 1 : 0));
+      config_params->push_back(
+          make_pair("min_compressed_message_size",
+                    min_compressed_message_size));
+      config_params->push_back(
+          make_pair("enable_priority_lane", enable_priority_lane ? 1 : 0));
+      config_params->push_back(
+          make_pair("priority_batching_delay",
+                    priority_batching_delay.InMilliseconds()));
+      config_params->push_back(
+          make_pair("outbound_validation_interval",
+                    outbound_validation_interval));
+      config_params->push_back(
+          make_pair("use_token_buckets", use_token_buckets ? 1 : 0));
+      config_params->push_back(
+          make_pair("info_message_shedding_deficit",
+                    info_message_shedding_deficit.InMilliseconds()));
+      config_params->push_back(
+          make_pair("pause_while_offline", pause_while_offline ? 1 : 0));
+      config_params->push_back(
+          make_pair("max_messages_in_flight", max_messages_in_flight));
+      config_params->push_back(
+          make_pair("message_ack_timeout",
+                    message_ack_timeout.InMilliseconds()));
+      config_params->push_back(
+          make_pair("urgent_object_sources",
+                    static_cast<int>(urgent_object_sources.size())));
+      config_params->push_back(
+          make_pair("max_inline_payload_size", max_inline_payload_size));
+      config_params->push_back(
+          make_pair("omit_payloads", omit_payloads ? 1 : 0));
+      config_params->push_back(
+          make_pair("front_code_object_names",
+                    front_code_object_names ? 1 : 0));
+      config_params->push_back(
+          make_pair("max_pending_registrations_per_source",
+                    max_pending_registrations_per_source));
+      config_params->push_back(
+          make_pair("fair_queue_registrations",
+                    fair_queue_registrations ? 1 : 0));
     }
 
     // Default batching delay in milliseconds.
     static const int kDefaultBatchingDelayMs = 500;
+
+    // Default maximum number of operations per message.
+    static const int kDefaultMaxOperationsPerMessage = 5000;
+
+    // Default smallest adaptive batching delay in milliseconds.
+    static const int kDefaultMinBatchingDelayMs = 50;
+
+    // Default size in bytes above which messages are compressed (if enabled).
+    static const int kDefaultMinCompressedMessageSize = 1024;
+
+    // Default batching delay of the priority lane in milliseconds.
+    static const int kDefaultPriorityBatchingDelayMs = 100;
+
+    // Default time in milliseconds after which an unacknowledged pipelined
+    // message is resent.
+    static const int kDefaultMessageAckTimeoutMs = 10000;
   };
 
+  /* The number of times a pipelined message is resent before it is given up
+   * on, leaving the recovery to the Ticl's network timeouts.
+   */
+  static const int kMaxMessageRetransmissions = 2;
+
   /* Creates an instance.
    *
    * config - configuration for the client
@@ -190,11 +452,12 @@ class ProtocolHandler {
    *     debugging/monitoring)
    * listener - callback for protocol events
    * msg_validator - validator for protocol messages
+   * event_log - log of the messages sent and received, or NULL
    */
   ProtocolHandler(const Config& config, SystemResources* resources,
                   Statistics* statistics, const string& application_name,
                   ProtocolListener* listener,
-                  TiclMessageValidator* msg_validator);
+                  TiclMessageValidator* msg_validator, EventLog* event_log);
 
 
   /* Returns the next time a message is allowed to be sent to the server (could
@@ -204,6 +467,34 @@ class ProtocolHandler {
     return next_message_send_time_ms_;
   }
 
+  /* Returns the earliest time at which the quiet period and the rate limits
+   * allow a message (other than on the priority lane) to be sent to the
+   * server, which could be in the past.
+   */
+  int64 GetNextPermittedSendTimeMs();
+
+  /* Returns the time at which the last message was sent to the server, in
+   * milliseconds, or 0 if none has been.
+   */
+  int64 last_message_sent_time_ms() const {
+    return last_message_sent_time_ms_;
+  }
+
+  /* Returns whether messages are being held back because the network is
+   * offline (see Config::pause_while_offline).
+   */
+  bool IsPausedOffline() const {
+    return pause_while_offline_ && !is_network_online_;
+  }
+
+  /* Returns whether pipelined messages (see Config::max_messages_in_flight)
+   * are waiting to be acknowledged by the server, and will be resent if they
+   * are not.
+   */
+  bool HasMessagesInFlight() const {
+    return !in_flight_messages_.empty();
+  }
+
   /* Sends a message to the server to request a client token.
    *
    * Arguments:
@@ -211,11 +502,15 @@ class ProtocolHandler {
    *     backend
    * application_client_id - application-specific client id
    * nonce - nonce for the request
+   * catch_up_versions - if not NULL, the client can catch up incrementally,
+   *     and these are the highest versions it has processed (see
+   *     InitializeMessage.catch_up_version)
    * debug_string - information to identify the caller
    */
   void SendInitializeMessage(
       int client_type, const ApplicationClientIdP& applicationClientId,
-      const string& nonce, const string& debugString);
+      const string& nonce, const vector<InvalidationP>* catch_up_versions,
+      const string& debugString);
 
   /* Sends an info message to the server with the performance counters supplied
    * in performance_counters and the config supplies in config_params.
@@ -233,7 +528,23 @@ class ProtocolHandler {
   void SendRegistrations(const vector<ObjectIdP>& object_ids,
                          RegistrationP::OpType reg_op_type);
 
-  /* Sends an acknowledgement for invalidation to the server. */
+  /* Sets is_admitted[i] to whether sending the operation on object_ids[i] now
+   * keeps its source within Config::max_pending_registrations_per_source.
+   * An operation on an object that already has one pending replaces it, so it
+   * is always admitted.
+   */
+  void AdmitRegistrations(const vector<ObjectIdP>& object_ids,
+                          vector<bool>* is_admitted);
+
+  /* Returns whether AdmitRegistrations may reject operations. */
+  bool HasRegistrationBudgets() const {
+    return max_pending_registrations_per_source_ > 0;
+  }
+
+  /* Sends an acknowledgement for invalidation to the server. If an ack for a
+   * later version of the same object is already pending, does nothing; an ack
+   * for an earlier version is replaced.
+   */
   void SendInvalidationAck(const InvalidationP& invalidation);
 
   /* Sends a single registration subtree to the server.
@@ -243,9 +554,71 @@ class ProtocolHandler {
    */
   void SendRegistrationSyncSubtree(const RegistrationSubtree& reg_subtree);
 
+  /* Sends a request for the payload with payload_reference to the server,
+   * unless one is already pending. Payload fetches go with the priority
+   * operations, since the application is waiting for them.
+   */
+  void SendPayloadFetch(const string& payload_reference);
+
+  /* Returns whether source is one of Config::urgent_object_sources. */
+  bool IsUrgentSource(int source) const {
+    return !urgent_object_sources_.empty() &&
+        (urgent_object_sources_.count(source) > 0);
+  }
+
+  /* Returns whether registration subtrees are waiting to be sent. */
+  bool HasPendingRegistrationSyncSubtrees() {
+    return !pending_reg_subtrees_.empty();
+  }
+
+  /* Appends to usage the approximate heap bytes held by the pending
+   * operations, the reused message buffers and the throttles, by component
+   * name.
+   */
+  void GetMemoryUsage(vector<pair<string, size_t> >* usage);
+
  private:
+  /* A message received from the network, with the time at which it was
+   * received and its trace id.
+   */
+  struct ReceivedMessage {
+    Time receive_time;
+    uint64 trace_id;
+    string message;
+  };
+
+  /* A pipelined message not yet acknowledged by the server. */
+  struct InFlightMessage {
+    string message_id;
+
+    /* The message id and client time in the header of the message. */
+    int message_number;
+    int64 client_time_ms;
+
+    /* The client token the message was sent with. */
+    string client_token;
+
+    /* The serialized message, as sent. */
+    string message;
+
+    /* If the message (un)registers objects, its contents without the header
+     * and with full object names, less the operations superseded by later
+     * messages.
+     */
+    ClientToServerMessage body;
+
+    /* Whether operations were removed from body since message was encoded. */
+    bool has_superseded_operations;
+
+    int64 last_send_time_ms;
+    int num_retransmissions;
+  };
+
   /* Handles a message from the server. */
-  void HandleIncomingMessage(string incoming_message);
+  void HandleIncomingMessage(const ReceivedMessage& received_message);
+
+  /* Handles the messages queued by MessageReceiver. */
+  void HandleQueuedMessages();
 
   /* Verifies that the {@code serverToken} matches the token currently held by
    * the client.
@@ -253,22 +626,203 @@ class ProtocolHandler {
   bool CheckServerToken(const string& server_token);
 
   /* Sends pending data to the server (e.g., registrations, acks, registration
-   * sync messages).
+   * sync messages). If is_priority_lane, only sends the initialize message,
+   * registrations, acks and payload fetches.
    */
-  void SendMessageToServer();
+  void SendMessageToServer(bool is_priority_lane);
 
-  /* Stores the header to include on a message to the server. */
-  void InitClientHeader(ClientHeader* header);
+  /* Records in the statistics how long the rate limits held back the message
+   * being sent by sender, if at all.
+   */
+  void RecordThrottleDelay(Throttle* sender);
+
+  /* Returns whether registrations, acks or payload fetches are waiting to be
+   * sent.
+   */
+  bool HasPendingPriorityOperations() {
+    return !pending_acked_invalidations_.empty() ||
+        !pending_registrations_.empty() || !pending_payload_fetches_.empty();
+  }
+
+  /* Returns whether registrations, acks, payload fetches or registration
+   * subtrees are waiting to be sent.
+   */
+  bool HasPendingOperations() {
+    return HasPendingPriorityOperations() || !pending_reg_subtrees_.empty();
+  }
+
+  /* Returns whether ack1 and ack2 are for the same object and both for known
+   * or both for system versions, so that the later one subsumes the other.
+   */
+  static bool IsAckForSameVersionSpace(const InvalidationP& ack1,
+                                       const InvalidationP& ack2);
+
+  /* Removes the first element of pending and stores it in message. The element
+   * is swapped out rather than copied: it is erased right after, so its order
+   * in the set does not matter any more.
+   *
+   * REQUIRES: pending is not empty.
+   */
+  template <typename T>
+  static void TakeFirst(set<T, ProtoCompareLess>* pending, T* message) {
+    typename set<T, ProtoCompareLess>::iterator iter = pending->begin();
+    const_cast<T*>(&*iter)->Swap(message);
+    pending->erase(iter);
+  }
+
+  /* Records the sizes of the sub-messages of message, which is about to be
+   * sent.
+   */
+  void RecordSentBytes(const ClientToServerMessage& message);
+
+  /* Records the sizes of the sub-messages of message, which was parsed from
+   * num_bytes bytes.
+   */
+  void RecordReceivedBytes(const ServerToClientMessage& message,
+                           int num_bytes);
+
+  /* If the server accepts compression and body, the serialization of a
+   * message without its header, is large enough, replaces body with the
+   * serialization of a message with its compressed_content. builder, the
+   * message body was serialized from, is reused for that message.
+   */
+  void CompressBody(ClientToServerMessage* builder, string* body);
+
+  /* Returns whether to validate the next message to the server, according to
+   * Config::outbound_validation_interval.
+   */
+  bool ShouldValidateOutgoingMessage();
+
+  /* Returns a throttle for listener that enforces rate_limits as configured
+   * by config, storing in *budget the budget that it uses, if any.
+   */
+  Throttle* NewThrottle(const Config& config,
+                        const vector<RateLimit>& rate_limits,
+                        scoped_ptr<RateBudget>* budget, Closure* listener);
+
+  /* Stores the header of the message to the server with the given id and
+   * time, as outbound_encoder_ encodes it.
+   */
+  void InitClientHeader(int message_id, int64 client_time_ms,
+                        ClientHeader* header);
+
+  /* Schedules the batching task to send the pending operations, picking its
+   * delay if adaptive batching is enabled.
+   */
+  void ScheduleBatchingTask();
 
   /* Does the actual work of the batching task. */
   void BatchingTask();
 
-  /* Handles inbound messages from the network. */
-  void MessageReceiver(const string& message);
+  /* Applies the batching delay and rate limits of a ConfigChangeMessage
+   * from the server, and passes it on to the listener for the rest.
+   */
+  void HandleConfigChange(const ConfigChangeMessage& config_change);
+
+  /* Schedules the priority batching task to send the pending initialize
+   * message, registrations and acks, or the batching task if there is no
+   * priority lane.
+   */
+  void SchedulePriorityBatchingTask();
+
+  /* Does the actual work of the priority batching task. */
+  void PriorityBatchingTask();
+
+  /* Sends the pending operations, which include some for urgent objects, as
+   * soon as the rate limits allow.
+   */
+  void FlushUrgentOperations();
 
-  /* Responds to changes in network connectivity. */
+  /* Returns whether num_pending_registrations_per_source_ is maintained. */
+  bool CountsRegistrationsPerSource() const {
+    return (max_pending_registrations_per_source_ > 0) ||
+        fair_queue_registrations_;
+  }
+
+  /* Returns the number of pending registrations of source. */
+  int GetNumPendingRegistrations(int source) const {
+    map<int, int>::const_iterator iter =
+        num_pending_registrations_per_source_.find(source);
+    return (iter == num_pending_registrations_per_source_.end()) ?
+        0 : iter->second;
+  }
+
+  /* Moves up to max_registrations pending registrations into reg_message,
+   * in order of object id, shared among the sources as described in
+   * Config::fair_queue_registrations.
+   */
+  void TakeRegistrationsFairly(int max_registrations,
+                               RegistrationMessage* reg_message);
+
+  /* Handles inbound messages from the network: queues the message, taking the
+   * contents of *message, for the internal thread.
+   */
+  void MessageReceiver(string* message);
+
+  /* Responds to changes in network connectivity: queues status for the
+   * internal thread.
+   */
   void NetworkStatusReceiver(bool status);
 
+  /* Records a change in network connectivity, sends the messages held back
+   * while offline if it is back online, and informs the listener.
+   */
+  void HandleNetworkStatus(bool is_online);
+
+  /* If IsPausedOffline() or the window of pipelined messages is full, notes
+   * that a message is held back and returns true.
+   */
+  bool DeferIfPaused();
+
+  /* Returns whether Config::max_messages_in_flight messages are waiting to
+   * be acknowledged.
+   */
+  bool IsWindowFull() const {
+    return (max_messages_in_flight_ > 0) &&
+        (in_flight_messages_.size() >= max_messages_in_flight_);
+  }
+
+  /* Sends the message held back by DeferIfPaused, if any, once neither the
+   * network nor the window holds it back any longer.
+   */
+  void SendDeferredMessage();
+
+  /* Keeps the message just serialized into outgoing_buffer_ until the server
+   * acknowledges it, if messages are pipelined. If body is not NULL, it is
+   * the contents of the message, which (un)registers objects, and is taken;
+   * its operations supersede those on the same objects in the messages
+   * already in flight.
+   */
+  void TrackInFlightMessage(int message_id, int64 client_time_ms,
+                            const string& client_token,
+                            ClientToServerMessage* body);
+
+  /* Removes from the bodies of the messages in flight the (un)registrations
+   * of the objects that body (un)registers.
+   */
+  void SupersedeInFlightOperations(const ClientToServerMessage& body);
+
+  /* Removes from body the (un)registrations of the objects whose serialized
+   * ids are in object_keys. Returns whether any were removed.
+   */
+  static bool RemoveOperations(const set<string>& object_keys,
+                               ClientToServerMessage* body);
+
+  /* Re-encodes the message of in_flight from its body, as superseded
+   * operations were removed from the body since it was encoded.
+   */
+  void RebuildInFlightMessage(InFlightMessage* in_flight);
+
+  /* Stops tracking the messages acknowledged in header, and sends a message
+   * held back for the window if there is now room.
+   */
+  void HandleMessageAcks(const ServerHeader& header);
+
+  /* Resends the pipelined messages whose acks are overdue, and gives up on
+   * those resent too often.
+   */
+  void RetransmitTask();
+
   // Returns the current time in milliseconds.
   int64 GetCurrentTimeMs() {
     return InvalidationClientUtil::GetCurrentTimeMs(internal_scheduler_);
@@ -281,14 +835,142 @@ class ProtocolHandler {
   Logger* logger_;
   Scheduler* internal_scheduler_;
 
-  Throttle throttled_message_sender_;
+  /* Token buckets for the rate limits of the two lanes, if
+   * Config::use_token_buckets (or Config::shared_rate_budget).
+   */
+  scoped_ptr<RateBudget> rate_budget_;
+  scoped_ptr<RateBudget> priority_rate_budget_;
+
+  scoped_ptr<Throttle> throttled_message_sender_;
+
+  /* Rate limiter for the priority lane, if Config::enable_priority_lane. */
+  scoped_ptr<Throttle> priority_message_sender_;
   ProtocolListener* listener_;
   scoped_ptr<OperationScheduler> operation_scheduler_;
   TiclMessageValidator* msg_validator_;
 
+  /* Binary log of the messages, or NULL. Not owned. */
+  EventLog* event_log_;
+
+  /* See Config::max_operations_per_message. */
+  int max_operations_per_message_;
+
+  /* See Config::outbound_validation_interval. */
+  int outbound_validation_interval_;
+
+  /* See Config::info_message_shedding_deficit. */
+  TimeDelta info_message_shedding_deficit_;
+
+  /* Number of messages to the server to send before validating one. */
+  int messages_until_validation_;
+
+  /* Adaptive batching parameters (see Config). The maximum total wait is
+   * Config::batching_delay.
+   */
+  bool adaptive_batching_;
+  TimeDelta min_batching_delay_;
+  TimeDelta max_batching_delay_;
+
+  /* See Config::urgent_object_sources. */
+  set<int> urgent_object_sources_;
+
+  /* See Config::max_pending_registrations_per_source and
+   * Config::fair_queue_registrations.
+   */
+  int max_pending_registrations_per_source_;
+  bool fair_queue_registrations_;
+
+  /* Whether adaptive batching is waiting to send pending operations. */
+  bool is_batching_;
+
+  /* If is_batching_, the time at which the wait started. */
+  int64 batch_start_time_ms_;
+
+  /* If is_batching_, the delay with which the batching task was last
+   * scheduled.
+   */
+  TimeDelta current_batching_delay_;
+
+  /* Number of operations added since the batching task was last scheduled, if
+   * is_batching_.
+   */
+  int num_batched_arrivals_;
+
+  /* The time at which the last message was sent to the server. */
+  int64 last_message_sent_time_ms_;
+
+  /* See Config::pause_while_offline. */
+  bool pause_while_offline_;
+
+  /* Whether the network channel last reported being online. Assumed until
+   * it reports otherwise.
+   */
+  bool is_network_online_;
+
+  /* Whether a message was held back while offline or for a full window of
+   * pipelined messages.
+   */
+  bool has_deferred_message_;
+
+  /* Pipelining parameters (see Config). */
+  size_t max_messages_in_flight_;
+  TimeDelta message_ack_timeout_;
+
+  /* The pipelined messages not yet acknowledged, in the order sent. */
+  deque<InFlightMessage> in_flight_messages_;
+
+  /* Compression parameters (see Config). */
+  bool enable_compression_;
+  int min_compressed_message_size_;
+
+  /* Whether the last message from the server accepted DEFLATE compression. */
+  bool server_accepts_compression_;
+
+  /* See Config::front_code_object_names. */
+  bool front_code_object_names_;
+
+  /* Whether the last message from the server accepted front-coded names. */
+  bool server_accepts_front_coding_;
+
+  /* Buffer for the contents of a message being compressed. */
+  string compressed_content_;
+
   /* A debug message id that is added to every message to the server. */
   int message_id_;
 
+  /* The message from the server being handled. It is reused for every
+   * incoming message so that, once warmed up, parsing reuses the sub-messages
+   * and strings allocated for earlier messages instead of allocating new ones.
+   */
+  ServerToClientMessage incoming_message_;
+
+  /* Messages received from the network and not yet handled. The network
+   * thread pushes them without a lock, and only the first message into an
+   * empty queue schedules HandleQueuedMessages. Handled messages go back to
+   * the queue with their buffers, for the next ones received.
+   */
+  MpscQueue<ReceivedMessage> queued_messages_;
+
+  /* Trace id of the next message received. Incremented atomically, since
+   * messages may be received on any thread.
+   */
+  uint64 next_trace_id_;
+
+  /* The message being sent to the server and its serialized form. Both are
+   * reused for every outgoing message, like incoming_message_, so that sending
+   * does not allocate once they have grown to the usual message size.
+   */
+  ClientToServerMessage outgoing_message_;
+  string outgoing_buffer_;
+
+  /* Encoder of the outgoing messages, and reused buffers for the serialized
+   * message without its header and for the registration summary of its
+   * header.
+   */
+  scoped_ptr<OutboundMessageEncoder> outbound_encoder_;
+  string outgoing_body_;
+  RegistrationSummary outgoing_summary_;
+
   // State specific to a client. If we want to support multiple clients, this
   // could be in a map or could be eliminated (e.g., no batching).
 
@@ -306,12 +988,29 @@ class ProtocolHandler {
   map<ObjectIdP, RegistrationP::OpType, ProtoCompareLess>
       pending_registrations_;
 
-  /* Set of pending invalidation acks. */
-  set<InvalidationP, ProtoCompareLess> pending_acked_invalidations_;
+  /* Number of pending registrations of each source with some, if
+   * CountsRegistrationsPerSource().
+   */
+  map<int, int> num_pending_registrations_per_source_;
+
+  /* Set of pending invalidation acks, without payloads, each with the time at
+   * which it was first requested. Holds at most one ack per object and kind of
+   * version: the one for the highest version.
+   */
+  map<InvalidationP, Time, ProtoCompareLess> pending_acked_invalidations_;
 
   /* Set of pending registration sub trees for registration sync. */
   set<RegistrationSubtree, ProtoCompareLess> pending_reg_subtrees_;
 
+  /* References of the payloads to fetch from the server. */
+  set<string> pending_payload_fetches_;
+
+  /* See Config::max_inline_payload_size. */
+  int max_inline_payload_size_;
+
+  /* See Config::omit_payloads. */
+  bool omit_payloads_;
+
   /* Pending initialization message to send to the server, if any. */
   scoped_ptr<InitializeMessage> pending_initialize_message_;
 
@@ -323,6 +1022,23 @@ class ProtocolHandler {
 
   /* Task to send all batched messages to the server. */
   scoped_ptr<Closure> batching_task_;
+
+  /* Task to send the batched priority operations to the server, if
+   * Config::enable_priority_lane.
+   */
+  scoped_ptr<Closure> priority_batching_task_;
+
+  /* The operation scheduler's information for the batching tasks, with which
+   * they are scheduled without lookup or allocation.
+   */
+  OperationScheduleInfo* batching_operation_;
+  OperationScheduleInfo* priority_batching_operation_;
+
+  /* Task to resend overdue pipelined messages, and its operation, if
+   * Config::max_messages_in_flight is positive.
+   */
+  scoped_ptr<Closure> retransmit_task_;
+  OperationScheduleInfo* retransmit_operation_;
 };
 
 }  // namespace invalidation
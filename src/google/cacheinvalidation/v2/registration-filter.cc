@@ -0,0 +1,85 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Bloom filter over object ids.
+
+#include "google/cacheinvalidation/v2/registration-filter.h"
+
+#include <string>
+
+#include "google/cacheinvalidation/v2/logging.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+
+const int RegistrationFilter::kBitsPerObject;
+const int RegistrationFilter::kNumHashes;
+
+RegistrationFilter::RegistrationFilter(int capacity)
+    : capacity_(capacity),
+      num_added_(0) {
+  CHECK(capacity > 0) << "Bad filter capacity: " << capacity;
+  num_bits_ = static_cast<uint32>(capacity) * kBitsPerObject;
+  words_.assign((num_bits_ + 31) / 32, 0);
+}
+
+void RegistrationFilter::Add(const ObjectIdP& oid) {
+  uint64 hash = GetHash(oid);
+  uint32 h1 = static_cast<uint32>(hash);
+  uint32 h2 = static_cast<uint32>(hash >> 32) | 1;
+  for (int i = 0; i < kNumHashes; ++i) {
+    uint32 bit = (h1 + i * h2) % num_bits_;
+    words_[bit / 32] |= (1u << (bit % 32));
+  }
+  ++num_added_;
+}
+
+bool RegistrationFilter::MightContain(const ObjectIdP& oid) const {
+  uint64 hash = GetHash(oid);
+  uint32 h1 = static_cast<uint32>(hash);
+  uint32 h2 = static_cast<uint32>(hash >> 32) | 1;
+  for (int i = 0; i < kNumHashes; ++i) {
+    uint32 bit = (h1 + i * h2) % num_bits_;
+    if ((words_[bit / 32] & (1u << (bit % 32))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void RegistrationFilter::Clear() {
+  words_.assign(words_.size(), 0);
+  num_added_ = 0;
+}
+
+uint64 RegistrationFilter::GetHash(const ObjectIdP& oid) {
+  // FNV-1a over the source and the name, followed by a final mix so that the
+  // high and low halves are both well distributed.
+  uint64 hash = 14695981039346656037ULL;
+  uint32 source = static_cast<uint32>(oid.source());
+  for (int i = 0; i < 4; ++i) {
+    hash = (hash ^ ((source >> (8 * i)) & 0xff)) * 1099511628211ULL;
+  }
+  const string& name = oid.name();
+  for (size_t i = 0; i < name.size(); ++i) {
+    hash = (hash ^ static_cast<unsigned char>(name[i])) * 1099511628211ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+}  // namespace invalidation
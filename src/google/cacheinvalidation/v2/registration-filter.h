@@ -0,0 +1,98 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Bloom filter over object ids, used to tell cheaply that an object is
+// definitely not registered.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_REGISTRATION_FILTER_H_
+#define GOOGLE_CACHEINVALIDATION_V2_REGISTRATION_FILTER_H_
+
+#include <vector>
+
+#include "base/basictypes.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* A set of object ids that may report false positives but never false
+ * negatives. Objects cannot be removed; the owner rebuilds the filter once
+ * enough of its objects are stale.
+ *
+ * Implementation notes: each object sets kNumHashes bits, picked by double
+ * hashing of a 64-bit hash of the source and name. With kBitsPerObject bits
+ * per object of capacity, the false positive rate stays under 1% as long as at
+ * most capacity objects have been added.
+ */
+class RegistrationFilter {
+ public:
+  /* Creates an empty filter sized for capacity objects. */
+  explicit RegistrationFilter(int capacity);
+
+  /* Adds oid to the filter. */
+  void Add(const ObjectIdP& oid);
+
+  /* Returns false if oid has definitely not been added since the filter was
+   * created or cleared.
+   */
+  bool MightContain(const ObjectIdP& oid) const;
+
+  /* Removes all the objects from the filter. */
+  void Clear();
+
+  /* Returns the number of objects the filter was sized for. */
+  int capacity() const {
+    return capacity_;
+  }
+
+  /* Returns the number of calls to Add since the filter was created or
+   * cleared.
+   */
+  int num_added() const {
+    return num_added_;
+  }
+
+  /* Returns the number of bytes allocated for the bits of the filter. */
+  size_t GetAllocatedBytes() const {
+    return words_.capacity() * sizeof(uint32);
+  }
+
+  /* Number of bits of the filter per object of capacity. */
+  static const int kBitsPerObject = 10;
+
+  /* Number of bits set per object. */
+  static const int kNumHashes = 7;
+
+ private:
+  /* Returns a 64-bit hash of oid. */
+  static uint64 GetHash(const ObjectIdP& oid);
+
+  /* The bits of the filter, 32 per word. */
+  vector<uint32> words_;
+
+  /* The number of bits in words_ that are in use. */
+  uint32 num_bits_;
+
+  /* See capacity(). */
+  int capacity_;
+
+  /* See num_added(). */
+  int num_added_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_REGISTRATION_FILTER_H_
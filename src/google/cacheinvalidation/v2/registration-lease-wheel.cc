@@ -0,0 +1,116 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Timing wheel of registration leases, which expires the registrations that
+// the application has not renewed.
+
+#include "google/cacheinvalidation/v2/registration-lease-wheel.h"
+
+#include "google/cacheinvalidation/v2/logging.h"
+#include "google/cacheinvalidation/v2/memory-usage.h"
+
+namespace invalidation {
+
+RegistrationLeaseWheel::RegistrationLeaseWheel(int64 lease_ms, int64 now_ms)
+    : slots_(kNumSlots) {
+  CHECK(lease_ms > 0) << "lease must be positive";
+  // Round the tick up so that a lease spans at most kNumSlots - 1 ticks.
+  tick_ms_ = (lease_ms + kNumSlots - 2) / (kNumSlots - 1);
+  lease_ticks_ = (lease_ms + tick_ms_ - 1) / tick_ms_;
+  current_tick_ = GetTick(now_ms);
+}
+
+void RegistrationLeaseWheel::Renew(const vector<ObjectIdP>& object_ids,
+                                   int64 now_ms) {
+  int64 expiry_tick = GetTick(now_ms) + lease_ticks_;
+  string serialized;
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    object_ids[i].SerializeToString(&serialized);
+    int64& object_expiry_tick = expiry_ticks_[serialized];
+    if (object_expiry_tick == expiry_tick) {
+      continue;  // Already filed in this tick's slot.
+    }
+    object_expiry_tick = expiry_tick;
+    slots_[expiry_tick % kNumSlots].push_back(serialized);
+  }
+}
+
+void RegistrationLeaseWheel::Remove(const vector<ObjectIdP>& object_ids) {
+  string serialized;
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    object_ids[i].SerializeToString(&serialized);
+    expiry_ticks_.erase(serialized);
+  }
+}
+
+void RegistrationLeaseWheel::Clear() {
+  expiry_ticks_.clear();
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    vector<string>().swap(slots_[i]);
+  }
+}
+
+void RegistrationLeaseWheel::Advance(int64 now_ms,
+                                     vector<ObjectIdP>* expired) {
+  int64 now_tick = GetTick(now_ms);
+  if (now_tick <= current_tick_) {
+    return;
+  }
+  // After a long pause, each slot is visited once, expiring all it holds that
+  // is due.
+  int64 first_tick = current_tick_ + 1;
+  if (now_tick - first_tick >= kNumSlots) {
+    first_tick = now_tick - kNumSlots + 1;
+  }
+  current_tick_ = now_tick;
+  for (int64 tick = first_tick; tick <= now_tick; ++tick) {
+    int slot_index = static_cast<int>(tick % kNumSlots);
+    vector<string>& slot = slots_[slot_index];
+    size_t num_kept = 0;
+    for (size_t i = 0; i < slot.size(); ++i) {
+      map<string, int64>::iterator iter = expiry_ticks_.find(slot[i]);
+      if (iter == expiry_ticks_.end()) {
+        continue;  // Removed, or expired through another entry.
+      }
+      if (iter->second <= now_tick) {
+        expired->push_back(ObjectIdP());
+        expired->back().ParseFromString(slot[i]);
+        expiry_ticks_.erase(iter);
+      } else if (iter->second % kNumSlots == slot_index) {
+        // Due in a later turn of the wheel, which only happens after a pause.
+        slot[num_kept++].swap(slot[i]);
+      }
+      // Otherwise the lease was renewed and is filed in another slot.
+    }
+    slot.resize(num_kept);
+  }
+}
+
+size_t RegistrationLeaseWheel::GetAllocatedBytes() const {
+  size_t bytes = MemoryUsage::TreeNodeBytes(expiry_ticks_) +
+      slots_.capacity() * sizeof(vector<string>);
+  for (map<string, int64>::const_iterator iter = expiry_ticks_.begin();
+       iter != expiry_ticks_.end(); ++iter) {
+    bytes += MemoryUsage::StringBytes(iter->first);
+  }
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    bytes += slots_[i].capacity() * sizeof(string);
+    for (size_t j = 0; j < slots_[i].size(); ++j) {
+      bytes += MemoryUsage::StringBytes(slots_[i][j]);
+    }
+  }
+  return bytes;
+}
+
+}  // namespace invalidation
@@ -0,0 +1,112 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Timing wheel of registration leases, which expires the registrations that
+// the application has not renewed.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_REGISTRATION_LEASE_WHEEL_H_
+#define GOOGLE_CACHEINVALIDATION_V2_REGISTRATION_LEASE_WHEEL_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* The leases of a set of objects, each of which expires lease_ms after it was
+ * last renewed, give or take one tick of lease_ms / kNumSlots.
+ *
+ * Implementation notes: a lease is filed in the slot of the tick in which it
+ * expires. Since no lease lasts longer than kNumSlots - 1 ticks, each slot
+ * only holds leases expiring in its next turn, and Advance visits the slots of
+ * the ticks that have passed. Renewing or removing a lease leaves its old slot
+ * entry in place, to be dropped when that slot comes up; an object is thus
+ * filed at most once per tick of its lease.
+ *
+ * This class is not thread-safe.
+ */
+class RegistrationLeaseWheel {
+ public:
+  /* Creates a wheel of leases lasting lease_ms, starting at now_ms. */
+  RegistrationLeaseWheel(int64 lease_ms, int64 now_ms);
+
+  /* Starts or renews the leases of object_ids at now_ms. */
+  void Renew(const vector<ObjectIdP>& object_ids, int64 now_ms);
+
+  /* Removes the leases of object_ids, if any. */
+  void Remove(const vector<ObjectIdP>& object_ids);
+
+  /* Removes all the leases. */
+  void Clear();
+
+  /* Appends to expired the objects whose leases have expired by now_ms, and
+   * removes their leases.
+   */
+  void Advance(int64 now_ms, vector<ObjectIdP>* expired);
+
+  /* Returns the number of objects with a lease. */
+  int size() const {
+    return static_cast<int>(expiry_ticks_.size());
+  }
+
+  /* Returns the interval at which Advance needs to be called for the leases
+   * to expire on time.
+   */
+  int64 tick_ms() const {
+    return tick_ms_;
+  }
+
+  /* Returns the approximate number of heap bytes held by the wheel. */
+  size_t GetAllocatedBytes() const;
+
+  /* Number of slots of the wheel. */
+  static const int kNumSlots = 64;
+
+ private:
+  /* Returns the tick containing time_ms. */
+  int64 GetTick(int64 time_ms) const {
+    return time_ms / tick_ms_;
+  }
+
+  /* Duration of a lease, in ticks. */
+  int64 lease_ticks_;
+
+  /* Duration of a tick. */
+  int64 tick_ms_;
+
+  /* The last tick whose leases have been expired. */
+  int64 current_tick_;
+
+  /* The tick in which the lease of each object expires, keyed by serialized
+   * object id.
+   */
+  map<string, int64> expiry_ticks_;
+
+  /* For each slot, the serialized object ids filed in it, some of them
+   * stale.
+   */
+  vector<vector<string> > slots_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_REGISTRATION_LEASE_WHEEL_H_
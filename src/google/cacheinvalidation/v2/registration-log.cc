@@ -0,0 +1,285 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Persistent log of the desired registrations of a client.
+
+#include "google/cacheinvalidation/v2/registration-log.h"
+
+#include "google/cacheinvalidation/v2/log-macro.h"
+#include "google/cacheinvalidation/v2/pooled-callback.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+
+namespace invalidation {
+
+RegistrationLog::RegistrationLog(
+    Storage* storage, Scheduler* internal_scheduler, Logger* logger,
+    Statistics* statistics, int compaction_threshold,
+    ExponentialBackoffDelayGenerator* retry_backoff,
+    TimeDelta initial_retry_delay)
+    : storage_(storage),
+      internal_scheduler_(internal_scheduler),
+      logger_(logger),
+      statistics_(statistics),
+      compaction_threshold_(compaction_threshold),
+      server_summary_writer_(storage, internal_scheduler, logger, statistics,
+                             kServerSummaryKey, retry_backoff,
+                             initial_retry_delay),
+      first_sequence_number_(0),
+      next_sequence_number_(0),
+      snapshot_sequence_number_(0),
+      is_snapshot_write_in_flight_(false),
+      must_compact_(false),
+      has_loaded_snapshot_(false),
+      has_loaded_server_summary_(false),
+      load_done_(NULL) {
+  CHECK(compaction_threshold > 0);
+}
+
+void RegistrationLog::Load(Closure* done) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  CHECK(load_done_ == NULL) << "Already loading";
+  load_done_ = done;
+  storage_->ReadKey(
+      kSnapshotKey,
+      NewPermanentCallback(this, &RegistrationLog::ReadCallback,
+                           LOAD_SNAPSHOT));
+}
+
+bool RegistrationLog::TakeLoadedState(
+    PersistentRegistrationSnapshot* snapshot,
+    vector<PersistentRegistrationLogEntry>* entries,
+    RegistrationSummary* server_summary) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (!has_loaded_snapshot_ || !has_loaded_server_summary_) {
+    return false;
+  }
+  snapshot->Swap(&loaded_snapshot_);
+  entries->swap(loaded_entries_);
+  server_summary->Swap(&loaded_server_summary_);
+  loaded_snapshot_.Clear();
+  loaded_entries_.clear();
+  loaded_server_summary_.Clear();
+  has_loaded_snapshot_ = false;
+  has_loaded_server_summary_ = false;
+  return true;
+}
+
+void RegistrationLog::DiscardLoadedState() {
+  loaded_snapshot_.Clear();
+  loaded_entries_.clear();
+  loaded_server_summary_.Clear();
+  has_loaded_snapshot_ = false;
+  has_loaded_server_summary_ = false;
+  must_compact_ = true;
+}
+
+void RegistrationLog::AppendOperations(
+    const vector<ObjectIdP>& object_ids, RegistrationP::OpType reg_op_type) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  PersistentRegistrationLogEntry entry;
+  entry.set_sequence_number(next_sequence_number_);
+  entry.set_op_type(reg_op_type);
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    entry.add_object_id()->CopyFrom(object_ids[i]);
+  }
+  string serialized_entry;
+  entry.SerializeToString(&serialized_entry);
+  storage_->WriteKey(
+      GetLogEntryKey(next_sequence_number_), serialized_entry,
+      NewPermanentCallback(this, &RegistrationLog::LogEntryWriteCallback));
+  ++next_sequence_number_;
+}
+
+void RegistrationLog::WriteServerSummary(
+    const RegistrationSummary& server_summary) {
+  // Only the overall summary is needed to tell whether the restored
+  // registrations are in sync.
+  RegistrationSummary summary;
+  summary.set_num_registrations(server_summary.num_registrations());
+  summary.set_registration_digest(server_summary.registration_digest());
+  string serialized_summary;
+  summary.SerializeToString(&serialized_summary);
+  server_summary_writer_.Write(serialized_summary);
+}
+
+void RegistrationLog::WriteSnapshot(const vector<ObjectIdP>& registrations) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  CHECK(!is_snapshot_write_in_flight_) << "Snapshot write already in flight";
+  PersistentRegistrationSnapshot snapshot;
+  snapshot.set_next_sequence_number(next_sequence_number_);
+  for (size_t i = 0; i < registrations.size(); ++i) {
+    snapshot.add_registration()->CopyFrom(registrations[i]);
+  }
+  string serialized_snapshot;
+  snapshot.SerializeToString(&serialized_snapshot);
+  TLOG(logger_, INFO, "Compacting registration log: %d entries, %d objects",
+       GetNumUncompactedEntries(), static_cast<int>(registrations.size()));
+  is_snapshot_write_in_flight_ = true;
+  must_compact_ = false;
+  snapshot_sequence_number_ = next_sequence_number_;
+  storage_->WriteKey(
+      kSnapshotKey, serialized_snapshot,
+      NewPermanentCallback(this, &RegistrationLog::SnapshotWriteCallback));
+}
+
+string RegistrationLog::GetLogEntryKey(int64 sequence_number) {
+  return StringPrintf("%s%lld", kLogEntryKeyPrefix,
+                      static_cast<long long>(sequence_number));
+}
+
+void RegistrationLog::ReadCallback(LoadStep step,
+                                   StatusStringPair read_result) {
+  // The storage may call back on any thread.
+  internal_scheduler_->Schedule(
+      Scheduler::NoDelay(),
+      NewPooledCallback(this, &RegistrationLog::HandleRead, step,
+                        read_result));
+}
+
+void RegistrationLog::HandleRead(LoadStep step,
+                                 StatusStringPair read_result) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  bool found = read_result.first.IsSuccess();
+  switch (step) {
+    case LOAD_SNAPSHOT:
+      if (found) {
+        has_loaded_snapshot_ =
+            loaded_snapshot_.ParseFromString(read_result.second);
+        if (!has_loaded_snapshot_) {
+          statistics_->RecordError(
+              Statistics::ClientErrorType_PERSISTENT_DESERIALIZATION_FAILURE);
+          TLOG(logger_, SEVERE, "Failed deserializing registration snapshot");
+          loaded_snapshot_.Clear();
+        }
+      }
+      // Without a snapshot, look for the log from its start so that any
+      // entries in storage are found and compacted away.
+      first_sequence_number_ = loaded_snapshot_.next_sequence_number();
+      next_sequence_number_ = first_sequence_number_;
+      snapshot_sequence_number_ = first_sequence_number_;
+      storage_->ReadKey(
+          kServerSummaryKey,
+          NewPermanentCallback(this, &RegistrationLog::ReadCallback,
+                               LOAD_SERVER_SUMMARY));
+      return;
+    case LOAD_SERVER_SUMMARY:
+      has_loaded_server_summary_ = found &&
+          loaded_server_summary_.ParseFromString(read_result.second);
+      break;
+    case LOAD_LOG_ENTRY:
+      if (found) {
+        PersistentRegistrationLogEntry entry;
+        if (entry.ParseFromString(read_result.second) &&
+            (entry.sequence_number() == next_sequence_number_)) {
+          loaded_entries_.push_back(entry);
+          ++next_sequence_number_;
+          break;
+        }
+        statistics_->RecordError(
+            Statistics::ClientErrorType_PERSISTENT_DESERIALIZATION_FAILURE);
+        TLOG(logger_, SEVERE, "Failed deserializing registration log entry "
+             "%lld", next_sequence_number_);
+
+        // Skip the corrupt entry so that it is overwritten by neither a new
+        // entry nor the entries after it, and drop the state.
+        ++next_sequence_number_;
+        has_loaded_snapshot_ = false;
+        must_compact_ = true;
+      }
+      TLOG(logger_, INFO, "Read registration log of %d entries",
+           static_cast<int>(loaded_entries_.size()));
+      if (!has_loaded_snapshot_) {
+        loaded_entries_.clear();
+      }
+      Closure* done = load_done_;
+      load_done_ = NULL;
+      done->Run();
+      delete done;
+      return;
+  }
+
+  // Read the next log entry.
+  storage_->ReadKey(
+      GetLogEntryKey(next_sequence_number_),
+      NewPermanentCallback(this, &RegistrationLog::ReadCallback,
+                           LOAD_LOG_ENTRY));
+}
+
+void RegistrationLog::LogEntryWriteCallback(Status status) {
+  // The storage may call back on any thread.
+  internal_scheduler_->Schedule(
+      Scheduler::NoDelay(),
+      NewPooledCallback(this, &RegistrationLog::HandleLogEntryWriteDone,
+                        status));
+}
+
+void RegistrationLog::HandleLogEntryWriteDone(Status status) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (!status.IsSuccess()) {
+    // The entries after the lost one would not be read, so write a snapshot
+    // that includes them.
+    statistics_->RecordError(
+        Statistics::ClientErrorType_PERSISTENT_WRITE_FAILURE);
+    TLOG(logger_, WARNING, "Failed writing registration log entry: %s",
+         status.message().c_str());
+    must_compact_ = true;
+  }
+}
+
+void RegistrationLog::SnapshotWriteCallback(Status status) {
+  // The storage may call back on any thread.
+  internal_scheduler_->Schedule(
+      Scheduler::NoDelay(),
+      NewPooledCallback(this, &RegistrationLog::HandleSnapshotWriteDone,
+                        status));
+}
+
+void RegistrationLog::HandleSnapshotWriteDone(Status status) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  is_snapshot_write_in_flight_ = false;
+  if (!status.IsSuccess()) {
+    // Whichever snapshot the storage now holds, the entries after it are still
+    // there. Compact again at the next opportunity.
+    statistics_->RecordError(
+        Statistics::ClientErrorType_PERSISTENT_WRITE_FAILURE);
+    TLOG(logger_, WARNING, "Failed writing registration snapshot: %s",
+         status.message().c_str());
+    must_compact_ = true;
+    return;
+  }
+
+  // The snapshot covers the entries before it. Delete them.
+  for (; first_sequence_number_ < snapshot_sequence_number_;
+       ++first_sequence_number_) {
+    storage_->DeleteKey(
+        GetLogEntryKey(first_sequence_number_),
+        NewPermanentCallback(this, &RegistrationLog::DeleteCallback));
+  }
+}
+
+void RegistrationLog::DeleteCallback(bool success) {
+  // An entry that was not deleted is not read again, since the snapshot starts
+  // after it. Nothing else to do.
+  if (!success) {
+    TLOG(logger_, WARNING, "Failed deleting registration log entry");
+  }
+}
+
+const char* RegistrationLog::kSnapshotKey = "RegistrationSnapshot";
+
+const char* RegistrationLog::kLogEntryKeyPrefix = "RegistrationLog.";
+
+const char* RegistrationLog::kServerSummaryKey = "ServerRegistrationSummary";
+
+}  // namespace invalidation
@@ -0,0 +1,209 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Persistent log of the desired registrations of a client.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_REGISTRATION_LOG_H_
+#define GOOGLE_CACHEINVALIDATION_V2_REGISTRATION_LOG_H_
+
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/exponential-backoff-delay-generator.h"
+#include "google/cacheinvalidation/v2/persistent-state-writer.h"
+#include "google/cacheinvalidation/v2/statistics.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
+#include "google/cacheinvalidation/v2/time.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Persists the desired registrations of a client, and the last registration
+ * summary received from the server, so that a restarted client can resume with
+ * them instead of having the application reissue all its registrations.
+ *
+ * The registrations are kept through the Storage interface as a snapshot plus
+ * an append-only log of the operations performed since: each operation is
+ * written to a key of its own, named after its sequence number, so that it
+ * costs one small write however many registrations there are. Once the log
+ * has compaction_threshold entries, a new snapshot is written and the entries
+ * that it covers are deleted.
+ *
+ * When loading, the entries that follow the snapshot are read in sequence
+ * order up to the first one that is missing; an entry lost in a crash thus also
+ * hides the ones after it. Such a loss, like any other, shows up as a mismatch
+ * between the restored registrations and the persisted server summary, in
+ * which case the caller should not use the restored registrations.
+ *
+ * All methods must be called on the internal thread of the scheduler.
+ */
+class RegistrationLog {
+ public:
+  /* Creates a log in storage, which runs on internal_scheduler. retry_backoff,
+   * which is owned by this after the call, gives the delays before retrying a
+   * failed write of the server summary; it is reset to initial_retry_delay
+   * after a successful write.
+   */
+  RegistrationLog(Storage* storage, Scheduler* internal_scheduler,
+                  Logger* logger, Statistics* statistics,
+                  int compaction_threshold,
+                  ExponentialBackoffDelayGenerator* retry_backoff,
+                  TimeDelta initial_retry_delay);
+
+  /* Reads the persisted snapshot, log entries and server summary, then runs
+   * and deletes done. Later writes append to the log that was read.
+   *
+   * REQUIRES: Called once, before any other method.
+   */
+  void Load(Closure* done);
+
+  /* Moves the state read by Load into snapshot, entries (in order) and
+   * server_summary. Returns false, moving nothing, if no (uncorrupted) snapshot
+   * or server summary was read.
+   */
+  bool TakeLoadedState(PersistentRegistrationSnapshot* snapshot,
+                       vector<PersistentRegistrationLogEntry>* entries,
+                       RegistrationSummary* server_summary);
+
+  /* Drops the state read by Load, and makes NeedsCompaction return true so
+   * that the snapshot written next replaces what is in storage.
+   */
+  void DiscardLoadedState();
+
+  /* Appends an entry for reg_op_type on object_ids to the log. */
+  void AppendOperations(const vector<ObjectIdP>& object_ids,
+                        RegistrationP::OpType reg_op_type);
+
+  /* Persists server_summary as the last known summary from the server. */
+  void WriteServerSummary(const RegistrationSummary& server_summary);
+
+  /* Returns whether the log should be replaced by a snapshot, i.e., whether it
+   * has grown to the compaction threshold, an entry could not be written, or
+   * RequestCompaction was called, and no snapshot is being written.
+   */
+  bool NeedsCompaction() const {
+    return !is_snapshot_write_in_flight_ &&
+        (must_compact_ || (GetNumUncompactedEntries() >= compaction_threshold_));
+  }
+
+  /* Makes NeedsCompaction return true. */
+  void RequestCompaction() {
+    must_compact_ = true;
+  }
+
+  /* Writes registrations, which must be all the desired registrations after
+   * the operations appended so far, as the snapshot. Once the snapshot is
+   * written, deletes the entries that it covers.
+   */
+  void WriteSnapshot(const vector<ObjectIdP>& registrations);
+
+  /* Returns the number of entries appended since the snapshot being written, or
+   * since the last one written.
+   */
+  int GetNumUncompactedEntries() const {
+    return static_cast<int>(next_sequence_number_ - snapshot_sequence_number_);
+  }
+
+  /* Key of the snapshot of the registrations. */
+  static const char* kSnapshotKey;
+
+  /* Prefix of the keys of the log entries, which is followed by the sequence
+   * number of the entry.
+   */
+  static const char* kLogEntryKeyPrefix;
+
+  /* Key of the last known server summary. */
+  static const char* kServerSummaryKey;
+
+ private:
+  /* Steps of Load, each reading one key. */
+  enum LoadStep {
+    LOAD_SNAPSHOT,
+    LOAD_SERVER_SUMMARY,
+    LOAD_LOG_ENTRY
+  };
+
+  /* Returns the key of the log entry with sequence_number. */
+  static string GetLogEntryKey(int64 sequence_number);
+
+  /* Called by the storage when the read of step finishes. */
+  void ReadCallback(LoadStep step, StatusStringPair read_result);
+
+  /* Handles the result of the read of step on the internal thread, then reads
+   * the next key or finishes loading.
+   */
+  void HandleRead(LoadStep step, StatusStringPair read_result);
+
+  /* Called by the storage when a log entry write finishes. */
+  void LogEntryWriteCallback(Status status);
+
+  /* Handles the result of a log entry write on the internal thread. */
+  void HandleLogEntryWriteDone(Status status);
+
+  /* Called by the storage when the snapshot write finishes. */
+  void SnapshotWriteCallback(Status status);
+
+  /* Handles the result of the snapshot write on the internal thread. */
+  void HandleSnapshotWriteDone(Status status);
+
+  /* Called by the storage when the deletion of a log entry finishes. */
+  void DeleteCallback(bool success);
+
+  Storage* storage_;
+  Scheduler* internal_scheduler_;
+  Logger* logger_;
+  Statistics* statistics_;
+
+  /* Number of log entries after which a new snapshot is written. */
+  int compaction_threshold_;
+
+  /* Coalescing writer of the server summary. */
+  PersistentStateWriter server_summary_writer_;
+
+  /* Sequence number of the oldest log entry that may still be in storage. */
+  int64 first_sequence_number_;
+
+  /* Sequence number of the next log entry to append. */
+  int64 next_sequence_number_;
+
+  /* Sequence number of the first log entry not covered by the snapshot being
+   * written, or by the last one written.
+   */
+  int64 snapshot_sequence_number_;
+
+  /* Whether a snapshot write is outstanding. */
+  bool is_snapshot_write_in_flight_;
+
+  /* Whether a new snapshot must be written regardless of the log size. */
+  bool must_compact_;
+
+  /* The state read by Load, until taken. */
+  PersistentRegistrationSnapshot loaded_snapshot_;
+  vector<PersistentRegistrationLogEntry> loaded_entries_;
+  RegistrationSummary loaded_server_summary_;
+  bool has_loaded_snapshot_;
+  bool has_loaded_server_summary_;
+
+  /* Task to run once Load finishes. Owned. */
+  Closure* load_done_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_REGISTRATION_LOG_H_
@@ -20,15 +20,24 @@
 
 #include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
 #include "google/cacheinvalidation/v2/log-macro.h"
+#include "google/cacheinvalidation/v2/memory-usage.h"
+#include "google/cacheinvalidation/v2/merkle-trie-registration-store.h"
+#include "google/cacheinvalidation/v2/object-id-digest-utils.h"
 #include "google/cacheinvalidation/v2/proto-helpers.h"
-#include "google/cacheinvalidation/v2/simple-registration-store.h"
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
 RegistrationManager::RegistrationManager(
     Logger* logger, Statistics* statistics, DigestFunction* digest_function)
-    : desired_registrations_(new SimpleRegistrationStore(digest_function)),
+    : desired_registrations_(new MerkleTrieRegistrationStore(
+          digest_function, kDigestStoreLevels)),
+      num_stale_filter_objects_(0),
+      registration_log_(NULL),
       statistics_(statistics),
+      max_sync_subtree_size_(0),
+      is_client_summary_stale_(true),
       logger_(logger) {
   // Initialize the server summary with a 0 size and the digest corresponding to
   // it.  Using defaultInstance would wrong since the server digest will not
@@ -36,12 +45,91 @@ RegistrationManager::RegistrationManager(
   GetClientSummary(&last_known_server_summary_);
 }
 
+bool RegistrationManager::RestoreRegistrations() {
+  CHECK(registration_log_ != NULL);
+  PersistentRegistrationSnapshot snapshot;
+  vector<PersistentRegistrationLogEntry> entries;
+  RegistrationSummary server_summary;
+  if (!registration_log_->TakeLoadedState(&snapshot, &entries,
+                                          &server_summary)) {
+    TLOG(logger_, INFO, "No persisted registrations to restore");
+    DiscardRestoredRegistrations();
+    return false;
+  }
+  vector<ObjectIdP> object_ids(snapshot.registration().begin(),
+                               snapshot.registration().end());
+  ApplyOperations(object_ids, NULL, RegistrationP_OpType_REGISTER);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    object_ids.assign(entries[i].object_id().begin(),
+                      entries[i].object_id().end());
+    ApplyOperations(object_ids, NULL, entries[i].op_type());
+  }
+  last_known_server_summary_.CopyFrom(server_summary);
+
+  if (!IsStateInSyncWithServer()) {
+    // Some registrations were lost, or the server had not caught up with the
+    // application when the client stopped: the restored registrations cannot
+    // be trusted.
+    TLOG(logger_, INFO, "Persisted registrations not in sync: %s",
+         ToString().c_str());
+    desired_registrations_->RemoveAll(&object_ids);
+    InvalidateClientSummary();
+    if (registration_filter_.get() != NULL) {
+      RebuildRegistrationFilter();
+    }
+    GetClientSummary(&last_known_server_summary_);
+    DiscardRestoredRegistrations();
+    return false;
+  }
+  TLOG(logger_, INFO, "Restored %d registrations from %d log entries",
+       desired_registrations_->size(), static_cast<int>(entries.size()));
+  MaybeCompactRegistrationLog();
+  return true;
+}
+
+void RegistrationManager::DiscardRestoredRegistrations() {
+  CHECK(registration_log_ != NULL);
+  registration_log_->DiscardLoadedState();
+  MaybeCompactRegistrationLog();
+}
+
 void RegistrationManager::PerformOperations(
-    const vector<ObjectIdP>& object_ids, RegistrationP::OpType reg_op_type) {
+    const vector<ObjectIdP>& object_ids, const vector<string>* digests,
+    RegistrationP::OpType reg_op_type) {
+  ApplyOperations(object_ids, digests, reg_op_type);
+  if (registration_log_ != NULL) {
+    registration_log_->AppendOperations(object_ids, reg_op_type);
+    MaybeCompactRegistrationLog();
+  }
+}
+
+void RegistrationManager::ApplyOperations(
+    const vector<ObjectIdP>& object_ids, const vector<string>* digests,
+    RegistrationP::OpType reg_op_type) {
+  InvalidateClientSummary();
   if (reg_op_type == RegistrationP_OpType_REGISTER) {
-    desired_registrations_->Add(object_ids);
+    if (digests != NULL) {
+      desired_registrations_->AddWithDigests(object_ids, *digests);
+    } else {
+      desired_registrations_->Add(object_ids);
+    }
+    if (registration_filter_.get() != NULL) {
+      if (registration_filter_->num_added() + object_ids.size() >
+          static_cast<size_t>(registration_filter_->capacity())) {
+        RebuildRegistrationFilter();
+      } else {
+        for (size_t i = 0; i < object_ids.size(); ++i) {
+          registration_filter_->Add(object_ids[i]);
+        }
+      }
+    }
   } else {
-    desired_registrations_->Remove(object_ids);
+    if (digests != NULL) {
+      desired_registrations_->RemoveWithDigests(object_ids, *digests);
+    } else {
+      desired_registrations_->Remove(object_ids);
+    }
+    NoteRemovedRegistrations(object_ids.size());
   }
 }
 
@@ -54,9 +142,93 @@ void RegistrationManager::GetRegistrations(
   }
 }
 
+void RegistrationManager::StartRegistrationSync(
+    int max_subtree_size, const RegistrationSummary& server_summary) {
+  CHECK(max_subtree_size > 0);
+  max_sync_subtree_size_ = max_subtree_size;
+  pending_sync_prefixes_.clear();
+
+  const RepeatedPtrField<RegistrationSubtree>& subtree_summaries =
+      server_summary.subtree_summary();
+  if (IsPartition(subtree_summaries)) {
+    // Only send the ranges where the server disagrees with us. Push them in
+    // reverse so that they are sent in the order given by the server.
+    for (int i = subtree_summaries.size() - 1; i >= 0; --i) {
+      const RegistrationSubtree& server_subtree = subtree_summaries.Get(i);
+      int num_registrations;
+      string digest = desired_registrations_->GetDigestForPrefix(
+          server_subtree.digest_prefix(), server_subtree.prefix_len(),
+          &num_registrations);
+      if ((num_registrations != server_subtree.num_registrations()) ||
+          (digest != server_subtree.registration_digest())) {
+        pending_sync_prefixes_.push_back(make_pair(
+            server_subtree.digest_prefix(), server_subtree.prefix_len()));
+      }
+    }
+    TLOG(logger_, INFO, "Starting differential registration sync of %d of %d "
+         "ranges", static_cast<int>(pending_sync_prefixes_.size()),
+         subtree_summaries.size());
+    return;
+  }
+
+  // Start with the shortest prefix length at which the subtrees are expected
+  // to fit in the budget. Subtrees that turn out to be larger are split when
+  // they are generated.
+  int prefix_len = 0;
+  while ((prefix_len < kMaxSyncPrefixLen) &&
+         ((desired_registrations_->size() >> prefix_len) > max_subtree_size)) {
+    ++prefix_len;
+  }
+
+  // Push the prefixes in reverse so that they are sent in increasing order.
+  for (int prefix = (1 << prefix_len) - 1; prefix >= 0; --prefix) {
+    pending_sync_prefixes_.push_back(
+        make_pair(GetDigestPrefix(prefix, prefix_len), prefix_len));
+  }
+  TLOG(logger_, INFO, "Starting registration sync of %d objects in %d subtrees",
+       desired_registrations_->size(),
+       static_cast<int>(pending_sync_prefixes_.size()));
+}
+
+void RegistrationManager::GetNextRegistrationSyncSubtree(
+    RegistrationSubtree* builder) {
+  CHECK(HasPendingRegistrationSync());
+  while (true) {
+    pair<string, int> prefix = pending_sync_prefixes_.back();
+    pending_sync_prefixes_.pop_back();
+    builder->Clear();
+    GetRegistrations(prefix.first, prefix.second, builder);
+    if ((builder->registered_object_size() <= max_sync_subtree_size_) ||
+        (prefix.second >= kMaxSyncPrefixLen)) {
+      int num_registrations;
+      builder->set_registration_digest(
+          desired_registrations_->GetDigestForPrefix(
+              prefix.first, prefix.second, &num_registrations));
+      builder->set_num_registrations(num_registrations);
+      builder->set_digest_prefix(prefix.first);
+      builder->set_prefix_len(prefix.second);
+      return;
+    }
+
+    // Too many objects: split the range in two on the next bit and send the
+    // half with the bit clear first.
+    int bit_index = prefix.second;
+    string child_prefix = prefix.first;
+    if (static_cast<int>(child_prefix.size()) <= bit_index / 8) {
+      child_prefix.resize(bit_index / 8 + 1, 0);
+    }
+    child_prefix[bit_index / 8] |= (1 << (bit_index % 8));
+    pending_sync_prefixes_.push_back(make_pair(child_prefix, bit_index + 1));
+    child_prefix[bit_index / 8] &= ~(1 << (bit_index % 8));
+    pending_sync_prefixes_.push_back(make_pair(child_prefix, bit_index + 1));
+  }
+}
+
 void RegistrationManager::HandleRegistrationStatus(
     const RepeatedPtrField<RegistrationStatus>& registration_statuses,
     vector<bool>* success_status) {
+  // The objects removed from the desired registrations, to be logged.
+  vector<ObjectIdP> removed_object_ids;
 
   // Local-processing result code for each element of
   // registrationStatuses. Indicates whether the registration status was
@@ -85,7 +257,8 @@ void RegistrationManager::HandleRegistrationStatus(
         // Just remove it and issue registration failure. Caller must issue reg
         // failure to the app so that we find out the actual state of the
         // registration.
-        desired_registrations_->Remove(object_id_proto);
+        RemoveDesiredRegistration(object_id_proto);
+        removed_object_ids.push_back(object_id_proto);
         statistics_->RecordError(
             Statistics::ClientErrorType_REGISTRATION_DISCREPANCY);
         TLOG(logger_, INFO,
@@ -96,18 +269,43 @@ void RegistrationManager::HandleRegistrationStatus(
       }
     } else {
       // If the server operation failed, then local processing fails.
-      desired_registrations_->Remove(object_id_proto);
+      RemoveDesiredRegistration(object_id_proto);
+      removed_object_ids.push_back(object_id_proto);
       TLOG(logger_, FINE, "Removing %s from committed",
            ProtoHelpers::ToString(object_id_proto).c_str());
       is_success = false;
     }
     success_status->push_back(is_success);
   }
+  if ((registration_log_ != NULL) && !removed_object_ids.empty()) {
+    registration_log_->AppendOperations(removed_object_ids,
+                                        RegistrationP_OpType_UNREGISTER);
+    MaybeCompactRegistrationLog();
+  }
+}
+
+void RegistrationManager::RemoveRegisteredObjects(vector<ObjectIdP>* result) {
+  desired_registrations_->RemoveAll(result);
+  InvalidateClientSummary();
+  if (registration_filter_.get() != NULL) {
+    RebuildRegistrationFilter();
+  }
+  if (registration_log_ != NULL) {
+    // Replace the log with an empty snapshot rather than logging the removal of
+    // every object.
+    registration_log_->RequestCompaction();
+    MaybeCompactRegistrationLog();
+  }
 }
 
-void RegistrationManager::GetClientSummary(RegistrationSummary* summary) {
-  summary->set_num_registrations(desired_registrations_->size());
-  summary->set_registration_digest(desired_registrations_->GetDigest());
+const RegistrationSummary& RegistrationManager::GetCachedClientSummary() {
+  if (is_client_summary_stale_) {
+    client_summary_.set_num_registrations(desired_registrations_->size());
+    client_summary_.set_registration_digest(
+        desired_registrations_->GetDigest());
+    is_client_summary_stale_ = false;
+  }
+  return client_summary_;
 }
 
 string RegistrationManager::ToString() {
@@ -117,6 +315,113 @@ string RegistrationManager::ToString() {
       desired_registrations_->ToString().c_str());
 }
 
+void RegistrationManager::GetMemoryUsage(
+    vector<pair<string, size_t> >* usage) {
+  usage->push_back(make_pair("RegistrationStore",
+                             desired_registrations_->GetAllocatedBytes()));
+  if (registration_filter_.get() != NULL) {
+    usage->push_back(make_pair("RegistrationFilter",
+                               registration_filter_->GetAllocatedBytes()));
+  }
+  size_t sync_bytes =
+      pending_sync_prefixes_.capacity() * sizeof(pair<string, int>);
+  for (size_t i = 0; i < pending_sync_prefixes_.size(); ++i) {
+    sync_bytes += MemoryUsage::StringBytes(pending_sync_prefixes_[i].first);
+  }
+  usage->push_back(make_pair("RegistrationSync", sync_bytes));
+}
+
+string RegistrationManager::GetDigestPrefix(int prefix, int prefix_len) {
+  string digest_prefix((prefix_len + 7) / 8, 0);
+  for (size_t i = 0; i < digest_prefix.size(); ++i) {
+    digest_prefix[i] = (prefix >> (8 * i)) & 0xff;
+  }
+  return digest_prefix;
+}
+
+void RegistrationManager::MaybeCompactRegistrationLog() {
+  if ((registration_log_ == NULL) || !registration_log_->NeedsCompaction()) {
+    return;
+  }
+  vector<ObjectIdP> oids;
+  desired_registrations_->GetElements(kEmptyPrefix, 0, &oids);
+  registration_log_->WriteSnapshot(oids);
+}
+
+void RegistrationManager::RemoveDesiredRegistration(
+    const ObjectIdP& object_id) {
+  desired_registrations_->Remove(object_id);
+  InvalidateClientSummary();
+  NoteRemovedRegistrations(1);
+}
+
+void RegistrationManager::NoteRemovedRegistrations(int num_removed) {
+  if (registration_filter_.get() == NULL) {
+    return;
+  }
+  num_stale_filter_objects_ += num_removed;
+  if ((num_stale_filter_objects_ > desired_registrations_->size()) &&
+      (num_stale_filter_objects_ >= kMinRegistrationFilterCapacity)) {
+    RebuildRegistrationFilter();
+  }
+}
+
+void RegistrationManager::RebuildRegistrationFilter() {
+  vector<ObjectIdP> oids;
+  desired_registrations_->GetElements(kEmptyPrefix, 0, &oids);
+  int capacity = kMinRegistrationFilterCapacity;
+  while (capacity < 2 * static_cast<int>(oids.size())) {
+    capacity *= 2;
+  }
+  registration_filter_.reset(new RegistrationFilter(capacity));
+  for (size_t i = 0; i < oids.size(); ++i) {
+    registration_filter_->Add(oids[i]);
+  }
+  num_stale_filter_objects_ = 0;
+  TLOG(logger_, FINE, "Rebuilt registration filter for %d objects",
+       static_cast<int>(oids.size()));
+}
+
+bool RegistrationManager::IsPartition(
+    const RepeatedPtrField<RegistrationSubtree>& subtree_summaries) {
+  if (subtree_summaries.size() == 0) {
+    return false;
+  }
+  int prefix_len = subtree_summaries.Get(0).prefix_len();
+  if ((prefix_len > kMaxSyncPrefixLen) ||
+      (subtree_summaries.size() != (1 << prefix_len))) {
+    return false;
+  }
+
+  // With 2^prefix_len ranges of the same length, they cover the object space
+  // iff they are distinct.
+  vector<bool> is_covered(subtree_summaries.size(), false);
+  for (int i = 0; i < subtree_summaries.size(); ++i) {
+    const RegistrationSubtree& subtree = subtree_summaries.Get(i);
+    if ((subtree.prefix_len() != prefix_len) ||
+        !subtree.has_num_registrations() ||
+        !subtree.has_registration_digest()) {
+      return false;
+    }
+    int prefix = 0;
+    for (int bit = 0; bit < prefix_len; ++bit) {
+      prefix |= ObjectIdDigestUtils::GetBit(subtree.digest_prefix(), bit) <<
+          bit;
+    }
+    if (is_covered[prefix]) {
+      return false;
+    }
+    is_covered[prefix] = true;
+  }
+  return true;
+}
+
 const char* RegistrationManager::kEmptyPrefix = "";
 
+const int RegistrationManager::kDigestStoreLevels = 8;
+
+const int RegistrationManager::kMaxSyncPrefixLen = 16;
+
+const int RegistrationManager::kMinRegistrationFilterCapacity = 64;
+
 }  // namespace invalidation
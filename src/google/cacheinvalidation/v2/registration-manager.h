@@ -19,28 +19,98 @@
 #ifndef GOOGLE_CACHEINVALIDATION_V2_REGISTRATION_MANAGER_H_
 #define GOOGLE_CACHEINVALIDATION_V2_REGISTRATION_MANAGER_H_
 
+#include <utility>
+#include <vector>
+
 #include "google/cacheinvalidation/v2/scoped_ptr.h"
 #include "google/cacheinvalidation/v2/system-resources.h"
 #include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
 #include "google/cacheinvalidation/v2/digest-function.h"
 #include "google/cacheinvalidation/v2/digest-store.h"
+#include "google/cacheinvalidation/v2/registration-filter.h"
+#include "google/cacheinvalidation/v2/registration-log.h"
 #include "google/cacheinvalidation/v2/statistics.h"
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::vector;
+
 class RegistrationManager {
  public:
   RegistrationManager(Logger* logger, Statistics* statistics,
                       DigestFunction* digest_function);
 
-  /* Sets the digest store to be digest_store for testing purposes.
+  /* Sets the digest store to be digest_store, taking ownership of it.
    *
    * REQUIRES: This method is called before the Ticl has done any operations on
    * this object.
    */
-  void SetDigestStoreForTest(DigestStore<ObjectIdP>* digest_store) {
+  void SetDigestStore(DigestStore<ObjectIdP>* digest_store) {
     desired_registrations_.reset(digest_store);
+    InvalidateClientSummary();
     GetClientSummary(&last_known_server_summary_);
+    if (registration_filter_.get() != NULL) {
+      RebuildRegistrationFilter();
+    }
+  }
+
+  /* Starts maintaining a RegistrationFilter over the desired registrations, so
+   * that MightBeRegistered can rule out most unregistered objects without a
+   * lookup in the digest store.
+   */
+  void EnableRegistrationFilter() {
+    RebuildRegistrationFilter();
+  }
+
+  /* Starts persisting the desired registrations and the server summary in
+   * registration_log. Does not take ownership.
+   *
+   * REQUIRES: This method is called before the Ticl has done any operations on
+   * this object, and the log is loaded and either RestoreRegistrations or
+   * DiscardRestoredRegistrations called before the others.
+   */
+  void EnableRegistrationLog(RegistrationLog* registration_log) {
+    registration_log_ = registration_log;
+  }
+
+  /* Restores the desired registrations and the server summary loaded by the
+   * registration log. Returns whether they were restored, which they are only
+   * if they agree with each other; otherwise discards them, as with
+   * DiscardRestoredRegistrations.
+   *
+   * REQUIRES: The registration log is enabled.
+   */
+  bool RestoreRegistrations();
+
+  /* Discards the registrations loaded by the registration log and starts
+   * persisting from the current (empty) desired registrations.
+   *
+   * REQUIRES: The registration log is enabled.
+   */
+  void DiscardRestoredRegistrations();
+
+  /* Returns false if object_id is definitely not a desired registration. Always
+   * returns true if the registration filter is not enabled.
+   */
+  bool MightBeRegistered(const ObjectIdP& object_id) {
+    return (registration_filter_.get() == NULL) ||
+        registration_filter_->MightContain(object_id);
+  }
+
+  /* Returns whether object_id is a desired registration. */
+  bool IsDesiredRegistration(const ObjectIdP& object_id) {
+    return MightBeRegistered(object_id) &&
+        desired_registrations_->Contains(object_id);
+  }
+
+  /* Sets the digest store to be digest_store for testing purposes.
+   *
+   * REQUIRES: This method is called before the Ticl has done any operations on
+   * this object.
+   */
+  void SetDigestStoreForTest(DigestStore<ObjectIdP>* digest_store) {
+    SetDigestStore(digest_store);
   }
 
   void GetRegisteredObjectsForTest(vector<ObjectIdP>* registrations) {
@@ -49,6 +119,16 @@ class RegistrationManager {
 
   /* (Un)registers for object_id. */
   void PerformOperations(const vector<ObjectIdP>& object_ids,
+                         RegistrationP::OpType reg_op_type) {
+    PerformOperations(object_ids, NULL, reg_op_type);
+  }
+
+  /* (Un)registers for object_ids, given digests[i], the digest of
+   * object_ids[i] under the digest function of the manager (e.g., computed
+   * before the call, on another thread), if digests is not NULL.
+   */
+  void PerformOperations(const vector<ObjectIdP>& object_ids,
+                         const vector<string>* digests,
                          RegistrationP::OpType reg_op_type);
 
   /* Initializes a registration subtree for registrations where the digest of
@@ -59,6 +139,30 @@ class RegistrationManager {
   void GetRegistrations(const string& digest_prefix, int prefix_len,
                         RegistrationSubtree* builder);
 
+  /* Prepares to stream the desired registrations to the server as a sequence
+   * of subtrees, each covering a range of digest prefixes and holding at most
+   * max_subtree_size objects where possible. If server_summary has subtree
+   * summaries that partition the object space, only the ranges whose
+   * summaries differ from the client's are sent. Discards any sync in
+   * progress.
+   */
+  void StartRegistrationSync(int max_subtree_size,
+                             const RegistrationSummary& server_summary);
+
+  /* Returns whether there are subtrees left to send for the sync started by
+   * StartRegistrationSync.
+   */
+  bool HasPendingRegistrationSync() {
+    return !pending_sync_prefixes_.empty();
+  }
+
+  /* Initializes builder with the next subtree of the registration sync in
+   * progress, including the digest prefix that it covers.
+   *
+   * REQUIRES: HasPendingRegistrationSync().
+   */
+  void GetNextRegistrationSyncSubtree(RegistrationSubtree* builder);
+
   /* Handles registration operation statuses from the server.
    *
    * Arguments:
@@ -70,17 +174,22 @@ class RegistrationManager {
       vector<bool>* result);
 
   /* Removes all the registrations in this manager and returns the list. */
-  void RemoveRegisteredObjects(vector<ObjectIdP>* result) {
-    desired_registrations_->RemoveAll(result);
-  }
+  void RemoveRegisteredObjects(vector<ObjectIdP>* result);
 
   //
   // Digest-related methods
   //
 
   /* Modifies client_summary to contain the summary of the desired
-   * registrations (by the client). */
-  void GetClientSummary(RegistrationSummary* client_summary);
+   * registrations (by the client). The summary is cached between changes to
+   * the desired registrations, so this is a copy into client_summary, which
+   * reuses its memory. The outgoing messages do not serialize the copy
+   * either: OutboundMessageEncoder splices in the header bytes it cached for
+   * the summary, and encodes them again only when the summary changes.
+   */
+  void GetClientSummary(RegistrationSummary* client_summary) {
+    client_summary->CopyFrom(GetCachedClientSummary());
+  }
 
   /* Modifies server_summary to contain the last known summary from the server.
    * If none, modifies server_summary to contain the summary corresponding
@@ -92,14 +201,21 @@ class RegistrationManager {
   /* Informs the manager of a new registration state summary from the server. */
   void InformServerRegistrationSummary(const RegistrationSummary& reg_summary) {
     last_known_server_summary_.CopyFrom(reg_summary);
+    if (registration_log_ != NULL) {
+      registration_log_->WriteServerSummary(reg_summary);
+    }
+  }
+
+  /* Returns the number of desired registrations. */
+  int GetNumDesiredRegistrations() {
+    return desired_registrations_->size();
   }
 
   /* Returns whether the local registration state and server state agree, based
    * on the last received server summary (from InformServerRegistrationSummary).
    */
   bool IsStateInSyncWithServer() {
-    RegistrationSummary summary;
-    GetClientSummary(&summary);
+    const RegistrationSummary& summary = GetCachedClientSummary();
     return (last_known_server_summary_.num_registrations() ==
             summary.num_registrations()) &&
         (last_known_server_summary_.registration_digest() ==
@@ -108,19 +224,113 @@ class RegistrationManager {
 
   string ToString();
 
+  /* Appends to usage the approximate heap bytes held by the desired
+   * registrations, the registration filter and the registration sync in
+   * progress, by component name.
+   */
+  void GetMemoryUsage(vector<pair<string, size_t> >* usage);
+
+  /* Returns the digest prefix of prefix_len bits whose bit i is bit i of
+   * prefix, i.e., the little-endian encoding of prefix.
+   */
+  static string GetDigestPrefix(int prefix, int prefix_len);
+
   // Empty hash prefix.
   static const char* kEmptyPrefix;
 
+  /* Number of levels in the Merkle trie holding the desired registrations. */
+  static const int kDigestStoreLevels;
+
+  /* Maximum length in bits of the digest prefix of a registration sync
+   * subtree. Subtrees at this length are sent even if they exceed the size
+   * budget.
+   */
+  static const int kMaxSyncPrefixLen;
+
+  /* Smallest capacity of the registration filter. */
+  static const int kMinRegistrationFilterCapacity;
+
  private:
+  /* Returns whether subtree_summaries are for all 2^k ranges of some prefix
+   * length k (with k <= kMaxSyncPrefixLen).
+   */
+  static bool IsPartition(
+      const RepeatedPtrField<RegistrationSubtree>& subtree_summaries);
+
+  /* (Un)registers for object_ids, whose digests are given as for
+   * PerformOperations, without logging the operation.
+   */
+  void ApplyOperations(const vector<ObjectIdP>& object_ids,
+                       const vector<string>* digests,
+                       RegistrationP::OpType reg_op_type);
+
+  /* Writes a snapshot of the desired registrations if the registration log (if
+   * any) needs compaction.
+   */
+  void MaybeCompactRegistrationLog();
+
+  /* Removes object_id from the desired registrations. */
+  void RemoveDesiredRegistration(const ObjectIdP& object_id);
+
+  /* Notes that num_removed objects may have been removed from the desired
+   * registrations, rebuilding the registration filter (if any) once the stale
+   * objects in it outnumber the live ones.
+   */
+  void NoteRemovedRegistrations(int num_removed);
+
+  /* Recreates the registration filter from the desired registrations, with
+   * room for them to double.
+   */
+  void RebuildRegistrationFilter();
+
+  /* Returns the summary of the desired registrations, computing it if they
+   * have changed since it was last computed.
+   */
+  const RegistrationSummary& GetCachedClientSummary();
+
+  /* Notes that the desired registrations have changed, so that the cached
+   * summary is recomputed when next needed.
+   */
+  void InvalidateClientSummary() {
+    is_client_summary_stale_ = true;
+  }
+
   /* The set of regisrations that the application has requested for. */
   scoped_ptr<DigestStore<ObjectIdP> > desired_registrations_;
 
+  /* Filter over the desired registrations (and possibly some removed ones), if
+   * enabled.
+   */
+  scoped_ptr<RegistrationFilter> registration_filter_;
+
+  /* Upper bound on the number of objects in registration_filter_ that are no
+   * longer desired registrations.
+   */
+  int num_stale_filter_objects_;
+
+  /* Log persisting the desired registrations, if enabled. Not owned. */
+  RegistrationLog* registration_log_;
+
   /* Statistics objects to track number of sent messages, etc. */
   Statistics* statistics_;
 
+  /* Digest prefixes (and their lengths in bits) of the subtrees still to be
+   * sent for the registration sync in progress. The next one is at the back.
+   */
+  vector<pair<string, int> > pending_sync_prefixes_;
+
+  /* Size budget for each subtree of the registration sync in progress. */
+  int max_sync_subtree_size_;
+
   /* Latest known server registration state summary. */
   RegistrationSummary last_known_server_summary_;
 
+  /* Summary of the desired registrations, valid unless
+   * is_client_summary_stale_.
+   */
+  RegistrationSummary client_summary_;
+  bool is_client_summary_stale_;
+
   Logger* logger_;
 };
 
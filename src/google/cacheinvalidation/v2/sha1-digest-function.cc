@@ -0,0 +1,469 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implementation of DigestFunction based on SHA1 (FIPS 180-4).
+
+#include "google/cacheinvalidation/v2/sha1-digest-function.h"
+
+#include <string.h>
+
+#include "google/cacheinvalidation/v2/logging.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define INVALIDATION_SHA1_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && \
+    (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#define INVALIDATION_SHA1_ARM 1
+#include <arm_neon.h>
+#endif
+
+namespace invalidation {
+
+namespace {
+
+const uint32 kInitialState[5] = {
+  0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+const uint32 kRoundConstants[4] = {
+  0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6
+};
+
+inline uint32 RotateLeft(uint32 value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+inline uint32 LoadBigEndian(const uint8* data) {
+  return (static_cast<uint32>(data[0]) << 24) |
+      (static_cast<uint32>(data[1]) << 16) |
+      (static_cast<uint32>(data[2]) << 8) |
+      static_cast<uint32>(data[3]);
+}
+
+/* Stores in blocks the padded final block(s) of a message of total_size bytes
+ * whose last tail_size (< 64) bytes are at tail and returns their number (1 or
+ * 2).
+ */
+size_t PadMessageTail(const uint8* tail, size_t tail_size, uint64 total_size,
+                      uint8* blocks) {
+  // The tail is followed by a one bit and the length in bits as a 64-bit
+  // big-endian number; a second block is needed if they do not fit.
+  size_t num_blocks = (tail_size < 56) ? 1 : 2;
+  size_t padded_size = 64 * num_blocks;
+  memcpy(blocks, tail, tail_size);
+  blocks[tail_size] = 0x80;
+  memset(blocks + tail_size + 1, 0, padded_size - 8 - (tail_size + 1));
+  uint64 bit_count = total_size * 8;
+  for (int i = 0; i < 8; ++i) {
+    blocks[padded_size - 8 + i] =
+        static_cast<uint8>(bit_count >> (56 - 8 * i));
+  }
+  return num_blocks;
+}
+
+/* Portable compression function. */
+void ProcessBlocksPortable(uint32 state[5], const uint8* data,
+                           size_t num_blocks) {
+  for (; num_blocks > 0; --num_blocks, data += 64) {
+    uint32 w[16];
+    for (int t = 0; t < 16; ++t) {
+      w[t] = LoadBigEndian(data + 4 * t);
+    }
+    uint32 a = state[0], b = state[1], c = state[2], d = state[3],
+        e = state[4];
+    for (int t = 0; t < 80; ++t) {
+      if (t >= 16) {
+        w[t & 15] = RotateLeft(w[(t - 3) & 15] ^ w[(t - 8) & 15] ^
+                               w[(t - 14) & 15] ^ w[t & 15], 1);
+      }
+      uint32 f;
+      if (t < 20) {
+        f = (b & c) | (~b & d);
+      } else if (t < 40) {
+        f = b ^ c ^ d;
+      } else if (t < 60) {
+        f = (b & c) | (b & d) | (c & d);
+      } else {
+        f = b ^ c ^ d;
+      }
+      uint32 temp = RotateLeft(a, 5) + f + e + kRoundConstants[t / 20] +
+          w[t & 15];
+      e = d;
+      d = c;
+      c = RotateLeft(b, 30);
+      b = a;
+      a = temp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+#if defined(INVALIDATION_SHA1_X86)
+
+/* Returns whether the processor supports the SHA extensions and SSE4.1. */
+bool CpuHasShaExtensions() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+    return false;
+  }
+  if (__get_cpuid_max(0, NULL) < 7) {
+    return false;
+  }
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & (1 << 29)) != 0;
+}
+
+/* Performs the four rounds 4 * group .. 4 * group + 3 with the SHA extensions.
+ * msg[group % 4] holds the message words for these rounds; the schedule for
+ * later rounds is advanced in msg as a side effect. e[group % 2] holds the E
+ * value and e[1 - group % 2] gets the one for the next group.
+ */
+#define INVALIDATION_SHA1_NI_GROUP(group)                                    \
+  {                                                                          \
+    const int kCur = (group) % 2;                                            \
+    const __m128i& w = msg[(group) % 4];                                     \
+    if ((group) == 0) {                                                      \
+      e[kCur] = _mm_add_epi32(e[kCur], w);                                   \
+    } else {                                                                 \
+      e[kCur] = _mm_sha1nexte_epu32(e[kCur], w);                             \
+    }                                                                        \
+    e[1 - kCur] = abcd;                                                      \
+    if ((group) >= 3 && (group) <= 18) {                                     \
+      msg[((group) + 1) % 4] = _mm_sha1msg2_epu32(msg[((group) + 1) % 4], w);\
+    }                                                                        \
+    abcd = _mm_sha1rnds4_epu32(abcd, e[kCur], (group) / 5);                  \
+    if ((group) >= 1 && (group) <= 16) {                                     \
+      msg[((group) + 3) % 4] = _mm_sha1msg1_epu32(msg[((group) + 3) % 4], w);\
+    }                                                                        \
+    if ((group) >= 2 && (group) <= 17) {                                     \
+      msg[((group) + 2) % 4] = _mm_xor_si128(msg[((group) + 2) % 4], w);     \
+    }                                                                        \
+  }
+
+/* Compression function using the SHA extensions. */
+__attribute__((target("sha,sse4.1")))
+void ProcessBlocksShaNi(uint32 state[5], const uint8* data,
+                        size_t num_blocks) {
+  // Reverses the bytes of a 128-bit vector, turning four big-endian message
+  // words into the word order expected by the SHA instructions.
+  const __m128i kByteSwap =
+      _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd = _mm_shuffle_epi32(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1b);
+  __m128i e[2];
+  e[0] = _mm_set_epi32(state[4], 0, 0, 0);
+  for (; num_blocks > 0; --num_blocks, data += 64) {
+    __m128i saved_abcd = abcd;
+    __m128i saved_e = e[0];
+    __m128i msg[4];
+    for (int i = 0; i < 4; ++i) {
+      msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(data + 16 * i)), kByteSwap);
+    }
+    INVALIDATION_SHA1_NI_GROUP(0);
+    INVALIDATION_SHA1_NI_GROUP(1);
+    INVALIDATION_SHA1_NI_GROUP(2);
+    INVALIDATION_SHA1_NI_GROUP(3);
+    INVALIDATION_SHA1_NI_GROUP(4);
+    INVALIDATION_SHA1_NI_GROUP(5);
+    INVALIDATION_SHA1_NI_GROUP(6);
+    INVALIDATION_SHA1_NI_GROUP(7);
+    INVALIDATION_SHA1_NI_GROUP(8);
+    INVALIDATION_SHA1_NI_GROUP(9);
+    INVALIDATION_SHA1_NI_GROUP(10);
+    INVALIDATION_SHA1_NI_GROUP(11);
+    INVALIDATION_SHA1_NI_GROUP(12);
+    INVALIDATION_SHA1_NI_GROUP(13);
+    INVALIDATION_SHA1_NI_GROUP(14);
+    INVALIDATION_SHA1_NI_GROUP(15);
+    INVALIDATION_SHA1_NI_GROUP(16);
+    INVALIDATION_SHA1_NI_GROUP(17);
+    INVALIDATION_SHA1_NI_GROUP(18);
+    INVALIDATION_SHA1_NI_GROUP(19);
+    e[0] = _mm_sha1nexte_epu32(e[0], saved_e);
+    abcd = _mm_add_epi32(abcd, saved_abcd);
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state),
+                   _mm_shuffle_epi32(abcd, 0x1b));
+  state[4] = _mm_extract_epi32(e[0], 3);
+}
+
+#undef INVALIDATION_SHA1_NI_GROUP
+
+const bool kUseHardware = CpuHasShaExtensions();
+
+#elif defined(INVALIDATION_SHA1_ARM)
+
+/* Compression function using the ARMv8 cryptography extensions. */
+void ProcessBlocksArm(uint32 state[5], const uint8* data, size_t num_blocks) {
+  uint32x4_t abcd = vld1q_u32(state);
+  uint32 e0 = state[4];
+  for (; num_blocks > 0; --num_blocks, data += 64) {
+    uint32x4_t saved_abcd = abcd;
+    uint32 saved_e0 = e0;
+    uint32x4_t msg[4];
+    for (int i = 0; i < 4; ++i) {
+      msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+    }
+    uint32x4_t tmp[2];
+    tmp[0] = vaddq_u32(msg[0], vdupq_n_u32(kRoundConstants[0]));
+    tmp[1] = vaddq_u32(msg[1], vdupq_n_u32(kRoundConstants[0]));
+    uint32 e[2] = { e0, 0 };
+    // Each group performs four rounds; msg[group % 4] is extended in place so
+    // that it holds the message words for group + 4.
+    for (int group = 0; group < 20; ++group) {
+      int cur = group % 2;
+      e[1 - cur] = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+      if (group < 5) {
+        abcd = vsha1cq_u32(abcd, e[cur], tmp[cur]);
+      } else if (group >= 10 && group < 15) {
+        abcd = vsha1mq_u32(abcd, e[cur], tmp[cur]);
+      } else {
+        abcd = vsha1pq_u32(abcd, e[cur], tmp[cur]);
+      }
+      if (group + 2 < 20) {
+        tmp[cur] = vaddq_u32(msg[(group + 2) % 4],
+                             vdupq_n_u32(kRoundConstants[(group + 2) / 5]));
+      }
+      if (group >= 1 && group <= 16) {
+        msg[(group + 3) % 4] =
+            vsha1su1q_u32(msg[(group + 3) % 4], msg[(group + 2) % 4]);
+      }
+      if (group <= 15) {
+        msg[group % 4] = vsha1su0q_u32(msg[group % 4], msg[(group + 1) % 4],
+                                       msg[(group + 2) % 4]);
+      }
+    }
+    e0 = e[0] + saved_e0;
+    abcd = vaddq_u32(abcd, saved_abcd);
+  }
+  vst1q_u32(state, abcd);
+  state[4] = e0;
+}
+
+const bool kUseHardware = true;
+
+#else
+
+const bool kUseHardware = false;
+
+#endif
+
+/* Processes num_blocks 64-byte blocks at data into state, using the fastest
+ * available compression function.
+ */
+void ProcessBlocks(uint32 state[5], const uint8* data, size_t num_blocks) {
+#if defined(INVALIDATION_SHA1_X86)
+  if (kUseHardware) {
+    ProcessBlocksShaNi(state, data, num_blocks);
+    return;
+  }
+#elif defined(INVALIDATION_SHA1_ARM)
+  ProcessBlocksArm(state, data, num_blocks);
+  return;
+#endif
+  ProcessBlocksPortable(state, data, num_blocks);
+}
+
+}  // namespace
+
+const int Sha1DigestFunction::kDigestSize;
+const int Sha1DigestFunction::kBlockSize;
+const int Sha1DigestFunction::kNumLanes;
+
+bool Sha1DigestFunction::HasHardwareSupport() {
+  return kUseHardware;
+}
+
+void Sha1DigestFunction::Reset() {
+  memcpy(state_, kInitialState, sizeof(state_));
+  buffer_size_ = 0;
+  total_size_ = 0;
+}
+
+void Sha1DigestFunction::Update(const string& data) {
+  Update(data.data(), data.size());
+}
+
+void Sha1DigestFunction::Update(const char* input, size_t size) {
+  const uint8* data = reinterpret_cast<const uint8*>(input);
+  total_size_ += size;
+  if (buffer_size_ > 0) {
+    size_t to_copy = kBlockSize - buffer_size_;
+    if (to_copy > size) {
+      to_copy = size;
+    }
+    memcpy(buffer_ + buffer_size_, data, to_copy);
+    buffer_size_ += to_copy;
+    data += to_copy;
+    size -= to_copy;
+    if (buffer_size_ < static_cast<size_t>(kBlockSize)) {
+      return;
+    }
+    ProcessBlocks(state_, buffer_, 1);
+    buffer_size_ = 0;
+  }
+
+  // Compress whole blocks straight from the input.
+  size_t num_blocks = size / kBlockSize;
+  ProcessBlocks(state_, data, num_blocks);
+  data += num_blocks * kBlockSize;
+  size -= num_blocks * kBlockSize;
+  memcpy(buffer_, data, size);
+  buffer_size_ = size;
+}
+
+string Sha1DigestFunction::GetDigest() {
+  uint32 state[5];
+  Finish(state);
+  string digest;
+  StoreDigest(state, &digest);
+  return digest;
+}
+
+int Sha1DigestFunction::GetDigest(char* digest, int max_size) {
+  CHECK(max_size >= kDigestSize);
+  uint32 state[5];
+  Finish(state);
+  StoreDigest(state, digest);
+  return kDigestSize;
+}
+
+void Sha1DigestFunction::Finish(uint32 state[5]) {
+  uint8 final_blocks[2 * kBlockSize];
+  size_t num_final_blocks =
+      PadMessageTail(buffer_, buffer_size_, total_size_, final_blocks);
+  memcpy(state, state_, sizeof(state_));
+  ProcessBlocks(state, final_blocks, num_final_blocks);
+}
+
+void Sha1DigestFunction::GetDigests(const vector<string>& inputs,
+                                    vector<string>* digests) {
+  digests->resize(inputs.size());
+  const string* lane_inputs[kNumLanes];
+  string* lane_digests[kNumLanes];
+  int num_lanes = 0;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    const string& input = inputs[i];
+    if (kUseHardware || (input.size() >= static_cast<size_t>(kBlockSize - 8))) {
+      // The hardware is faster than the multi-buffer code on a single message,
+      // and messages of several blocks do not fit the lanes.
+      ComputeDigest(reinterpret_cast<const uint8*>(input.data()), input.size(),
+                    &(*digests)[i]);
+      continue;
+    }
+    lane_inputs[num_lanes] = &input;
+    lane_digests[num_lanes] = &(*digests)[i];
+    if (++num_lanes == kNumLanes) {
+      ProcessSingleBlockLanes(lane_inputs, num_lanes, lane_digests);
+      num_lanes = 0;
+    }
+  }
+  if (num_lanes > 0) {
+    ProcessSingleBlockLanes(lane_inputs, num_lanes, lane_digests);
+  }
+}
+
+void Sha1DigestFunction::ComputeDigest(const uint8* data, size_t size,
+                                       string* digest) {
+  uint32 state[5];
+  memcpy(state, kInitialState, sizeof(state));
+  size_t num_blocks = size / kBlockSize;
+  ProcessBlocks(state, data, num_blocks);
+  size_t tail_size = size - num_blocks * kBlockSize;
+  uint8 final_blocks[2 * kBlockSize];
+  size_t num_final_blocks = PadMessageTail(data + num_blocks * kBlockSize,
+                                           tail_size, size, final_blocks);
+  ProcessBlocks(state, final_blocks, num_final_blocks);
+  StoreDigest(state, digest);
+}
+
+void Sha1DigestFunction::ProcessSingleBlockLanes(
+    const string* const* inputs, int num_lanes, string* const* digests) {
+  // Each LaneWord holds the same 32-bit word for kNumLanes independent
+  // messages, so every step below is a single vector operation on all of them.
+  // Unused lanes hash an empty message.
+  typedef uint32 LaneWord __attribute__((vector_size(4 * kNumLanes)));
+  LaneWord w[16];
+  for (int lane = 0; lane < kNumLanes; ++lane) {
+    uint8 block[kBlockSize];
+    const string& input = *inputs[lane < num_lanes ? lane : 0];
+    size_t size = (lane < num_lanes) ? input.size() : 0;
+    PadMessageTail(reinterpret_cast<const uint8*>(input.data()), size, size,
+                   block);
+    for (int t = 0; t < 16; ++t) {
+      w[t][lane] = LoadBigEndian(block + 4 * t);
+    }
+  }
+
+  LaneWord a, b, c, d, e;
+  for (int lane = 0; lane < kNumLanes; ++lane) {
+    a[lane] = kInitialState[0];
+    b[lane] = kInitialState[1];
+    c[lane] = kInitialState[2];
+    d[lane] = kInitialState[3];
+    e[lane] = kInitialState[4];
+  }
+  LaneWord initial_a = a, initial_b = b, initial_c = c, initial_d = d,
+      initial_e = e;
+  for (int t = 0; t < 80; ++t) {
+    LaneWord& wt = w[t & 15];
+    if (t >= 16) {
+      wt ^= w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15];
+      wt = (wt << 1) | (wt >> 31);
+    }
+    LaneWord f;
+    if (t < 20) {
+      f = (b & c) | (~b & d);
+    } else if ((t >= 40) && (t < 60)) {
+      f = (b & c) | (b & d) | (c & d);
+    } else {
+      f = b ^ c ^ d;
+    }
+    LaneWord temp = ((a << 5) | (a >> 27)) + f + e + kRoundConstants[t / 20] +
+        wt;
+    e = d;
+    d = c;
+    c = (b << 30) | (b >> 2);
+    b = a;
+    a = temp;
+  }
+  a += initial_a;
+  b += initial_b;
+  c += initial_c;
+  d += initial_d;
+  e += initial_e;
+
+  for (int lane = 0; lane < num_lanes; ++lane) {
+    uint32 state[5] = { a[lane], b[lane], c[lane], d[lane], e[lane] };
+    StoreDigest(state, digests[lane]);
+  }
+}
+
+void Sha1DigestFunction::StoreDigest(const uint32 state[5], char* digest) {
+  for (int i = 0; i < 5; ++i) {
+    digest[4 * i] = static_cast<char>(state[i] >> 24);
+    digest[4 * i + 1] = static_cast<char>(state[i] >> 16);
+    digest[4 * i + 2] = static_cast<char>(state[i] >> 8);
+    digest[4 * i + 3] = static_cast<char>(state[i]);
+  }
+}
+
+}  // namespace invalidation
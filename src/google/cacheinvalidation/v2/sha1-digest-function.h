@@ -17,6 +17,105 @@
 #ifndef GOOGLE_CACHEINVALIDATION_V2_SHA1_DIGEST_FUNCTION_H_
 #define GOOGLE_CACHEINVALIDATION_V2_SHA1_DIGEST_FUNCTION_H_
 
-#error Replace this file with an implementation of DigestFunction based on SHA1.
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "google/cacheinvalidation/v2/digest-function.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Self-contained implementation of DigestFunction based on SHA1.
+ *
+ * The compression function uses the SHA extensions on x86 processors that have
+ * them (detected at run time) and the ARMv8 cryptography extensions when the
+ * compiler targets them (e.g., -march=armv8-a+crypto). Otherwise, portable code
+ * is used. All paths compute the same digests.
+ */
+class Sha1DigestFunction : public DigestFunction {
+ public:
+  Sha1DigestFunction() {
+    Reset();
+  }
+
+  virtual ~Sha1DigestFunction() {}
+
+  virtual void Reset();
+
+  virtual void Update(const string& data);
+
+  virtual void Update(const char* data, size_t size);
+
+  virtual string GetDigest();
+
+  virtual int GetDigest(char* digest, int max_size);
+
+  /* Computes the digests of inputs side by side. Inputs short enough to fit a
+   * single SHA1 block (as object id digest inputs usually are) are hashed
+   * kNumLanes at a time by multi-buffer code when there is no hardware SHA1
+   * support. Does not disturb a digest being computed with Update.
+   */
+  virtual void GetDigests(const vector<string>& inputs,
+                          vector<string>* digests);
+
+  /* Returns whether the compression function uses hardware SHA1 instructions.
+   */
+  static bool HasHardwareSupport();
+
+  /* Size of a digest in bytes. */
+  static const int kDigestSize = 20;
+
+ private:
+  /* Size of a SHA1 block in bytes. */
+  static const int kBlockSize = 64;
+
+  /* Number of single-block messages hashed together by
+   * ProcessSingleBlockLanes.
+   */
+  static const int kNumLanes = 8;
+
+  /* Stores in digest the digest of the size bytes at data, without touching
+   * the state of this object.
+   */
+  static void ComputeDigest(const uint8* data, size_t size, string* digest);
+
+  /* Stores in state the final chaining state of the digest being computed.
+   */
+  void Finish(uint32 state[5]);
+
+  /* Hashes num_lanes (at most kNumLanes) inputs that each fit in a single block
+   * and stores their digests in digests[0..num_lanes).
+   */
+  static void ProcessSingleBlockLanes(const string* const* inputs,
+                                      int num_lanes, string* const* digests);
+
+  /* Stores the big-endian encoding of state in digest[0..kDigestSize). */
+  static void StoreDigest(const uint32 state[5], char* digest);
+
+  /* Stores the big-endian encoding of state in digest. */
+  static void StoreDigest(const uint32 state[5], string* digest) {
+    digest->resize(kDigestSize);
+    StoreDigest(state, &(*digest)[0]);
+  }
+
+  /* The chaining state of the digest being computed. */
+  uint32 state_[5];
+
+  /* Bytes that have been added but not yet compressed. */
+  uint8 buffer_[kBlockSize];
+
+  /* Number of valid bytes in buffer_. */
+  size_t buffer_size_;
+
+  /* Total number of bytes added since the last Reset. */
+  uint64 total_size_;
+};
+
+}  // namespace invalidation
 
 #endif  // GOOGLE_CACHEINVALIDATION_V2_SHA1_DIGEST_FUNCTION_H_
@@ -0,0 +1,265 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Resources shared by many clients in one process, on a fixed set of threads.
+
+#include "google/cacheinvalidation/v2/sharded-client-pool.h"
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/v2/logging.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+
+namespace invalidation {
+
+/* Callback for Storage::ReadAllKeys that passes on the keys starting with a
+ * prefix, without the prefix, to the callback of a client.
+ */
+class KeyPrefixFilter : public ReadAllKeysCallback {
+ public:
+  /* Takes ownership of callback. */
+  KeyPrefixFilter(const string& key_prefix, ReadAllKeysCallback* callback)
+      : key_prefix_(key_prefix), callback_(callback) {}
+
+  virtual ~KeyPrefixFilter() {
+    delete callback_;
+  }
+
+  virtual bool IsRepeatable() const {
+    return true;
+  }
+
+  virtual void Run(StatusStringPair result) {
+    if (!result.first.IsSuccess()) {
+      callback_->Run(result);
+    } else if (result.second.compare(0, key_prefix_.size(), key_prefix_) ==
+               0) {
+      callback_->Run(StatusStringPair(
+          result.first, result.second.substr(key_prefix_.size())));
+    }
+  }
+
+ private:
+  string key_prefix_;
+  ReadAllKeysCallback* callback_;
+};
+
+/* Cursor over the keys of a client, which strips the prefix of the client
+ * from the keys read by a cursor of the shared storage.
+ */
+class KeyPrefixCursor : public StorageCursor {
+ public:
+  /* Takes ownership of cursor. */
+  KeyPrefixCursor(StorageCursor* cursor, size_t key_prefix_size)
+      : cursor_(cursor), key_prefix_size_(key_prefix_size) {}
+
+  virtual void ReadNext(int max_entries, KeyValueBatchCallback* done) {
+    cursor_->ReadNext(max_entries, NewPermanentCallback(
+        this, &KeyPrefixCursor::HandleBatch, done));
+  }
+
+ private:
+  /* Passes batch to done, without the prefix of the keys, and deletes done.
+   */
+  void HandleBatch(KeyValueBatchCallback* done, const KeyValueBatch& batch) {
+    batch_.success = batch.success;
+    batch_.is_last = batch.is_last;
+    batch_.entries.clear();
+    for (size_t i = 0; i < batch.entries.size(); ++i) {
+      const KeyValueView& entry = batch.entries[i];
+      CHECK(entry.key_size >= key_prefix_size_);
+      batch_.entries.push_back(KeyValueView(
+          entry.key_data + key_prefix_size_,
+          entry.key_size - key_prefix_size_, entry.value_data,
+          entry.value_size));
+    }
+    done->Run(batch_);
+    delete done;
+  }
+
+  scoped_ptr<StorageCursor> cursor_;
+  size_t key_prefix_size_;
+
+  /* The batch passed on, whose views point into the shared storage. */
+  KeyValueBatch batch_;
+};
+
+/* The storage of one client: the keys of the client in the shared storage,
+ * where they start with a prefix for the client.
+ */
+class ShardedClientPool::ClientStorage : public Storage {
+ public:
+  ClientStorage(Storage* storage, const string& client_name)
+      : storage_(storage),
+        // The length keeps apart clients whose names are prefixes of others'.
+        key_prefix_(StringPrintf("%d:", static_cast<int>(client_name.size())) +
+                    client_name + "/") {}
+
+  virtual void WriteKey(const string& key, const string& value,
+                        WriteKeyCallback* done) {
+    storage_->WriteKey(key_prefix_ + key, value, done);
+  }
+
+  virtual void ReadKey(const string& key, ReadKeyCallback* done) {
+    storage_->ReadKey(key_prefix_ + key, done);
+  }
+
+  virtual void DeleteKey(const string& key, DeleteKeyCallback* done) {
+    storage_->DeleteKey(key_prefix_ + key, done);
+  }
+
+  virtual void ReadAllKeys(ReadAllKeysCallback* key_callback) {
+    storage_->ReadAllKeys(new KeyPrefixFilter(key_prefix_, key_callback));
+  }
+
+  virtual StorageCursor* OpenCursor(const string& key_prefix) {
+    StorageCursor* cursor = storage_->OpenCursor(key_prefix_ + key_prefix);
+    return (cursor == NULL) ? NULL :
+        new KeyPrefixCursor(cursor, key_prefix_.size());
+  }
+
+ private:
+  Storage* storage_;
+  string key_prefix_;
+};
+
+/* The resources of one client, on the schedulers of its shard. */
+class ShardedClientPool::ClientResources : public SystemResources {
+ public:
+  ClientResources(Logger* logger, Storage* storage, const string& client_name,
+                  NetworkChannel* network, Scheduler* internal_scheduler,
+                  Scheduler* listener_scheduler)
+      : logger_(logger), storage_(storage, client_name), network_(network),
+        internal_scheduler_(internal_scheduler),
+        listener_scheduler_(listener_scheduler), is_started_(false) {}
+
+  virtual void Start() {
+    CHECK(!is_started_) << "resources already started";
+    is_started_ = true;
+  }
+
+  virtual void Stop() {
+    CHECK(is_started_) << "cannot stop resources that aren't started";
+    is_started_ = false;
+  }
+
+  virtual bool IsStarted() const {
+    return is_started_;
+  }
+
+  virtual string platform() const {
+    return "ShardedClientPool";
+  }
+
+  virtual Logger* logger() {
+    return logger_;
+  }
+
+  virtual Storage* storage() {
+    return &storage_;
+  }
+
+  virtual NetworkChannel* network() {
+    return network_;
+  }
+
+  virtual Scheduler* internal_scheduler() {
+    return internal_scheduler_;
+  }
+
+  virtual Scheduler* listener_scheduler() {
+    return listener_scheduler_;
+  }
+
+ private:
+  Logger* logger_;
+  ClientStorage storage_;
+  NetworkChannel* network_;
+  Scheduler* internal_scheduler_;
+  Scheduler* listener_scheduler_;
+  bool is_started_;
+};
+
+ShardedClientPool::ShardedClientPool(const Config& config, Logger* logger,
+                                     Storage* storage, NetworkChannel* network)
+    : config_(config), logger_(logger), storage_(storage) {
+  CHECK(config.num_shards > 0) << "num_shards must be positive";
+  for (int i = 0; i < config.num_shards; ++i) {
+    Shard* shard = new Shard();
+    shard->internal_scheduler.reset(NewScheduler());
+    shard->listener_scheduler.reset(NewScheduler());
+    shards_.push_back(shard);
+  }
+  if (network != NULL) {
+    network_scheduler_.reset(NewScheduler());
+    multiplexer_.reset(new ChannelMultiplexer(
+        network, network_scheduler_.get(), logger,
+        config.multiplexer_batching_delay));
+  }
+}
+
+ShardedClientPool::~ShardedClientPool() {
+  // Stop all the threads before deleting anything their tasks may use.
+  if (network_scheduler_.get() != NULL) {
+    network_scheduler_->StopThread();
+  }
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    shards_[i]->internal_scheduler->StopThread();
+    shards_[i]->listener_scheduler->StopThread();
+  }
+  multiplexer_.reset();
+  network_scheduler_.reset();
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    delete shards_[i];
+  }
+}
+
+SystemResources* ShardedClientPool::NewClientResources(
+    const string& client_name, NetworkChannel* network) {
+  if (network == NULL) {
+    CHECK(multiplexer_.get() != NULL) << "pool has no shared network channel";
+    network = multiplexer_->NewClientChannel();
+  }
+  Shard* shard = shards_[GetShard(client_name)];
+  return new ClientResources(
+      logger_, storage_, client_name, network,
+      shard->internal_scheduler.get(), shard->listener_scheduler.get());
+}
+
+int ShardedClientPool::GetShard(const string& client_name) const {
+  // A hash of the name (FNV-1a) rather than an order of arrival, so that a
+  // client keeps its shard when the process restarts.
+  uint64 hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < client_name.size(); ++i) {
+    hash = (hash ^ static_cast<unsigned char>(client_name[i])) *
+        1099511628211ULL;
+  }
+  return static_cast<int>(hash % shards_.size());
+}
+
+Scheduler* ShardedClientPool::internal_scheduler(int shard) {
+  return shards_[shard]->internal_scheduler.get();
+}
+
+Scheduler* ShardedClientPool::listener_scheduler(int shard) {
+  return shards_[shard]->listener_scheduler.get();
+}
+
+TimerWheelScheduler* ShardedClientPool::NewScheduler() {
+  TimerWheelScheduler* scheduler =
+      new TimerWheelScheduler(config_.tick_size, Time::Now());
+  scheduler->StartThread();
+  return scheduler;
+}
+
+}  // namespace invalidation
@@ -0,0 +1,143 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Resources shared by many clients in one process, on a fixed set of threads.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_SHARDED_CLIENT_POOL_H_
+#define GOOGLE_CACHEINVALIDATION_V2_SHARDED_CLIENT_POOL_H_
+
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/channel-multiplexer.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
+#include "google/cacheinvalidation/v2/time.h"
+#include "google/cacheinvalidation/v2/timer-wheel-scheduler.h"
+#include "google/cacheinvalidation/v2/types.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Gives the clients of a process that hosts many of them (e.g., one
+ * InvalidationClientImpl per tenant in a backend) their SystemResources, so
+ * that they run on a fixed number of threads instead of needing a scheduler
+ * thread or two each.
+ *
+ * The pool has num_shards shards, each with an internal and a listener
+ * TimerWheelScheduler running on a thread of its own. A client is assigned to
+ * a shard by a hash of its name, so that it always runs on the same threads
+ * and the clients spread evenly over the shards; with one shard per core, the
+ * pool scales with the cores as long as no client is much busier than the
+ * others. All the clients share the logger and the storage, in which the keys
+ * of each client are kept apart by a prefix for the client. If the pool is
+ * given a network channel, the clients may also share it through a
+ * ChannelMultiplexer, whose batches are sent from a scheduler thread of its
+ * own.
+ *
+ * The logger, storage and network must be thread-safe, as for any
+ * SystemResources. This class is thread-safe.
+ */
+class ShardedClientPool {
+ public:
+  struct Config {
+    Config() : num_shards(kDefaultNumShards),
+               tick_size(TimeDelta::FromMilliseconds(kDefaultTickSizeMs)),
+               multiplexer_batching_delay(TimeDelta::FromMilliseconds(
+                   kDefaultMultiplexerBatchingDelayMs)) {}
+
+    /* Number of shards, each with two threads. Typically the number of
+     * cores.
+     */
+    int num_shards;
+
+    /* Tick size of the schedulers of the shards. */
+    TimeDelta tick_size;
+
+    /* Batching delay of the multiplexer of the shared network channel. */
+    TimeDelta multiplexer_batching_delay;
+  };
+
+  /* Creates a pool and starts the threads of its shards. The caller keeps
+   * ownership of logger, storage and network. network may be NULL if each
+   * client is given its own channel.
+   */
+  ShardedClientPool(const Config& config, Logger* logger, Storage* storage,
+                    NetworkChannel* network);
+
+  /* Stops the threads of the pool, deleting the tasks still scheduled on them.
+   *
+   * REQUIRES: The clients of the pool have been stopped and deleted.
+   */
+  ~ShardedClientPool();
+
+  /* Returns new resources for the client named client_name, which must be
+   * unique in the pool. The client sends its messages on network if it is
+   * not NULL, and on the shared network channel of the pool otherwise. The
+   * caller owns the resources (and keeps ownership of network), and must
+   * delete them after the client.
+   */
+  SystemResources* NewClientResources(const string& client_name,
+                                      NetworkChannel* network);
+
+  /* Returns the shard to which the client named client_name is assigned. */
+  int GetShard(const string& client_name) const;
+
+  /* Returns the internal scheduler of shard. */
+  Scheduler* internal_scheduler(int shard);
+
+  /* Returns the listener scheduler of shard. */
+  Scheduler* listener_scheduler(int shard);
+
+  int num_shards() const {
+    return static_cast<int>(shards_.size());
+  }
+
+  static const int kDefaultNumShards = 4;
+  static const int kDefaultTickSizeMs = 10;
+  static const int kDefaultMultiplexerBatchingDelayMs = 20;
+
+ private:
+  class ClientStorage;
+  class ClientResources;
+
+  /* The threads, and their schedulers, shared by the clients of a shard. */
+  struct Shard {
+    scoped_ptr<TimerWheelScheduler> internal_scheduler;
+    scoped_ptr<TimerWheelScheduler> listener_scheduler;
+  };
+
+  /* Returns a new scheduler, running on a thread of its own. */
+  TimerWheelScheduler* NewScheduler();
+
+  Config config_;
+  Logger* logger_;
+  Storage* storage_;
+
+  /* The shards. Owned. */
+  vector<Shard*> shards_;
+
+  /* The scheduler on which the multiplexer sends its batches, and the
+   * multiplexer of the shared network channel, if the pool has one.
+   */
+  scoped_ptr<TimerWheelScheduler> network_scheduler_;
+  scoped_ptr<ChannelMultiplexer> multiplexer_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_SHARDED_CLIENT_POOL_H_
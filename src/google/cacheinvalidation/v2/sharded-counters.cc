@@ -0,0 +1,32 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Counters that any thread can add to without contending with the others.
+
+#include "google/cacheinvalidation/v2/sharded-counters.h"
+
+namespace invalidation {
+
+/* The number of threads that have been given a shard. */
+static int num_sharded_threads = 0;
+
+int GetCounterShard() {
+  static __thread int shard = -1;
+  if (shard < 0) {
+    shard = __sync_fetch_and_add(&num_sharded_threads, 1) % kNumCounterShards;
+  }
+  return shard;
+}
+
+}  // namespace invalidation
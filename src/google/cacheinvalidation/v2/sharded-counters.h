@@ -0,0 +1,109 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Counters that any thread can add to without contending with the others.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_SHARDED_COUNTERS_H_
+#define GOOGLE_CACHEINVALIDATION_V2_SHARDED_COUNTERS_H_
+
+#include <stddef.h>
+#include <string.h>
+
+namespace invalidation {
+
+/* Number of shards of each sharded ShardedCounters. */
+static const int kNumCounterShards = 8;
+
+/* Returns the shard of the calling thread, in [0, kNumCounterShards). Threads
+ * are given shards in turn when they first call this.
+ */
+int GetCounterShard();
+
+/* An array of kNumCounters counters that any thread can add to with an
+ * atomic add; reads sum the shards. By default the counters are a single
+ * shard, as small as a plain array. If sharded, each counter is split into
+ * kNumCounterShards shards, one per group of threads, each in its own cache
+ * lines, so that a thread's adds stay in its own lines unless more than
+ * kNumCounterShards threads record at once, at the cost of a few KB.
+ */
+template <int kNumCounters>
+class ShardedCounters {
+ public:
+  explicit ShardedCounters(bool is_sharded)
+      : num_shards_(is_sharded ? kNumCounterShards : 1),
+        shard_size_(is_sharded ? kPaddedShardSize : kNumCounters),
+        counters_(new int[num_shards_ * shard_size_]) {
+    memset(counters_, 0, num_shards_ * shard_size_ * sizeof(int));
+  }
+
+  ~ShardedCounters() {
+    delete[] counters_;
+  }
+
+  /* Adds delta to counter. May be called from any thread. */
+  void Add(int counter, int delta) {
+    int shard = (num_shards_ == 1) ? 0 : GetCounterShard();
+    __sync_fetch_and_add(&counters_[shard * shard_size_ + counter], delta);
+  }
+
+  /* Returns the value of counter. May be called from any thread, and then
+   * sees each of the adds made before it on other threads, or not.
+   */
+  int Get(int counter) const {
+    int value = 0;
+    for (int i = 0; i < num_shards_; ++i) {
+      value += *static_cast<const volatile int*>(
+          &counters_[i * shard_size_ + counter]);
+    }
+    return value;
+  }
+
+  /* Sets values[i] to the value of counter i, for all the counters. */
+  void GetAll(int values[]) const {
+    for (int i = 0; i < kNumCounters; ++i) {
+      values[i] = Get(i);
+    }
+  }
+
+  /* Returns the number of bytes the counters take on the heap. */
+  size_t GetHeapSize() const {
+    return num_shards_ * shard_size_ * sizeof(int);
+  }
+
+ private:
+  /* The counters of a shard when sharded, rounded up to whole cache lines of
+   * 64 bytes plus one, so that two shards never share a line however the
+   * array is aligned.
+   */
+  static const int kIntsPerCacheLine = 64 / sizeof(int);
+  static const int kPaddedShardSize =
+      ((kNumCounters + kIntsPerCacheLine - 1) / kIntsPerCacheLine + 1) *
+      kIntsPerCacheLine;
+
+  int num_shards_;
+
+  /* Distance between the shards of a counter, in counters. */
+  int shard_size_;
+
+  /* The counters of each shard, one shard after the other. Owned. */
+  int* counters_;
+
+  // Not copyable, since it owns the counters.
+  ShardedCounters(const ShardedCounters& other);
+  void operator=(const ShardedCounters& other);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_SHARDED_COUNTERS_H_
@@ -0,0 +1,183 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Pool of threads that run tasks in order per key and in parallel across keys.
+
+#include "google/cacheinvalidation/v2/sharded-dispatcher.h"
+
+#include "google/cacheinvalidation/v2/logging.h"
+
+namespace invalidation {
+
+/* The state shared by the per-thread parts of a DispatchToAll call. */
+struct ShardedDispatcher::Barrier {
+  Barrier(Closure* task, int num_threads)
+      : task(task), num_arriving(num_threads), num_references(num_threads),
+        is_done(false) {}
+
+  /* Lock for the fields below but task. */
+  Mutex lock;
+
+  /* Signalled when is_done is set. */
+  CondVar done;
+
+  /* The task to run once every thread has arrived. Owned. */
+  Closure* task;
+
+  /* Number of threads that have not reached the barrier yet. */
+  int num_arriving;
+
+  /* Number of BarrierTasks not deleted yet; the last one deletes the
+   * barrier.
+   */
+  int num_references;
+
+  /* Whether the task has run, or never will, so that the threads can go on. */
+  bool is_done;
+};
+
+/* The part of a DispatchToAll call queued on one thread. */
+class ShardedDispatcher::BarrierTask : public Closure {
+ public:
+  explicit BarrierTask(Barrier* barrier) : barrier_(barrier), has_run_(false) {}
+
+  virtual ~BarrierTask() {
+    bool is_last;
+    {
+      MutexLock m(&barrier_->lock);
+      if (!has_run_ && !barrier_->is_done) {
+        // Deleted by a stopping dispatcher: the task will never run, so
+        // release the threads already waiting for it.
+        barrier_->is_done = true;
+        barrier_->done.SignalAll();
+      }
+      is_last = (--barrier_->num_references == 0);
+    }
+    if (is_last) {
+      delete barrier_->task;
+      delete barrier_;
+    }
+  }
+
+  virtual bool IsRepeatable() const {
+    return true;
+  }
+
+  virtual void Run() {
+    has_run_ = true;
+    {
+      MutexLock m(&barrier_->lock);
+      if (--barrier_->num_arriving > 0) {
+        while (!barrier_->is_done) {
+          barrier_->done.Wait(&barrier_->lock);
+        }
+        return;
+      }
+    }
+    // Every other thread is waiting above, so the task runs alone.
+    barrier_->task->Run();
+    MutexLock m(&barrier_->lock);
+    barrier_->is_done = true;
+    barrier_->done.SignalAll();
+  }
+
+ private:
+  Barrier* barrier_;
+  bool has_run_;
+};
+
+ShardedDispatcher::ShardedDispatcher(int num_threads) {
+  CHECK(num_threads > 0) << "Need at least one thread: given " << num_threads;
+  for (int i = 0; i < num_threads; ++i) {
+    Worker* worker = new Worker();
+    CHECK(pthread_create(&worker->thread, NULL, &ShardedDispatcher::WorkerMain,
+                         worker) == 0) << "Could not create dispatch thread";
+    workers_.push_back(worker);
+  }
+}
+
+ShardedDispatcher::~ShardedDispatcher() {
+  CHECK(!IsRunningOnThread()) << "Cannot delete the dispatcher from its thread";
+  // Stop every thread before deleting any queued task, and delete them all
+  // before joining: a thread waiting in a DispatchToAll barrier is only
+  // released when the parts queued on the other threads are deleted.
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    Worker* worker = workers_[i];
+    MutexLock m(&worker->lock);
+    worker->stop = true;
+    worker->wakeup.Signal();
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    Worker* worker = workers_[i];
+    deque<Closure*> tasks;
+    {
+      MutexLock m(&worker->lock);
+      tasks.swap(worker->tasks);
+    }
+    for (size_t j = 0; j < tasks.size(); ++j) {
+      delete tasks[j];
+    }
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    pthread_join(workers_[i]->thread, NULL);
+    delete workers_[i];
+  }
+}
+
+void ShardedDispatcher::Dispatch(uint64 key, Closure* task) {
+  Worker* worker = workers_[key % workers_.size()];
+  MutexLock m(&worker->lock);
+  worker->tasks.push_back(task);
+  if (worker->tasks.size() == 1) {
+    worker->wakeup.Signal();
+  }
+}
+
+void ShardedDispatcher::DispatchToAll(Closure* task) {
+  Barrier* barrier = new Barrier(task, static_cast<int>(workers_.size()));
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    Dispatch(i, new BarrierTask(barrier));
+  }
+}
+
+bool ShardedDispatcher::IsRunningOnThread() const {
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (pthread_equal(workers_[i]->thread, pthread_self())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void* ShardedDispatcher::WorkerMain(void* worker_ptr) {
+  Worker* worker = static_cast<Worker*>(worker_ptr);
+  while (true) {
+    Closure* task;
+    {
+      MutexLock m(&worker->lock);
+      while (!worker->stop && worker->tasks.empty()) {
+        worker->wakeup.Wait(&worker->lock);
+      }
+      if (worker->stop) {
+        return NULL;
+      }
+      task = worker->tasks.front();
+      worker->tasks.pop_front();
+    }
+    task->Run();
+    delete task;
+  }
+}
+
+}  // namespace invalidation
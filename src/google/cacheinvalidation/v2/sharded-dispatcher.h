@@ -0,0 +1,105 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Pool of threads that run tasks in order per key and in parallel across keys.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_SHARDED_DISPATCHER_H_
+#define GOOGLE_CACHEINVALIDATION_V2_SHARDED_DISPATCHER_H_
+
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/mutex.h"
+#include "google/cacheinvalidation/v2/types.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::deque;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* A pool of threads, each with its own queue of tasks. A task is queued to the
+ * thread picked by its key, so tasks with the same key run one at a time in
+ * the order in which they were dispatched, while tasks whose keys pick other
+ * threads run in parallel with them. Used to issue listener upcalls for
+ * different objects in parallel while keeping them in order per object.
+ */
+class ShardedDispatcher {
+ public:
+  /* Creates a dispatcher and starts its num_threads threads. */
+  explicit ShardedDispatcher(int num_threads);
+
+  /* Stops the threads, waiting for their running tasks to finish, and deletes
+   * the queued tasks without running them.
+   */
+  ~ShardedDispatcher();
+
+  /* Queues task to be run, and then deleted, on the thread for key. Takes
+   * ownership of task. May be called from any thread.
+   */
+  void Dispatch(uint64 key, Closure* task);
+
+  /* Queues task to be run once, and then deleted, after every thread has run
+   * the tasks dispatched to it before, and before any thread runs the tasks
+   * dispatched to it after. The threads wait for each other meanwhile, and the
+   * task runs on the last one to get there. If the dispatcher is deleted first,
+   * the task is deleted without running. Takes ownership of task. May be
+   * called from any thread, but is only ordered with the Dispatch calls of
+   * the same thread.
+   */
+  void DispatchToAll(Closure* task);
+
+  /* Returns whether the calling thread is one of the dispatcher's threads. */
+  bool IsRunningOnThread() const;
+
+  int num_threads() const {
+    return static_cast<int>(workers_.size());
+  }
+
+ private:
+  /* A thread and its queue of tasks. */
+  struct Worker {
+    Worker() : stop(false) {}
+
+    /* Lock for tasks and stop. */
+    Mutex lock;
+
+    /* Signalled when a task is queued or the thread must stop. */
+    CondVar wakeup;
+
+    /* The tasks to run, in order. Owned. */
+    deque<Closure*> tasks;
+
+    /* Whether the thread must stop. */
+    bool stop;
+
+    pthread_t thread;
+  };
+
+  struct Barrier;
+  class BarrierTask;
+
+  /* Runs the tasks of worker until it is stopped. */
+  static void* WorkerMain(void* worker);
+
+  /* The threads, indexed by key modulo their number. Owned. */
+  vector<Worker*> workers_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_SHARDED_DISPATCHER_H_
@@ -0,0 +1,163 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Ring buffer of records in a file mapped by two processes.
+
+#include "google/cacheinvalidation/v2/shared-memory-ring.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "google/cacheinvalidation/v2/log-macro.h"
+
+namespace invalidation {
+
+SharedMemoryRing::SharedMemoryRing(const string& path, int capacity,
+                                   bool create, Logger* logger)
+    : path_(path), logger_(logger), header_(NULL), mapped_size_(0),
+      data_(NULL) {
+  int fd = create ? open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600) :
+      open(path.c_str(), O_RDWR);
+  if (fd < 0) {
+    TLOG(logger_, WARNING, "Cannot open ring file %s", path.c_str());
+    return;
+  }
+  size_t file_size = sizeof(Header) + capacity;
+  if (create) {
+    // A power of two divides 2^32, so the offsets stay consistent when the
+    // positions wrap around.
+    if ((capacity <= 0) || ((capacity & (capacity - 1)) != 0) ||
+        (ftruncate(fd, file_size) != 0)) {
+      TLOG(logger_, WARNING, "Cannot size ring file %s", path.c_str());
+      close(fd);
+      return;
+    }
+  } else {
+    struct stat file_stat;
+    if ((fstat(fd, &file_stat) != 0) ||
+        (static_cast<size_t>(file_stat.st_size) <= sizeof(Header))) {
+      TLOG(logger_, WARNING, "Ring file %s is too short", path.c_str());
+      close(fd);
+      return;
+    }
+    file_size = file_stat.st_size;
+  }
+  void* mapping =
+      mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);  // The mapping keeps the file.
+  if (mapping == MAP_FAILED) {
+    TLOG(logger_, WARNING, "Cannot map ring file %s", path.c_str());
+    return;
+  }
+  header_ = static_cast<Header*>(mapping);
+  mapped_size_ = file_size;
+  data_ = static_cast<char*>(mapping) + sizeof(Header);
+  if (create) {
+    header_->capacity = capacity;
+    header_->write_position = 0;
+    header_->read_position = 0;
+    __sync_synchronize();
+    header_->magic = kMagic;
+  } else if ((header_->magic != kMagic) ||
+             (header_->capacity != file_size - sizeof(Header))) {
+    TLOG(logger_, WARNING, "Ring file %s is not initialized", path.c_str());
+    Unmap();
+  }
+}
+
+SharedMemoryRing::~SharedMemoryRing() {
+  Unmap();
+}
+
+bool SharedMemoryRing::Write(const char* data, size_t size) {
+  if (!IsOpen()) {
+    return false;
+  }
+  uint32 write_position = header_->write_position;
+  uint32 used = write_position - header_->read_position;
+  if (sizeof(uint32) + size > header_->capacity - used) {
+    return false;
+  }
+  uint32 record_size = size;
+  CopyIn(write_position, reinterpret_cast<const char*>(&record_size),
+         sizeof(record_size));
+  CopyIn(write_position + sizeof(record_size), data, size);
+
+  // Publish the record only once its bytes are in place.
+  __sync_synchronize();
+  header_->write_position = write_position + sizeof(record_size) + size;
+  return true;
+}
+
+bool SharedMemoryRing::Read(string* record) {
+  if (!IsOpen()) {
+    return false;
+  }
+  uint32 read_position = header_->read_position;
+  uint32 used = header_->write_position - read_position;
+  if (used == 0) {
+    return false;
+  }
+  // Read the record only once the write position says it is in place.
+  __sync_synchronize();
+  uint32 record_size;
+  CopyOut(read_position, reinterpret_cast<char*>(&record_size),
+          sizeof(record_size));
+  if (sizeof(record_size) + record_size > used) {
+    TLOG(logger_, SEVERE, "Corrupt record in ring %s: %u of %u bytes",
+         path_.c_str(), record_size, used);
+    header_->read_position = header_->write_position;
+    return false;
+  }
+  record->resize(record_size);
+  if (record_size > 0) {
+    CopyOut(read_position + sizeof(record_size), &(*record)[0], record_size);
+  }
+
+  // Free the space only once the record has been copied out.
+  __sync_synchronize();
+  header_->read_position = read_position + sizeof(record_size) + record_size;
+  return true;
+}
+
+void SharedMemoryRing::CopyIn(uint32 position, const char* data,
+                              size_t size) {
+  uint32 capacity = header_->capacity;
+  size_t offset = position % capacity;
+  size_t first_part = (size < capacity - offset) ? size : capacity - offset;
+  memcpy(data_ + offset, data, first_part);
+  memcpy(data_, data + first_part, size - first_part);
+}
+
+void SharedMemoryRing::CopyOut(uint32 position, char* data, size_t size) {
+  uint32 capacity = header_->capacity;
+  size_t offset = position % capacity;
+  size_t first_part = (size < capacity - offset) ? size : capacity - offset;
+  memcpy(data, data_ + offset, first_part);
+  memcpy(data + first_part, data_, size - first_part);
+}
+
+void SharedMemoryRing::Unmap() {
+  if (header_ != NULL) {
+    munmap(header_, mapped_size_);
+    header_ = NULL;
+    mapped_size_ = 0;
+    data_ = NULL;
+  }
+}
+
+}  // namespace invalidation
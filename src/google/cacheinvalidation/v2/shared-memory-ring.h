@@ -0,0 +1,120 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Ring buffer of records in a file mapped by two processes.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_SHARED_MEMORY_RING_H_
+#define GOOGLE_CACHEINVALIDATION_V2_SHARED_MEMORY_RING_H_
+
+#include <stddef.h>
+
+#include <string>
+
+#include "base/basictypes.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+
+/* A queue of records (byte strings) in a file that one process writes and
+ * another reads, each through a shared memory mapping of the file (e.g., in
+ * /dev/shm).
+ *
+ * The file holds a header, with the positions at which the next record is
+ * written and read, followed by a ring of capacity bytes in which each
+ * record is stored as its size and its bytes, wrapping around the end. The
+ * positions count the bytes ever written and read, modulo 2^32; the writer
+ * only advances the write position, after the record is in place, and the
+ * reader only the read position, after it has copied the record out, so
+ * that no lock is needed between the two.
+ *
+ * There must be a single writer and a single reader at a time; each may be
+ * in either process. Neither blocks: the writer fails if the ring is full,
+ * and the reader if it is empty.
+ */
+class SharedMemoryRing {
+ public:
+  /* Maps the ring in the file at path. If create, the file is created (or
+   * truncated) with an empty ring of capacity bytes, which must be a power of
+   * two; otherwise it must have been created already, and capacity is
+   * ignored. If the file cannot be opened or mapped, all the operations fail.
+   */
+  SharedMemoryRing(const string& path, int capacity, bool create,
+                   Logger* logger);
+
+  /* Unmaps the file, leaving it in place. */
+  ~SharedMemoryRing();
+
+  /* Returns whether the ring was mapped. */
+  bool IsOpen() const {
+    return header_ != NULL;
+  }
+
+  /* Appends a record with the size bytes at data. Returns false if the ring
+   * does not have room for it.
+   */
+  bool Write(const char* data, size_t size);
+
+  /* Removes the oldest record and stores it in record. Returns false if the
+   * ring is empty.
+   */
+  bool Read(string* record);
+
+  /* Returns the number of bytes in the ring for records. */
+  int capacity() const {
+    return IsOpen() ? static_cast<int>(header_->capacity) : 0;
+  }
+
+  /* Default capacity of a ring. */
+  static const int kDefaultCapacity = 1 << 20;
+
+ private:
+  /* The start of the file. */
+  struct Header {
+    uint32 magic;
+    uint32 capacity;
+
+    /* Positions of the next record to write and to read. */
+    volatile uint32 write_position;
+    volatile uint32 read_position;
+  };
+
+  /* Copies size bytes from data into the ring at position. */
+  void CopyIn(uint32 position, const char* data, size_t size);
+
+  /* Copies size bytes from the ring at position to data. */
+  void CopyOut(uint32 position, char* data, size_t size);
+
+  /* Unmaps the file. */
+  void Unmap();
+
+  /* Marks the files that hold a ring. */
+  static const uint32 kMagic = 0x52696e67;
+
+  string path_;
+  Logger* logger_;
+
+  /* The mapping of the file, or NULL. */
+  Header* header_;
+  size_t mapped_size_;
+
+  /* The ring, right after the header. */
+  char* data_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_SHARED_MEMORY_RING_H_
@@ -20,60 +20,97 @@
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
 void SimpleRegistrationStore::Add(const ObjectIdP& oid) {
-  registrations_[ObjectIdDigestUtils::GetDigest(oid, digest_function_)] = oid;
-  RecomputeDigest();
+  if (registrations_.insert(
+          make_pair(digest_cache_.GetDigest(oid), oid)).second) {
+    InvalidateDigest();
+  }
 }
 
 void SimpleRegistrationStore::Add(const vector<ObjectIdP>& oids) {
+  digest_cache_.CacheDigests(oids);
   for (size_t i = 0; i < oids.size(); ++i) {
-    const ObjectIdP& oid = oids[i];
-    registrations_[ObjectIdDigestUtils::GetDigest(oid, digest_function_)] = oid;
+    Add(oids[i]);
+  }
+}
+
+void SimpleRegistrationStore::AddWithDigests(const vector<ObjectIdP>& oids,
+                                             const vector<string>& digests) {
+  digest_cache_.CacheDigests(oids, digests);
+  for (size_t i = 0; i < oids.size(); ++i) {
+    Add(oids[i]);
   }
-  RecomputeDigest();
 }
 
 void SimpleRegistrationStore::Remove(const ObjectIdP& oid) {
-  registrations_.erase(ObjectIdDigestUtils::GetDigest(oid, digest_function_));
-  RecomputeDigest();
+  // Objects without a cached digest are not in the store.
+  const string* oid_digest = digest_cache_.Find(oid);
+  if (oid_digest != NULL) {
+    registrations_.erase(*oid_digest);
+    digest_cache_.Erase(oid);
+    InvalidateDigest();
+  }
 }
 
 void SimpleRegistrationStore::Remove(const vector<ObjectIdP>& oids) {
   for (size_t i = 0; i < oids.size(); ++i) {
-    const ObjectIdP& oid = oids[i];
-    registrations_.erase(ObjectIdDigestUtils::GetDigest(oid, digest_function_));
+    Remove(oids[i]);
   }
-  RecomputeDigest();
 }
 
 void SimpleRegistrationStore::RemoveAll(vector<ObjectIdP>* oids) {
+  if (registrations_.empty()) {
+    return;
+  }
   for (map<string, ObjectIdP>::const_iterator iter = registrations_.begin();
        iter != registrations_.end(); ++iter) {
     oids->push_back(iter->second);
   }
   registrations_.clear();
-  RecomputeDigest();
+  digest_cache_.Clear();
+  InvalidateDigest();
 }
 
 bool SimpleRegistrationStore::Contains(const ObjectIdP& oid) {
-  return registrations_.find(
-      ObjectIdDigestUtils::GetDigest(oid, digest_function_)) !=
-      registrations_.end();
+  return digest_cache_.Find(oid) != NULL;
+}
+
+string SimpleRegistrationStore::GetDigestForPrefix(
+    const string& oid_digest_prefix, int prefix_len, int* num_elements) {
+  // The registrations are already sorted by digest.
+  *num_elements = 0;
+  digest_function_->Reset();
+  for (map<string, ObjectIdP>::iterator iter = registrations_.begin();
+       iter != registrations_.end(); ++iter) {
+    if (ObjectIdDigestUtils::MatchesPrefix(
+            iter->first, oid_digest_prefix, prefix_len)) {
+      digest_function_->Update(iter->first);
+      ++*num_elements;
+    }
+  }
+  return digest_function_->GetDigest();
 }
 
 void SimpleRegistrationStore::GetElements(
     const string& oid_digest_prefix, int prefix_len,
     vector<ObjectIdP>* result) {
-  // We always return all the registrations and let the Ticl sort it out.
+  // The registrations are keyed by their digests, so they can be filtered by
+  // prefix without being rehashed.
   for (map<string, ObjectIdP>::iterator iter = registrations_.begin();
        iter != registrations_.end(); ++iter) {
-    result->push_back(iter->second);
+    if (ObjectIdDigestUtils::MatchesPrefix(
+            iter->first, oid_digest_prefix, prefix_len)) {
+      result->push_back(iter->second);
+    }
   }
 }
 
 void SimpleRegistrationStore::RecomputeDigest() {
   digest_ = ObjectIdDigestUtils::GetDigest(
       registrations_, digest_function_);
+  is_digest_stale_ = false;
 }
 
 }  // namespace invalidation
@@ -23,6 +23,8 @@
 #include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
 #include "google/cacheinvalidation/v2/digest-function.h"
 #include "google/cacheinvalidation/v2/digest-store.h"
+#include "google/cacheinvalidation/v2/memory-usage.h"
+#include "google/cacheinvalidation/v2/object-id-digest-utils.h"
 
 namespace invalidation {
 
@@ -31,7 +33,9 @@ using INVALIDATION_STL_NAMESPACE::map;
 class SimpleRegistrationStore : public DigestStore<ObjectIdP> {
  public:
   explicit SimpleRegistrationStore(DigestFunction* digest_function)
-      : digest_function_(digest_function) {
+      : digest_function_(digest_function),
+        digest_cache_(digest_function),
+        is_digest_stale_(false) {
     RecomputeDigest();
   }
 
@@ -41,6 +45,9 @@ class SimpleRegistrationStore : public DigestStore<ObjectIdP> {
 
   virtual void Add(const vector<ObjectIdP>& oids);
 
+  virtual void AddWithDigests(const vector<ObjectIdP>& oids,
+                              const vector<string>& digests);
+
   virtual void Remove(const ObjectIdP& oid);
 
   virtual void Remove(const vector<ObjectIdP>& oids);
@@ -54,12 +61,23 @@ class SimpleRegistrationStore : public DigestStore<ObjectIdP> {
   }
 
   virtual string GetDigest() {
+    if (is_digest_stale_) {
+      RecomputeDigest();
+    }
     return digest_;
   }
 
+  virtual string GetDigestForPrefix(const string& oid_digest_prefix,
+                                    int prefix_len, int* num_elements);
+
   virtual void GetElements(const string& oid_digest_prefix, int prefix_len,
                            vector<ObjectIdP>* result);
 
+  virtual size_t GetAllocatedBytes() const {
+    return MemoryUsage::DigestMapBytes(registrations_) +
+        digest_cache_.GetAllocatedBytes() + MemoryUsage::StringBytes(digest_);
+  }
+
   virtual string ToString() {
     return StringPrintf("SimpleRegistrationStore: %d registrations",
                         static_cast<int>(registrations_.size()));
@@ -69,6 +87,16 @@ class SimpleRegistrationStore : public DigestStore<ObjectIdP> {
   /* Recomputes the digests over all objects and sets this.digest. */
   void RecomputeDigest();
 
+  /* Notes that the set of objects has changed so that digest_ is recomputed
+   * the next time it is needed. The digest is over all the object digests in
+   * sorted order, so it cannot be patched in place; deferring it means that a
+   * run of changes costs a single pass over the store instead of one per
+   * change.
+   */
+  void InvalidateDigest() {
+    is_digest_stale_ = true;
+  }
+
   /* All the registrations in the store mappd from the digest to the ibject id.
    */
   map<string, ObjectIdP> registrations_;
@@ -76,6 +104,14 @@ class SimpleRegistrationStore : public DigestStore<ObjectIdP> {
   /* The function used to compute digests of objects. */
   DigestFunction* digest_function_;
 
+  /* The digests of the objects in registrations_, so that each object is
+   * hashed only once while it is in the store.
+   */
+  ObjectIdDigestCache digest_cache_;
+
+  /* Whether digest_ is out of date with respect to registrations_. */
+  bool is_digest_stale_;
+
   /* The memoized digest of all objects in registrations. */
   string digest_;
 };
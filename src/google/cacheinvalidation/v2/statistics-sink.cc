@@ -0,0 +1,40 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Receivers of the statistics that the Ticl exports periodically.
+
+#include "google/cacheinvalidation/v2/statistics-sink.h"
+
+namespace invalidation {
+
+void AccumulatingStatisticsSink::ReportDeltas(
+    const vector<pair<string, int> >& deltas) {
+  MutexLock m(&lock_);
+  for (size_t i = 0; i < deltas.size(); ++i) {
+    values_[deltas[i].first] += deltas[i].second;
+  }
+}
+
+void AccumulatingStatisticsSink::GetValues(vector<pair<string, int> >* values) {
+  values->clear();
+  MutexLock m(&lock_);
+  for (map<string, int>::iterator iter = values_.begin();
+       iter != values_.end(); ++iter) {
+    if (iter->second != 0) {
+      values->push_back(*iter);
+    }
+  }
+}
+
+}  // namespace invalidation
@@ -0,0 +1,74 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Receivers of the statistics that the Ticl exports periodically.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_STATISTICS_SINK_H_
+#define GOOGLE_CACHEINVALIDATION_V2_STATISTICS_SINK_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/mutex.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Receives the changes of the Ticl statistics every
+ * Config::statistics_export_interval, so that they can be exported without
+ * going through the internal thread.
+ */
+class StatisticsSink {
+ public:
+  virtual ~StatisticsSink() {}
+
+  /* Receives the name and change of each statistic that changed since the
+   * last call, so that the sum of the changes of a statistic is its current
+   * value (as given by Statistics::GetNonZeroStatistics). Called on the
+   * internal thread, so must return quickly.
+   */
+  virtual void ReportDeltas(const vector<pair<string, int> >& deltas) = 0;
+};
+
+/* A sink that adds up the changes, so that the current value of every
+ * statistic can be read from any thread. Holds its lock only to apply a
+ * report or copy the values, never while the Ticl waits on anything else.
+ */
+class AccumulatingStatisticsSink : public StatisticsSink {
+ public:
+  virtual void ReportDeltas(const vector<pair<string, int> >& deltas);
+
+  /* Sets values to the non-zero statistics as of the last report, in name
+   * order.
+   */
+  void GetValues(vector<pair<string, int> >* values);
+
+ private:
+  /* Protects values_. */
+  Mutex lock_;
+
+  /* The current value of each statistic that was ever reported. */
+  map<string, int> values_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_STATISTICS_SINK_H_
@@ -25,6 +25,7 @@ const char* Statistics::SentMessageType_names[] = {
   "INVALIDATION_ACK",
   "REGISTRATION",
   "REGISTRATION_SYNC",
+  "PAYLOAD_FETCH",
   "TOTAL",
 };
 
@@ -35,6 +36,7 @@ const char* Statistics::ReceivedMessageType_names[] = {
   "REGISTRATION_SYNC_REQUEST",
   "TOKEN_CONTROL",
   "ERROR",
+  "PAYLOAD",
   "TOTAL",
 };
 
@@ -69,34 +71,208 @@ const char* Statistics::ClientErrorType_names[] = {
   "TOKEN_TRANSIENT_FAILURE",
 };
 
-Statistics::Statistics() {
-  InitializeMap(sent_message_types_, SentMessageType_MAX + 1);
-  InitializeMap(received_message_types_, ReceivedMessageType_MAX + 1);
-  InitializeMap(incoming_operation_types_, IncomingOperationType_MAX + 1);
-  InitializeMap(listener_event_types_, ListenerEventType_MAX + 1);
-  InitializeMap(client_error_types_, ClientErrorType_MAX + 1);
+const char* Statistics::ThrottleDelayType_names[] = {
+  "DEFERRED_MESSAGES",
+  "TOTAL_DELAY_MS",
+  "MAX_DELAY_MS",
+};
+
+const char* Statistics::PersistentWriteType_names[] = {
+  "COMPLETED_WRITES",
+  "SKIPPED_WRITES",
+  "TOTAL_LATENCY_MS",
+  "MAX_LATENCY_MS",
+};
+
+const char* Statistics::ListenerBacklogType_names[] = {
+  "OUTSTANDING_INVALIDATIONS",
+  "MAX_OUTSTANDING_INVALIDATIONS",
+  "DEFERRED_INVALIDATIONS",
+};
+
+const char* Statistics::AckedVersionCacheType_names[] = {
+  "LOOKUPS",
+  "HITS",
+  "HIT_RATE_PERCENT",
+  "EVICTIONS",
+};
+
+const char* Statistics::StartupPhaseType_names[] = {
+  "STATE_READ_MS",
+  "REGISTRATION_LOG_LOAD_MS",
+  "STATE_RESTORE_MS",
+  "TOKEN_ACQUISITION_MS",
+  "TOTAL_MS",
+};
+
+const char* Statistics::LatencyType_names[] = {
+  "REGISTRATION",
+  "INVALIDATION_DISPATCH",
+  "ACKNOWLEDGEMENT",
+};
+
+// Percentiles of the latencies given by GetNonZeroStatistics.
+static const int kExportedLatencyPercentiles[] = { 50, 90, 99 };
+
+Statistics::Statistics()
+    : sent_message_types_(false),
+      received_message_types_(false),
+      sent_message_bytes_(false),
+      received_message_bytes_(false),
+      incoming_operation_types_(false),
+      listener_event_types_(false),
+      client_error_types_(false),
+      latency_histograms_(false),
+      latency_counts_(false),
+      instrumented_internal_scheduler_(NULL),
+      instrumented_listener_scheduler_(NULL) {
+  Init();
+}
+
+Statistics::Statistics(bool shard_counters)
+    : sent_message_types_(shard_counters),
+      received_message_types_(shard_counters),
+      sent_message_bytes_(shard_counters),
+      received_message_bytes_(shard_counters),
+      incoming_operation_types_(shard_counters),
+      listener_event_types_(shard_counters),
+      client_error_types_(shard_counters),
+      latency_histograms_(shard_counters),
+      latency_counts_(shard_counters),
+      instrumented_internal_scheduler_(NULL),
+      instrumented_listener_scheduler_(NULL) {
+  Init();
+}
+
+void Statistics::Init() {
+  InitializeMap(throttle_delay_types_, ThrottleDelayType_MAX + 1);
+  InitializeMap(persistent_write_types_, PersistentWriteType_MAX + 1);
+  InitializeMap(listener_backlog_types_, ListenerBacklogType_MAX + 1);
+  InitializeMap(acked_version_cache_types_, AckedVersionCacheType_MAX + 1);
+  InitializeMap(startup_phase_types_, StartupPhaseType_MAX + 1);
+}
+
+size_t Statistics::GetMemoryUsage() const {
+  return sizeof(*this) + sent_message_types_.GetHeapSize() +
+      received_message_types_.GetHeapSize() +
+      sent_message_bytes_.GetHeapSize() +
+      received_message_bytes_.GetHeapSize() +
+      incoming_operation_types_.GetHeapSize() +
+      listener_event_types_.GetHeapSize() +
+      client_error_types_.GetHeapSize() + latency_histograms_.GetHeapSize() +
+      latency_counts_.GetHeapSize();
+}
+
+void Statistics::RecordLatency(LatencyType latency_type, int latency_ms) {
+  int bucket = 0;
+  while ((latency_ms > 0) && (bucket < kNumLatencyBuckets - 1)) {
+    latency_ms >>= 1;
+    ++bucket;
+  }
+  latency_histograms_.Add(latency_type * kNumLatencyBuckets + bucket, 1);
+  latency_counts_.Add(latency_type, 1);
+}
+
+void Statistics::GetClientStateCounters(ClientState* state) {
+  state->num_messages_sent = sent_message_types_.Get(SentMessageType_TOTAL);
+  state->num_messages_received =
+      received_message_types_.Get(ReceivedMessageType_TOTAL);
+  state->num_invalidations_issued =
+      listener_event_types_.Get(ListenerEventType_INVALIDATE) +
+      listener_event_types_.Get(ListenerEventType_INVALIDATE_UNKNOWN) +
+      listener_event_types_.Get(ListenerEventType_INVALIDATE_ALL);
+  state->num_errors = 0;
+  for (int i = 0; i <= ClientErrorType_MAX; ++i) {
+    state->num_errors += client_error_types_.Get(i);
+  }
+}
+
+int Statistics::GetLatencyQuantile(LatencyType latency_type, double quantile) {
+  int count = latency_counts_.Get(latency_type);
+  if (count == 0) {
+    return 0;
+  }
+  // Rank (from 1) of the latency at the quantile.
+  int rank = static_cast<int>(quantile * count + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  int seen = 0;
+  int bucket = 0;
+  for (; bucket < kNumLatencyBuckets - 1; ++bucket) {
+    seen +=
+        latency_histograms_.Get(latency_type * kNumLatencyBuckets + bucket);
+    if (seen >= rank) {
+      break;
+    }
+  }
+  return 1 << bucket;
 }
 
 void Statistics::GetNonZeroStatistics(
     vector<pair<string, int> >* performance_counters) {
   // Add the non-zero values from the different maps to performance_counters.
   FillWithNonZeroStatistics(
-      sent_message_types_, SentMessageType_MAX + 1, SentMessageType_names,
-      "SentMessageType.", performance_counters);
+      sent_message_types_, SentMessageType_names, "SentMessageType.",
+      performance_counters);
+  FillWithNonZeroStatistics(
+      received_message_types_, ReceivedMessageType_names,
+      "ReceivedMessageType.", performance_counters);
+  FillWithNonZeroStatistics(
+      sent_message_bytes_, SentMessageType_names, "SentBytes.",
+      performance_counters);
+  FillWithNonZeroStatistics(
+      received_message_bytes_, ReceivedMessageType_names, "ReceivedBytes.",
+      performance_counters);
+  FillWithNonZeroStatistics(
+      incoming_operation_types_, IncomingOperationType_names,
+      "IncomingOperationType.", performance_counters);
   FillWithNonZeroStatistics(
-      received_message_types_, ReceivedMessageType_MAX + 1,
-      ReceivedMessageType_names, "ReceivedMessageType.",
+      listener_event_types_, ListenerEventType_names, "ListenerEventType.",
       performance_counters);
   FillWithNonZeroStatistics(
-      incoming_operation_types_, IncomingOperationType_MAX + 1,
-      IncomingOperationType_names, "IncomingOperationType.",
+      client_error_types_, ClientErrorType_names, "ClientErrorType.",
       performance_counters);
   FillWithNonZeroStatistics(
-      listener_event_types_, ListenerEventType_MAX + 1, ListenerEventType_names,
-      "ListenerEventType.", performance_counters);
+      throttle_delay_types_, ThrottleDelayType_MAX + 1,
+      ThrottleDelayType_names, "ThrottleDelay.", performance_counters);
+  FillWithNonZeroStatistics(
+      persistent_write_types_, PersistentWriteType_MAX + 1,
+      PersistentWriteType_names, "PersistentWrite.", performance_counters);
+  FillWithNonZeroStatistics(
+      listener_backlog_types_, ListenerBacklogType_MAX + 1,
+      ListenerBacklogType_names, "ListenerBacklog.", performance_counters);
+  FillWithNonZeroStatistics(
+      acked_version_cache_types_, AckedVersionCacheType_MAX + 1,
+      AckedVersionCacheType_names, "AckedVersionCache.",
+      performance_counters);
   FillWithNonZeroStatistics(
-      client_error_types_, ClientErrorType_MAX + 1, ClientErrorType_names,
-      "ClientErrorType.", performance_counters);
+      startup_phase_types_, StartupPhaseType_MAX + 1, StartupPhaseType_names,
+      "StartupPhase.", performance_counters);
+  for (int i = 0; i <= LatencyType_MAX; ++i) {
+    LatencyType latency_type = static_cast<LatencyType>(i);
+    int count = latency_counts_.Get(i);
+    if (count == 0) {
+      continue;
+    }
+    performance_counters->push_back(make_pair(
+        StringPrintf("Latency.%s.COUNT", LatencyType_names[i]), count));
+    for (size_t j = 0; j < sizeof(kExportedLatencyPercentiles) /
+             sizeof(kExportedLatencyPercentiles[0]); ++j) {
+      int percentile = kExportedLatencyPercentiles[j];
+      performance_counters->push_back(make_pair(
+          StringPrintf("Latency.%s.P%d", LatencyType_names[i], percentile),
+          GetLatencyQuantile(latency_type, percentile / 100.0)));
+    }
+  }
+  if (instrumented_internal_scheduler_ != NULL) {
+    instrumented_internal_scheduler_->GetNonZeroMeasurements(
+        "InternalScheduler.", performance_counters);
+  }
+  if (instrumented_listener_scheduler_ != NULL) {
+    instrumented_listener_scheduler_->GetNonZeroMeasurements(
+        "ListenerScheduler.", performance_counters);
+  }
 }
 
 /* Modifies result to contain those statistics from map whose value is > 0. */
@@ -23,6 +23,9 @@
 #include <vector>
 
 #include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-state-snapshot.h"
+#include "google/cacheinvalidation/v2/instrumented-scheduler.h"
+#include "google/cacheinvalidation/v2/sharded-counters.h"
 #include "google/cacheinvalidation/v2/string_util.h"
 
 namespace invalidation {
@@ -37,6 +40,11 @@ class Statistics {
   // enums to track different different types of statistics, e.g., sent message
   // types, errors, etc. For each statistic type, we create a map and provide a
   // method to record an event for each type of statistic.
+  //
+  // The counts of messages, bytes, operations, listener events, errors and
+  // latencies only ever add up, so they are sharded counters that any thread
+  // may record into without a lock or a hop to the internal thread. The other
+  // statistics are gauges and maxima, recorded on the internal thread only.
 
   /* Types of messages sent to the server: ClientToServerMessage for their
    * description.
@@ -47,6 +55,7 @@ class Statistics {
     SentMessageType_INVALIDATION_ACK,
     SentMessageType_REGISTRATION,
     SentMessageType_REGISTRATION_SYNC,
+    SentMessageType_PAYLOAD_FETCH,
     SentMessageType_TOTAL,  // Refers to the actual ClientToServerMessage
                             // message sent on the network.
   };
@@ -64,6 +73,7 @@ class Statistics {
     ReceivedMessageType_REGISTRATION_SYNC_REQUEST,
     ReceivedMessageType_TOKEN_CONTROL,
     ReceivedMessageType_ERROR,
+    ReceivedMessageType_PAYLOAD,
     ReceivedMessageType_TOTAL,  // Refers to the actual ServerToClientMessage
                                 // messages received from the network.
   };
@@ -152,57 +162,364 @@ class Statistics {
       ClientErrorType_TOKEN_TRANSIENT_FAILURE;
   static const char* ClientErrorType_names[];
 
+  /* Delays of outgoing messages by the rate limits. */
+  enum ThrottleDelayType {
+    /* Number of messages whose sending the rate limits deferred. */
+    ThrottleDelayType_DEFERRED_MESSAGES,
+
+    /* Total time in milliseconds by which messages were deferred. */
+    ThrottleDelayType_TOTAL_DELAY_MS,
+
+    /* Longest time in milliseconds by which a message was deferred. */
+    ThrottleDelayType_MAX_DELAY_MS,
+  };
+  static const ThrottleDelayType ThrottleDelayType_MIN =
+      ThrottleDelayType_DEFERRED_MESSAGES;
+  static const ThrottleDelayType ThrottleDelayType_MAX =
+      ThrottleDelayType_MAX_DELAY_MS;
+  static const char* ThrottleDelayType_names[];
+
+  /* Writes of the persistent state. */
+  enum PersistentWriteType {
+    /* Number of writes that completed (successfully or not). */
+    PersistentWriteType_COMPLETED_WRITES,
+
+    /* Number of writes skipped because the state was unchanged or a later
+     * state replaced it before it could be written.
+     */
+    PersistentWriteType_SKIPPED_WRITES,
+
+    /* Total time in milliseconds that the completed writes took. */
+    PersistentWriteType_TOTAL_LATENCY_MS,
+
+    /* Longest time in milliseconds that a write took. */
+    PersistentWriteType_MAX_LATENCY_MS,
+  };
+  static const PersistentWriteType PersistentWriteType_MIN =
+      PersistentWriteType_COMPLETED_WRITES;
+  static const PersistentWriteType PersistentWriteType_MAX =
+      PersistentWriteType_MAX_LATENCY_MS;
+  static const char* PersistentWriteType_names[];
+
+  /* Invalidations issued to the listener and not yet acknowledged. */
+  enum ListenerBacklogType {
+    /* Number of invalidations currently outstanding. */
+    ListenerBacklogType_OUTSTANDING_INVALIDATIONS,
+
+    /* Largest number of invalidations that were outstanding at once. */
+    ListenerBacklogType_MAX_OUTSTANDING_INVALIDATIONS,
+
+    /* Number of invalidations left for the server to resend because the
+     * backlog was full.
+     */
+    ListenerBacklogType_DEFERRED_INVALIDATIONS,
+  };
+  static const ListenerBacklogType ListenerBacklogType_MIN =
+      ListenerBacklogType_OUTSTANDING_INVALIDATIONS;
+  static const ListenerBacklogType ListenerBacklogType_MAX =
+      ListenerBacklogType_DEFERRED_INVALIDATIONS;
+  static const char* ListenerBacklogType_names[];
+
+  /* Lookups of received invalidations in the cache of acknowledged versions
+   * (see InvalidationClientImpl::Config::acked_version_cache_size).
+   */
+  enum AckedVersionCacheType {
+    /* Number of known-version invalidations looked up. */
+    AckedVersionCacheType_LOOKUPS,
+
+    /* Number of invalidations found to be at or below an acknowledged
+     * version, and so acknowledged without being issued.
+     */
+    AckedVersionCacheType_HITS,
+
+    /* Percentage of the lookups that were hits. */
+    AckedVersionCacheType_HIT_RATE_PERCENT,
+
+    /* Number of objects evicted from the cache to make room for others. */
+    AckedVersionCacheType_EVICTIONS,
+  };
+  static const AckedVersionCacheType AckedVersionCacheType_MIN =
+      AckedVersionCacheType_LOOKUPS;
+  static const AckedVersionCacheType AckedVersionCacheType_MAX =
+      AckedVersionCacheType_EVICTIONS;
+  static const char* AckedVersionCacheType_names[];
+
+  /* Durations in milliseconds of the phases of the last start of the Ticl. The
+   * read of the state blob and the load of the registration log run
+   * concurrently.
+   */
+  enum StartupPhaseType {
+    /* From Start until the state blob was read. */
+    StartupPhaseType_STATE_READ_MS,
+
+    /* From Start until the persisted registrations were loaded. */
+    StartupPhaseType_REGISTRATION_LOG_LOAD_MS,
+
+    /* Verifying and restoring the persistent state, including sending the
+     * first info message when restarting.
+     */
+    StartupPhaseType_STATE_RESTORE_MS,
+
+    /* From the end of the restore until the Ticl had a token. */
+    StartupPhaseType_TOKEN_ACQUISITION_MS,
+
+    /* From Start until the listener was told that the Ticl is ready. */
+    StartupPhaseType_TOTAL_MS,
+  };
+  static const StartupPhaseType StartupPhaseType_MIN =
+      StartupPhaseType_STATE_READ_MS;
+  static const StartupPhaseType StartupPhaseType_MAX =
+      StartupPhaseType_TOTAL_MS;
+  static const char* StartupPhaseType_names[];
+
+  /* Intervals whose latencies are kept in histograms. */
+  enum LatencyType {
+    /* From a registration until the server confirmed it. */
+    LatencyType_REGISTRATION,
+
+    /* From the receipt of an invalidation until it was handed to the listener.
+     */
+    LatencyType_INVALIDATION_DISPATCH,
+
+    /* From an acknowledgement until the ack was sent to the server. */
+    LatencyType_ACKNOWLEDGEMENT,
+  };
+  static const LatencyType LatencyType_MIN = LatencyType_REGISTRATION;
+  static const LatencyType LatencyType_MAX = LatencyType_ACKNOWLEDGEMENT;
+  static const char* LatencyType_names[];
+
+  /* Number of buckets of each latency histogram. Bucket 0 counts latencies
+   * under 1 ms, bucket i > 0 those in [2^(i-1), 2^i) ms, and the last bucket
+   * also all the longer ones (over about 35 minutes).
+   */
+  static const int kNumLatencyBuckets = 22;
+
   // Arrays for each type of Statistic to keep track of how many times each
   // event has occurred.
 
+  /* Creates statistics whose additive counters are one shard each. */
   Statistics();
 
+  /* Creates statistics whose additive counters are sharded across threads if
+   * shard_counters (see ShardedCounters), for clients on which many threads
+   * record at once. This makes the statistics about 10 KB larger.
+   */
+  explicit Statistics(bool shard_counters);
+
+  /* Returns the number of bytes taken by this object and its counters. */
+  size_t GetMemoryUsage() const;
+
   /* Returns the counter value for client_error_type. */
   int GetClientErrorCounterForTest(ClientErrorType client_error_type) {
-    return client_error_types_[client_error_type];
+    return client_error_types_.Get(client_error_type);
   }
 
   /* Returns the counter value for sent_message_type. */
   int GetSentMessageCounterForTest(SentMessageType sent_message_type) {
-    return sent_message_types_[sent_message_type];
+    return sent_message_types_.Get(sent_message_type);
+  }
+
+  /* Returns the number of bytes sent in messages of type sent_message_type. */
+  int GetSentBytesForTest(SentMessageType sent_message_type) {
+    return sent_message_bytes_.Get(sent_message_type);
+  }
+
+  /* Returns the number of bytes received in messages of type
+   * received_message_type.
+   */
+  int GetReceivedBytesForTest(ReceivedMessageType received_message_type) {
+    return received_message_bytes_.Get(received_message_type);
+  }
+
+  /* Returns the value for throttle_delay_type. */
+  int GetThrottleDelayForTest(ThrottleDelayType throttle_delay_type) {
+    return throttle_delay_types_[throttle_delay_type];
+  }
+
+  /* Returns the value for persistent_write_type. */
+  int GetPersistentWriteForTest(PersistentWriteType persistent_write_type) {
+    return persistent_write_types_[persistent_write_type];
+  }
+
+  /* Returns the value for listener_backlog_type. */
+  int GetListenerBacklogForTest(ListenerBacklogType listener_backlog_type) {
+    return listener_backlog_types_[listener_backlog_type];
+  }
+
+  int GetAckedVersionCacheForTest(
+      AckedVersionCacheType acked_version_cache_type) {
+    return acked_version_cache_types_[acked_version_cache_type];
+  }
+
+  /* Returns the duration of startup_phase_type. */
+  int GetStartupPhaseForTest(StartupPhaseType startup_phase_type) {
+    return startup_phase_types_[startup_phase_type];
+  }
+
+  /* Returns the number of latencies recorded for latency_type. */
+  int GetLatencyCountForTest(LatencyType latency_type) {
+    return latency_counts_.Get(latency_type);
   }
 
-  /* Records the fact that a message of type sent_message_type has been sent. */
+  /* Records the fact that a message of type sent_message_type has been sent.
+   * May be called from any thread.
+   */
   void RecordSentMessage(SentMessageType sent_message_type) {
-    ++sent_message_types_[sent_message_type];
+    sent_message_types_.Add(sent_message_type, 1);
+  }
+
+  /* Records that num_bytes bytes of messages of type sent_message_type were
+   * sent. The sub-messages are counted before compression, and TOTAL counts
+   * the whole messages as they were sent on the network. May be called from
+   * any thread.
+   */
+  void RecordSentBytes(SentMessageType sent_message_type, int num_bytes) {
+    sent_message_bytes_.Add(sent_message_type, num_bytes);
+  }
+
+  /* Records that num_bytes bytes of messages of type received_message_type
+   * were received. May be called from any thread.
+   */
+  void RecordReceivedBytes(ReceivedMessageType received_message_type,
+                           int num_bytes) {
+    received_message_bytes_.Add(received_message_type, num_bytes);
   }
 
   /* Records the fact that a message of type received_message_type has been
-   * received.
+   * received. May be called from any thread.
    */
   void RecordReceivedMessage(ReceivedMessageType received_message_type) {
-    ++received_message_types_[received_message_type];
+    received_message_types_.Add(received_message_type, 1);
   }
 
   /* Records the fact that the application has made a call of type
-   * incoming_operation_type.
+   * incoming_operation_type. May be called from any thread.
    */
   void RecordIncomingOperation(IncomingOperationType incoming_operation_type) {
-    ++incoming_operation_types_[incoming_operation_type];
+    incoming_operation_types_.Add(incoming_operation_type, 1);
   }
 
   /* Records the fact that the listener has issued an event of type
-   * listener_event_type.
+   * listener_event_type. May be called from any thread.
    */
   void RecordListenerEvent(ListenerEventType listener_event_type) {
-    ++listener_event_types_[listener_event_type];
+    listener_event_types_.Add(listener_event_type, 1);
   }
 
   /* Records the fact that the client has observed an error of type
-   * client_error_type.
+   * client_error_type. May be called from any thread.
    */
   void RecordError(ClientErrorType client_error_type) {
-    ++client_error_types_[client_error_type];
+    client_error_types_.Add(client_error_type, 1);
+  }
+
+  /* Records the fact that the rate limits deferred the sending of a message by
+   * delay_ms milliseconds.
+   */
+  void RecordThrottleDelay(int delay_ms) {
+    ++throttle_delay_types_[ThrottleDelayType_DEFERRED_MESSAGES];
+    throttle_delay_types_[ThrottleDelayType_TOTAL_DELAY_MS] += delay_ms;
+    if (delay_ms > throttle_delay_types_[ThrottleDelayType_MAX_DELAY_MS]) {
+      throttle_delay_types_[ThrottleDelayType_MAX_DELAY_MS] = delay_ms;
+    }
+  }
+
+  /* Records the fact that a write of the persistent state completed after
+   * latency_ms milliseconds.
+   */
+  void RecordPersistentWrite(int latency_ms) {
+    ++persistent_write_types_[PersistentWriteType_COMPLETED_WRITES];
+    persistent_write_types_[PersistentWriteType_TOTAL_LATENCY_MS] += latency_ms;
+    if (latency_ms >
+        persistent_write_types_[PersistentWriteType_MAX_LATENCY_MS]) {
+      persistent_write_types_[PersistentWriteType_MAX_LATENCY_MS] = latency_ms;
+    }
+  }
+
+  /* Records the fact that a write of the persistent state was skipped. */
+  void RecordSkippedPersistentWrite() {
+    ++persistent_write_types_[PersistentWriteType_SKIPPED_WRITES];
+  }
+
+  /* Records the fact that num_outstanding invalidations are now issued to the
+   * listener and not yet acknowledged.
+   */
+  void RecordListenerBacklog(int num_outstanding) {
+    listener_backlog_types_[ListenerBacklogType_OUTSTANDING_INVALIDATIONS] =
+        num_outstanding;
+    if (num_outstanding > listener_backlog_types_[
+            ListenerBacklogType_MAX_OUTSTANDING_INVALIDATIONS]) {
+      listener_backlog_types_[
+          ListenerBacklogType_MAX_OUTSTANDING_INVALIDATIONS] = num_outstanding;
+    }
+  }
+
+  /* Records the fact that an invalidation was not issued because the listener
+   * backlog was full.
+   */
+  void RecordDeferredInvalidation() {
+    ++listener_backlog_types_[ListenerBacklogType_DEFERRED_INVALIDATIONS];
+  }
+
+  /* Records the fact that a known-version invalidation was looked up in the
+   * cache of acknowledged versions, and whether it was found to be stale.
+   */
+  void RecordAckedVersionLookup(bool is_hit) {
+    int* counts = acked_version_cache_types_;
+    ++counts[AckedVersionCacheType_LOOKUPS];
+    if (is_hit) {
+      ++counts[AckedVersionCacheType_HITS];
+    }
+    counts[AckedVersionCacheType_HIT_RATE_PERCENT] = static_cast<int>(
+        100LL * counts[AckedVersionCacheType_HITS] /
+        counts[AckedVersionCacheType_LOOKUPS]);
+  }
+
+  /* Records the fact that an object was evicted from the cache of
+   * acknowledged versions.
+   */
+  void RecordAckedVersionEviction() {
+    ++acked_version_cache_types_[AckedVersionCacheType_EVICTIONS];
+  }
+
+  /* Records the fact that startup_phase_type took duration_ms milliseconds in
+   * the last start.
+   */
+  void RecordStartupPhase(StartupPhaseType startup_phase_type,
+                          int duration_ms) {
+    startup_phase_types_[startup_phase_type] = duration_ms;
+  }
+
+  /* Records the fact that an interval of type latency_type took latency_ms
+   * milliseconds. May be called from any thread.
+   */
+  void RecordLatency(LatencyType latency_type, int latency_ms);
+
+  /* Returns an upper bound in milliseconds on the given quantile (in [0, 1]) of
+   * the latencies recorded for latency_type, i.e., the upper end of the bucket
+   * that holds it, or 0 if none was recorded.
+   */
+  int GetLatencyQuantile(LatencyType latency_type, double quantile);
+
+  /* Sets the counters of state: the messages sent and received, the
+   * invalidations of all kinds issued to the listener and the client errors.
+   */
+  void GetClientStateCounters(ClientState* state);
+
+  /* Makes GetNonZeroStatistics report the measurements of the given
+   * schedulers (either may be NULL), which must outlive this object.
+   */
+  void SetInstrumentedSchedulers(InstrumentedScheduler* internal_scheduler,
+                                 InstrumentedScheduler* listener_scheduler) {
+    instrumented_internal_scheduler_ = internal_scheduler;
+    instrumented_listener_scheduler_ = listener_scheduler;
   }
 
   /* Modifies performance_counters to contain all the statistics that are
    * non-zero. Each pair has the name of the statistic event and the number of
-   * times that event has occurred since the client started.
+   * times that event has occurred since the client started. The latency
+   * histograms contribute their count and their 50th, 90th and 99th
+   * percentiles, and the instrumented schedulers their measurements.
    */
   void GetNonZeroStatistics(vector<pair<string, int> >* performance_counters);
 
@@ -215,11 +532,44 @@ class Statistics {
   static void InitializeMap(int map[], int size);
 
  private:
-  int sent_message_types_[SentMessageType_MAX + 1];
-  int received_message_types_[ReceivedMessageType_MAX + 1];
-  int incoming_operation_types_[IncomingOperationType_MAX + 1];
-  int listener_event_types_[ListenerEventType_MAX + 1];
-  int client_error_types_[ClientErrorType_MAX + 1];
+  /* Sets the counters that are not sharded to 0. */
+  void Init();
+
+  /* Modifies result to contain those statistics from counters whose value is
+   * > 0.
+   */
+  template <int kNumCounters>
+  static void FillWithNonZeroStatistics(
+      const ShardedCounters<kNumCounters>& counters, const char* names[],
+      const char* prefix, vector<pair<string, int> >* destination) {
+    int map[kNumCounters];
+    counters.GetAll(map);
+    FillWithNonZeroStatistics(map, kNumCounters, names, prefix, destination);
+  }
+
+  ShardedCounters<SentMessageType_MAX + 1> sent_message_types_;
+  ShardedCounters<ReceivedMessageType_MAX + 1> received_message_types_;
+  ShardedCounters<SentMessageType_MAX + 1> sent_message_bytes_;
+  ShardedCounters<ReceivedMessageType_MAX + 1> received_message_bytes_;
+  ShardedCounters<IncomingOperationType_MAX + 1> incoming_operation_types_;
+  ShardedCounters<ListenerEventType_MAX + 1> listener_event_types_;
+  ShardedCounters<ClientErrorType_MAX + 1> client_error_types_;
+  int throttle_delay_types_[ThrottleDelayType_MAX + 1];
+  int persistent_write_types_[PersistentWriteType_MAX + 1];
+  int listener_backlog_types_[ListenerBacklogType_MAX + 1];
+  int acked_version_cache_types_[AckedVersionCacheType_MAX + 1];
+  int startup_phase_types_[StartupPhaseType_MAX + 1];
+
+  /* Bucket b of the histogram of latency type t is at t * kNumLatencyBuckets
+   * + b.
+   */
+  ShardedCounters<(LatencyType_MAX + 1) * kNumLatencyBuckets>
+      latency_histograms_;
+  ShardedCounters<LatencyType_MAX + 1> latency_counts_;
+
+  /* Instrumented schedulers of the Ticl, if any. Not owned. */
+  InstrumentedScheduler* instrumented_internal_scheduler_;
+  InstrumentedScheduler* instrumented_listener_scheduler_;
 };
 
 }  // namespace invalidation
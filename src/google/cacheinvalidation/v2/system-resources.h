@@ -23,8 +23,11 @@
 #ifndef GOOGLE_CACHEINVALIDATION_V2_SYSTEM_RESOURCES_H_
 #define GOOGLE_CACHEINVALIDATION_V2_SYSTEM_RESOURCES_H_
 
+#include <stddef.h>
+
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "google/cacheinvalidation/callback.h"
 #include "google/cacheinvalidation/stl-namespace.h"
@@ -34,18 +37,58 @@ namespace invalidation {
 
 using INVALIDATION_STL_NAMESPACE::pair;
 using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
 
 class Status;
 class SystemResources;  // Declared below.
 
 typedef pair<Status, string> StatusStringPair;
 typedef INVALIDATION_CALLBACK1_TYPE(const string&) MessageCallback;
+typedef INVALIDATION_CALLBACK1_TYPE(string*) MessageBufferCallback;
 typedef INVALIDATION_CALLBACK1_TYPE(bool) NetworkStatusCallback;
 typedef INVALIDATION_CALLBACK1_TYPE(StatusStringPair) ReadKeyCallback;
 typedef INVALIDATION_CALLBACK1_TYPE(Status) WriteKeyCallback;
 typedef INVALIDATION_CALLBACK1_TYPE(bool) DeleteKeyCallback;
 typedef INVALIDATION_CALLBACK1_TYPE(StatusStringPair) ReadAllKeysCallback;
 
+/* A key and its value, pointing into memory owned by the storage. */
+struct KeyValueView {
+  KeyValueView(const char* key_data, size_t key_size, const char* value_data,
+               size_t value_size)
+      : key_data(key_data), key_size(key_size), value_data(value_data),
+        value_size(value_size) {}
+
+  /* Returns copies of the key and the value. */
+  string key() const {
+    return string(key_data, key_size);
+  }
+  string value() const {
+    return string(value_data, value_size);
+  }
+
+  const char* key_data;
+  size_t key_size;
+  const char* value_data;
+  size_t value_size;
+};
+
+/* A batch of entries read by a StorageCursor. */
+struct KeyValueBatch {
+  KeyValueBatch() : success(true), is_last(false) {}
+
+  /* Whether the entries could be read. If not, the iteration stops. */
+  bool success;
+
+  /* The entries, in increasing key order. */
+  vector<KeyValueView> entries;
+
+  /* Whether there are no entries after these. */
+  bool is_last;
+};
+
+typedef INVALIDATION_CALLBACK1_TYPE(const KeyValueBatch&)
+    KeyValueBatchCallback;
+
 /* Interface specifying the logging functionality provided by
  * SystemResources.
  */
@@ -71,6 +114,14 @@ class Logger {
    */
   virtual void Log(LogLevel level, const char* file, int line,
                    const char* format, ...) = 0;
+
+  /* Returns whether messages at level are logged. Callers may skip calling Log
+   * (and computing its arguments) for messages at levels that are not. The
+   * default implementation logs all levels.
+   */
+  virtual bool IsEnabled(LogLevel level) {
+    return true;
+  }
 };
 
 /* Interface specifying the scheduling functionality provided by
@@ -113,6 +164,16 @@ class NetworkChannel {
   // protocol buffer.  Implementors MAY NOT rely on this fact.
   virtual void SendMessage(const string& outgoing_message) = 0;
 
+  /* Sends *outgoing_message to the data center, like SendMessage above, but
+   * allows the channel to take the contents instead of copying them: the
+   * channel may leave any value in *outgoing_message (e.g., swap it with a
+   * buffer of its own). The caller keeps ownership of the string itself and
+   * may reuse it. The default implementation calls SendMessage above.
+   */
+  virtual void SendMessage(string* outgoing_message) {
+    SendMessage(static_cast<const string&>(*outgoing_message));
+  }
+
   /* Sets the receiver to which messages from the data center will be
    * delivered.
    */
@@ -121,6 +182,20 @@ class NetworkChannel {
   virtual void SetMessageReceiver(
       MessageCallback* incoming_receiver) = 0;
 
+  /* Sets the receiver to which messages from the data center will be
+   * delivered, like SetMessageReceiver, but as buffers whose contents the
+   * receiver may take (e.g., by swapping them out) instead of copying them.
+   * Channels that can give up their buffers should override this. The
+   * channel takes ownership of incoming_receiver, as of the receiver given to
+   * SetMessageReceiver. The default implementation hands SetMessageReceiver
+   * a receiver that owns incoming_receiver and delivers it a copy of each
+   * message, so that the channel deletes incoming_receiver along with it.
+   */
+  virtual void SetMessageBufferReceiver(
+      MessageBufferCallback* incoming_receiver) {
+    SetMessageReceiver(new BufferReceiverAdapter(incoming_receiver));
+  }
+
   /* Informs the network channel that network_status_receiver be informed about
    * changes to network status changes. If the network is connected, the channel
    * should call network_Status_Receiver->Run(true) and when the network is
@@ -136,6 +211,49 @@ class NetworkChannel {
    */
   virtual void AddNetworkStatusReceiver(
       NetworkStatusCallback* network_status_receiver) = 0;
+
+ private:
+  /* Receiver that delivers a copy of each message to a buffer receiver, which
+   * it owns.
+   */
+  class BufferReceiverAdapter : public MessageCallback {
+   public:
+    explicit BufferReceiverAdapter(MessageBufferCallback* receiver)
+        : receiver_(receiver) {}
+
+    virtual ~BufferReceiverAdapter() {
+      delete receiver_;
+    }
+
+    virtual bool IsRepeatable() const {
+      return true;
+    }
+
+    virtual void Run(const string& message) {
+      string buffer(message);
+      receiver_->Run(&buffer);
+    }
+
+   private:
+    MessageBufferCallback* receiver_;
+  };
+};
+
+/* Streams the entries of a Storage in batches, each one read only when the
+ * consumer asks for it. Keys written or deleted while the cursor is open may or
+ * may not be seen.
+ */
+class StorageCursor {
+ public:
+  virtual ~StorageCursor() {}
+
+  /* Reads up to max_entries entries after those already read, then calls done
+   * with them and deletes it. The views in the batch stay valid until the next
+   * call to ReadNext or the deletion of the cursor.
+   *
+   * REQUIRES: max_entries > 0, and no other ReadNext is outstanding.
+   */
+  virtual void ReadNext(int max_entries, KeyValueBatchCallback* done) = 0;
 };
 
 /* Interface specifying the storage functionality provided by
@@ -174,6 +292,15 @@ class Storage {
    * indicate a failed status, in which case the iteration stops.
    */
   virtual void ReadAllKeys(ReadAllKeysCallback* key_callback) = 0;
+
+  /* Returns a new cursor over the keys that start with key_prefix and their
+   * values, in increasing key order, or NULL if the storage has no cursors,
+   * in which case callers fall back to ReadAllKeys and ReadKey. The caller
+   * owns the cursor, and may delete it to stop early.
+   */
+  virtual StorageCursor* OpenCursor(const string& key_prefix) {
+    return NULL;
+  }
 };
 
 /* Interface for a component of a SystemResources implementation constructed by
@@ -0,0 +1,102 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the cache of acknowledged versions.
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/acked-version-cache.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+
+namespace invalidation {
+
+class AckedVersionCacheTest : public testing::Test {
+ public:
+  void SetUp() {
+    for (int i = 0; i < kNumObjects; ++i) {
+      ObjectIdP oid;
+      oid.set_source(ObjectSource_Type_TEST);
+      oid.set_name(StringPrintf("object-%d", i));
+      oids_.push_back(oid);
+    }
+  }
+
+  vector<ObjectIdP> oids_;
+
+  static const int kNumObjects;
+};
+
+const int AckedVersionCacheTest::kNumObjects = 10;
+
+/* Checks that versions at or below the highest acknowledged one are reported
+ * as acknowledged, and later ones are not.
+ */
+TEST_F(AckedVersionCacheTest, KeepsHighestVersion) {
+  AckedVersionCache cache(kNumObjects);
+  ASSERT_FALSE(cache.IsAcknowledged(oids_[0], 1));
+  ASSERT_FALSE(cache.RecordAck(oids_[0], 5));
+  ASSERT_FALSE(cache.RecordAck(oids_[0], 3));
+  ASSERT_TRUE(cache.IsAcknowledged(oids_[0], 3));
+  ASSERT_TRUE(cache.IsAcknowledged(oids_[0], 5));
+  ASSERT_FALSE(cache.IsAcknowledged(oids_[0], 6));
+  ASSERT_FALSE(cache.IsAcknowledged(oids_[1], 5));
+  ASSERT_EQ(1, cache.size());
+}
+
+/* Checks that a full cache evicts an object that was not used since the hand
+ * last passed it, and keeps the ones that were.
+ */
+TEST_F(AckedVersionCacheTest, EvictsWithClock) {
+  AckedVersionCache cache(3);
+  cache.RecordAck(oids_[0], 1);
+  cache.RecordAck(oids_[1], 1);
+  cache.RecordAck(oids_[2], 1);
+
+  // Object 0 gets a second chance, so object 1 is evicted.
+  ASSERT_TRUE(cache.IsAcknowledged(oids_[0], 1));
+  ASSERT_TRUE(cache.RecordAck(oids_[3], 1));
+  ASSERT_EQ(3, cache.size());
+  ASSERT_TRUE(cache.IsAcknowledged(oids_[0], 1));
+  ASSERT_FALSE(cache.IsAcknowledged(oids_[1], 1));
+  ASSERT_TRUE(cache.IsAcknowledged(oids_[2], 1));
+  ASSERT_TRUE(cache.IsAcknowledged(oids_[3], 1));
+
+  // Every object is now referenced, so the hand sweeps them all and evicts
+  // the one it started from.
+  ASSERT_TRUE(cache.RecordAck(oids_[4], 1));
+  ASSERT_EQ(3, cache.size());
+  ASSERT_FALSE(cache.IsAcknowledged(oids_[2], 1));
+  ASSERT_TRUE(cache.IsAcknowledged(oids_[4], 1));
+}
+
+/* Checks that the versions listed for catching up are the highest
+ * acknowledged version of each object in the cache.
+ */
+TEST_F(AckedVersionCacheTest, ListsHighestVersions) {
+  AckedVersionCache cache(kNumObjects);
+  cache.RecordAck(oids_[0], 5);
+  cache.RecordAck(oids_[1], 2);
+  cache.RecordAck(oids_[0], 7);
+  vector<InvalidationP> versions;
+  cache.GetVersions(&versions);
+  ASSERT_EQ(2, static_cast<int>(versions.size()));
+  for (size_t i = 0; i < versions.size(); ++i) {
+    ASSERT_TRUE(versions[i].is_known_version());
+    int index = (versions[i].object_id().name() == oids_[0].name()) ? 0 : 1;
+    ASSERT_EQ(oids_[index].SerializeAsString(),
+              versions[i].object_id().SerializeAsString());
+    ASSERT_EQ((index == 0) ? 7 : 2, versions[i].version());
+  }
+}
+
+}  // namespace invalidation
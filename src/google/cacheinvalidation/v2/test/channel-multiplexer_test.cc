@@ -0,0 +1,220 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the channel multiplexer.
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/channel-multiplexer.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+/* Network channel that records the messages sent on it. */
+class RecordingNetworkChannel : public NetworkChannel {
+ public:
+  RecordingNetworkChannel() : receiver_(NULL), status_receiver_(NULL) {}
+
+  virtual ~RecordingNetworkChannel() {
+    delete receiver_;
+    delete status_receiver_;
+  }
+
+  virtual void SendMessage(const string& outgoing_message) {
+    sent_messages.push_back(outgoing_message);
+  }
+
+  virtual void SetMessageReceiver(MessageCallback* incoming_receiver) {
+    receiver_ = incoming_receiver;
+  }
+
+  virtual void AddNetworkStatusReceiver(
+      NetworkStatusCallback* network_status_receiver) {
+    status_receiver_ = network_status_receiver;
+  }
+
+  /* Delivers a batch of the serialized messages to the receiver. */
+  void Deliver(const vector<string>& messages) {
+    ServerToClientMessageBatch batch;
+    for (size_t i = 0; i < messages.size(); ++i) {
+      batch.add_message(messages[i]);
+    }
+    string serialized;
+    batch.SerializeToString(&serialized);
+    receiver_->Run(serialized);
+  }
+
+  vector<string> sent_messages;
+
+ private:
+  MessageCallback* receiver_;
+  NetworkStatusCallback* status_receiver_;
+};
+
+class ChannelMultiplexerTest : public testing::Test {
+ public:
+  void SetUp() {
+    scheduler_.reset(new DeterministicScheduler());
+    scheduler_->StartScheduler();
+    network_.reset(new RecordingNetworkChannel());
+    multiplexer_.reset(new ChannelMultiplexer(
+        network_.get(), scheduler_.get(), &logger_, kBatchingDelay));
+    received_messages_.resize(kNumClients);
+    for (int i = 0; i < kNumClients; ++i) {
+      NetworkChannel* channel = multiplexer_->NewClientChannel();
+      channel->SetMessageReceiver(NewPermanentCallback(
+          this, &ChannelMultiplexerTest::ReceiveMessage, i));
+      client_channels_.push_back(channel);
+    }
+  }
+
+  void TearDown() {
+    // Run the pending batching task before the multiplexer goes away.
+    scheduler_->StopScheduler();
+  }
+
+  /* Records message as received by client. */
+  void ReceiveMessage(int client, const string& message) {
+    received_messages_[client].push_back(message);
+  }
+
+  /* Returns a serialized client message with the given token and, if token is
+   * empty, an initialize message with nonce.
+   */
+  static string MakeClientMessage(const string& token, const string& nonce) {
+    ClientToServerMessage message;
+    message.mutable_header()->set_client_token(token);
+    if (token.empty()) {
+      message.mutable_initialize_message()->set_nonce(nonce);
+    }
+    string serialized;
+    message.SerializeToString(&serialized);
+    return serialized;
+  }
+
+  /* Returns a serialized server message for token, which assigns new_token if
+   * it is not empty.
+   */
+  static string MakeServerMessage(const string& token,
+                                  const string& new_token) {
+    ServerToClientMessage message;
+    message.mutable_header()->set_client_token(token);
+    if (!new_token.empty()) {
+      message.mutable_token_control_message()->set_new_token(new_token);
+    }
+    string serialized;
+    message.SerializeToString(&serialized);
+    return serialized;
+  }
+
+  /* Advances the time past the batching delay and runs the ready tasks. */
+  void AdvanceBatchingDelay() {
+    scheduler_->ModifyTime(kBatchingDelay);
+    scheduler_->RunReadyTasks();
+  }
+
+  NullLogger logger_;
+  scoped_ptr<DeterministicScheduler> scheduler_;
+  scoped_ptr<RecordingNetworkChannel> network_;
+  scoped_ptr<ChannelMultiplexer> multiplexer_;
+  vector<NetworkChannel*> client_channels_;
+  vector<vector<string> > received_messages_;
+
+  static const int kNumClients;
+  static const TimeDelta kBatchingDelay;
+};
+
+const int ChannelMultiplexerTest::kNumClients = 3;
+const TimeDelta ChannelMultiplexerTest::kBatchingDelay =
+    TimeDelta::FromMilliseconds(100);
+
+/* Checks that the messages of the clients are sent in one batch after the
+ * batching delay.
+ */
+TEST_F(ChannelMultiplexerTest, BatchesOutgoingMessages) {
+  ASSERT_EQ(kNumClients, multiplexer_->num_clients());
+  client_channels_[0]->SendMessage(MakeClientMessage("token-0", ""));
+  client_channels_[1]->SendMessage(MakeClientMessage("", "nonce-1"));
+  client_channels_[0]->SendMessage(MakeClientMessage("token-0", ""));
+  scheduler_->RunReadyTasks();
+  ASSERT_TRUE(network_->sent_messages.empty());
+
+  AdvanceBatchingDelay();
+  ASSERT_EQ(1, static_cast<int>(network_->sent_messages.size()));
+  ClientToServerMessageBatch batch;
+  ASSERT_TRUE(batch.ParseFromString(network_->sent_messages[0]));
+  ASSERT_EQ(3, batch.message_size());
+  ASSERT_EQ(MakeClientMessage("", "nonce-1"), batch.message(1));
+
+  // Nothing more is sent until another message is.
+  AdvanceBatchingDelay();
+  ASSERT_EQ(1, static_cast<int>(network_->sent_messages.size()));
+}
+
+/* Checks that incoming messages are delivered by token or nonce, including to
+ * a token that the client has been assigned but has not yet sent on.
+ */
+TEST_F(ChannelMultiplexerTest, RoutesIncomingMessages) {
+  client_channels_[0]->SendMessage(MakeClientMessage("token-0", ""));
+  client_channels_[1]->SendMessage(MakeClientMessage("", "nonce-1"));
+  AdvanceBatchingDelay();
+
+  vector<string> messages;
+  messages.push_back(MakeServerMessage("nonce-1", "token-1"));
+  messages.push_back(MakeServerMessage("token-0", ""));
+  messages.push_back(MakeServerMessage("token-1", ""));
+  messages.push_back(MakeServerMessage("unknown", ""));
+  network_->Deliver(messages);
+
+  ASSERT_EQ(1, static_cast<int>(received_messages_[0].size()));
+  ASSERT_EQ(messages[1], received_messages_[0][0]);
+  ASSERT_EQ(2, static_cast<int>(received_messages_[1].size()));
+  ASSERT_EQ(messages[0], received_messages_[1][0]);
+  ASSERT_EQ(messages[2], received_messages_[1][1]);
+  ASSERT_TRUE(received_messages_[2].empty());
+
+  // The nonce is no longer routed once the client has a token.
+  messages.clear();
+  messages.push_back(MakeServerMessage("nonce-1", ""));
+  network_->Deliver(messages);
+  ASSERT_EQ(2, static_cast<int>(received_messages_[1].size()));
+}
+
+/* Checks that messages are routed by the token in their header wherever it
+ * is in the message, around the fields that are skipped.
+ */
+TEST_F(ChannelMultiplexerTest, RoutesByHeaderAroundOtherFields) {
+  // A registration message, then the header: fields may come in any order.
+  ClientToServerMessage body;
+  for (int i = 0; i < 100; ++i) {
+    RegistrationP* registration =
+        body.mutable_registration_message()->add_registration();
+    registration->mutable_object_id()->set_source(1);
+    registration->mutable_object_id()->set_name("object");
+    registration->set_op_type(RegistrationP_OpType_REGISTER);
+  }
+  string serialized;
+  body.SerializeToString(&serialized);
+  serialized += MakeClientMessage("token-2", "");
+  client_channels_[2]->SendMessage(serialized);
+  AdvanceBatchingDelay();
+
+  vector<string> messages;
+  messages.push_back(MakeServerMessage("token-2", ""));
+  network_->Deliver(messages);
+  ASSERT_EQ(1, static_cast<int>(received_messages_[2].size()));
+}
+
+}  // namespace invalidation
@@ -0,0 +1,232 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the coalescing of invalidations waiting for the listener.
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/checking-invalidation-listener.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/statistics.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Client that records the handles acknowledged on it. */
+class AckRecordingClient : public InvalidationClient {
+ public:
+  virtual void Start() {}
+  virtual void Stop() {}
+  virtual void Register(const ObjectId& object_id) {}
+  virtual void Register(const vector<ObjectId>& object_ids) {}
+  virtual void Unregister(const ObjectId& object_id) {}
+  virtual void Unregister(const vector<ObjectId>& object_ids) {}
+
+  virtual void Register(const vector<ObjectId>& object_ids,
+                        CompletionCallback* callback) {
+    delete callback;
+  }
+
+  virtual void Unregister(const vector<ObjectId>& object_ids,
+                          CompletionCallback* callback) {
+    delete callback;
+  }
+
+  virtual void Acknowledge(const AckHandle& ack_handle) {
+    acked.push_back(ack_handle.handle_data());
+  }
+
+  virtual void Acknowledge(const vector<AckHandle>& ack_handles) {
+    for (size_t i = 0; i < ack_handles.size(); ++i) {
+      Acknowledge(ack_handles[i]);
+    }
+  }
+
+  virtual void Acknowledge(const vector<AckHandle>& ack_handles,
+                           CompletionCallback* callback) {
+    Acknowledge(ack_handles);
+    delete callback;
+  }
+
+  virtual void FetchPayload(const Invalidation& invalidation,
+                            PayloadCallback* callback) {
+    delete callback;
+  }
+
+  vector<string> acked;
+};
+
+/* Listener that records the invalidations issued to it. */
+class InvalidationRecordingListener : public InvalidationListener {
+ public:
+  InvalidationRecordingListener() : num_upcalls(0) {}
+
+  virtual void Ready(InvalidationClient* client) {}
+
+  virtual void Invalidate(InvalidationClient* client,
+                          const Invalidation& invalidation,
+                          const AckHandle& ack_handle) {
+    ++num_upcalls;
+    invalidations.push_back(make_pair(invalidation, ack_handle));
+  }
+
+  virtual void InvalidateUnknownVersion(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        const AckHandle& ack_handle) {}
+
+  virtual void InvalidateAll(InvalidationClient* client,
+                             const AckHandle& ack_handle) {}
+
+  virtual void InformRegistrationStatus(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        RegistrationState reg_state) {}
+
+  virtual void InformRegistrationFailure(InvalidationClient* client,
+                                         const ObjectId& object_id,
+                                         bool is_transient,
+                                         const string& error_message) {}
+
+  virtual void ReissueRegistrations(InvalidationClient* client,
+                                    const string& prefix,
+                                    int prefix_length) {}
+
+  virtual void InformError(InvalidationClient* client,
+                           const ErrorInfo& error_info) {}
+
+  virtual void InvalidateBatch(
+      InvalidationClient* client,
+      const vector<pair<Invalidation, AckHandle> >& batch) {
+    ++num_upcalls;
+    invalidations.insert(invalidations.end(), batch.begin(), batch.end());
+  }
+
+  int num_upcalls;
+  vector<pair<Invalidation, AckHandle> > invalidations;
+};
+
+class CheckingInvalidationListenerTest : public testing::Test {
+ public:
+  void SetUp() {
+    internal_scheduler_.StartScheduler();
+    listener_scheduler_.StartScheduler();
+    listener_.reset(new CheckingInvalidationListener(
+        &delegate_, &statistics_, &internal_scheduler_, &listener_scheduler_,
+        &logger_, 0, true));
+  }
+
+  /* Passes an invalidation of the object with name at version to the
+   * listener, with an ack handle named after both.
+   */
+  void Invalidate(const string& name, int64 version) {
+    listener_->Invalidate(&client_, Invalidation(ObjectId(4, name), version),
+                          MakeAckHandle(name, version));
+  }
+
+  /* Passes the invalidations of the objects with names at version to the
+   * listener in one batch.
+   */
+  void InvalidateBatch(const vector<string>& names, int64 version) {
+    vector<pair<Invalidation, AckHandle> > batch;
+    for (size_t i = 0; i < names.size(); ++i) {
+      batch.push_back(make_pair(Invalidation(ObjectId(4, names[i]), version),
+                                MakeAckHandle(names[i], version)));
+    }
+    listener_->InvalidateBatch(&client_, batch);
+  }
+
+  /* Runs the internal task, then the upcalls it scheduled. */
+  void RunOnInternalThread(Closure* task) {
+    internal_scheduler_.Schedule(Scheduler::NoDelay(), task);
+    internal_scheduler_.RunReadyTasks();
+    listener_scheduler_.RunReadyTasks();
+  }
+
+  void InvalidateObjects() {
+    Invalidate("a", 1);
+    Invalidate("b", 1);
+    Invalidate("a", 3);
+    Invalidate("a", 2);
+  }
+
+  void InvalidateBatches() {
+    vector<string> names;
+    names.push_back("a");
+    names.push_back("b");
+    InvalidateBatch(names, 1);
+    names.pop_back();
+    InvalidateBatch(names, 2);
+  }
+
+  static AckHandle MakeAckHandle(const string& name, int64 version) {
+    return AckHandle(name + StringPrintf("%d", static_cast<int>(version)));
+  }
+
+  NullLogger logger_;
+  Statistics statistics_;
+  DeterministicScheduler internal_scheduler_;
+  DeterministicScheduler listener_scheduler_;
+  AckRecordingClient client_;
+  InvalidationRecordingListener delegate_;
+  scoped_ptr<CheckingInvalidationListener> listener_;
+};
+
+/* Checks that of the invalidations of an object that wait for the listener,
+ * only the newest is issued, and the others are acknowledged.
+ */
+TEST_F(CheckingInvalidationListenerTest, IssuesNewestVersion) {
+  RunOnInternalThread(NewPermanentCallback(
+      this, &CheckingInvalidationListenerTest::InvalidateObjects));
+  ASSERT_EQ(2, delegate_.num_upcalls);
+  ASSERT_EQ(2, static_cast<int>(delegate_.invalidations.size()));
+  ASSERT_EQ("a", delegate_.invalidations[0].first.object_id().name());
+  ASSERT_EQ(3, delegate_.invalidations[0].first.version());
+  ASSERT_EQ("a3", delegate_.invalidations[0].second.handle_data());
+  ASSERT_EQ("b", delegate_.invalidations[1].first.object_id().name());
+  ASSERT_EQ(2, static_cast<int>(client_.acked.size()));
+  ASSERT_EQ("a1", client_.acked[0]);
+  ASSERT_EQ("a2", client_.acked[1]);
+
+  // Once issued, an invalidation is no longer merged with later ones.
+  RunOnInternalThread(NewPermanentCallback(
+      this, &CheckingInvalidationListenerTest::InvalidateObjects));
+  ASSERT_EQ(4, delegate_.num_upcalls);
+}
+
+/* Checks that invalidations given in batches are merged too, and that an
+ * entry merged into a waiting one leaves no upcall of its own.
+ */
+TEST_F(CheckingInvalidationListenerTest, CoalescesBatches) {
+  RunOnInternalThread(NewPermanentCallback(
+      this, &CheckingInvalidationListenerTest::InvalidateBatches));
+  ASSERT_EQ(1, delegate_.num_upcalls);
+  ASSERT_EQ(2, static_cast<int>(delegate_.invalidations.size()));
+  ASSERT_EQ("a2", delegate_.invalidations[0].second.handle_data());
+  ASSERT_EQ("b1", delegate_.invalidations[1].second.handle_data());
+  ASSERT_EQ(1, static_cast<int>(client_.acked.size()));
+  ASSERT_EQ("a1", client_.acked[0]);
+}
+
+}  // namespace invalidation
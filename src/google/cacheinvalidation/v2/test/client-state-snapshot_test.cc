@@ -0,0 +1,105 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the lock-free snapshot of the client state.
+
+#include <pthread.h>
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/client-state-snapshot.h"
+
+namespace invalidation {
+
+static const int kNumPublications = 200000;
+
+/* Returns a state whose fields all derive from i, so that a torn copy of two
+ * states shows as fields that disagree.
+ */
+static ClientState MakeState(int i) {
+  ClientState state;
+  state.publish_time_ms = i;
+  state.is_started = ((i & 1) != 0);
+  state.has_token = ((i & 1) != 0);
+  state.is_registration_in_sync = ((i & 1) == 0);
+  state.num_registrations = i;
+  state.num_outstanding_invalidations = -i;
+  state.num_messages_sent = 2 * i;
+  state.num_messages_received = 3 * i;
+  state.num_invalidations_issued = i + 1;
+  state.num_errors = i - 1;
+  return state;
+}
+
+/* Publishes kNumPublications states into the snapshot. */
+static void* PublishStates(void* snapshot_ptr) {
+  ClientStateSnapshot* snapshot =
+      static_cast<ClientStateSnapshot*>(snapshot_ptr);
+  for (int i = 1; i <= kNumPublications; ++i) {
+    snapshot->Publish(MakeState(i));
+  }
+  return NULL;
+}
+
+/* Checks that nothing is read before the first publication, and then the last
+ * state published.
+ */
+TEST(ClientStateSnapshotTest, ReadsLastPublishedState) {
+  ClientStateSnapshot snapshot;
+  ClientState state;
+  ASSERT_FALSE(snapshot.Read(&state));
+  ASSERT_EQ(static_cast<uint64>(0), snapshot.num_published());
+
+  snapshot.Publish(MakeState(7));
+  snapshot.Publish(MakeState(8));
+  ASSERT_TRUE(snapshot.Read(&state));
+  ASSERT_EQ(8, state.num_registrations);
+  ASSERT_EQ(16, state.num_messages_sent);
+  ASSERT_TRUE(state.is_registration_in_sync);
+  ASSERT_EQ(static_cast<uint64>(2), snapshot.num_published());
+}
+
+/* Checks that states read while another thread publishes are never torn,
+ * and never go back in time.
+ */
+TEST(ClientStateSnapshotTest, ReadsConsistentStatesConcurrently) {
+  ClientStateSnapshot snapshot;
+  pthread_t writer;
+  ASSERT_EQ(0, pthread_create(&writer, NULL, &PublishStates, &snapshot));
+  int64 last_time_ms = 0;
+  ClientState state;
+  while (last_time_ms < kNumPublications) {
+    if (!snapshot.Read(&state)) {
+      continue;
+    }
+    int i = static_cast<int>(state.publish_time_ms);
+    ClientState expected = MakeState(i);
+    ASSERT_EQ(expected.is_started, state.is_started);
+    ASSERT_EQ(expected.has_token, state.has_token);
+    ASSERT_EQ(expected.is_registration_in_sync,
+              state.is_registration_in_sync);
+    ASSERT_EQ(expected.num_registrations, state.num_registrations);
+    ASSERT_EQ(expected.num_outstanding_invalidations,
+              state.num_outstanding_invalidations);
+    ASSERT_EQ(expected.num_messages_sent, state.num_messages_sent);
+    ASSERT_EQ(expected.num_messages_received, state.num_messages_received);
+    ASSERT_EQ(expected.num_invalidations_issued,
+              state.num_invalidations_issued);
+    ASSERT_EQ(expected.num_errors, state.num_errors);
+    ASSERT_LE(last_time_ms, state.publish_time_ms);
+    last_time_ms = state.publish_time_ms;
+  }
+  pthread_join(writer, NULL);
+}
+
+}  // namespace invalidation
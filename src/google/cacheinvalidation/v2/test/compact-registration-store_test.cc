@@ -0,0 +1,151 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the compact registration store.
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/compact-registration-store.h"
+#include "google/cacheinvalidation/v2/object-id-digest-utils.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/sha1-digest-function.h"
+#include "google/cacheinvalidation/v2/simple-registration-store.h"
+
+namespace invalidation {
+
+class CompactRegistrationStoreTest : public testing::Test {
+ public:
+  void SetUp() {
+    digest_function_.reset(new Sha1DigestFunction());
+    store_.reset(new CompactRegistrationStore(digest_function_.get()));
+    simple_store_.reset(new SimpleRegistrationStore(digest_function_.get()));
+    for (int i = 0; i < kNumObjects; ++i) {
+      ObjectIdP oid;
+      oid.set_source(ObjectSource_Type_TEST);
+      oid.set_name(StringPrintf("object-%d", i));
+      oids_.push_back(oid);
+    }
+  }
+
+  /* Checks that store_ holds the same objects as simple_store_ and computes
+   * the same digests.
+   */
+  void CheckSameAsSimpleStore() {
+    ASSERT_EQ(simple_store_->size(), store_->size());
+    ASSERT_EQ(simple_store_->GetDigest(), store_->GetDigest());
+    for (size_t i = 0; i < oids_.size(); ++i) {
+      ASSERT_EQ(simple_store_->Contains(oids_[i]), store_->Contains(oids_[i]));
+    }
+  }
+
+  scoped_ptr<DigestFunction> digest_function_;
+  scoped_ptr<CompactRegistrationStore> store_;
+  scoped_ptr<SimpleRegistrationStore> simple_store_;
+  vector<ObjectIdP> oids_;
+
+  static const int kNumObjects;
+};
+
+const int CompactRegistrationStoreTest::kNumObjects = 1000;
+
+/* Checks that the store agrees with the simple store through additions and
+ * removals, including enough churn to force the table to be rebuilt.
+ */
+TEST_F(CompactRegistrationStoreTest, MatchesSimpleStore) {
+  CheckSameAsSimpleStore();
+  for (int i = 0; i < 100; ++i) {
+    store_->Add(oids_[i]);
+    simple_store_->Add(oids_[i]);
+  }
+  CheckSameAsSimpleStore();
+  store_->Add(oids_);
+  simple_store_->Add(oids_);
+  CheckSameAsSimpleStore();
+
+  // Remove most of the objects one by one and then add some back.
+  for (int i = 0; i < kNumObjects; ++i) {
+    if (i % 10 != 0) {
+      store_->Remove(oids_[i]);
+      simple_store_->Remove(oids_[i]);
+    }
+  }
+  CheckSameAsSimpleStore();
+  vector<ObjectIdP> to_add(oids_.begin(), oids_.begin() + kNumObjects / 2);
+  store_->Add(to_add);
+  simple_store_->Add(to_add);
+  CheckSameAsSimpleStore();
+
+  // The elements must round-trip, and the per-prefix digests must agree.
+  vector<ObjectIdP> elements;
+  store_->GetElements(string(), 0, &elements);
+  ASSERT_EQ(store_->size(), static_cast<int>(elements.size()));
+  for (size_t i = 0; i < elements.size(); ++i) {
+    ASSERT_TRUE(simple_store_->Contains(elements[i]));
+  }
+  string prefix =
+      ObjectIdDigestUtils::GetDigest(oids_[0], digest_function_.get());
+  for (int prefix_len = 0; prefix_len <= 8; ++prefix_len) {
+    int count, simple_count;
+    ASSERT_EQ(
+        simple_store_->GetDigestForPrefix(prefix, prefix_len, &simple_count),
+        store_->GetDigestForPrefix(prefix, prefix_len, &count));
+    ASSERT_EQ(simple_count, count);
+    elements.clear();
+    store_->GetElements(prefix, prefix_len, &elements);
+    ASSERT_EQ(count, static_cast<int>(elements.size()));
+  }
+
+  vector<ObjectIdP> removed;
+  store_->RemoveAll(&removed);
+  ASSERT_EQ(simple_store_->size(), static_cast<int>(removed.size()));
+  ASSERT_EQ(0, store_->size());
+  ASSERT_EQ(SimpleRegistrationStore(digest_function_.get()).GetDigest(),
+            store_->GetDigest());
+}
+
+/* Checks that adding and removing objects with digests computed elsewhere
+ * gives the same store as computing them in the store.
+ */
+TEST_F(CompactRegistrationStoreTest, UsesGivenDigests) {
+  Sha1DigestFunction other_digest_function;
+  vector<string> digests;
+  ObjectIdDigestUtils::GetDigests(oids_, &other_digest_function, &digests);
+  store_->AddWithDigests(oids_, digests);
+  simple_store_->AddWithDigests(oids_, digests);
+  CheckSameAsSimpleStore();
+  ASSERT_EQ(kNumObjects, store_->size());
+
+  vector<ObjectIdP> to_remove(oids_.begin(), oids_.begin() + kNumObjects / 2);
+  vector<string> removed_digests(digests.begin(),
+                                 digests.begin() + kNumObjects / 2);
+  store_->RemoveWithDigests(to_remove, removed_digests);
+  simple_store_->RemoveWithDigests(to_remove, removed_digests);
+  CheckSameAsSimpleStore();
+  ASSERT_EQ(kNumObjects / 2, store_->size());
+}
+
+/* Checks that each registration costs a small, fixed amount of memory beyond
+ * its name.
+ */
+TEST_F(CompactRegistrationStoreTest, MemoryPerRegistration) {
+  store_->Add(oids_);
+  size_t name_bytes = 0;
+  for (size_t i = 0; i < oids_.size(); ++i) {
+    name_bytes += oids_[i].name().size();
+  }
+  store_->GetDigest();
+  size_t overhead = store_->GetAllocatedBytes() - name_bytes;
+  ASSERT_LE(overhead / kNumObjects, 80u);
+}
+
+}  // namespace invalidation
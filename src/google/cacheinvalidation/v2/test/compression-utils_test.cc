@@ -0,0 +1,55 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the compression utilities.
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/compression-utils.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+
+namespace invalidation {
+
+class CompressionUtilsTest : public testing::Test {};
+
+/* Checks that data round-trips through Deflate and Inflate, including empty
+ * data, and that a registration message with repetitive names compresses well.
+ */
+TEST_F(CompressionUtilsTest, RoundTrip) {
+  string compressed, data;
+  ASSERT_TRUE(CompressionUtils::Deflate(string(), &compressed));
+  ASSERT_TRUE(CompressionUtils::Inflate(compressed, &data));
+  ASSERT_EQ(string(), data);
+
+  RegistrationMessage message;
+  for (int i = 0; i < 1000; ++i) {
+    RegistrationP* registration = message.add_registration();
+    registration->mutable_object_id()->set_source(ObjectSource_Type_TEST);
+    registration->mutable_object_id()->set_name(
+        StringPrintf("user/1234567/bookmarks/folder-%d", i));
+    registration->set_op_type(RegistrationP_OpType_REGISTER);
+  }
+  string serialized;
+  message.SerializeToString(&serialized);
+  ASSERT_TRUE(CompressionUtils::Deflate(serialized, &compressed));
+  ASSERT_LT(compressed.size() * 5, serialized.size());
+  ASSERT_TRUE(CompressionUtils::Inflate(compressed, &data));
+  ASSERT_EQ(serialized, data);
+
+  // Truncated data is rejected.
+  ASSERT_FALSE(CompressionUtils::Inflate(
+      compressed.substr(0, compressed.size() / 2), &data));
+}
+
+}  // namespace invalidation
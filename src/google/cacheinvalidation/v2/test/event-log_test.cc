@@ -0,0 +1,88 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the binary event log.
+
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/event-log.h"
+
+namespace invalidation {
+
+/* Checks that a snapshot decodes to the last events in order, with their
+ * values and bytes, once the ring has wrapped around (leaving out the oldest
+ * event kept).
+ */
+TEST(EventLogTest, KeepsLastEvents) {
+  EventLog event_log(2);
+  string snapshot;
+  vector<EventLog::Event> events;
+  event_log.GetSnapshot(&snapshot);
+  ASSERT_TRUE(EventLog::Decode(snapshot, &events));
+  ASSERT_TRUE(events.empty());
+
+  for (int64 i = 0; i < 6; ++i) {
+    event_log.Record(EVENT_MESSAGE_SENT, i, 100 + i);
+  }
+  string name("object-name");
+  TICL_EVENT_BYTES(&event_log, EVENT_INVALIDATION_ISSUED, 7, 1, name);
+  ASSERT_EQ(static_cast<uint64>(7), event_log.num_recorded());
+
+  event_log.GetSnapshot(&snapshot);
+  ASSERT_TRUE(EventLog::Decode(snapshot, &events));
+  ASSERT_EQ(3, static_cast<int>(events.size()));
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_EQ(EVENT_MESSAGE_SENT, events[i].event_id);
+    ASSERT_EQ(i + 4, events[i].values[0]);
+    ASSERT_EQ(i + 104, events[i].values[1]);
+    ASSERT_EQ(0, events[i].bytes_size);
+    ASSERT_TRUE(events[i].time_us <= events[i + 1].time_us);
+  }
+  ASSERT_EQ(EVENT_INVALIDATION_ISSUED, events[2].event_id);
+  ASSERT_EQ(7, events[2].values[0]);
+  ASSERT_EQ(name, string(events[2].bytes, events[2].bytes_size));
+  ASSERT_STREQ("INVALIDATION_ISSUED",
+               EventLog::EventName(EVENT_INVALIDATION_ISSUED));
+}
+
+/* Checks that long bytes are truncated, that a NULL log records nothing, and
+ * that malformed snapshots are rejected.
+ */
+TEST(EventLogTest, TruncatesBytesAndRejectsMalformedSnapshots) {
+  EventLog event_log(3);
+  string long_name(100, 'n');
+  TICL_EVENT_BYTES(&event_log, EVENT_REGISTRATION_STATUS, 1, 0, long_name);
+  EventLog* no_log = NULL;
+  TICL_EVENT(no_log, EVENT_NETWORK_STATUS, 1, 0);
+
+  string snapshot;
+  vector<EventLog::Event> events;
+  event_log.GetSnapshot(&snapshot);
+  ASSERT_TRUE(EventLog::Decode(snapshot, &events));
+  ASSERT_EQ(1, static_cast<int>(events.size()));
+  ASSERT_EQ(EventLog::kMaxEventBytes, events[0].bytes_size);
+  ASSERT_EQ(long_name.substr(0, EventLog::kMaxEventBytes),
+            string(events[0].bytes, events[0].bytes_size));
+
+  ASSERT_FALSE(EventLog::Decode(snapshot.substr(0, snapshot.size() - 1),
+                                &events));
+  ASSERT_FALSE(EventLog::Decode("", &events));
+  string corrupt(snapshot);
+  corrupt[0] ^= 1;
+  ASSERT_FALSE(EventLog::Decode(corrupt, &events));
+}
+
+}  // namespace invalidation
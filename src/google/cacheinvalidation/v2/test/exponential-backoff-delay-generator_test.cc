@@ -0,0 +1,73 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the exponential backoff delay generator.
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/exponential-backoff-delay-generator.h"
+
+namespace invalidation {
+
+static const TimeDelta kInitialDelay = TimeDelta::FromSeconds(1);
+static const TimeDelta kMaxDelay = TimeDelta::FromSeconds(100);
+
+/* Checks that the plain delays stay under a cap that doubles up to the max. */
+TEST(ExponentialBackoffDelayGeneratorTest, DelaysStayUnderDoublingCap) {
+  ExponentialBackoffDelayGenerator generator(new Random(1), kMaxDelay,
+                                             kInitialDelay);
+  TimeDelta cap = kInitialDelay;
+  for (int i = 0; i < 20; ++i) {
+    TimeDelta delay = generator.GetNextDelay();
+    ASSERT_TRUE(delay >= TimeDelta());
+    ASSERT_TRUE(delay <= cap);
+    cap = (cap * 2 > kMaxDelay) ? kMaxDelay : cap * 2;
+  }
+}
+
+/* Checks that decorrelated delays stay between the initial delay and three
+ * times the previous one, capped at the max, and start over on a reset.
+ */
+TEST(ExponentialBackoffDelayGeneratorTest, DecorrelatedDelaysAreBounded) {
+  ExponentialBackoffDelayGenerator generator(new Random(1), kMaxDelay,
+                                             kInitialDelay);
+  generator.set_decorrelated(true);
+  TimeDelta last = kInitialDelay;
+  for (int i = 0; i < 50; ++i) {
+    TimeDelta delay = generator.GetNextDelay();
+    ASSERT_TRUE(delay >= kInitialDelay);
+    ASSERT_TRUE(delay <= last * 3);
+    ASSERT_TRUE(delay <= kMaxDelay);
+    last = delay;
+  }
+  generator.Reset(kInitialDelay);
+  ASSERT_TRUE(generator.GetNextDelay() <= kInitialDelay * 3);
+}
+
+/* Checks that lowering the max delay caps the following delays. */
+TEST(ExponentialBackoffDelayGeneratorTest, SetMaxDelayCapsDelays) {
+  ExponentialBackoffDelayGenerator generator(new Random(1), kMaxDelay,
+                                             kInitialDelay);
+  generator.set_decorrelated(true);
+  for (int i = 0; i < 20; ++i) {
+    generator.GetNextDelay();
+  }
+  TimeDelta new_max = TimeDelta::FromSeconds(2);
+  generator.SetMaxDelay(new_max);
+  ASSERT_TRUE(new_max == generator.max_delay());
+  for (int i = 0; i < 20; ++i) {
+    ASSERT_TRUE(generator.GetNextDelay() <= new_max);
+  }
+}
+
+}  // namespace invalidation
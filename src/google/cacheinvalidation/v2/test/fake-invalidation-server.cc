@@ -0,0 +1,363 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Fake invalidation server and client fleet for load tests.
+
+#include "google/cacheinvalidation/v2/test/fake-invalidation-server.h"
+
+#include "google/cacheinvalidation/v2/object-name-coding.h"
+#include "google/cacheinvalidation/v2/proto-converter.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+
+namespace invalidation {
+
+void LoadNetworkChannel::SendMessage(const string& outgoing_message) {
+  scheduler_->Schedule(network_delay_, NewPermanentCallback(
+      server_, &FakeInvalidationServer::HandleClientMessage, client_index_,
+      outgoing_message));
+}
+
+void FakeInvalidationServer::HandleClientMessage(int client_index,
+                                                 string message) {
+  ++num_messages_received_;
+  ClientSession* session = sessions_[client_index];
+  ClientToServerMessage& request = incoming_message_;
+  request.ParseFromString(message);
+  CHECK(!request.has_compressed_content())
+      << "Server does not accept compression";
+  if (request.has_registration_message()) {
+    CHECK(ObjectNameCoding::DecodeRegistrations(
+        request.mutable_registration_message())) << "Malformed names";
+  }
+  for (int i = 0; i < request.registration_sync_message().subtree_size();
+       ++i) {
+    CHECK(ObjectNameCoding::DecodeSubtree(
+        request.mutable_registration_sync_message()->mutable_subtree(i)))
+        << "Malformed names";
+  }
+  RecordArrival(message.size(), request.has_initialize_message());
+  if (IsDown()) {
+    ++num_messages_dropped_;
+    return;
+  }
+  ServerToClientMessage response;
+  bool has_response = false;
+
+  if (request.has_initialize_message()) {
+    // Assign a token, echoing the nonce as the client token.
+    session->token = StringPrintf("token-%d", client_index);
+    const InitializeMessage& init_message = request.initialize_message();
+    session->omits_payloads = init_message.omit_payloads();
+    session->front_codes_names = false;
+    for (int i = 0; i < init_message.supported_name_encoding_size(); ++i) {
+      if (init_message.supported_name_encoding(i) ==
+          InitializeMessage_NameEncoding_FRONT_CODED) {
+        session->front_codes_names = true;
+      }
+    }
+    InitHeader(session, request.initialize_message().nonce(), &response);
+    response.mutable_token_control_message()->set_new_token(session->token);
+    Send(session, response);
+    if (session->is_forgotten) {
+      session->is_forgotten = false;
+      ServerToClientMessage sync_request;
+      InitHeader(session, session->token, &sync_request);
+      sync_request.mutable_registration_sync_request_message();
+      Send(session, sync_request);
+      SendCatchUp(session, init_message);
+    }
+    return;
+  }
+  if (session->token.empty()) {
+    // Forgotten in a restart: make the client acquire a new token.
+    InitHeader(session, request.header().client_token(), &response);
+    response.mutable_token_control_message()->set_new_token("");
+    Send(session, response);
+    return;
+  }
+  if (request.has_registration_message()) {
+    const RegistrationMessage& reg_message = request.registration_message();
+    for (int i = 0; i < reg_message.registration_size(); ++i) {
+      const RegistrationP& registration = reg_message.registration(i);
+      if (registration.op_type() == RegistrationP_OpType_REGISTER) {
+        session->registrations.Add(registration.object_id());
+      } else {
+        session->registrations.Remove(registration.object_id());
+      }
+      RegistrationStatus* status =
+          response.mutable_registration_status_message()->
+          add_registration_status();
+      status->mutable_registration()->CopyFrom(registration);
+      status->mutable_status()->set_code(StatusP_Code_SUCCESS);
+    }
+    has_response = true;
+  }
+  if (request.has_registration_sync_message()) {
+    const RegistrationSyncMessage& sync_message =
+        request.registration_sync_message();
+    for (int i = 0; i < sync_message.subtree_size(); ++i) {
+      const RegistrationSubtree& subtree = sync_message.subtree(i);
+      for (int j = 0; j < subtree.registered_object_size(); ++j) {
+        session->registrations.Add(subtree.registered_object(j));
+      }
+    }
+    has_response = true;
+  }
+  if (request.has_invalidation_ack_message()) {
+    const InvalidationMessage& acks = request.invalidation_ack_message();
+    for (int i = 0; i < acks.invalidation_size(); ++i) {
+      map<int64, Time>::iterator iter =
+          send_times_.find(acks.invalidation(i).version());
+      if (iter != send_times_.end()) {
+        ack_latencies_.Add(
+            (scheduler_->GetCurrentTime() - iter->second).InMilliseconds());
+        send_times_.erase(iter);
+      }
+    }
+  }
+  if (request.has_info_message() &&
+      request.info_message().server_registration_summary_requested()) {
+    has_response = true;
+  }
+  if (has_response) {
+    InitHeader(session, session->token, &response);
+    Send(session, response);
+  }
+}
+
+void FakeInvalidationServer::Tick() {
+  scheduler_->Schedule(TimeDelta::FromMilliseconds(config_.tick_ms),
+      NewPermanentCallback(this, &FakeInvalidationServer::Tick));
+  if (IsDown()) {
+    return;
+  }
+  pending_invalidations_ +=
+      config_.invalidations_per_second * config_.tick_ms / 1000.0;
+  int num_invalidations = static_cast<int>(pending_invalidations_);
+  pending_invalidations_ -= num_invalidations;
+  SendInvalidations(num_invalidations);
+  SendPeriodicMessages(config_.registration_sync_interval_ms,
+                       &FakeInvalidationServer::AddRegistrationSyncRequest);
+  SendPeriodicMessages(config_.quiet_period_interval_ms,
+                       &FakeInvalidationServer::AddConfigChange);
+}
+
+void FakeInvalidationServer::SendInvalidations(int num_invalidations) {
+  map<int, ServerToClientMessage> messages;
+  string payload(config_.payload_size, 'p');
+  Time now = scheduler_->GetCurrentTime();
+  for (int i = 0; i < num_invalidations; ++i) {
+    int client_index = RandomIndex(sessions_.size());
+    ClientSession* session = sessions_[client_index];
+    if (session->token.empty() || session->objects.empty()) {
+      continue;
+    }
+    int object_index = RandomIndex(session->objects.size());
+    const ObjectIdP& object_id = session->objects[object_index];
+    if (!session->registrations.Contains(object_id)) {
+      continue;
+    }
+    session->object_versions[object_index] = next_version_;
+    InvalidationP* invalidation =
+        messages[client_index].mutable_invalidation_message()->
+        add_invalidation();
+    invalidation->mutable_object_id()->CopyFrom(object_id);
+    invalidation->set_is_known_version(true);
+    invalidation->set_version(next_version_);
+    if ((config_.payload_size > 0) && !session->omits_payloads) {
+      invalidation->set_payload(payload);
+    }
+    send_times_[next_version_++] = now;
+    ++num_invalidations_sent_;
+  }
+  for (map<int, ServerToClientMessage>::iterator iter = messages.begin();
+       iter != messages.end(); ++iter) {
+    ClientSession* session = sessions_[iter->first];
+    InitHeader(session, session->token, &iter->second);
+    Send(session, iter->second);
+  }
+}
+
+void FakeInvalidationServer::SendCatchUp(
+    ClientSession* session, const InitializeMessage& init_message) {
+  ServerToClientMessage message;
+  InvalidationMessage* invalidations = message.mutable_invalidation_message();
+  if (!init_message.supports_catch_up()) {
+    InvalidationP* invalidation = invalidations->add_invalidation();
+    invalidation->mutable_object_id()->set_source(ObjectSource_Type_INTERNAL);
+    invalidation->mutable_object_id()->set_name("");
+    invalidation->set_is_known_version(false);
+    invalidation->set_version(0);
+    ++num_invalidate_alls_sent_;
+  } else {
+    map<string, int64> processed_versions;
+    for (int i = 0; i < init_message.catch_up_version_size(); ++i) {
+      const InvalidationP& version = init_message.catch_up_version(i);
+      processed_versions[version.object_id().SerializeAsString()] =
+          version.version();
+    }
+    string payload(config_.payload_size, 'p');
+    for (size_t i = 0; i < session->objects.size(); ++i) {
+      if (session->object_versions[i] == 0) {
+        continue;
+      }
+      map<string, int64>::iterator iter =
+          processed_versions.find(session->objects[i].SerializeAsString());
+      if ((iter != processed_versions.end()) &&
+          (iter->second >= session->object_versions[i])) {
+        continue;
+      }
+      InvalidationP* invalidation = invalidations->add_invalidation();
+      invalidation->mutable_object_id()->CopyFrom(session->objects[i]);
+      invalidation->set_is_known_version(true);
+      invalidation->set_version(session->object_versions[i]);
+      if ((config_.payload_size > 0) && !session->omits_payloads) {
+        invalidation->set_payload(payload);
+      }
+      ++num_catch_up_invalidations_sent_;
+    }
+    if (invalidations->invalidation_size() == 0) {
+      return;
+    }
+  }
+  InitHeader(session, session->token, &message);
+  Send(session, message);
+}
+
+void FakeInvalidationServer::PrintServerLoad() {
+  int fleet_size = (config_.fleet_size > 0) ? config_.fleet_size :
+      config_.clients;
+  double scale = static_cast<double>(fleet_size) / config_.clients;
+  double interval_s = config_.load_report_interval_ms / 1000.0;
+  int64 peak_arrivals = 0;
+  int64 num_initializes = 0;
+  for (size_t i = 0; i < arrivals_per_interval_.size(); ++i) {
+    peak_arrivals = max(peak_arrivals, arrivals_per_interval_[i]);
+    num_initializes += initializes_per_interval_[i];
+  }
+  printf("Fleet size:            %8d (%d simulated clients)\n", fleet_size,
+         config_.clients);
+  printf("Messages received:     %8.0f (%.0f during the outage)\n",
+         num_messages_received_ * scale, num_messages_dropped_ * scale);
+  printf("Token requests:        %8.0f\n", num_initializes * scale);
+  printf("Catch-up:              %8.0f invalidate-alls, %.0f invalidations\n",
+         num_invalidate_alls_sent_ * scale,
+         num_catch_up_invalidations_sent_ * scale);
+  printf("Server QPS:            %8.1f mean, %.1f peak over %d ms\n",
+         num_messages_received_ * scale * 1000.0 / max(GetElapsedMs(),
+                                                       static_cast<int64>(1)),
+         peak_arrivals * scale / interval_s, config_.load_report_interval_ms);
+  received_sizes_.PrintWithUnit("Received sizes:", "B");
+  sent_sizes_.PrintWithUnit("Sent sizes:", "B");
+  printf("Server QPS over time (all messages, token requests):\n");
+  for (size_t i = 0; i < arrivals_per_interval_.size(); ++i) {
+    printf("  %8.1f s %12.1f %12.1f\n",
+           i * interval_s, arrivals_per_interval_[i] * scale / interval_s,
+           initializes_per_interval_[i] * scale / interval_s);
+  }
+}
+
+void FakeInvalidationServer::SendPeriodicMessages(
+    int interval_ms,
+    void (FakeInvalidationServer::*add_to_message)(
+        ClientSession*, ServerToClientMessage*)) {
+  if (interval_ms <= 0) {
+    return;
+  }
+  // Client i gets its message in the tick in which the time, modulo the
+  // interval, passes i / clients of the interval.
+  int64 now_ms = InvalidationClientUtil::GetCurrentTimeMs(scheduler_);
+  int64 phase_end = now_ms % interval_ms;
+  int64 phase_begin = phase_end - config_.tick_ms;
+  for (size_t i = 0; i < sessions_.size(); ++i) {
+    int64 client_phase = static_cast<int64>(interval_ms) * i /
+        sessions_.size();
+    if ((client_phase <= phase_begin) || (client_phase > phase_end) ||
+        sessions_[i]->token.empty()) {
+      continue;
+    }
+    ServerToClientMessage message;
+    (this->*add_to_message)(sessions_[i], &message);
+    InitHeader(sessions_[i], sessions_[i]->token, &message);
+    Send(sessions_[i], message);
+  }
+}
+
+LoadTest::LoadTest(const LoadConfig& config)
+    : config_(config), server_(config, &scheduler_) {
+  scheduler_.StartScheduler();
+  for (int i = 0; i < config.clients; ++i) {
+    vector<ObjectIdP> object_protos;
+    vector<ObjectId> objects;
+    for (int j = 0; j < config.objects_per_client; ++j) {
+      ObjectIdP object_id;
+      object_id.set_source(ObjectSource_Type_TEST);
+      object_id.set_name(StringPrintf("client-%d/object-%d", i, j));
+      object_protos.push_back(object_id);
+      ObjectId converted;
+      ProtoConverter::ConvertFromObjectIdProto(object_id, &converted);
+      objects.push_back(converted);
+    }
+    channels_.push_back(new LoadNetworkChannel(
+        i, &scheduler_, TimeDelta::FromMilliseconds(config.network_delay_ms),
+        &server_));
+    int client_index = server_.AddClient(channels_.back(), object_protos);
+    InvalidationClientImpl::Config client_config = config.client_config;
+    if (config.provision_tokens) {
+      InvalidationClientImpl::SerializeProvisionedState(
+          server_.ProvisionToken(client_index),
+          &client_config.provisioned_state);
+    }
+    resources_.push_back(
+        new LoadClientResources(&logger_, &scheduler_, channels_.back()));
+    listeners_.push_back(new LoadListener(objects, &server_));
+    resources_.back()->Start();
+    clients_.push_back(new InvalidationClientImpl(
+        resources_.back(), ClientType_Type_INTERNAL,
+        StringPrintf("load-client-%d", i), client_config,
+        "LoadGenerator", listeners_.back()));
+  }
+}
+
+LoadTest::~LoadTest() {
+  // Stop the scheduler while the clients are alive, since it runs the tasks
+  // that are due.
+  for (size_t i = 0; i < clients_.size(); ++i) {
+    clients_[i]->Stop();
+  }
+  scheduler_.StopScheduler();
+  for (size_t i = 0; i < clients_.size(); ++i) {
+    delete clients_[i];
+    delete listeners_[i];
+    delete resources_[i];
+    delete channels_[i];
+  }
+}
+
+void LoadTest::Start() {
+  for (size_t i = 0; i < clients_.size(); ++i) {
+    clients_[i]->Start();
+  }
+  server_.Start();
+}
+
+void LoadTest::RunFor(int duration_ms) {
+  for (int elapsed_ms = 0; elapsed_ms < duration_ms;
+       elapsed_ms += config_.tick_ms) {
+    scheduler_.ModifyTime(TimeDelta::FromMilliseconds(config_.tick_ms));
+    scheduler_.RunReadyTasks();
+  }
+}
+
+}  // namespace invalidation
@@ -0,0 +1,657 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Fakes for running many InvalidationClientImpl instances against a fake
+// invalidation server, all on one DeterministicScheduler, as the load
+// generator and the memory footprint benchmark do. The server assigns tokens,
+// acknowledges registrations, tracks each client's registrations to send
+// correct registration summaries, and generates invalidations at a configured
+// rate and payload size. It can also periodically ask the clients for a
+// registration sync (after forgetting their registrations, as a server that
+// lost its state would) and send them ConfigChangeMessages that make them
+// quiet for a while. To study the load the clients put on the server, it
+// records the messages it receives over time and their sizes, and can go
+// down for a while and come back without the client tokens, so that the
+// clients reconnect all at once.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_TEST_FAKE_INVALIDATION_SERVER_H_
+#define GOOGLE_CACHEINVALIDATION_V2_TEST_FAKE_INVALIDATION_SERVER_H_
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/random.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/constants.h"
+#include "google/cacheinvalidation/v2/invalidation-client-impl.h"
+#include "google/cacheinvalidation/v2/invalidation-client-util.h"
+#include "google/cacheinvalidation/v2/invalidation-listener.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/sha1-digest-function.h"
+#include "google/cacheinvalidation/v2/simple-registration-store.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+#include "google/cacheinvalidation/v2/types.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::max;
+using INVALIDATION_STL_NAMESPACE::sort;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Parameters of a load test. */
+struct LoadConfig {
+  LoadConfig() : clients(10),
+                 objects_per_client(100),
+                 invalidations_per_second(100),
+                 payload_size(0),
+                 network_delay_ms(50),
+                 registration_sync_interval_ms(0),
+                 quiet_period_interval_ms(0),
+                 quiet_period_ms(5000),
+                 duration_ms(60000),
+                 tick_ms(10),
+                 fleet_size(0),
+                 outage_start_ms(0),
+                 outage_duration_ms(0),
+                 load_report_interval_ms(1000),
+                 provision_tokens(false) {}
+
+  /* Number of clients. */
+  int clients;
+
+  /* Number of objects each client registers for. */
+  int objects_per_client;
+
+  /* Total rate of invalidations across all clients. */
+  int invalidations_per_second;
+
+  /* Size of the payload of each invalidation; 0 for none. */
+  int payload_size;
+
+  /* Delay of each message through the network, in either direction. */
+  int network_delay_ms;
+
+  /* Interval at which the server forgets a client's registrations and asks
+   * for a registration sync, spread over the clients; 0 for never.
+   */
+  int registration_sync_interval_ms;
+
+  /* Interval at which the server sends each client a ConfigChangeMessage,
+   * spread over the clients; 0 for never.
+   */
+  int quiet_period_interval_ms;
+
+  /* Delay before the next message given in those ConfigChangeMessages. */
+  int quiet_period_ms;
+
+  /* Simulated duration of the test, after the clients have started. */
+  int duration_ms;
+
+  /* Step by which the simulated time advances. */
+  int tick_ms;
+
+  /* Number of clients of the fleet that the simulated clients stand for, by
+   * which the server load is scaled when printed; 0 for clients. The clients
+   * are independent of each other, so the load scales with their number,
+   * provided invalidations_per_second is scaled down likewise.
+   */
+  int fleet_size;
+
+  /* If outage_duration_ms is positive, the server drops all messages from
+   * outage_start_ms after the start for outage_duration_ms, and then comes
+   * back without the client tokens and registrations, as a restarted server
+   * would, so that every client acquires a new token and resyncs.
+   */
+  int outage_start_ms;
+  int outage_duration_ms;
+
+  /* Interval over which the server load is reported over time. */
+  int load_report_interval_ms;
+
+  /* Whether each client is handed a token acquired from the server on its
+   * behalf (see InvalidationClientImpl::Config::provisioned_state) instead of
+   * acquiring one itself.
+   */
+  bool provision_tokens;
+
+  /* Configuration of every client. */
+  InvalidationClientImpl::Config client_config;
+};
+
+class FakeInvalidationServer;
+
+/* Network channel between one client and the fake server, delaying messages
+ * in both directions by the configured network delay.
+ */
+class LoadNetworkChannel : public NetworkChannel {
+ public:
+  LoadNetworkChannel(int client_index, Scheduler* scheduler,
+                     TimeDelta network_delay, FakeInvalidationServer* server)
+      : client_index_(client_index), scheduler_(scheduler),
+        network_delay_(network_delay), server_(server) {}
+
+  virtual void SendMessage(const string& outgoing_message);
+
+  virtual void SetMessageReceiver(MessageCallback* incoming_receiver) {
+    message_receiver_.reset(incoming_receiver);
+  }
+
+  virtual void SetMessageBufferReceiver(
+      MessageBufferCallback* incoming_receiver) {
+    buffer_receiver_.reset(incoming_receiver);
+  }
+
+  /* The network is always connected, so the receivers are never called. */
+  virtual void AddNetworkStatusReceiver(
+      NetworkStatusCallback* network_status_receiver) {
+    delete network_status_receiver;
+  }
+
+  /* Delivers message to the client after the network delay. */
+  void SendToClient(const string& message) {
+    scheduler_->Schedule(network_delay_, NewPermanentCallback(
+        this, &LoadNetworkChannel::Deliver, message));
+  }
+
+ private:
+  void Deliver(string message) {
+    if (buffer_receiver_.get() != NULL) {
+      buffer_receiver_->Run(&message);
+    } else if (message_receiver_.get() != NULL) {
+      message_receiver_->Run(message);
+    }
+  }
+
+  int client_index_;
+  Scheduler* scheduler_;
+  TimeDelta network_delay_;
+  FakeInvalidationServer* server_;
+  scoped_ptr<MessageCallback> message_receiver_;
+  scoped_ptr<MessageBufferCallback> buffer_receiver_;
+};
+
+/* Resources of one client. The schedulers are shared by all the clients. */
+class LoadClientResources : public SystemResources {
+ public:
+  LoadClientResources(Logger* logger, Scheduler* scheduler,
+                      NetworkChannel* network)
+      : logger_(logger), scheduler_(scheduler), network_(network),
+        started_(false) {}
+
+  virtual void Start() { started_ = true; }
+  virtual void Stop() { started_ = false; }
+  virtual bool IsStarted() const { return started_; }
+  virtual string platform() const { return "LoadGenerator"; }
+  virtual Logger* logger() { return logger_; }
+  virtual Storage* storage() { return &storage_; }
+  virtual NetworkChannel* network() { return network_; }
+  virtual Scheduler* internal_scheduler() { return scheduler_; }
+  virtual Scheduler* listener_scheduler() { return scheduler_; }
+
+ private:
+  Logger* logger_;
+  Scheduler* scheduler_;
+  NetworkChannel* network_;
+  MemoryStorage storage_;
+  bool started_;
+};
+
+/* Samples of one measurement, e.g., latencies in milliseconds. */
+class LatencySamples {
+ public:
+  void Add(int64 latency_ms) {
+    samples_.push_back(latency_ms);
+  }
+
+  int size() const {
+    return static_cast<int>(samples_.size());
+  }
+
+  /* Returns the latency below which a fraction quantile of the samples lie.
+   *
+   * REQUIRES: size() > 0.
+   */
+  int64 GetQuantile(double quantile) {
+    sort(samples_.begin(), samples_.end());
+    int index = static_cast<int>(quantile * (samples_.size() - 1));
+    return samples_[index];
+  }
+
+  /* Prints the count and percentiles of the samples, labeled name. */
+  void Print(const char* name) {
+    PrintWithUnit(name, "ms");
+  }
+
+  /* Like Print, for samples measured in unit. */
+  void PrintWithUnit(const char* name, const char* unit) {
+    if (samples_.empty()) {
+      printf("%-22s none\n", name);
+      return;
+    }
+    printf("%-22s %8d samples, p50 %6lld %s, p90 %6lld %s, p99 %6lld %s, "
+           "max %6lld %s\n", name, size(),
+           static_cast<long long>(GetQuantile(0.5)), unit,
+           static_cast<long long>(GetQuantile(0.9)), unit,
+           static_cast<long long>(GetQuantile(0.99)), unit,
+           static_cast<long long>(GetQuantile(1.0)), unit);
+  }
+
+ private:
+  vector<int64> samples_;
+};
+
+/* Fake server implementing the ServerToClientMessage side of the protocol for
+ * the clients of a load test.
+ */
+class FakeInvalidationServer {
+ public:
+  FakeInvalidationServer(const LoadConfig& config, Scheduler* scheduler)
+      : config_(config), scheduler_(scheduler), random_(0),
+        start_time_(scheduler->GetCurrentTime()), has_restarted_(false),
+        next_version_(1), pending_invalidations_(0.0),
+        num_invalidations_sent_(0), num_messages_received_(0),
+        num_messages_dropped_(0), num_invalidate_alls_sent_(0),
+        num_catch_up_invalidations_sent_(0) {}
+
+  ~FakeInvalidationServer() {
+    for (size_t i = 0; i < sessions_.size(); ++i) {
+      delete sessions_[i];
+    }
+  }
+
+  /* Adds a client that will register for objects and returns its index. */
+  int AddClient(LoadNetworkChannel* channel,
+                const vector<ObjectIdP>& objects) {
+    ClientSession* session = new ClientSession(&digest_fn_);
+    session->channel = channel;
+    session->objects = objects;
+    session->object_versions.assign(objects.size(), 0);
+    sessions_.push_back(session);
+    return static_cast<int>(sessions_.size()) - 1;
+  }
+
+  /* Assigns a token to the client with index client_index without an
+   * initialize message, as for a daemon that acquires tokens for short-lived
+   * clients, and returns it.
+   */
+  string ProvisionToken(int client_index) {
+    ClientSession* session = sessions_[client_index];
+    session->token = StringPrintf("token-%d", client_index);
+    return session->token;
+  }
+
+  /* Starts generating invalidations and the scripted events. */
+  void Start() {
+    start_time_ = scheduler_->GetCurrentTime();
+    scheduler_->Schedule(TimeDelta::FromMilliseconds(config_.tick_ms),
+        NewPermanentCallback(this, &FakeInvalidationServer::Tick));
+  }
+
+  /* Handles message from the client with index client_index. */
+  void HandleClientMessage(int client_index, string message);
+
+  /* Notes that the client received the invalidation with version. */
+  void RecordDelivery(int64 version) {
+    map<int64, Time>::iterator iter = send_times_.find(version);
+    if (iter != send_times_.end()) {
+      delivery_latencies_.Add(
+          (scheduler_->GetCurrentTime() - iter->second).InMilliseconds());
+    }
+  }
+
+  /* Prints the measurements of the test. */
+  void PrintResults(int64 cpu_ns) {
+    printf("Invalidations sent:    %8lld\n",
+           static_cast<long long>(num_invalidations_sent_));
+    printf("Messages received:     %8lld\n",
+           static_cast<long long>(num_messages_received_));
+    delivery_latencies_.Print("Delivery latency:");
+    ack_latencies_.Print("Acknowledgement latency:");
+    if (delivery_latencies_.size() > 0) {
+      printf("Throughput:            %8.1f invalidations/s (simulated)\n",
+             delivery_latencies_.size() * 1000.0 / config_.duration_ms);
+      printf("CPU per invalidation:  %8lld ns\n",
+             static_cast<long long>(cpu_ns / delivery_latencies_.size()));
+    }
+  }
+
+  /* Prints the load that the clients put on the server: the rate of the
+   * messages received, overall and over time, the rate of token requests
+   * (reconnects) and the sizes of the messages, with the rates scaled to
+   * LoadConfig::fleet_size.
+   */
+  void PrintServerLoad();
+
+ private:
+  /* What the server knows about one client. */
+  struct ClientSession {
+    explicit ClientSession(DigestFunction* digest_fn)
+        : channel(NULL), registrations(digest_fn), is_forgotten(false),
+          omits_payloads(false), front_codes_names(false) {}
+
+    LoadNetworkChannel* channel;
+
+    /* The client token, once assigned. */
+    string token;
+
+    /* The objects the client registers for. */
+    vector<ObjectIdP> objects;
+
+    /* The latest version of each of objects, or 0 if it never changed. The
+     * server keeps these when it forgets the client, as a real backend keeps
+     * its data.
+     */
+    vector<int64> object_versions;
+
+    /* The objects the server has the client registered for. */
+    SimpleRegistrationStore registrations;
+
+    /* Whether the server forgot the client in a restart, and so asks it for
+     * a registration sync once it has a new token.
+     */
+    bool is_forgotten;
+
+    /* Whether the client asked for invalidations without payloads. */
+    bool omits_payloads;
+
+    /* Whether the client offered to front-code object names, which the
+     * server then accepts.
+     */
+    bool front_codes_names;
+  };
+
+  /* Generates the invalidations due this tick and runs the scripted events,
+   * then schedules the next tick.
+   */
+  void Tick();
+
+  /* Sends invalidations for num_invalidations random objects of random
+   * clients, in one message per client.
+   */
+  void SendInvalidations(int num_invalidations);
+
+  /* Sends session, which the server forgot and which sent init_message to
+   * get a new token, what it may have missed meanwhile: an invalidation for
+   * each of its objects that changed since the versions the client
+   * presented, if it can catch up, or else an invalidate-all.
+   */
+  void SendCatchUp(ClientSession* session,
+                   const InitializeMessage& init_message);
+
+  /* Sends a message to the clients whose turn it is in a cycle of
+   * interval_ms, using add_to_message to fill it in.
+   */
+  void SendPeriodicMessages(int interval_ms,
+                            void (FakeInvalidationServer::*add_to_message)(
+                                ClientSession*, ServerToClientMessage*));
+
+  /* Forgets the registrations of session and asks for a registration sync. */
+  void AddRegistrationSyncRequest(ClientSession* session,
+                                  ServerToClientMessage* message) {
+    session->registrations.RemoveAll(&removed_objects_);
+    message->mutable_registration_sync_request_message();
+  }
+
+  /* Returns the simulated time since the server started. */
+  int64 GetElapsedMs() {
+    return (scheduler_->GetCurrentTime() - start_time_).InMilliseconds();
+  }
+
+  /* Returns whether the server is down (see LoadConfig::outage_start_ms).
+   * Once the outage is over, forgets the clients the first time it is called.
+   */
+  bool IsDown() {
+    int64 elapsed_ms = GetElapsedMs();
+    if ((config_.outage_duration_ms <= 0) ||
+        (elapsed_ms < config_.outage_start_ms)) {
+      return false;
+    }
+    if (elapsed_ms < config_.outage_start_ms + config_.outage_duration_ms) {
+      return true;
+    }
+    if (!has_restarted_) {
+      has_restarted_ = true;
+      ForgetClients();
+    }
+    return false;
+  }
+
+  /* Forgets the tokens and registrations of all the clients. */
+  void ForgetClients() {
+    for (size_t i = 0; i < sessions_.size(); ++i) {
+      sessions_[i]->token.clear();
+      sessions_[i]->registrations.RemoveAll(&removed_objects_);
+      sessions_[i]->is_forgotten = true;
+    }
+  }
+
+  /* Counts a message of size bytes received now, in the interval of the
+   * load report it falls in.
+   */
+  void RecordArrival(size_t size, bool is_initialize) {
+    received_sizes_.Add(size);
+    size_t interval = static_cast<size_t>(
+        GetElapsedMs() / config_.load_report_interval_ms);
+    if (arrivals_per_interval_.size() <= interval) {
+      arrivals_per_interval_.resize(interval + 1);
+      initializes_per_interval_.resize(interval + 1);
+    }
+    ++arrivals_per_interval_[interval];
+    if (is_initialize) {
+      ++initializes_per_interval_[interval];
+    }
+  }
+
+  /* Asks the client of session not to send for the quiet period. */
+  void AddConfigChange(ClientSession* session,
+                       ServerToClientMessage* message) {
+    message->mutable_config_change_message()->set_next_message_delay_ms(
+        config_.quiet_period_ms);
+  }
+
+  /* Initializes the header of message for session, with token as the client
+   * token.
+   */
+  void InitHeader(ClientSession* session, const string& token,
+                  ServerToClientMessage* message) {
+    ServerHeader* header = message->mutable_header();
+    Version* version = header->mutable_protocol_version()->mutable_version();
+    version->set_major_version(Constants::kProtocolMajorVersion);
+    version->set_minor_version(Constants::kProtocolMinorVersion);
+    header->set_client_token(token);
+    header->set_server_time_ms(
+        InvalidationClientUtil::GetCurrentTimeMs(scheduler_));
+    RegistrationSummary* summary = header->mutable_registration_summary();
+    summary->set_num_registrations(session->registrations.size());
+    summary->set_registration_digest(session->registrations.GetDigest());
+    if (session->front_codes_names) {
+      header->set_accepted_name_encoding(
+          InitializeMessage_NameEncoding_FRONT_CODED);
+    }
+  }
+
+  /* Returns a random index in [0, size). */
+  int RandomIndex(size_t size) {
+    int index = static_cast<int>(random_.RandDouble() * size);
+    return index < static_cast<int>(size) ? index : static_cast<int>(size) - 1;
+  }
+
+  /* Sends message to the client of session. */
+  void Send(ClientSession* session, const ServerToClientMessage& message) {
+    message.SerializeToString(&outgoing_message_);
+    sent_sizes_.Add(outgoing_message_.size());
+    session->channel->SendToClient(outgoing_message_);
+  }
+
+  LoadConfig config_;
+  Scheduler* scheduler_;
+  Random random_;
+  Sha1DigestFunction digest_fn_;
+  vector<ClientSession*> sessions_;
+
+  /* Time at which the server started. */
+  Time start_time_;
+
+  /* Whether the server has come back from its outage. */
+  bool has_restarted_;
+
+  /* Version of the next invalidation; versions are unique across clients. */
+  int64 next_version_;
+
+  /* Invalidations owed by the rate but not yet sent. */
+  double pending_invalidations_;
+
+  /* Send times of the invalidations not yet acknowledged, by version. */
+  map<int64, Time> send_times_;
+
+  LatencySamples delivery_latencies_;
+  LatencySamples ack_latencies_;
+  int64 num_invalidations_sent_;
+  int64 num_messages_received_;
+
+  /* Messages received during the outage. */
+  int64 num_messages_dropped_;
+
+  /* Invalidate-alls, and invalidations sent instead to clients catching up,
+   * after the server forgot the clients.
+   */
+  int64 num_invalidate_alls_sent_;
+  int64 num_catch_up_invalidations_sent_;
+
+  /* Messages, and those with an initialize message, received in each
+   * interval of the load report.
+   */
+  vector<int64> arrivals_per_interval_;
+  vector<int64> initializes_per_interval_;
+
+  /* Sizes in bytes of the messages received and sent. */
+  LatencySamples received_sizes_;
+  LatencySamples sent_sizes_;
+
+  /* Scratch space reused across messages. */
+  ClientToServerMessage incoming_message_;
+  string outgoing_message_;
+  vector<ObjectIdP> removed_objects_;
+};
+
+/* Listener that registers for its objects once ready, acknowledges every
+ * event, and reports deliveries to the server.
+ */
+class LoadListener : public InvalidationListener {
+ public:
+  LoadListener(const vector<ObjectId>& objects,
+               FakeInvalidationServer* server)
+      : objects_(objects), server_(server) {}
+
+  virtual void Ready(InvalidationClient* client) {
+    if (!objects_.empty()) {
+      client->Register(objects_);
+    }
+  }
+
+  virtual void Invalidate(InvalidationClient* client,
+                          const Invalidation& invalidation,
+                          const AckHandle& ack_handle) {
+    server_->RecordDelivery(invalidation.version());
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InvalidateUnknownVersion(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        const AckHandle& ack_handle) {
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InvalidateAll(InvalidationClient* client,
+                             const AckHandle& ack_handle) {
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InformRegistrationStatus(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        RegistrationState reg_state) {}
+
+  virtual void InformRegistrationFailure(InvalidationClient* client,
+                                         const ObjectId& object_id,
+                                         bool is_transient,
+                                         const string& error_message) {}
+
+  virtual void ReissueRegistrations(InvalidationClient* client,
+                                    const string& prefix,
+                                    int prefix_length) {
+    if (!objects_.empty()) {
+      client->Register(objects_);
+    }
+  }
+
+  virtual void InformError(InvalidationClient* client,
+                           const ErrorInfo& error_info) {}
+
+ private:
+  vector<ObjectId> objects_;
+  FakeInvalidationServer* server_;
+};
+
+/* A fleet of clients, each with its own listener, resources and channel,
+ * and the fake server they talk to, as described by a LoadConfig.
+ */
+class LoadTest {
+ public:
+  /* Creates the server and the clients, without starting them. */
+  explicit LoadTest(const LoadConfig& config);
+
+  /* Stops the clients and deletes them. */
+  ~LoadTest();
+
+  /* Starts the clients and the server. */
+  void Start();
+
+  /* Advances the simulated time by duration_ms in steps of the configured
+   * tick, running the tasks that become due.
+   */
+  void RunFor(int duration_ms);
+
+  /* Runs task on the internal thread of the clients, now. */
+  void RunOnInternalThread(Closure* task) {
+    scheduler_.Schedule(Scheduler::NoDelay(), task);
+    scheduler_.RunReadyTasks();
+  }
+
+  FakeInvalidationServer* server() { return &server_; }
+
+  const vector<InvalidationClientImpl*>& clients() const { return clients_; }
+
+ private:
+  LoadConfig config_;
+  NullLogger logger_;
+  DeterministicScheduler scheduler_;
+  FakeInvalidationServer server_;
+  vector<LoadNetworkChannel*> channels_;
+  vector<LoadClientResources*> resources_;
+  vector<LoadListener*> listeners_;
+  vector<InvalidationClientImpl*> clients_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_TEST_FAKE_INVALIDATION_SERVER_H_
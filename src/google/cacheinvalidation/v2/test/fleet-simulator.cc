@@ -0,0 +1,193 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Fleet simulator for planning the capacity of the server: runs a sample of
+// real InvalidationClientImpl instances, with the client configuration given
+// by the flags, against the fake invalidation server of
+// fake-invalidation-server.h in simulated time, and prints the load they put
+// on the server, scaled to the size of the fleet: the QPS over time, the
+// token requests and the message sizes. With an outage, the server drops all
+// messages for a while and then comes back without the client tokens, which
+// shows the shape of the reconnect storm the settings cause.
+//
+// Usage: fleet-simulator [--flag=value ...], with the flags of LoadConfig and
+// of the client configuration below, e.g. --clients=1000
+// --fleet_size=10000000 --heartbeat_interval_ms=600000
+// --outage_start_ms=60000 --outage_duration_ms=30000
+// --rate_limits=1000:1,60000:6.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/test/fake-invalidation-server.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Sets limits to the rate limits in value, a comma-separated list of
+ * window_ms:count pairs, and returns whether it is well formed.
+ */
+static bool ParseRateLimits(const char* value, vector<RateLimit>* limits) {
+  limits->clear();
+  while (*value != '\0') {
+    int window_ms, count, length;
+    if ((sscanf(value, "%d:%d%n", &window_ms, &count, &length) != 2) ||
+        (window_ms <= 0) || (count <= 0)) {
+      return false;
+    }
+    limits->push_back(
+        RateLimit(TimeDelta::FromMilliseconds(window_ms), count));
+    value += length;
+    if (*value == ',') {
+      ++value;
+    }
+  }
+  return true;
+}
+
+/* Sets the field of config named by flag ("--name=value") and returns
+ * whether there is such a field.
+ */
+static bool ParseFlag(const char* flag, LoadConfig* config) {
+  InvalidationClientImpl::Config* client_config = &config->client_config;
+  ProtocolHandler::Config* protocol_config =
+      &client_config->protocol_handler_config;
+  struct IntFlag {
+    const char* name;
+    int* value;
+  };
+  IntFlag int_flags[] = {
+    { "clients", &config->clients },
+    { "fleet_size", &config->fleet_size },
+    { "objects_per_client", &config->objects_per_client },
+    { "invalidations_per_second", &config->invalidations_per_second },
+    { "payload_size", &config->payload_size },
+    { "network_delay_ms", &config->network_delay_ms },
+    { "registration_sync_interval_ms",
+      &config->registration_sync_interval_ms },
+    { "quiet_period_interval_ms", &config->quiet_period_interval_ms },
+    { "quiet_period_ms", &config->quiet_period_ms },
+    { "outage_start_ms", &config->outage_start_ms },
+    { "outage_duration_ms", &config->outage_duration_ms },
+    { "load_report_interval_ms", &config->load_report_interval_ms },
+    { "duration_ms", &config->duration_ms },
+    { "tick_ms", &config->tick_ms },
+    { "max_exponential_backoff_factor",
+      &client_config->max_exponential_backoff_factor },
+    { "max_operations_per_message",
+      &protocol_config->max_operations_per_message },
+    { "acked_version_cache_size", &client_config->acked_version_cache_size },
+    { "max_pending_registrations_per_source",
+      &protocol_config->max_pending_registrations_per_source },
+  };
+  struct DelayFlag {
+    const char* name;
+    TimeDelta* value;
+  };
+  DelayFlag delay_flags[] = {
+    { "heartbeat_interval_ms", &client_config->heartbeat_interval },
+    { "network_timeout_delay_ms", &client_config->network_timeout_delay },
+    { "perf_counter_delay_ms", &client_config->perf_counter_delay },
+    { "batching_delay_ms", &protocol_config->batching_delay },
+    { "min_batching_delay_ms", &protocol_config->min_batching_delay },
+  };
+  struct BoolFlag {
+    const char* name;
+    bool* value;
+  };
+  BoolFlag bool_flags[] = {
+    { "provision_tokens", &config->provision_tokens },
+    { "suppress_redundant_heartbeats",
+      &client_config->suppress_redundant_heartbeats },
+    { "decorrelated_token_backoff",
+      &client_config->decorrelated_token_backoff },
+    { "catch_up_after_token_loss",
+      &client_config->catch_up_after_token_loss },
+    { "adaptive_batching", &protocol_config->adaptive_batching },
+    { "use_token_buckets", &protocol_config->use_token_buckets },
+    { "omit_payloads", &protocol_config->omit_payloads },
+    { "front_code_object_names",
+      &protocol_config->front_code_object_names },
+    { "fair_queue_registrations",
+      &protocol_config->fair_queue_registrations },
+  };
+  for (size_t i = 0; i < sizeof(int_flags) / sizeof(int_flags[0]); ++i) {
+    string prefix = StringPrintf("--%s=", int_flags[i].name);
+    if (strncmp(flag, prefix.c_str(), prefix.size()) == 0) {
+      return sscanf(flag + prefix.size(), "%d", int_flags[i].value) == 1;
+    }
+  }
+  for (size_t i = 0; i < sizeof(delay_flags) / sizeof(delay_flags[0]); ++i) {
+    string prefix = StringPrintf("--%s=", delay_flags[i].name);
+    int delay_ms;
+    if (strncmp(flag, prefix.c_str(), prefix.size()) == 0) {
+      if (sscanf(flag + prefix.size(), "%d", &delay_ms) != 1) {
+        return false;
+      }
+      *delay_flags[i].value = TimeDelta::FromMilliseconds(delay_ms);
+      return true;
+    }
+  }
+  for (size_t i = 0; i < sizeof(bool_flags) / sizeof(bool_flags[0]); ++i) {
+    string prefix = StringPrintf("--%s=", bool_flags[i].name);
+    int value;
+    if (strncmp(flag, prefix.c_str(), prefix.size()) == 0) {
+      if (sscanf(flag + prefix.size(), "%d", &value) != 1) {
+        return false;
+      }
+      *bool_flags[i].value = (value != 0);
+      return true;
+    }
+  }
+  const char kRateLimitsPrefix[] = "--rate_limits=";
+  if (strncmp(flag, kRateLimitsPrefix, strlen(kRateLimitsPrefix)) == 0) {
+    return ParseRateLimits(flag + strlen(kRateLimitsPrefix),
+                           &protocol_config->rate_limits);
+  }
+  return false;
+}
+
+/* Runs the fleet described by config and prints the load on the server. */
+static void RunSimulation(const LoadConfig& config) {
+  LoadTest load_test(config);
+  load_test.Start();
+  load_test.RunFor(config.duration_ms);
+  load_test.server()->PrintServerLoad();
+}
+
+}  // namespace invalidation
+
+int main(int argc, char** argv) {
+  invalidation::LoadConfig config;
+  for (int i = 1; i < argc; ++i) {
+    if (!invalidation::ParseFlag(argv[i], &config)) {
+      fprintf(stderr, "Unknown or malformed flag: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if ((config.clients <= 0) || (config.tick_ms <= 0) ||
+      (config.load_report_interval_ms <= 0)) {
+    fprintf(stderr, "clients, tick_ms and load_report_interval_ms must be "
+            "positive\n");
+    return 1;
+  }
+  invalidation::RunSimulation(config);
+  return 0;
+}
@@ -0,0 +1,118 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the channel shared through a host daemon.
+
+#include <unistd.h>
+
+#include <string>
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/host-channel.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+
+class HostChannelTest : public testing::Test {
+ public:
+  void SetUp() {
+    scheduler_.StartScheduler();
+    config_.directory = "/tmp";
+    config_.ring_capacity = 1 << 12;
+    client_name_ = StringPrintf("host-channel_test.%d",
+                                static_cast<int>(getpid()));
+  }
+
+  void TearDown() {
+    scheduler_.StopScheduler();
+    unlink(HostChannelDaemon::GetRingPath(
+        config_.directory, client_name_, true).c_str());
+    unlink(HostChannelDaemon::GetRingPath(
+        config_.directory, client_name_, false).c_str());
+  }
+
+  /* Creates the client channel of client_name_. */
+  HostChannelClient* NewClient() {
+    return new HostChannelClient(config_.directory, client_name_,
+                                 &scheduler_, &logger_, config_.poll_interval);
+  }
+
+  /* Advances the time by duration, one poll interval at a time, running the
+   * tasks that become due.
+   */
+  void RunFor(TimeDelta duration) {
+    for (TimeDelta elapsed; elapsed < duration;
+         elapsed += config_.poll_interval) {
+      scheduler_.ModifyTime(config_.poll_interval);
+      scheduler_.RunReadyTasks();
+    }
+  }
+
+  /* Returns a serialized initialize message with nonce. */
+  static string MakeClientMessage(const string& nonce) {
+    ClientToServerMessage message;
+    message.mutable_initialize_message()->set_nonce(nonce);
+    string serialized;
+    message.SerializeToString(&serialized);
+    return serialized;
+  }
+
+  NullLogger logger_;
+  DeterministicScheduler scheduler_;
+  ScriptedNetworkChannel network_;
+  HostChannelDaemon::Config config_;
+  string client_name_;
+};
+
+/* Checks that a client created before the daemon adds it opens its rings once
+ * added, and then reaches the network.
+ */
+TEST_F(HostChannelTest, OpensRingsOnceAdded) {
+  HostChannelDaemon daemon(config_, &network_, &scheduler_, &logger_);
+  scoped_ptr<HostChannelClient> client(NewClient());
+  EXPECT_FALSE(client->IsOpen());
+
+  ASSERT_TRUE(daemon.AddClient(client_name_));
+  RunFor(config_.poll_interval * 2);
+  ASSERT_TRUE(client->IsOpen());
+
+  client->SendMessage(MakeClientMessage("nonce"));
+  RunFor(config_.multiplexer_batching_delay * 2);
+  EXPECT_EQ(1, network_.sent_messages.size());
+}
+
+/* Checks that the channels stop polling when deleted, while the scheduler
+ * keeps running.
+ */
+TEST_F(HostChannelTest, StopsPollingWhenDeleted) {
+  scoped_ptr<HostChannelDaemon> daemon(
+      new HostChannelDaemon(config_, &network_, &scheduler_, &logger_));
+  ASSERT_TRUE(daemon->AddClient(client_name_));
+  scoped_ptr<HostChannelClient> client(NewClient());
+  RunFor(config_.poll_interval * 2);
+
+  client.reset();
+  daemon.reset();
+  RunFor(config_.poll_interval * 4);
+  EXPECT_TRUE(network_.sent_messages.empty());
+}
+
+}  // namespace invalidation
@@ -0,0 +1,328 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks the stages of the inbound path of the Ticl for an invalidation
+// message, as ProtocolHandler and InvalidationClientImpl run them:
+//
+//   parse     ServerToClientMessage::ParseFromString, into a reused message
+//   validate  TiclMessageValidator::IsValid
+//   header    ServerMessageHeader construction
+//   convert   per invalidation, the ack handle serialization and the
+//             conversion by ProtoConverter, as in HandleInvalidations
+//   dispatch  CheckingInvalidationListener::TakeInvalidationBatch, which
+//             schedules the upcall
+//   upcall    the scheduled upcall, into a listener that does nothing
+//
+// The schedulers are DeterministicSchedulers, so the measurements are the CPU
+// cost of the client alone. Each stage is timed around every message, less
+// the cost of reading the clock, and the heap allocations in it are counted.
+//
+// Prints one line per batch size (invalidations per message), payload size
+// and stage with the time and allocations per message.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/checking-invalidation-listener.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/constants.h"
+#include "google/cacheinvalidation/v2/protocol-handler.h"
+#include "google/cacheinvalidation/v2/proto-converter.h"
+#include "google/cacheinvalidation/v2/statistics.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+#include "google/cacheinvalidation/v2/ticl-message-validator.h"
+
+/* Number of heap allocations so far. The benchmark is single-threaded. */
+static int64 num_allocations = 0;
+
+void* operator new(size_t size) throw(std::bad_alloc) {
+  ++num_allocations;
+  void* result = malloc(size == 0 ? 1 : size);
+  if (result == NULL) {
+    throw std::bad_alloc();
+  }
+  return result;
+}
+
+void operator delete(void* ptr) throw() {
+  free(ptr);
+}
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+using INVALIDATION_STL_NAMESPACE::max;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Listener that ignores all upcalls. */
+class NullListener : public InvalidationListener {
+ public:
+  virtual void Ready(InvalidationClient* client) {}
+
+  virtual void Invalidate(InvalidationClient* client,
+                          const Invalidation& invalidation,
+                          const AckHandle& ack_handle) {}
+
+  virtual void InvalidateUnknownVersion(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        const AckHandle& ack_handle) {}
+
+  virtual void InvalidateAll(InvalidationClient* client,
+                             const AckHandle& ack_handle) {}
+
+  virtual void InformRegistrationStatus(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        RegistrationState reg_state) {}
+
+  virtual void InformRegistrationFailure(InvalidationClient* client,
+                                         const ObjectId& object_id,
+                                         bool is_transient,
+                                         const string& error_message) {}
+
+  virtual void ReissueRegistrations(InvalidationClient* client,
+                                    const string& prefix, int prefix_len) {}
+
+  virtual void InformError(InvalidationClient* client,
+                           const ErrorInfo& error_info) {}
+};
+
+/* Returns the time of a monotonic clock in nanoseconds. */
+static int64 NowNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (static_cast<int64>(now.tv_sec) * 1000000000LL) + now.tv_nsec;
+}
+
+/* The stages of the inbound path, in order. */
+enum Stage {
+  PARSE,
+  VALIDATE,
+  HEADER,
+  CONVERT,
+  DISPATCH,
+  UPCALL,
+  NUM_STAGES
+};
+
+static const char* kStageNames[] = {
+  "parse",
+  "validate",
+  "header",
+  "convert",
+  "dispatch",
+  "upcall"
+};
+
+class InboundPathBenchmark {
+ public:
+  /* Number of invalidations over all the messages of a run. */
+  static const int kInvalidationsPerRun = 200000;
+
+  InboundPathBenchmark(int batch_size, int payload_size)
+      : batch_size_(batch_size),
+        payload_size_(payload_size),
+        num_messages_(max(kInvalidationsPerRun / batch_size, 10)),
+        validator_(&logger_),
+        listener_(&delegate_, &statistics_, &internal_scheduler_,
+                  &listener_scheduler_, &logger_, 0, false) {
+    internal_scheduler_.StartScheduler();
+    listener_scheduler_.StartScheduler();
+    BuildMessage();
+    for (int i = 0; i < NUM_STAGES; ++i) {
+      stage_ns_[i] = 0;
+      stage_allocations_[i] = 0;
+    }
+  }
+
+  /* Runs all the messages through the stages and prints the results. */
+  void Run() {
+    clock_overhead_ns_ = MeasureClockOverhead();
+    internal_scheduler_.Schedule(Scheduler::NoDelay(), NewPermanentCallback(
+        this, &InboundPathBenchmark::HandleMessages));
+    internal_scheduler_.RunReadyTasks();
+    for (int i = 0; i < NUM_STAGES; ++i) {
+      printf("%5d %7d  %-9s %11.0f ns %9.1f allocs\n", batch_size_,
+             payload_size_, kStageNames[i],
+             static_cast<double>(stage_ns_[i]) / num_messages_,
+             static_cast<double>(stage_allocations_[i]) / num_messages_);
+    }
+  }
+
+ private:
+  /* Builds and serializes an invalidation message of batch_size_
+   * invalidations for known versions, with payloads of payload_size_ bytes.
+   */
+  void BuildMessage() {
+    ServerToClientMessage message;
+    ServerHeader* header = message.mutable_header();
+    Version* version = header->mutable_protocol_version()->mutable_version();
+    version->set_major_version(Constants::kProtocolMajorVersion);
+    version->set_minor_version(Constants::kProtocolMinorVersion);
+    header->set_client_token("benchmark-client-token");
+    header->set_server_time_ms(1000);
+    RegistrationSummary* summary = header->mutable_registration_summary();
+    summary->set_num_registrations(batch_size_);
+    summary->set_registration_digest(string(20, 'd'));
+    string payload(payload_size_, 'p');
+    for (int i = 0; i < batch_size_; ++i) {
+      InvalidationP* invalidation =
+          message.mutable_invalidation_message()->add_invalidation();
+      invalidation->mutable_object_id()->set_source(ObjectSource_Type_TEST);
+      invalidation->mutable_object_id()->set_name(
+          StringPrintf("user/%d/object-%d", i % 1000, i));
+      invalidation->set_is_known_version(true);
+      invalidation->set_version(1000 + i);
+      if (payload_size_ > 0) {
+        invalidation->set_payload(payload);
+      }
+    }
+    CHECK(validator_.IsValid(message)) << "Benchmark message is invalid";
+    message.SerializeToString(&serialized_message_);
+  }
+
+  /* Returns the cost in nanoseconds of reading the clock once, as the stages
+   * are timed.
+   */
+  static int64 MeasureClockOverhead() {
+    const int kNumReads = 100000;
+    int64 start_ns = NowNs();
+    for (int i = 0; i < kNumReads - 1; ++i) {
+      NowNs();
+    }
+    return (NowNs() - start_ns) / kNumReads;
+  }
+
+  /* Ends the current stage, adding its time and allocations to stage, and
+   * starts the next one.
+   */
+  void EndStage(Stage stage) {
+    int64 now_ns = NowNs();
+    stage_ns_[stage] += max(now_ns - stage_start_ns_ - clock_overhead_ns_,
+                            static_cast<int64>(0));
+    stage_allocations_[stage] += num_allocations - stage_start_allocations_;
+    stage_start_allocations_ = num_allocations;
+    stage_start_ns_ = NowNs();
+  }
+
+  /* Runs num_messages_ messages through the stages, on the internal thread. */
+  void HandleMessages() {
+    Time receive_time = internal_scheduler_.GetCurrentTime();
+    vector<pair<Invalidation, AckHandle> > batch;
+    for (int i = 0; i < num_messages_; ++i) {
+      stage_start_allocations_ = num_allocations;
+      stage_start_ns_ = NowNs();
+
+      message_.ParseFromString(serialized_message_);
+      EndStage(PARSE);
+
+      bool is_valid = validator_.IsValid(message_);
+      EndStage(VALIDATE);
+      CHECK(is_valid);
+
+      const ServerHeader& message_header = message_.header();
+      ServerMessageHeader header(
+          message_header.client_token(),
+          message_header.registration_summary(), receive_time, i);
+      EndStage(HEADER);
+
+      RepeatedPtrField<InvalidationP>* invalidations =
+          message_.mutable_invalidation_message()->mutable_invalidation();
+      for (int j = 0; j < invalidations->size(); ++j) {
+        InvalidationP* invalidation = invalidations->Mutable(j);
+        string serialized;
+        SerializeAckHandle(*invalidation, &serialized);
+        batch.push_back(make_pair(Invalidation(), AckHandle(serialized)));
+        ProtoConverter::ConvertFromInvalidationProtoTakingPayload(
+            invalidation, &batch.back().first);
+      }
+      EndStage(CONVERT);
+
+      listener_.TakeInvalidationBatch(NULL, &batch);
+      EndStage(DISPATCH);
+
+      listener_scheduler_.RunReadyTasks();
+      EndStage(UPCALL);
+      batch.clear();
+    }
+  }
+
+  /* Serializes the ack handle of invalidation without its payload, as
+   * InvalidationClientImpl::SerializeAckHandle does.
+   */
+  static void SerializeAckHandle(const InvalidationP& full_invalidation,
+                                 string* serialized) {
+    AckHandleP ack_handle;
+    InvalidationP* invalidation = ack_handle.mutable_invalidation();
+    invalidation->mutable_object_id()->CopyFrom(full_invalidation.object_id());
+    invalidation->set_is_known_version(full_invalidation.is_known_version());
+    invalidation->set_version(full_invalidation.version());
+    ack_handle.SerializeToString(serialized);
+  }
+
+  int batch_size_;
+  int payload_size_;
+  int num_messages_;
+  NullLogger logger_;
+  Statistics statistics_;
+  DeterministicScheduler internal_scheduler_;
+  DeterministicScheduler listener_scheduler_;
+  TiclMessageValidator validator_;
+  NullListener delegate_;
+  CheckingInvalidationListener listener_;
+  string serialized_message_;
+
+  /* Reused across messages, as by the ProtocolHandler. */
+  ServerToClientMessage message_;
+
+  /* Cost of reading the clock, taken off each stage. */
+  int64 clock_overhead_ns_;
+
+  /* Start of the current stage. */
+  int64 stage_start_ns_;
+  int64 stage_start_allocations_;
+
+  /* Totals of each stage over all the messages. */
+  int64 stage_ns_[NUM_STAGES];
+  int64 stage_allocations_[NUM_STAGES];
+};
+
+}  // namespace invalidation
+
+int main(int argc, char** argv) {
+  const int kBatchSizes[] = { 1, 10, 100, 1000 };
+  const int kPayloadSizes[] = { 0, 100, 10000 };
+  printf("batch payload  stage     time/message  allocs/message\n");
+  for (size_t i = 0; i < sizeof(kBatchSizes) / sizeof(kBatchSizes[0]); ++i) {
+    for (size_t j = 0; j < sizeof(kPayloadSizes) / sizeof(kPayloadSizes[0]);
+         ++j) {
+      invalidation::InboundPathBenchmark benchmark(kBatchSizes[i],
+                                                   kPayloadSizes[j]);
+      benchmark.Run();
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,73 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the measurements of the InstrumentedScheduler.
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/instrumented-scheduler.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+
+namespace invalidation {
+
+class InstrumentedSchedulerTest : public testing::Test {
+ public:
+  InstrumentedSchedulerTest() : scheduler_(&delegate_) {}
+
+  void SetUp() {
+    delegate_.StartScheduler();
+  }
+
+  /* A task that takes run_time_ms to run. */
+  void Work(int run_time_ms) {
+    delegate_.ModifyTime(TimeDelta::FromMilliseconds(run_time_ms));
+  }
+
+  int Get(InstrumentedScheduler::Measurement measurement) {
+    return scheduler_.GetMeasurement(measurement);
+  }
+
+  DeterministicScheduler delegate_;
+  InstrumentedScheduler scheduler_;
+};
+
+/* Checks the queue depth, lags and run times of tasks that run late. */
+TEST_F(InstrumentedSchedulerTest, MeasuresTasks) {
+  scheduler_.Schedule(
+      Scheduler::NoDelay(),
+      NewPermanentCallback(this, &InstrumentedSchedulerTest::Work, 30));
+  scheduler_.Schedule(
+      TimeDelta::FromMilliseconds(100),
+      NewPermanentCallback(this, &InstrumentedSchedulerTest::Work, 0));
+  ASSERT_EQ(2, Get(InstrumentedScheduler::QUEUE_DEPTH));
+
+  // The first task runs 250 ms late and takes 30 ms, so the second one runs
+  // 180 ms late.
+  delegate_.ModifyTime(TimeDelta::FromMilliseconds(250));
+  delegate_.RunReadyTasks();
+  ASSERT_EQ(2, Get(InstrumentedScheduler::TASKS_RUN));
+  ASSERT_EQ(0, Get(InstrumentedScheduler::QUEUE_DEPTH));
+  ASSERT_EQ(2, Get(InstrumentedScheduler::MAX_QUEUE_DEPTH));
+  ASSERT_EQ(430, Get(InstrumentedScheduler::TOTAL_LAG_MS));
+  ASSERT_EQ(250, Get(InstrumentedScheduler::MAX_LAG_MS));
+  ASSERT_EQ(30, Get(InstrumentedScheduler::TOTAL_RUN_TIME_MS));
+  ASSERT_EQ(30, Get(InstrumentedScheduler::MAX_RUN_TIME_MS));
+
+  vector<pair<string, int> > measurements;
+  scheduler_.GetNonZeroMeasurements("Internal.", &measurements);
+  ASSERT_EQ(6, static_cast<int>(measurements.size()));
+  ASSERT_EQ("Internal.TASKS_RUN", measurements[0].first);
+}
+
+}  // namespace invalidation
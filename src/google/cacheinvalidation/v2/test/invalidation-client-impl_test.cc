@@ -0,0 +1,281 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the Ticl against messages scripted by the test in place of a server.
+
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/constants.h"
+#include "google/cacheinvalidation/v2/invalidation-client-impl.h"
+#include "google/cacheinvalidation/v2/invalidation-client-util.h"
+#include "google/cacheinvalidation/v2/invalidation-listener.h"
+#include "google/cacheinvalidation/v2/proto-converter.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/sha1-digest-function.h"
+#include "google/cacheinvalidation/v2/simple-registration-store.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/v2/test/fake-invalidation-server.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Listener that records the objects invalidated, and that reissues a
+ * configured set of registrations when asked to.
+ */
+class ReissuingListener : public InvalidationListener {
+ public:
+  explicit ReissuingListener(const vector<ObjectId>& objects)
+      : num_reissue_requests(0), objects_(objects) {}
+
+  virtual void Ready(InvalidationClient* client) {}
+
+  virtual void Invalidate(InvalidationClient* client,
+                          const Invalidation& invalidation,
+                          const AckHandle& ack_handle) {
+    invalidated_names.push_back(invalidation.object_id().name());
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InvalidateUnknownVersion(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        const AckHandle& ack_handle) {
+    invalidated_names.push_back(object_id.name());
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InvalidateAll(InvalidationClient* client,
+                             const AckHandle& ack_handle) {
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InformRegistrationStatus(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        RegistrationState reg_state) {}
+
+  virtual void InformRegistrationFailure(InvalidationClient* client,
+                                         const ObjectId& object_id,
+                                         bool is_transient,
+                                         const string& error_message) {}
+
+  virtual void ReissueRegistrations(InvalidationClient* client,
+                                    const string& prefix,
+                                    int prefix_length) {
+    ++num_reissue_requests;
+    if (!objects_.empty()) {
+      client->Register(objects_);
+    }
+  }
+
+  virtual void InformError(InvalidationClient* client,
+                           const ErrorInfo& error_info) {}
+
+  /* Number of ReissueRegistrations upcalls. */
+  int num_reissue_requests;
+
+  /* Names of the objects invalidated, in order. */
+  vector<string> invalidated_names;
+
+ private:
+  vector<ObjectId> objects_;
+};
+
+/* Completion callback that clears a flag of the test when deleted. */
+class FlaggingCompletionCallback : public CompletionCallback {
+ public:
+  explicit FlaggingCompletionCallback(bool* is_alive) : is_alive_(is_alive) {
+    *is_alive_ = true;
+  }
+
+  virtual ~FlaggingCompletionCallback() {
+    *is_alive_ = false;
+  }
+
+  virtual bool IsRepeatable() const {
+    return true;
+  }
+
+  virtual void Run(Status status) {}
+
+ private:
+  bool* is_alive_;
+};
+
+class InvalidationClientImplTest : public testing::Test {
+ public:
+  virtual void SetUp() {
+    scheduler_.StartScheduler();
+    resources_.reset(
+        new LoadClientResources(&logger_, &scheduler_, &channel_));
+    resources_->Start();
+    config_.use_registration_filter = true;
+  }
+
+  virtual void TearDown() {
+    if (client_.get() != NULL) {
+      client_->Stop();
+    }
+    scheduler_.StopScheduler();
+  }
+
+  /* Returns an object id with name in the test source. */
+  static ObjectIdP MakeObjectId(const string& name) {
+    ObjectIdP object_id;
+    object_id.set_source(ObjectSource_Type_TEST);
+    object_id.set_name(name);
+    return object_id;
+  }
+
+  /* Stores a client token in the storage, as a client that ran before and
+   * stopped would have left it.
+   */
+  void StoreToken(const string& token) {
+    string state_blob;
+    InvalidationClientImpl::SerializeProvisionedState(token, &state_blob);
+    static_cast<MemoryStorage*>(resources_->storage())->values[
+        InvalidationClientImpl::kClientTokenKey] = state_blob;
+  }
+
+  /* Creates and starts a client whose listener reissues objects, and runs
+   * the tasks that are due.
+   */
+  void StartClient(const vector<ObjectIdP>& objects) {
+    vector<ObjectId> converted(objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+      ProtoConverter::ConvertFromObjectIdProto(objects[i], &converted[i]);
+    }
+    listener_.reset(new ReissuingListener(converted));
+    client_.reset(new InvalidationClientImpl(
+        resources_.get(), ClientType_Type_INTERNAL, "client", config_,
+        "InvalidationClientImplTest", listener_.get()));
+    client_->Start();
+    scheduler_.RunReadyTasks();
+  }
+
+  /* Creates a client whose listener reissues nothing, without starting it. */
+  void CreateClient() {
+    listener_.reset(new ReissuingListener(vector<ObjectId>()));
+    client_.reset(new InvalidationClientImpl(
+        resources_.get(), ClientType_Type_INTERNAL, "client", config_,
+        "InvalidationClientImplTest", listener_.get()));
+  }
+
+  /* Initializes the header of message for token, with a registration
+   * summary of registered_objects.
+   */
+  void InitHeader(const string& token,
+                  const vector<ObjectIdP>& registered_objects,
+                  ServerToClientMessage* message) {
+    ServerHeader* header = message->mutable_header();
+    Version* version = header->mutable_protocol_version()->mutable_version();
+    version->set_major_version(Constants::kProtocolMajorVersion);
+    version->set_minor_version(Constants::kProtocolMinorVersion);
+    header->set_client_token(token);
+    header->set_server_time_ms(
+        InvalidationClientUtil::GetCurrentTimeMs(&scheduler_));
+    SimpleRegistrationStore registrations(&digest_fn_);
+    registrations.Add(registered_objects);
+    RegistrationSummary* summary = header->mutable_registration_summary();
+    summary->set_num_registrations(registrations.size());
+    summary->set_registration_digest(registrations.GetDigest());
+  }
+
+  /* Sends the client a message, with token and a summary of
+   * registered_objects, invalidating each of invalidated_objects.
+   */
+  void SendInvalidations(const string& token,
+                         const vector<ObjectIdP>& registered_objects,
+                         const vector<ObjectIdP>& invalidated_objects) {
+    ServerToClientMessage message;
+    InitHeader(token, registered_objects, &message);
+    for (size_t i = 0; i < invalidated_objects.size(); ++i) {
+      InvalidationP* invalidation =
+          message.mutable_invalidation_message()->add_invalidation();
+      invalidation->mutable_object_id()->CopyFrom(invalidated_objects[i]);
+      invalidation->set_is_known_version(true);
+      invalidation->set_version(i + 1);
+    }
+    channel_.Deliver(message);
+    scheduler_.RunReadyTasks();
+  }
+
+  NullLogger logger_;
+  DeterministicScheduler scheduler_;
+  ScriptedNetworkChannel channel_;
+  Sha1DigestFunction digest_fn_;
+  scoped_ptr<LoadClientResources> resources_;
+  InvalidationClientImpl::Config config_;
+  scoped_ptr<ReissuingListener> listener_;
+  scoped_ptr<InvalidationClientImpl> client_;
+};
+
+/* Tests that a client restarted from a stored token, whose application has
+ * not reissued its registrations yet, issues the invalidations the server
+ * sends for the registrations it still has.
+ */
+TEST_F(InvalidationClientImplTest, IssuesInvalidationsBeforeReissue) {
+  StoreToken("token");
+  StartClient(vector<ObjectIdP>());
+  EXPECT_EQ(1, listener_->num_reissue_requests);
+
+  vector<ObjectIdP> server_objects;
+  server_objects.push_back(MakeObjectId("registered"));
+  SendInvalidations("token", server_objects, server_objects);
+  ASSERT_EQ(1, listener_->invalidated_names.size());
+  EXPECT_EQ("registered", listener_->invalidated_names[0]);
+}
+
+/* Tests that once the reissued registrations agree with the server's, the
+ * invalidations for other objects are acknowledged without upcalls.
+ */
+TEST_F(InvalidationClientImplTest, FiltersInvalidationsOnceInSync) {
+  vector<ObjectIdP> registered_objects;
+  registered_objects.push_back(MakeObjectId("registered"));
+  StoreToken("token");
+  StartClient(registered_objects);
+  EXPECT_EQ(1, listener_->num_reissue_requests);
+
+  vector<ObjectIdP> invalidated_objects;
+  invalidated_objects.push_back(MakeObjectId("unregistered"));
+  invalidated_objects.push_back(MakeObjectId("registered"));
+  SendInvalidations("token", registered_objects, invalidated_objects);
+  ASSERT_EQ(1, listener_->invalidated_names.size());
+  EXPECT_EQ("registered", listener_->invalidated_names[0]);
+}
+
+/* Tests that destroying a client that never started deletes the completion
+ * callbacks of the registrations held until start.
+ */
+TEST_F(InvalidationClientImplTest, DeletesCallbacksHeldUntilStart) {
+  CreateClient();
+  ObjectId object_id;
+  ProtoConverter::ConvertFromObjectIdProto(MakeObjectId("held"), &object_id);
+  bool is_callback_alive;
+  client_->Register(vector<ObjectId>(1, object_id),
+                    new FlaggingCompletionCallback(&is_callback_alive));
+  scheduler_.RunReadyTasks();
+  EXPECT_TRUE(is_callback_alive);
+
+  client_.reset();
+  EXPECT_FALSE(is_callback_alive);
+}
+
+}  // namespace invalidation
@@ -0,0 +1,96 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Load generator that runs many InvalidationClientImpl instances against the
+// fake invalidation server of fake-invalidation-server.h.
+//
+// Time is simulated, so the latencies reported (from the server sending an
+// invalidation to the listener upcall, and to the server receiving the ack)
+// are the ones the protocol causes: network delay, batching and quiet
+// periods. The CPU per invalidation is measured for the whole process, and so
+// includes the fake server.
+//
+// Usage: load-generator [--flag=value ...], with the flags of LoadConfig,
+// e.g. --clients=100 --invalidations_per_second=1000.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/test/fake-invalidation-server.h"
+#include "google/cacheinvalidation/v2/test/stopwatch.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+
+/* Sets the field of config named by flag ("--name=value") and returns
+ * whether there is such a field.
+ */
+static bool ParseFlag(const char* flag, LoadConfig* config) {
+  struct IntFlag {
+    const char* name;
+    int* value;
+  };
+  IntFlag flags[] = {
+    { "clients", &config->clients },
+    { "objects_per_client", &config->objects_per_client },
+    { "invalidations_per_second", &config->invalidations_per_second },
+    { "payload_size", &config->payload_size },
+    { "network_delay_ms", &config->network_delay_ms },
+    { "registration_sync_interval_ms",
+      &config->registration_sync_interval_ms },
+    { "quiet_period_interval_ms", &config->quiet_period_interval_ms },
+    { "quiet_period_ms", &config->quiet_period_ms },
+    { "duration_ms", &config->duration_ms },
+    { "tick_ms", &config->tick_ms },
+  };
+  for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); ++i) {
+    string prefix = StringPrintf("--%s=", flags[i].name);
+    if (strncmp(flag, prefix.c_str(), prefix.size()) == 0) {
+      return sscanf(flag + prefix.size(), "%d", flags[i].value) == 1;
+    }
+  }
+  return false;
+}
+
+/* Runs the load test described by config and prints its results. */
+static void RunLoadTest(const LoadConfig& config) {
+  LoadTest load_test(config);
+  Stopwatch stopwatch;
+  stopwatch.Start();
+  load_test.Start();
+  load_test.RunFor(config.duration_ms);
+  int64 wall_ns, cpu_ns;
+  stopwatch.Stop(&wall_ns, &cpu_ns);
+  load_test.server()->PrintResults(cpu_ns);
+  printf("Wall time:             %8.1f s\n", wall_ns / 1e9);
+}
+
+}  // namespace invalidation
+
+int main(int argc, char** argv) {
+  invalidation::LoadConfig config;
+  for (int i = 1; i < argc; ++i) {
+    if (!invalidation::ParseFlag(argv[i], &config)) {
+      fprintf(stderr, "Unknown or malformed flag: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  invalidation::RunLoadTest(config);
+  return 0;
+}
@@ -0,0 +1,292 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the Storage over a memory-mapped file.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/mapped-file-storage.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+class MappedFileStorageTest : public testing::Test {
+ public:
+  MappedFileStorageTest()
+      : last_status_(Status::SUCCESS, ""), last_batch_is_last_(false),
+        num_completed_(0) {}
+
+  void SetUp() {
+    char path[] = "/tmp/mapped-file-storage-test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_TRUE(fd >= 0);
+    close(fd);
+    path_ = path;
+    scheduler_.StartScheduler();
+    config_.initial_file_size = 256;
+    config_.min_compaction_size = 1024;
+    OpenStorage();
+  }
+
+  void TearDown() {
+    storage_.reset();
+    unlink(path_.c_str());
+  }
+
+  /* (Re)opens the storage over the test file. */
+  void OpenStorage() {
+    storage_.reset();
+    storage_.reset(
+        new MappedFileStorage(path_, config_, &scheduler_, &logger_));
+    ASSERT_TRUE(storage_->IsOpen());
+  }
+
+  void HandleWrite(Status status) {
+    last_status_ = status;
+    ++num_completed_;
+  }
+
+  void HandleRead(StatusStringPair result) {
+    last_status_ = result.first;
+    last_value_ = result.second;
+    ++num_completed_;
+  }
+
+  void HandleDelete(bool success) {
+    last_status_ = Status(success ? Status::SUCCESS : Status::PERMANENT_FAILURE,
+                          "");
+    ++num_completed_;
+  }
+
+  /* Records the keys and values of batch in last_entries_. */
+  void HandleBatch(const KeyValueBatch& batch) {
+    last_status_ = Status(
+        batch.success ? Status::SUCCESS : Status::PERMANENT_FAILURE, "");
+    last_entries_.clear();
+    for (size_t i = 0; i < batch.entries.size(); ++i) {
+      last_entries_.push_back(
+          batch.entries[i].key() + "=" + batch.entries[i].value());
+    }
+    last_batch_is_last_ = batch.is_last;
+    ++num_completed_;
+  }
+
+  /* Reads the next batch of up to max_entries entries from cursor and returns
+   * whether the read succeeded.
+   */
+  bool ReadNext(StorageCursor* cursor, int max_entries) {
+    cursor->ReadNext(max_entries, NewPermanentCallback(
+        this, &MappedFileStorageTest::HandleBatch));
+    return last_status_.IsSuccess();
+  }
+
+  /* Writes value to key and returns whether the write succeeded. */
+  bool Write(const string& key, const string& value) {
+    storage_->WriteKey(key, value, NewPermanentCallback(
+        this, &MappedFileStorageTest::HandleWrite));
+    return last_status_.IsSuccess();
+  }
+
+  /* Returns whether key has a value, setting last_value_ to it if so. */
+  bool Read(const string& key) {
+    storage_->ReadKey(key, NewPermanentCallback(
+        this, &MappedFileStorageTest::HandleRead));
+    return last_status_.IsSuccess();
+  }
+
+  bool Delete(const string& key) {
+    storage_->DeleteKey(key, NewPermanentCallback(
+        this, &MappedFileStorageTest::HandleDelete));
+    return last_status_.IsSuccess();
+  }
+
+  string path_;
+  MappedFileStorage::Config config_;
+  DeterministicScheduler scheduler_;
+  NullLogger logger_;
+  scoped_ptr<MappedFileStorage> storage_;
+  Status last_status_;
+  string last_value_;
+  vector<string> last_entries_;
+  bool last_batch_is_last_;
+  int num_completed_;
+};
+
+/* Checks that written and deleted keys are found as such, including after the
+ * file is reopened, and that values can be read without a copy.
+ */
+TEST_F(MappedFileStorageTest, WritesAndDeletesPersist) {
+  ASSERT_TRUE(Write("a", "1"));
+  ASSERT_TRUE(Write("b", "2"));
+  ASSERT_TRUE(Write("a", "3"));
+  ASSERT_TRUE(Delete("b"));
+  ASSERT_TRUE(Delete("c"));
+  ASSERT_TRUE(Read("a"));
+  ASSERT_EQ("3", last_value_);
+  ASSERT_FALSE(Read("b"));
+
+  OpenStorage();
+  ASSERT_TRUE(Read("a"));
+  ASSERT_EQ("3", last_value_);
+  ASSERT_FALSE(Read("b"));
+  const char* data;
+  size_t size;
+  ASSERT_TRUE(storage_->ReadKeyView("a", &data, &size));
+  ASSERT_EQ("3", string(data, size));
+  ASSERT_FALSE(storage_->ReadKeyView("b", &data, &size));
+}
+
+/* Checks that a record torn by a crash is ignored, keeping the value it was
+ * to replace, and then overwritten.
+ */
+TEST_F(MappedFileStorageTest, IgnoresTornRecord) {
+  ASSERT_TRUE(Write("a", "old value"));
+  size_t intact_size = storage_->GetDataSizeForTest();
+  ASSERT_TRUE(Write("a", "new value"));
+  storage_.reset();
+
+  // Corrupt the last byte of the value of the second record.
+  int fd = open(path_.c_str(), O_WRONLY);
+  ASSERT_TRUE(fd >= 0);
+  ASSERT_EQ(1, pwrite(fd, "X", 1, 2 * intact_size - 1));
+  close(fd);
+
+  OpenStorage();
+  ASSERT_EQ(intact_size, storage_->GetDataSizeForTest());
+  ASSERT_TRUE(Read("a"));
+  ASSERT_EQ("old value", last_value_);
+  ASSERT_TRUE(Write("b", "value"));
+  OpenStorage();
+  ASSERT_TRUE(Read("a"));
+  ASSERT_EQ("old value", last_value_);
+  ASSERT_TRUE(Read("b"));
+}
+
+/* Checks that the file grows and is compacted as keys are overwritten, keeping
+ * the latest values.
+ */
+TEST_F(MappedFileStorageTest, CompactsFile) {
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(Write(StringPrintf("key%d", i % 4),
+                      StringPrintf("value%d", i)));
+  }
+  ASSERT_TRUE(storage_->GetDataSizeForTest() <
+              static_cast<size_t>(config_.min_compaction_size));
+  OpenStorage();
+  for (int i = 96; i < 100; ++i) {
+    ASSERT_TRUE(Read(StringPrintf("key%d", i % 4)));
+    ASSERT_EQ(StringPrintf("value%d", i), last_value_);
+  }
+}
+
+/* Checks that a write whose record was appended succeeds even if the
+ * compaction it triggers fails, and that a later write compacts the file.
+ */
+TEST_F(MappedFileStorageTest, WriteSucceedsWhenCompactionFails) {
+  // The new file for the compaction cannot be created over a directory.
+  string new_path = path_ + ".tmp";
+  ASSERT_EQ(0, mkdir(new_path.c_str(), 0700));
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(Write("key", StringPrintf("value%d", i)));
+  }
+  ASSERT_TRUE(storage_->GetDataSizeForTest() >=
+              static_cast<size_t>(config_.min_compaction_size));
+  ASSERT_EQ(0, rmdir(new_path.c_str()));
+
+  ASSERT_TRUE(Write("key", "last value"));
+  ASSERT_TRUE(storage_->GetDataSizeForTest() <
+              static_cast<size_t>(config_.min_compaction_size));
+  OpenStorage();
+  ASSERT_TRUE(Read("key"));
+  ASSERT_EQ("last value", last_value_);
+}
+
+/* Checks that batched syncs complete all the writes issued before the sync
+ * task runs.
+ */
+TEST_F(MappedFileStorageTest, BatchesSyncs) {
+  config_.sync_policy = MappedFileStorage::SYNC_BATCHED;
+  OpenStorage();
+  Write("a", "1");
+  Write("b", "2");
+  Delete("a");
+  ASSERT_EQ(0, num_completed_);
+  scheduler_.RunReadyTasks();
+  ASSERT_EQ(3, num_completed_);
+  ASSERT_TRUE(last_status_.IsSuccess());
+  ASSERT_FALSE(Read("a"));
+  ASSERT_TRUE(Read("b"));
+}
+
+/* Checks that a sync task that the scheduler runs after the storage is
+ * destroyed does nothing, the destructor having dropped the writes' callbacks.
+ */
+TEST_F(MappedFileStorageTest, SyncTaskOutlivesStorage) {
+  config_.sync_policy = MappedFileStorage::SYNC_BATCHED;
+  OpenStorage();
+  Write("a", "1");
+  storage_.reset();
+  scheduler_.RunReadyTasks();
+  ASSERT_EQ(0, num_completed_);
+}
+
+/* Checks that a cursor reads the keys with its prefix in order, in batches of
+ * the requested size, and only them.
+ */
+TEST_F(MappedFileStorageTest, CursorReadsBatches) {
+  ASSERT_TRUE(Write("log-1", "a"));
+  ASSERT_TRUE(Write("log-3", "c"));
+  ASSERT_TRUE(Write("log-2", "b"));
+  ASSERT_TRUE(Write("snapshot", "s"));
+  ASSERT_TRUE(Write("log-4", "d"));
+  ASSERT_TRUE(Delete("log-4"));
+
+  scoped_ptr<StorageCursor> cursor(storage_->OpenCursor("log-"));
+  ASSERT_TRUE(ReadNext(cursor.get(), 2));
+  ASSERT_EQ(2, static_cast<int>(last_entries_.size()));
+  ASSERT_EQ("log-1=a", last_entries_[0]);
+  ASSERT_EQ("log-2=b", last_entries_[1]);
+  ASSERT_FALSE(last_batch_is_last_);
+  ASSERT_TRUE(ReadNext(cursor.get(), 2));
+  ASSERT_EQ(1, static_cast<int>(last_entries_.size()));
+  ASSERT_EQ("log-3=c", last_entries_[0]);
+  ASSERT_TRUE(last_batch_is_last_);
+  ASSERT_TRUE(ReadNext(cursor.get(), 2));
+  ASSERT_TRUE(last_entries_.empty());
+  ASSERT_TRUE(last_batch_is_last_);
+
+  // A batch that ends exactly at the last key says so.
+  cursor.reset(storage_->OpenCursor("snap"));
+  ASSERT_TRUE(ReadNext(cursor.get(), 1));
+  ASSERT_EQ(1, static_cast<int>(last_entries_.size()));
+  ASSERT_EQ("snapshot=s", last_entries_[0]);
+  ASSERT_TRUE(last_batch_is_last_);
+}
+
+}  // namespace invalidation
@@ -0,0 +1,109 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks the memory footprint of a Ticl, as reported by
+// InvalidationClientImpl::GetMemoryUsage. Runs a fleet of clients against the
+// fake invalidation server until their registrations have settled, with no
+// invalidations, and then prints the average bytes per client of each
+// component, for clients with no registrations and with increasing numbers of
+// them, and the bytes per registration.
+
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/invalidation-client-impl.h"
+#include "google/cacheinvalidation/v2/test/fake-invalidation-server.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Number of clients whose footprints are averaged. */
+static const int kNumClients = 20;
+
+/* Simulated time for the clients to get tokens and their registrations to be
+ * acknowledged and written to storage.
+ */
+static const int kSettleTimeMs = 120000;
+
+/* Returns the average bytes per client used by the clients of a fleet
+ * registered for objects_per_client objects each, and stores in usage the
+ * average bytes per client of each component.
+ */
+static size_t MeasureFootprint(int objects_per_client,
+                               map<string, size_t>* usage) {
+  LoadConfig config;
+  config.clients = kNumClients;
+  config.objects_per_client = objects_per_client;
+  config.invalidations_per_second = 0;
+  LoadTest load_test(config);
+  load_test.Start();
+  load_test.RunFor(kSettleTimeMs);
+
+  usage->clear();
+  vector<pair<string, size_t> > client_usage;
+  for (size_t i = 0; i < load_test.clients().size(); ++i) {
+    load_test.RunOnInternalThread(NewPermanentCallback(
+        load_test.clients()[i], &InvalidationClientImpl::GetMemoryUsage,
+        &client_usage));
+    for (size_t j = 0; j < client_usage.size(); ++j) {
+      (*usage)[client_usage[j].first] += client_usage[j].second;
+    }
+  }
+  size_t total_bytes = 0;
+  for (map<string, size_t>::iterator iter = usage->begin();
+       iter != usage->end(); ++iter) {
+    iter->second /= kNumClients;
+    total_bytes += iter->second;
+  }
+  return total_bytes;
+}
+
+}  // namespace invalidation
+
+int main(int argc, char** argv) {
+  using invalidation::map;
+  using invalidation::string;
+  map<string, size_t> usage;
+  size_t idle_bytes = invalidation::MeasureFootprint(0, &usage);
+  printf("Idle client: %lu bytes\n", static_cast<unsigned long>(idle_bytes));
+  for (map<string, size_t>::iterator iter = usage.begin();
+       iter != usage.end(); ++iter) {
+    printf("  %-22s %10lu bytes\n", iter->first.c_str(),
+           static_cast<unsigned long>(iter->second));
+  }
+
+  const int kNumObjects[] = { 10, 100, 1000, 10000 };
+  for (size_t i = 0; i < sizeof(kNumObjects) / sizeof(kNumObjects[0]); ++i) {
+    size_t bytes = invalidation::MeasureFootprint(kNumObjects[i], &usage);
+    printf("Client with %d registrations: %lu bytes, %.1f bytes/registration\n",
+           kNumObjects[i], static_cast<unsigned long>(bytes),
+           (static_cast<double>(bytes) - idle_bytes) / kNumObjects[i]);
+    for (map<string, size_t>::iterator iter = usage.begin();
+         iter != usage.end(); ++iter) {
+      printf("  %-22s %10lu bytes\n", iter->first.c_str(),
+             static_cast<unsigned long>(iter->second));
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,233 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the Merkle-trie registration store.
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/merkle-trie-registration-store.h"
+#include "google/cacheinvalidation/v2/object-id-digest-utils.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/sha1-digest-function.h"
+#include "google/cacheinvalidation/v2/simple-registration-store.h"
+
+namespace invalidation {
+
+class MerkleTrieRegistrationStoreTest : public testing::Test {
+ public:
+  void SetUp() {
+    digest_function_.reset(new Sha1DigestFunction());
+    trie_.reset(new MerkleTrieRegistrationStore(digest_function_.get(),
+                                                kLevels));
+    simple_store_.reset(new SimpleRegistrationStore(digest_function_.get()));
+    for (int i = 0; i < kNumObjects; ++i) {
+      ObjectIdP oid;
+      oid.set_source(ObjectSource_Type_TEST);
+      oid.set_name(StringPrintf("object-%d", i));
+      oids_.push_back(oid);
+    }
+  }
+
+  /* Returns whether bit bit_index of digest is set (LSB of byte 0 first). */
+  static bool IsBitSet(const string& digest, int bit_index) {
+    return (static_cast<unsigned char>(digest[bit_index / 8]) >>
+            (bit_index % 8)) & 1;
+  }
+
+  /* Returns whether the first prefix_len bits of digest and prefix agree. */
+  static bool HasPrefix(const string& digest, const string& prefix,
+                        int prefix_len) {
+    for (int i = 0; i < prefix_len; ++i) {
+      if (IsBitSet(digest, i) != IsBitSet(prefix, i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /* Checks that GetElements returns exactly the objects of the trie whose
+   * digests begin with the first prefix_len bits of prefix.
+   */
+  void CheckElementsWithPrefix(const string& prefix, int prefix_len) {
+    vector<ObjectIdP> elements;
+    trie_->GetElements(prefix, prefix_len, &elements);
+    int expected = 0;
+    for (size_t i = 0; i < oids_.size(); ++i) {
+      if (!trie_->Contains(oids_[i])) {
+        continue;
+      }
+      string digest =
+          ObjectIdDigestUtils::GetDigest(oids_[i], digest_function_.get());
+      if (HasPrefix(digest, prefix, prefix_len)) {
+        ++expected;
+      }
+    }
+    ASSERT_EQ(expected, static_cast<int>(elements.size()));
+    for (size_t i = 0; i < elements.size(); ++i) {
+      string digest =
+          ObjectIdDigestUtils::GetDigest(elements[i], digest_function_.get());
+      ASSERT_TRUE(HasPrefix(digest, prefix, prefix_len));
+    }
+  }
+
+  scoped_ptr<DigestFunction> digest_function_;
+  scoped_ptr<MerkleTrieRegistrationStore> trie_;
+  scoped_ptr<SimpleRegistrationStore> simple_store_;
+  vector<ObjectIdP> oids_;
+
+  static const int kLevels;
+  static const int kNumObjects;
+};
+
+const int MerkleTrieRegistrationStoreTest::kLevels = 4;
+const int MerkleTrieRegistrationStoreTest::kNumObjects = 100;
+
+/* Checks that the summary digest is the same as the one computed by the
+ * simple store, i.e., that the trie does not change what goes on the wire.
+ */
+TEST_F(MerkleTrieRegistrationStoreTest, DigestMatchesSimpleStore) {
+  ASSERT_EQ(simple_store_->GetDigest(), trie_->GetDigest());
+
+  // Add objects one at a time and then in bulk.
+  for (int i = 0; i < kNumObjects / 2; ++i) {
+    trie_->Add(oids_[i]);
+    simple_store_->Add(oids_[i]);
+    ASSERT_EQ(simple_store_->GetDigest(), trie_->GetDigest());
+  }
+  trie_->Add(oids_);
+  simple_store_->Add(oids_);
+  ASSERT_EQ(simple_store_->GetDigest(), trie_->GetDigest());
+  ASSERT_EQ(kNumObjects, trie_->size());
+
+  // Adding an object that is already present is a no-op.
+  string digest = trie_->GetDigest();
+  trie_->Add(oids_[0]);
+  ASSERT_EQ(digest, trie_->GetDigest());
+  ASSERT_EQ(kNumObjects, trie_->size());
+
+  // Remove every third object.
+  vector<ObjectIdP> to_remove;
+  for (int i = 0; i < kNumObjects; i += 3) {
+    to_remove.push_back(oids_[i]);
+  }
+  trie_->Remove(to_remove);
+  simple_store_->Remove(to_remove);
+  ASSERT_EQ(simple_store_->GetDigest(), trie_->GetDigest());
+  ASSERT_EQ(simple_store_->size(), trie_->size());
+  ASSERT_FALSE(trie_->Contains(oids_[0]));
+  ASSERT_TRUE(trie_->Contains(oids_[1]));
+  ASSERT_TRUE(trie_->CheckRepForTest());
+}
+
+/* Checks that GetElements only returns the objects under the given prefix,
+ * both for prefixes that end inside the trie and prefixes that are longer than
+ * the trie is deep.
+ */
+TEST_F(MerkleTrieRegistrationStoreTest, GetElementsWithPrefix) {
+  trie_->Add(oids_);
+  vector<ObjectIdP> elements;
+  trie_->GetElements(string(), 0, &elements);
+  ASSERT_EQ(kNumObjects, static_cast<int>(elements.size()));
+
+  string prefix =
+      ObjectIdDigestUtils::GetDigest(oids_[7], digest_function_.get());
+  for (int prefix_len = 0; prefix_len <= 2 * kLevels; ++prefix_len) {
+    CheckElementsWithPrefix(prefix, prefix_len);
+  }
+
+  // The full digest of an object must select exactly that object.
+  elements.clear();
+  trie_->GetElements(prefix, 8 * prefix.size(), &elements);
+  ASSERT_EQ(1, static_cast<int>(elements.size()));
+  ASSERT_EQ(oids_[7].name(), elements[0].name());
+}
+
+/* Checks that the per-range digests agree with the simple store for prefixes
+ * shorter than, equal to and longer than the depth of the trie.
+ */
+TEST_F(MerkleTrieRegistrationStoreTest, DigestForPrefixMatchesSimpleStore) {
+  trie_->Add(oids_);
+  simple_store_->Add(oids_);
+  string prefix =
+      ObjectIdDigestUtils::GetDigest(oids_[5], digest_function_.get());
+  int total = 0;
+  for (int prefix_len = 0; prefix_len <= 2 * kLevels; ++prefix_len) {
+    int trie_count, simple_count;
+    string trie_digest =
+        trie_->GetDigestForPrefix(prefix, prefix_len, &trie_count);
+    ASSERT_EQ(simple_store_->GetDigestForPrefix(prefix, prefix_len,
+                                                &simple_count),
+              trie_digest);
+    ASSERT_EQ(simple_count, trie_count);
+    if (prefix_len == 0) {
+      ASSERT_EQ(kNumObjects, trie_count);
+      ASSERT_EQ(trie_->GetDigest(), trie_digest);
+    }
+  }
+
+  // The ranges for all prefixes of one length partition the objects.
+  for (int i = 0; i < (1 << kLevels); ++i) {
+    string range_prefix(1, static_cast<char>(i));
+    int count;
+    trie_->GetDigestForPrefix(range_prefix, kLevels, &count);
+    total += count;
+  }
+  ASSERT_EQ(kNumObjects, total);
+}
+
+/* Checks that the subtree digests are updated when objects change and that
+ * RemoveAll empties the trie.
+ */
+TEST_F(MerkleTrieRegistrationStoreTest, SubtreeDigestsAndRemoveAll) {
+  string empty_digest = trie_->GetDigest();
+  string empty_root = trie_->GetSubtreeDigest(string(), 0);
+  trie_->Add(oids_);
+  ASSERT_TRUE(trie_->CheckRepForTest());
+
+  string prefix =
+      ObjectIdDigestUtils::GetDigest(oids_[3], digest_function_.get());
+  string subtree_digest = trie_->GetSubtreeDigest(prefix, kLevels);
+  string root_digest = trie_->GetSubtreeDigest(string(), 0);
+  ASSERT_NE(empty_root, root_digest);
+  trie_->Remove(oids_[3]);
+  ASSERT_NE(subtree_digest, trie_->GetSubtreeDigest(prefix, kLevels));
+  ASSERT_NE(root_digest, trie_->GetSubtreeDigest(string(), 0));
+  ASSERT_TRUE(trie_->CheckRepForTest());
+
+  vector<ObjectIdP> removed;
+  trie_->RemoveAll(&removed);
+  ASSERT_EQ(kNumObjects - 1, static_cast<int>(removed.size()));
+  ASSERT_EQ(0, trie_->size());
+  ASSERT_EQ(empty_digest, trie_->GetDigest());
+  ASSERT_EQ(empty_root, trie_->GetSubtreeDigest(string(), 0));
+  ASSERT_TRUE(trie_->CheckRepForTest());
+}
+
+/* Checks that the allocated bytes of the trie and of the simple store grow
+ * with their registrations and cover at least the object names.
+ */
+TEST_F(MerkleTrieRegistrationStoreTest, AllocatedBytesGrowWithRegistrations) {
+  size_t empty_trie_bytes = trie_->GetAllocatedBytes();
+  size_t empty_simple_bytes = simple_store_->GetAllocatedBytes();
+  trie_->Add(oids_);
+  simple_store_->Add(oids_);
+  size_t name_bytes = 0;
+  for (size_t i = 0; i < oids_.size(); ++i) {
+    name_bytes += oids_[i].name().size();
+  }
+  ASSERT_GT(trie_->GetAllocatedBytes(), empty_trie_bytes + name_bytes);
+  ASSERT_GT(simple_store_->GetAllocatedBytes(),
+            empty_simple_bytes + name_bytes);
+}
+
+}  // namespace invalidation
@@ -0,0 +1,165 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the multi-producer, single-consumer queues.
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/mpsc-queue.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::find;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* A value pushed by a producer thread. */
+struct Item {
+  int producer;
+  int sequence_number;
+};
+
+typedef MpscQueue<Item> ItemQueue;
+
+/* A producer thread and the queue into which it pushes. */
+struct Producer {
+  ItemQueue* queue;
+  int id;
+};
+
+static const int kNumProducers = 4;
+static const int kNumItemsPerProducer = 20000;
+
+/* Pushes kNumItemsPerProducer items, in order. */
+static void* ProduceItems(void* producer_ptr) {
+  Producer* producer = static_cast<Producer*>(producer_ptr);
+  for (int i = 0; i < kNumItemsPerProducer; ++i) {
+    ItemQueue::Node* node = producer->queue->NewNode();
+    node->value.producer = producer->id;
+    node->value.sequence_number = i;
+    producer->queue->Push(node);
+  }
+  return NULL;
+}
+
+/* Takes the items in queue, checking that those of each producer come in
+ * order, and adds their number to *num_taken.
+ */
+static void TakeItems(ItemQueue* queue, vector<int>* next_sequence_numbers,
+                      int* num_taken) {
+  ItemQueue::Node* nodes = queue->TakeAll();
+  for (ItemQueue::Node* node = nodes; node != NULL; node = node->next) {
+    int producer = node->value.producer;
+    ASSERT_EQ((*next_sequence_numbers)[producer],
+              node->value.sequence_number);
+    ++(*next_sequence_numbers)[producer];
+    ++(*num_taken);
+  }
+  queue->RecycleNodes(nodes);
+}
+
+/* Checks that the items pushed concurrently by several threads are all taken,
+ * in the order in which each thread pushed them.
+ */
+TEST(MpscQueueTest, TakesItemsInOrderPerProducer) {
+  ItemQueue queue;
+  Producer producers[kNumProducers];
+  pthread_t threads[kNumProducers];
+  for (int i = 0; i < kNumProducers; ++i) {
+    producers[i].queue = &queue;
+    producers[i].id = i;
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL, &ProduceItems,
+                                &producers[i]));
+  }
+
+  // Take the items while they are pushed, and once all threads are done.
+  vector<int> next_sequence_numbers(kNumProducers, 0);
+  int num_taken = 0;
+  for (int i = 0; i < 10; ++i) {
+    TakeItems(&queue, &next_sequence_numbers, &num_taken);
+  }
+  for (int i = 0; i < kNumProducers; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  TakeItems(&queue, &next_sequence_numbers, &num_taken);
+  ASSERT_EQ(kNumProducers * kNumItemsPerProducer, num_taken);
+  ASSERT_TRUE(queue.TakeAll() == NULL);
+}
+
+/* Checks that the nodes handed back by the consumer, up to the number of
+ * spare nodes, are the ones pushed again.
+ */
+TEST(MpscQueueTest, RecyclesNodes) {
+  ItemQueue queue;
+  vector<ItemQueue::Node*> pushed;
+  for (int i = 0; i < ItemQueue::kNumSpareNodes + 1; ++i) {
+    pushed.push_back(queue.NewNode());
+    queue.Push(pushed.back());
+  }
+  queue.RecycleNodes(queue.TakeAll());
+
+  for (int i = 0; i < ItemQueue::kNumSpareNodes; ++i) {
+    ItemQueue::Node* node = queue.NewNode();
+    ASSERT_TRUE(find(pushed.begin(), pushed.end(), node) != pushed.end());
+    ASSERT_TRUE(node->next == NULL);
+    queue.Push(node);
+  }
+  queue.RecycleNodes(queue.TakeAll());
+}
+
+class SubmissionQueueTest : public testing::Test {
+ public:
+  void SetUp() {
+    scheduler_.StartScheduler();
+    queue_.reset(new SubmissionQueue(&scheduler_));
+  }
+
+  void Record(int value) {
+    values_.push_back(value);
+  }
+
+  DeterministicScheduler scheduler_;
+  scoped_ptr<SubmissionQueue> queue_;
+  vector<int> values_;
+};
+
+/* Checks that submitted tasks run on the scheduler in order, including those
+ * submitted after the first ones have run.
+ */
+TEST_F(SubmissionQueueTest, RunsTasksInOrder) {
+  for (int i = 0; i < 3; ++i) {
+    queue_->Submit(NewPermanentCallback(this, &SubmissionQueueTest::Record,
+                                        i));
+  }
+  ASSERT_TRUE(values_.empty());
+  scheduler_.RunReadyTasks();
+  ASSERT_EQ(3, static_cast<int>(values_.size()));
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_EQ(i, values_[i]);
+  }
+
+  queue_->Submit(NewPermanentCallback(this, &SubmissionQueueTest::Record, 3));
+  scheduler_.RunReadyTasks();
+  ASSERT_EQ(4, static_cast<int>(values_.size()));
+  ASSERT_EQ(3, values_[3]);
+}
+
+}  // namespace invalidation
@@ -0,0 +1,83 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the front coding of object names.
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/object-name-coding.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+
+namespace invalidation {
+
+class ObjectNameCodingTest : public testing::Test {};
+
+/* Checks that sorted registrations with hierarchical names round-trip, that
+ * the encoding shrinks them, and that short shared prefixes are sent in full.
+ */
+TEST_F(ObjectNameCodingTest, RegistrationsRoundTrip) {
+  RegistrationMessage message;
+  for (int i = 0; i < 100; ++i) {
+    RegistrationP* registration = message.add_registration();
+    registration->mutable_object_id()->set_source(ObjectSource_Type_TEST);
+    registration->mutable_object_id()->set_name(
+        StringPrintf("tenant/region/catalog/item-%03d", i));
+    registration->set_op_type(RegistrationP_OpType_REGISTER);
+  }
+  RegistrationP* registration = message.add_registration();
+  registration->mutable_object_id()->set_source(ObjectSource_Type_TEST);
+  registration->mutable_object_id()->set_name("tx");
+  registration->set_op_type(RegistrationP_OpType_UNREGISTER);
+  RegistrationMessage original(message);
+
+  ObjectNameCoding::EncodeRegistrations(&message);
+  ASSERT_LT(message.ByteSize() * 2, original.ByteSize());
+  ASSERT_FALSE(message.registration(0).object_id().
+               has_shared_name_prefix_length());
+  ASSERT_EQ(29, message.registration(1).object_id().
+            shared_name_prefix_length());
+  ASSERT_EQ("1", message.registration(1).object_id().name());
+  ASSERT_FALSE(message.registration(100).object_id().
+               has_shared_name_prefix_length());
+
+  ASSERT_TRUE(ObjectNameCoding::DecodeRegistrations(&message));
+  ASSERT_EQ(original.SerializeAsString(), message.SerializeAsString());
+}
+
+/* Checks that the objects of a subtree are sorted before they are encoded,
+ * and that a shared prefix longer than the previous name is rejected.
+ */
+TEST_F(ObjectNameCodingTest, SubtreeSortedAndMalformedRejected) {
+  RegistrationSubtree subtree;
+  const char* names[] = { "a/b/c/2", "a/b/c/1", "a/b/d/1" };
+  for (int i = 0; i < 3; ++i) {
+    ObjectIdP* object_id = subtree.add_registered_object();
+    object_id->set_source(ObjectSource_Type_TEST);
+    object_id->set_name(names[i]);
+  }
+  ObjectNameCoding::EncodeSubtree(&subtree);
+  ASSERT_EQ("a/b/c/1", subtree.registered_object(0).name());
+  ASSERT_EQ(6, subtree.registered_object(1).shared_name_prefix_length());
+  ASSERT_EQ("2", subtree.registered_object(1).name());
+  ASSERT_EQ(4, subtree.registered_object(2).shared_name_prefix_length());
+  ASSERT_EQ("d/1", subtree.registered_object(2).name());
+  ASSERT_TRUE(ObjectNameCoding::DecodeSubtree(&subtree));
+  ASSERT_EQ("a/b/c/2", subtree.registered_object(1).name());
+  ASSERT_EQ("a/b/d/1", subtree.registered_object(2).name());
+
+  subtree.mutable_registered_object(1)->set_shared_name_prefix_length(8);
+  ASSERT_FALSE(ObjectNameCoding::DecodeSubtree(&subtree));
+}
+
+}  // namespace invalidation
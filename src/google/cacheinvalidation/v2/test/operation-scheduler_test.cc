@@ -0,0 +1,138 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the operation scheduler and the lifetime of its trampolines.
+
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/operation-scheduler.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Scheduler that runs tasks only when the test asks, and deletes them only
+ * later, as schedulers that delete the tasks they run in batches do.
+ */
+class HoldingScheduler : public Scheduler {
+ public:
+  virtual ~HoldingScheduler() {
+    DeleteTasks();
+  }
+
+  virtual void Schedule(TimeDelta delay, Closure* runnable) {
+    tasks.push_back(runnable);
+  }
+
+  virtual bool IsRunningOnThread() const {
+    return true;
+  }
+
+  virtual Time GetCurrentTime() const {
+    return Time();
+  }
+
+  /* Runs the task at index, without deleting it. */
+  void RunTask(int index) {
+    tasks[index]->Run();
+  }
+
+  /* Deletes the tasks up to index, exclusive. */
+  void DeleteTasks(int index) {
+    for (int i = 0; i < index; ++i) {
+      delete tasks[i];
+      tasks[i] = NULL;
+    }
+  }
+
+  void DeleteTasks() {
+    DeleteTasks(tasks.size());
+  }
+
+  vector<Closure*> tasks;
+};
+
+class OperationSchedulerTest : public testing::Test {
+ public:
+  void SetUp() {
+    num_runs_ = 0;
+    operation_.reset(
+        NewPermanentCallback(this, &OperationSchedulerTest::CountRun));
+    operation_scheduler_.reset(new OperationScheduler(&logger_, &scheduler_));
+    operation_scheduler_->SetOperation(
+        TimeDelta::FromMilliseconds(100), operation_.get(), "operation");
+  }
+
+  void CountRun() {
+    ++num_runs_;
+  }
+
+  /* Schedules and runs the operation twice without the scheduler deleting
+   * the tasks, so that both trampoline slots are in use, and schedules it a
+   * third time, on a trampoline on the heap.
+   */
+  void ScheduleOnHeapTrampoline() {
+    for (int i = 0; i < 2; ++i) {
+      operation_scheduler_->Schedule(operation_.get());
+      scheduler_.RunTask(i);
+    }
+    operation_scheduler_->Schedule(operation_.get());
+    ASSERT_EQ(3, static_cast<int>(scheduler_.tasks.size()));
+    ASSERT_EQ(2, num_runs_);
+  }
+
+  NullLogger logger_;
+  HoldingScheduler scheduler_;
+  scoped_ptr<Closure> operation_;
+  scoped_ptr<OperationScheduler> operation_scheduler_;
+  int num_runs_;
+};
+
+/* Tests that a trampoline on the heap runs the operation and lets it be
+ * scheduled again.
+ */
+TEST_F(OperationSchedulerTest, HeapTrampolineRunsOperation) {
+  ScheduleOnHeapTrampoline();
+
+  // Scheduled operations are not scheduled twice.
+  operation_scheduler_->Schedule(operation_.get());
+  ASSERT_EQ(3, static_cast<int>(scheduler_.tasks.size()));
+
+  scheduler_.RunTask(2);
+  ASSERT_EQ(3, num_runs_);
+  operation_scheduler_->Schedule(operation_.get());
+  ASSERT_EQ(4, static_cast<int>(scheduler_.tasks.size()));
+}
+
+/* Tests that a trampoline on the heap that outlives the operation scheduler
+ * neither runs the operation nor touches its deleted state.
+ */
+TEST_F(OperationSchedulerTest, HeapTrampolineOutlivesOperationScheduler) {
+  ScheduleOnHeapTrampoline();
+  operation_scheduler_.reset();
+
+  // Deleting the tasks in the slots leaves the heap trampoline holding the
+  // info of the operation.
+  scheduler_.DeleteTasks(2);
+  scheduler_.RunTask(2);
+  ASSERT_EQ(2, num_runs_);
+  scheduler_.DeleteTasks();
+}
+
+}  // namespace invalidation
@@ -0,0 +1,139 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the encoding of messages to the server from cached header fields.
+
+#include <string>
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/constants.h"
+#include "google/cacheinvalidation/v2/outbound-message-encoder.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+
+class OutboundMessageEncoderTest : public testing::Test {
+ public:
+  void SetUp() {
+    client_version_.mutable_version()->set_major_version(3);
+    client_version_.mutable_version()->set_minor_version(1);
+    client_version_.set_platform("test-platform");
+    client_version_.set_language("C++");
+    client_version_.set_application_info("test-app");
+    encoder_.reset(new OutboundMessageEncoder(client_version_));
+    summary_.set_num_registrations(2);
+    summary_.set_registration_digest("digest");
+  }
+
+  /* Returns a message with an invalidation ack and, if with_info, an info
+   * message without its client version.
+   */
+  static ClientToServerMessage MakeBody(bool with_info) {
+    ClientToServerMessage message;
+    InvalidationP* ack =
+        message.mutable_invalidation_ack_message()->add_invalidation();
+    ack->mutable_object_id()->set_source(4);
+    ack->mutable_object_id()->set_name("object");
+    ack->set_is_known_version(true);
+    ack->set_version(7);
+    if (with_info) {
+      PropertyRecord* param =
+          message.mutable_info_message()->add_config_parameter();
+      param->set_name("param");
+      param->set_value(5);
+    }
+    return message;
+  }
+
+  /* Checks that encoding body with the given header fields parses to the
+   * message built with the full header and client version.
+   */
+  void CheckEncoding(const ClientToServerMessage& body,
+                     const string& client_token, int message_id,
+                     int64 client_time_ms) {
+    ClientToServerMessage expected(body);
+    ClientHeader* header = expected.mutable_header();
+    header->mutable_protocol_version()->mutable_version()->set_major_version(
+        Constants::kProtocolMajorVersion);
+    header->mutable_protocol_version()->mutable_version()->set_minor_version(
+        Constants::kProtocolMinorVersion);
+    header->set_client_time_ms(client_time_ms);
+    header->set_message_id(StringPrintf("%d", message_id));
+    header->set_max_known_server_time_ms(kServerTimeMs);
+    header->mutable_registration_summary()->CopyFrom(summary_);
+    if (!client_token.empty()) {
+      header->set_client_token(client_token);
+    }
+    if (expected.has_info_message()) {
+      expected.mutable_info_message()->mutable_client_version()->CopyFrom(
+          client_version_);
+    }
+
+    ClientToServerMessage message(body);
+    string body_bytes;
+    encoder_->EncodeBody(&message, &body_bytes);
+    ASSERT_FALSE(message.has_info_message());
+    string buffer;
+    encoder_->EncodeMessage(client_token, summary_, message_id,
+                            client_time_ms, kServerTimeMs, body_bytes,
+                            &buffer);
+
+    ClientToServerMessage parsed;
+    ASSERT_TRUE(parsed.ParseFromString(buffer));
+    ASSERT_EQ(expected.SerializeAsString(), parsed.SerializeAsString());
+  }
+
+  static const int64 kServerTimeMs = 1234567890123LL;
+
+  ClientVersion client_version_;
+  scoped_ptr<OutboundMessageEncoder> encoder_;
+  RegistrationSummary summary_;
+};
+
+const int64 OutboundMessageEncoderTest::kServerTimeMs;
+
+/* Checks messages with and without a token and an info message. */
+TEST_F(OutboundMessageEncoderTest, MatchesFullSerialization) {
+  CheckEncoding(MakeBody(false), "", 1, 1000);
+  CheckEncoding(MakeBody(false), "token", 2, 2000);
+  CheckEncoding(MakeBody(true), "token", 3, 3000);
+  CheckEncoding(ClientToServerMessage(), "token", 4, 4000);
+}
+
+/* Checks that the cached header fields follow changes of the token and
+ * registration summary.
+ */
+TEST_F(OutboundMessageEncoderTest, TracksHeaderChanges) {
+  CheckEncoding(MakeBody(false), "token", 1, 1000);
+  summary_.set_num_registrations(3);
+  CheckEncoding(MakeBody(false), "token", 2, 1000);
+  summary_.set_registration_digest("other-digest");
+  CheckEncoding(MakeBody(true), "token", 3, 1000);
+  CheckEncoding(MakeBody(true), "new-token", 4, 1000);
+  CheckEncoding(MakeBody(true), "", 5, 1000);
+}
+
+/* Checks the encoding of message ids of every length. */
+TEST_F(OutboundMessageEncoderTest, EncodesAllMessageIds) {
+  CheckEncoding(MakeBody(false), "token", 0, 0);
+  CheckEncoding(MakeBody(false), "token", -1, 1);
+  CheckEncoding(MakeBody(false), "token", 2147483647, 1000);
+  CheckEncoding(MakeBody(false), "token", -2147483647 - 1, 1000);
+}
+
+}  // namespace invalidation
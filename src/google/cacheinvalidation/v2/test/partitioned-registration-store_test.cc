@@ -0,0 +1,184 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the registration store partitioned by object source.
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/object-id-digest-utils.h"
+#include "google/cacheinvalidation/v2/partitioned-registration-store.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/sha1-digest-function.h"
+#include "google/cacheinvalidation/v2/simple-registration-store.h"
+
+namespace invalidation {
+
+class PartitionedRegistrationStoreTest : public testing::Test {
+ public:
+  void SetUp() {
+    digest_function_.reset(new Sha1DigestFunction());
+    store_.reset(new PartitionedRegistrationStore(digest_function_.get()));
+    simple_store_.reset(new SimpleRegistrationStore(digest_function_.get()));
+    // Spread the objects over the sources.
+    for (int i = 0; i < kNumObjects; ++i) {
+      ObjectIdP oid;
+      oid.set_source(kSources[i % kNumSources]);
+      oid.set_name(StringPrintf("object-%d", i));
+      oids_.push_back(oid);
+    }
+  }
+
+  /* Checks that store_ holds the same objects as simple_store_ and computes
+   * the same digests.
+   */
+  void CheckSameAsSimpleStore() {
+    ASSERT_EQ(simple_store_->size(), store_->size());
+    ASSERT_EQ(simple_store_->GetDigest(), store_->GetDigest());
+    for (size_t i = 0; i < oids_.size(); ++i) {
+      ASSERT_EQ(simple_store_->Contains(oids_[i]), store_->Contains(oids_[i]));
+    }
+  }
+
+  /* Returns the digest of the objects in oids_ of source that are in
+   * simple_store_, and stores their number in num_elements.
+   */
+  string GetExpectedDigestForSource(int source, int* num_elements) {
+    SimpleRegistrationStore source_store(digest_function_.get());
+    for (size_t i = 0; i < oids_.size(); ++i) {
+      if ((oids_[i].source() == source) &&
+          simple_store_->Contains(oids_[i])) {
+        source_store.Add(oids_[i]);
+      }
+    }
+    *num_elements = source_store.size();
+    return source_store.GetDigest();
+  }
+
+  scoped_ptr<DigestFunction> digest_function_;
+  scoped_ptr<PartitionedRegistrationStore> store_;
+  scoped_ptr<SimpleRegistrationStore> simple_store_;
+  vector<ObjectIdP> oids_;
+
+  static const int kNumObjects;
+  static const int kNumSources = 2;
+  static const int kSources[kNumSources];
+};
+
+const int PartitionedRegistrationStoreTest::kNumObjects = 1000;
+const int PartitionedRegistrationStoreTest::kNumSources;
+const int PartitionedRegistrationStoreTest::kSources[] = {
+  ObjectSource_Type_TEST, ObjectSource_Type_INTERNAL };
+
+/* Checks that the store agrees with the simple store through additions and
+ * removals, i.e., that the summary digest over the partitions is the digest
+ * the server expects.
+ */
+TEST_F(PartitionedRegistrationStoreTest, MatchesSimpleStore) {
+  CheckSameAsSimpleStore();
+  for (int i = 0; i < 100; ++i) {
+    store_->Add(oids_[i]);
+    simple_store_->Add(oids_[i]);
+  }
+  CheckSameAsSimpleStore();
+  store_->Add(oids_);
+  simple_store_->Add(oids_);
+  CheckSameAsSimpleStore();
+
+  for (int i = 0; i < kNumObjects; ++i) {
+    if (i % 10 != 0) {
+      store_->Remove(oids_[i]);
+      simple_store_->Remove(oids_[i]);
+    }
+  }
+  CheckSameAsSimpleStore();
+
+  vector<ObjectIdP> elements;
+  store_->GetElements(string(), 0, &elements);
+  ASSERT_EQ(store_->size(), static_cast<int>(elements.size()));
+  for (size_t i = 0; i < elements.size(); ++i) {
+    ASSERT_TRUE(simple_store_->Contains(elements[i]));
+  }
+  string prefix =
+      ObjectIdDigestUtils::GetDigest(oids_[0], digest_function_.get());
+  for (int prefix_len = 0; prefix_len <= 8; ++prefix_len) {
+    int count, simple_count;
+    ASSERT_EQ(
+        simple_store_->GetDigestForPrefix(prefix, prefix_len, &simple_count),
+        store_->GetDigestForPrefix(prefix, prefix_len, &count));
+    ASSERT_EQ(simple_count, count);
+    elements.clear();
+    store_->GetElements(prefix, prefix_len, &elements);
+    ASSERT_EQ(count, static_cast<int>(elements.size()));
+  }
+
+  vector<ObjectIdP> removed;
+  store_->RemoveAll(&removed);
+  ASSERT_EQ(simple_store_->size(), static_cast<int>(removed.size()));
+  ASSERT_EQ(0, store_->size());
+  ASSERT_EQ(SimpleRegistrationStore(digest_function_.get()).GetDigest(),
+            store_->GetDigest());
+}
+
+/* Checks the per-source digests and elements, and that changing the objects
+ * of one source leaves the digests of the others alone.
+ */
+TEST_F(PartitionedRegistrationStoreTest, ScopesToSources) {
+  store_->Add(oids_);
+  simple_store_->Add(oids_);
+  vector<int> sources;
+  store_->GetSources(&sources);
+  ASSERT_EQ(kNumSources, static_cast<int>(sources.size()));
+
+  vector<string> source_digests;
+  for (int i = 0; i < kNumSources; ++i) {
+    int count, expected_count;
+    string digest = store_->GetDigestForSource(kSources[i], &count);
+    ASSERT_EQ(GetExpectedDigestForSource(kSources[i], &expected_count),
+              digest);
+    ASSERT_EQ(expected_count, count);
+    vector<ObjectIdP> elements;
+    store_->GetElementsForSource(kSources[i], &elements);
+    ASSERT_EQ(count, static_cast<int>(elements.size()));
+    source_digests.push_back(digest);
+  }
+
+  // Churn in the first source only.
+  for (int i = 0; i < kNumObjects; i += kNumSources * 2) {
+    store_->Remove(oids_[i]);
+    simple_store_->Remove(oids_[i]);
+  }
+  CheckSameAsSimpleStore();
+  int count, expected_count;
+  ASSERT_EQ(GetExpectedDigestForSource(kSources[0], &expected_count),
+            store_->GetDigestForSource(kSources[0], &count));
+  ASSERT_EQ(expected_count, count);
+  ASSERT_NE(source_digests[0], store_->GetDigestForSource(kSources[0], &count));
+  for (int i = 1; i < kNumSources; ++i) {
+    ASSERT_EQ(source_digests[i],
+              store_->GetDigestForSource(kSources[i], &count));
+  }
+
+  // Dropping a whole source leaves the others in place.
+  vector<ObjectIdP> removed;
+  store_->RemoveAllForSource(kSources[1], &removed);
+  simple_store_->Remove(removed);
+  CheckSameAsSimpleStore();
+  ASSERT_EQ(SimpleRegistrationStore(digest_function_.get()).GetDigest(),
+            store_->GetDigestForSource(kSources[1], &count));
+  ASSERT_EQ(0, count);
+  sources.clear();
+  store_->GetSources(&sources);
+  ASSERT_EQ(kNumSources - 1, static_cast<int>(sources.size()));
+}
+
+}  // namespace invalidation
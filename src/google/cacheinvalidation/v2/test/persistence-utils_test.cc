@@ -0,0 +1,85 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the serialization of the Ticl state blob.
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/persistence-utils.h"
+#include "google/cacheinvalidation/v2/sha1-digest-function.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+class PersistenceUtilsTest : public testing::Test {
+ public:
+  /* Returns the blob for state as serialized by the PersistentStateBlob
+   * message itself.
+   */
+  string SerializeBlobMessage(const PersistentTiclState& state) {
+    PersistentStateBlob blob;
+    blob.mutable_ticl_state()->CopyFrom(state);
+    blob.set_authentication_code(
+        PersistenceUtils::GenerateMac(state, &digest_fn_));
+    string result;
+    blob.SerializeToString(&result);
+    return result;
+  }
+
+  NullLogger logger_;
+  Sha1DigestFunction digest_fn_;
+};
+
+/* Checks that the directly encoded blob has the same bytes as the serialized
+ * message, including for a token long enough to need a multi-byte length.
+ */
+TEST_F(PersistenceUtilsTest, SerializeStateMatchesMessage) {
+  PersistentTiclState state;
+  const string tokens[] = { "", "token", string(300, 't') };
+  for (size_t i = 0; i < sizeof(tokens) / sizeof(tokens[0]); ++i) {
+    state.set_client_token(tokens[i]);
+    string serialized;
+    PersistenceUtils::SerializeState(state, &digest_fn_, &serialized);
+    ASSERT_EQ(SerializeBlobMessage(state), serialized);
+
+    string serialized_state;
+    state.SerializeToString(&serialized_state);
+    string from_bytes;
+    PersistenceUtils::SerializeStateFromBytes(
+        serialized_state, &digest_fn_, &from_bytes);
+    ASSERT_EQ(serialized, from_bytes);
+  }
+}
+
+/* Checks that a serialized blob deserializes to the same state, and that a
+ * corrupted one fails the MAC check.
+ */
+TEST_F(PersistenceUtilsTest, RoundTrip) {
+  PersistentTiclState state;
+  state.set_client_token("token");
+  string serialized;
+  PersistenceUtils::SerializeState(state, &digest_fn_, &serialized);
+
+  PersistentTiclState parsed;
+  ASSERT_TRUE(PersistenceUtils::DeserializeState(
+      &logger_, serialized, &digest_fn_, &parsed));
+  ASSERT_EQ("token", parsed.client_token());
+
+  // Flip the first byte of the token, after the blob's and the state's tag
+  // and length bytes.
+  serialized[4] ^= 1;
+  ASSERT_FALSE(PersistenceUtils::DeserializeState(
+      &logger_, serialized, &digest_fn_, &parsed));
+}
+
+}  // namespace invalidation
@@ -0,0 +1,175 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the coalescing writer of the persistent state.
+
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/random.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/persistent-state-writer.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/statistics.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Storage that records the writes and completes them when told to. */
+class RecordingStorage : public Storage {
+ public:
+  virtual ~RecordingStorage() {
+    for (size_t i = 0; i < callbacks_.size(); ++i) {
+      delete callbacks_[i];
+    }
+  }
+
+  virtual void WriteKey(const string& key, const string& value,
+                        WriteKeyCallback* done) {
+    values_.push_back(value);
+    callbacks_.push_back(done);
+  }
+
+  virtual void ReadKey(const string& key, ReadKeyCallback* done) {
+    delete done;
+  }
+
+  virtual void DeleteKey(const string& key, DeleteKeyCallback* done) {
+    delete done;
+  }
+
+  virtual void ReadAllKeys(ReadAllKeysCallback* key_callback) {
+    delete key_callback;
+  }
+
+  /* Completes the oldest outstanding write with status. */
+  void CompleteWrite(Status status) {
+    ASSERT_FALSE(callbacks_.empty());
+    WriteKeyCallback* callback = callbacks_.front();
+    callbacks_.erase(callbacks_.begin());
+    callback->Run(status);
+    delete callback;
+  }
+
+  /* The values of all the writes, in order. */
+  vector<string> values_;
+
+  /* The callbacks of the outstanding writes. */
+  vector<WriteKeyCallback*> callbacks_;
+};
+
+class PersistentStateWriterTest : public testing::Test {
+ public:
+  void SetUp() {
+    scheduler_.StartScheduler();
+    writer_.reset(new PersistentStateWriter(
+        &storage_, &scheduler_, &logger_, &statistics_, "key",
+        new ExponentialBackoffDelayGenerator(
+            new Random(0), kMaxRetryDelay, kRetryDelay),
+        kRetryDelay));
+  }
+
+  /* Writes value on the internal thread. */
+  void Write(const string& value) {
+    scheduler_.Schedule(Scheduler::NoDelay(), NewPermanentCallback(
+        writer_.get(), &PersistentStateWriter::Write, value));
+    scheduler_.RunReadyTasks();
+  }
+
+  /* Completes the outstanding write with status and runs the tasks that come
+   * due within time_to_advance.
+   */
+  void CompleteWrite(Status::Code code, TimeDelta time_to_advance) {
+    storage_.CompleteWrite(Status(code, ""));
+    scheduler_.ModifyTime(time_to_advance);
+    scheduler_.RunReadyTasks();
+  }
+
+  int GetWriteStat(Statistics::PersistentWriteType type) {
+    return statistics_.GetPersistentWriteForTest(type);
+  }
+
+  static const TimeDelta kRetryDelay;
+  static const TimeDelta kMaxRetryDelay;
+
+  DeterministicScheduler scheduler_;
+  NullLogger logger_;
+  Statistics statistics_;
+  RecordingStorage storage_;
+  scoped_ptr<PersistentStateWriter> writer_;
+};
+
+const TimeDelta PersistentStateWriterTest::kRetryDelay =
+    TimeDelta::FromSeconds(10);
+const TimeDelta PersistentStateWriterTest::kMaxRetryDelay =
+    TimeDelta::FromSeconds(100);
+
+/* Checks that at most one write is outstanding, that the values given in the
+ * meantime are merged into the latest one, and that unchanged values are not
+ * written.
+ */
+TEST_F(PersistentStateWriterTest, CoalescesWrites) {
+  Write("a");
+  Write("b");
+  Write("c");
+  ASSERT_EQ(1, static_cast<int>(storage_.values_.size()));
+  ASSERT_TRUE(writer_->HasPendingWrite());
+
+  // Once "a" is written, only the latest value, "c", is.
+  CompleteWrite(Status::SUCCESS, TimeDelta());
+  ASSERT_EQ(2, static_cast<int>(storage_.values_.size()));
+  ASSERT_EQ("c", storage_.values_[1]);
+  CompleteWrite(Status::SUCCESS, TimeDelta());
+  ASSERT_FALSE(writer_->HasPendingWrite());
+
+  // Writing "c" again does nothing.
+  Write("c");
+  ASSERT_EQ(2, static_cast<int>(storage_.values_.size()));
+  ASSERT_FALSE(writer_->HasPendingWrite());
+
+  ASSERT_EQ(2, GetWriteStat(Statistics::PersistentWriteType_COMPLETED_WRITES));
+  ASSERT_EQ(2, GetWriteStat(Statistics::PersistentWriteType_SKIPPED_WRITES));
+}
+
+/* Checks that a failed write is retried after a delay, with the latest
+ * value.
+ */
+TEST_F(PersistentStateWriterTest, RetriesFailedWrites) {
+  Write("a");
+  Write("b");
+  CompleteWrite(Status::TRANSIENT_FAILURE, TimeDelta());
+  ASSERT_EQ(1, statistics_.GetClientErrorCounterForTest(
+      Statistics::ClientErrorType_PERSISTENT_WRITE_FAILURE));
+
+  // The retry, after a random backoff delay, writes the value given in the
+  // meantime.
+  scheduler_.ModifyTime(kMaxRetryDelay);
+  scheduler_.RunReadyTasks();
+  ASSERT_EQ(2, static_cast<int>(storage_.values_.size()));
+  ASSERT_EQ("b", storage_.values_[1]);
+
+  // Once the retry succeeds, the backoff is reset and writing resumes.
+  CompleteWrite(Status::SUCCESS, TimeDelta());
+  ASSERT_FALSE(writer_->HasPendingWrite());
+  Write("a");
+  ASSERT_EQ(3, static_cast<int>(storage_.values_.size()));
+}
+
+}  // namespace invalidation
@@ -0,0 +1,147 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the pooled callbacks.
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/pooled-callback.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::max;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+class PooledCallbackTest : public testing::Test {
+ public:
+  PooledCallbackTest() : num_calls_(0) {}
+
+  void Count() {
+    ++num_calls_;
+  }
+
+  void Record(int a, const string& b, bool c, const string& d) {
+    ++num_calls_;
+    result_ = StringPrintf("%d %s %d %s", a, b.c_str(), c, d.c_str());
+  }
+
+  /* Bound to a closure too large for the pool. */
+  struct Large {
+    char bytes[1024];
+  };
+
+  void TakeLarge(const Large& large) {
+    ++num_calls_;
+    result_ = string(large.bytes);
+  }
+
+  void Join(const string& separator, const vector<string>& parts) {
+    ++num_calls_;
+    result_.clear();
+    for (size_t i = 0; i < parts.size(); ++i) {
+      result_ += (i == 0) ? parts[i] : separator + parts[i];
+    }
+  }
+
+  int num_calls_;
+  string result_;
+};
+
+/* Checks that a pooled closure calls its method with copies of the bound
+ * arguments, and can be run repeatedly.
+ */
+TEST_F(PooledCallbackTest, RunsWithBoundArguments) {
+  string message = "message";
+  Closure* closure = NewPooledCallback(
+      this, &PooledCallbackTest::Record, 7, string("seven"), true, message);
+  message = "changed";
+  ASSERT_TRUE(IsCallbackRepeatable(closure));
+  closure->Run();
+  closure->Run();
+  delete closure;
+  ASSERT_EQ(2, num_calls_);
+  ASSERT_EQ("7 seven 1 message", result_);
+}
+
+/* Checks that a swap closure takes its last argument from the caller, leaving
+ * the caller's empty.
+ */
+TEST_F(PooledCallbackTest, TakesSwappedArgument) {
+  vector<string> parts;
+  parts.push_back("a");
+  parts.push_back("b");
+  Closure* closure = NewPooledSwapCallback(
+      this, &PooledCallbackTest::Join, string(","), &parts);
+  ASSERT_TRUE(parts.empty());
+  closure->Run();
+  delete closure;
+  ASSERT_EQ(1, num_calls_);
+  ASSERT_EQ("a,b", result_);
+}
+
+/* Checks that the memory of deleted closures is reused for new ones, and that
+ * closures too large for the pool still work.
+ */
+TEST_F(PooledCallbackTest, ReusesMemory) {
+  Closure* first = NewPooledCallback(this, &PooledCallbackTest::Count);
+  delete first;
+  int num_free_blocks = CallbackPool::GetNumFreeBlocksForTest();
+  ASSERT_GT(num_free_blocks, 0);
+
+  Closure* second = NewPooledCallback(this, &PooledCallbackTest::Count);
+  ASSERT_EQ(num_free_blocks - 1, CallbackPool::GetNumFreeBlocksForTest());
+  second->Run();
+  delete second;
+  ASSERT_EQ(num_free_blocks, CallbackPool::GetNumFreeBlocksForTest());
+
+  Large large;
+  snprintf(large.bytes, sizeof(large.bytes), "large");
+  Closure* third = NewPooledCallback(this, &PooledCallbackTest::TakeLarge,
+                                     large);
+  third->Run();
+  delete third;
+  ASSERT_EQ(num_free_blocks, CallbackPool::GetNumFreeBlocksForTest());
+  ASSERT_EQ(2, num_calls_);
+  ASSERT_EQ("large", result_);
+}
+
+/* Deletes the closure passed to it, as a thread entry point. */
+static void* DeleteClosure(void* closure) {
+  delete static_cast<Closure*>(closure);
+  return NULL;
+}
+
+/* Checks that blocks freed by another thread are kept by that thread, and
+ * not handed out to the closures of this one.
+ */
+TEST_F(PooledCallbackTest, KeepsBlocksPerThread) {
+  int num_free_blocks = CallbackPool::GetNumFreeBlocksForTest();
+  Closure* closure = NewPooledCallback(this, &PooledCallbackTest::Count);
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, &DeleteClosure, closure));
+  ASSERT_EQ(0, pthread_join(thread, NULL));
+  ASSERT_EQ(max(num_free_blocks - 1, 0),
+            CallbackPool::GetNumFreeBlocksForTest());
+}
+
+}  // namespace invalidation
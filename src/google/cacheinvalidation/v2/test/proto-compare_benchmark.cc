@@ -0,0 +1,295 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks the pending-message containers of the ProtocolHandler, which are
+// ordered by ProtoCompareLess, against alternatives: ordered maps over keys
+// precomputed from the protos (so that comparisons are single string
+// comparisons) and hashed maps over the same keys.
+//
+// Each benchmark fills a container with a batch of entries and drains it, as
+// the batching path does between two messages. The ordered containers are
+// drained from the front, as the ProtocolHandler does; the hashed ones are
+// iterated and cleared, since they give no order to drain in (which would
+// also make the order of operations in a message unpredictable).
+//
+// Prints the CPU time per entry for each container and batch size.
+
+#include <stdio.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/hash_map.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/proto-helpers.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/time.h"
+#include "google/cacheinvalidation/v2/test/stopwatch.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::set;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* FNV-1a hash of a string, for the hashed containers. */
+struct StringHash {
+  size_t operator()(const string& value) const {
+    uint64 hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < value.size(); ++i) {
+      hash ^= static_cast<unsigned char>(value[i]);
+      hash *= 1099511628211ULL;
+    }
+    return static_cast<size_t>(hash);
+  }
+};
+
+/* Appends value to key in big-endian order, so that keys compare as the
+ * values do.
+ */
+static void AppendBigEndian(uint64 value, int num_bytes, string* key) {
+  for (int i = num_bytes - 1; i >= 0; --i) {
+    key->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+/* Sets key to a string that orders object ids as ProtoCompareLess does. */
+static void GetObjectIdKey(const ObjectIdP& object_id, string* key) {
+  key->clear();
+  AppendBigEndian(static_cast<uint32>(object_id.source()), 4, key);
+  key->append(object_id.name());
+}
+
+/* Sets key to a string that orders invalidations as ProtoCompareLess does,
+ * provided that object names contain no NUL bytes.
+ */
+static void GetInvalidationKey(const InvalidationP& invalidation,
+                               string* key) {
+  GetObjectIdKey(invalidation.object_id(), key);
+  key->push_back('\0');
+  key->push_back(invalidation.is_known_version() ? 1 : 0);
+  // Flip the sign bit so that negative versions sort first.
+  AppendBigEndian(static_cast<uint64>(invalidation.version()) ^ (1ULL << 63),
+                  8, key);
+}
+
+/* Inserts key into the map container. */
+template <typename Container, typename Key>
+void InsertInto(Container* container, const Key& key) {
+  container->insert(typename Container::value_type(
+      key, typename Container::mapped_type()));
+}
+
+/* Inserts key into the set container. */
+template <typename Key, typename Compare>
+void InsertInto(set<Key, Compare>* container, const Key& key) {
+  container->insert(key);
+}
+
+/* Removes the entries of container one at a time from the front. */
+template <typename Container>
+void DrainInOrder(Container* container) {
+  while (!container->empty()) {
+    container->erase(container->begin());
+  }
+}
+
+/* Visits the entries of container and then clears it. */
+template <typename Container>
+void DrainAll(Container* container) {
+  int num_entries = 0;
+  for (typename Container::iterator iter = container->begin();
+       iter != container->end(); ++iter) {
+    ++num_entries;
+  }
+  CHECK(num_entries == static_cast<int>(container->size()));
+  container->clear();
+}
+
+/* Number of entries inserted by each benchmark, across its repetitions. */
+static const int kEntriesPerBenchmark = 1000000;
+
+/* Fills and drains a Container with keys kEntriesPerBenchmark / keys.size()
+ * times and prints the CPU time per entry.
+ */
+template <typename Container, typename Key>
+void RunBenchmark(const char* name, const vector<Key>& keys,
+                  bool drain_in_order) {
+  int repetitions = kEntriesPerBenchmark / keys.size();
+  if (repetitions == 0) {
+    repetitions = 1;
+  }
+  Container container;
+  Stopwatch stopwatch;
+  stopwatch.Start();
+  for (int i = 0; i < repetitions; ++i) {
+    for (size_t j = 0; j < keys.size(); ++j) {
+      InsertInto(&container, keys[j]);
+    }
+    if (drain_in_order) {
+      DrainInOrder(&container);
+    } else {
+      DrainAll(&container);
+    }
+  }
+  int64 wall_ns, cpu_ns;
+  stopwatch.Stop(&wall_ns, &cpu_ns);
+  printf("%-44s %6d entries: %7.1f ns CPU/entry\n", name,
+         static_cast<int>(keys.size()),
+         static_cast<double>(cpu_ns) / (repetitions * keys.size()));
+}
+
+/* Fills and drains a Container with the keys of protos, computing each key
+ * as it is inserted, and prints the CPU time per entry.
+ */
+template <typename Container, typename Proto>
+void RunKeyedBenchmark(const char* name, const vector<Proto>& protos,
+                       void (*get_key)(const Proto&, string*)) {
+  int repetitions = kEntriesPerBenchmark / protos.size();
+  if (repetitions == 0) {
+    repetitions = 1;
+  }
+  Container container;
+  string key;
+  Stopwatch stopwatch;
+  stopwatch.Start();
+  for (int i = 0; i < repetitions; ++i) {
+    for (size_t j = 0; j < protos.size(); ++j) {
+      get_key(protos[j], &key);
+      InsertInto(&container, key);
+    }
+    DrainInOrder(&container);
+  }
+  int64 wall_ns, cpu_ns;
+  stopwatch.Stop(&wall_ns, &cpu_ns);
+  printf("%-44s %6d entries: %7.1f ns CPU/entry\n", name,
+         static_cast<int>(protos.size()),
+         static_cast<double>(cpu_ns) / (repetitions * protos.size()));
+}
+
+/* Stores in object_ids num_objects object ids named as applications name them,
+ * with long common prefixes.
+ */
+static void MakeObjectIds(int num_objects, vector<ObjectIdP>* object_ids) {
+  object_ids->clear();
+  for (int i = 0; i < num_objects; ++i) {
+    ObjectIdP object_id;
+    object_id.set_source(ObjectSource_Type_TEST);
+    object_id.set_name(
+        StringPrintf("user/%d/bookmarks/folder-%d", 1234567 + i % 7, i));
+    object_ids->push_back(object_id);
+  }
+}
+
+/* Benchmarks the containers for pending registrations. */
+static void BenchmarkRegistrations(int num_objects) {
+  typedef map<ObjectIdP, RegistrationP::OpType, ProtoCompareLess> ProtoMap;
+  typedef map<string, RegistrationP::OpType> KeyMap;
+  typedef hash_map<string, RegistrationP::OpType, StringHash> KeyHashMap;
+
+  vector<ObjectIdP> object_ids;
+  MakeObjectIds(num_objects, &object_ids);
+  vector<string> keys(object_ids.size());
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    GetObjectIdKey(object_ids[i], &keys[i]);
+  }
+  RunBenchmark<ProtoMap>("Registrations: map<ObjectIdP, ProtoCompareLess>",
+                         object_ids, true);
+  RunKeyedBenchmark<KeyMap>("Registrations: map<key>, keys on insert",
+                            object_ids, &GetObjectIdKey);
+  RunBenchmark<KeyMap>("Registrations: map<key>, precomputed keys", keys,
+                       true);
+  RunBenchmark<KeyHashMap>("Registrations: hash_map<key>, precomputed keys",
+                           keys, false);
+}
+
+/* Benchmarks the containers for pending acknowledgements. */
+static void BenchmarkAcks(int num_invalidations) {
+  typedef map<InvalidationP, Time, ProtoCompareLess> ProtoMap;
+  typedef map<string, Time> KeyMap;
+  typedef hash_map<string, Time, StringHash> KeyHashMap;
+
+  vector<ObjectIdP> object_ids;
+  MakeObjectIds(num_invalidations, &object_ids);
+  vector<InvalidationP> invalidations(object_ids.size());
+  vector<string> keys(object_ids.size());
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    invalidations[i].mutable_object_id()->CopyFrom(object_ids[i]);
+    invalidations[i].set_is_known_version(true);
+    invalidations[i].set_version(1000 + i);
+    GetInvalidationKey(invalidations[i], &keys[i]);
+  }
+  RunBenchmark<ProtoMap>("Acks: map<InvalidationP, ProtoCompareLess>",
+                         invalidations, true);
+  RunKeyedBenchmark<KeyMap>("Acks: map<key>, keys on insert", invalidations,
+                            &GetInvalidationKey);
+  RunBenchmark<KeyMap>("Acks: map<key>, precomputed keys", keys, true);
+  RunBenchmark<KeyHashMap>("Acks: hash_map<key>, precomputed keys", keys,
+                           false);
+}
+
+/* Benchmarks the containers for pending registration subtrees. The subtrees
+ * all cover the same range and hold the same number of objects, differing
+ * only in their last object, which is the worst case for ProtoCompareLess.
+ */
+static void BenchmarkSubtrees(int num_subtrees, int objects_per_subtree) {
+  typedef set<RegistrationSubtree, ProtoCompareLess> ProtoSet;
+  typedef set<string> KeySet;
+
+  vector<ObjectIdP> object_ids;
+  MakeObjectIds(objects_per_subtree + num_subtrees, &object_ids);
+  vector<RegistrationSubtree> subtrees(num_subtrees);
+  vector<string> keys(num_subtrees);
+  for (int i = 0; i < num_subtrees; ++i) {
+    subtrees[i].set_prefix_len(4);
+    subtrees[i].set_digest_prefix(string(1, '\x05'));
+    for (int j = 0; j < objects_per_subtree - 1; ++j) {
+      subtrees[i].add_registered_object()->CopyFrom(object_ids[j]);
+    }
+    subtrees[i].add_registered_object()->CopyFrom(
+        object_ids[objects_per_subtree + i]);
+    subtrees[i].SerializeToString(&keys[i]);
+  }
+  string name = StringPrintf(
+      "Subtrees of %d: set<ProtoCompareLess>", objects_per_subtree);
+  RunBenchmark<ProtoSet>(name.c_str(), subtrees, true);
+  name = StringPrintf(
+      "Subtrees of %d: set<serialized>, precomputed", objects_per_subtree);
+  RunBenchmark<KeySet>(name.c_str(), keys, true);
+}
+
+}  // namespace invalidation
+
+int main(int argc, char** argv) {
+  const int kBatchSizes[] = { 10, 100, 1000, 10000 };
+  for (size_t i = 0; i < sizeof(kBatchSizes) / sizeof(kBatchSizes[0]); ++i) {
+    invalidation::BenchmarkRegistrations(kBatchSizes[i]);
+  }
+  for (size_t i = 0; i < sizeof(kBatchSizes) / sizeof(kBatchSizes[0]); ++i) {
+    invalidation::BenchmarkAcks(kBatchSizes[i]);
+  }
+  // A registration sync has a few subtrees pending at a time, each of up to
+  // the maximum subtree size.
+  const int kSubtreeSizes[] = { 10, 100, 1000 };
+  for (size_t i = 0; i < sizeof(kSubtreeSizes) / sizeof(kSubtreeSizes[0]);
+       ++i) {
+    invalidation::BenchmarkSubtrees(4, kSubtreeSizes[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,131 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the conversion of object ids and invalidations, and the sharing of
+// invalidation payloads.
+
+#include <string>
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/proto-converter.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+
+/* Returns an invalidation message with a payload of payload_size bytes. */
+static InvalidationP MakeInvalidationProto(int payload_size) {
+  InvalidationP proto;
+  proto.mutable_object_id()->set_source(4);
+  proto.mutable_object_id()->set_name("object");
+  proto.set_is_known_version(true);
+  proto.set_version(7);
+  proto.set_payload(string(payload_size, 'p'));
+  return proto;
+}
+
+/* Checks that taking the payload converts like copying it, and leaves the
+ * message without it.
+ */
+TEST(ProtoConverterTest, TakesPayload) {
+  InvalidationP proto = MakeInvalidationProto(50000);
+  Invalidation copied;
+  ProtoConverter::ConvertFromInvalidationProto(proto, &copied);
+  Invalidation taken;
+  ProtoConverter::ConvertFromInvalidationProtoTakingPayload(&proto, &taken);
+  ASSERT_TRUE(copied == taken);
+  ASSERT_EQ(50000, static_cast<int>(taken.payload().size()));
+  ASSERT_TRUE(proto.payload().empty());
+
+  InvalidationP without_payload = MakeInvalidationProto(0);
+  without_payload.clear_payload();
+  ProtoConverter::ConvertFromInvalidationProtoTakingPayload(
+      &without_payload, &taken);
+  ASSERT_FALSE(taken.has_payload());
+  ASSERT_TRUE(taken.payload().empty());
+}
+
+/* Checks that copies of an invalidation share its payload, which outlives
+ * the original.
+ */
+TEST(ProtoConverterTest, SharesPayloadBetweenCopies) {
+  InvalidationP proto = MakeInvalidationProto(100);
+  Invalidation* original = new Invalidation();
+  ProtoConverter::ConvertFromInvalidationProtoTakingPayload(&proto, original);
+  Invalidation copy(*original);
+  Invalidation assigned;
+  assigned = copy;
+  ASSERT_EQ(&original->payload(), &copy.payload());
+  ASSERT_EQ(&original->payload(), &assigned.payload());
+  delete original;
+  ASSERT_EQ(string(100, 'p'), copy.payload());
+
+  // Re-initializing a copy does not affect the others.
+  copy.Init(copy.object_id(), 8, "other");
+  ASSERT_EQ(string(100, 'p'), assigned.payload());
+  ASSERT_EQ("other", copy.payload());
+}
+
+/* Checks that a payload reference survives the conversions both ways and is
+ * cleared when the invalidation is re-initialized.
+ */
+TEST(ProtoConverterTest, ConvertsPayloadReference) {
+  InvalidationP proto = MakeInvalidationProto(0);
+  proto.clear_payload();
+  proto.set_payload_reference("reference");
+  Invalidation taken;
+  ProtoConverter::ConvertFromInvalidationProtoTakingPayload(&proto, &taken);
+  ASSERT_FALSE(taken.has_payload());
+  ASSERT_TRUE(taken.has_payload_reference());
+  ASSERT_EQ("reference", taken.payload_reference());
+
+  Invalidation copied;
+  ProtoConverter::ConvertFromInvalidationProto(proto, &copied);
+  ASSERT_TRUE(copied == taken);
+  InvalidationP converted;
+  ProtoConverter::ConvertToInvalidationProto(copied, &converted);
+  ASSERT_EQ("reference", converted.payload_reference());
+  ASSERT_FALSE(converted.has_payload());
+
+  copied.Init(copied.object_id(), 8);
+  ASSERT_FALSE(copied.has_payload_reference());
+  ASSERT_FALSE(copied == taken);
+}
+
+/* Checks that converted object ids hash and order consistently. */
+TEST(ProtoConverterTest, HashesObjectIds) {
+  ObjectIdP proto;
+  proto.set_source(4);
+  proto.set_name("object");
+  ObjectId converted;
+  ProtoConverter::ConvertFromObjectIdProto(proto, &converted);
+  ObjectId constructed(4, "object");
+  ASSERT_TRUE(converted == constructed);
+  ASSERT_EQ(constructed.hash(), converted.hash());
+  ASSERT_EQ(ObjectIdHash()(constructed), ObjectIdHash()(converted));
+
+  ObjectId other_source(5, "object");
+  ObjectId other_name(4, "objecu");
+  ASSERT_NE(constructed.hash(), other_source.hash());
+  ASSERT_NE(constructed.hash(), other_name.hash());
+  ASSERT_FALSE(constructed == other_name);
+
+  ObjectIdLess less;
+  ASSERT_FALSE(less(constructed, converted));
+  ASSERT_FALSE(less(converted, constructed));
+  ASSERT_TRUE(less(constructed, other_name) != less(other_name, constructed));
+}
+
+}  // namespace invalidation
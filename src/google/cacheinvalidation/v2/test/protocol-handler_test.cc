@@ -0,0 +1,276 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the pipelining of messages: the window of unacknowledged messages,
+// their acks and their retransmission.
+
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/constants.h"
+#include "google/cacheinvalidation/v2/protocol-handler.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/statistics.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/v2/test/fake-invalidation-server.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+#include "google/cacheinvalidation/v2/ticl-message-validator.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Protocol listener with a fixed token and registration summary, which ignores
+ * the messages from the server.
+ */
+class TokenHoldingListener : public ProtocolListener {
+ public:
+  virtual void HandleIncomingHeader(const ServerMessageHeader& header) {}
+
+  virtual void HandleTokenChanged(const ServerMessageHeader& header,
+                                  const string& new_token) {}
+
+  virtual void HandleInvalidations(
+      const ServerMessageHeader& header,
+      RepeatedPtrField<InvalidationP>* invalidations) {}
+
+  virtual void HandleRegistrationStatus(
+      const ServerMessageHeader& header,
+      const RepeatedPtrField<RegistrationStatus>& reg_status) {}
+
+  virtual void HandleRegistrationSyncRequest(
+      const ServerMessageHeader& header) {}
+
+  virtual void HandleInfoMessage(const ServerMessageHeader& header,
+                                 const RepeatedField<int>& info_types) {}
+
+  virtual void HandleErrorMessage(const ServerMessageHeader& header,
+                                  const ErrorMessage::Code code,
+                                  const string& description) {}
+
+  virtual void HandlePayloads(const ServerMessageHeader& header,
+                              RepeatedPtrField<PayloadP>* payloads) {}
+
+  virtual void GetRegistrationSummary(RegistrationSummary* summary) {
+    summary->set_num_registrations(0);
+    summary->set_registration_digest("digest");
+  }
+
+  virtual string GetClientToken() {
+    return "token";
+  }
+
+  virtual void HandleNetworkStatusChange(bool is_online) {}
+
+  virtual void HandleConfigChange(const ConfigChangeMessage& config_change) {}
+};
+
+class ProtocolHandlerTest : public testing::Test {
+ public:
+  ProtocolHandlerTest() : validator_(&logger_) {}
+
+  virtual void SetUp() {
+    scheduler_.StartScheduler();
+    resources_.reset(
+        new LoadClientResources(&logger_, &scheduler_, &channel_));
+    resources_->Start();
+    config_.rate_limits.clear();
+    config_.max_messages_in_flight = 2;
+    config_.message_ack_timeout = TimeDelta::FromMilliseconds(kAckTimeoutMs);
+  }
+
+  virtual void TearDown() {
+    scheduler_.StopScheduler();
+  }
+
+  /* Creates the protocol handler with config_. */
+  void CreateHandler() {
+    handler_.reset(new ProtocolHandler(
+        config_, resources_.get(), &statistics_, "ProtocolHandlerTest",
+        &listener_, &validator_, NULL));
+  }
+
+  /* (Un)registers the objects with names, on the internal thread. */
+  void SendRegistrations(const vector<string>& names,
+                         RegistrationP::OpType op_type) {
+    vector<ObjectIdP> object_ids(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+      object_ids[i].set_source(ObjectSource_Type_TEST);
+      object_ids[i].set_name(names[i]);
+    }
+    scheduler_.Schedule(Scheduler::NoDelay(), NewPermanentCallback(
+        handler_.get(), &ProtocolHandler::SendRegistrations, object_ids,
+        op_type));
+    scheduler_.RunReadyTasks();
+  }
+
+  /* Like SendRegistrations, for a single object. */
+  void SendRegistration(const string& name, RegistrationP::OpType op_type) {
+    SendRegistrations(vector<string>(1, name), op_type);
+  }
+
+  /* Advances the simulated time by duration_ms, running the tasks that
+   * become due.
+   */
+  void RunFor(int duration_ms) {
+    for (int elapsed_ms = 0; elapsed_ms < duration_ms;
+         elapsed_ms += kTickMs) {
+      scheduler_.ModifyTime(TimeDelta::FromMilliseconds(kTickMs));
+      scheduler_.RunReadyTasks();
+    }
+  }
+
+  /* Runs past the batching delay, smeared, so that a message is sent for the
+   * pending operations unless held back.
+   */
+  void RunBatchingDelay() {
+    RunFor(2 * config_.batching_delay.InMilliseconds());
+  }
+
+  /* Acknowledges the message with message_id from the server. */
+  void AcknowledgeMessage(const string& message_id) {
+    ServerToClientMessage message;
+    ServerHeader* header = message.mutable_header();
+    Version* version = header->mutable_protocol_version()->mutable_version();
+    version->set_major_version(Constants::kProtocolMajorVersion);
+    version->set_minor_version(Constants::kProtocolMinorVersion);
+    header->set_client_token("token");
+    header->set_server_time_ms(
+        InvalidationClientUtil::GetCurrentTimeMs(&scheduler_));
+    listener_.GetRegistrationSummary(header->mutable_registration_summary());
+    header->add_acked_message_id(message_id);
+    channel_.Deliver(message);
+    scheduler_.RunReadyTasks();
+  }
+
+  /* Returns the index-th message sent by the handler. */
+  ClientToServerMessage GetSentMessage(size_t index) {
+    ClientToServerMessage message;
+    CHECK(message.ParseFromString(channel_.sent_messages[index]));
+    return message;
+  }
+
+  static const int kTickMs = 10;
+  static const int kAckTimeoutMs = 2000;
+
+  NullLogger logger_;
+  DeterministicScheduler scheduler_;
+  ScriptedNetworkChannel channel_;
+  scoped_ptr<LoadClientResources> resources_;
+  Statistics statistics_;
+  TiclMessageValidator validator_;
+  TokenHoldingListener listener_;
+  ProtocolHandler::Config config_;
+  scoped_ptr<ProtocolHandler> handler_;
+};
+
+/* Tests that a message is held back while the window is full, and sent once
+ * an ack frees it.
+ */
+TEST_F(ProtocolHandlerTest, DefersMessagesWhileWindowFull) {
+  config_.max_messages_in_flight = 1;
+  CreateHandler();
+  SendRegistration("a", RegistrationP_OpType_REGISTER);
+  RunBatchingDelay();
+  ASSERT_EQ(1, channel_.sent_messages.size());
+
+  SendRegistration("b", RegistrationP_OpType_REGISTER);
+  RunBatchingDelay();
+  EXPECT_EQ(1, channel_.sent_messages.size());
+
+  AcknowledgeMessage(GetSentMessage(0).header().message_id());
+  ASSERT_EQ(2, channel_.sent_messages.size());
+  ClientToServerMessage message = GetSentMessage(1);
+  ASSERT_EQ(1, message.registration_message().registration_size());
+  EXPECT_EQ("b", message.registration_message().registration(0).
+            object_id().name());
+}
+
+/* Tests that an acknowledged message is no longer resent. */
+TEST_F(ProtocolHandlerTest, StopsTrackingAcknowledgedMessages) {
+  CreateHandler();
+  SendRegistration("a", RegistrationP_OpType_REGISTER);
+  RunBatchingDelay();
+  ASSERT_EQ(1, channel_.sent_messages.size());
+  EXPECT_TRUE(handler_->HasMessagesInFlight());
+
+  AcknowledgeMessage(GetSentMessage(0).header().message_id());
+  EXPECT_FALSE(handler_->HasMessagesInFlight());
+  RunFor(2 * kAckTimeoutMs);
+  EXPECT_EQ(1, channel_.sent_messages.size());
+}
+
+/* Tests that a message still unacknowledged after message_ack_timeout is
+ * resent as it was.
+ */
+TEST_F(ProtocolHandlerTest, ResendsAfterAckTimeout) {
+  CreateHandler();
+  SendRegistration("a", RegistrationP_OpType_REGISTER);
+  RunBatchingDelay();
+  ASSERT_EQ(1, channel_.sent_messages.size());
+
+  RunFor(kAckTimeoutMs - 2 * config_.batching_delay.InMilliseconds() -
+         kTickMs);
+  EXPECT_EQ(1, channel_.sent_messages.size());
+  RunFor(kAckTimeoutMs);
+  ASSERT_EQ(2, channel_.sent_messages.size());
+  EXPECT_EQ(channel_.sent_messages[0], channel_.sent_messages[1]);
+}
+
+/* Tests that a message is given up on after kMaxMessageRetransmissions
+ * resends.
+ */
+TEST_F(ProtocolHandlerTest, GivesUpAfterMaxRetransmissions) {
+  CreateHandler();
+  SendRegistration("a", RegistrationP_OpType_REGISTER);
+  RunBatchingDelay();
+  RunFor((ProtocolHandler::kMaxMessageRetransmissions + 2) * kAckTimeoutMs);
+  EXPECT_EQ(1 + ProtocolHandler::kMaxMessageRetransmissions,
+            channel_.sent_messages.size());
+  EXPECT_FALSE(handler_->HasMessagesInFlight());
+}
+
+/* Tests that a resent message leaves out the registrations that a later
+ * message changed, so that it cannot undo them at the server.
+ */
+TEST_F(ProtocolHandlerTest, ResendOmitsSupersededRegistrations) {
+  CreateHandler();
+  vector<string> names;
+  names.push_back("a");
+  names.push_back("b");
+  SendRegistrations(names, RegistrationP_OpType_REGISTER);
+  RunBatchingDelay();
+  SendRegistration("a", RegistrationP_OpType_UNREGISTER);
+  RunBatchingDelay();
+  ASSERT_EQ(2, channel_.sent_messages.size());
+  AcknowledgeMessage(GetSentMessage(1).header().message_id());
+
+  RunFor(kAckTimeoutMs);
+  ASSERT_EQ(3, channel_.sent_messages.size());
+  ClientToServerMessage resent = GetSentMessage(2);
+  EXPECT_EQ(GetSentMessage(0).header().message_id(),
+            resent.header().message_id());
+  ASSERT_EQ(1, resent.registration_message().registration_size());
+  EXPECT_EQ("b", resent.registration_message().registration(0).
+            object_id().name());
+  EXPECT_EQ(RegistrationP_OpType_REGISTER,
+            resent.registration_message().registration(0).op_type());
+}
+
+}  // namespace invalidation
@@ -0,0 +1,276 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks the registration path of the Ticl over each registration store:
+// bulk registration, interleaved register/unregister churn and a full
+// registration sync. The registration manager and log run on a
+// DeterministicScheduler over in-memory storage, and the sync subtrees are
+// serialized as they would be for the network, so the measurements are the
+// CPU cost of the client alone.
+//
+// Prints one line per store, benchmark and number of objects with the wall
+// and CPU time per operation.
+
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/random.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/compact-registration-store.h"
+#include "google/cacheinvalidation/v2/merkle-trie-registration-store.h"
+#include "google/cacheinvalidation/v2/partitioned-registration-store.h"
+#include "google/cacheinvalidation/v2/registration-log.h"
+#include "google/cacheinvalidation/v2/registration-manager.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/sha1-digest-function.h"
+#include "google/cacheinvalidation/v2/simple-registration-store.h"
+#include "google/cacheinvalidation/v2/statistics.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/v2/test/stopwatch.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Network fake that serializes the messages given to it and counts them. */
+class CountingNetwork {
+ public:
+  CountingNetwork() : num_messages_(0), num_bytes_(0) {}
+
+  void Send(const RegistrationSubtree& subtree) {
+    subtree.SerializeToString(&buffer_);
+    ++num_messages_;
+    num_bytes_ += buffer_.size();
+  }
+
+  int num_messages() const { return num_messages_; }
+  int64 num_bytes() const { return num_bytes_; }
+
+ private:
+  /* Reused serialization buffer. */
+  string buffer_;
+  int num_messages_;
+  int64 num_bytes_;
+};
+
+/* The registration stores to compare. */
+enum StoreType {
+  SIMPLE_STORE,
+  COMPACT_STORE,
+  MERKLE_TRIE_STORE,
+  PARTITIONED_STORE
+};
+
+static const char* kStoreNames[] = {
+  "Simple",
+  "Compact",
+  "MerkleTrie",
+  "Partitioned"
+};
+
+class RegistrationChurnBenchmark {
+ public:
+  /* Objects per call to PerformOperations, as an application registering in
+   * bulk would pass them.
+   */
+  static const int kBatchSize = 100;
+
+  /* Maximum number of objects per sync subtree, as in the default Config. */
+  static const int kMaxSyncSubtreeSize = 1000;
+
+  /* Registration log compaction threshold, as in the default Config. */
+  static const int kCompactionThreshold = 100;
+
+  /* Number of levels of the Merkle trie, as in the RegistrationManager. */
+  static const int kMerkleTrieLevels = 8;
+
+  RegistrationChurnBenchmark(StoreType store_type, int num_objects)
+      : store_type_(store_type), num_objects_(num_objects) {
+    scheduler_.StartScheduler();
+    manager_.reset(
+        new RegistrationManager(&logger_, &statistics_, &digest_fn_));
+    manager_->SetDigestStore(NewStore());
+    log_.reset(new RegistrationLog(
+        &storage_, &scheduler_, &logger_, &statistics_, kCompactionThreshold,
+        new ExponentialBackoffDelayGenerator(
+            new Random(0), TimeDelta::FromSeconds(100),
+            TimeDelta::FromSeconds(10)),
+        TimeDelta::FromSeconds(10)));
+    manager_->EnableRegistrationLog(log_.get());
+    RunOnInternalThread(NewPermanentCallback(
+        log_.get(), &RegistrationLog::Load,
+        NewPermanentCallback(&DoNothing)));
+    RunOnInternalThread(NewPermanentCallback(
+        manager_.get(), &RegistrationManager::DiscardRestoredRegistrations));
+
+    // Create twice as many objects as registered, for the churn to register.
+    for (int i = 0; i < 2 * num_objects; ++i) {
+      ObjectIdP oid;
+      oid.set_source(ObjectSource_Type_TEST);
+      oid.set_name(StringPrintf("user/%d/object-%d", i % 1000, i));
+      oids_.push_back(oid);
+    }
+  }
+
+  /* Registers the first num_objects objects in batches. */
+  void BulkRegister() {
+    Stopwatch stopwatch;
+    stopwatch.Start();
+    PerformOperations(0, num_objects_, RegistrationP_OpType_REGISTER);
+    Report("BulkRegister", num_objects_, &stopwatch, 0);
+  }
+
+  /* Replaces each registered object by a new one, alternating a batch of
+   * registrations with a batch of unregistrations.
+   *
+   * REQUIRES: BulkRegister has run.
+   */
+  void Churn() {
+    Stopwatch stopwatch;
+    stopwatch.Start();
+    for (int begin = 0; begin < num_objects_; begin += kBatchSize) {
+      int end = begin + kBatchSize < num_objects_ ?
+          begin + kBatchSize : num_objects_;
+      PerformOperations(num_objects_ + begin, num_objects_ + end,
+                        RegistrationP_OpType_REGISTER);
+      PerformOperations(begin, end, RegistrationP_OpType_UNREGISTER);
+    }
+    Report("Churn", 2 * num_objects_, &stopwatch, 0);
+  }
+
+  /* Streams all the registrations to the network, as for a registration sync
+   * request from a server that knows none of them.
+   */
+  void FullSync() {
+    Stopwatch stopwatch;
+    stopwatch.Start();
+    RunOnInternalThread(NewPermanentCallback(
+        this, &RegistrationChurnBenchmark::SyncAllSubtrees));
+    Report("FullSync", num_objects_, &stopwatch, network_.num_bytes());
+  }
+
+ private:
+  DigestStore<ObjectIdP>* NewStore() {
+    switch (store_type_) {
+      case SIMPLE_STORE:
+        return new SimpleRegistrationStore(&digest_fn_);
+      case COMPACT_STORE:
+        return new CompactRegistrationStore(&digest_fn_);
+      case MERKLE_TRIE_STORE:
+        return new MerkleTrieRegistrationStore(&digest_fn_,
+                                               kMerkleTrieLevels);
+      case PARTITIONED_STORE:
+        return new PartitionedRegistrationStore(&digest_fn_);
+    }
+    CHECK(false) << "Unknown store type: " << store_type_;
+    return NULL;
+  }
+
+  /* Runs task on the internal thread. */
+  void RunOnInternalThread(Closure* task) {
+    scheduler_.Schedule(Scheduler::NoDelay(), task);
+    scheduler_.RunReadyTasks();
+  }
+
+  /* Performs reg_op_type on the objects with indices [begin, end), in
+   * batches of kBatchSize, one internal task per batch.
+   */
+  void PerformOperations(int begin, int end,
+                         RegistrationP::OpType reg_op_type) {
+    // Picks the overload without digests.
+    void (RegistrationManager::*perform_operations)(
+        const vector<ObjectIdP>&, RegistrationP::OpType) =
+        &RegistrationManager::PerformOperations;
+    for (int batch_begin = begin; batch_begin < end;
+         batch_begin += kBatchSize) {
+      int batch_end = batch_begin + kBatchSize < end ?
+          batch_begin + kBatchSize : end;
+      vector<ObjectIdP> batch(oids_.begin() + batch_begin,
+                              oids_.begin() + batch_end);
+      RunOnInternalThread(NewPermanentCallback(
+          manager_.get(), perform_operations, batch, reg_op_type));
+    }
+  }
+
+  /* Sends every subtree of a registration sync against an empty server
+   * summary.
+   */
+  void SyncAllSubtrees() {
+    RegistrationSummary empty_summary;
+    manager_->StartRegistrationSync(kMaxSyncSubtreeSize, empty_summary);
+    while (manager_->HasPendingRegistrationSync()) {
+      RegistrationSubtree subtree;
+      manager_->GetNextRegistrationSyncSubtree(&subtree);
+      network_.Send(subtree);
+    }
+  }
+
+  /* Prints the times since stopwatch was started for num_ops operations. */
+  void Report(const char* benchmark, int num_ops, Stopwatch* stopwatch,
+              int64 bytes_sent) {
+    int64 wall_ns, cpu_ns;
+    stopwatch->Stop(&wall_ns, &cpu_ns);
+    printf("%-10s %-12s %7d objects: %9.2f ms wall, %8lld ns CPU/op",
+           kStoreNames[store_type_], benchmark, num_objects_,
+           wall_ns / 1e6, static_cast<long long>(cpu_ns / num_ops));
+    if (bytes_sent > 0) {
+      printf(", %lld bytes in %d messages",
+             static_cast<long long>(bytes_sent), network_.num_messages());
+    }
+    printf("\n");
+  }
+
+  StoreType store_type_;
+  int num_objects_;
+  NullLogger logger_;
+  Statistics statistics_;
+  Sha1DigestFunction digest_fn_;
+  DeterministicScheduler scheduler_;
+  MemoryStorage storage_;
+  CountingNetwork network_;
+  scoped_ptr<RegistrationManager> manager_;
+  scoped_ptr<RegistrationLog> log_;
+  vector<ObjectIdP> oids_;
+};
+
+}  // namespace invalidation
+
+int main(int argc, char** argv) {
+  using invalidation::RegistrationChurnBenchmark;
+  using invalidation::StoreType;
+  const int kNumObjects[] = { 1000, 10000, 100000 };
+  for (int store = invalidation::SIMPLE_STORE;
+       store <= invalidation::PARTITIONED_STORE; ++store) {
+    for (size_t i = 0; i < sizeof(kNumObjects) / sizeof(kNumObjects[0]);
+         ++i) {
+      // Each size gets a fresh manager; the churn and sync run over the
+      // registrations left by the benchmarks before them.
+      RegistrationChurnBenchmark benchmark(static_cast<StoreType>(store),
+                                           kNumObjects[i]);
+      benchmark.BulkRegister();
+      benchmark.Churn();
+      benchmark.FullSync();
+    }
+  }
+  return 0;
+}
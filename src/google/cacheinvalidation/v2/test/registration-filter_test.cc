@@ -0,0 +1,73 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the registration filter.
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/registration-filter.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+
+namespace invalidation {
+
+class RegistrationFilterTest : public testing::Test {
+ public:
+  void SetUp() {
+    for (int i = 0; i < 2 * kNumObjects; ++i) {
+      ObjectIdP oid;
+      oid.set_source(ObjectSource_Type_TEST);
+      oid.set_name(StringPrintf("object-%d", i));
+      oids_.push_back(oid);
+    }
+  }
+
+  vector<ObjectIdP> oids_;
+
+  static const int kNumObjects;
+};
+
+const int RegistrationFilterTest::kNumObjects = 1000;
+
+/* Checks that added objects are always reported, and that few of the others
+ * are while the filter is within its capacity.
+ */
+TEST_F(RegistrationFilterTest, NoFalseNegatives) {
+  RegistrationFilter filter(kNumObjects);
+  for (int i = 0; i < kNumObjects; ++i) {
+    ASSERT_FALSE(filter.MightContain(oids_[i]));
+  }
+  for (int i = 0; i < kNumObjects; ++i) {
+    filter.Add(oids_[i]);
+  }
+  ASSERT_EQ(kNumObjects, filter.num_added());
+  for (int i = 0; i < kNumObjects; ++i) {
+    ASSERT_TRUE(filter.MightContain(oids_[i])) << i;
+  }
+  int num_false_positives = 0;
+  for (int i = kNumObjects; i < 2 * kNumObjects; ++i) {
+    if (filter.MightContain(oids_[i])) {
+      ++num_false_positives;
+    }
+  }
+  ASSERT_LE(num_false_positives, kNumObjects / 50);
+
+  // The same name with a different source is a different object.
+  ObjectIdP other_source = oids_[0];
+  other_source.set_source(ObjectSource_Type_TEST + 1);
+  filter.Clear();
+  filter.Add(oids_[0]);
+  ASSERT_FALSE(filter.MightContain(other_source));
+  ASSERT_EQ(1, filter.num_added());
+}
+
+}  // namespace invalidation
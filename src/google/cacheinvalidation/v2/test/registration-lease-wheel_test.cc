@@ -0,0 +1,98 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the timing wheel of registration leases.
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/registration-lease-wheel.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+
+namespace invalidation {
+
+class RegistrationLeaseWheelTest : public testing::Test {
+ public:
+  void SetUp() {
+    for (int i = 0; i < kNumObjects; ++i) {
+      ObjectIdP oid;
+      oid.set_source(ObjectSource_Type_TEST);
+      oid.set_name(StringPrintf("object-%d", i));
+      oids_.push_back(oid);
+    }
+  }
+
+  /* Returns the objects in [begin, end). */
+  vector<ObjectIdP> GetObjects(int begin, int end) {
+    return vector<ObjectIdP>(oids_.begin() + begin, oids_.begin() + end);
+  }
+
+  vector<ObjectIdP> oids_;
+
+  static const int kNumObjects;
+  static const int64 kLeaseMs;
+};
+
+const int RegistrationLeaseWheelTest::kNumObjects = 10;
+const int64 RegistrationLeaseWheelTest::kLeaseMs = 63000;
+
+/* Checks that leases expire one lease after they were last renewed, within a
+ * tick, and that removed leases do not.
+ */
+TEST_F(RegistrationLeaseWheelTest, ExpiresUnrenewedLeases) {
+  RegistrationLeaseWheel wheel(kLeaseMs, 0);
+  ASSERT_EQ(1000, wheel.tick_ms());
+  wheel.Renew(GetObjects(0, 6), 0);
+  wheel.Remove(GetObjects(4, 5));
+  wheel.Renew(GetObjects(0, 2), kLeaseMs / 2);
+  ASSERT_EQ(5, wheel.size());
+
+  vector<ObjectIdP> expired;
+  wheel.Advance(kLeaseMs - wheel.tick_ms(), &expired);
+  ASSERT_TRUE(expired.empty());
+  wheel.Advance(kLeaseMs + wheel.tick_ms(), &expired);
+  ASSERT_EQ(3, static_cast<int>(expired.size()));
+  ASSERT_EQ(oids_[2].name(), expired[0].name());
+  ASSERT_EQ(oids_[5].name(), expired[2].name());
+  ASSERT_EQ(2, wheel.size());
+
+  expired.clear();
+  wheel.Advance(kLeaseMs / 2 + kLeaseMs + wheel.tick_ms(), &expired);
+  ASSERT_EQ(2, static_cast<int>(expired.size()));
+  ASSERT_EQ(0, wheel.size());
+}
+
+/* Checks that leases still expire, once, when the wheel is advanced after a
+ * pause of several turns, and that the ones due later survive it.
+ */
+TEST_F(RegistrationLeaseWheelTest, CatchesUpAfterPause) {
+  RegistrationLeaseWheel wheel(kLeaseMs, 0);
+  wheel.Renew(GetObjects(0, 5), 0);
+  vector<ObjectIdP> expired;
+  wheel.Advance(10 * kLeaseMs, &expired);
+  ASSERT_EQ(5, static_cast<int>(expired.size()));
+
+  wheel.Renew(GetObjects(5, 10), 10 * kLeaseMs);
+  wheel.Renew(GetObjects(5, 6), 10 * kLeaseMs + 3 * wheel.tick_ms());
+  expired.clear();
+  wheel.Advance(30 * kLeaseMs + 5 * wheel.tick_ms(), &expired);
+  ASSERT_EQ(5, static_cast<int>(expired.size()));
+  ASSERT_EQ(0, wheel.size());
+
+  wheel.Clear();
+  wheel.Renew(GetObjects(0, 1), 40 * kLeaseMs);
+  expired.clear();
+  wheel.Advance(41 * kLeaseMs + wheel.tick_ms(), &expired);
+  ASSERT_EQ(1, static_cast<int>(expired.size()));
+}
+
+}  // namespace invalidation
@@ -0,0 +1,207 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the persistence of the desired registrations through the registration
+// log.
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/random.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/registration-log.h"
+#include "google/cacheinvalidation/v2/registration-manager.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/sha1-digest-function.h"
+#include "google/cacheinvalidation/v2/statistics.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+class RegistrationLogTest : public testing::Test {
+ public:
+  void SetUp() {
+    scheduler_.StartScheduler();
+    for (int i = 0; i < 4; ++i) {
+      ObjectIdP oid;
+      oid.set_source(ObjectSource_Type_TEST);
+      oid.set_name(StringPrintf("object-%d", i));
+      oids_.push_back(oid);
+    }
+  }
+
+  /* Creates a registration manager and log, as a restarted client would, and
+   * loads the log.
+   */
+  void Restart() {
+    manager_.reset(
+        new RegistrationManager(&logger_, &statistics_, &digest_fn_));
+    log_.reset(new RegistrationLog(
+        &storage_, &scheduler_, &logger_, &statistics_,
+        kCompactionThreshold,
+        new ExponentialBackoffDelayGenerator(
+            new Random(0), TimeDelta::FromSeconds(100),
+            TimeDelta::FromSeconds(10)),
+        TimeDelta::FromSeconds(10)));
+    manager_->EnableRegistrationLog(log_.get());
+    RunOnInternalThread(NewPermanentCallback(
+        log_.get(), &RegistrationLog::Load,
+        NewPermanentCallback(&DoNothing)));
+  }
+
+  /* Runs task on the internal thread. */
+  void RunOnInternalThread(Closure* task) {
+    scheduler_.Schedule(Scheduler::NoDelay(), task);
+    scheduler_.RunReadyTasks();
+  }
+
+  /* Performs reg_op_type on the objects with indices [begin, end). */
+  void PerformOperations(int begin, int end,
+                         RegistrationP::OpType reg_op_type) {
+    vector<ObjectIdP> oids(oids_.begin() + begin, oids_.begin() + end);
+    // Picks the overload without digests.
+    void (RegistrationManager::*perform_operations)(
+        const vector<ObjectIdP>&, RegistrationP::OpType) =
+        &RegistrationManager::PerformOperations;
+    RunOnInternalThread(NewPermanentCallback(
+        manager_.get(), perform_operations, oids, reg_op_type));
+  }
+
+  /* Informs the manager that the server has all the desired registrations. */
+  void InformServerOfClientSummary() {
+    RegistrationSummary summary;
+    manager_->GetClientSummary(&summary);
+    manager_->InformServerRegistrationSummary(summary);
+  }
+
+  void RestoreRegistrations() {
+    restored_ = manager_->RestoreRegistrations();
+  }
+
+  /* Restores the registrations and returns whether they were restored. */
+  bool Restore() {
+    RunOnInternalThread(NewPermanentCallback(
+        this, &RegistrationLogTest::RestoreRegistrations));
+    return restored_;
+  }
+
+  /* Returns the number of log entries in storage. */
+  int GetNumStoredLogEntries() {
+    int num_entries = 0;
+    string prefix = RegistrationLog::kLogEntryKeyPrefix;
+    for (map<string, string>::iterator iter = storage_.values.begin();
+         iter != storage_.values.end(); ++iter) {
+      if (iter->first.compare(0, prefix.size(), prefix) == 0) {
+        ++num_entries;
+      }
+    }
+    return num_entries;
+  }
+
+  static const int kCompactionThreshold;
+
+  DeterministicScheduler scheduler_;
+  NullLogger logger_;
+  Statistics statistics_;
+  Sha1DigestFunction digest_fn_;
+  MemoryStorage storage_;
+  scoped_ptr<RegistrationLog> log_;
+  scoped_ptr<RegistrationManager> manager_;
+  vector<ObjectIdP> oids_;
+  bool restored_;
+};
+
+const int RegistrationLogTest::kCompactionThreshold = 3;
+
+/* Checks that a restarted client restores the registrations that the server
+ * was known to have, from the snapshot and the log entries after it.
+ */
+TEST_F(RegistrationLogTest, RestoresRegistrationsInSync) {
+  Restart();
+  ASSERT_FALSE(Restore());
+  PerformOperations(0, 3, RegistrationP_OpType_REGISTER);
+  PerformOperations(0, 1, RegistrationP_OpType_UNREGISTER);
+  RunOnInternalThread(NewPermanentCallback(
+      this, &RegistrationLogTest::InformServerOfClientSummary));
+  ASSERT_EQ(2, GetNumStoredLogEntries());
+
+  Restart();
+  ASSERT_TRUE(Restore());
+  ASSERT_TRUE(manager_->IsStateInSyncWithServer());
+  vector<ObjectIdP> registrations;
+  manager_->GetRegisteredObjectsForTest(&registrations);
+  ASSERT_EQ(2, static_cast<int>(registrations.size()));
+  RegistrationSummary summary;
+  manager_->GetClientSummary(&summary);
+  ASSERT_EQ(2, summary.num_registrations());
+}
+
+/* Checks that the log is replaced by a snapshot once it reaches the compaction
+ * threshold, and that the registrations are still restored.
+ */
+TEST_F(RegistrationLogTest, CompactsLog) {
+  Restart();
+  ASSERT_FALSE(Restore());
+  for (int i = 0; i < 4; ++i) {
+    PerformOperations(i, i + 1, RegistrationP_OpType_REGISTER);
+  }
+
+  // The snapshot written on the third entry covers the first three.
+  ASSERT_EQ(1, GetNumStoredLogEntries());
+  RunOnInternalThread(NewPermanentCallback(
+      this, &RegistrationLogTest::InformServerOfClientSummary));
+
+  Restart();
+  ASSERT_TRUE(Restore());
+  vector<ObjectIdP> registrations;
+  manager_->GetRegisteredObjectsForTest(&registrations);
+  ASSERT_EQ(4, static_cast<int>(registrations.size()));
+}
+
+/* Checks that registrations that do not match the persisted server summary
+ * are discarded, along with the persisted log.
+ */
+TEST_F(RegistrationLogTest, DiscardsRegistrationsNotInSync) {
+  Restart();
+  ASSERT_FALSE(Restore());
+  PerformOperations(0, 2, RegistrationP_OpType_REGISTER);
+  RunOnInternalThread(NewPermanentCallback(
+      this, &RegistrationLogTest::InformServerOfClientSummary));
+  PerformOperations(2, 3, RegistrationP_OpType_REGISTER);
+
+  Restart();
+  ASSERT_FALSE(Restore());
+  vector<ObjectIdP> registrations;
+  manager_->GetRegisteredObjectsForTest(&registrations);
+  ASSERT_TRUE(registrations.empty());
+  ASSERT_EQ(0, GetNumStoredLogEntries());
+
+  // The empty snapshot then matches the empty server summary.
+  RunOnInternalThread(NewPermanentCallback(
+      this, &RegistrationLogTest::InformServerOfClientSummary));
+  Restart();
+  ASSERT_TRUE(Restore());
+}
+
+}  // namespace invalidation
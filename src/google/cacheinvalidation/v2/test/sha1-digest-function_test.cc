@@ -0,0 +1,108 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the SHA1 digest function.
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/sha1-digest-function.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+
+namespace invalidation {
+
+class Sha1DigestFunctionTest : public testing::Test {
+ public:
+  /* Returns the digest of data, as lower-case hex. */
+  string HexDigest(const string& data) {
+    digest_function_.Reset();
+    digest_function_.Update(data);
+    return ToHex(digest_function_.GetDigest());
+  }
+
+  static string ToHex(const string& digest) {
+    string result;
+    for (size_t i = 0; i < digest.size(); ++i) {
+      result += StringPrintf("%02x", static_cast<unsigned char>(digest[i]));
+    }
+    return result;
+  }
+
+  Sha1DigestFunction digest_function_;
+};
+
+/* Checks the digests of the FIPS 180 test vectors, including messages whose
+ * padding does and does not spill into a second block.
+ */
+TEST_F(Sha1DigestFunctionTest, KnownDigests) {
+  ASSERT_EQ("da39a3ee5e6b4b0d3255bfef95601890afd80709", HexDigest(""));
+  ASSERT_EQ("a9993e364706816aba3e25717850c26c9cd0d89d", HexDigest("abc"));
+  ASSERT_EQ("84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+            HexDigest("abcdbcdecdefdefgefghfghighijhijkijkljklm"
+                      "klmnlmnomnopnopq"));
+  ASSERT_EQ("34aa973cd4c4daa4f61eeb2bdbad27316534016f",
+            HexDigest(string(1000000, 'a')));
+}
+
+/* Checks that splitting the input across calls to Update does not change the
+ * digest.
+ */
+TEST_F(Sha1DigestFunctionTest, IncrementalUpdate) {
+  string data;
+  for (int i = 0; i < 300; ++i) {
+    data += static_cast<char>(i * 7);
+  }
+  string expected = HexDigest(data);
+  for (size_t split = 0; split <= data.size(); split += 13) {
+    digest_function_.Reset();
+    digest_function_.Update(data.substr(0, split));
+    digest_function_.Update(string());
+    digest_function_.Update(data.substr(split));
+    ASSERT_EQ(expected, ToHex(digest_function_.GetDigest())) << split;
+  }
+}
+
+/* Checks that the pointer-based Update and the fixed-size GetDigest agree with
+ * the string-based ones.
+ */
+TEST_F(Sha1DigestFunctionTest, BufferInterface) {
+  string data = "The quick brown fox jumps over the lazy dog";
+  digest_function_.Reset();
+  digest_function_.Update(data.data(), 10);
+  digest_function_.Update(data.data() + 10, data.size() - 10);
+  char digest[DigestFunction::kMaxDigestSize];
+  int digest_size = digest_function_.GetDigest(digest, sizeof(digest));
+  ASSERT_EQ(Sha1DigestFunction::kDigestSize, digest_size);
+  ASSERT_EQ("2fd4e1c67a2d28fced849ee1bb76e7391b93eb12",
+            ToHex(string(digest, digest_size)));
+  ASSERT_EQ(HexDigest(data), ToHex(string(digest, digest_size)));
+}
+
+/* Checks that the batch entry point agrees with digesting each input on its
+ * own, for inputs on both sides of the single-block limit and for a number of
+ * inputs that does not fill the last batch.
+ */
+TEST_F(Sha1DigestFunctionTest, GetDigests) {
+  vector<string> inputs;
+  for (int i = 0; i < 150; ++i) {
+    inputs.push_back(string(i % 70, static_cast<char>('a' + i % 26)));
+  }
+  vector<string> digests;
+  digests.push_back("stale");
+  digest_function_.GetDigests(inputs, &digests);
+  ASSERT_EQ(inputs.size(), digests.size());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    ASSERT_EQ(HexDigest(inputs[i]), ToHex(digests[i])) << i;
+  }
+}
+
+}  // namespace invalidation
@@ -0,0 +1,175 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the pool of resources for many clients.
+
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/mutex.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/sharded-client-pool.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Network channel that drops the messages sent on it. */
+class NullChannel : public NetworkChannel {
+ public:
+  virtual void SendMessage(const string& outgoing_message) {}
+
+  virtual void SetMessageReceiver(MessageCallback* incoming_receiver) {
+    delete incoming_receiver;
+  }
+
+  virtual void AddNetworkStatusReceiver(
+      NetworkStatusCallback* network_status_receiver) {
+    delete network_status_receiver;
+  }
+};
+
+class ShardedClientPoolTest : public testing::Test {
+ public:
+  void SetUp() {
+    num_runs_ = 0;
+    ran_on_shard_thread_ = true;
+    pool_.reset(new ShardedClientPool(ShardedClientPool::Config(), &logger_,
+                                      &storage_, NULL));
+  }
+
+  void TearDown() {
+    pool_.reset();
+  }
+
+  void HandleWrite(Status status) {}
+
+  void HandleRead(StatusStringPair result) {
+    last_read_ = result.second;
+  }
+
+  void HandleKey(StatusStringPair result) {
+    keys_.push_back(result.second);
+  }
+
+  /* Notes whether the task runs on the internal thread of shard. */
+  void CheckShardThread(int shard) {
+    bool is_on_thread = pool_->internal_scheduler(shard)->IsRunningOnThread();
+    MutexLock m(&lock_);
+    ran_on_shard_thread_ = ran_on_shard_thread_ && is_on_thread;
+    ++num_runs_;
+  }
+
+  int num_runs() {
+    MutexLock m(&lock_);
+    return num_runs_;
+  }
+
+  NullLogger logger_;
+  MemoryStorage storage_;
+  scoped_ptr<ShardedClientPool> pool_;
+  string last_read_;
+  vector<string> keys_;
+
+  /* Lock for the fields below, which the shard threads update. */
+  Mutex lock_;
+  int num_runs_;
+  bool ran_on_shard_thread_;
+};
+
+/* Checks that clients are spread over the shards by name, and keep their
+ * shard in another pool.
+ */
+TEST_F(ShardedClientPoolTest, AssignsShardsByName) {
+  static const int kNumClients = 400;
+  ShardedClientPool other_pool(ShardedClientPool::Config(), &logger_,
+                               &storage_, NULL);
+  vector<int> shard_sizes(pool_->num_shards());
+  for (int i = 0; i < kNumClients; ++i) {
+    string name = StringPrintf("tenant-%d", i);
+    int shard = pool_->GetShard(name);
+    ASSERT_TRUE((shard >= 0) && (shard < pool_->num_shards()));
+    ASSERT_EQ(shard, other_pool.GetShard(name));
+    ++shard_sizes[shard];
+  }
+  for (size_t i = 0; i < shard_sizes.size(); ++i) {
+    ASSERT_TRUE(shard_sizes[i] > kNumClients / pool_->num_shards() / 2);
+  }
+}
+
+/* Checks that the clients share the storage without seeing each other's
+ * keys, even when a name is a prefix of another.
+ */
+TEST_F(ShardedClientPoolTest, KeepsClientKeysApart) {
+  NullChannel network;
+  scoped_ptr<SystemResources> first(
+      pool_->NewClientResources("a", &network));
+  scoped_ptr<SystemResources> second(
+      pool_->NewClientResources("a/b", &network));
+  first->storage()->WriteKey("b/key", "first", NewPermanentCallback(
+      this, &ShardedClientPoolTest::HandleWrite));
+  second->storage()->WriteKey("key", "second", NewPermanentCallback(
+      this, &ShardedClientPoolTest::HandleWrite));
+  ASSERT_EQ(2, static_cast<int>(storage_.values.size()));
+
+  first->storage()->ReadKey("b/key", NewPermanentCallback(
+      this, &ShardedClientPoolTest::HandleRead));
+  ASSERT_EQ("first", last_read_);
+  second->storage()->ReadKey("key", NewPermanentCallback(
+      this, &ShardedClientPoolTest::HandleRead));
+  ASSERT_EQ("second", last_read_);
+
+  first->storage()->ReadAllKeys(NewPermanentCallback(
+      this, &ShardedClientPoolTest::HandleKey));
+  ASSERT_EQ(1, static_cast<int>(keys_.size()));
+  ASSERT_EQ("b/key", keys_[0]);
+}
+
+/* Checks that the tasks of a client run on the internal thread of its
+ * shard.
+ */
+TEST_F(ShardedClientPoolTest, RunsClientsOnShardThreads) {
+  static const int kNumClients = 20;
+  NullChannel network;
+  vector<SystemResources*> clients;
+  for (int i = 0; i < kNumClients; ++i) {
+    string name = StringPrintf("tenant-%d", i);
+    clients.push_back(pool_->NewClientResources(name, &network));
+    clients[i]->internal_scheduler()->Schedule(
+        Scheduler::NoDelay(), NewPermanentCallback(
+            this, &ShardedClientPoolTest::CheckShardThread,
+            pool_->GetShard(name)));
+    ASSERT_TRUE(clients[i]->listener_scheduler() ==
+                pool_->listener_scheduler(pool_->GetShard(name)));
+  }
+  while (num_runs() < kNumClients) {
+    usleep(1000);
+  }
+  ASSERT_TRUE(ran_on_shard_thread_);
+  for (int i = 0; i < kNumClients; ++i) {
+    delete clients[i];
+  }
+}
+
+}  // namespace invalidation
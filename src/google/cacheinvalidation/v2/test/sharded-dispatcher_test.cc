@@ -0,0 +1,171 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the sharded dispatcher.
+
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/mutex.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/sharded-dispatcher.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::vector;
+
+class ShardedDispatcherTest : public testing::Test {
+ public:
+  ShardedDispatcherTest()
+      : num_runs_(0), is_released_(false), was_released_in_wait_(false) {}
+
+  void SetUp() {
+    dispatcher_.reset(new ShardedDispatcher(kNumThreads));
+  }
+
+  /* Records that the task with the given sequence number for key ran. */
+  void Record(int key, int sequence_number) {
+    ASSERT_TRUE(dispatcher_->IsRunningOnThread());
+    MutexLock m(&lock_);
+    runs_[key].push_back(sequence_number);
+    ++num_runs_;
+    done_.Signal();
+  }
+
+  /* Records a barrier in the runs of every key. */
+  void RecordBarrier() {
+    ASSERT_TRUE(dispatcher_->IsRunningOnThread());
+    MutexLock m(&lock_);
+    for (int key = 0; key < kNumThreads; ++key) {
+      runs_[key].push_back(kBarrier);
+    }
+    ++num_runs_;
+    done_.Signal();
+  }
+
+  /* Waits until Release is called, or gives up after about five seconds. */
+  void WaitForRelease() {
+    MutexLock m(&lock_);
+    for (int i = 0; (i < 50) && !is_released_; ++i) {
+      released_.WaitWithTimeout(&lock_, 100);
+    }
+    was_released_in_wait_ = is_released_;
+    ++num_runs_;
+    done_.Signal();
+  }
+
+  void Release() {
+    MutexLock m(&lock_);
+    is_released_ = true;
+    released_.Signal();
+    ++num_runs_;
+    done_.Signal();
+  }
+
+  /* Waits until num_runs tasks have run. */
+  void WaitForRuns(int num_runs) {
+    MutexLock m(&lock_);
+    while (num_runs_ < num_runs) {
+      done_.Wait(&lock_);
+    }
+  }
+
+  static const int kNumThreads = 4;
+  static const int kBarrier = -1;
+
+  Mutex lock_;
+  CondVar done_;
+  CondVar released_;
+  vector<int> runs_[kNumThreads];
+  int num_runs_;
+  bool is_released_;
+  bool was_released_in_wait_;
+  scoped_ptr<ShardedDispatcher> dispatcher_;
+};
+
+const int ShardedDispatcherTest::kBarrier;
+
+/* Checks that the tasks for each key run in the order in which they were
+ * dispatched.
+ */
+TEST_F(ShardedDispatcherTest, RunsTasksInOrderPerKey) {
+  const int kNumTasksPerKey = 1000;
+  for (int i = 0; i < kNumTasksPerKey; ++i) {
+    for (int key = 0; key < kNumThreads; ++key) {
+      dispatcher_->Dispatch(key, NewPermanentCallback(
+          this, &ShardedDispatcherTest::Record, key, i));
+    }
+  }
+  WaitForRuns(kNumTasksPerKey * kNumThreads);
+
+  for (int key = 0; key < kNumThreads; ++key) {
+    ASSERT_EQ(kNumTasksPerKey, static_cast<int>(runs_[key].size()));
+    for (int i = 0; i < kNumTasksPerKey; ++i) {
+      ASSERT_EQ(i, runs_[key][i]);
+    }
+  }
+}
+
+/* Checks that a blocked task does not hold up the tasks of another thread. */
+TEST_F(ShardedDispatcherTest, RunsKeysInParallel) {
+  dispatcher_->Dispatch(0, NewPermanentCallback(
+      this, &ShardedDispatcherTest::WaitForRelease));
+  dispatcher_->Dispatch(1, NewPermanentCallback(
+      this, &ShardedDispatcherTest::Release));
+  WaitForRuns(2);
+  MutexLock m(&lock_);
+  ASSERT_TRUE(was_released_in_wait_);
+}
+
+/* Checks that a task dispatched to all threads runs after the tasks
+ * dispatched before it, and before those dispatched after it, on every thread.
+ */
+TEST_F(ShardedDispatcherTest, RunsTaskForAllAsBarrier) {
+  const int kNumTasksPerKey = 100;
+  for (int i = 0; i < 2 * kNumTasksPerKey; ++i) {
+    if (i == kNumTasksPerKey) {
+      dispatcher_->DispatchToAll(NewPermanentCallback(
+          this, &ShardedDispatcherTest::RecordBarrier));
+    }
+    for (int key = 0; key < kNumThreads; ++key) {
+      dispatcher_->Dispatch(key, NewPermanentCallback(
+          this, &ShardedDispatcherTest::Record, key, i));
+    }
+  }
+  WaitForRuns(2 * kNumTasksPerKey * kNumThreads + 1);
+
+  for (int key = 0; key < kNumThreads; ++key) {
+    ASSERT_EQ(2 * kNumTasksPerKey + 1, static_cast<int>(runs_[key].size()));
+    ASSERT_EQ(kBarrier, runs_[key][kNumTasksPerKey]);
+  }
+}
+
+/* Checks that deleting the dispatcher while a thread is held up before a
+ * barrier releases the threads waiting in it, and deletes the task without
+ * running it.
+ */
+TEST_F(ShardedDispatcherTest, DeletesBarrierWhenStopped) {
+  dispatcher_->Dispatch(0, NewPermanentCallback(
+      this, &ShardedDispatcherTest::WaitForRelease));
+  dispatcher_->DispatchToAll(NewPermanentCallback(
+      this, &ShardedDispatcherTest::RecordBarrier));
+  dispatcher_.reset();
+  for (int key = 0; key < kNumThreads; ++key) {
+    EXPECT_TRUE(runs_[key].empty());
+  }
+}
+
+}  // namespace invalidation
@@ -0,0 +1,94 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the ring buffer shared through a mapped file.
+
+#include <unistd.h>
+
+#include <string>
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/shared-memory-ring.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+
+class SharedMemoryRingTest : public testing::Test {
+ public:
+  void SetUp() {
+    path_ = StringPrintf("/tmp/shared-memory-ring_test.%d",
+                         static_cast<int>(getpid()));
+  }
+
+  void TearDown() {
+    unlink(path_.c_str());
+  }
+
+  NullLogger logger_;
+  string path_;
+};
+
+/* Checks that records written through one mapping are read in order through
+ * another, including ones that wrap around the end of the ring.
+ */
+TEST_F(SharedMemoryRingTest, PassesRecordsBetweenMappings) {
+  SharedMemoryRing writer(path_, 64, true, &logger_);
+  SharedMemoryRing reader(path_, 0, false, &logger_);
+  ASSERT_TRUE(writer.IsOpen());
+  ASSERT_TRUE(reader.IsOpen());
+  ASSERT_EQ(64, reader.capacity());
+
+  string record;
+  ASSERT_FALSE(reader.Read(&record));
+  for (int i = 0; i < 20; ++i) {
+    string first = StringPrintf("record-%d", i);
+    string second(i, 'x');
+    ASSERT_TRUE(writer.Write(first.data(), first.size()));
+    ASSERT_TRUE(writer.Write(second.data(), second.size()));
+    ASSERT_TRUE(reader.Read(&record));
+    ASSERT_EQ(first, record);
+    ASSERT_TRUE(reader.Read(&record));
+    ASSERT_EQ(second, record);
+  }
+  ASSERT_FALSE(reader.Read(&record));
+}
+
+/* Checks that a full ring rejects records until some are read. */
+TEST_F(SharedMemoryRingTest, RejectsRecordsWhenFull) {
+  SharedMemoryRing ring(path_, 32, true, &logger_);
+  string record(12, 'r');
+  ASSERT_TRUE(ring.Write(record.data(), record.size()));
+  ASSERT_TRUE(ring.Write(record.data(), record.size()));
+  ASSERT_FALSE(ring.Write(record.data(), 1));
+
+  string read;
+  ASSERT_TRUE(ring.Read(&read));
+  ASSERT_TRUE(ring.Write(record.data(), record.size()));
+  ASSERT_FALSE(ring.Write(NULL, 0));
+}
+
+/* Checks that a ring that was not created, or not with a power-of-two
+ * capacity, is not opened.
+ */
+TEST_F(SharedMemoryRingTest, RejectsInvalidRings) {
+  ASSERT_FALSE(SharedMemoryRing(path_, 0, false, &logger_).IsOpen());
+  ASSERT_FALSE(SharedMemoryRing(path_, 48, true, &logger_).IsOpen());
+  ASSERT_FALSE(SharedMemoryRing(path_, 0, false, &logger_).IsOpen());
+}
+
+}  // namespace invalidation
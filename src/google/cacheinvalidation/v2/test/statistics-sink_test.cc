@@ -0,0 +1,50 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the sink that accumulates the exported statistics.
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/statistics-sink.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+/* Checks that the reported changes add up to the current values, and that
+ * values back at zero are left out.
+ */
+TEST(AccumulatingStatisticsSinkTest, AddsUpDeltas) {
+  AccumulatingStatisticsSink sink;
+  vector<pair<string, int> > deltas;
+  deltas.push_back(make_pair("b", 2));
+  deltas.push_back(make_pair("a", 1));
+  sink.ReportDeltas(deltas);
+  deltas.clear();
+  deltas.push_back(make_pair("a", -1));
+  deltas.push_back(make_pair("b", 3));
+  sink.ReportDeltas(deltas);
+
+  vector<pair<string, int> > values;
+  sink.GetValues(&values);
+  ASSERT_EQ(1, static_cast<int>(values.size()));
+  ASSERT_EQ("b", values[0].first);
+  ASSERT_EQ(5, values[0].second);
+}
+
+}  // namespace invalidation
@@ -0,0 +1,184 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the byte counters, latency histograms and recording from many threads
+// of the Statistics.
+
+#include <pthread.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/statistics.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Checks that byte counts accumulate per message type and are exported. */
+TEST(StatisticsTest, CountsBytes) {
+  Statistics statistics;
+  statistics.RecordSentBytes(Statistics::SentMessageType_REGISTRATION, 10);
+  statistics.RecordSentBytes(Statistics::SentMessageType_REGISTRATION, 5);
+  statistics.RecordReceivedBytes(Statistics::ReceivedMessageType_TOTAL, 7);
+  ASSERT_EQ(15, statistics.GetSentBytesForTest(
+      Statistics::SentMessageType_REGISTRATION));
+  ASSERT_EQ(7, statistics.GetReceivedBytesForTest(
+      Statistics::ReceivedMessageType_TOTAL));
+  vector<pair<string, int> > counters;
+  statistics.GetNonZeroStatistics(&counters);
+  ASSERT_EQ(2, static_cast<int>(counters.size()));
+  ASSERT_EQ("SentBytes.REGISTRATION", counters[0].first);
+  ASSERT_EQ(15, counters[0].second);
+  ASSERT_EQ("ReceivedBytes.TOTAL", counters[1].first);
+}
+
+/* Checks that the quantiles are the upper ends of the log-scale buckets that
+ * hold them.
+ */
+TEST(StatisticsTest, LatencyQuantiles) {
+  Statistics statistics;
+  Statistics::LatencyType type = Statistics::LatencyType_REGISTRATION;
+  ASSERT_EQ(0, statistics.GetLatencyQuantile(type, 0.5));
+
+  // 90 latencies in [2, 4) ms, 9 in [64, 128) ms and one very long one.
+  for (int i = 0; i < 90; ++i) {
+    statistics.RecordLatency(type, 3);
+  }
+  for (int i = 0; i < 9; ++i) {
+    statistics.RecordLatency(type, 100);
+  }
+  statistics.RecordLatency(type, 1 << 30);
+  ASSERT_EQ(100, statistics.GetLatencyCountForTest(type));
+  ASSERT_EQ(4, statistics.GetLatencyQuantile(type, 0.5));
+  ASSERT_EQ(4, statistics.GetLatencyQuantile(type, 0.9));
+  ASSERT_EQ(128, statistics.GetLatencyQuantile(type, 0.99));
+  ASSERT_EQ(1 << (Statistics::kNumLatencyBuckets - 1),
+            statistics.GetLatencyQuantile(type, 1.0));
+  ASSERT_EQ(0, statistics.GetLatencyQuantile(
+      Statistics::LatencyType_ACKNOWLEDGEMENT, 0.5));
+}
+
+/* Checks that the histograms with latencies are exported with the counters. */
+TEST(StatisticsTest, ExportsLatencies) {
+  Statistics statistics;
+  statistics.RecordLatency(Statistics::LatencyType_ACKNOWLEDGEMENT, 0);
+  vector<pair<string, int> > counters;
+  statistics.GetNonZeroStatistics(&counters);
+  ASSERT_EQ(4, static_cast<int>(counters.size()));
+  ASSERT_EQ("Latency.ACKNOWLEDGEMENT.COUNT", counters[0].first);
+  ASSERT_EQ(1, counters[0].second);
+  ASSERT_EQ("Latency.ACKNOWLEDGEMENT.P50", counters[1].first);
+  ASSERT_EQ(1, counters[1].second);
+  ASSERT_EQ("Latency.ACKNOWLEDGEMENT.P99", counters[3].first);
+}
+
+/* Checks that the listener backlog keeps its current and largest sizes. */
+TEST(StatisticsTest, TracksListenerBacklog) {
+  Statistics statistics;
+  statistics.RecordListenerBacklog(5);
+  statistics.RecordListenerBacklog(2);
+  statistics.RecordDeferredInvalidation();
+  ASSERT_EQ(2, statistics.GetListenerBacklogForTest(
+      Statistics::ListenerBacklogType_OUTSTANDING_INVALIDATIONS));
+  ASSERT_EQ(5, statistics.GetListenerBacklogForTest(
+      Statistics::ListenerBacklogType_MAX_OUTSTANDING_INVALIDATIONS));
+  ASSERT_EQ(1, statistics.GetListenerBacklogForTest(
+      Statistics::ListenerBacklogType_DEFERRED_INVALIDATIONS));
+  vector<pair<string, int> > counters;
+  statistics.GetNonZeroStatistics(&counters);
+  ASSERT_EQ(3, static_cast<int>(counters.size()));
+  ASSERT_EQ("ListenerBacklog.OUTSTANDING_INVALIDATIONS", counters[0].first);
+}
+
+/* Checks that the acked version cache statistics keep the hit rate. */
+TEST(StatisticsTest, TracksAckedVersionCacheHitRate) {
+  Statistics statistics;
+  statistics.RecordAckedVersionLookup(true);
+  statistics.RecordAckedVersionLookup(false);
+  statistics.RecordAckedVersionLookup(false);
+  statistics.RecordAckedVersionLookup(false);
+  ASSERT_EQ(4, statistics.GetAckedVersionCacheForTest(
+      Statistics::AckedVersionCacheType_LOOKUPS));
+  ASSERT_EQ(1, statistics.GetAckedVersionCacheForTest(
+      Statistics::AckedVersionCacheType_HITS));
+  ASSERT_EQ(25, statistics.GetAckedVersionCacheForTest(
+      Statistics::AckedVersionCacheType_HIT_RATE_PERCENT));
+  ASSERT_EQ(0, statistics.GetAckedVersionCacheForTest(
+      Statistics::AckedVersionCacheType_EVICTIONS));
+}
+
+static const int kNumRecordingThreads = 12;
+static const int kNumRecordsPerThread = 100000;
+
+/* Records kNumRecordsPerThread of each additive statistic. */
+static void* RecordStatistics(void* statistics_ptr) {
+  Statistics* statistics = static_cast<Statistics*>(statistics_ptr);
+  for (int i = 0; i < kNumRecordsPerThread; ++i) {
+    statistics->RecordSentMessage(Statistics::SentMessageType_TOTAL);
+    statistics->RecordSentBytes(Statistics::SentMessageType_TOTAL, 2);
+    statistics->RecordError(Statistics::ClientErrorType_INCOMING_MESSAGE_FAILURE);
+    statistics->RecordLatency(Statistics::LatencyType_ACKNOWLEDGEMENT, 3);
+  }
+  return NULL;
+}
+
+/* Records from many threads at once into statistics and checks that no
+ * record is lost.
+ */
+static void CheckRecordsFromManyThreads(Statistics* statistics) {
+  pthread_t threads[kNumRecordingThreads];
+  for (int i = 0; i < kNumRecordingThreads; ++i) {
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL, &RecordStatistics,
+                                statistics));
+  }
+  for (int i = 0; i < kNumRecordingThreads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  int num_records = kNumRecordingThreads * kNumRecordsPerThread;
+  ASSERT_EQ(num_records, statistics->GetSentMessageCounterForTest(
+      Statistics::SentMessageType_TOTAL));
+  ASSERT_EQ(2 * num_records, statistics->GetSentBytesForTest(
+      Statistics::SentMessageType_TOTAL));
+  ASSERT_EQ(num_records, statistics->GetClientErrorCounterForTest(
+      Statistics::ClientErrorType_INCOMING_MESSAGE_FAILURE));
+  ASSERT_EQ(num_records, statistics->GetLatencyCountForTest(
+      Statistics::LatencyType_ACKNOWLEDGEMENT));
+  ASSERT_EQ(4, statistics->GetLatencyQuantile(
+      Statistics::LatencyType_ACKNOWLEDGEMENT, 0.99));
+}
+
+/* Checks that no record is lost when many threads record at once. */
+TEST(StatisticsTest, RecordsFromManyThreads) {
+  Statistics statistics;
+  CheckRecordsFromManyThreads(&statistics);
+}
+
+/* Checks that no record is lost when more threads than shards record at
+ * once, and that sharding is what makes the statistics large.
+ */
+TEST(StatisticsTest, RecordsFromManyThreadsWhenSharded) {
+  Statistics statistics(true);
+  CheckRecordsFromManyThreads(&statistics);
+  Statistics unsharded_statistics;
+  ASSERT_LT(unsharded_statistics.GetMemoryUsage(), 2048u);
+  ASSERT_GT(statistics.GetMemoryUsage(), 8192u);
+}
+
+}  // namespace invalidation
@@ -0,0 +1,56 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Wall and CPU clocks for the benchmarks.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_TEST_STOPWATCH_H_
+#define GOOGLE_CACHEINVALIDATION_V2_TEST_STOPWATCH_H_
+
+#include <time.h>
+
+#include "base/basictypes.h"
+
+namespace invalidation {
+
+/* Wall and CPU clocks, read at the start and end of a measured phase. */
+class Stopwatch {
+ public:
+  void Start() {
+    clock_gettime(CLOCK_MONOTONIC, &wall_start_);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start_);
+  }
+
+  /* Stops the clocks and stores the elapsed times in nanoseconds. */
+  void Stop(int64* wall_ns, int64* cpu_ns) {
+    struct timespec wall_end, cpu_end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    *wall_ns = Elapsed(wall_start_, wall_end);
+    *cpu_ns = Elapsed(cpu_start_, cpu_end);
+  }
+
+ private:
+  static int64 Elapsed(const struct timespec& start,
+                       const struct timespec& end) {
+    return (static_cast<int64>(end.tv_sec - start.tv_sec) * 1000000000LL) +
+        (end.tv_nsec - start.tv_nsec);
+  }
+
+  struct timespec wall_start_;
+  struct timespec cpu_start_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_TEST_STOPWATCH_H_
@@ -0,0 +1,127 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A logger, a storage and a network channel for tests and benchmarks that do
+// not care about them.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_TEST_TEST_UTILS_H_
+#define GOOGLE_CACHEINVALIDATION_V2_TEST_TEST_UTILS_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
+#include "google/cacheinvalidation/v2/types.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Logger that drops all messages. */
+class NullLogger : public Logger {
+ public:
+  virtual void Log(LogLevel level, const char* file, int line,
+                   const char* format, ...) {}
+};
+
+/* In-memory storage that completes operations immediately. */
+class MemoryStorage : public Storage {
+ public:
+  virtual void WriteKey(const string& key, const string& value,
+                        WriteKeyCallback* done) {
+    values[key] = value;
+    done->Run(Status(Status::SUCCESS, ""));
+    delete done;
+  }
+
+  virtual void ReadKey(const string& key, ReadKeyCallback* done) {
+    map<string, string>::iterator iter = values.find(key);
+    if (iter == values.end()) {
+      done->Run(StatusStringPair(Status(Status::PERMANENT_FAILURE, ""), ""));
+    } else {
+      done->Run(StatusStringPair(Status(Status::SUCCESS, ""), iter->second));
+    }
+    delete done;
+  }
+
+  virtual void DeleteKey(const string& key, DeleteKeyCallback* done) {
+    done->Run(values.erase(key) > 0);
+    delete done;
+  }
+
+  virtual void ReadAllKeys(ReadAllKeysCallback* key_callback) {
+    for (map<string, string>::iterator iter = values.begin();
+         iter != values.end(); ++iter) {
+      key_callback->Run(
+          StatusStringPair(Status(Status::SUCCESS, ""), iter->first));
+    }
+    delete key_callback;
+  }
+
+  /* The stored values, by key. */
+  map<string, string> values;
+};
+
+/* Network channel that keeps the messages sent by the client and hands the
+ * ones given by the test to the client.
+ */
+class ScriptedNetworkChannel : public NetworkChannel {
+ public:
+  virtual void SendMessage(const string& outgoing_message) {
+    sent_messages.push_back(outgoing_message);
+  }
+
+  virtual void SetMessageReceiver(MessageCallback* incoming_receiver) {
+    message_receiver_.reset(incoming_receiver);
+  }
+
+  virtual void SetMessageBufferReceiver(
+      MessageBufferCallback* incoming_receiver) {
+    buffer_receiver_.reset(incoming_receiver);
+  }
+
+  virtual void AddNetworkStatusReceiver(
+      NetworkStatusCallback* network_status_receiver) {
+    delete network_status_receiver;
+  }
+
+  /* Hands message to the client. */
+  void Deliver(const ServerToClientMessage& message) {
+    string serialized;
+    message.SerializeToString(&serialized);
+    if (buffer_receiver_.get() != NULL) {
+      buffer_receiver_->Run(&serialized);
+    } else {
+      message_receiver_->Run(serialized);
+    }
+  }
+
+  /* The messages sent by the client, in order. */
+  vector<string> sent_messages;
+
+ private:
+  scoped_ptr<MessageCallback> message_receiver_;
+  scoped_ptr<MessageBufferCallback> buffer_receiver_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_TEST_TEST_UTILS_H_
@@ -46,6 +46,15 @@ class ThrottleTest : public testing::Test {
     ASSERT_TRUE(min_time <= now);
   }
 
+  // Increments the call count and checks that calls are at least one second
+  // apart.
+  void IncrementAndCheckInterval() {
+    ++call_count_;
+    Time now = scheduler_->GetCurrentTime();
+    ASSERT_TRUE(now - last_call_time_ >= TimeDelta::FromSeconds(1));
+    last_call_time_ = now;
+  }
+
   void SetUp() {
     scheduler_.reset(new DeterministicScheduler());
     start_time_ = scheduler_->GetCurrentTime();
@@ -200,4 +209,166 @@ TEST_F(ThrottleTest, ThrottlingStorm) {
   ASSERT_EQ(kMessagesPerMinute * duration_minutes + 1, call_count_);
 }
 
+/* Test that throttlers with token-bucket budgets under one shared budget
+ * together keep to the shared limits, and that the long-run rate is that of
+ * the limits.
+ */
+TEST_F(ThrottleTest, SharedBudgetStorm) {
+  scheduler_->StartScheduler();
+
+  vector<RateLimit> rate_limits;
+  rate_limits.push_back(
+      RateLimit(TimeDelta::FromSeconds(1), kMessagesPerSecond));
+  rate_limits.push_back(
+      RateLimit(TimeDelta::FromMinutes(1), kMessagesPerMinute));
+  RateBudget shared_budget(rate_limits, NULL);
+
+  // Each throttler alone would be allowed one call per second.
+  vector<RateLimit> client_rate_limits;
+  client_rate_limits.push_back(RateLimit(TimeDelta::FromSeconds(1), 1));
+  RateBudget budget1(client_rate_limits, &shared_budget);
+  RateBudget budget2(client_rate_limits, &shared_budget);
+  scoped_ptr<Throttle> throttle1(new Throttle(
+      &budget1, scheduler_.get(),
+      NewPermanentCallback(this, &ThrottleTest::IncrementAndCheckInterval)));
+  scoped_ptr<Throttle> throttle2(new Throttle(
+      &budget2, scheduler_.get(),
+      NewPermanentCallback(this, &ThrottleTest::IncrementAndCheckInterval)));
+
+  // For five minutes, call Fire() on both every ten milliseconds.
+  TimeDelta fine_interval = TimeDelta::FromMilliseconds(10);
+  int duration_minutes = 5;
+  TimeDelta duration = TimeDelta::FromMinutes(duration_minutes);
+  int num_iterations = duration / fine_interval;
+  for (int i = 0; i < num_iterations; ++i) {
+    throttle1->Fire();
+    throttle2->Fire();
+    scheduler_->ModifyTime(fine_interval);
+    scheduler_->RunReadyTasks();
+  }
+
+  // Expect an initial burst of kMessagesPerMinute, then kMessagesPerMinute per
+  // minute.
+  ASSERT_EQ(kMessagesPerMinute * (duration_minutes + 1), call_count_);
+  scheduler_->StopScheduler();
+}
+
+/* Checks that the throttle reports when it next allows a call and how far
+ * behind its callers are, and how long the calls it made were deferred.
+ */
+TEST_F(ThrottleTest, ReportsBackpressure) {
+  scheduler_->StartScheduler();
+  Closure* listener =
+      NewPermanentCallback(this, &ThrottleTest::IncrementCounter);
+
+  vector<RateLimit> rate_limits;
+  rate_limits.push_back(
+      RateLimit(TimeDelta::FromSeconds(1), kMessagesPerSecond));
+  rate_limits.push_back(
+      RateLimit(TimeDelta::FromMinutes(1), kMessagesPerMinute));
+  scoped_ptr<Throttle> throttle(
+      new Throttle(rate_limits, scheduler_.get(), listener));
+
+  // An idle throttle allows a call right away.
+  ASSERT_TRUE(throttle->GetNextPermittedTime() <= start_time_);
+  throttle->Fire();
+  ASSERT_EQ(1, call_count_);
+  ASSERT_EQ(TimeDelta::FromSeconds(0), throttle->last_call_delay());
+  ASSERT_EQ(start_time_ + TimeDelta::FromSeconds(1),
+            throttle->GetNextPermittedTime());
+
+  // Calls within the second are deferred into one, and the deficit grows from
+  // the first of them.
+  scheduler_->ModifyTime(TimeDelta::FromMilliseconds(200));
+  throttle->Fire();
+  scheduler_->ModifyTime(TimeDelta::FromMilliseconds(300));
+  throttle->Fire();
+  ASSERT_EQ(1, call_count_);
+  ASSERT_TRUE(throttle->has_deferred_call());
+  ASSERT_EQ(2, throttle->num_deferred_fires());
+  ASSERT_EQ(TimeDelta::FromMilliseconds(300), throttle->GetDeficit());
+
+  // The deferred call is made once allowed, 800 ms after the first call it
+  // serves.
+  scheduler_->SetTime(start_time_ + TimeDelta::FromSeconds(1));
+  scheduler_->RunReadyTasks();
+  ASSERT_EQ(2, call_count_);
+  ASSERT_FALSE(throttle->has_deferred_call());
+  ASSERT_EQ(0, throttle->num_deferred_fires());
+  ASSERT_EQ(TimeDelta::FromSeconds(0), throttle->GetDeficit());
+  ASSERT_EQ(TimeDelta::FromMilliseconds(800), throttle->last_call_delay());
+
+  // Once the per-minute limit is reached, the next call is allowed a minute
+  // after the first.
+  for (int i = 2; i < kMessagesPerMinute; ++i) {
+    scheduler_->ModifyTime(TimeDelta::FromSeconds(1));
+    throttle->Fire();
+  }
+  ASSERT_EQ(kMessagesPerMinute, call_count_);
+  ASSERT_EQ(start_time_ + TimeDelta::FromMinutes(1),
+            throttle->GetNextPermittedTime());
+
+  // A throttle over a budget reports the same for the budget.
+  RateBudget budget(rate_limits, NULL);
+  scoped_ptr<Throttle> budget_throttle(new Throttle(
+      &budget, scheduler_.get(),
+      NewPermanentCallback(this, &ThrottleTest::IncrementCounter)));
+  Time now = scheduler_->GetCurrentTime();
+  budget_throttle->Fire();
+  ASSERT_EQ(kMessagesPerMinute + 1, call_count_);
+  ASSERT_EQ(now + TimeDelta::FromSeconds(1),
+            budget_throttle->GetNextPermittedTime());
+  ASSERT_EQ(TimeDelta::FromSeconds(1), budget.GetDelay(now));
+
+  scheduler_->StopScheduler();
+}
+
+/* Checks that replacing the rate limits of a throttle takes effect on the
+ * next call, for a throttle with limits of its own and one over a budget.
+ */
+TEST_F(ThrottleTest, SetRateLimits) {
+  scheduler_->StartScheduler();
+  vector<RateLimit> rate_limits;
+  rate_limits.push_back(
+      RateLimit(TimeDelta::FromSeconds(1), kMessagesPerSecond));
+  scoped_ptr<Throttle> throttle(new Throttle(
+      rate_limits, scheduler_.get(),
+      NewPermanentCallback(this, &ThrottleTest::IncrementCounter)));
+  throttle->Fire();
+  ASSERT_EQ(start_time_ + TimeDelta::FromSeconds(1),
+            throttle->GetNextPermittedTime());
+
+  // Tightening the limit defers the next call further.
+  vector<RateLimit> slower_limits;
+  slower_limits.push_back(RateLimit(TimeDelta::FromSeconds(10), 1));
+  throttle->SetRateLimits(slower_limits);
+  ASSERT_EQ(start_time_ + TimeDelta::FromSeconds(10),
+            throttle->GetNextPermittedTime());
+
+  // Loosening it allows the next call right away.
+  vector<RateLimit> faster_limits;
+  faster_limits.push_back(RateLimit(TimeDelta::FromSeconds(1), 2));
+  throttle->SetRateLimits(faster_limits);
+  throttle->Fire();
+  ASSERT_EQ(2, call_count_);
+
+  RateBudget budget(rate_limits, NULL);
+  scoped_ptr<Throttle> budget_throttle(new Throttle(
+      &budget, scheduler_.get(),
+      NewPermanentCallback(this, &ThrottleTest::IncrementCounter)));
+  budget_throttle->Fire();
+  ASSERT_EQ(3, call_count_);
+
+  // The budget keeps the token already taken, and the new rate applies from
+  // the next one.
+  budget_throttle->SetRateLimits(slower_limits);
+  ASSERT_EQ(start_time_ + TimeDelta::FromSeconds(1),
+            budget_throttle->GetNextPermittedTime());
+  scheduler_->SetTime(start_time_ + TimeDelta::FromSeconds(1));
+  budget_throttle->Fire();
+  ASSERT_EQ(4, call_count_);
+  ASSERT_EQ(start_time_ + TimeDelta::FromSeconds(11),
+            budget_throttle->GetNextPermittedTime());
+}
+
 }  // namespace invalidation
@@ -0,0 +1,169 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the timer-wheel scheduler.
+
+#include <unistd.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/string_util.h"
+#include "google/cacheinvalidation/v2/timer-wheel-scheduler.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+class TimerWheelSchedulerTest : public testing::Test {
+ public:
+  void SetUp() {
+    scheduler_.reset(new TimerWheelScheduler(kTickSize, start_time_));
+  }
+
+  /* Records that the task named name ran, and when. */
+  void RecordRun(string name) {
+    ASSERT_TRUE(scheduler_->IsRunningOnThread());
+    runs_.push_back(make_pair(name, scheduler_->GetCurrentTime()));
+  }
+
+  /* Schedules a task named name to run after delay. */
+  void ScheduleRecord(TimeDelta delay, const string& name) {
+    scheduler_->Schedule(delay, NewPermanentCallback(
+        this, &TimerWheelSchedulerTest::RecordRun, name));
+  }
+
+  /* Records that the task named name ran and schedules another named next to
+   * run right away.
+   */
+  void RecordAndScheduleNext(string name, string next) {
+    RecordRun(name);
+    ScheduleRecord(Scheduler::NoDelay(), next);
+  }
+
+  /* Advances the time by delta. */
+  void Advance(TimeDelta delta) {
+    scheduler_->AdvanceTo(scheduler_->GetCurrentTime() + delta);
+  }
+
+  Time start_time_;
+  scoped_ptr<TimerWheelScheduler> scheduler_;
+  vector<pair<string, Time> > runs_;
+
+  static const TimeDelta kTickSize;
+};
+
+const TimeDelta TimerWheelSchedulerTest::kTickSize =
+    TimeDelta::FromMilliseconds(10);
+
+/* Checks that tasks run once their delay has passed, rounded up to a tick, and
+ * in order of scheduling within a tick.
+ */
+TEST_F(TimerWheelSchedulerTest, RunsTasksWhenDue) {
+  ScheduleRecord(TimeDelta::FromMilliseconds(25), "b");
+  ScheduleRecord(TimeDelta::FromMilliseconds(5), "a");
+  ScheduleRecord(TimeDelta::FromMilliseconds(30), "c");
+  ScheduleRecord(Scheduler::NoDelay(), "now");
+  ASSERT_FALSE(scheduler_->IsRunningOnThread());
+  ASSERT_EQ(4, scheduler_->num_pending_tasks());
+
+  // Only the task without delay is due at the start.
+  scheduler_->AdvanceTo(start_time_);
+  ASSERT_EQ(1, static_cast<int>(runs_.size()));
+  ASSERT_EQ("now", runs_[0].first);
+
+  // The task with 5 ms delay is due at the first tick.
+  Advance(TimeDelta::FromMilliseconds(9));
+  ASSERT_EQ(1, static_cast<int>(runs_.size()));
+  Advance(TimeDelta::FromMilliseconds(1));
+  ASSERT_EQ(2, static_cast<int>(runs_.size()));
+  ASSERT_EQ("a", runs_[1].first);
+
+  // The tasks with 25 and 30 ms delay are both due at the third tick, in the
+  // order in which they were scheduled.
+  Advance(TimeDelta::FromMilliseconds(100));
+  ASSERT_EQ(4, static_cast<int>(runs_.size()));
+  ASSERT_EQ("b", runs_[2].first);
+  ASSERT_EQ("c", runs_[3].first);
+  ASSERT_EQ(0, scheduler_->num_pending_tasks());
+}
+
+/* Checks that tasks in the higher levels of the wheel, and beyond its reach,
+ * run at their due tick.
+ */
+TEST_F(TimerWheelSchedulerTest, RunsTasksFarAhead) {
+  // Level 1, level 2, level 3 and beyond the 2^32 ticks (about 500 days) that
+  // the wheel reaches.
+  TimeDelta delays[] = {
+    TimeDelta::FromSeconds(3), TimeDelta::FromMinutes(20),
+    TimeDelta::FromHours(30 * 24), TimeDelta::FromHours(1000 * 24),
+  };
+  const int kNumDelays = sizeof(delays) / sizeof(delays[0]);
+  for (int i = 0; i < kNumDelays; ++i) {
+    ScheduleRecord(delays[i], StringPrintf("%d", i));
+  }
+
+  // Advance in steps that are not multiples of the tick and check that each
+  // task runs within a step of its due time.
+  TimeDelta step = TimeDelta::FromMilliseconds(7);
+  for (int i = 0; i < kNumDelays; ++i) {
+    while (static_cast<int>(runs_.size()) == i) {
+      Advance(step);
+    }
+    ASSERT_EQ(i + 1, static_cast<int>(runs_.size()));
+    Time due_time = start_time_ + delays[i];
+    ASSERT_TRUE(runs_[i].second >= due_time);
+    ASSERT_TRUE(runs_[i].second < due_time + step);
+    step = delays[i] / 100;
+  }
+  ASSERT_EQ(0, scheduler_->num_pending_tasks());
+}
+
+/* Checks that tasks scheduled without delay by a running task run in the same
+ * call to AdvanceTo.
+ */
+TEST_F(TimerWheelSchedulerTest, RunsTasksScheduledByTasks) {
+  scheduler_->Schedule(TimeDelta::FromMilliseconds(10), NewPermanentCallback(
+      this, &TimerWheelSchedulerTest::RecordAndScheduleNext,
+      string("first"), string("second")));
+  Advance(TimeDelta::FromMilliseconds(10));
+  ASSERT_EQ(2, static_cast<int>(runs_.size()));
+  ASSERT_EQ("second", runs_[1].first);
+}
+
+/* Checks that the thread runs tasks as they come due in real time. */
+TEST_F(TimerWheelSchedulerTest, RunsTasksOnThread) {
+  scheduler_.reset(new TimerWheelScheduler(kTickSize, Time::Now()));
+  scheduler_->StartThread();
+  Time start = scheduler_->GetCurrentTime();
+  ScheduleRecord(TimeDelta::FromMilliseconds(30), "later");
+  ScheduleRecord(Scheduler::NoDelay(), "now");
+  while (scheduler_->num_pending_tasks() > 0) {
+    usleep(1000);
+  }
+  scheduler_->StopThread();
+
+  ASSERT_EQ(2, static_cast<int>(runs_.size()));
+  ASSERT_EQ("now", runs_[0].first);
+  ASSERT_EQ("later", runs_[1].first);
+  ASSERT_TRUE(runs_[1].second >= start + TimeDelta::FromMilliseconds(30));
+}
+
+}  // namespace invalidation
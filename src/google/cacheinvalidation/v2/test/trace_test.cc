@@ -0,0 +1,49 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the ring buffer of trace spans.
+
+#include <vector>
+
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/v2/trace.h"
+
+namespace invalidation {
+
+/* Checks that the tracer keeps the last spans in order, with nondecreasing
+ * times, once the buffer has wrapped around.
+ */
+TEST(RingBufferTracerTest, KeepsLastSpans) {
+  RingBufferTracer tracer(2);
+  vector<RingBufferTracer::Span> spans;
+  tracer.GetSpans(&spans);
+  ASSERT_TRUE(spans.empty());
+
+  for (uint64 i = 0; i < 6; ++i) {
+    tracer.Record(TRACE_MESSAGE_RECEIVED, i);
+  }
+  tracer.Record(TRACE_LISTENER_UPCALL, 6);
+  tracer.GetSpans(&spans);
+  ASSERT_EQ(4, static_cast<int>(spans.size()));
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_EQ(static_cast<uint64>(i + 3), spans[i].trace_id);
+    if (i > 0) {
+      ASSERT_TRUE(spans[i - 1].time_ns <= spans[i].time_ns);
+    }
+  }
+  ASSERT_EQ(TRACE_MESSAGE_RECEIVED, spans[0].point);
+  ASSERT_EQ(TRACE_LISTENER_UPCALL, spans[3].point);
+}
+
+}  // namespace invalidation
@@ -0,0 +1,195 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the recording of traffic logs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/googletest.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+#include "google/cacheinvalidation/v2/traffic-recorder.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Network channel whose receivers the test calls directly. */
+class LoopbackChannel : public NetworkChannel {
+ public:
+  virtual void SendMessage(const string& outgoing_message) {
+    sent_messages.push_back(outgoing_message);
+  }
+
+  virtual void SetMessageReceiver(MessageCallback* incoming_receiver) {
+    receiver.reset(incoming_receiver);
+  }
+
+  virtual void AddNetworkStatusReceiver(
+      NetworkStatusCallback* network_status_receiver) {
+    status_receiver.reset(network_status_receiver);
+  }
+
+  vector<string> sent_messages;
+  scoped_ptr<MessageCallback> receiver;
+  scoped_ptr<NetworkStatusCallback> status_receiver;
+};
+
+class TrafficRecorderTest : public testing::Test {
+ public:
+  void SetUp() {
+    char path[] = "/tmp/traffic-recorder-test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_TRUE(fd >= 0);
+    close(fd);
+    path_ = path;
+    scheduler_.StartScheduler();
+    scheduler_.SetTime(Time::FromInternalValue(1000000));
+    recorder_.reset(new TrafficRecorder(path_, &scheduler_, &logger_));
+    ASSERT_TRUE(recorder_->IsOpen());
+  }
+
+  void TearDown() {
+    recorder_.reset();
+    unlink(path_.c_str());
+  }
+
+  void HandleMessage(const string& message) {
+    received_messages_.push_back(message);
+  }
+
+  void HandleStatus(bool status) {}
+
+  void HandleWrite(Status status) {}
+
+  void HandleRead(StatusStringPair result) {
+    last_read_ = result.second;
+  }
+
+  void HandleDelete(bool success) {}
+
+  /* Closes the recorder and reads its log into records_. */
+  bool ReadLog() {
+    recorder_.reset();
+    return TrafficLogReader::ReadFile(path_, &records_);
+  }
+
+  string path_;
+  NullLogger logger_;
+  DeterministicScheduler scheduler_;
+  scoped_ptr<TrafficRecorder> recorder_;
+  vector<string> received_messages_;
+  string last_read_;
+  vector<TrafficRecord> records_;
+};
+
+/* Checks that messages and status changes are passed through and recorded
+ * with their times.
+ */
+TEST_F(TrafficRecorderTest, RecordsNetworkTraffic) {
+  LoopbackChannel network;
+  TrafficRecordingChannel channel(&network, recorder_.get());
+  channel.SetMessageReceiver(NewPermanentCallback(
+      this, &TrafficRecorderTest::HandleMessage));
+  channel.AddNetworkStatusReceiver(NewPermanentCallback(
+      this, &TrafficRecorderTest::HandleStatus));
+
+  channel.SendMessage("out");
+  scheduler_.ModifyTime(TimeDelta::FromMilliseconds(5));
+  network.receiver->Run("in");
+  network.status_receiver->Run(false);
+
+  ASSERT_EQ(1, static_cast<int>(network.sent_messages.size()));
+  ASSERT_EQ("out", network.sent_messages[0]);
+  ASSERT_EQ(1, static_cast<int>(received_messages_.size()));
+  ASSERT_EQ("in", received_messages_[0]);
+
+  ASSERT_TRUE(ReadLog());
+  ASSERT_EQ(3, static_cast<int>(records_.size()));
+  ASSERT_EQ(TrafficRecord::OUTBOUND_MESSAGE, records_[0].type);
+  ASSERT_EQ("out", records_[0].value);
+  ASSERT_EQ(1000000, records_[0].time_us);
+  ASSERT_EQ(TrafficRecord::INBOUND_MESSAGE, records_[1].type);
+  ASSERT_EQ("in", records_[1].value);
+  ASSERT_EQ(1005000, records_[1].time_us);
+  ASSERT_EQ(TrafficRecord::NETWORK_STATUS, records_[2].type);
+  ASSERT_EQ(0, records_[2].code);
+}
+
+/* Checks that storage operations are passed through and their results
+ * recorded.
+ */
+TEST_F(TrafficRecorderTest, RecordsStorageResults) {
+  MemoryStorage memory_storage;
+  TrafficRecordingStorage storage(&memory_storage, recorder_.get());
+  storage.WriteKey("key", "value", NewPermanentCallback(
+      this, &TrafficRecorderTest::HandleWrite));
+  storage.ReadKey("key", NewPermanentCallback(
+      this, &TrafficRecorderTest::HandleRead));
+  ASSERT_EQ("value", last_read_);
+  storage.DeleteKey("key", NewPermanentCallback(
+      this, &TrafficRecorderTest::HandleDelete));
+  storage.ReadKey("key", NewPermanentCallback(
+      this, &TrafficRecorderTest::HandleRead));
+
+  ASSERT_TRUE(ReadLog());
+  ASSERT_EQ(4, static_cast<int>(records_.size()));
+  ASSERT_EQ(TrafficRecord::STORAGE_WRITE, records_[0].type);
+  ASSERT_EQ("key", records_[0].key);
+  ASSERT_EQ(Status::SUCCESS, records_[0].code);
+  ASSERT_EQ(TrafficRecord::STORAGE_READ, records_[1].type);
+  ASSERT_EQ("value", records_[1].value);
+  ASSERT_EQ(TrafficRecord::STORAGE_DELETE, records_[2].type);
+  ASSERT_EQ(1, records_[2].code);
+  ASSERT_EQ(TrafficRecord::STORAGE_READ, records_[3].type);
+  ASSERT_EQ(Status::PERMANENT_FAILURE, records_[3].code);
+}
+
+/* Checks that a torn last record is reported and the ones before it kept. */
+TEST_F(TrafficRecorderTest, TornLogKeepsCompleteRecords) {
+  recorder_->RecordMessage(TrafficRecord::OUTBOUND_MESSAGE, "first");
+  recorder_->RecordMessage(TrafficRecord::OUTBOUND_MESSAGE, "second");
+  ASSERT_TRUE(ReadLog());
+  ASSERT_EQ(2, static_cast<int>(records_.size()));
+
+  // Reparse all but the last byte of the log, which was written as one
+  // batch.
+  FILE* file = fopen(path_.c_str(), "rb");
+  ASSERT_TRUE(file != NULL);
+  string log;
+  char buffer[256];
+  size_t num_read;
+  while ((num_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    log.append(buffer, num_read);
+  }
+  fclose(file);
+  log.resize(log.size() - 1);
+  ASSERT_FALSE(TrafficLogReader::Parse(log, &records_));
+  ASSERT_EQ(1, static_cast<int>(records_.size()));
+  ASSERT_EQ("first", records_[0].value);
+  ASSERT_FALSE(TrafficLogReader::Parse("not a log", &records_));
+}
+
+}  // namespace invalidation
@@ -0,0 +1,515 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Replays a traffic log written by a TrafficRecorder into a new
+// InvalidationClientImpl on a DeterministicScheduler, for profiling the
+// client on real traffic offline.
+//
+// The simulated time starts at the time of the first record. The inbound
+// messages and network status changes are delivered at their recorded
+// times, and the storage answers each read and write with the recorded
+// result for its key, in order (falling back to the values written during
+// the replay once the recorded results run out). The messages the client
+// sends are counted and dropped. By default the replay runs as fast as
+// possible; with --realtime it sleeps so that the simulated time advances at
+// the recorded speed.
+//
+// A client that had no token when recorded asks for one with a nonce
+// derived from the time, which need not match the recorded one, so the
+// recorded nonces in the server's replies are replaced with the ones the
+// client sent.
+//
+// Usage: traffic-replay --log=path [--realtime] [--client_type=n]
+//                       [--client_name=name]
+// The client type and name should be those of the recorded client.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/v2/invalidation-client-impl.h"
+#include "google/cacheinvalidation/v2/invalidation-listener.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/traffic-recorder.h"
+#include "google/cacheinvalidation/v2/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/v2/test/stopwatch.h"
+#include "google/cacheinvalidation/v2/test/test-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::deque;
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Network channel that counts the messages the client sends and delivers
+ * the recorded ones to it.
+ */
+class ReplayNetworkChannel : public NetworkChannel {
+ public:
+  /* recorded_nonces are the nonces of the recorded initialize messages, in
+   * the order they were sent.
+   */
+  explicit ReplayNetworkChannel(const deque<string>& recorded_nonces)
+      : recorded_nonces_(recorded_nonces), num_messages_sent_(0),
+        num_bytes_sent_(0) {}
+
+  virtual ~ReplayNetworkChannel() {
+    for (size_t i = 0; i < status_receivers_.size(); ++i) {
+      delete status_receivers_[i];
+    }
+  }
+
+  virtual void SendMessage(const string& outgoing_message) {
+    ++num_messages_sent_;
+    num_bytes_sent_ += outgoing_message.size();
+    if (recorded_nonces_.empty()) {
+      return;
+    }
+    ClientToServerMessage message;
+    if (message.ParseFromString(outgoing_message) &&
+        message.has_initialize_message()) {
+      nonce_replacements_[recorded_nonces_.front()] =
+          message.initialize_message().nonce();
+      recorded_nonces_.pop_front();
+    }
+  }
+
+  virtual void SetMessageReceiver(MessageCallback* incoming_receiver) {
+    message_receiver_.reset(incoming_receiver);
+  }
+
+  virtual void SetMessageBufferReceiver(
+      MessageBufferCallback* incoming_receiver) {
+    buffer_receiver_.reset(incoming_receiver);
+  }
+
+  virtual void AddNetworkStatusReceiver(
+      NetworkStatusCallback* network_status_receiver) {
+    status_receivers_.push_back(network_status_receiver);
+  }
+
+  /* Delivers a recorded message to the client. */
+  void Deliver(const string& recorded_message) {
+    string message(recorded_message);
+    if (!nonce_replacements_.empty()) {
+      ReplaceNonce(&message);
+    }
+    if (buffer_receiver_.get() != NULL) {
+      buffer_receiver_->Run(&message);
+    } else if (message_receiver_.get() != NULL) {
+      message_receiver_->Run(message);
+    }
+  }
+
+  /* Delivers a recorded network status change to the client. */
+  void DeliverNetworkStatus(bool status) {
+    for (size_t i = 0; i < status_receivers_.size(); ++i) {
+      status_receivers_[i]->Run(status);
+    }
+  }
+
+  int num_messages_sent() const { return num_messages_sent_; }
+  int64 num_bytes_sent() const { return num_bytes_sent_; }
+
+ private:
+  /* If message is addressed to a recorded nonce, readdresses it to the
+   * nonce the client sent in its place.
+   */
+  void ReplaceNonce(string* message) {
+    ServerToClientMessage parsed;
+    if (!parsed.ParseFromString(*message)) {
+      return;
+    }
+    map<string, string>::iterator iter =
+        nonce_replacements_.find(parsed.header().client_token());
+    if (iter != nonce_replacements_.end()) {
+      parsed.mutable_header()->set_client_token(iter->second);
+      parsed.SerializeToString(message);
+      nonce_replacements_.erase(iter);
+    }
+  }
+
+  /* Recorded nonces not yet matched with ones the client sent. */
+  deque<string> recorded_nonces_;
+
+  /* The nonces the client sent, by the recorded nonces they replace. */
+  map<string, string> nonce_replacements_;
+
+  int num_messages_sent_;
+  int64 num_bytes_sent_;
+  scoped_ptr<MessageCallback> message_receiver_;
+  scoped_ptr<MessageBufferCallback> buffer_receiver_;
+  vector<NetworkStatusCallback*> status_receivers_;
+};
+
+/* Storage that answers with the recorded results. */
+class ReplayStorage : public Storage {
+ public:
+  /* Queues the storage records among records, by key. */
+  explicit ReplayStorage(const vector<TrafficRecord>& records) {
+    for (size_t i = 0; i < records.size(); ++i) {
+      const TrafficRecord& record = records[i];
+      if (record.type == TrafficRecord::STORAGE_WRITE) {
+        writes_[record.key].push_back(&record);
+      } else if (record.type == TrafficRecord::STORAGE_READ) {
+        reads_[record.key].push_back(&record);
+      } else if (record.type == TrafficRecord::STORAGE_DELETE) {
+        deletes_[record.key].push_back(&record);
+      }
+    }
+  }
+
+  virtual void WriteKey(const string& key, const string& value,
+                        WriteKeyCallback* done) {
+    const TrafficRecord* record = TakeRecord(key, &writes_);
+    Status status(record == NULL ? Status::SUCCESS :
+                  static_cast<Status::Code>(record->code), "");
+    if (status.IsSuccess()) {
+      values_[key] = value;
+    }
+    done->Run(status);
+    delete done;
+  }
+
+  virtual void ReadKey(const string& key, ReadKeyCallback* done) {
+    const TrafficRecord* record = TakeRecord(key, &reads_);
+    if (record != NULL) {
+      done->Run(StatusStringPair(
+          Status(static_cast<Status::Code>(record->code), ""),
+          record->value));
+    } else {
+      map<string, string>::iterator iter = values_.find(key);
+      if (iter == values_.end()) {
+        done->Run(StatusStringPair(Status(Status::PERMANENT_FAILURE, ""), ""));
+      } else {
+        done->Run(StatusStringPair(Status(Status::SUCCESS, ""), iter->second));
+      }
+    }
+    delete done;
+  }
+
+  virtual void DeleteKey(const string& key, DeleteKeyCallback* done) {
+    const TrafficRecord* record = TakeRecord(key, &deletes_);
+    bool success = (record == NULL) || (record->code != 0);
+    if (success) {
+      values_.erase(key);
+    }
+    done->Run(success);
+    delete done;
+  }
+
+  virtual void ReadAllKeys(ReadAllKeysCallback* key_callback) {
+    for (map<string, string>::iterator iter = values_.begin();
+         iter != values_.end(); ++iter) {
+      key_callback->Run(StatusStringPair(Status(Status::SUCCESS, ""),
+                                         iter->first));
+    }
+    delete key_callback;
+  }
+
+ private:
+  typedef map<string, deque<const TrafficRecord*> > RecordQueues;
+
+  /* Removes and returns the next record for key in queues, or NULL if there
+   * is none.
+   */
+  static const TrafficRecord* TakeRecord(const string& key,
+                                         RecordQueues* queues) {
+    RecordQueues::iterator iter = queues->find(key);
+    if ((iter == queues->end()) || iter->second.empty()) {
+      return NULL;
+    }
+    const TrafficRecord* record = iter->second.front();
+    iter->second.pop_front();
+    return record;
+  }
+
+  RecordQueues writes_;
+  RecordQueues reads_;
+  RecordQueues deletes_;
+
+  /* The values written during the replay. */
+  map<string, string> values_;
+};
+
+/* Resources of the replayed client, on one DeterministicScheduler. */
+class ReplayResources : public SystemResources {
+ public:
+  ReplayResources(Logger* logger, Scheduler* scheduler,
+                  NetworkChannel* network, Storage* storage)
+      : logger_(logger), scheduler_(scheduler), network_(network),
+        storage_(storage), started_(false) {}
+
+  virtual void Start() { started_ = true; }
+  virtual void Stop() { started_ = false; }
+  virtual bool IsStarted() const { return started_; }
+  virtual string platform() const { return "TrafficReplay"; }
+  virtual Logger* logger() { return logger_; }
+  virtual Storage* storage() { return storage_; }
+  virtual NetworkChannel* network() { return network_; }
+  virtual Scheduler* internal_scheduler() { return scheduler_; }
+  virtual Scheduler* listener_scheduler() { return scheduler_; }
+
+ private:
+  Logger* logger_;
+  Scheduler* scheduler_;
+  NetworkChannel* network_;
+  Storage* storage_;
+  bool started_;
+};
+
+/* Listener that acknowledges every event. */
+class AckingListener : public InvalidationListener {
+ public:
+  AckingListener() : num_invalidations_(0) {}
+
+  virtual void Ready(InvalidationClient* client) {}
+
+  virtual void Invalidate(InvalidationClient* client,
+                          const Invalidation& invalidation,
+                          const AckHandle& ack_handle) {
+    ++num_invalidations_;
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InvalidateUnknownVersion(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        const AckHandle& ack_handle) {
+    ++num_invalidations_;
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InvalidateAll(InvalidationClient* client,
+                             const AckHandle& ack_handle) {
+    ++num_invalidations_;
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InformRegistrationStatus(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        RegistrationState reg_state) {}
+
+  virtual void InformRegistrationFailure(InvalidationClient* client,
+                                         const ObjectId& object_id,
+                                         bool is_transient,
+                                         const string& error_message) {}
+
+  virtual void ReissueRegistrations(InvalidationClient* client,
+                                    const string& prefix,
+                                    int prefix_length) {}
+
+  virtual void InformError(InvalidationClient* client,
+                           const ErrorInfo& error_info) {}
+
+  int num_invalidations() const { return num_invalidations_; }
+
+ private:
+  int num_invalidations_;
+};
+
+/* Options of a replay. */
+struct ReplayConfig {
+  ReplayConfig() : realtime(false), client_type(ClientType_Type_INTERNAL),
+                   client_name("replay-client") {}
+
+  /* The log to replay. */
+  string log_path;
+
+  /* Whether to replay at the recorded speed rather than as fast as
+   * possible.
+   */
+  bool realtime;
+
+  int client_type;
+  string client_name;
+};
+
+/* Replays records into a new client. */
+class TrafficReplayer {
+ public:
+  /* Step by which the simulated time advances between records, so that the
+   * client's timers run at about their times.
+   */
+  static const int kTickMs = 10;
+
+  TrafficReplayer(const ReplayConfig& config,
+                  const vector<TrafficRecord>& records)
+      : config_(config), records_(records), num_recorded_messages_sent_(0),
+        storage_(records) {
+    deque<string> recorded_nonces;
+    for (size_t i = 0; i < records.size(); ++i) {
+      if (records[i].type != TrafficRecord::OUTBOUND_MESSAGE) {
+        continue;
+      }
+      ++num_recorded_messages_sent_;
+      ClientToServerMessage message;
+      if (message.ParseFromString(records[i].value) &&
+          message.has_initialize_message()) {
+        recorded_nonces.push_back(message.initialize_message().nonce());
+      }
+    }
+    network_.reset(new ReplayNetworkChannel(recorded_nonces));
+    resources_.reset(new ReplayResources(&logger_, &scheduler_,
+                                         network_.get(), &storage_));
+  }
+
+  /* Replays the records and prints the results. */
+  void Run() {
+    if (records_.empty()) {
+      printf("Empty log\n");
+      return;
+    }
+    scheduler_.SetTime(Time::FromInternalValue(records_[0].time_us));
+    scheduler_.StartScheduler();
+    resources_->Start();
+    InvalidationClientImpl client(
+        resources_.get(), config_.client_type, config_.client_name,
+        InvalidationClientImpl::Config(), "TrafficReplay", &listener_);
+
+    Stopwatch stopwatch;
+    stopwatch.Start();
+    client.Start();
+    scheduler_.RunReadyTasks();
+    int num_delivered = 0;
+    for (size_t i = 0; i < records_.size(); ++i) {
+      const TrafficRecord& record = records_[i];
+      if (record.type == TrafficRecord::INBOUND_MESSAGE) {
+        AdvanceTo(Time::FromInternalValue(record.time_us));
+        network_->Deliver(record.value);
+      } else if (record.type == TrafficRecord::NETWORK_STATUS) {
+        AdvanceTo(Time::FromInternalValue(record.time_us));
+        network_->DeliverNetworkStatus(record.code != 0);
+      } else {
+        continue;
+      }
+      ++num_delivered;
+      scheduler_.RunReadyTasks();
+    }
+    int64 wall_ns, cpu_ns;
+    stopwatch.Stop(&wall_ns, &cpu_ns);
+
+    client.Stop();
+    scheduler_.StopScheduler();
+
+    printf("Records:               %8d\n", static_cast<int>(records_.size()));
+    printf("Events delivered:      %8d\n", num_delivered);
+    printf("Invalidations:         %8d\n", listener_.num_invalidations());
+    printf("Messages sent:         %8d (%d recorded)\n",
+           network_->num_messages_sent(), num_recorded_messages_sent_);
+    printf("Bytes sent:            %8lld\n",
+           static_cast<long long>(network_->num_bytes_sent()));
+    printf("Simulated time:        %8.1f s\n",
+           (records_.back().time_us - records_[0].time_us) / 1e6);
+    printf("Wall time:             %8.1f s\n", wall_ns / 1e9);
+    printf("CPU time:              %8.1f ms\n", cpu_ns / 1e6);
+    if (num_delivered > 0) {
+      printf("CPU per event:         %8lld ns\n",
+             static_cast<long long>(cpu_ns / num_delivered));
+    }
+  }
+
+ private:
+  /* Advances the simulated time to time in steps of kTickMs, running the
+   * tasks that become due and, for a realtime replay, sleeping for each
+   * step.
+   */
+  void AdvanceTo(Time time) {
+    TimeDelta tick = TimeDelta::FromMilliseconds(kTickMs);
+    while (scheduler_.GetCurrentTime() + tick < time) {
+      Sleep(tick);
+      scheduler_.ModifyTime(tick);
+      scheduler_.RunReadyTasks();
+    }
+    if (scheduler_.GetCurrentTime() < time) {
+      Sleep(time - scheduler_.GetCurrentTime());
+      scheduler_.SetTime(time);
+    }
+  }
+
+  void Sleep(TimeDelta delay) {
+    if (config_.realtime) {
+      usleep(static_cast<useconds_t>(delay.InMicroseconds()));
+    }
+  }
+
+  ReplayConfig config_;
+  const vector<TrafficRecord>& records_;
+  int num_recorded_messages_sent_;
+  NullLogger logger_;
+  DeterministicScheduler scheduler_;
+  ReplayStorage storage_;
+  scoped_ptr<ReplayNetworkChannel> network_;
+  scoped_ptr<ReplayResources> resources_;
+  AckingListener listener_;
+};
+
+/* Sets the field of config named by flag and returns whether there is such
+ * a field.
+ */
+static bool ParseFlag(const char* flag, ReplayConfig* config) {
+  if (strcmp(flag, "--realtime") == 0) {
+    config->realtime = true;
+    return true;
+  }
+  if (strncmp(flag, "--log=", 6) == 0) {
+    config->log_path = flag + 6;
+    return true;
+  }
+  if (strncmp(flag, "--client_name=", 14) == 0) {
+    config->client_name = flag + 14;
+    return true;
+  }
+  if (strncmp(flag, "--client_type=", 14) == 0) {
+    return sscanf(flag + 14, "%d", &config->client_type) == 1;
+  }
+  return false;
+}
+
+}  // namespace invalidation
+
+int main(int argc, char** argv) {
+  invalidation::ReplayConfig config;
+  for (int i = 1; i < argc; ++i) {
+    if (!invalidation::ParseFlag(argv[i], &config)) {
+      fprintf(stderr, "Unknown or malformed flag: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (config.log_path.empty()) {
+    fprintf(stderr, "Usage: %s --log=path [--realtime] [--client_type=n] "
+            "[--client_name=name]\n", argv[0]);
+    return 1;
+  }
+  invalidation::vector<invalidation::TrafficRecord> records;
+  if (!invalidation::TrafficLogReader::ReadFile(config.log_path, &records)) {
+    if (records.empty()) {
+      fprintf(stderr, "Could not read traffic log %s\n",
+              config.log_path.c_str());
+      return 1;
+    }
+    fprintf(stderr, "Ignoring the torn end of %s\n", config.log_path.c_str());
+  }
+  invalidation::TrafficReplayer replayer(config, records);
+  replayer.Run();
+  return 0;
+}
@@ -25,11 +25,104 @@ namespace invalidation {
 
 using INVALIDATION_STL_NAMESPACE::max;
 
+RateBudget::RateBudget(const vector<RateLimit>& rate_limits,
+                       RateBudget* parent)
+    : parent_(parent) {
+  SetRateLimits(rate_limits);
+}
+
+void RateBudget::SetRateLimits(const vector<RateLimit>& rate_limits) {
+  MutexLock m(&lock_);
+  buckets_.resize(rate_limits.size());
+  for (size_t i = 0; i < rate_limits.size(); ++i) {
+    CHECK(rate_limits[i].count > 0);
+    buckets_[i].emission_interval =
+        rate_limits[i].window_size / static_cast<int64>(rate_limits[i].count);
+    buckets_[i].tolerance = buckets_[i].emission_interval *
+        static_cast<int64>(rate_limits[i].count - 1);
+  }
+}
+
+bool RateBudget::TryAcquire(Time now, TimeDelta* delay) {
+  MutexLock m(&lock_);
+
+  TimeDelta bucket_delay = GetBucketDelay(now);
+  if (bucket_delay > TimeDelta::FromMicroseconds(0)) {
+    *delay = bucket_delay;
+    return false;
+  }
+  if ((parent_ != NULL) && !parent_->TryAcquire(now, delay)) {
+    return false;
+  }
+
+  // Take a token from each bucket.
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    Bucket* bucket = &buckets_[i];
+    bucket->full_time = max(bucket->full_time, now) +
+        bucket->emission_interval;
+  }
+  return true;
+}
+
+TimeDelta RateBudget::GetDelay(Time now) {
+  MutexLock m(&lock_);
+  TimeDelta delay = GetBucketDelay(now);
+  if (parent_ != NULL) {
+    delay = max(delay, parent_->GetDelay(now));
+  }
+  return delay;
+}
+
+TimeDelta RateBudget::GetBucketDelay(Time now) {
+  // A bucket has a token iff it is full at most 'tolerance' from now.
+  TimeDelta max_wait = TimeDelta::FromMicroseconds(0);
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    const Bucket& bucket = buckets_[i];
+    max_wait = max(max_wait, (bucket.full_time - bucket.tolerance) - now);
+  }
+  return max_wait;
+}
+
 Throttle::Throttle(
     const vector<RateLimit>& rate_limits, Scheduler* scheduler,
     Closure* listener)
-    : rate_limits_(rate_limits), scheduler_(scheduler), listener_(listener),
-      timer_scheduled_(false) {
+    : budget_(NULL), scheduler_(scheduler), listener_(listener),
+      timer_scheduled_(false), num_deferred_fires_(0) {
+  SetRateLimits(rate_limits);
+}
+
+Throttle::Throttle(RateBudget* budget, Scheduler* scheduler, Closure* listener)
+    : budget_(budget), scheduler_(scheduler), listener_(listener),
+      timer_scheduled_(false), num_deferred_fires_(0), max_recent_events_(0) {
+}
+
+void Throttle::Fire() {
+  if (num_deferred_fires_ == 0) {
+    first_deferred_fire_time_ = scheduler_->GetCurrentTime();
+  }
+  ++num_deferred_fires_;
+  if (timer_scheduled_) {
+    // We're already rate-limited and have a deferred call scheduled.  Just
+    // return.  The flag will be reset when the deferred task runs.
+    return;
+  }
+  CallListenerIfPermitted();
+}
+
+Time Throttle::GetNextPermittedTime() {
+  Time now = scheduler_->GetCurrentTime();
+  if (budget_ != NULL) {
+    return now + budget_->GetDelay(now);
+  }
+  return now + GetWindowDelay(now);
+}
+
+void Throttle::SetRateLimits(const vector<RateLimit>& rate_limits) {
+  if (budget_ != NULL) {
+    budget_->SetRateLimits(rate_limits);
+    return;
+  }
+  rate_limits_ = rate_limits;
 
   // Find the largest 'count' in all of the rate limits, as this is the size of
   // the buffer of recent messages we need to retain.
@@ -37,18 +130,60 @@ Throttle::Throttle(
   for (size_t i = 0; i < rate_limits_.size(); ++i) {
     max_recent_events_ = max(max_recent_events_, rate_limits_[i].count);
   }
+  while (recent_event_times_.size() > max_recent_events_) {
+    recent_event_times_.pop_front();
+  }
 }
 
-void Throttle::Fire() {
-  if (timer_scheduled_) {
-    // We're already rate-limited and have a deferred call scheduled.  Just
-    // return.  The flag will be reset when the deferred task runs.
-    return;
+TimeDelta Throttle::GetDeficit() {
+  if (num_deferred_fires_ == 0) {
+    return TimeDelta::FromMicroseconds(0);
   }
-  // Go through all of the limits to see if we've hit one.  If so, schedule a
-  // task to try again once that limit won't be violated.  If no limits would be
-  // violated, send.
+  return scheduler_->GetCurrentTime() - first_deferred_fire_time_;
+}
+
+void Throttle::CallListenerIfPermitted() {
+  // If calling the listener now would violate the limits, schedule a task to
+  // try again once it won't.
   Time now = scheduler_->GetCurrentTime();
+  TimeDelta delay;
+  bool permitted;
+  if (budget_ != NULL) {
+    permitted = budget_->TryAcquire(now, &delay);
+  } else {
+    delay = GetWindowDelay(now);
+    permitted = delay <= TimeDelta::FromMicroseconds(0);
+  }
+  if (!permitted) {
+    // Set the flag to indicate we have a deferred task scheduled.
+    timer_scheduled_ = true;
+    scheduler_->Schedule(
+        delay, NewPermanentCallback(this, &Throttle::RetryFire));
+    return;
+  }
+
+  // Record the fact that we're triggering an event now. This is done before
+  // calling the listener, which may fire again or ask for the next permitted
+  // time.
+  if (budget_ == NULL) {
+    recent_event_times_.push_back(now);
+
+    // Only save up to max_recent_events_ event times.
+    if (recent_event_times_.size() > max_recent_events_) {
+      recent_event_times_.pop_front();
+    }
+  }
+
+  // The listener serves all the calls to Fire() so far.
+  last_call_delay_ = now - first_deferred_fire_time_;
+  num_deferred_fires_ = 0;
+  listener_->Run();
+}
+
+TimeDelta Throttle::GetWindowDelay(Time now) {
+  // Go through all of the limits to see if we've hit any, and find how long it
+  // will be until none would be violated.
+  TimeDelta max_delay = TimeDelta::FromMicroseconds(0);
   for (size_t i = 0; i < rate_limits_.size(); ++i) {
     RateLimit rate_limit = rate_limits_[i];
 
@@ -78,32 +213,11 @@ void Throttle::Fire() {
 
       // Check where the end of the window is relative to the current time.  If
       // the end of the window is in the future, then sending now would violate
-      // the rate limit, so we must defer.
-      TimeDelta window_end_from_now = window_end - now;
-      if (window_end_from_now > TimeDelta::FromSeconds(0)) {
-        // Rate limit would be violated, so schedule a task to try again.
-
-        // Set the flag to indicate we have a deferred task scheduled.  No need
-        // to continue checking other rate limits now.
-        timer_scheduled_ = true;
-        scheduler_->Schedule(
-            window_end_from_now,
-            NewPermanentCallback(this, &Throttle::RetryFire));
-        return;
-      }
+      // the rate limit until then.
+      max_delay = max(max_delay, window_end - now);
     }
   }
-  // We checked all the rate limits, and none would have been violated, so it's
-  // safe to call the listener.
-  listener_->Run();
-
-  // Record the fact that we're triggering an event now.
-  recent_event_times_.push_back(scheduler_->GetCurrentTime());
-
-  // Only save up to max_recent_events_ event times.
-  if (recent_event_times_.size() > max_recent_events_) {
-    recent_event_times_.pop_front();
-  }
+  return max_delay;
 }
 
 }  // namespace invalidation
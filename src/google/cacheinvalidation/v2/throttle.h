@@ -24,6 +24,7 @@
 #include "google/cacheinvalidation/callback.h"
 #include "google/cacheinvalidation/stl-namespace.h"
 #include "google/cacheinvalidation/v2/logging.h"
+#include "google/cacheinvalidation/v2/mutex.h"
 #include "google/cacheinvalidation/v2/scoped_ptr.h"
 #include "google/cacheinvalidation/v2/time.h"
 
@@ -43,6 +44,73 @@ struct RateLimit {
   size_t count;
 };
 
+// A budget of events under a set of rate limits, enforced with one token bucket
+// per limit: a limit of 'count' events per 'window_size' allows a burst of
+// 'count' events, refilled at 'count' per 'window_size'. Unlike the sliding
+// windows of Throttle, the budget uses constant space and time per event
+// whatever the counts, but it may allow up to twice 'count' events in some
+// window of 'window_size' (a full burst followed by a full refill).
+//
+// A budget may have a parent budget, from which every event must also be
+// allowed. This lets the throttles of many clients each have limits of their
+// own and share one aggregate limit. Budgets are thread-safe.
+class RateBudget {
+ public:
+  // Constructs a budget for the given rate limits, under parent if it is not
+  // NULL. Ownership of parent is retained by the caller.
+  RateBudget(const vector<RateLimit>& rate_limits, RateBudget* parent);
+
+  // If an event at now is within the budget (and its parent's), takes it from
+  // the budget and returns true. Otherwise, stores in *delay how long to wait
+  // before trying again and returns false.
+  bool TryAcquire(Time now, TimeDelta* delay);
+
+  // Returns how long after now an event would be within the budget (and its
+  // parent's), without taking it, or zero if it would be right away.
+  TimeDelta GetDelay(Time now);
+
+  // Replaces the rate limits of the budget (not its parent's). The buckets of
+  // limits that remain at the same position keep the times at which they are
+  // full, so a change does not hand out a fresh burst; the new rates apply to
+  // the events that follow.
+  void SetRateLimits(const vector<RateLimit>& rate_limits);
+
+  // Returns the number of heap bytes held by the budget, counting the budget
+  // itself.
+  size_t GetAllocatedBytes() const {
+    return sizeof(*this) + buckets_.capacity() * sizeof(Bucket);
+  }
+
+ private:
+  // Returns how long after now every bucket will have a token. Requires that
+  // lock_ is held.
+  TimeDelta GetBucketDelay(Time now);
+
+  // The state of the token bucket for one rate limit, kept as the time at
+  // which the bucket will be full again (the "theoretical arrival time" of the
+  // generic cell rate algorithm).
+  struct Bucket {
+    // The time in which one token is refilled.
+    TimeDelta emission_interval;
+
+    // How far full_time may be in the future while tokens remain, i.e., the
+    // time to refill all but one token.
+    TimeDelta tolerance;
+
+    // The time at which the bucket is full.
+    Time full_time;
+  };
+
+  // The buckets, one per rate limit.
+  vector<Bucket> buckets_;
+
+  // Budget from which events must also be allowed, if not NULL.
+  RateBudget* parent_;
+
+  // Lock for the buckets.
+  Mutex lock_;
+};
+
 // Provides an abstraction for multi-level rate-limiting.  For example, the
 // default limits state that no more than one message should be sent per second,
 // or six per minute.  Rate-limiting is implemented by maintaining a buffer of
@@ -56,6 +124,11 @@ class Throttle {
   Throttle(const vector<RateLimit>& rate_limits, Scheduler* scheduler,
            Closure* listener);
 
+  // Constructs a throttler that enforces the limits of budget (which may be
+  // shared with other throttlers) instead of rate limits of its own. Ownership
+  // of budget and scheduler is retained by the caller.
+  Throttle(RateBudget* budget, Scheduler* scheduler, Closure* listener);
+
   // If calling the listener would not violate the rate limits, does so.
   // Otherwise, schedules a timer to do so as soon as doing so would not violate
   // the rate limits, unless such a timer is already set, in which case does
@@ -63,16 +136,68 @@ class Throttle {
   // queued.
   void Fire();
 
+  // Returns the earliest time at which the rate limits allow the listener to be
+  // called, which is in the past or present if they allow it right away. Lets
+  // callers adapt to the rate limits instead of finding out about them only
+  // when their calls are deferred.
+  Time GetNextPermittedTime();
+
+  // Replaces the rate limits enforced by the throttle, or by its budget if it
+  // was constructed with one. A deferred call stays scheduled, and rechecks
+  // the new limits when it runs.
+  void SetRateLimits(const vector<RateLimit>& rate_limits);
+
+  // Returns whether a call to the listener is deferred by the rate limits.
+  bool has_deferred_call() const {
+    return timer_scheduled_;
+  }
+
+  // Returns how long the callers of Fire() are behind, i.e., how long ago the
+  // first call to Fire() that the listener has not yet served was made, or
+  // zero if there is no such call.
+  TimeDelta GetDeficit();
+
+  // Returns the number of calls to Fire() that the listener has not yet served
+  // and that will be served by one deferred call.
+  int num_deferred_fires() const {
+    return num_deferred_fires_;
+  }
+
+  // Returns how long the latest call to the listener was deferred by the rate
+  // limits, measured from the first call to Fire() that it served. While the
+  // listener runs, this is the delay of the running call.
+  TimeDelta last_call_delay() const {
+    return last_call_delay_;
+  }
+
+  // Returns the approximate number of heap bytes held by the throttle,
+  // counting the throttle itself and its buffer of recent events.
+  size_t GetAllocatedBytes() const {
+    return sizeof(*this) + rate_limits_.capacity() * sizeof(RateLimit) +
+        recent_event_times_.size() * sizeof(Time);
+  }
+
  private:
-  // Retries a call to Fire() after some delay.
+  // Retries a call to the listener after some delay.
   void RetryFire() {
     timer_scheduled_ = false;
-    Fire();
+    CallListenerIfPermitted();
   }
 
+  // Calls the listener if doing so would not violate the rate limits, and
+  // otherwise schedules a retry.
+  void CallListenerIfPermitted();
+
+  // Returns how long after now calling the listener would not violate
+  // rate_limits_, or zero if it would not right away.
+  TimeDelta GetWindowDelay(Time now);
+
   // Rate limits to be enforced by this object.
   vector<RateLimit> rate_limits_;
 
+  // Budget to take events from instead of enforcing rate_limits_, if not NULL.
+  RateBudget* budget_;
+
   // Scheduler for reading the current time and scheduling tasks that need to be
   // delayed.
   Scheduler* scheduler_;
@@ -83,6 +208,16 @@ class Throttle {
   // Whether we've already scheduled a deferred call.
   bool timer_scheduled_;
 
+  // The number of calls to Fire() not yet served by the listener.
+  int num_deferred_fires_;
+
+  // The time of the first call to Fire() not yet served by the listener, if
+  // num_deferred_fires_ > 0.
+  Time first_deferred_fire_time_;
+
+  // How long the latest call to the listener was deferred.
+  TimeDelta last_call_delay_;
+
   // A buffer of recent events, so we can determine the length of the interval
   // in which we made the most recent K events.
   deque<Time> recent_event_times_;
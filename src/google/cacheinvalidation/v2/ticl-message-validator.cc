@@ -131,7 +131,7 @@ namespace invalidation {
     Validate(message.field(i), result);                                  \
     if (!*result) {                                                     \
       TLOG(logger_, SEVERE, "field " #field " #%d failed validation in %s", \
-           ProtoHelpers::ToString(message).c_str());                    \
+           i, ProtoHelpers::ToString(message).c_str());                 \
       *result = false;                                                  \
       return;                                                           \
     }                                                                   \
@@ -169,7 +169,9 @@ DEFINE_VALIDATOR(string) {}
 // Similarly, for now enum values are always considered valid.
 DEFINE_VALIDATOR(ErrorMessage::Code) {}
 DEFINE_VALIDATOR(InfoRequestMessage::InfoType) {}
+DEFINE_VALIDATOR(InitializeMessage::CompressionType) {}
 DEFINE_VALIDATOR(InitializeMessage::DigestSerializationType) {}
+DEFINE_VALIDATOR(InitializeMessage::NameEncoding) {}
 DEFINE_VALIDATOR(RegistrationP::OpType) {}
 DEFINE_VALIDATOR(StatusP::Code) {}
 
@@ -188,6 +190,8 @@ DEFINE_VALIDATOR(ObjectIdP) {
   REQUIRE(name);
   REQUIRE(source);
   NON_NEGATIVE(source);
+  ALLOW(shared_name_prefix_length);
+  NON_NEGATIVE(shared_name_prefix_length);
 }
 
 DEFINE_VALIDATOR(InvalidationP) {
@@ -196,6 +200,9 @@ DEFINE_VALIDATOR(InvalidationP) {
   REQUIRE(version);
   NON_NEGATIVE(version);
   ALLOW(payload);
+  ALLOW(payload_reference);
+  NON_EMPTY(payload_reference);
+  CONDITION(!message.has_payload() || !message.has_payload_reference());
 }
 
 DEFINE_VALIDATOR(RegistrationP) {
@@ -203,11 +210,20 @@ DEFINE_VALIDATOR(RegistrationP) {
   REQUIRE(op_type);
 }
 
+DEFINE_VALIDATOR(RegistrationSubtree) {
+  ZERO_OR_MORE(registered_object);
+  NON_NEGATIVE(prefix_len);
+  CONDITION(message.prefix_len() <=
+            static_cast<int>(8 * message.digest_prefix().size()));
+  NON_NEGATIVE(num_registrations);
+}
+
 DEFINE_VALIDATOR(RegistrationSummary) {
   REQUIRE(num_registrations);
   NON_NEGATIVE(num_registrations);
   REQUIRE(registration_digest);
   NON_EMPTY(registration_digest);
+  ZERO_OR_MORE(subtree_summary);
 }
 
 DEFINE_VALIDATOR(InvalidationMessage) {
@@ -235,6 +251,13 @@ DEFINE_VALIDATOR(InitializeMessage) {
   NON_EMPTY(nonce);
   REQUIRE(digest_serialization_type);
   REQUIRE(application_client_id);
+  ZERO_OR_MORE(supported_compression_type);
+  ALLOW(max_inline_payload_size);
+  NON_NEGATIVE(max_inline_payload_size);
+  ALLOW(omit_payloads);
+  ZERO_OR_MORE(supported_name_encoding);
+  ALLOW(supports_catch_up);
+  ZERO_OR_MORE(catch_up_version);
 }
 
 DEFINE_VALIDATOR(RegistrationMessage) {
@@ -260,14 +283,14 @@ DEFINE_VALIDATOR(InfoMessage) {
   ALLOW(server_registration_summary_requested);
 }
 
-DEFINE_VALIDATOR(RegistrationSubtree) {
-  ZERO_OR_MORE(registered_object);
-}
-
 DEFINE_VALIDATOR(RegistrationSyncMessage) {
   ONE_OR_MORE(subtree);
 }
 
+DEFINE_VALIDATOR(PayloadFetchMessage) {
+  ONE_OR_MORE(payload_reference);
+}
+
 DEFINE_VALIDATOR(ClientToServerMessage) {
   REQUIRE(header);
   ALLOW(info_message);
@@ -275,8 +298,13 @@ DEFINE_VALIDATOR(ClientToServerMessage) {
   ALLOW(invalidation_ack_message);
   ALLOW(registration_message);
   ALLOW(registration_sync_message);
+  ALLOW(payload_fetch_message);
+  ALLOW(compression_type);
+  ALLOW(compressed_content);
   CONDITION(message.has_initialize_message() ^
             message.header().has_client_token());
+  CONDITION(message.has_compression_type() ==
+            message.has_compressed_content());
 }
 
 DEFINE_VALIDATOR(ServerHeader) {
@@ -288,6 +316,9 @@ DEFINE_VALIDATOR(ServerHeader) {
   NON_NEGATIVE(server_time_ms);
   ALLOW(message_id);
   NON_EMPTY(message_id);
+  ALLOW(accepted_compression_type);
+  ZERO_OR_MORE(acked_message_id);
+  ALLOW(accepted_name_encoding);
 }
 
 DEFINE_VALIDATOR(StatusP) {
@@ -319,9 +350,34 @@ DEFINE_VALIDATOR(InfoRequestMessage) {
   ONE_OR_MORE(info_type);
 }
 
+DEFINE_VALIDATOR(RateLimitP) {
+  REQUIRE(window_ms);
+  GREATER_OR_EQUAL(window_ms, 1);
+  REQUIRE(count);
+  GREATER_OR_EQUAL(count, 1);
+}
+
 DEFINE_VALIDATOR(ConfigChangeMessage) {
   ALLOW(next_message_delay_ms);
   GREATER_OR_EQUAL(next_message_delay_ms, 1);
+  ALLOW(max_token_backoff_delay_ms);
+  GREATER_OR_EQUAL(max_token_backoff_delay_ms, 1);
+  ALLOW(batching_delay_ms);
+  GREATER_OR_EQUAL(batching_delay_ms, 1);
+  ALLOW(heartbeat_interval_ms);
+  GREATER_OR_EQUAL(heartbeat_interval_ms, 1);
+  ZERO_OR_MORE(rate_limit);
+}
+
+DEFINE_VALIDATOR(PayloadP) {
+  REQUIRE(payload_reference);
+  NON_EMPTY(payload_reference);
+  REQUIRE(status);
+  ALLOW(payload);
+}
+
+DEFINE_VALIDATOR(PayloadMessage) {
+  ONE_OR_MORE(payload);
 }
 
 DEFINE_VALIDATOR(ServerToClientMessage) {
@@ -333,6 +389,7 @@ DEFINE_VALIDATOR(ServerToClientMessage) {
   ALLOW(config_change_message);
   ALLOW(info_request_message);
   ALLOW(error_message);
+  ALLOW(payload_message);
 }
 
 }  // namespace invalidation
@@ -0,0 +1,320 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Scheduler backed by a hierarchical timing wheel.
+
+#include "google/cacheinvalidation/v2/timer-wheel-scheduler.h"
+
+#include <algorithm>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/v2/logging.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::max;
+using INVALIDATION_STL_NAMESPACE::min;
+using INVALIDATION_STL_NAMESPACE::sort;
+
+// The mask of the slot index of a level.
+static const int64 kSlotMask = TimerWheelScheduler::kNumSlots - 1;
+
+// The farthest ahead a task can be put in the wheel, in ticks.
+static const int64 kMaxTicksAhead =
+    (static_cast<int64>(1) << (TimerWheelScheduler::kSlotBits *
+                               TimerWheelScheduler::kNumLevels)) - 1;
+
+// Value of wakeup_tick_ while the thread is not waiting.
+static const int64 kNotWaiting = -1;
+
+TimerWheelScheduler::TimerWheelScheduler(TimeDelta tick_size, Time start_time)
+    : tick_micros_(tick_size.InMicroseconds()),
+      start_time_(start_time),
+      current_time_(start_time),
+      current_tick_(0),
+      num_pending_tasks_(0),
+      next_sequence_number_(0),
+      is_running_tasks_(false),
+      is_thread_started_(false),
+      stop_thread_(false),
+      wakeup_tick_(kNotWaiting) {
+  CHECK(tick_micros_ > 0) << "tick_size must be positive: given " <<
+      tick_micros_ << " us";
+  for (int level = 0; level < kNumLevels; ++level) {
+    level_sizes_[level] = 0;
+  }
+}
+
+TimerWheelScheduler::~TimerWheelScheduler() {
+  StopThread();
+  for (int level = 0; level < kNumLevels; ++level) {
+    for (int index = 0; index < kNumSlots; ++index) {
+      vector<Entry>& slot = slots_[level][index];
+      for (size_t i = 0; i < slot.size(); ++i) {
+        delete slot[i].task;
+      }
+    }
+  }
+  for (size_t i = 0; i < due_entries_.size(); ++i) {
+    delete due_entries_[i].task;
+  }
+}
+
+void TimerWheelScheduler::Schedule(TimeDelta delay, Closure* runnable) {
+  CHECK(IsCallbackRepeatable(runnable));
+  MutexLock m(&lock_);
+  Time now = is_thread_started_ ? Time::Now() : current_time_;
+  Time due_time = now + delay;
+
+  // A task is due at the first tick at or after its due time, or right away if
+  // the wheel has already passed that time.
+  int64 due_tick = current_tick_;
+  if ((delay > Scheduler::NoDelay()) && (due_time > current_time_)) {
+    int64 due_micros = (due_time - start_time_).InMicroseconds();
+    due_tick = (due_micros + tick_micros_ - 1) / tick_micros_;
+  }
+  AddEntry(Entry(due_tick, next_sequence_number_++, runnable));
+  ++num_pending_tasks_;
+
+  // Wake the thread if it waits for a first task or plans to sleep past the
+  // new one.
+  if ((wakeup_tick_ != kNotWaiting) &&
+      ((num_pending_tasks_ == 1) || (due_tick < wakeup_tick_))) {
+    wakeup_.Signal();
+  }
+}
+
+bool TimerWheelScheduler::IsRunningOnThread() const {
+  MutexLock m(&lock_);
+  if (is_thread_started_) {
+    return pthread_equal(thread_, pthread_self());
+  }
+  return is_running_tasks_ && pthread_equal(running_thread_, pthread_self());
+}
+
+Time TimerWheelScheduler::GetCurrentTime() const {
+  MutexLock m(&lock_);
+  return is_thread_started_ ? Time::Now() : current_time_;
+}
+
+void TimerWheelScheduler::AdvanceTo(Time now) {
+  {
+    MutexLock m(&lock_);
+    CHECK(!is_thread_started_) << "Cannot advance a wheel with a thread";
+  }
+  RunDueTasks(now);
+}
+
+void TimerWheelScheduler::StartThread() {
+  MutexLock m(&lock_);
+  CHECK(!is_thread_started_) << "Thread already started";
+  is_thread_started_ = true;
+  stop_thread_ = false;
+  CHECK(pthread_create(&thread_, NULL, &TimerWheelScheduler::ThreadMain,
+                       this) == 0) << "Could not create the scheduler thread";
+}
+
+void TimerWheelScheduler::StopThread() {
+  CHECK(!IsRunningOnThread()) << "Cannot stop the thread from itself";
+  {
+    MutexLock m(&lock_);
+    if (!is_thread_started_) {
+      return;
+    }
+    stop_thread_ = true;
+    wakeup_.Signal();
+  }
+  pthread_join(thread_, NULL);
+  MutexLock m(&lock_);
+  is_thread_started_ = false;
+  stop_thread_ = false;
+}
+
+int TimerWheelScheduler::num_pending_tasks() const {
+  MutexLock m(&lock_);
+  return num_pending_tasks_;
+}
+
+void TimerWheelScheduler::AddEntry(const Entry& entry) {
+  int64 ticks_ahead = entry.due_tick - current_tick_;
+  if (ticks_ahead <= 0) {
+    due_entries_.push_back(entry);
+    return;
+  }
+
+  // A task due beyond the reach of the wheel goes in the farthest slot, and is
+  // put back when that slot comes round.
+  ticks_ahead = min(ticks_ahead, kMaxTicksAhead);
+  int64 slot_tick = current_tick_ + ticks_ahead;
+  int level = 0;
+  while ((level + 1 < kNumLevels) &&
+         (ticks_ahead >> (kSlotBits * (level + 1)) != 0)) {
+    ++level;
+  }
+  int index = (slot_tick >> (kSlotBits * level)) & kSlotMask;
+  slots_[level][index].push_back(entry);
+  ++level_sizes_[level];
+}
+
+void TimerWheelScheduler::AdvanceTicks(int64 target_tick,
+                                       vector<Closure*>* due_tasks) {
+  TakeDueEntries(due_tasks);
+  while (current_tick_ < target_tick) {
+    // Nothing can come due before the lowest non-empty level next moves a slot
+    // down, so skip the ticks until then.
+    int lowest_level = GetLowestNonEmptyLevel();
+    if (lowest_level == kNumLevels) {
+      current_tick_ = target_tick;
+      return;
+    }
+    if (lowest_level > 0) {
+      current_tick_ = min(target_tick, GetNextCascadeTick(lowest_level) - 1);
+      if (current_tick_ == target_tick) {
+        return;
+      }
+    }
+    ++current_tick_;
+
+    // When a level wraps round, the next slot of each level above it comes up
+    // and is moved down, farthest first.
+    int level = 1;
+    while ((level < kNumLevels) &&
+           ((current_tick_ & ((static_cast<int64>(1) << (kSlotBits * level)) -
+                              1)) == 0)) {
+      ++level;
+    }
+    for (--level; level >= 1; --level) {
+      Cascade(level);
+    }
+
+    vector<Entry>& slot = slots_[0][current_tick_ & kSlotMask];
+    level_sizes_[0] -= slot.size();
+    due_entries_.insert(due_entries_.end(), slot.begin(), slot.end());
+    slot.clear();
+    TakeDueEntries(due_tasks);
+  }
+}
+
+void TimerWheelScheduler::Cascade(int level) {
+  vector<Entry> entries;
+  entries.swap(
+      slots_[level][(current_tick_ >> (kSlotBits * level)) & kSlotMask]);
+  level_sizes_[level] -= entries.size();
+  for (size_t i = 0; i < entries.size(); ++i) {
+    AddEntry(entries[i]);
+  }
+}
+
+void TimerWheelScheduler::TakeDueEntries(vector<Closure*>* due_tasks) {
+  if (due_entries_.empty()) {
+    return;
+  }
+  sort(due_entries_.begin(), due_entries_.end());
+  for (size_t i = 0; i < due_entries_.size(); ++i) {
+    due_tasks->push_back(due_entries_[i].task);
+  }
+  num_pending_tasks_ -= due_entries_.size();
+  due_entries_.clear();
+}
+
+void TimerWheelScheduler::RunDueTasks(Time now) {
+  vector<Closure*> due_tasks;
+  while (true) {
+    {
+      MutexLock m(&lock_);
+      current_time_ = max(current_time_, now);
+      if (!stop_thread_) {
+        AdvanceTicks(GetTickAtOrBefore(current_time_), &due_tasks);
+      }
+      is_running_tasks_ = !due_tasks.empty();
+      if (!is_running_tasks_) {
+        return;
+      }
+      running_thread_ = pthread_self();
+    }
+
+    // Run the tasks without the lock, since they may schedule more.
+    for (size_t i = 0; i < due_tasks.size(); ++i) {
+      due_tasks[i]->Run();
+      delete due_tasks[i];
+    }
+    due_tasks.clear();
+  }
+}
+
+int64 TimerWheelScheduler::GetNextWakeupTick() {
+  int lowest_level = GetLowestNonEmptyLevel();
+  if (lowest_level > 0) {
+    return GetNextCascadeTick(lowest_level);
+  }
+  int64 cascade_tick = GetNextCascadeTick(1);
+  for (int64 tick = current_tick_ + 1; tick < cascade_tick; ++tick) {
+    if (!slots_[0][tick & kSlotMask].empty()) {
+      return tick;
+    }
+  }
+  return cascade_tick;
+}
+
+int TimerWheelScheduler::GetLowestNonEmptyLevel() {
+  int level = 0;
+  while ((level < kNumLevels) && (level_sizes_[level] == 0)) {
+    ++level;
+  }
+  return level;
+}
+
+int64 TimerWheelScheduler::GetNextCascadeTick(int level) {
+  int bits = kSlotBits * level;
+  return ((current_tick_ >> bits) + 1) << bits;
+}
+
+int64 TimerWheelScheduler::GetTickAtOrBefore(Time time) const {
+  return max(static_cast<int64>(0),
+             (time - start_time_).InMicroseconds() / tick_micros_);
+}
+
+void TimerWheelScheduler::RunThread() {
+  while (true) {
+    {
+      MutexLock m(&lock_);
+      if (stop_thread_) {
+        return;
+      }
+      if (due_entries_.empty()) {
+        if (num_pending_tasks_ == 0) {
+          wakeup_tick_ = current_tick_;
+          wakeup_.Wait(&lock_);
+        } else {
+          wakeup_tick_ = GetNextWakeupTick();
+          TimeDelta wait = (start_time_ + TimeDelta::FromMicroseconds(
+              wakeup_tick_ * tick_micros_)) - Time::Now();
+          if (wait > TimeDelta::FromMicroseconds(0)) {
+            wakeup_.WaitWithTimeout(
+                &lock_, (wait.InMicroseconds() + 999) / 1000);
+          }
+        }
+        wakeup_tick_ = kNotWaiting;
+      }
+    }
+    RunDueTasks(Time::Now());
+  }
+}
+
+void* TimerWheelScheduler::ThreadMain(void* scheduler) {
+  static_cast<TimerWheelScheduler*>(scheduler)->RunThread();
+  return NULL;
+}
+
+}  // namespace invalidation
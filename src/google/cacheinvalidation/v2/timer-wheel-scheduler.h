@@ -0,0 +1,222 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Scheduler backed by a hierarchical timing wheel.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_TIMER_WHEEL_SCHEDULER_H_
+#define GOOGLE_CACHEINVALIDATION_V2_TIMER_WHEEL_SCHEDULER_H_
+
+#include <pthread.h>
+
+#include <vector>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/mutex.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
+#include "google/cacheinvalidation/v2/time.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* A scheduler whose tasks are kept in a hierarchical timing wheel, so that
+ * scheduling and expiring a task take constant time whatever the number of
+ * pending tasks. It suits processes hosting many clients (e.g., sharing one
+ * internal scheduler), whose heartbeat, timeout, batching and retry timers
+ * would otherwise churn a heap of tasks.
+ *
+ * Time is divided into ticks of tick_size, and tasks are due at the first tick
+ * that is at least their delay after they were scheduled. The wheel has
+ * kNumLevels levels of kNumSlots slots: level 0 holds the tasks due in the next
+ * kNumSlots ticks, one slot per tick, and each slot of level l holds the tasks
+ * due in a range of kNumSlots^l ticks, which are moved down a level when the
+ * range comes up. Tasks due further than the wheel reaches are moved down when
+ * the last level comes round and put back. Tasks due at the same tick run in
+ * the order in which they were scheduled.
+ *
+ * The wheel is either advanced by the caller with AdvanceTo, which runs the
+ * due tasks on the calling thread, or by its own thread after StartThread.
+ * Tasks may be scheduled from any thread.
+ */
+class TimerWheelScheduler : public Scheduler {
+ public:
+  /* Creates a scheduler with ticks of tick_size whose time starts at
+   * start_time.
+   */
+  TimerWheelScheduler(TimeDelta tick_size, Time start_time);
+
+  /* Stops the thread, if any, and deletes the pending tasks without running
+   * them.
+   */
+  virtual ~TimerWheelScheduler();
+
+  virtual void Schedule(TimeDelta delay, Closure* runnable);
+
+  virtual bool IsRunningOnThread() const;
+
+  /* Returns the time to which the wheel was last advanced, or the real time
+   * (Time::Now()) once the thread is started.
+   */
+  virtual Time GetCurrentTime() const;
+
+  /* Advances the time to now (if it is later than the current time) and runs
+   * the tasks that are then due on the calling thread, including those that
+   * they schedule and that are due as well. IsRunningOnThread() is true for
+   * the tasks. Must not be called once the thread is started.
+   */
+  void AdvanceTo(Time now);
+
+  /* Starts a thread that advances the wheel with the real time and runs the
+   * tasks as they are due. The real time must not be before start_time.
+   */
+  void StartThread();
+
+  /* Stops the thread started by StartThread, if any, waiting for the running
+   * task to finish. Pending tasks stay pending.
+   */
+  void StopThread();
+
+  /* Returns the number of pending tasks. */
+  int num_pending_tasks() const;
+
+  /* Number of bits of the slot index of a level. */
+  static const int kSlotBits = 8;
+
+  /* Number of slots per level. */
+  static const int kNumSlots = 1 << kSlotBits;
+
+  /* Number of levels. The wheel reaches kNumSlots^kNumLevels ticks ahead. */
+  static const int kNumLevels = 4;
+
+ private:
+  /* A pending task. */
+  struct Entry {
+    Entry(int64 due_tick, uint64 sequence_number, Closure* task)
+        : due_tick(due_tick), sequence_number(sequence_number), task(task) {}
+
+    /* Orders entries by sequence number. */
+    bool operator<(const Entry& other) const {
+      return sequence_number < other.sequence_number;
+    }
+
+    /* The tick at which the task is due. */
+    int64 due_tick;
+
+    /* The order in which the task was scheduled. */
+    uint64 sequence_number;
+
+    /* The task to run. Owned. */
+    Closure* task;
+  };
+
+  /* Adds entry to the slot for its due tick, or to the due tasks if it is due
+   * already. Requires that lock_ is held.
+   */
+  void AddEntry(const Entry& entry);
+
+  /* Moves the current time forward to target_tick, appending the tasks that
+   * come due to *due_tasks in the order in which they must run. Requires that
+   * lock_ is held.
+   */
+  void AdvanceTicks(int64 target_tick, vector<Closure*>* due_tasks);
+
+  /* Moves the entries of the slot of level for the current tick down the
+   * wheel. Requires that lock_ is held.
+   */
+  void Cascade(int level);
+
+  /* Appends the tasks of due_entries_ to *due_tasks, in order. Requires that
+   * lock_ is held.
+   */
+  void TakeDueEntries(vector<Closure*>* due_tasks);
+
+  /* Advances to now and runs the due tasks until none are left. */
+  void RunDueTasks(Time now);
+
+  /* Returns the tick at or before which the thread must next run: the first
+   * tick with tasks in level 0 or, if there is none, the next tick at which
+   * the lowest non-empty level moves a slot down. Requires that lock_ is held.
+   */
+  int64 GetNextWakeupTick();
+
+  /* Returns the lowest level with entries, or kNumLevels if there is none.
+   * Requires that lock_ is held.
+   */
+  int GetLowestNonEmptyLevel();
+
+  /* Returns the first tick after the current one at which level moves a slot
+   * down. Requires that lock_ is held.
+   */
+  int64 GetNextCascadeTick(int level);
+
+  /* Returns the largest tick at or before time. */
+  int64 GetTickAtOrBefore(Time time) const;
+
+  /* Body of the thread started by StartThread. */
+  void RunThread();
+
+  /* Trampoline for pthread_create. */
+  static void* ThreadMain(void* scheduler);
+
+  /* The duration of a tick in microseconds. */
+  const int64 tick_micros_;
+
+  /* The time of tick 0. */
+  const Time start_time_;
+
+  /* Lock for the fields below. */
+  mutable Mutex lock_;
+
+  /* Signalled when the thread may need to wake up earlier than planned. */
+  CondVar wakeup_;
+
+  /* The time to which the wheel was last advanced. */
+  Time current_time_;
+
+  /* The last tick that has been processed. */
+  int64 current_tick_;
+
+  /* The slots of the wheel, by level and index. */
+  vector<Entry> slots_[kNumLevels][kNumSlots];
+
+  /* The number of entries in the slots of each level. */
+  int64 level_sizes_[kNumLevels];
+
+  /* Entries that are due but have not yet been taken to be run. */
+  vector<Entry> due_entries_;
+
+  /* The number of tasks in the wheel (including due_entries_). */
+  int num_pending_tasks_;
+
+  /* The sequence number of the next task scheduled. */
+  uint64 next_sequence_number_;
+
+  /* Whether the due tasks are being run by AdvanceTo or the thread, and on
+   * which thread.
+   */
+  bool is_running_tasks_;
+  pthread_t running_thread_;
+
+  /* Whether the thread is started, and whether it must stop. */
+  bool is_thread_started_;
+  bool stop_thread_;
+  pthread_t thread_;
+
+  /* The tick at which the thread plans to wake up, if it is waiting. */
+  int64 wakeup_tick_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_TIMER_WHEEL_SCHEDULER_H_
@@ -0,0 +1,51 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Lightweight tracing of inbound messages through the Ticl.
+
+#include "google/cacheinvalidation/v2/trace.h"
+
+#include <time.h>
+
+namespace invalidation {
+
+Tracer* Tracer::current_tracer_ = NULL;
+
+RingBufferTracer::RingBufferTracer(int log2_capacity)
+    : mask_((static_cast<uint64>(1) << log2_capacity) - 1),
+      num_recorded_(0),
+      spans_(mask_ + 1) {
+  CHECK(log2_capacity >= 0) << "Invalid capacity: " << log2_capacity;
+}
+
+void RingBufferTracer::Record(TracePoint point, uint64 trace_id) {
+  uint64 index = __sync_fetch_and_add(&num_recorded_, 1);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  Span& span = spans_[index & mask_];
+  span.point = point;
+  span.trace_id = trace_id;
+  span.time_ns = static_cast<int64>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+void RingBufferTracer::GetSpans(vector<Span>* spans) {
+  spans->clear();
+  uint64 num_recorded = __sync_fetch_and_add(&num_recorded_, 0);
+  uint64 first = (num_recorded > mask_ + 1) ? num_recorded - (mask_ + 1) : 0;
+  for (uint64 i = first; i < num_recorded; ++i) {
+    spans->push_back(spans_[i & mask_]);
+  }
+}
+
+}  // namespace invalidation
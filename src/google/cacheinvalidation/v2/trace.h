@@ -0,0 +1,127 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Lightweight tracing of inbound messages through the Ticl.
+//
+// Tracing is compiled in only if INVALIDATION_ENABLE_TRACING is defined;
+// otherwise TICL_TRACE expands to nothing. When compiled in, each span costs a
+// load of the installed tracer and, if there is one, a virtual call.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_TRACE_H_
+#define GOOGLE_CACHEINVALIDATION_V2_TRACE_H_
+
+#include <vector>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/types.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* Points at which an inbound message, identified by the trace id assigned
+ * when it is received, is traced.
+ */
+enum TracePoint {
+  /* The network delivered the message (on the network thread). */
+  TRACE_MESSAGE_RECEIVED,
+
+  /* The internal thread started handling the message. */
+  TRACE_MESSAGE_HANDLING_STARTED,
+
+  /* The message was parsed and validated. */
+  TRACE_MESSAGE_VALIDATED,
+
+  /* The invalidations of the message were handed to the listener. */
+  TRACE_INVALIDATIONS_HANDLED,
+
+  /* A listener upcall for the message was scheduled. */
+  TRACE_LISTENER_SCHEDULED,
+
+  /* A listener upcall for the message started (on a listener thread). */
+  TRACE_LISTENER_UPCALL,
+};
+
+/* Receives the trace spans. May be called from any thread, concurrently. */
+class Tracer {
+ public:
+  virtual ~Tracer() {}
+
+  /* Records that the message with trace_id reached point. */
+  virtual void Record(TracePoint point, uint64 trace_id) = 0;
+
+  /* Installs tracer (not owned; NULL to remove) as the tracer of all the
+   * Ticls in the process. Must be called before the Ticls are started.
+   */
+  static void SetTracer(Tracer* tracer) {
+    current_tracer_ = tracer;
+  }
+
+  /* Returns the installed tracer, or NULL. */
+  static Tracer* current_tracer() {
+    return current_tracer_;
+  }
+
+ private:
+  static Tracer* current_tracer_;
+};
+
+/* A tracer that keeps the last spans, with the time at which they were
+ * recorded, in a fixed-size ring buffer. Recording takes no lock.
+ */
+class RingBufferTracer : public Tracer {
+ public:
+  struct Span {
+    TracePoint point;
+    uint64 trace_id;
+
+    /* Monotonic time in nanoseconds. */
+    int64 time_ns;
+  };
+
+  /* Creates a tracer that keeps the last 2^log2_capacity spans. */
+  explicit RingBufferTracer(int log2_capacity);
+
+  virtual void Record(TracePoint point, uint64 trace_id);
+
+  /* Sets spans to the spans kept, oldest first. Spans being recorded
+   * concurrently may be torn, so call when the Ticl is quiet.
+   */
+  void GetSpans(vector<Span>* spans);
+
+ private:
+  /* Size of spans_ minus one, to mask indices. */
+  uint64 mask_;
+
+  /* Number of spans ever recorded. */
+  uint64 num_recorded_;
+
+  vector<Span> spans_;
+};
+
+#ifdef INVALIDATION_ENABLE_TRACING
+#define TICL_TRACE(point, trace_id)                                     \
+  do {                                                                  \
+    Tracer* ticl_trace_tracer = Tracer::current_tracer();               \
+    if (ticl_trace_tracer != NULL) {                                    \
+      ticl_trace_tracer->Record((point), (trace_id));                   \
+    }                                                                   \
+  } while (false)
+#else
+#define TICL_TRACE(point, trace_id) do {} while (false)
+#endif
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_TRACE_H_
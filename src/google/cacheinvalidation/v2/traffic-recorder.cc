@@ -0,0 +1,336 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Recording of the network and storage traffic of a Ticl, for replay.
+
+#include "google/cacheinvalidation/v2/traffic-recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "google/cacheinvalidation/callback.h"
+#include "google/cacheinvalidation/v2/log-macro.h"
+
+namespace invalidation {
+
+// First bytes of a traffic log.
+static const char kLogMagic[] = "TRL1";
+static const size_t kLogMagicSize = 4;
+
+static void AppendVarint(uint64 value, string* buffer) {
+  while (value >= 0x80) {
+    buffer->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  buffer->push_back(static_cast<char>(value));
+}
+
+// Reads a varint at *offset in log into *value and advances *offset past it.
+// Returns false if log ends before the varint does.
+static bool ReadVarint(const string& log, size_t* offset, uint64* value) {
+  *value = 0;
+  for (int shift = 0; (shift < 64) && (*offset < log.size()); shift += 7) {
+    unsigned char byte = static_cast<unsigned char>(log[(*offset)++]);
+    *value |= static_cast<uint64>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void AppendString(const string& value, string* buffer) {
+  AppendVarint(value.size(), buffer);
+  buffer->append(value);
+}
+
+static bool ReadString(const string& log, size_t* offset, string* value) {
+  uint64 size;
+  if (!ReadVarint(log, offset, &size) || (size > log.size() - *offset)) {
+    return false;
+  }
+  value->assign(log, *offset, size);
+  *offset += size;
+  return true;
+}
+
+// Returns the code of status, as recorded in the log.
+static int GetStatusCode(const Status& status) {
+  if (status.IsSuccess()) {
+    return Status::SUCCESS;
+  }
+  return status.IsTransientFailure() ? Status::TRANSIENT_FAILURE :
+      Status::PERMANENT_FAILURE;
+}
+
+// Writes size bytes of data to fd. Returns whether all were written.
+static bool WriteFully(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+TrafficRecorder::TrafficRecorder(const string& path, Scheduler* scheduler,
+                                 Logger* logger)
+    : scheduler_(scheduler), logger_(logger), last_time_us_(0) {
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd_ < 0) {
+    TLOG(logger_, SEVERE, "Could not open traffic log %s: %s", path.c_str(),
+         strerror(errno));
+    return;
+  }
+  buffer_.append(kLogMagic, kLogMagicSize);
+}
+
+TrafficRecorder::~TrafficRecorder() {
+  MutexLock m(&lock_);
+  FlushLocked();
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+void TrafficRecorder::RecordMessage(TrafficRecord::Type type,
+                                    const string& message) {
+  Append(type, 0, string(), message);
+}
+
+void TrafficRecorder::RecordNetworkStatus(bool is_online) {
+  Append(TrafficRecord::NETWORK_STATUS, is_online ? 1 : 0, string(),
+         string());
+}
+
+void TrafficRecorder::RecordStorageOperation(
+    TrafficRecord::Type type, const string& key, int code,
+    const string& value) {
+  Append(type, code, key, value);
+}
+
+void TrafficRecorder::Flush() {
+  MutexLock m(&lock_);
+  FlushLocked();
+}
+
+void TrafficRecorder::Append(TrafficRecord::Type type, int code,
+                             const string& key, const string& value) {
+  int64 time_us = scheduler_->GetCurrentTime().ToInternalValue();
+  MutexLock m(&lock_);
+  if (fd_ < 0) {
+    return;
+  }
+  // Records from different threads may arrive slightly out of time order, so
+  // the difference is signed.
+  int64 delta = time_us - last_time_us_;
+  last_time_us_ = time_us;
+  buffer_.push_back(static_cast<char>(type));
+  AppendVarint((static_cast<uint64>(delta) << 1) ^
+               static_cast<uint64>(delta >> 63), &buffer_);
+  buffer_.push_back(static_cast<char>(code));
+  AppendString(key, &buffer_);
+  AppendString(value, &buffer_);
+  if (buffer_.size() >= kFlushThreshold) {
+    FlushLocked();
+  }
+}
+
+void TrafficRecorder::FlushLocked() {
+  if ((fd_ < 0) || buffer_.empty()) {
+    return;
+  }
+  if (!WriteFully(fd_, buffer_.data(), buffer_.size())) {
+    TLOG(logger_, SEVERE, "Could not write traffic log: %s", strerror(errno));
+  }
+  buffer_.clear();
+}
+
+bool TrafficLogReader::Parse(const string& log,
+                             vector<TrafficRecord>* records) {
+  records->clear();
+  if ((log.size() < kLogMagicSize) ||
+      (log.compare(0, kLogMagicSize, kLogMagic) != 0)) {
+    return false;
+  }
+  size_t offset = kLogMagicSize;
+  int64 time_us = 0;
+  while (offset < log.size()) {
+    TrafficRecord record;
+    record.type = static_cast<TrafficRecord::Type>(log[offset++]);
+    uint64 zigzag_delta;
+    if (!ReadVarint(log, &offset, &zigzag_delta) || (offset >= log.size())) {
+      return false;
+    }
+    time_us += static_cast<int64>(zigzag_delta >> 1) ^
+        -static_cast<int64>(zigzag_delta & 1);
+    record.time_us = time_us;
+    record.code = static_cast<unsigned char>(log[offset++]);
+    if (!ReadString(log, &offset, &record.key) ||
+        !ReadString(log, &offset, &record.value)) {
+      return false;
+    }
+    records->push_back(record);
+  }
+  return true;
+}
+
+bool TrafficLogReader::ReadFile(const string& path,
+                                vector<TrafficRecord>* records) {
+  records->clear();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  string log;
+  char buffer[64 * 1024];
+  ssize_t num_read;
+  while ((num_read = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (num_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      close(fd);
+      return false;
+    }
+    log.append(buffer, num_read);
+  }
+  close(fd);
+  return Parse(log, records);
+}
+
+TrafficRecordingChannel::TrafficRecordingChannel(NetworkChannel* delegate,
+                                                 TrafficRecorder* recorder)
+    : delegate_(delegate), recorder_(recorder) {
+}
+
+TrafficRecordingChannel::~TrafficRecordingChannel() {
+  for (size_t i = 0; i < status_receivers_.size(); ++i) {
+    delete status_receivers_[i];
+  }
+}
+
+void TrafficRecordingChannel::SendMessage(const string& outgoing_message) {
+  recorder_->RecordMessage(TrafficRecord::OUTBOUND_MESSAGE, outgoing_message);
+  delegate_->SendMessage(outgoing_message);
+}
+
+void TrafficRecordingChannel::SendMessage(string* outgoing_message) {
+  recorder_->RecordMessage(TrafficRecord::OUTBOUND_MESSAGE, *outgoing_message);
+  delegate_->SendMessage(outgoing_message);
+}
+
+void TrafficRecordingChannel::SetMessageReceiver(
+    MessageCallback* incoming_receiver) {
+  message_receiver_.reset(incoming_receiver);
+  delegate_->SetMessageReceiver(NewPermanentCallback(
+      this, &TrafficRecordingChannel::HandleInboundMessage));
+}
+
+void TrafficRecordingChannel::SetMessageBufferReceiver(
+    MessageBufferCallback* incoming_receiver) {
+  buffer_receiver_.reset(incoming_receiver);
+  delegate_->SetMessageBufferReceiver(NewPermanentCallback(
+      this, &TrafficRecordingChannel::HandleInboundBuffer));
+}
+
+void TrafficRecordingChannel::AddNetworkStatusReceiver(
+    NetworkStatusCallback* network_status_receiver) {
+  // Listen to the delegate once, so that each change is recorded once
+  // however many receivers there are.
+  if (status_receivers_.empty()) {
+    delegate_->AddNetworkStatusReceiver(NewPermanentCallback(
+        this, &TrafficRecordingChannel::HandleNetworkStatus));
+  }
+  status_receivers_.push_back(network_status_receiver);
+}
+
+void TrafficRecordingChannel::HandleInboundMessage(const string& message) {
+  recorder_->RecordMessage(TrafficRecord::INBOUND_MESSAGE, message);
+  message_receiver_->Run(message);
+}
+
+void TrafficRecordingChannel::HandleInboundBuffer(string* message) {
+  recorder_->RecordMessage(TrafficRecord::INBOUND_MESSAGE, *message);
+  buffer_receiver_->Run(message);
+}
+
+void TrafficRecordingChannel::HandleNetworkStatus(bool status) {
+  recorder_->RecordNetworkStatus(status);
+  for (size_t i = 0; i < status_receivers_.size(); ++i) {
+    status_receivers_[i]->Run(status);
+  }
+}
+
+void TrafficRecordingStorage::WriteKey(const string& key, const string& value,
+                                       WriteKeyCallback* done) {
+  delegate_->WriteKey(key, value, NewPermanentCallback(
+      this, &TrafficRecordingStorage::HandleWriteDone,
+      new PendingOperation(key, done, NULL, NULL)));
+}
+
+void TrafficRecordingStorage::ReadKey(const string& key,
+                                      ReadKeyCallback* done) {
+  delegate_->ReadKey(key, NewPermanentCallback(
+      this, &TrafficRecordingStorage::HandleReadDone,
+      new PendingOperation(key, NULL, done, NULL)));
+}
+
+void TrafficRecordingStorage::DeleteKey(const string& key,
+                                        DeleteKeyCallback* done) {
+  delegate_->DeleteKey(key, NewPermanentCallback(
+      this, &TrafficRecordingStorage::HandleDeleteDone,
+      new PendingOperation(key, NULL, NULL, done)));
+}
+
+void TrafficRecordingStorage::HandleWriteDone(PendingOperation* operation,
+                                              Status status) {
+  recorder_->RecordStorageOperation(TrafficRecord::STORAGE_WRITE,
+                                    operation->key, GetStatusCode(status),
+                                    string());
+  operation->write_done->Run(status);
+  delete operation->write_done;
+  delete operation;
+}
+
+void TrafficRecordingStorage::HandleReadDone(PendingOperation* operation,
+                                             StatusStringPair result) {
+  recorder_->RecordStorageOperation(TrafficRecord::STORAGE_READ,
+                                    operation->key,
+                                    GetStatusCode(result.first),
+                                    result.second);
+  operation->read_done->Run(result);
+  delete operation->read_done;
+  delete operation;
+}
+
+void TrafficRecordingStorage::HandleDeleteDone(PendingOperation* operation,
+                                               bool success) {
+  recorder_->RecordStorageOperation(TrafficRecord::STORAGE_DELETE,
+                                    operation->key, success ? 1 : 0,
+                                    string());
+  operation->delete_done->Run(success);
+  delete operation->delete_done;
+  delete operation;
+}
+
+}  // namespace invalidation
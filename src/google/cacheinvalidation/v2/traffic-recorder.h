@@ -0,0 +1,244 @@
+// Copyright 2011 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Recording of the network and storage traffic of a Ticl, for replay.
+
+#ifndef GOOGLE_CACHEINVALIDATION_V2_TRAFFIC_RECORDER_H_
+#define GOOGLE_CACHEINVALIDATION_V2_TRAFFIC_RECORDER_H_
+
+#include <string>
+#include <vector>
+
+#include "google/cacheinvalidation/stl-namespace.h"
+#include "google/cacheinvalidation/v2/mutex.h"
+#include "google/cacheinvalidation/v2/scoped_ptr.h"
+#include "google/cacheinvalidation/v2/system-resources.h"
+#include "google/cacheinvalidation/v2/types.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+/* One event in a traffic log. */
+struct TrafficRecord {
+  enum Type {
+    /* A message sent by the Ticl; value is the message. */
+    OUTBOUND_MESSAGE = 1,
+
+    /* A message delivered to the Ticl; value is the message. */
+    INBOUND_MESSAGE = 2,
+
+    /* A network status change; code is 1 if connected, 0 if not. */
+    NETWORK_STATUS = 3,
+
+    /* A completed write of key; code is the Status::Code of the result. */
+    STORAGE_WRITE = 4,
+
+    /* A completed read of key; code is the Status::Code of the result and
+     * value the value read.
+     */
+    STORAGE_READ = 5,
+
+    /* A completed deletion of key; code is 1 if it succeeded, 0 if not. */
+    STORAGE_DELETE = 6
+  };
+
+  TrafficRecord() : type(OUTBOUND_MESSAGE), time_us(0), code(0) {}
+
+  Type type;
+
+  /* When the event happened, as Time::ToInternalValue. */
+  int64 time_us;
+
+  int code;
+  string key;
+  string value;
+};
+
+/* Writes a traffic log: a compact binary file of timestamped records, which
+ * TrafficLogReader reads back.
+ *
+ * The file starts with a four-byte magic number, followed by the records.
+ * Each record is its type (one byte), its time as the zigzag-encoded
+ * difference from the previous record's (a varint, in microseconds), its
+ * code (one byte), and its key and value, each a varint length followed by
+ * the bytes. Records are buffered and appended to the file in batches, so a
+ * crash loses at most the last batch and may leave a torn record at the end,
+ * which the reader ignores.
+ *
+ * This class is thread-safe.
+ */
+class TrafficRecorder {
+ public:
+  /* Size of the buffered records at which they are written to the file. */
+  static const size_t kFlushThreshold = 64 * 1024;
+
+  /* Creates a recorder that writes to the file at path, replacing any file
+   * there, and takes the times of the records from scheduler. If the file
+   * cannot be opened, the records are dropped.
+   */
+  TrafficRecorder(const string& path, Scheduler* scheduler, Logger* logger);
+
+  /* Writes the buffered records and closes the file. */
+  ~TrafficRecorder();
+
+  /* Returns whether the file was opened. */
+  bool IsOpen() const {
+    return fd_ >= 0;
+  }
+
+  /* Records a message of type OUTBOUND_MESSAGE or INBOUND_MESSAGE. */
+  void RecordMessage(TrafficRecord::Type type, const string& message);
+
+  /* Records a network status change. */
+  void RecordNetworkStatus(bool is_online);
+
+  /* Records the completion of a storage operation of type STORAGE_WRITE,
+   * STORAGE_READ or STORAGE_DELETE.
+   */
+  void RecordStorageOperation(TrafficRecord::Type type, const string& key,
+                              int code, const string& value);
+
+  /* Writes the buffered records to the file. */
+  void Flush();
+
+ private:
+  /* Appends a record to the buffer, and writes the buffer out if it has
+   * grown past kFlushThreshold.
+   */
+  void Append(TrafficRecord::Type type, int code, const string& key,
+              const string& value);
+
+  /* Writes the buffered records to the file. Requires that lock_ is held. */
+  void FlushLocked();
+
+  Scheduler* scheduler_;
+  Logger* logger_;
+
+  /* Lock for the fields below. */
+  Mutex lock_;
+
+  /* Descriptor of the log file, or -1 if it could not be opened. */
+  int fd_;
+
+  /* Time of the last record, from which the next one's is encoded. */
+  int64 last_time_us_;
+
+  /* Encoded records not yet written to the file. */
+  string buffer_;
+};
+
+/* Reads a traffic log written by a TrafficRecorder. */
+class TrafficLogReader {
+ public:
+  /* Parses log into records. Returns false if log is not a traffic log or
+   * ends in a torn record, in which case records holds the records before
+   * it.
+   */
+  static bool Parse(const string& log, vector<TrafficRecord>* records);
+
+  /* Reads the file at path and parses it into records, as Parse does. */
+  static bool ReadFile(const string& path, vector<TrafficRecord>* records);
+};
+
+/* Network channel that records the messages and network status changes
+ * passing through another channel.
+ */
+class TrafficRecordingChannel : public NetworkChannel {
+ public:
+  /* The caller keeps ownership of delegate and recorder. */
+  TrafficRecordingChannel(NetworkChannel* delegate, TrafficRecorder* recorder);
+
+  virtual ~TrafficRecordingChannel();
+
+  virtual void SendMessage(const string& outgoing_message);
+
+  virtual void SendMessage(string* outgoing_message);
+
+  virtual void SetMessageReceiver(MessageCallback* incoming_receiver);
+
+  virtual void SetMessageBufferReceiver(
+      MessageBufferCallback* incoming_receiver);
+
+  virtual void AddNetworkStatusReceiver(
+      NetworkStatusCallback* network_status_receiver);
+
+ private:
+  void HandleInboundMessage(const string& message);
+
+  void HandleInboundBuffer(string* message);
+
+  /* Records status and passes it on to the status receivers. */
+  void HandleNetworkStatus(bool status);
+
+  NetworkChannel* delegate_;
+  TrafficRecorder* recorder_;
+  scoped_ptr<MessageCallback> message_receiver_;
+  scoped_ptr<MessageBufferCallback> buffer_receiver_;
+
+  /* The receivers given to AddNetworkStatusReceiver. Owned. */
+  vector<NetworkStatusCallback*> status_receivers_;
+};
+
+/* Storage that records the results of the operations on another storage.
+ * Cursors are not offered, so that the Ticl's reads go through ReadKey and
+ * are recorded; ReadAllKeys is passed through without being recorded.
+ */
+class TrafficRecordingStorage : public Storage {
+ public:
+  /* The caller keeps ownership of delegate and recorder. */
+  TrafficRecordingStorage(Storage* delegate, TrafficRecorder* recorder)
+      : delegate_(delegate), recorder_(recorder) {}
+
+  virtual void WriteKey(const string& key, const string& value,
+                        WriteKeyCallback* done);
+
+  virtual void ReadKey(const string& key, ReadKeyCallback* done);
+
+  virtual void DeleteKey(const string& key, DeleteKeyCallback* done);
+
+  virtual void ReadAllKeys(ReadAllKeysCallback* key_callback) {
+    delegate_->ReadAllKeys(key_callback);
+  }
+
+ private:
+  /* An operation waiting for the delegate to complete it. */
+  struct PendingOperation {
+    PendingOperation(const string& key, WriteKeyCallback* write_done,
+                     ReadKeyCallback* read_done,
+                     DeleteKeyCallback* delete_done)
+        : key(key), write_done(write_done), read_done(read_done),
+          delete_done(delete_done) {}
+
+    string key;
+    WriteKeyCallback* write_done;
+    ReadKeyCallback* read_done;
+    DeleteKeyCallback* delete_done;
+  };
+
+  /* Each of these records the result of operation, passes it on to the
+   * caller's callback and deletes operation.
+   */
+  void HandleWriteDone(PendingOperation* operation, Status status);
+  void HandleReadDone(PendingOperation* operation, StatusStringPair result);
+  void HandleDeleteDone(PendingOperation* operation, bool success);
+
+  Storage* delegate_;
+  TrafficRecorder* recorder_;
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_V2_TRAFFIC_RECORDER_H_
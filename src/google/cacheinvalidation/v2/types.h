@@ -19,6 +19,7 @@
 
 #include <string>
 
+#include "google/cacheinvalidation/atomic-ref-count.h"
 #include "google/cacheinvalidation/v2/logging.h"
 #include "google/cacheinvalidation/stl-namespace.h"
 
@@ -173,19 +174,25 @@ class ErrorInfo {
 
 /* A class to represent a unique object id that an application can register or
  * unregister for.
+ *
+ * The object id keeps a 64-bit hash of its source and name, computed once when
+ * it is initialized, for hashed containers (see ObjectIdHash) and quick
+ * comparisons.
  */
 class ObjectId {
  public:
-  ObjectId() : is_initialized_(false) {}
+  ObjectId() : is_initialized_(false), source_(0), hash_(0) {}
 
   /* Creates an object id for the given source and name (the name is copied). */
   ObjectId(int source, const string& name)
-      : is_initialized_(true), source_(source), name_(name) {}
+      : is_initialized_(true), source_(source), name_(name),
+        hash_(ComputeHash(source, name)) {}
 
   void Init(int source, const string& name) {
     is_initialized_ = true;
     source_ = source;
     name_ = name;
+    hash_ = ComputeHash(source, name);
   }
 
   int source() const {
@@ -198,13 +205,30 @@ class ObjectId {
     return name_;
   }
 
+  /* Returns the hash of the source and name (FNV-1a), which is the same in
+   * every process.
+   */
+  uint64 hash() const {
+    CHECK(is_initialized_);
+    return hash_;
+  }
+
   bool operator==(const ObjectId& object_id) const {
     CHECK(is_initialized_);
     CHECK(object_id.is_initialized_);
-    return (source() == object_id.source()) && (name() == object_id.name());
+    return (hash_ == object_id.hash_) && (source_ == object_id.source_) &&
+        (name_ == object_id.name_);
   }
 
  private:
+  static uint64 ComputeHash(int source, const string& name) {
+    uint64 hash = 14695981039346656037ULL ^ static_cast<uint32>(source);
+    for (size_t i = 0; i < name.size(); ++i) {
+      hash = (hash ^ static_cast<unsigned char>(name[i])) * 1099511628211ULL;
+    }
+    return hash;
+  }
+
   /* Whether the object id has been initialized. */
   bool is_initialized_;
 
@@ -213,32 +237,105 @@ class ObjectId {
 
   /* The name/unique id for the object. */
   string name_;
+
+  /* Hash of the source and name. */
+  uint64 hash_;
+};
+
+/* Hash function of object ids for hashed containers, e.g.,
+ * hash_map<ObjectId, T, ObjectIdHash>.
+ */
+struct ObjectIdHash {
+  size_t operator()(const ObjectId& object_id) const {
+    return static_cast<size_t>(object_id.hash());
+  }
+};
+
+/* Ordering of object ids by hash first, for ordered containers, which then
+ * mostly compare integers instead of names. The order is not that of the
+ * names.
+ */
+struct ObjectIdLess {
+  bool operator()(const ObjectId& a, const ObjectId& b) const {
+    if (a.hash() != b.hash()) {
+      return a.hash() < b.hash();
+    }
+    if (a.source() != b.source()) {
+      return a.source() < b.source();
+    }
+    return a.name() < b.name();
+  }
 };
 
 /* A class to represent an invalidation for a given object/version and an
  * optional payload.
+ *
+ * The payload is immutable and shared by the copies of an invalidation, so
+ * that copying one (e.g., into a listener upcall) does not copy its payload.
  */
 class Invalidation {
  public:
-  Invalidation() : is_initialized_(false) {}
+  Invalidation() : is_initialized_(false), payload_buffer_(NULL) {}
 
   /* Creates an invalidation for the given object and version. */
-  Invalidation(const ObjectId& object_id, int64 version) {
+  Invalidation(const ObjectId& object_id, int64 version)
+      : payload_buffer_(NULL) {
     Init(object_id, version);
   }
 
   /* Creates an invalidation for the given object, version, and payload. */
   Invalidation(
-      const ObjectId& object_id, int64 version, const string& payload) {
+      const ObjectId& object_id, int64 version, const string& payload)
+      : payload_buffer_(NULL) {
     Init(object_id, version, payload);
   }
 
+  Invalidation(const Invalidation& invalidation)
+      : is_initialized_(invalidation.is_initialized_),
+        object_id_(invalidation.object_id_),
+        version_(invalidation.version_),
+        has_payload_(invalidation.has_payload_),
+        payload_buffer_(invalidation.payload_buffer_),
+        payload_reference_(invalidation.payload_reference_) {
+    AddPayloadReference();
+  }
+
+  ~Invalidation() {
+    ReleasePayload();
+  }
+
+  Invalidation& operator=(const Invalidation& invalidation) {
+    if (payload_buffer_ != invalidation.payload_buffer_) {
+      ReleasePayload();
+      payload_buffer_ = invalidation.payload_buffer_;
+      AddPayloadReference();
+    }
+    is_initialized_ = invalidation.is_initialized_;
+    object_id_ = invalidation.object_id_;
+    version_ = invalidation.version_;
+    has_payload_ = invalidation.has_payload_;
+    payload_reference_ = invalidation.payload_reference_;
+    return *this;
+  }
+
   void Init(const ObjectId& object_id, int64 version) {
-    Init(object_id, version, false, "");
+    InitWithBuffer(object_id, version, NULL);
   }
 
   void Init(const ObjectId& object_id, int64 version, const string& payload) {
-    Init(object_id, version, true, payload);
+    PayloadBuffer* payload_buffer = new PayloadBuffer();
+    payload_buffer->data = payload;
+    InitWithBuffer(object_id, version, payload_buffer);
+  }
+
+  /* Like Init with a payload, but takes the contents of *payload, which is
+   * left empty, instead of copying them.
+   */
+  void InitTakingPayload(const ObjectId& object_id, int64 version,
+                         string* payload) {
+    PayloadBuffer* payload_buffer = new PayloadBuffer();
+    payload_buffer->data.swap(*payload);
+    InitWithBuffer(object_id, version, payload_buffer);
   }
 
   const ObjectId& object_id() const {
@@ -254,24 +351,78 @@ class Invalidation {
   }
 
   const string& payload() const {
-    return payload_;
+    return (payload_buffer_ == NULL) ? EmptyPayload() : payload_buffer_->data;
+  }
+
+  /* Returns whether the server holds back the payload of the invalidation,
+   * which is then fetched with InvalidationClient::FetchPayload.
+   */
+  bool has_payload_reference() const {
+    return !payload_reference_.empty();
+  }
+
+  const string& payload_reference() const {
+    return payload_reference_;
+  }
+
+  /* Sets the reference to the payload held back by the server. */
+  void set_payload_reference(const string& payload_reference) {
+    payload_reference_ = payload_reference;
   }
 
   bool operator==(const Invalidation& invalidation) const {
     return (object_id() == invalidation.object_id()) &&
         (version() == invalidation.version()) &&
         (has_payload() == invalidation.has_payload()) &&
-        (payload() == invalidation.payload());
+        (payload_reference() == invalidation.payload_reference()) &&
+        ((payload_buffer_ == invalidation.payload_buffer_) ||
+         (payload() == invalidation.payload()));
   }
 
  private:
-  void Init(const ObjectId& object_id, int64 version, bool has_payload,
-            const string& payload) {
+  /* A payload and the number of invalidations that share it. */
+  struct PayloadBuffer {
+    PayloadBuffer() : ref_count(1) {}
+
+    AtomicRefCount ref_count;
+    string data;
+  };
+
+  /* Initializes the invalidation with payload_buffer, whose reference it
+   * takes, or without a payload if payload_buffer is NULL.
+   */
+  void InitWithBuffer(const ObjectId& object_id, int64 version,
+                      PayloadBuffer* payload_buffer) {
     is_initialized_ = true;
     object_id_.Init(object_id.source(), object_id.name());
     version_ = version;
-    has_payload_ = has_payload;
-    payload_ = payload;
+    has_payload_ = (payload_buffer != NULL);
+    ReleasePayload();
+    payload_buffer_ = payload_buffer;
+    payload_reference_.clear();
+  }
+
+  void AddPayloadReference() {
+    if (payload_buffer_ != NULL) {
+      // Copies may be made and deleted on different threads.
+      AtomicRefCountIncrement(&payload_buffer_->ref_count);
+    }
+  }
+
+  /* Drops the reference to the payload buffer, deleting it if it was the
+   * last one.
+   */
+  void ReleasePayload() {
+    if ((payload_buffer_ != NULL) &&
+        !AtomicRefCountDecrement(&payload_buffer_->ref_count)) {
+      delete payload_buffer_;
+    }
+    payload_buffer_ = NULL;
+  }
+
+  static const string& EmptyPayload() {
+    static const string* empty = new string();
+    return *empty;
   }
 
   /* Whether this invalidation has been initialized. */
@@ -286,8 +437,15 @@ class Invalidation {
   /* Whether or not the invalidation includes a payload. */
   bool has_payload_;
 
-  /* Optional payload for the client. */
-  string payload_;
+  /* Optional payload for the client, shared with the copies of this
+   * invalidation; NULL if there is none.
+   */
+  PayloadBuffer* payload_buffer_;
+
+  /* Reference to the payload held back by the server, or empty if there is
+   * none.
+   */
+  string payload_reference_;
 };
 
 /* Information given to about a operation - success, temporary or permanent